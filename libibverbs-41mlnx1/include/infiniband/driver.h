@@ -91,6 +91,22 @@ struct verbs_qp {
 	uint32_t		comp_mask;
 	struct verbs_xrcd       *xrcd;
 };
+/*
+ * Completion channel of a software device (one without a "dev" attribute
+ * in sysfs, opened with cmd_fd -1): the application reads channel.fd as
+ * usual, and the provider writes a struct ibv_comp_event for each event to
+ * event_fd.
+ */
+struct ibv_soft_comp_channel {
+	struct ibv_comp_channel	channel;
+	int			event_fd;
+};
+
+static inline int ibv_soft_channel_fd(struct ibv_comp_channel *channel)
+{
+	return container_of(channel, struct ibv_soft_comp_channel, channel)->event_fd;
+}
+
 typedef struct ibv_device *(*ibv_driver_init_func)(const char *uverbs_sys_path,
 						   int abi_version);
 typedef struct verbs_device *(*verbs_driver_init_func)(const char *uverbs_sys_path,
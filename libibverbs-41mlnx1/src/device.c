@@ -585,6 +585,13 @@ static int __ibv_exp_setenv(struct ibv_context *context,
 		setenv(name, value, overwrite);
 }
 
+static int ibv_device_is_soft(struct ibv_device *device)
+{
+	char value[16];
+
+	return ibv_read_sysfs_file(device->dev_path, "dev", value, sizeof value) < 0;
+}
+
 struct ibv_context *__ibv_open_device(struct ibv_device *device)
 {
 	struct verbs_device *verbs_device = verbs_get_device(device);
@@ -594,6 +601,16 @@ struct ibv_context *__ibv_open_device(struct ibv_device *device)
 	struct verbs_context *context_ex;
 	struct verbs_context_exp *context_exp;
 
+	/*
+	 * A software device (no "dev" attribute in sysfs) has no character
+	 * device: its provider does everything in user space and gets
+	 * cmd_fd -1.
+	 */
+	if (ibv_device_is_soft(device)) {
+		cmd_fd = -1;
+		goto open_context;
+	}
+
 	if (asprintf(&devpath, "/dev/infiniband/%s", device->dev_name) < 0)
 		return NULL;
 
@@ -607,6 +624,8 @@ struct ibv_context *__ibv_open_device(struct ibv_device *device)
 	if (cmd_fd < 0)
 		return NULL;
 
+open_context:
+
 	if (!verbs_device) {
 		context = device->ops.alloc_context(device, cmd_fd);
 		if (!context)
@@ -707,7 +726,8 @@ struct ibv_context *__ibv_open_device(struct ibv_device *device)
 verbs_err:
 	free(context_exp);
 err:
-	close(cmd_fd);
+	if (cmd_fd >= 0)
+		close(cmd_fd);
 	return NULL;
 }
 default_symver(__ibv_open_device, ibv_open_device);
@@ -752,7 +772,8 @@ int __ibv_close_device(struct ibv_context *context)
 	}
 
 	close(async_fd);
-	close(cmd_fd);
+	if (cmd_fd >= 0)
+		close(cmd_fd);
 	put_device(device);
 
 	return 0;
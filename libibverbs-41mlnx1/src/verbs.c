@@ -39,6 +39,7 @@
 #include <netinet/in.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <sys/socket.h>
 #include <errno.h>
 #include <string.h>
 #include <search.h>
@@ -424,6 +425,33 @@ static struct ibv_comp_channel *ibv_create_comp_channel_v2(struct ibv_context *c
 	return NULL;
 }
 
+/*
+ * A software device has no kernel to create event files: its completion
+ * channels are socket pairs, the provider writing the events to the
+ * other end (ibv_soft_channel_fd()).
+ */
+static struct ibv_comp_channel *ibv_create_soft_comp_channel(struct ibv_context *context)
+{
+	struct ibv_soft_comp_channel *soft;
+	int sv[2];
+
+	soft = malloc(sizeof *soft);
+	if (!soft)
+		return NULL;
+
+	if (socketpair(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0, sv)) {
+		free(soft);
+		return NULL;
+	}
+
+	soft->channel.context = context;
+	soft->channel.fd      = sv[0];
+	soft->channel.refcnt  = 0;
+	soft->event_fd        = sv[1];
+
+	return &soft->channel;
+}
+
 struct ibv_comp_channel *ibv_create_comp_channel(struct ibv_context *context)
 {
 	struct ibv_comp_channel            *channel;
@@ -433,6 +461,9 @@ struct ibv_comp_channel *ibv_create_comp_channel(struct ibv_context *context)
 	if (abi_ver <= 2)
 		return ibv_create_comp_channel_v2(context);
 
+	if (context->cmd_fd < 0)
+		return ibv_create_soft_comp_channel(context);
+
 	channel = malloc(sizeof *channel);
 	if (!channel)
 		return NULL;
@@ -478,7 +509,12 @@ int ibv_destroy_comp_channel(struct ibv_comp_channel *channel)
 	}
 
 	close(channel->fd);
-	free(channel);
+	if (context->cmd_fd < 0) {
+		close(ibv_soft_channel_fd(channel));
+		free(container_of(channel, struct ibv_soft_comp_channel, channel));
+	} else {
+		free(channel);
+	}
 	ret = 0;
 
 out:
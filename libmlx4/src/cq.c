@@ -41,6 +41,7 @@
 #include <pthread.h>
 #include <netinet/in.h>
 #include <string.h>
+#include <errno.h>
 
 #include <infiniband/opcode.h>
 
@@ -48,6 +49,7 @@
 #include "doorbell.h"
 ////
 #include "wqe.h"
+#include "split_pool.h"
 typedef unsigned long long cycles_t;
 static inline cycles_t get_cycles()
 {
@@ -76,11 +78,15 @@ enum {
 	CQ_EMPTY				= -1,
 	CQ_POLL_ERR				= -2,
 	////
-	CQ_SPLIT				= 1,
-	CQ_SPLIT_WIMM			= 2
+	CQ_SPLIT				= 1,	// the head of a split message (split_imm.h)
+	CQ_SPLIT_HOLD			= 2	// a receive behind a held head of its QP
 	////
 };
 
+//// a receive completion of a QP with completions held behind a split head
+//// waits behind them, so the QP's receives stay in order (mlx4_poll_cq)
+#define MLX4_RECV_DONE(qp)	((qp) && (qp)->split_nheld ? CQ_SPLIT_HOLD : CQ_OK)
+
 #define MLX4_CQ_DB_REQ_NOT_SOL			(1 << 24)
 #define MLX4_CQ_DB_REQ_NOT			(2 << 24)
 
@@ -535,12 +541,11 @@ static int __mlx4_poll_one(struct mlx4_cq *cq,
 static int mlx4_poll_one(struct mlx4_cq *cq,
 			 struct mlx4_qp **cur_qp,
 			 struct ibv_exp_wc *wc,
-			 uint32_t wc_size, int is_exp, struct mlx4_wqe_data_seg **scat)
+			 uint32_t wc_size, int is_exp, struct ibv_sge *scat, int *nscat)
 {
 	//printf("DEBUG mlx4_poll_one: enter\n");
 	////
 	int split_flag = 0;
-	int wimm_flag = 0;
 	////
 	struct mlx4_wq *wq;
 	struct mlx4_cqe *cqe;
@@ -670,7 +675,7 @@ static int mlx4_poll_one(struct mlx4_cq *cq,
 		//printf("IS ERROR??????????????\n");
 		mlx4_handle_error_cqe((struct mlx4_err_cqe *)cqe,
 				      (struct ibv_wc *)wc);
-		return CQ_OK;
+		return is_send ? CQ_OK : MLX4_RECV_DONE(*cur_qp);
 	}
 
 	wc->status = IBV_WC_SUCCESS;
@@ -748,18 +753,6 @@ static int mlx4_poll_one(struct mlx4_cq *cq,
 	} else {
 		wc->byte_len = ntohl(cqe->byte_cnt);
 		//printf("DEBUG: mlx4_poll_one: wc->byte_len: %u\n", wc->byte_len);
-		//// Instead of checking the chunk size, always assume it is going to be split, and get the message from Split QP unless the msg is too small
-		//if (wc->byte_len > cq->split_chunk_size) {
-		if (wc->byte_len >= MIN_SPLIT_CHUNK_SIZE) {
-			//// get receive request corresponding to this wc
-			if (scat != NULL) {
-				*scat = (struct mlx4_wqe_data_seg *)mlx4_get_recv_wqe(*cur_qp, wqe_index);
-				//printf("DEBUG: get RR: scat->addr: %" PRIu64 "\n", ntohll((*scat)->addr));
-				//printf("DEBUG: get RR: scat->lkey: %" PRIu32 "\n", ntohl((*scat)->lkey));
-			}
-			split_flag = 1;
-		}
-		////
 		if ((*cur_qp) && (*cur_qp)->max_inlr_sg &&
 		    (cqe->owner_sr_opcode & MLX4_CQE_INL_SCATTER_MASK)) {
 			//printf("DEBUG: POLL CQ: inline?\n");
@@ -776,7 +769,7 @@ static int mlx4_poll_one(struct mlx4_cq *cq,
 			}
 			if (left) {
 				wc->status = IBV_WC_LOC_LEN_ERR;
-				return CQ_OK;
+				return MLX4_RECV_DONE(*cur_qp);
 			}
 		}
 
@@ -790,11 +783,6 @@ static int mlx4_poll_one(struct mlx4_cq *cq,
 			wc_flags = IBV_WC_WITH_IMM;
 			wc->imm_data = cqe->immed_rss_invalid;
 			//printf("DEBUG POLL CQ: ntohl(cqe->immed_rss_invalid): %d\n", ntohl(cqe->immed_rss_invalid));
-			//// WIMM hack
-			if (split_flag) {
-				wimm_flag = 1;
-			}
-			////
 			break;
 		case MLX4_RECV_OPCODE_SEND_INVAL:
 			((struct ibv_wc *)wc)->opcode   = IBV_WC_RECV;
@@ -866,6 +854,23 @@ static int mlx4_poll_one(struct mlx4_cq *cq,
 		////
 		}
 
+		//// the head of a split message, marked by its immediate (split_imm.h).
+		//// Copy its RR's scatter list now, the RQ slot is free from here on
+		if ((wc_flags & IBV_WC_WITH_IMM) && SPLIT_IMM_IS_HEAD(wc->imm_data) &&
+		    wc->byte_len == SPLIT_IMM_BUF && !srq && (*cur_qp)->split_imm.pool) {
+			struct mlx4_wqe_data_seg *seg = mlx4_get_recv_wqe(*cur_qp, wqe_index);
+
+			for (i = 0; i < (*cur_qp)->rq.max_gs && i < SPLIT_IMM_MAX_SGE &&
+				    seg[i].lkey != htonl(MLX4_INVALID_LKEY); i++) {
+				scat[i].addr = ntohll(seg[i].addr);
+				scat[i].length = ntohl(seg[i].byte_count);
+				scat[i].lkey = ntohl(seg[i].lkey);
+			}
+			*nscat = i;
+			split_flag = 1;
+		}
+		////
+
 		if (!timestamp_en) {
 			exp_wc_flags |= IBV_EXP_WC_WITH_SLID;
 			wc->slid = ntohs(cqe->rlid);
@@ -931,11 +936,6 @@ static int mlx4_poll_one(struct mlx4_cq *cq,
 	((struct ibv_wc *)wc)->wc_flags = wc_flags;
 	//printf("DEBUG POLL ONE: actually hit end\n");
 
-	//// WIMM hack
-	if (wimm_flag) {
-		return CQ_SPLIT_WIMM;
-	}
-	////
 #ifdef DRIVER_MEASURE_LAT
 	//// TIMESTAMP
 	if (cq->wr_timestamps != NULL) {
@@ -943,11 +943,9 @@ static int mlx4_poll_one(struct mlx4_cq *cq,
 		//printf("cycles = %llu\n", cycles_elapsed);
 		int lat = round(cycles_elapsed / cq->cpu_mhz * 1000);	// latency in nanosec
 		printf("lat = %.2f\n", (double)lat/1000);
-#ifdef DRIVER_USE_CMH
-		if (CMH_Update(cq->cmh, lat)) {
-			fprintf(stderr, "CHM_update failed\n");	
-			return CQ_OK;
-		}
+#ifdef DRIVER_USE_LATQ
+		if (cq->lat_hist)
+			latq_update(cq->lat_hist, lat);
 #endif
 	}
 	////
@@ -957,7 +955,7 @@ static int mlx4_poll_one(struct mlx4_cq *cq,
 		// generate a CQ_SPLIT return val	
 		return CQ_SPLIT;
 	}
-	return CQ_OK;
+	return is_send ? CQ_OK : MLX4_RECV_DONE(*cur_qp);
 }
 
 static void mlx4_stall_poll_cq()
@@ -1004,12 +1002,133 @@ int __mlx4_poll_cq(struct ibv_cq *ibcq, int ne, struct ibv_exp_wc *wc,
 	return err == CQ_POLL_ERR ? err : npolled;
 }
 
+//// Completions held back behind split heads (split_imm.h). A head is held
+//// until its tail has landed; receives of its QP polled after it are held
+//// behind it, so the QP's receives stay in order. Everything else, other
+//// QPs' receives and all sends, goes out as it is polled.
+struct mlx4_split_held {
+	struct mlx4_qp		*qp;
+	int			head;		// its tail is not all in yet
+	int			nscat;
+	struct ibv_sge		scat[SPLIT_IMM_MAX_SGE];
+	struct ibv_exp_wc	wc;
+};
+
+//// hold the completion just polled into wc; cq->lock held
+static int split_hold(struct mlx4_cq *cq, struct mlx4_qp *qp, int head, const struct ibv_exp_wc *wc,
+		      uint32_t wc_size, const struct ibv_sge *scat, int nscat)
+{
+	struct mlx4_split_held *h;
+	int max;
+
+	if (cq->split_nheld == cq->split_held_max) {
+		max = cq->split_held_max ? 2 * cq->split_held_max : 16;
+		h = realloc(cq->split_held, max * sizeof(*h));
+		if (!h)
+			return ENOMEM;
+		cq->split_held = h;
+		cq->split_held_max = max;
+	}
+	h = &cq->split_held[cq->split_nheld++];
+	h->qp = qp;
+	h->head = head;
+	h->nscat = head ? nscat : 0;
+	memcpy(h->scat, scat, h->nscat * sizeof(*scat));
+	memcpy(&h->wc, wc, wc_size < sizeof(h->wc) ? wc_size : sizeof(h->wc));
+	qp->split_nheld++;
+	return 0;
+}
+
+//// the oldest held head of each QP takes what has landed of its tail;
+//// returns how many heads still wait. cq->lock held
+static int split_held_progress(struct mlx4_cq *cq)
+{
+	struct mlx4_split_held *h, *o;
+	struct split_imm_msg msg;
+	struct ibv_wc *wc;
+	int waiting = 0, ret;
+
+	for (h = cq->split_held; h < cq->split_held + cq->split_nheld; h++) {
+		if (!h->head)
+			continue;
+		for (o = cq->split_held; o < h && !(o->head && o->qp == h->qp); o++)
+			;
+		if (o < h) {
+			waiting++;
+			continue;
+		}
+		wc = (struct ibv_wc *)&h->wc;
+		ret = split_imm_recv(&mlx4_split_imm_ops, h->qp, &h->qp->split_imm, wc->imm_data,
+				     wc->opcode == IBV_WC_RECV_RDMA_WITH_IMM, h->scat, h->nscat, 0, &msg);
+		if (ret == EAGAIN) {
+			waiting++;
+			continue;
+		}
+		h->head = 0;
+		if (ret && ret != ENOSPC) {
+			fprintf(stderr, "split receive failed: %s\n", strerror(ret));
+			wc->status = IBV_WC_GENERAL_ERR;
+			continue;
+		}
+		wc->status = ret ? IBV_WC_LOC_LEN_ERR : IBV_WC_SUCCESS;
+		wc->byte_len = msg.byte_len;
+		wc->imm_data = msg.imm;
+		if (!msg.with_imm) {
+			wc->wc_flags &= ~IBV_WC_WITH_IMM;
+			h->wc.exp_wc_flags &= ~(uint64_t)IBV_EXP_WC_WITH_IMM;
+		}
+	}
+	return waiting;
+}
+
+//// hand out up to ne held completions, oldest first, except those behind a
+//// held head of their own QP. cq->lock held
+static int split_held_deliver(struct mlx4_cq *cq, struct ibv_exp_wc *wc, int ne, uint32_t wc_size)
+{
+	struct mlx4_split_held *h, *o;
+	int i, kept = 0, n = 0;
+
+	for (i = 0; i < cq->split_nheld; i++) {
+		h = &cq->split_held[i];
+		for (o = cq->split_held; o < cq->split_held + kept && o->qp != h->qp; o++)
+			;
+		if (n < ne && !h->head && o == cq->split_held + kept) {
+			memcpy((void *)wc + n++ * wc_size, &h->wc, wc_size);
+			h->qp->split_nheld--;
+		} else if (kept++ != i) {
+			cq->split_held[kept - 1] = *h;
+		}
+	}
+	cq->split_nheld = kept;
+	return n;
+}
+
+//// drop what is held for qpn, whose QP is reset or destroyed. cq->lock held
+static void split_held_clean(struct mlx4_cq *cq, uint32_t qpn)
+{
+	int i, kept = 0;
+
+	for (i = 0; i < cq->split_nheld; i++) {
+		if (cq->split_held[i].qp->verbs_qp.qp.qp_num == qpn) {
+			cq->split_held[i].qp->split_nheld--;
+			cq->split_held[i].qp->split_imm.rx_busy = 0;
+		} else if (kept++ != i) {
+			cq->split_held[kept - 1] = cq->split_held[i];
+		}
+	}
+	cq->split_nheld = kept;
+}
+
 int mlx4_poll_cq(struct ibv_cq *ibcq, int ne, struct ibv_exp_wc *wc,
 		 uint32_t wc_size, int is_exp)
 {
 	struct mlx4_cq *cq = to_mcq(ibcq);
 	struct mlx4_qp *qp = NULL;
-	int npolled;
+	struct ibv_sge scat[SPLIT_IMM_MAX_SGE];
+	int nscat = 0;
+	int npolled = 0;
+	int consumed = 0;
+	int held = 0;
 	int err = CQ_OK;
 
 	if (unlikely(cq->stall_next_poll)) {
@@ -1017,304 +1136,40 @@ int mlx4_poll_cq(struct ibv_cq *ibcq, int ne, struct ibv_exp_wc *wc,
 		mlx4_stall_poll_cq();
 	}
 	mlx4_lock(&cq->lock);
-	struct mlx4_wqe_data_seg *scat = NULL;
-	for (npolled = 0; npolled < ne; ++npolled) {
+	//// what was held back goes first, as far as the tails have landed
+	if (unlikely(cq->split_nheld)) {
+		split_held_progress(cq);
+		npolled = split_held_deliver(cq, wc, ne, wc_size);
+	}
+	while (npolled < ne) {
 		err = mlx4_poll_one(cq, &qp, ((void *)wc) + npolled * wc_size,
-				    wc_size, is_exp, &scat);
-		//if (unlikely(err != CQ_OK && err != CQ_SPLIT))
-		//if (err == CQ_SPLIT) {
-		//	printf("DEBUG mlx4_poll_cq: wc->qp_num: %#06x\n", wc->qp_num);
-		//}
-		if (unlikely(err != CQ_OK)) {
+				    wc_size, is_exp, scat, &nscat);
+		if (likely(err == CQ_OK)) {
+			++npolled;
+			consumed = 1;
+			continue;
+		}
+		if (err != CQ_SPLIT && err != CQ_SPLIT_HOLD)
+			break;
+		consumed = 1;
+		if (split_hold(cq, qp, err == CQ_SPLIT, ((void *)wc) + npolled * wc_size,
+			       wc_size, scat, nscat)) {
+			err = CQ_POLL_ERR;
 			break;
 		}
+		held = 1;
+		err = CQ_OK;
 	}
-	//printf("DEBUG mlx4_poll_cq: err:%d\n", err);
-	//printf("DEBUG mlx4_poll_cq: npolled:%d\n", npolled);
 
-	//if (scat != NULL) {printf("DDD SEG1: scat is not NULL.\n");}
-	if (likely(npolled || err == CQ_POLL_ERR || err == CQ_SPLIT || err == CQ_SPLIT_WIMM))
+	if (likely(consumed || err == CQ_POLL_ERR))
 		mlx4_update_cons_index(cq);
-	
-	//if (scat != NULL) {printf("DDD SEG2: scat is not NULL.\n");}
-	long total_bytes_recvd = 0;
-	if (err == CQ_SPLIT) {
-		// <1> poll from split_qp to get sender's INFO message
-		////
-		/*
-		struct ibv_qp_attr attr0;
-		struct ibv_qp_init_attr init_attr0;
-		if (ibv_query_qp(qp->split_qp, &attr0, IBV_QP_STATE, &init_attr0)) {
-			fprintf(stderr, "Failed to query QP state\n");
-			return -1;
-		}
-		printf("DEBUG poll_cq dest qpn CHECK: split_qp's dest_qp_num: %#06x\n", attr0.dest_qp_num);
-		printf("SPLIT QP local QPN: %#06x\n", qp->split_qp->qp_num);
-		*/
-		////
-
-		printf("RECEIVER <1> poll from split_qp to get sender's INFO message\n");
-		fflush(stdout);
-
-		//struct mlx4_qp *split_qp = NULL;
-		struct ibv_exp_wc split_wc;
-		uint32_t num_chunks_to_recv;
-		uint32_t split_chunk_size;
-
-		int ne2;
-		struct ibv_cq *ev_cq;
-		void *ev_ctx;
-		if (SPLIT_USE_EVENT) {
-			if (ibv_get_cq_event(qp->split_comp_recv_channel, &ev_cq, &ev_ctx)) {
-				fprintf(stderr, "Failed to get CQ event.\n");
-				return CQ_POLL_ERR;
-			}
-
-			ibv_ack_cq_events(ev_cq, 1);
-
-			if (ibv_req_notify_cq(ev_cq, 0)) {
-				fprintf(stderr, "Couldn't request CQ notification\n");
-				return CQ_POLL_ERR;
-			}
-		}
-		do {
-			ne2 = __mlx4_poll_cq(qp->split_recv_cq, 1, &split_wc, wc_size, is_exp);
-		} while (ne2 == 0);
-
-		// <2> cache num_chunks_split from the received message
-		printf("RECEIVER <2> cache updated chunks_size & num_chunks_split from the received message\n");
-		fflush(stdout);
-		if (qp->split_fc_msg[0].type == INFO) {
-			printf("DEBUG: mlx4_poll_cq: Received INFO msg\n");
-			fflush(stdout);
-		} else {
-			printf("NOT INFO!\n");
-			fflush(stdout);
-			return -1;
-		}
-
-		num_chunks_to_recv = qp->split_fc_msg[0].msg.split_chunk_info.num_split_chunks;
-		split_chunk_size = qp->split_fc_msg[0].msg.split_chunk_info.current_chunk_size;
-		//cq->split_chunk_size = split_chunk_size;	
-
-		printf("DEBUG: mlx4_poll_cq: updated chunk size = %" PRIu32 "\n", split_chunk_size);
-		printf("DEBUG: mlx4_poll_cq: num_chunks_to_recv = %" PRIu32 "\n", num_chunks_to_recv);
-		fflush(stdout);
-
-		//printf("DEBUG: mlx4_poll_cq: split_FC_msg.msg.num_split_chunks = %d\n", qp->split_fc_msg[0].msg.num_split_chunks);
-		//printf("DEBUG: mlx4_poll_cq: num_chunks_to_recv = %d\n", num_chunks_to_recv);
-
-		// <3> post corresponding number of RRs to split_qp
-		printf("RECEIVER <3> post corresponding number of RRs to split_qp\n");
-		fflush(stdout);
-		
-		struct ibv_sge rsge;
-		struct ibv_recv_wr rwr;
-		struct ibv_recv_wr *bad_rwr;
-
-		memset(&rsge, 0, sizeof(rsge));
-		rsge.addr = (uintptr_t)ntohll(scat->addr);		// base addr
-		rsge.length = split_chunk_size;
-		rsge.lkey = ntohl(scat->lkey); 
-		
-		//printf("DEBUG: print scat: rsge.addr: %" PRIu64 "\n", rsge.addr);
-		//printf("DEBUG: print scat: rsge.lkey: %" PRIu32 "\n", rsge.lkey);
-
-		memset(&rwr, 0, sizeof(rwr));
-		rwr.wr_id = 0;
-		rwr.next = NULL;
-		rwr.sg_list = &rsge;
-		rwr.num_sge = 1;
-
-		int i;
-		int ret;
-		//printf("DEBUG mlx4_poll_cq: num_chunks_to_recv = %d\n", num_chunks_to_recv);
-
-		// NOTE: num_chunks_to_recv can be 0. In such case, no RR is posted.
-		for (i = 0; i < num_chunks_to_recv; i++) {
-			rsge.addr += split_chunk_size;		// relevant for SEND, DC for WIMM
-
-			ret = mlx4_post_recv(qp->split_qp[0], &rwr, &bad_rwr);
-			if (ret != 0) {
-				errno = ret;
-				fprintf(stderr, "mlx4_post_recv REALLY BAD!!, errno = %d\n", errno);
-			}
-			
-		}
-		//printf("Posted %d recv requests\n", num_chunks_to_recv);
-
-		// <4> post another RR for future splitting
-		printf("RECEIVER <4> post another RR for future splitting\n");
-		fflush(stdout);
-		memset(&rsge, 0, sizeof(rsge));
-		rsge.addr = (uintptr_t)&qp->split_fc_msg[0];
-		rsge.length = sizeof(struct Split_FC_message);
-		rsge.lkey = qp->split_fc_mr->lkey;
-
-		memset(&rwr, 0, sizeof(rwr));
-		rwr.wr_id = 0;
-		rwr.next = NULL;
-		rwr.sg_list = &rsge;
-		rwr.num_sge = 1;
-
-		ret = mlx4_post_recv(qp->split_qp[0], &rwr, &bad_rwr);
-		if (ret != 0) {
-			errno = ret;
-			fprintf(stderr, "mlx4_post_recv REALLY BAD!!, errno = %d\n", errno);
-		}
-
-		// <5> send ACK back to sender using split_qp, and poll its wc
-		printf("RECEIVER <5> send ACK back to sender using split_qp, and poll its wc\n");
-		fflush(stdout);
-		if (num_chunks_to_recv > 0) {
-
-			//printf("DEBUG5: mlx4_poll_cq: split_fc_msg.msg.num_split_chunks = %d\n", qp->split_fc_msg[0].msg.num_split_chunks);
-			qp->split_fc_msg[3].type = ACK;
-			struct ibv_sge ssge;
-			struct ibv_send_wr swr;
-			struct ibv_send_wr *bad_swr;
-
-			memset(&ssge, 0, sizeof(ssge));
-			ssge.addr	  = (uintptr_t)&qp->split_fc_msg[3];
-			ssge.length = sizeof(struct Split_FC_message);
-			ssge.lkey	  = qp->split_fc_mr->lkey;
-
-			//printf("DDDDD: ssge.addr = %" PRIu64 "\n", ssge.addr);
-			//printf("DDDDD: ssge.length = %d \n", ssge.length);
-			//printf("DDDDD: ssge.lkey = %" PRIu32 "\n", ssge.lkey);
-				
-			memset(&swr, 0, sizeof(swr));
-			swr.wr_id      = 0;
-			swr.sg_list    = &ssge;
-			swr.num_sge    = 1;
-			swr.opcode     = IBV_WR_SEND;
-			swr.send_flags = IBV_SEND_SIGNALED;
-
-			//__mlx4_post_send(qp->split_qp, &swr, &bad_swr);
-			ret = __mlx4_post_send(qp->split_qp2, &swr, &bad_swr);
-			if (ret != 0) {
-				errno = ret;
-				fprintf(stderr, "mlx4_post_recv REALLY BAD!!, errno = %d\n", errno);
-			}
-			printf("ACK msg posted\n");
-			fflush(stdout);
-
-			if (SPLIT_USE_EVENT) {
-				if (ibv_get_cq_event(qp->split_comp_channel2, &ev_cq, &ev_ctx)) {
-					fprintf(stderr, "Failed to get CQ event.\n");
-					return CQ_POLL_ERR;
-				}
-
-				ibv_ack_cq_events(ev_cq, 1);
-
-				if (ibv_req_notify_cq(ev_cq, 0)) {
-					fprintf(stderr, "Couldn't request CQ notification\n");
-					return CQ_POLL_ERR;
-				}
-			}
-			do {
-				ne2 = __mlx4_poll_cq(qp->split_cq2, 1, &split_wc, wc_size, is_exp);
-			} while (ne2 == 0);
-		}
-
-		// <6> poll from split_qp, and keep counting successful wc until all chunks are polled
-		printf("RECEIVER <6> poll from split_qp, and keep counting successful wc until all chunks are polled\n");
-		fflush(stdout);
-		//total_bytes_recvd = split_chunk_size + 1;
-		total_bytes_recvd += wc->byte_len;
-
-		////
-		if (num_chunks_to_recv > 0) {	// check if there is a need to poll
-			int ret_ne = 0;
-			ne2 = 0;
-			if (SPLIT_USE_EVENT) {
-				if (ibv_get_cq_event(qp->split_comp_recv_channel, &ev_cq, &ev_ctx)) {
-					fprintf(stderr, "Failed to get CQ event.\n");
-					return CQ_POLL_ERR;
-				}
-
-				ibv_ack_cq_events(ev_cq, 1);
 
-				
-				if (ibv_req_notify_cq(ev_cq, 0)) {
-					fprintf(stderr, "Couldn't request CQ notification\n");
-					return CQ_POLL_ERR;
-				}
-			}
-			while (ne2 < num_chunks_to_recv) {
-				do {
-					ret_ne = __mlx4_poll_cq(qp->split_recv_cq, 1, &split_wc, wc_size, is_exp);
-				} while (ret_ne == 0);
-				++ne2;	
-				total_bytes_recvd += split_wc.byte_len;
-				//printf("ne2 = %d, byte_len: %d\n", ne2, split_wc.byte_len);
-			}
-			////
-		}
-
-		//// increment npolled;
-		++npolled;
-	} else if (err == CQ_SPLIT_WIMM) {
-		//printf("INDEED WIMM, USER received %d bytes\n", wc->byte_len);
-
-		struct ibv_sge rsge;
-		struct ibv_recv_wr rwr;
-		struct ibv_recv_wr *bad_rwr;
-		memset(&rsge, 0, sizeof(rsge));
-		rsge.addr = (uintptr_t)&qp->split_fc_msg[0];
-		rsge.length = sizeof(struct Split_FC_message);
-		rsge.lkey = qp->split_fc_mr->lkey;
-
-		memset(&rwr, 0, sizeof(rwr));
-		rwr.wr_id = 0;
-		rwr.next = NULL;
-		rwr.sg_list = &rsge;
-		rwr.num_sge = 1;
-
-		int ret = mlx4_post_recv(qp->split_qp[0], &rwr, &bad_rwr);
-		if (ret != 0) {
-			errno = ret;
-			fprintf(stderr, "mlx4_post_recv REALLY BAD!!, errno = %d\n", errno);
-		}
-
-		//// poll split_qp for the (N-1)th chunk sent via WIMM
-		int ne2;
-		struct ibv_cq *ev_cq;
-		void *ev_ctx;
-		struct ibv_exp_wc split_wc;
-		if (SPLIT_USE_EVENT) {
-			if (ibv_get_cq_event(qp->split_comp_recv_channel, &ev_cq, &ev_ctx)) {
-				fprintf(stderr, "Failed to get CQ event.\n");
-				return CQ_POLL_ERR;
-			}
-
-			ibv_ack_cq_events(ev_cq, 1);
-
-			if (ibv_req_notify_cq(ev_cq, 0)) {
-				fprintf(stderr, "Couldn't request CQ notification\n");
-				return CQ_POLL_ERR;
-			}
-		}
-		do {
-			ne2 = __mlx4_poll_cq(qp->split_recv_cq, 1, &split_wc, wc_size, is_exp);
-		} while (ne2 == 0);
-
-		//printf("GET WIMM chunk from split cq; recv byte = %d\n", split_wc.byte_len);
-		fflush(stdout);
-
-		//// increment npolled;
-		++npolled;
-	}
-
-	//// make byte_len look real
-	if (err == CQ_SPLIT) {
-		err = CQ_OK;
-	    wc->byte_len = total_bytes_recvd;
-	} else if (err == CQ_SPLIT_WIMM) {
-		err = CQ_OK;
-		//TODO: fix length later
+	//// the tail usually went ahead of its head, so a new head may be done
+	if (held && npolled < ne && err != CQ_POLL_ERR) {
+		split_held_progress(cq);
+		npolled += split_held_deliver(cq, ((void *)wc) + npolled * wc_size,
+					      ne - npolled, wc_size);
 	}
-	////
 
 	mlx4_unlock(&cq->lock);
 	//printf("PUPU2\n");
@@ -1339,6 +1194,25 @@ int mlx4_poll_ibv_cq(struct ibv_cq *ibcq, int ne, struct ibv_wc *wc)
 	return mlx4_poll_cq(ibcq, ne, (struct ibv_exp_wc *)wc, sizeof(*wc), 0);
 }
 
+//// wait until no held head waits for its tail
+static void split_held_finish(struct mlx4_cq *cq)
+{
+	struct ibv_comp_channel *channel = NULL;
+	int waiting;
+
+	for (;;) {
+		mlx4_lock(&cq->lock);
+		waiting = split_held_progress(cq);
+		if (waiting)
+			channel = cq->split_held[0].qp->split_comp_recv_channel;
+		mlx4_unlock(&cq->lock);
+		if (!waiting)
+			return;
+		if (SPLIT_USE_EVENT && split_wait_event(channel))
+			return;
+	}
+}
+
 int mlx4_arm_cq(struct ibv_cq *ibvcq, int solicited)
 {
 	struct mlx4_cq *cq = to_mcq(ibvcq);
@@ -1347,6 +1221,11 @@ int mlx4_arm_cq(struct ibv_cq *ibvcq, int solicited)
 	uint32_t ci;
 	uint32_t cmd;
 
+	//// no event comes when a held head's tail lands, so those tails are
+	//// waited for here, without cq->lock; the poll after arming gets them
+	if (unlikely(cq->split_nheld))
+		split_held_finish(cq);
+
 	sn  = cq->arm_sn & 3;
 	ci  = cq->cons_index & 0xffffff;
 	cmd = solicited ? MLX4_CQ_DB_REQ_NOT_SOL : MLX4_CQ_DB_REQ_NOT;
@@ -1382,6 +1261,8 @@ void __mlx4_cq_clean(struct mlx4_cq *cq, uint32_t qpn, struct mlx4_srq *srq)
 
 	if (cq->last_qp && cq->last_qp->verbs_qp.qp.qp_num == qpn)
 		cq->last_qp = NULL;
+	if (cq->split_nheld)
+		split_held_clean(cq, qpn);
 	/*
 	 * First we need to find the current producer index, so we
 	 * know where to start cleaning from.  It doesn't matter if HW
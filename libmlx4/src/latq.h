@@ -0,0 +1,40 @@
+// Sliding-window latency quantiles (log-linear histogram)
+//
+// Replaces the windowed count-min sketch (rdma_pacer/countmin.c) for tail latency.
+// Values are bucketed HDR-style: exact below 2^(LATQ_SUB_BITS+1), then
+// 2^LATQ_SUB_BITS linear buckets per power of two, and a quantile is
+// reported as the middle of its bucket, i.e. within 1/2^(LATQ_SUB_BITS+1)
+// (~1.6%) of the true value. The window is made of
+// LATQ_EPOCHS epochs of window/LATQ_EPOCHS samples; when an epoch is full
+// the oldest one is subtracted from the running total, so the window slides
+// in steps of one epoch and holds between (LATQ_EPOCHS-1)/LATQ_EPOCHS and
+// all of the last `window` samples.
+//
+// Update is O(1) (plus one O(LATQ_BUCKETS) epoch clear every window /
+// LATQ_EPOCHS samples), a quantile query scans the buckets from the top.
+// One thread updates; any thread may query without locks and sees a
+// snapshot that is at most one sample or one epoch clear behind.
+#ifndef LATQ_H
+#define LATQ_H
+
+#include <stdint.h>
+
+#define LATQ_SUB_BITS 5             /* 32 buckets per power of two */
+#define LATQ_MAX_BITS 24            /* values up to 2^24 (16.7 ms in ns); larger ones land in the top bucket */
+#define LATQ_BUCKETS ((LATQ_MAX_BITS - LATQ_SUB_BITS + 1) << LATQ_SUB_BITS)     /* 640 */
+#define LATQ_EPOCHS 4
+
+struct latq {
+    uint32_t total[LATQ_BUCKETS];               /* sum of the epochs */
+    uint32_t epochs[LATQ_EPOCHS][LATQ_BUCKETS];
+    uint32_t count;                             /* samples in total[] */
+    uint32_t epoch_n[LATQ_EPOCHS];              /* samples in each epoch */
+    uint32_t epoch_size;
+    uint32_t cur;                               /* current epoch */
+};
+
+void latq_init(struct latq *q, uint32_t window);
+void latq_update(struct latq *q, uint32_t value);
+uint32_t latq_quantile(const struct latq *q, double frac);
+
+#endif
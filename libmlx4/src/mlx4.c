@@ -51,6 +51,8 @@
 #include "mlx4.h"
 #include "mlx4-abi.h"
 #include "mlx4_exp.h"
+#include "split_engine.h"
+#include "split_pool.h"
 
 
 #ifndef PCI_VENDOR_ID_MELLANOX
@@ -589,6 +591,8 @@ static int mlx4_init_context(struct verbs_device *v_device,
 	INIT_LIST_HEAD(&context->hugetlb_list);
 
 	pthread_mutex_init(&context->task_mutex, NULL);
+	pthread_mutex_init(&context->split_eng_mtx, NULL);
+	split_pool_init(context);
 
 	memset(&dev_attrs, 0, sizeof(dev_attrs));
 	dev_attrs.comp_mask = IBV_EXP_DEVICE_ATTR_WITH_TIMESTAMP_MASK |
@@ -702,6 +706,8 @@ static void mlx4_uninit_context(struct verbs_device *v_device,
 {
 	struct mlx4_context *context = to_mctx(ibv_ctx);
 
+	split_engine_destroy(context);
+	split_pool_destroy(context);
 	munmap(context->uar, to_mdev(&v_device->device)->page_size);
 	if (context->bfs.page)
 		munmap(context->bfs.page,
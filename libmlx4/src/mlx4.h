@@ -52,7 +52,7 @@
 ////
 #include <inttypes.h>
 #include "queue.h"
-#include "countmin.h"
+#include "latq.h"
 #define SPLIT_CHUNK_SIZE		1000000			//// Default Split Chunk Size; Need to be equal or less than the initial chunk size that pacer sets.
 //#define SPLIT_CHUNK_SIZE		1048576			//// Default Split Chunk Size; Need to be equal or less than the initial chunk size that pacer sets.
 //#define SPLIT_CHUNK_SIZE		10000			//// Default Split Chunk Size; Need to be equal or less than the initial chunk size that pacer sets.
@@ -71,17 +71,12 @@
 #define MAX_SPLIT_QP_NUM_ONE_SIDED		1	    //// Maximum number of split_QPs used to send split chunks in one-sided verbs
 #define SPLIT_MAX_SEND_WR 		8000
 #define SPLIT_MAX_RECV_WR 		8000
-#define SPLIT_MAX_CQE			10000
-#define RR_BUFFER_INIT_CAP		1000
+#define SPLIT_MAX_CQE			10000			//// these three unless the pacer publishes others (PACER_TUNABLE)
 #define TIMESTAMP_QUEUE_CAP		16
-// For count-min sketch
+// For sliding-window latency quantiles (latq.c)
 //#define DRIVER_MEASURE_LAT
-//#define DRIVER_USE_CMH
-#define CMH_WIDTH 32768
-#define CMH_DEPTH 16
-#define CMH_U 24
-#define CMH_GRAN 4
-#define CMH_WINDOW_SIZE 10000
+//#define DRIVER_USE_LATQ
+#define LATQ_WINDOW 10000
 //#define CPU_FRIENDLY                            //// Don't not use busy-wait checking for "pending" in shared memory. Use UDS with token enforcement.
 #define SPLIT_BIG_CHUNK_SIZE    1000000	        //// The big chunk size used in CPU_FRIENDLY version. Should be consistent with the value used in Pacer.
 //#define SPLIT_BIG_CHUNK_SIZE    1048576	        //// The big chunk size used in CPU_FRIENDLY version. Should be consistent with the value used in Pacer.
@@ -320,18 +315,39 @@ struct Split_FC_message {
 };
 ////
 
-//// Buffer holding Receive Requests posted at the user's qp at INIT state
-struct rr_buffer {
-	struct ibv_recv_wr **slot;	// head of the buffer
-	unsigned int size;			// number of wr_head pointers
-	unsigned int capacity;
-};
+//// Receive Requests posted at the user's qp at INIT state (rr_ring.h)
+#include "rr_ring.h"
+
+int rr_buffer_post_and_clear(struct rr_ring *rr_buf, struct ibv_qp *qp);
 
-int rr_buffer_init(struct rr_buffer *rr_buf, unsigned int cap);
+#include "split_wqe.h"
+#include "split_imm.h"
 
-int rr_buffer_enqueue(struct rr_buffer *rr_buf, struct ibv_recv_wr* wr);
+struct pacer_flow;	//// pacer.h
 
-int rr_buffer_post_and_clear(struct rr_buffer *rr_buf, struct ibv_qp *qp);
+//// Send requests of a QP waiting for the split engine (split_engine.c)
+struct split_desc;
+struct mlx4_qp;
+struct split_queue {
+	struct split_desc	*head, *tail;	// FIFO; engine lock
+	int			pending;	// descriptors queued; read without the lock
+	int			inflight;	// chunks on split_qp[0] not yet completed (engine only)
+	int			err;		// first failure, returned by the next post
+	int			failed;		// the user QP was moved to error: what is queued is flushed (engine only)
+	struct mlx4_qp		*next_active;	// engine's list of QPs with queued work
+};
+
+//// Split resources shared by all QPs of a context (split_pool.c)
+struct split_fc_slab;
+struct split_pool {
+	pthread_mutex_t		lock;
+	struct ibv_comp_channel	*channel;	// every split CQ of the context; created with the first RC QP
+	unsigned long		rc_qps;		// user QPs given split QPs and CQs
+	unsigned long		other_qps;	// non-RC user QPs, given none
+	unsigned long		fc_slabs;	// FC message MRs registered
+	unsigned long		rr_bufs;	// rr_buffers that had to buffer a RR
+	unsigned long		pacer_attach_skipped;
+};
 
 ////
 
@@ -536,6 +552,9 @@ struct mlx4_context {
 	} port_query_cache[MLX4_PORTS_NUM];
 	pthread_mutex_t			env_mtx;
 	int				env_initialized;
+	struct split_engine		*split_eng;	/* created on the first queued split */
+	pthread_mutex_t			split_eng_mtx;
+	struct split_pool		split_pool;
 };
 
 struct mlx4_buf {
@@ -549,7 +568,7 @@ struct mlx4_pd {
 	struct ibv_pd			ibv_pd;
 	uint32_t			pdn;
 	//// added for splitting cleanup
-	struct ibv_mr		*split_fc_mr;
+	struct split_fc_slab	*split_fc_slabs;	// split_pool.c; pool lock
 	////
 };
 
@@ -581,13 +600,16 @@ struct mlx4_cq {
 	int				creation_flags;
 	struct mlx4_qp			*last_qp;
 	uint32_t			model_flags; /* use mlx4_cq_model_flags */
+	struct mlx4_split_held		*split_held;	// behind split heads (cq.c)
+	int				split_nheld;
+	int				split_held_max;
 	//uint32_t 		split_chunk_size;
 #ifdef DRIVER_MEASURE_LAT
 	//// TIMESTAMP
 	Queue 			*wr_timestamps;		/* Ideally, we don't even need a queue if assume user post-1-poll-1 for theri "small" QP */
 	double 			cpu_mhz;
-#ifdef DRIVER_USE_CMH
-	CMH_type		*cmh;
+#ifdef DRIVER_USE_LATQ
+	struct latq		*lat_hist;
 	////
 #endif
 #endif
@@ -720,17 +742,25 @@ struct mlx4_qp {
 	struct ibv_comp_channel *split_comp_recv_channel;
 	struct ibv_comp_channel *split_comp_channel2;
 	uint32_t			split_dest_qpn;
-	struct Split_FC_message split_fc_msg[4];
-	struct ibv_mr		*split_fc_mr;
+	struct Split_FC_message *split_fc_msg;		// 4 messages in split_fc_slab
+	struct ibv_mr		*split_fc_mr;		// split_fc_slab's MR
+	struct split_fc_slab	*split_fc_slab;
 	struct ibv_qp_attr	*user_qp_attr_init;
 	int 				user_qp_mask_init;
 	struct ibv_qp_attr	*user_qp_attr_rtr;
 	int 				user_qp_mask_rtr;
-	struct rr_buffer	rr_buf;
+	struct rr_ring		rr_buf;
 	int 				split_qp_exchange_done;
 	//uint32_t			prev_chunk_size;		// used in 2-sided chunk size varying
 	int					isSmall;
 	struct mlx4_cq		*orig_send_cq;
+	struct split_queue	split_q;
+	struct split_wqe_tmpl	split_tmpl;	// chunks of the WR being split inline
+	struct split_imm	split_imm;	// two-sided split; pool set at RTR (split_pool.c)
+	struct ibv_mr		*split_imm_mr;
+	int			split_nheld;	// receives held in recv_cq (cq.c)
+	struct pacer_flow	*flow;		// slot of the QP (or of its user QP); NULL: not paced (pacer.h)
+	int			flow_armed;	// set when modify_qp returns; the next post starts the flow
 	////
 };
 
@@ -931,6 +961,8 @@ int mlx4_query_qp(struct ibv_qp *qp, struct ibv_qp_attr *attr,
 		   struct ibv_qp_init_attr *init_attr);
 int mlx4_modify_qp(struct ibv_qp *qp, struct ibv_qp_attr *attr,
 		    int attr_mask);
+int __mlx4_modify_qp(struct ibv_qp *qp, struct ibv_qp_attr *attr,
+		    int attr_mask);
 int mlx4_exp_modify_qp(struct ibv_qp *qp, struct ibv_exp_qp_attr *attr,
 		       uint64_t attr_mask);
 int mlx4_destroy_qp(struct ibv_qp *qp);
@@ -939,6 +971,16 @@ void mlx4_init_qp_indices(struct mlx4_qp *qp);
 void mlx4_qp_init_sq_ownership(struct mlx4_qp *qp);
 int __mlx4_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
 		   struct ibv_send_wr **bad_wr) __MLX4_ALGN_FUNC__;
+int mlx4_post_send_grant(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
+		   struct ibv_send_wr **bad_wr) __MLX4_ALGN_FUNC__;
+int mlx4_split_tmpl_init(struct ibv_qp *ibqp, const struct ibv_send_wr *wr,
+			 struct split_wqe_tmpl *t);
+int mlx4_post_chunks(struct ibv_qp *ibqp, const struct split_wqe_tmpl *t,
+		     const struct split_sgl_chunk *c, int n, int grant) __MLX4_ALGN_FUNC__;
+int mlx4_post_send_ctl(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
+		       struct ibv_send_wr **bad_wr);
+int mlx4_flow_try_charge(struct pacer_flow *f, int opcode, int nreq, uint64_t bytes, int per_wr);
+extern const struct split_imm_ops mlx4_split_imm_ops;
 #ifdef CPU_FRIENDLY
 int __mlx4_post_send_BIG(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
 		   struct ibv_send_wr **bad_wr) __MLX4_ALGN_FUNC__;
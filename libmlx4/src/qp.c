@@ -49,12 +49,13 @@
 /* isolation */
 //#include "qp_pacer.h"
 #include "pacer.h"
+#include "split_engine.h"
+#include "split_pool.h"
+#include "split_sgl.h"
 #include <inttypes.h>
 #include <sys/time.h>
-int isSmall = 1; /* 0: elephant flow, 1: mouse flow, 2: tput */
 int isRead = 0;
-int32_t debit = 0;
-double cpu_factor_table[] = {0,0.5,0.5,0.7,0.9};    //value for first level is a don't-care (for 1MB chunks)
+#define SPLIT_CPU_FACTOR 0.5         //// CPU_FRIENDLY: spin this much of a chunk's link time between chunks
 /* end */
 
 #ifndef htobe64
@@ -99,6 +100,132 @@ static inline unsigned long get_cycles()
 #endif
 ////
 
+/* isolation: wait until the pacer grants flow f a token, the responder's if
+ * read (flow_read_token()), then charge the wait and the bytes the token
+ * covers to its slot
+ *
+ * In futex mode we keep spinning for up to FLOW_SPIN_CYCLES while tokens
+ * usually arrive within that time, and sleep after a short spin otherwise. */
+static inline void wait_for_token(struct pacer_flow *f, int read, uint64_t bytes)
+{
+	uint64_t start = get_cycles(), budget, waited;
+	int polls = 0;
+
+	flow_set_pending(f, read);
+	if (wait_mode == FLOW_WAIT_FUTEX) {
+		budget = f->avg_wait_cycles <= FLOW_SPIN_CYCLES ? FLOW_SPIN_CYCLES : FLOW_SPIN_CYCLES / 16;
+		while (__atomic_load_n(&f->info->pending, __ATOMIC_ACQUIRE)) {
+			if (get_cycles() - start > budget || ++polls > FLOW_SPIN_CYCLES) {
+				flow_sleep(f);
+				break;
+			}
+			cpu_relax();
+		}
+	} else {
+		while (__atomic_load_n(&f->info->pending, __ATOMIC_ACQUIRE))
+			cpu_relax();
+	}
+	waited = get_cycles() - start;
+	f->avg_wait_cycles += ((int64_t)waited - (int64_t)f->avg_wait_cycles) / 8;
+	flow_account(f, waited, bytes);
+}
+
+static inline uint64_t sge_bytes(struct ibv_sge *sg_list, int num_sge)
+{
+	uint64_t bytes = 0;
+	int i;
+
+	for (i = 0; i < num_sge; i++)
+		bytes += sg_list[i].length;
+	return bytes;
+}
+
+/* isolation: a token covers split_batch chunks of the link (the pacer paces
+ * it that long), so as many WRs of up to a chunk share one. A READ token is
+ * one chunk (active_chunk_size_read), and a READ never takes what is left
+ * of ours */
+static inline void wait_for_token_wr(struct pacer_flow *f, int opcode, uint64_t bytes)
+{
+	int read = flow_read_token(f, opcode);
+
+	if (!read && f->token_left > 0) {
+		f->token_left--;
+		flow_account(f, 0, bytes);
+		return;
+	}
+	wait_for_token(f, read, bytes);
+	f->token_left = read ? 0 : (int)__atomic_load_n(&flow_vlink(f)->split_batch, __ATOMIC_RELAXED) - 1;
+}
+
+/* isolation: a tput flow spends the bytes of a token on its WRs, payload and
+ * headers, so it gets the same share of the link whatever its op size */
+static inline void tput_debit(struct pacer_flow *f, int nreq, uint64_t bytes)
+{
+	while (f->debit <= 0)
+	{
+		wait_for_token(f, 0, 0);
+		f->debit += __atomic_load_n(&flow_vlink(f)->token_bytes, __ATOMIC_RELAXED);
+	}
+	f->debit -= flow_tput_cost(nreq, bytes);
+	flow_account(f, 0, bytes);
+}
+
+#ifndef CPU_FRIENDLY
+/* the split engine's wait_for_token(): ask for a token and return at once;
+ * 1 once the pacer has granted the one asked for, 0 while it has not */
+static inline int try_token(struct pacer_flow *f, int read)
+{
+	uint64_t waited;
+
+	if (!f->asked) {
+		f->ask_start = get_cycles();
+		f->asked = 1;
+		flow_set_pending(f, read);
+	}
+	if (__atomic_load_n(&f->info->pending, __ATOMIC_ACQUIRE))
+		return 0;
+	f->asked = 0;
+	waited = get_cycles() - f->ask_start;
+	f->avg_wait_cycles += ((int64_t)waited - (int64_t)f->avg_wait_cycles) / 8;
+	flow_account(f, waited, 0);
+	return 1;
+}
+
+/* isolation for the split engine, which serves every QP of the context from
+ * one thread: charge nreq WRs of this opcode and `bytes` to flow f as
+ * mlx4_post_send_grant() (one token for them all) or, with per_wr,
+ * __mlx4_post_send() (a token per split_batch WRs) would, but without
+ * waiting. Returns 0, charging nothing,
+ * while a token is still to come; the engine tries another QP meanwhile and
+ * posts with mlx4_post_send_ctl() once this returns 1. */
+int mlx4_flow_try_charge(struct pacer_flow *f, int opcode, int nreq, uint64_t bytes, int per_wr)
+{
+	int read;
+
+	if (flow_is(f, PMSG_APP_BW)) {
+		read = flow_read_token(f, opcode);
+		if (per_wr && !read && f->token_left > 0) {
+			f->token_left--;
+		} else {
+			if (!try_token(f, read))
+				return 0;
+			if (per_wr)
+				f->token_left = read ? 0 : (int)__atomic_load_n(&flow_vlink(f)->split_batch, __ATOMIC_RELAXED) - 1;
+		}
+		flow_account(f, 0, bytes);
+	} else if (flow_is(f, PMSG_APP_TPUT)) {
+		while (f->debit <= 0) {
+			if (!try_token(f, 0))
+				return 0;
+			f->debit += __atomic_load_n(&flow_vlink(f)->token_bytes, __ATOMIC_RELAXED);
+		}
+		f->debit -= flow_tput_cost(nreq, bytes);
+		flow_account(f, 0, bytes);
+	}
+	return 1;
+}
+#endif
+
 #ifdef MLX4_WQE_FORMAT
 #define SET_BYTE_COUNT(byte_count) (htonl(byte_count) | owner_bit)
 #define WQE_CTRL_OWN (1 << 30)
@@ -1123,9 +1250,12 @@ int ceil_helper(float num_chunks)
 }
 ////
 
-//// original mlx4_post_send without lock
-int __mlx4_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
-					 struct ibv_send_wr **bad_wr)
+//// original mlx4_post_send without lock; with grant, one token wait covers
+//// the whole postlist (the split chunks of one token, split_sgl.h); grant 2
+//// is for the split's own control messages, which are not paced at all
+static inline __attribute__((always_inline))
+int mlx4_post_send_paced(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
+			 struct ibv_send_wr **bad_wr, int grant)
 {
 	//printf("DEBUG __mlx4_post_send: enter\n");
 	//printf("DEBUG __mlx4_post_send: raddr:%" PRIu64 "\n", wr->wr.rdma.remote_addr);
@@ -1138,26 +1268,33 @@ int __mlx4_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
 	int ret = 0;
 	int size = 0;
     //uint8_t expected_pending = 0;
+#ifndef CPU_FRIENDLY
+	struct pacer_flow *f = qp->flow;
+	uint64_t batch_bytes = 0;	/* isolation: bytes covered by a tput batch */
+	struct ibv_send_wr *w;
+#endif
 
 	////mlx4_lock(&qp->sq.lock);
 
 	/* XXX check that state is OK to post send */
 
 	ind = qp->sq.head;
+#ifndef CPU_FRIENDLY
+	if (grant == 1 && flow_is(f, PMSG_APP_BW)) {
+		for (w = wr; w; w = w->next)
+			batch_bytes += sge_bytes(w->sg_list, w->num_sge);
+		wait_for_token(f, flow_read_token(f, wr->opcode), batch_bytes);	/* chunks of one WR */
+	}
+#endif
 
 	for (nreq = 0; wr; ++nreq, wr = wr->next)
 	{
 		/* isolation */
 #ifndef CPU_FRIENDLY
-		if (isSmall == 0 && flow)
-		{
-            //expected_pending = 0;
-			//printf("DEBUG ENTER HERE\n");
-			__atomic_store_n(&flow->pending, 1, __ATOMIC_RELAXED);
-			//while (!__atomic_compare_exchange_n(&flow->pending, &expected_pending, 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))   // multi-thread safer than doing load
-			while (__atomic_load_n(&flow->pending, __ATOMIC_RELAXED))
-				cpu_relax();
-		}
+		if (!grant && flow_is(f, PMSG_APP_BW))
+			wait_for_token_wr(f, wr->opcode, sge_bytes(wr->sg_list, wr->num_sge));
+		else if (grant != 2 && flow_is(f, PMSG_APP_TPUT))
+			batch_bytes += sge_bytes(wr->sg_list, wr->num_sge);
 #endif
 		/* end */
 		//printf("ORIG POST SEND: wr->sg_list->length = %d\n", wr->sg_list->length);
@@ -1219,20 +1356,8 @@ int __mlx4_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
 	// printf("ORIG POST SEND: nreq = %d\n", nreq);
 	/* isolation */
 #ifndef CPU_FRIENDLY
-	if (isSmall == 2 && flow)
-	{
-		// printf("DEBUG enter\n");
-		while (debit <= 0)
-		{
-			// printf("DEBUG REQUEST TOKEN\n");
-			__atomic_store_n(&flow->pending, 1, __ATOMIC_RELAXED);
-			while (__atomic_load_n(&flow->pending, __ATOMIC_RELAXED))
-				cpu_relax();
-			debit += __atomic_load_n(&sb->active_batch_ops, __ATOMIC_RELAXED);
-			// printf("DEBUG DEBIT %d\n", debit);
-		}
-		debit -= nreq;
-	}
+	if (grant != 2 && flow_is(f, PMSG_APP_TPUT))
+		tput_debit(f, nreq, batch_bytes);
 #endif
 	/* end */
 out:
@@ -1251,6 +1376,108 @@ out:
 
 	return ret;
 }
+
+int __mlx4_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
+					 struct ibv_send_wr **bad_wr)
+{
+	return mlx4_post_send_paced(ibqp, wr, bad_wr, 0);
+}
+
+//// split chunks of one token grant: one token wait, one doorbell
+int mlx4_post_send_grant(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
+			 struct ibv_send_wr **bad_wr)
+{
+	return mlx4_post_send_paced(ibqp, wr, bad_wr, 1);
+}
+
+//// split control messages (credits, split_imm.h) and split engine posts
+//// already charged (mlx4_flow_try_charge()): no token, no debit
+int mlx4_post_send_ctl(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
+		       struct ibv_send_wr **bad_wr)
+{
+	struct mlx4_qp *qp = to_mqp(ibqp);
+	int ret;
+
+	mlx4_lock(&qp->sq.lock);
+	ret = mlx4_post_send_paced(ibqp, wr, bad_wr, 2);
+	mlx4_unlock(&qp->sq.lock);
+	return ret;
+}
+
+#ifndef CPU_FRIENDLY
+//// WQE template for the chunks of a single-SGE WRITE/READ on the RC split
+//// QP (split_wqe.h); EINVAL if they have to go the generic way
+int mlx4_split_tmpl_init(struct ibv_qp *ibqp, const struct ibv_send_wr *wr,
+			 struct split_wqe_tmpl *t)
+{
+	struct mlx4_qp *qp = to_mqp(ibqp);
+	int idx = (wr->send_flags & IBV_SEND_SOLICITED) / (IBV_SEND_SOLICITED >> 1);
+
+	if (qp->qp_type != IBV_QPT_RC || wr->num_sge != 1 ||
+	    (wr->opcode != IBV_WR_RDMA_WRITE && wr->opcode != IBV_WR_RDMA_READ) ||
+	    wr->send_flags & IBV_SEND_INLINE ||
+	    qp->create_flags & IBV_EXP_QP_CREATE_MANAGED_SEND ||
+	    (1 << qp->sq.wqe_shift) < SPLIT_WQE_DS * 16)
+		return EINVAL;
+	t->owner_opcode = htonl(mlx4_ib_opcode[wr->opcode]);
+	t->srcrb_flags[0] = htonl((uint32_t)qp->srcrb_flags_tbl[idx]);
+	t->srcrb_flags[1] = htonl((uint32_t)qp->srcrb_flags_tbl[idx | 1]);
+	t->rkey = htonl(wr->wr.rdma.rkey);
+	t->lkey = htonl(wr->sg_list->lkey);
+	t->fence_size = (wr->send_flags & IBV_SEND_FENCE ? MLX4_WQE_CTRL_FENCE : 0) | SPLIT_WQE_DS;
+	t->inl = wr->opcode == IBV_WR_RDMA_READ;
+	return 0;
+}
+
+//// the chunks of one token grant from template t: what mlx4_post_send_grant()
+//// does for their WRs, with each WQE patched from the template; grant 2:
+//// the caller charged them already (mlx4_flow_try_charge())
+int mlx4_post_chunks(struct ibv_qp *ibqp, const struct split_wqe_tmpl *t,
+		     const struct split_sgl_chunk *c, int n, int grant)
+{
+	struct mlx4_qp *qp = to_mqp(ibqp);
+	void *uninitialized_var(ctrl);
+	unsigned int ind = qp->sq.head;
+	unsigned int owner_bit;
+	uint64_t bytes = 0;
+	int i;
+
+	if (!(qp->create_flags & IBV_EXP_QP_CREATE_IGNORE_SQ_OVERFLOW))
+		if (unlikely(wq_overflow(&qp->sq, n - 1, qp)))
+			return ENOMEM;
+
+	for (i = 0; i < n; i++)
+		bytes += c[i].length;
+	if (grant != 2 && flow_is(qp->flow, PMSG_APP_BW))
+		wait_for_token(qp->flow, t->inl, bytes);	/* t->inl: a READ */
+
+	for (i = 0; i < n; i++, ind++) {
+		ctrl = get_send_wqe(qp, ind & (qp->sq.wqe_cnt - 1));
+		qp->sq.wrid[ind & (qp->sq.wqe_cnt - 1)] = c[i].wr_id;
+		owner_bit = (ind & qp->sq.wqe_cnt) ? htonl(WQE_CTRL_OWN) : 0;
+#ifndef MLX4_WQE_FORMAT
+		split_wqe_emit(ctrl, t, &c[i], owner_bit, 0);
+		if (i + 1 < n)
+			stamp_send_wqe(qp, (ind + qp->sq_spare_wqes) & (qp->sq.wqe_cnt - 1));
+#else
+		split_wqe_emit(ctrl, t, &c[i], owner_bit, owner_bit);
+		if (i + 1 < n)
+			set_owner_wqe(qp, ind, SPLIT_WQE_DS, owner_bit);
+#endif
+	}
+	if (grant != 2 && flow_is(qp->flow, PMSG_APP_TPUT))
+		tput_debit(qp->flow, n, bytes);
+
+	ring_db(qp, ctrl, n, SPLIT_WQE_DS, t->inl);
+#ifndef MLX4_WQE_FORMAT
+	stamp_send_wqe(qp, (ind + qp->sq_spare_wqes - 1) & (qp->sq.wqe_cnt - 1));
+#else
+	set_owner_wqe(qp, ind - 1, SPLIT_WQE_DS,
+		      ((ind - 1) & qp->sq.wqe_cnt ? htonl(WQE_CTRL_OWN) : 0));
+#endif
+	return 0;
+}
+#endif
 ////
 
 #ifdef CPU_FRIENDLY
@@ -1268,6 +1495,7 @@ int __mlx4_post_send_BIG(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
 	int inl = 0;
 	int ret = 0;
 	int size = 0;
+	uint64_t batch_bytes = 0;	/* isolation: bytes a tput flow is charged */
     //uint8_t expected_pending = 0;
 
 	////mlx4_lock(&qp->sq.lock);
@@ -1280,17 +1508,13 @@ int __mlx4_post_send_BIG(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
 	for (nreq = 0; wr; ++nreq, wr = wr->next)
 	{
 		/* isolation */
-		if (isSmall == 0 && flow)
+		if (flow_is(qp->flow, PMSG_APP_TPUT))
+			batch_bytes += sge_bytes(wr->sg_list, wr->num_sge);
+		if (flow_is(qp->flow, PMSG_APP_BW))
 		{
-            char str;
-            __atomic_store_n(&flow->pending, 1, __ATOMIC_RELAXED);
+            flow_set_pending(qp->flow, flow_read_token(qp->flow, wr->opcode));
             //gettimeofday(&tt1,NULL);
-            if (recv(flow_socket, &str, 1, 0) > 0) {
-                //printf("received a token\n");
-            } else {
-                printf("Error in recving tokens. Exit\n");
-                exit(1);
-            }
+            pacer_flow_token(qp->flow);
             //gettimeofday(&tt2,NULL);
             //printf("__send_BIG: elaspsed time = %d us\n", (int)(tt2.tv_usec - tt1.tv_usec));
 		}
@@ -1353,23 +1577,17 @@ int __mlx4_post_send_BIG(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
 	}
 	// printf("ORIG POST SEND: nreq = %d\n", nreq);
 	/* isolation */
-	if (isSmall == 2 && flow)
+	if (flow_is(qp->flow, PMSG_APP_TPUT))
 	{
 		// printf("DEBUG enter\n");
-		while (debit <= 0)
+		while (qp->flow->debit <= 0)
 		{
-            char str;
-            __atomic_store_n(&flow->pending, 1, __ATOMIC_RELAXED);
-            if (recv(flow_socket, &str, 1, 0) > 0) {
-                //printf("received a token\n");
-            } else {
-                printf("Error in recving tokens. Exit\n");
-                exit(1);
-            }
-			debit += __atomic_load_n(&sb->active_batch_ops, __ATOMIC_RELAXED);
-			// printf("DEBUG DEBIT %d\n", debit);
+            flow_set_pending(qp->flow, 0);
+            pacer_flow_token(qp->flow);
+			qp->flow->debit += __atomic_load_n(&flow_vlink(qp->flow)->token_bytes, __ATOMIC_RELAXED);
+			// printf("DEBUG DEBIT %d\n", qp->flow->debit);
 		}
-		debit -= nreq;
+		qp->flow->debit -= flow_tput_cost(nreq, batch_bytes);
 	}
 	/* end */
 out:
@@ -1391,802 +1609,288 @@ out:
 ////
 #endif
 
-//// new version with both one-sided and two-sided verbs using split qp
-int mlx4_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
-				   struct ibv_send_wr **bad_wr)
+#ifndef CPU_FRIENDLY
+//// Inline split of a WR chain (split_sgl_post_chain(), split_sgl.h) with
+//// the split engine off or drained: WRITE/READ WRs over the chunk size,
+//// counting all of their SGEs, are cut into chunks for split_qp[0]; a
+//// two-sided WR that needs splitting is posted on its own through
+//// mlx4_post_send() for split_imm_send(); the rest go on the user QP.
+static int split_chain_classify(void *ctx, struct ibv_send_wr *wr, struct split_sgl_cut *cut)
 {
+	struct mlx4_qp *qp = ctx;
 
-	struct mlx4_qp *qp = to_mqp(ibqp);
-
-	/* isolation */
-	if (unlikely(start_flag))
-	{
-		start_flag = 0;
-		if (flow)
-		{
-			switch (qp->isSmall)
-			{
-			case 0:
-			{
-				isSmall = 0;
-				if (wr->opcode == IBV_WR_RDMA_READ)
-				{
-					__atomic_store_n(&flow->read, 1, __ATOMIC_RELAXED);
-					//contact_pacer_read();		//TODO: fix read later
-				}
-				else
-				{
-					num_active_big_flows++;
-					contact_pacer(2);
-					printf("DEBUG POST SEND: INDEED increment BIG flow counter\n");
-					__atomic_fetch_add(&sb->num_active_big_flows, 1, __ATOMIC_RELAXED);
-				    __atomic_fetch_add(&sb->num_active_bw_flows, 1, __ATOMIC_RELAXED);
-				}
-				break;
-			}
-			case 1:
-			{
-				isSmall = 1;
-				contact_pacer(2);
-				num_active_small_flows++;
-				printf("DEBUG POST SEND: INDEED increment SMALL flow counter\n");
-				__atomic_fetch_add(&sb->num_active_small_flows, 1, __ATOMIC_RELAXED);
-				break;
-			}
-			case 2:
-			{
-				isSmall = 2;
-				contact_pacer(2);
-				num_active_big_flows++;
-                __atomic_fetch_add(&sb->num_active_big_flows, 1, __ATOMIC_RELAXED);
-				// num_active_small_flows++;
-				// printf("DEBUG POST SEND: INDEED increment SMALL flow counter\n");
-				// __atomic_fetch_add(&sb->num_active_small_flows, 1, __ATOMIC_RELAXED);
-				printf("DEBUG POST SEND: TPUT SENSITIVE\n");
-				break;
-			}
-			}
-		}
-	}
-	/* end */
-
-	int ret = 0;
-	mlx4_lock(&qp->sq.lock);
-
-	//// splitting logic
-	//// Update split chunk size
-	uint32_t split_chunk_size = sb ? (wr->opcode == IBV_WR_RDMA_READ ? __atomic_load_n(&sb->active_chunk_size_read, __ATOMIC_RELAXED)
-																	 : __atomic_load_n(&sb->active_chunk_size, __ATOMIC_RELAXED))
-								   : SPLIT_CHUNK_SIZE;
-	//if (++GLOBAL_CNT % 100 == 0) {
-	//printf("DEBUG: POST SEND: split_chunk_size = %" PRIu32 "\n", split_chunk_size);
-	//	printf("DEBUG: POST SEND: split_chunk_size = %" PRIu32 " [%d]\n", split_chunk_size, GLOBAL_CNT);
-	//	fflush(stdout);
-	//}
-	//printf("DEBUG: POST SEND: split_chunk_size = %" PRIu32 "; msg size = %d [%d]\n", split_chunk_size, wr->sg_list->length, ++GLOBAL_CNT);
-	//fflush(stdout);
-
-	int is_two_sided = 0;
-	int is_wimm = 0;
-	if (wr->opcode == IBV_WR_RDMA_WRITE_WITH_IMM ||
-		wr->opcode == IBV_WR_SEND ||
-		wr->opcode == IBV_WR_SEND_WITH_IMM)
-	{
-		is_two_sided = 1;
+	if (wr->opcode == IBV_WR_RDMA_WRITE || wr->opcode == IBV_WR_RDMA_READ) {
+		split_cut_of(qp, wr, cut);
+		return split_sgl_bytes(wr) > cut->chunk ? SPLIT_SGL_CHUNKS : SPLIT_SGL_USER;
 	}
-	if (wr->opcode == IBV_WR_RDMA_WRITE_WITH_IMM)
-	{
-		is_wimm = 1;
-	}
-
-	//// Now in two-sided case, the receiver will alywas try to get a split INFO message after receiving the first chunk (unless message is really small)
-	//// In other words, sender alywas send an extra INFO message (again unless msg is really small -- less than MIN_SPLIT_CHUNK_SIZE)
-	//// In the info message, we specify chunk_size and num_split_chunks (0 means no splitting)
-
-	//if (wr->sg_list->length > split_chunk_size)
-	if (wr->sg_list->length > split_chunk_size ||
-		//(!is_wimm && (is_two_sided && wr->sg_list->length >= MIN_SPLIT_CHUNK_SIZE))) {
-		(is_two_sided && wr->sg_list->length >= MIN_SPLIT_CHUNK_SIZE))
-	{
-
-		//printf("[[[NEED TO SPLIT]]] [%d]\n", ++GLOBAL_CNT);
-
-		uint32_t num_chunks_to_send = 1;
-		uint32_t orig_num_chunks_to_send = 1;
-		uint32_t current_length = 0;
-		uint64_t orig_raddr = 0;
-		uint64_t orig_sge_addr = 0;
-		uint32_t orig_sge_length = 0;
-		int orig_send_flags = 0;
-
-		current_length = wr->sg_list->length;
-		orig_raddr = wr->wr.rdma.remote_addr;
-		orig_sge_addr = wr->sg_list->addr;
-		orig_sge_length = wr->sg_list->length;
-		orig_send_flags = wr->send_flags;
-
-		// For two-sided ops, the first chunk still need to be what it is originally,
-		// because the user will poll the first one at the end
-		//////wr->send_flags = wr->send_flags & (~(IBV_SEND_SIGNALED));
-		//printf("IBV_SEND_SIGNALED: %d\n", IBV_SEND_SIGNALED);
-
-		//if (wr->opcode == IBV_WR_RDMA_WRITE_WITH_IMM ||
-		//	wr->opcode == IBV_WR_SEND ||
-		//	wr->opcode == IBV_WR_SEND_WITH_IMM) { 				//// two-sided op
-
-		if (is_wimm)
-		{ // WIMM hack
-			//// num_chunks_to_send is the total chunks to send for the entire data. (including the chunk via user qp)
-			num_chunks_to_send = ceil_helper((double)orig_sge_length / (double)split_chunk_size);
-			uint32_t first_chunk_length = wr->sg_list->length % split_chunk_size;
-			if (first_chunk_length == 0)
-			{
-				first_chunk_length = split_chunk_size;
-			}
-			//printf("num_chunks_to_send = %d, first_chunk_length = %d\n", num_chunks_to_send, first_chunk_length);
-			//fflush(stdout);
-
-			if (num_chunks_to_send == 0)
-			{
-				printf("WRONG num_chunks_to_send\n");
-				return -1;
-			}
-
-			struct ibv_sge sge;
-			struct ibv_send_wr swr;
-			struct ibv_send_wr *bad_swr;
-			memset(&swr, 0, sizeof(swr));
-			memset(&sge, 0, sizeof(sge));
-			swr.wr.rdma.remote_addr = wr->wr.rdma.remote_addr;
-			//printf("ORIG remote addr = %lu\n", wr->wr.rdma.remote_addr);
-			sge.addr = wr->sg_list->addr;
-			//printf("ORIG sge addr = %lu\n", wr->sg_list->addr);
-			sge.length = first_chunk_length;
-			sge.lkey = wr->sg_list->lkey;
-
-			//// (N-2) chunks send using WRITE
-			int i = 0;
-			if (num_chunks_to_send > 2)
-			{
-
-				for (i = 0; i < num_chunks_to_send - 2; i++)
-				{
-					swr.wr_id = i + 1;
-					swr.opcode = IBV_WR_RDMA_WRITE;
-					swr.sg_list = &sge;
-					swr.num_sge = 1;
-					swr.send_flags = (i == num_chunks_to_send - 3) ? (orig_send_flags | IBV_SEND_SIGNALED) : (orig_send_flags & (~(IBV_SEND_SIGNALED)));
-					//// No batch for now
-					swr.send_flags = (orig_send_flags | IBV_SEND_SIGNALED);
-					if (i == 0)
-					{
-						swr.wr.rdma.remote_addr = wr->wr.rdma.remote_addr;
-					}
-					else if (i == 1)
-					{
-						swr.wr.rdma.remote_addr += first_chunk_length;
-					}
-					else
-					{
-						swr.wr.rdma.remote_addr += split_chunk_size;
-					}
-					swr.wr.rdma.rkey = wr->wr.rdma.rkey;
-					swr.next = NULL;
-
-					sge.length = (i == 0) ? first_chunk_length : split_chunk_size;
-					if (i == 0)
-					{
-						sge.addr = wr->sg_list->addr;
-					}
-					else if (i == 1)
-					{
-						sge.addr += first_chunk_length;
-					}
-					else
-					{
-						sge.addr += split_chunk_size;
-					}
-					sge.lkey = wr->sg_list->lkey;
-
-					// those WRs are handled by the split qp
-					ret = __mlx4_post_send(qp->split_qp[0], &swr, &bad_swr);
-					if (ret != 0)
-					{
-						errno = ret;
-						fprintf(stderr, "error posting SRs (WRITE) to split qp, errno = %d\n", errno);
-						goto out;
-					}
-
-					struct ibv_wc wc;
-					struct ibv_cq *ev_cq;
-					void *ev_ctx;
-					int ne = 0;
-					if (swr.send_flags == (orig_send_flags | IBV_SEND_SIGNALED))
-					{
-						if (SPLIT_USE_EVENT)
-						{
-							ret = ibv_get_cq_event(qp->split_comp_send_channel, &ev_cq, &ev_ctx);
-							if (ret)
-							{
-								fprintf(stderr, "Failed to get CQ event.\n");
-								return ret;
-							}
-
-							ibv_ack_cq_events(ev_cq, 1);
-
-							ret = ibv_req_notify_cq(ev_cq, 0);
-							if (ret)
-							{
-								fprintf(stderr, "Couldn't request CQ notification\n");
-								return ret;
-							}
-						}
-						do
-						{
-							ne = mlx4_poll_ibv_cq(qp->split_send_cq, 1, &wc);
-							//printf("ne = %d\n", ne);
-						} while (ne == 0);
-					}
-					//printf("Send chunks using WRITE, length = %d; sge.addr = %lu; remote_addr = %lu\n", sge.length, sge.addr, swr.wr.rdma.remote_addr);
-					//fflush(stdout);
-				}
-			}
-
-			//// (N-1)th chunk sends using WIMM
-			//// if N == 1, still sends out an empty chunk using WIMM
-			if (num_chunks_to_send >= 1)
-			{
-				swr.wr_id = i + 1;
-				swr.opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
-				swr.sg_list = &sge;
-				swr.num_sge = 1;
-				swr.send_flags = (orig_send_flags | IBV_SEND_SIGNALED);
-				if (i == 0)
-				{
-					swr.wr.rdma.remote_addr = wr->wr.rdma.remote_addr;
-				}
-				else if (i == 1)
-				{
-					swr.wr.rdma.remote_addr += first_chunk_length;
-				}
-				else
-				{
-					swr.wr.rdma.remote_addr += split_chunk_size;
-				}
-				swr.wr.rdma.rkey = wr->wr.rdma.rkey;
-				swr.next = NULL;
-
-				if (i == 0)
-				{
-					sge.addr = wr->sg_list->addr;
-				}
-				else if (i == 1)
-				{
-					sge.addr += first_chunk_length;
-				}
-				else
-				{
-					sge.addr += split_chunk_size;
-				}
-				sge.lkey = wr->sg_list->lkey;
-				if (num_chunks_to_send == 1)
-				{
-					swr.num_sge = 0;
-					swr.sg_list = NULL;
-					sge.length = 0;
-				}
-				else
-				{
-					sge.length = (i == 0) ? first_chunk_length : split_chunk_size;
-
-					++i;
-				}
-
-				ret = __mlx4_post_send(qp->split_qp[0], &swr, bad_wr);
-				if (ret != 0)
-				{
-					errno = ret;
-					fprintf(stderr, "error posting SRs (WRITE) to split qp, errno = %d\n", errno);
-					goto out;
-				}
-
-				struct ibv_wc wc;
-				struct ibv_cq *ev_cq;
-				void *ev_ctx;
-				int ne = 0;
-				if (SPLIT_USE_EVENT)
-				{
-					ret = ibv_get_cq_event(qp->split_comp_send_channel, &ev_cq, &ev_ctx);
-					if (ret)
-					{
-						fprintf(stderr, "Failed to get CQ event.\n");
-						return ret;
-					}
-
-					ibv_ack_cq_events(ev_cq, 1);
-
-					ret = ibv_req_notify_cq(ev_cq, 0);
-					if (ret)
-					{
-						fprintf(stderr, "Couldn't request CQ notification\n");
-						return ret;
-					}
-				}
-				do
-				{
-					ne = mlx4_poll_ibv_cq(qp->split_send_cq, 1, &wc);
-					//printf("ne = %d\n", ne);
-				} while (ne == 0);
-			}
-			else
-			{
-				printf("Shouldn't be the case\n");
-				fflush(stdout);
-				return -1;
-			}
-
-			//printf("Finished sending %d th chunk via split qp using WIMM; length = %d; sge.addr = %lu; remote_addr = %lu\n", num_chunks_to_send - 1, sge.length, sge.addr, swr.wr.rdma.remote_addr);
-			//fflush(stdout);
-
-			//// N th chunk sends using WIMM via USER QP
-			//current_length = wr->sg_list->length - split_chunks_size * i;
-
-			swr.wr_id = wr->wr_id;
-			swr.opcode = wr->opcode;
-			swr.sg_list = &sge;
-			swr.num_sge = 1;
-			swr.send_flags = orig_send_flags;
-			if (i == 0)
-			{
-				swr.wr.rdma.remote_addr = wr->wr.rdma.remote_addr;
-			}
-			else if (i == 1)
-			{
-				swr.wr.rdma.remote_addr += first_chunk_length;
-			}
-			else
-			{
-				swr.wr.rdma.remote_addr += split_chunk_size;
-			}
-			swr.wr.rdma.rkey = wr->wr.rdma.rkey;
-			swr.next = NULL;
-
-			//sge.length = current_length;
-			sge.length = (i == 0) ? first_chunk_length : split_chunk_size;
-			if (i == 0)
-			{
-				sge.addr = wr->sg_list->addr;
-			}
-			else if (i == 1)
-			{
-				sge.addr += first_chunk_length;
-			}
-			else
-			{
-				sge.addr += split_chunk_size;
-			}
-			sge.lkey = wr->sg_list->lkey;
-
-			//ret = __mlx4_post_send(ibqp, &swr, bad_wr);
-			wr->wr.rdma.remote_addr = swr.wr.rdma.remote_addr;
-			wr->sg_list->addr = sge.addr;
-			wr->sg_list->length = sge.length;
-			ret = __mlx4_post_send(ibqp, wr, bad_wr);
-			if (ret != 0)
-			{
-				errno = ret;
-				//printf("DEBUG POST SEND REALLY BAD!!, errno = %d\n", errno);
-				goto out;
-			}
-
-			//printf("USER last chunk sent; length = %d; sge.addr = %lu; remote_addr = %lu\n", sge.length, sge.addr, swr.wr.rdma.remote_addr);
-			//fflush(stdout);
-
-			wr->wr.rdma.remote_addr = orig_raddr;
-			wr->sg_list->addr = orig_sge_addr;
-			wr->sg_list->length = orig_sge_length;
-			wr->send_flags = orig_send_flags;
-
-			mlx4_unlock(&qp->sq.lock);
-			return ret;
-		}
-		else if (is_two_sided)
-		{
+	if (qp->split_imm.pool && split_imm_splits(wr))
+		return SPLIT_SGL_ALONE;
+	return SPLIT_SGL_USER;
+}
 
-			//printf("[[[Splitting two-sided op]]]\n");
-			//printf("ORIG QP local QPN: %#06x\n", ibqp->qp_num);
-			//printf("SPLIT QP local QPN: %#06x\n", qp->split_qp->qp_num);
+// called with qp->sq.lock held
+static int split_chain_post(void *ctx, int where, struct ibv_send_wr *wr, struct ibv_send_wr **bad_wr)
+{
+	struct mlx4_qp *qp = ctx;
+	int ret;
 
-			//// num_chunks_to_send here is the remainning chunks left to send to the receiver (not including the first one that has already been sent)
-			num_chunks_to_send = ceil_helper((double)orig_sge_length / (double)split_chunk_size) - 1;
-			if (num_chunks_to_send < 0)
-			{
-				printf("IMPOSSIBLE that chunks_to_split is < 0 since here orig_sge_length must be > 0\n");
-				return -1;
-			}
-			orig_num_chunks_to_send = num_chunks_to_send;
+	switch (where) {
+	case SPLIT_SGL_CHUNKS:
+		return mlx4_post_send_grant(qp->split_qp[0], wr, bad_wr);
+	case SPLIT_SGL_ALONE:
+		mlx4_unlock(&qp->sq.lock);
+		ret = mlx4_post_send(&qp->verbs_qp.qp, wr, bad_wr);
+		mlx4_lock(&qp->sq.lock);
+		return ret;
+	default:
+		return __mlx4_post_send(&qp->verbs_qp.qp, wr, bad_wr);
+	}
+}
 
-			// <1> send the first chunk of message using user's qp
-			//printf("SENDER <1> send the first chunk of message using user's qp\n");
-			//fflush(stdout);
+// wait for the signaled chunk of the oldest postlist on split_qp[0]
+static int split_chain_reap(void *ctx)
+{
+	struct mlx4_qp *qp = ctx;
+	struct ibv_wc wc;
+	int ne;
 
-			//// It is possible that the message is smaller than split_chunk_size.
-			//// In such case, we send out the original message.
-			if (wr->sg_list->length > split_chunk_size)
-			{
-				wr->sg_list->length = split_chunk_size;
-			}
-			//printf("first chunk message length = %" PRIu32 "\n", wr->sg_list->length);
-			//fflush(stdout);
+	if (SPLIT_USE_EVENT && split_wait_event(qp->split_comp_send_channel)) {
+		fprintf(stderr, "Failed to get CQ event.\n");
+		return EIO;
+	}
+	do {
+		ne = mlx4_poll_ibv_cq(qp->split_send_cq, 1, &wc);
+	} while (ne == 0);
+	if (ne < 0 || wc.status != IBV_WC_SUCCESS) {
+		fprintf(stderr, "split chunk failed: %s\n", ne < 0 ? "poll error" : ibv_wc_status_str(wc.status));
+		return EIO;
+	}
+	return 0;
+}
 
-			ret = __mlx4_post_send(ibqp, wr, bad_wr);
-			if (ret != 0)
-			{
-				errno = ret;
-				goto out;
-			}
+// between two postlists: the pacer's current chunk size and batch
+static void split_chain_recut(void *ctx, const struct ibv_send_wr *wr, struct split_sgl_cut *cut)
+{
+	split_cut_of(ctx, wr, cut);
+}
 
-			// <2> post a SR to split_qp to send num_split_chunks as well as the current(updated)_chunk_size to the receiver and poll its wc
-			//printf("SENDER <2> post a SR to split_qp to send num_split_chunks and current(updated)_chunk_size to the receiver and poll its wc\n");
-
-			qp->split_fc_msg[1].type = INFO;
-			qp->split_fc_msg[1].msg.split_chunk_info.num_split_chunks = num_chunks_to_send;
-			qp->split_fc_msg[1].msg.split_chunk_info.current_chunk_size = split_chunk_size;
-			//printf("DEBUG POST SEND: qp->split_fc_msg.msg.split_chunk_info.num_split_chunks: %d\n", qp->split_fc_msg[1].msg.split_chunk_info.num_split_chunks);
-			//printf("DEBUG POST SEND: qp->split_fc_msg.msg.split_chunk_info.current_chunk_size: %d\n", qp->split_fc_msg[1].msg.split_chunk_info.current_chunk_size);
-			//fflush(stdout);
-
-			struct ibv_sge ssge;
-			struct ibv_send_wr swr;
-			struct ibv_send_wr *bad_swr;
-
-			memset(&ssge, 0, sizeof(ssge));
-			ssge.addr = (uintptr_t)&qp->split_fc_msg[1];
-			ssge.length = sizeof(struct Split_FC_message);
-			ssge.lkey = qp->split_fc_mr->lkey;
-
-			memset(&swr, 0, sizeof(swr));
-			swr.wr_id = 0;
-			swr.sg_list = &ssge;
-			swr.num_sge = 1;
-			swr.opcode = IBV_WR_SEND;
-			swr.send_flags = IBV_SEND_SIGNALED;
-
-			int ret2;
-			ret2 = __mlx4_post_send(qp->split_qp[0], &swr, &bad_swr);
-			if (ret2 != 0)
-			{
-				errno = ret2;
-				fprintf(stderr, "DEBUG POST SEND: REALLY BAD!!, errno = %d\n", errno);
-			}
+// chunks of a single-SGE WR are written from a WQE template (split_wqe.h)
+static int split_chain_prime(void *ctx, const struct ibv_send_wr *wr)
+{
+	struct mlx4_qp *qp = ctx;
 
-			int ne = 0;
-			struct ibv_wc wc;
-			struct ibv_cq *ev_cq;
-			void *ev_ctx;
-			if (SPLIT_USE_EVENT)
-			{
-				ret = ibv_get_cq_event(qp->split_comp_send_channel, &ev_cq, &ev_ctx);
-				if (ret)
-				{
-					fprintf(stderr, "Failed to get CQ event.\n");
-					return ret;
-				}
+	return mlx4_split_tmpl_init(qp->split_qp[0], wr, &qp->split_tmpl);
+}
 
-				ibv_ack_cq_events(ev_cq, 1);
+// called with qp->sq.lock held
+static int split_chain_burst(void *ctx, const struct split_sgl_chunk *c, int n)
+{
+	struct mlx4_qp *qp = ctx;
 
-				ret = ibv_req_notify_cq(ev_cq, 0);
-				if (ret)
-				{
-					fprintf(stderr, "Couldn't request CQ notification\n");
-					return ret;
-				}
-			}
-			do
-			{
-				ne = mlx4_poll_ibv_cq(qp->split_send_cq, 1, &wc);
-			} while (ne == 0);
-
-			// <3> poll from split_cq for receiver's ACK
-			//printf("SENDER <3> poll from split_cq for receiver's ACK\n");
-			//fflush(stdout);
-			if (num_chunks_to_send > 0) {
-				if (SPLIT_USE_EVENT) {
-					ret = ibv_get_cq_event(qp->split_comp_channel2, &ev_cq, &ev_ctx);
-					if (ret)
-					{
-						fprintf(stderr, "Failed to get CQ event.\n");
-						return ret;
-					}
+	return mlx4_post_chunks(qp->split_qp[0], &qp->split_tmpl, c, n, 1);
+}
 
-					ibv_ack_cq_events(ev_cq, 1);
+static const struct split_sgl_ops split_chain_ops = {
+	.classify	= split_chain_classify,
+	.post		= split_chain_post,
+	.reap		= split_chain_reap,
+	.recut		= split_chain_recut,
+	.prime		= split_chain_prime,
+	.burst		= split_chain_burst,
+};
+#endif
 
-					ret = ibv_req_notify_cq(ev_cq, 0);
-					if (ret)
-					{
-						fprintf(stderr, "Couldn't request CQ notification\n");
-						return ret;
-					}
-				}
-				do
-				{
-					ne = mlx4_poll_ibv_cq(qp->split_cq2, 1, &wc);
-				} while (ne == 0);
-				// check if the message is ACK: (for debug)
-				if (qp->split_fc_msg[2].type == ACK) {
-					//printf("INDEED received ACK from receiver.\n");
-					//fflush(stdout);
-				} else if (qp->split_fc_msg[2].type == INFO) {
-					printf("NOT ACK BUT INFO!\n");
-					fflush(stdout);
-					return -1;
-				}
-				else {
-					printf("NOT ACK BUT something else!\n");
-					fflush(stdout);
-					return -1;
-				}
-			}
+//// Two-sided split (split_imm.h): tail chunks on split_qp[0], the head on
+//// the user QP, credits on split_qp2
+static int split_imm_post(void *ctx, int where, struct ibv_send_wr *wr)
+{
+	struct mlx4_qp *qp = ctx;
+	struct ibv_send_wr *bad_wr;
+
+	switch (where) {
+	case SPLIT_IMM_CHUNKS:
+		return mlx4_post_send_grant(qp->split_qp[0], wr, &bad_wr);
+	case SPLIT_IMM_FC:
+		return mlx4_post_send_ctl(qp->split_qp2, wr, &bad_wr);
+	default:
+		// called with qp->sq.lock held
+		return __mlx4_post_send(&qp->verbs_qp.qp, wr, &bad_wr);
+	}
+}
 
-			// <4> send using split_qp with the rest of the original message chunks
-			printf("SENDER <4> send using split_qp with the rest of the original message [%d] chunks\n", num_chunks_to_send);
-			fflush(stdout);
-			//printf("SENDER <4> send using split_qp with the rest of the original message chunks using a linked list of WRs\n");
-
-			//// Batch using a linked list of WRs
-			/* still some issue, fix later
-			struct ibv_send_wr *wr_head = NULL, *current_wr = NULL, *new_wr = NULL;
-			struct ibv_sge *sge;
-			//TODO: later deallocate the heap memory
-			int i;
-			int num_unsignaled = num_chunks_to_send - 1;
-			printf("num_unsignaled: %d\n", num_unsignaled);
-			for (i = 0; i < num_unsignaled; i++) {
-				new_wr = (struct ibv_send_wr *)malloc(sizeof(struct ibv_send_wr));
-				memset(new_wr, 0, sizeof(struct ibv_send_wr));
-				sge = (struct ibv_sge *)malloc(sizeof(struct ibv_sge));
-				new_wr->wr_id = i + 1;
-				new_wr->opcode = wr->opcode;
-				new_wr->sg_list = sge;
-				new_wr->num_sge = 1;
-				new_wr->send_flags = 0; //covered by memset though
-				new_wr->wr.rdma.remote_addr = wr->wr.rdma.remote_addr + split_chunk_size * i;
-				new_wr->wr.rdma.rkey = wr->wr.rdma.rkey;
-				sge->length = split_chunk_size;
-				sge->addr = wr->sg_list->addr + split_chunk_size * i;
-				sge->lkey = wr->sg_list->lkey;
-				printf("sge->addr:%" PRIu64 "\n", sge->addr);
-				if (wr_head == NULL) {
-					wr_head = new_wr;
-					current_wr = wr_head;
-				} else {
-					current_wr->next = new_wr;
-					current_wr = current_wr->next;
-				}
-			}
-			// Last one with flag SIGNALED
-			current_length -= split_chunk_size * num_unsignaled;
-			new_wr = (struct ibv_send_wr *)malloc(sizeof(struct ibv_send_wr));
-			memset(new_wr, 0, sizeof(struct ibv_send_wr));
-			sge = (struct ibv_sge *)malloc(sizeof(struct ibv_sge));
-			new_wr->wr_id = i + 1;
-			new_wr->opcode = wr->opcode;
-			new_wr->sg_list = sge;
-			new_wr->num_sge = 1;
-			new_wr->send_flags = IBV_SEND_SIGNALED;
-			new_wr->wr.rdma.remote_addr = wr->wr.rdma.remote_addr + split_chunk_size * i;
-			new_wr->wr.rdma.rkey = wr->wr.rdma.rkey;
-			sge->length = current_length;
-			sge->addr = wr->sg_list->addr + split_chunk_size * i;
-			sge->lkey = wr->sg_list->lkey;
-			printf("sge->addr:%" PRIu64 "\n", sge->addr);
-			if (i == 0) {
-				wr_head = new_wr;
-				fprintf(stderr, "WARNING: linked list size shouldn't be that small\n");
-			} else {
-				current_wr->next = new_wr;
-				current_wr = current_wr->next;
-				current_wr->next = NULL;
-			}
-			ret = __mlx4_post_send(qp->split_qp, wr_head, bad_wr);
-			if (ret != 0) {
-				errno = ret;
-				printf("DEBUG POST SEND REALLY BAD!!, errno = %d\n", errno);
-				goto out;
-			}
-			*/
-			//// End of using linked list
+static int split_imm_post_recv(void *ctx, int where, struct ibv_recv_wr *wr)
+{
+	struct mlx4_qp *qp = ctx;
+	struct ibv_recv_wr *bad_wr;
 
-			//wr->send_flags = wr->send_flags & (~(IBV_SEND_SIGNALED));
-			if (!SPLIT_USE_SELECTIVE_SIGNALING)
-			{
-				wr->send_flags = wr->send_flags | IBV_SEND_SIGNALED;
-			}
-			else
-			{
-				wr->send_flags = wr->send_flags & (~(IBV_SEND_SIGNALED));
-			}
+	return mlx4_post_recv(where == SPLIT_IMM_POOL ? qp->split_qp[0] : qp->split_qp2, wr, &bad_wr);
+}
 
-			// NOTE: if num_chunks_to_send = 0 here (which is possible), we will not post any WRs in the following loop.
-			while (num_chunks_to_send > 0)
-			{
+static int split_imm_poll(void *ctx, int where, struct ibv_wc *wc, int block)
+{
+	struct mlx4_qp *qp = ctx;
+	struct ibv_comp_channel *channel;
+	struct ibv_cq *cq;
+	int ne;
+
+	if (where == SPLIT_IMM_CHUNKS) {
+		cq = qp->split_send_cq;
+		channel = qp->split_comp_send_channel;
+	} else if (where == SPLIT_IMM_POOL) {
+		cq = qp->split_recv_cq;
+		channel = qp->split_comp_recv_channel;
+	} else {
+		cq = qp->split_cq2;
+		channel = qp->split_comp_channel2;
+	}
+	while (!(ne = mlx4_poll_ibv_cq(cq, 1, wc)) && block)
+		if (SPLIT_USE_EVENT && split_wait_event(channel))
+			return -EIO;
+	return ne;
+}
 
-				//printf("DEBUG POST SEND: posting rest SRs to split_qp. num_chunks_to_send = %d\n", num_chunks_to_send);
-				//printf("raddr:%" PRIu64 "\n", wr->wr.rdma.remote_addr);
-				//printf("sg_addr:%" PRIu64 "\n", wr->sg_list->addr);
-				//printf("rkey:%" PRIu32 "\n", wr->wr.rdma.rkey);
+const struct split_imm_ops mlx4_split_imm_ops = {
+	.post		= split_imm_post,
+	.post_recv	= split_imm_post_recv,
+	.poll		= split_imm_poll,
+};
 
-				current_length -= split_chunk_size;
-				wr->wr.rdma.remote_addr += split_chunk_size; // DC for SEND
-				wr->sg_list->addr += split_chunk_size;
+//// new version with both one-sided and two-sided verbs using split qp
+int mlx4_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
+				   struct ibv_send_wr **bad_wr)
+{
 
-				if (num_chunks_to_send == 1)
-				{
-					wr->sg_list->length = current_length;
-					// the last one has to be SIGNALED to synchronize. Otherwise we'll go to the next iteration directly.
-					wr->send_flags = wr->send_flags | IBV_SEND_SIGNALED;
-				}
+	struct mlx4_qp *qp = to_mqp(ibqp);
 
-				if (SPLIT_USE_NO_BATCH_2SIDED)
-				{
-					wr->send_flags = wr->send_flags | IBV_SEND_SIGNALED;
-				}
+	int ret = 0;
+	mlx4_lock(&qp->sq.lock);
 
-				//__mlx4_post_send(qp->split_qp, wr, bad_wr);
-				ret = __mlx4_post_send(qp->split_qp[0], wr, bad_wr);
-				if (ret != 0)
-				{
-					errno = ret;
-					fprintf(stderr, "DEBUG POST SEND REALLY BAD!!, errno = %d\n", errno);
-					goto out;
-				}
+	/* isolation: the first post after the QP was connected starts its flow */
+	if (unlikely(qp->flow_armed && qp->flow && !qp->flow->started))
+		pacer_flow_start(qp->flow, ibqp, wr);
+	/* isolation: note what kinds of WR the QP posts (flow_note()); a QP with
+	 * no declared class is also classified from them. A two-sided elephant in
+	 * a chain comes back here alone from split_chain_post() and counts twice,
+	 * only adding weight to its bw vote */
+	if (qp->flow && qp->flow->info) {
+		flow_note(qp->flow, wr);
+		if (qp->flow->auto_class)
+			flow_observe(qp->flow, wr);
+	}
+	/* end */
+
+#ifndef CPU_FRIENDLY
+	//// asynchronous split engine (split_engine.h): hand big one-sided WRs, and
+	//// anything posted behind them, to the progress thread and return
+	if (split_engine_inflight() && qp->split_qp[0]) {
+		while (unlikely(split_engine_busy(qp)) && !split_engine_can_queue(wr)) {
+			mlx4_unlock(&qp->sq.lock);
+			split_engine_drain(qp);
+			mlx4_lock(&qp->sq.lock);
+		}
+		ret = split_engine_error(qp);
+		if (unlikely(ret)) {
+			errno = ret;
+			*bad_wr = wr;
+			mlx4_unlock(&qp->sq.lock);
+			return ret;
+		}
+		if (unlikely(split_engine_busy(qp)) ||
+			(split_engine_should_split(qp, wr) && split_engine_can_queue(wr))) {
+			ret = split_engine_post(qp, wr, bad_wr);
+			mlx4_unlock(&qp->sq.lock);
+			return ret;
+		}
+	}
+#endif
+	/* the split engine is done with the QP: a class change the classifier
+	 * asked for, and a new kind of WR, apply from this post on */
+	flow_sync(qp->flow);
 
-				num_chunks_to_send--;
+	//// splitting logic
+	//// Update split chunk size
+	uint32_t split_chunk_size = sb ? (wr->opcode == IBV_WR_RDMA_READ ? __atomic_load_n(&sb->active_chunk_size_read, __ATOMIC_RELAXED)
+																	 : __atomic_load_n(&flow_vlink(qp->flow)->active_chunk_size, __ATOMIC_RELAXED))
+								   : SPLIT_CHUNK_SIZE;
+	//if (++GLOBAL_CNT % 100 == 0) {
+	//printf("DEBUG: POST SEND: split_chunk_size = %" PRIu32 "\n", split_chunk_size);
+	//	printf("DEBUG: POST SEND: split_chunk_size = %" PRIu32 " [%d]\n", split_chunk_size, GLOBAL_CNT);
+	//	fflush(stdout);
+	//}
+	//printf("DEBUG: POST SEND: split_chunk_size = %" PRIu32 "; msg size = %d [%d]\n", split_chunk_size, wr->sg_list->length, ++GLOBAL_CNT);
+	//fflush(stdout);
 
-				if (SPLIT_USE_NO_BATCH_2SIDED)
-				{
-					if (SPLIT_USE_EVENT)
-					{
-						ret = ibv_get_cq_event(qp->split_comp_send_channel, &ev_cq, &ev_ctx);
-						if (ret)
-						{
-							fprintf(stderr, "Failed to get CQ event.\n");
-							return ret;
-						}
+	int is_two_sided = 0;
+	if (wr->opcode == IBV_WR_RDMA_WRITE_WITH_IMM ||
+		wr->opcode == IBV_WR_SEND ||
+		wr->opcode == IBV_WR_SEND_WITH_IMM)
+	{
+		is_two_sided = 1;
+	}
 
-						ibv_ack_cq_events(ev_cq, 1);
+#ifndef CPU_FRIENDLY
+	//// WRITE/READ elephants over all of their SGEs and anywhere in the chain;
+	//// a two-sided WR posted alone still takes the path below
+	if (likely(qp->split_qp[0]) && (wr->next || !is_two_sided) &&
+		split_sgl_chain_splits(&split_chain_ops, qp, wr)) {
+		ret = split_sgl_post_chain(&split_chain_ops, qp, wr, bad_wr);
+		if (ret)
+			errno = ret;
+		mlx4_unlock(&qp->sq.lock);
+		return ret;
+	}
+#endif
 
-						ret = ibv_req_notify_cq(ev_cq, 0);
-						if (ret)
-						{
-							fprintf(stderr, "Couldn't request CQ notification\n");
-							return ret;
-						}
-					}
-					do
-					{
-						ne = mlx4_poll_ibv_cq(qp->split_send_cq, 1, &wc);
-						//printf("ne = %d\n", ne);
-					} while (ne == 0);
-				}
-			}
+	//// two-sided elephants: the tail goes ahead into the peer's bounce pool,
+	//// then the head on this QP (split_imm.h). Both ends need the pool,
+	//// which the manual QPN mode sets up at RTR
+	if (is_two_sided && !wr->next && qp->split_imm.pool && split_imm_splits(wr)) {
+		struct split_sgl_cut cut;
 
-			// <5> poll from the split_cq for all chunks to ensure the completion message has done transfering.
-			//printf("SENDER <5> poll from the split_cq for all chunks to ensure the completion message has done transfering.\n");
-			//printf("SENDER <5> Alternatively, post and poll without batch for all split chunks .\n");
-			//fflush(stdout);
-			//// All signalled
-			//TODO: if necessary, study the performance difference of polling multiple WCs at a time.
-			// Drawbacks of this is that you need to provide a big array of wc structs to pass in.
-			//printf("DEBUG POST_SEND: orig_num_chunks_to_send = %d\n", orig_num_chunks_to_send);
+#ifndef CPU_FRIENDLY
+		split_cut_of(qp, wr, &cut);
+#else
+		cut.chunk = split_chunk_size;
+		cut.batch = 1;
+		cut.signal = 1;
+#endif
+		ret = split_imm_send(&mlx4_split_imm_ops, qp, &qp->split_imm, wr, &cut);
+		if (ret) {
+			errno = ret;
+			*bad_wr = wr;
+		}
+		mlx4_unlock(&qp->sq.lock);
+		return ret;
+	}
 
-			if (!SPLIT_USE_NO_BATCH_2SIDED)
-			{
-				if (orig_num_chunks_to_send > 0)
-				{ //// only if we indeed sent out some chunks
-					if (SPLIT_USE_SELECTIVE_SIGNALING)
-					{
-						//// selective signalling to poll the wc of the last wr
-						if (SPLIT_USE_EVENT)
-						{
-							ret = ibv_get_cq_event(qp->split_comp_send_channel, &ev_cq, &ev_ctx);
-							if (ret)
-							{
-								fprintf(stderr, "Failed to get CQ event.\n");
-								return ret;
-							}
+	//// non-RC QPs have no split QP and are never split
+	if (likely(qp->split_qp[0]) && !is_two_sided && wr->sg_list->length > split_chunk_size)
+	{
 
-							ibv_ack_cq_events(ev_cq, 1);
+		//printf("[[[NEED TO SPLIT]]] [%d]\n", ++GLOBAL_CNT);
 
-							ret = ibv_req_notify_cq(ev_cq, 0);
-							if (ret)
-							{
-								fprintf(stderr, "Couldn't request CQ notification\n");
-								return ret;
-							}
-						}
-						do
-						{
-							ne = mlx4_poll_ibv_cq(qp->split_send_cq, 1, &wc);
-							//printf("ne = %d\n", ne);
-						} while (ne == 0);
-					}
-					else
-					{
-						int total_npolled = 0;
-						while (total_npolled < orig_num_chunks_to_send)
-						{
-							if (SPLIT_USE_EVENT)
-							{
-								ret = ibv_get_cq_event(qp->split_comp_send_channel, &ev_cq, &ev_ctx);
-								if (ret)
-								{
-									fprintf(stderr, "Failed to get CQ event.\n");
-									return ret;
-								}
-
-								ibv_ack_cq_events(ev_cq, 1);
-
-								ret = ibv_req_notify_cq(ev_cq, 0);
-								if (ret)
-								{
-									fprintf(stderr, "Couldn't request CQ notification\n");
-									return ret;
-								}
-							}
+		uint32_t num_chunks_to_send = 1;
+		uint32_t current_length = 0;
+		uint32_t orig_sge_length = 0;
+		int orig_send_flags = 0;
 
-							do
-							{
-								//ne += mlx4_poll_ibv_cq(qp->split_cq, num_wrs_to_split_qp, &wc);
-								ne = mlx4_poll_ibv_cq(qp->split_send_cq, 1, &wc);
-								//printf("ne = %d\n", ne);
-								total_npolled += ne;
-								//printf("total_npolled = %d\n", total_npolled);
-							} while (ne != 0);
-						}
-					}
-				}
-			}
+		current_length = wr->sg_list->length;
+		orig_sge_length = wr->sg_list->length;
+		orig_send_flags = wr->send_flags;
 
-			// <6> post another RR to split_qp for future splitting
-			//printf("SENDER <6> post another RR to split_qp for future splitting\n");
-			//fflush(stdout);
-
-			struct ibv_sge rsge;
-			struct ibv_recv_wr rwr;
-			struct ibv_recv_wr *bad_rwr;
-			memset(&rsge, 0, sizeof(rsge));
-			rsge.addr = (uintptr_t)&qp->split_fc_msg[2];
-			rsge.length = sizeof(struct Split_FC_message);
-			rsge.lkey = qp->split_fc_mr->lkey;
-			//printf("DDDDD: rsge.addr = %" PRIu64 "\n", rsge.addr);
-			//printf("DDDDD: rsge.length = %d \n", rsge.length);
-			//printf("DDDDD: rsge.lkey = %" PRIu32 "\n", rsge.lkey);
-
-			memset(&rwr, 0, sizeof(rwr));
-			rwr.wr_id = 0;
-			rwr.next = NULL;
-			rwr.sg_list = &rsge;
-			rwr.num_sge = 1;
-
-			ret2 = mlx4_post_recv(qp->split_qp2, &rwr, &bad_rwr);
-			if (ret2 != 0)
-			{
-				errno = ret2;
-				fprintf(stderr, "Failed to call mlx4_post_recv, errno = %d\n", errno);
-			}
+		// For two-sided ops, the first chunk still need to be what it is originally,
+		// because the user will poll the first one at the end
+		//////wr->send_flags = wr->send_flags & (~(IBV_SEND_SIGNALED));
+		//printf("IBV_SEND_SIGNALED: %d\n", IBV_SEND_SIGNALED);
 
-			//// Restore original qp before return
-			wr->wr.rdma.remote_addr = orig_raddr;
-			wr->sg_list->addr = orig_sge_addr;
-			wr->sg_list->length = orig_sge_length;
-			wr->send_flags = orig_send_flags;
-			mlx4_unlock(&qp->sq.lock);
+		//if (wr->opcode == IBV_WR_RDMA_WRITE_WITH_IMM ||
+		//	wr->opcode == IBV_WR_SEND ||
+		//	wr->opcode == IBV_WR_SEND_WITH_IMM) { 				//// two-sided op
 
-			return 0;
-		}
-		else if (wr->opcode == IBV_WR_RDMA_WRITE || wr->opcode == IBV_WR_RDMA_READ)
+		if (wr->opcode == IBV_WR_RDMA_WRITE || wr->opcode == IBV_WR_RDMA_READ)
 		{ // One-sided verbs
+			//// only reached with CPU_FRIENDLY; the default build cuts one-sided WRs
+			//// in split_sgl_post_chain() above
 
             //// Dynamically adjust the number of split QPs (for one-sided verbs)
             ////int num_split_qp = sb ? __atomic_load_n(&sb->num_active_split_qps, __ATOMIC_RELAXED) : SPLIT_QP_NUM_ONE_SIDED;
@@ -2201,8 +1905,6 @@ int mlx4_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
             int i, j, qp_idx;
             struct ibv_wc wc;
             int ne = 0;
-            struct ibv_cq *ev_cq;
-            void *ev_ctx;
 
 #ifdef CPU_FRIENDLY
             int split_idx = 0;
@@ -2210,7 +1912,6 @@ int mlx4_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
             int token_enforcement = 0;
             uint32_t virtual_link_cap = 0;
             double cpu_factor = 0;
-            char str;
             // assume split_chunk_size is never greater than SPLIT_BIG_CHUNK_SIZE but only less than or equal to it
             if (split_chunk_size < SPLIT_BIG_CHUNK_SIZE) {      // if token enforcement is needed
                 token_enforcement = 1;
@@ -2228,34 +1929,24 @@ int mlx4_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
                 num_wrs_to_split_qp = (num_big_chunks_to_send == 1) ? num_chunks_to_send - 1 : num_chunks_to_send;
                 //printf("num_wrs_to_split_qp at iteration %d = %d\n", split_idx, num_wrs_to_split_qp);
 
-                if (token_enforcement) {    // has to turn on pacer
-                    __atomic_store_n(&flow->pending, 1, __ATOMIC_RELAXED);
-                    virtual_link_cap = __atomic_load_n(&sb->virtual_link_cap, __ATOMIC_RELAXED);
-                    cpu_factor = cpu_factor_table[__atomic_load_n(&sb->split_level, __ATOMIC_RELAXED)];
+                if (token_enforcement && qp->flow && qp->flow->info) {    // has to turn on pacer
+                    flow_set_pending(qp->flow, flow_read_token(qp->flow, wr->opcode));
+                    virtual_link_cap = __atomic_load_n(&flow_vlink(qp->flow)->virtual_link_cap, __ATOMIC_RELAXED);
+                    cpu_factor = SPLIT_CPU_FACTOR;
                     //printf("cpu_factor = %.2f\n", cpu_factor);
 
                     //printf("virtual link cap = %u", virtual_link_cap);
-                    if (recv(flow_socket, &str, 1, 0) > 0) {
-                        //printf("received a token\n");
-                    } else {
-                        printf("Error in recving tokens. Exit\n");
-                        exit(1);
-                    }
+                    pacer_flow_token(qp->flow);
                 }
 #endif
 
                 //struct timeval tt1, tt2;
 				for (i = 0, j = 0; i < num_wrs_to_split_qp; i++, j++) {
 #ifdef CPU_FRIENDLY
-                    if (!token_enforcement) {   // has to turn on pacer
-                        __atomic_store_n(&flow->pending, 1, __ATOMIC_RELAXED);
+                    if (!token_enforcement && qp->flow && qp->flow->info) {   // has to turn on pacer
+                        flow_set_pending(qp->flow, flow_read_token(qp->flow, wr->opcode));
                         //gettimeofday(&tt1,NULL);
-                        if (recv(flow_socket, &str, 1, 0) > 0) {
-                            //printf("received a token\n");
-                        } else {
-                            printf("Error in recving tokens. Exit\n");
-                            exit(1);
-                        }
+                        pacer_flow_token(qp->flow);
                         //gettimeofday(&tt2,NULL);
                         //printf("elapsed time = %d us\n", (int)(tt2.tv_usec - tt1.tv_usec));
                     }
@@ -2301,7 +1992,7 @@ int mlx4_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
                         cycles_t start_cycle = get_cycles();
                         //while (get_cycles() - start_cycle < cpu_mhz * 5000 / 4400)
                         ////while (get_cycles() - start_cycle < cpu_mhz * split_chunk_size / 4400)
-                        ////virtual_link_cap = __atomic_load_n(&sb->virtual_link_cap, __ATOMIC_RELAXED);
+                        ////virtual_link_cap = __atomic_load_n(&flow_vlink()->virtual_link_cap, __ATOMIC_RELAXED);
                         while (get_cycles() - start_cycle < cpu_mhz * cpu_factor * split_chunk_size / virtual_link_cap)
                             cpu_relax();
                         //gettimeofday(&tt2,NULL);
@@ -2322,21 +2013,12 @@ int mlx4_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
 						//printf("indeed signalled; i = %d; var = %d\n", i, num_wrs_to_split_qp - num_split_qp);
 						if (SPLIT_USE_EVENT)
 						{
-							ret = ibv_get_cq_event(qp->split_comp_send_channel, &ev_cq, &ev_ctx);
+							ret = split_wait_event(qp->split_comp_send_channel);
 							if (ret)
 							{
 								fprintf(stderr, "Failed to get CQ event.\n");
 								return ret;
 							}
-
-							ibv_ack_cq_events(ev_cq, 1);
-
-							ret = ibv_req_notify_cq(ev_cq, 0);
-							if (ret)
-							{
-								fprintf(stderr, "Couldn't request CQ notification\n");
-								return ret;
-							}
 						}
 						//// selective signalling to poll the wc of the last wr
 						do
@@ -2445,27 +2127,16 @@ int mlx4_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
 				//// selective signalling to poll the wc of the last wr
 				struct ibv_wc wc;
 				int ne = 0;
-				struct ibv_cq *ev_cq;
-				void *ev_ctx;
 				if (SPLIT_USE_SELECTIVE_SIGNALING)
 				{
 					if (SPLIT_USE_EVENT)
 					{
-						ret = ibv_get_cq_event(qp->split_comp_send_channel, &ev_cq, &ev_ctx);
+						ret = split_wait_event(qp->split_comp_send_channel);
 						if (ret)
 						{
 							fprintf(stderr, "Failed to get CQ event.\n");
 							return ret;
 						}
-
-						ibv_ack_cq_events(ev_cq, 1);
-
-						ret = ibv_req_notify_cq(ev_cq, 0);
-						if (ret)
-						{
-							fprintf(stderr, "Couldn't request CQ notification\n");
-							return ret;
-						}
 					}
 					//// selective signalling to poll the wc of the last wr
 					do
@@ -2481,21 +2152,12 @@ int mlx4_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
 					{
 						if (SPLIT_USE_EVENT)
 						{
-							ret = ibv_get_cq_event(qp->split_comp_send_channel, &ev_cq, &ev_ctx);
+							ret = split_wait_event(qp->split_comp_send_channel);
 							if (ret)
 							{
 								fprintf(stderr, "Failed to get CQ event.\n");
 								return ret;
 							}
-
-							ibv_ack_cq_events(ev_cq, 1);
-
-							ret = ibv_req_notify_cq(ev_cq, 0);
-							if (ret)
-							{
-								fprintf(stderr, "Couldn't request CQ notification\n");
-								return ret;
-							}
 						}
 
 						do
@@ -3615,30 +3277,6 @@ out:
 	return ret;
 }
 
-////
-int rr_buffer_enqueue(struct rr_buffer *rr_buf, struct ibv_recv_wr *wr)
-{
-	unsigned int i = rr_buf->size;
-	struct ibv_recv_wr **new_slot;
-	if (i >= rr_buf->capacity)
-	{
-		rr_buf->capacity *= 2;
-		new_slot = realloc(rr_buf->slot, rr_buf->capacity * sizeof(struct ibv_recv_wr *));
-		if (!new_slot)
-		{
-			return -1;
-		}
-		rr_buf->slot = new_slot;
-	}
-	struct ibv_recv_wr *rwr = (struct ibv_recv_wr *)malloc(sizeof(struct ibv_recv_wr));
-	memcpy(rwr, wr, sizeof(struct ibv_recv_wr));
-	rr_buf->slot[i] = rwr;
-	rr_buf->size += 1;
-
-	return 0;
-}
-////
-
 int mlx4_post_recv(struct ibv_qp *ibqp, struct ibv_recv_wr *wr,
 				   struct ibv_recv_wr **bad_wr)
 {
@@ -3704,9 +3342,20 @@ int mlx4_post_recv(struct ibv_qp *ibqp, struct ibv_recv_wr *wr,
 		//if (!qp->split_qp_exchange_done) {
 		if (qp->split_qp_exchange_done == 0)
 		{ // 1 or -1(case where qpn is set manually) can bypass
-			if (rr_buffer_enqueue(&qp->rr_buf, wr))
+			if (!qp->rr_buf.capacity)
+			{
+				//// one allocation for the QP's lifetime, as large as its RQ
+				ret = rr_ring_init(&qp->rr_buf, qp->rq.wqe_cnt, qp->rq.max_gs);
+				if (ret)
+				{
+					*bad_wr = wr;
+					goto out;
+				}
+				__atomic_fetch_add(&to_mctx(ibqp->context)->split_pool.rr_bufs, 1, __ATOMIC_RELAXED);
+			}
+			ret = rr_ring_push(&qp->rr_buf, wr, bad_wr);
+			if (ret)
 			{
-				ret = 1;
 				fprintf(stderr, "Error adding wr to RR_buffer\n");
 				goto out;
 			}
@@ -0,0 +1,100 @@
+#ifndef RR_RING_H
+#define RR_RING_H
+//// Ring of receive requests held back while a QP is at INIT
+//
+// RRs posted to a user QP before its split QPN exchange are lost when the
+// exchange resets the QP, so mlx4_post_recv() keeps a copy of each until
+// rr_buffer_post_and_clear() (verbs.c) posts them again. The copies used to
+// be a malloc'd ibv_recv_wr per RR (whose sg_list still pointed at the
+// caller's, possibly reused, SGEs) in a slot array grown by realloc. They
+// now go into a ring of wqe_cnt slots, each a WR and max_gs SGEs, taken
+// with a single allocation the first time the QP buffers an RR: the RQ
+// cannot hold more than that either, so the ring never grows, and buffering
+// an RR is two copies. rr_ring_chain() links the buffered slots into one
+// chain for a single post_recv. rdma_pacer/rr_bench counts the allocations
+// per RR of both and times them.
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <infiniband/verbs.h>
+
+struct rr_ring {
+	struct ibv_recv_wr	*wr;		// capacity slots; NULL until the first RR
+	struct ibv_sge		*sge;		// max_sge per slot, behind the slots
+	unsigned int		head;		// oldest buffered RR
+	unsigned int		size;		// RRs buffered
+	unsigned int		capacity;	// power of two, the RQ's wqe_cnt
+	int			max_sge;
+};
+
+static inline int rr_ring_init(struct rr_ring *r, unsigned int capacity, int max_sge)
+{
+	if (!capacity || (capacity & (capacity - 1)) || max_sge < 1)
+		return EINVAL;
+	r->wr = malloc(capacity * (sizeof(*r->wr) + max_sge * sizeof(*r->sge)));
+	if (!r->wr)
+		return ENOMEM;
+	r->sge = (struct ibv_sge *)(r->wr + capacity);
+	r->head = 0;
+	r->size = 0;
+	r->capacity = capacity;
+	r->max_sge = max_sge;
+	return 0;
+}
+
+static inline void rr_ring_destroy(struct rr_ring *r)
+{
+	free(r->wr);
+	r->wr = NULL;
+	r->capacity = 0;
+}
+
+// copy the chain wr into the ring, all of it or (with *bad_wr = wr) none
+static inline int rr_ring_push(struct rr_ring *r, struct ibv_recv_wr *wr,
+			       struct ibv_recv_wr **bad_wr)
+{
+	struct ibv_recv_wr *w;
+	unsigned int n = 0, i;
+	int ret = EINVAL;
+
+	for (w = wr; w; w = w->next, ++n)
+		if (w->num_sge > r->max_sge || w->num_sge < 0)
+			goto bad;
+	ret = ENOMEM;
+	if (n > r->capacity - r->size)
+		goto bad;
+	for (w = wr; w; w = w->next) {
+		i = (r->head + r->size++) & (r->capacity - 1);
+		r->wr[i].wr_id = w->wr_id;
+		r->wr[i].next = NULL;
+		r->wr[i].sg_list = r->sge + (size_t)i * r->max_sge;
+		r->wr[i].num_sge = w->num_sge;
+		memcpy(r->wr[i].sg_list, w->sg_list, w->num_sge * sizeof(*w->sg_list));
+	}
+	return 0;
+bad:
+	*bad_wr = wr;
+	return ret;
+}
+
+// link the buffered RRs, oldest first, into one chain; NULL if none
+static inline struct ibv_recv_wr *rr_ring_chain(struct rr_ring *r)
+{
+	unsigned int k, i, j;
+
+	for (k = 0; k < r->size; ++k) {
+		i = (r->head + k) & (r->capacity - 1);
+		j = (i + 1) & (r->capacity - 1);
+		r->wr[i].next = k + 1 < r->size ? &r->wr[j] : NULL;
+	}
+	return r->size ? &r->wr[r->head & (r->capacity - 1)] : NULL;
+}
+
+// forget the buffered RRs once they are posted
+static inline void rr_ring_clear(struct rr_ring *r)
+{
+	r->head = (r->head + r->size) & (r->capacity - 1);
+	r->size = 0;
+}
+
+#endif
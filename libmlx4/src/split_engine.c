@@ -0,0 +1,467 @@
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "split_engine.h"
+#include "split_pool.h"
+#include "pacer.h"
+
+#ifndef CPU_FRIENDLY
+
+enum { SPLIT_WAIT, SPLIT_TOKEN, SPLIT_MOVED, SPLIT_DONE, SPLIT_FAILED };
+
+// token grants kept in flight per QP; JUSTITIA_SPLIT_INFLIGHT, 0 turns the engine off
+int split_engine_inflight(void)
+{
+	static int inflight = -1;
+
+	if (unlikely(inflight < 0))
+		inflight = getenv("JUSTITIA_SPLIT_INFLIGHT") ? atoi(getenv("JUSTITIA_SPLIT_INFLIGHT")) : SPLIT_ENG_DEF_INFLIGHT;
+	return inflight;
+}
+
+// same chunk size mlx4_post_send() would split with, on qp's virtual link
+uint32_t split_chunk_size_of(struct mlx4_qp *qp, struct ibv_send_wr *wr)
+{
+	if (!sb)
+		return SPLIT_CHUNK_SIZE;
+	return wr->opcode == IBV_WR_RDMA_READ ? __atomic_load_n(&sb->active_chunk_size_read, __ATOMIC_RELAXED)
+					      : __atomic_load_n(&flow_vlink(qp->flow)->active_chunk_size, __ATOMIC_RELAXED);
+}
+
+// signal every quarter of the split QP's SQ: with two signaled chunks
+// outstanding and a postlist of at most half the SQ on top, it cannot overflow
+int split_signal_of(struct mlx4_qp *sqp)
+{
+	return sqp->sq.max_post / 4 > 1 ? sqp->sq.max_post / 4 : 1;
+}
+
+// how mlx4_post_send() would cut wr now: the link's chunk size and the
+// chunks one token covers (its split_batch; READs are paced per chunk), read
+// as one pair, the batch at most half of the split QP's SQ so signaling can
+// keep up. The pacer may change them at any time, so this is asked again
+// before every postlist of a message
+void split_cut_of(struct mlx4_qp *qp, const struct ibv_send_wr *wr, struct split_sgl_cut *cut)
+{
+	struct mlx4_qp *sqp = to_mqp(qp->split_qp[0]);
+	uint32_t batch = 1;
+
+	if (!sb)
+		cut->chunk = SPLIT_CHUNK_SIZE;
+	else if (wr->opcode == IBV_WR_RDMA_READ)
+		cut->chunk = __atomic_load_n(&sb->active_chunk_size_read, __ATOMIC_RELAXED);
+	else
+		vlink_cut(flow_vlink(qp->flow), &cut->chunk, &batch);
+	if (batch > SPLIT_SGL_MAX_BATCH)
+		batch = SPLIT_SGL_MAX_BATCH;
+	if ((int)batch > sqp->sq.max_post / 2)
+		batch = sqp->sq.max_post / 2;
+	cut->batch = batch < 1 ? 1 : batch;
+	cut->signal = split_signal_of(sqp);
+}
+
+// one-sided and over the chunk size: the engine splits it
+int split_engine_should_split(struct mlx4_qp *qp, struct ibv_send_wr *wr)
+{
+	return (wr->opcode == IBV_WR_RDMA_WRITE || wr->opcode == IBV_WR_RDMA_READ) &&
+	       split_sgl_bytes(wr) > split_chunk_size_of(qp, wr);
+}
+
+// whether every WR of the chain can be copied into a descriptor
+int split_engine_can_queue(struct ibv_send_wr *wr)
+{
+	for (; wr; wr = wr->next) {
+		if (wr->send_flags & IBV_SEND_INLINE)
+			return 0;		// the user may reuse the buffer as soon as we return
+		if (wr->num_sge > SPLIT_ENG_MAX_SGE)
+			return 0;
+		if (split_imm_splits(wr))
+			return 0;		// two-sided split waits for its chunks (split_imm.h)
+	}
+	return 1;
+}
+
+static void split_kick(struct split_engine *eng)
+{
+	uint64_t one = 1;
+
+	eng->kicked = 1;
+	if (eng->sleeping && write(eng->wake_fd, &one, sizeof(one)) < 0)
+		perror("split engine: kick");
+}
+
+// a chunk or a post failed: move the user QP to error, as the hardware
+// would have done had the WR failed on it, and post every queued WR on it
+// again, signaled, so that each one completes with IBV_WC_WR_FLUSH_ERR on the
+// user's send CQ. WRs queued after this are flushed the same way on the next
+// pass. The first failure is also returned by the next post.
+static int split_fail(struct split_engine *eng, struct mlx4_qp *qp, int err)
+{
+	struct split_queue *q = &qp->split_q;
+	struct ibv_qp_attr attr = { .qp_state = IBV_QPS_ERR };
+	struct ibv_send_wr wr, *bad_wr;
+	struct split_desc *d;
+	int n;
+
+	if (!q->failed) {
+		q->failed = 1;
+		__atomic_store_n(&q->err, err, __ATOMIC_RELAXED);
+		if (__mlx4_modify_qp(&qp->verbs_qp.qp, &attr, IBV_QP_STATE))
+			fprintf(stderr, "split engine: cannot move QP %06x to error\n", qp->verbs_qp.qp.qp_num);
+		if (qp->flow)
+			qp->flow->asked = 0;	// the grant, if any, goes to whoever asks next
+	}
+	// the descriptors queued so far; the user may append more meanwhile
+	pthread_mutex_lock(&eng->lock);
+	for (n = 0, d = q->head; d; d = d->next, n++)
+		d->flushed = 1;
+	pthread_mutex_unlock(&eng->lock);
+	for (d = q->head; n--; d = d->next) {
+		wr = d->wr;
+		wr.send_flags |= IBV_SEND_SIGNALED;
+		if (mlx4_post_send_ctl(&qp->verbs_qp.qp, &wr, &bad_wr))
+			fprintf(stderr, "split engine: cannot flush WR %" PRIu64 "\n", wr.wr_id);
+	}
+	return SPLIT_FAILED;
+}
+
+// post as much of qp's head descriptor as the window allows and reap its
+// completions; the last piece goes on the user's QP once every chunk is done.
+// Each postlist is the chunks of one token and only its last is signaled;
+// wr_id counts chunks, so a completion retires its whole postlist. A token
+// is never waited for here: the postlist is cut, charged if the pacer has
+// granted the token asked for (mlx4_flow_try_charge()) and put back
+// otherwise, and the engine goes on with its other QPs.
+static int split_progress(struct split_engine *eng, struct mlx4_qp *qp, struct split_desc *d)
+{
+	struct split_queue *q = &qp->split_q;
+	struct mlx4_qp *sqp = to_mqp(qp->split_qp[0]);
+	struct ibv_wc wc[SPLIT_ENG_POLL_BATCH];
+	struct ibv_send_wr swr[SPLIT_SGL_MAX_BATCH], *bad_swr;
+	struct ibv_sge sge[SPLIT_SGL_MAX_BATCH][SPLIT_SGL_MAX_SGE];
+	struct split_sgl_chunk ch[SPLIT_SGL_MAX_BATCH];
+	struct split_sgl_cut cut;
+	struct split_sgl it;
+	uint64_t bytes;
+	int ne, i, n, window, ret, moved = 0;
+
+	if (q->failed)
+		return split_fail(eng, qp, 0);
+	flow_sync(qp->flow);	// we charge the flow while the QP has queued work
+	if (q->inflight) {
+		ne = mlx4_poll_ibv_cq(qp->split_send_cq, SPLIT_ENG_POLL_BATCH, wc);
+		if (ne < 0) {
+			fprintf(stderr, "split engine: poll split cq failed\n");
+			return split_fail(eng, qp, EIO);
+		}
+		for (i = 0; i < ne; i++) {
+			if (wc[i].status != IBV_WC_SUCCESS) {
+				fprintf(stderr, "split engine: chunk failed: %s\n", ibv_wc_status_str(wc[i].status));
+				return split_fail(eng, qp, EIO);
+			}
+		}
+		if (ne) {
+			d->completed = wc[ne - 1].wr_id;
+			q->inflight = d->posted - d->completed;
+		}
+		moved = ne;
+	}
+
+	// JUSTITIA_SPLIT_INFLIGHT token grants in flight; each postlist ends
+	// signaled, so the rest of the message may take a new chunk size
+	split_cut_of(qp, &d->wr, &cut);
+	if (d->chunk_size && split_sgl_more(&d->it, cut.chunk))
+		d->chunk_size = cut.chunk;
+	window = eng->inflight * cut.batch < sqp->sq.max_post ? eng->inflight * cut.batch : sqp->sq.max_post;
+	while (d->chunk_size && split_sgl_more(&d->it, d->chunk_size) && q->inflight < window) {
+		it = d->it;
+		for (n = 0, bytes = 0; n < cut.batch && q->inflight + n < window &&
+			    split_sgl_more(&d->it, d->chunk_size); n++) {
+			if (d->use_tmpl) {
+				bytes += split_sgl_next_1(&d->it, d->chunk_size, &ch[n]);
+				ch[n].wr_id = d->posted + n + 1;
+				ch[n].signaled = 0;
+				continue;
+			}
+			bytes += split_sgl_next(&d->it, d->chunk_size, SPLIT_SGL_MAX_SGE, &swr[n], sge[n]);
+			swr[n].wr_id = d->posted + n + 1;
+			swr[n].send_flags &= ~IBV_SEND_SIGNALED;
+			if (n)
+				swr[n - 1].next = &swr[n];
+		}
+		if (!mlx4_flow_try_charge(qp->flow, d->wr.opcode, n, bytes, 0)) {
+			d->it = it;		// cut again once the token is here
+			return moved ? SPLIT_MOVED : SPLIT_TOKEN;
+		}
+		if (d->use_tmpl) {
+			ch[n - 1].signaled = 1;
+			ret = mlx4_post_chunks(qp->split_qp[0], &d->tmpl, ch, n, 2);
+		} else {
+			swr[n - 1].send_flags |= IBV_SEND_SIGNALED;
+			ret = mlx4_post_send_ctl(qp->split_qp[0], swr, &bad_swr);
+		}
+		if (ret) {
+			fprintf(stderr, "split engine: error posting to split qp, errno = %d\n", ret);
+			return split_fail(eng, qp, ret);
+		}
+		d->posted += n;
+		q->inflight += n;
+		moved = 1;
+	}
+	if (d->completed < d->posted || (d->chunk_size && split_sgl_more(&d->it, d->chunk_size)))
+		return moved ? SPLIT_MOVED : SPLIT_WAIT;
+
+	it = d->it;
+	if (d->chunk_size) {
+		bytes = split_sgl_next(&d->it, d->chunk_size, SPLIT_SGL_MAX_SGE, &swr[0], sge[0]);
+	} else {
+		swr[0] = d->wr;
+		bytes = split_sgl_bytes(&d->wr);
+	}
+	if (!mlx4_flow_try_charge(qp->flow, d->wr.opcode, 1, bytes, 1)) {
+		d->it = it;
+		return moved ? SPLIT_MOVED : SPLIT_TOKEN;
+	}
+	ret = mlx4_post_send_ctl(&qp->verbs_qp.qp, &swr[0], &bad_swr);
+	if (ret) {
+		fprintf(stderr, "split engine: error posting to user qp, errno = %d\n", ret);
+		return split_fail(eng, qp, ret);
+	}
+	return SPLIT_DONE;
+}
+
+// called with eng->lock held; all: every descriptor split_fail() flushed.
+// Unlinks qp once its queue is empty
+static void split_retire(struct split_engine *eng, struct mlx4_qp *qp, int all)
+{
+	struct split_queue *q = &qp->split_q;
+	struct split_desc *d;
+	struct mlx4_qp **pp;
+
+	do {
+		d = q->head;
+		q->head = d->next;
+		free(d);
+		__atomic_sub_fetch(&q->pending, 1, __ATOMIC_RELEASE);
+	} while (all && q->head && q->head->flushed);
+	if (q->head)
+		return;
+	q->tail = NULL;
+	q->inflight = 0;
+	for (pp = &eng->active; *pp != qp; pp = &(*pp)->split_q.next_active)
+		;
+	*pp = q->next_active;
+	pthread_cond_broadcast(&eng->idle);
+}
+
+// nothing moved: sleep until a completion event, a kick, or stop; called
+// and returns with eng->lock held. Every split CQ of the context reports to
+// the one shared channel (split_pool.h), where an inline split may take the
+// engine's event, so with chunks in flight the wait is bounded. A grant
+// raises no event, so while a QP waits for a token the thread only yields.
+static void split_sleep(struct split_engine *eng, int token)
+{
+	struct pollfd fds[2];
+	struct ibv_comp_channel *channel = NULL;
+	struct mlx4_qp *qp;
+	uint64_t val;
+	int n = 1, timeout = -1;
+
+	if (eng->kicked || eng->stop)
+		return;
+	fds[0].fd = eng->wake_fd;
+	fds[0].events = POLLIN;
+	for (qp = eng->active; qp; qp = qp->split_q.next_active) {
+		if (qp->split_q.inflight) {
+			channel = qp->split_comp_send_channel;
+			break;
+		}
+	}
+	if (token || (channel && !SPLIT_USE_EVENT)) {
+		pthread_mutex_unlock(&eng->lock);
+		cpu_relax();
+		pthread_mutex_lock(&eng->lock);
+		return;
+	}
+	if (channel) {
+		fds[1].fd = channel->fd;
+		fds[1].events = POLLIN;
+		n = 2;
+		timeout = SPLIT_EVENT_TIMEOUT_MS;
+	}
+
+	eng->sleeping = 1;
+	pthread_mutex_unlock(&eng->lock);
+	if (poll(fds, n, timeout) < 0 && errno != EINTR)
+		perror("split engine: poll");
+	if (fds[0].revents & POLLIN && read(eng->wake_fd, &val, sizeof(val)) < 0)
+		perror("split engine: read");
+	// same dance as the inline split: ack the event and re-arm before polling
+	if (n > 1 && fds[1].revents & POLLIN && split_wait_event(channel))
+		fprintf(stderr, "Failed to get CQ event.\n");
+	pthread_mutex_lock(&eng->lock);
+	eng->sleeping = 0;
+}
+
+static void *split_engine_run(void *arg)
+{
+	struct split_engine *eng = arg;
+	struct mlx4_qp *qp, *next;
+	struct split_desc *d;
+	int r, moved, token;
+
+	pthread_mutex_lock(&eng->lock);
+	while (!eng->stop) {
+		eng->kicked = 0;
+		moved = 0;
+		token = 0;
+		for (qp = eng->active; qp; qp = next) {
+			d = qp->split_q.head;
+			pthread_mutex_unlock(&eng->lock);
+			r = split_progress(eng, qp, d);
+			pthread_mutex_lock(&eng->lock);
+			next = qp->split_q.next_active;
+			if (r == SPLIT_DONE || r == SPLIT_FAILED)
+				split_retire(eng, qp, r == SPLIT_FAILED);
+			moved |= r != SPLIT_WAIT && r != SPLIT_TOKEN;
+			token |= r == SPLIT_TOKEN;
+		}
+		if (!moved)
+			split_sleep(eng, token);
+	}
+	pthread_mutex_unlock(&eng->lock);
+	return NULL;
+}
+
+static struct split_engine *split_engine_get(struct mlx4_context *ctx)
+{
+	struct split_engine *eng;
+
+	pthread_mutex_lock(&ctx->split_eng_mtx);
+	eng = ctx->split_eng;
+	if (eng)
+		goto out;
+	eng = calloc(1, sizeof(*eng));
+	if (!eng)
+		goto out;
+	eng->inflight = split_engine_inflight();
+	eng->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (eng->wake_fd < 0) {
+		perror("split engine: eventfd");
+		goto err;
+	}
+	pthread_mutex_init(&eng->lock, NULL);
+	pthread_cond_init(&eng->idle, NULL);
+	if (pthread_create(&eng->thread, NULL, split_engine_run, eng)) {
+		fprintf(stderr, "split engine: cannot start the progress thread\n");
+		close(eng->wake_fd);
+		goto err;
+	}
+	ctx->split_eng = eng;
+	goto out;
+err:
+	free(eng);
+	eng = NULL;
+out:
+	pthread_mutex_unlock(&ctx->split_eng_mtx);
+	return eng;
+}
+
+// queue the chain behind whatever qp already has queued; called with
+// qp->sq.lock held, after split_engine_can_queue(wr)
+int split_engine_post(struct mlx4_qp *qp, struct ibv_send_wr *wr, struct ibv_send_wr **bad_wr)
+{
+	struct split_engine *eng = split_engine_get(to_mctx(qp->verbs_qp.qp.context));
+	struct split_queue *q = &qp->split_q;
+	struct split_desc *d;
+
+	for (; wr; wr = wr->next) {
+		if (!eng || __atomic_load_n(&q->pending, __ATOMIC_RELAXED) >= qp->sq.max_post || !(d = malloc(sizeof(*d)))) {
+			*bad_wr = wr;
+			errno = ENOMEM;
+			return ENOMEM;
+		}
+		d->next = NULL;
+		d->wr = *wr;
+		d->wr.next = NULL;
+		d->wr.sg_list = d->sge;
+		memcpy(d->sge, wr->sg_list, wr->num_sge * sizeof(*wr->sg_list));
+		d->chunk_size = split_engine_should_split(qp, wr) ? split_chunk_size_of(qp, wr) : 0;
+		split_sgl_init(&d->it, &d->wr);
+		d->use_tmpl = d->chunk_size && !mlx4_split_tmpl_init(qp->split_qp[0], &d->wr, &d->tmpl);
+		d->posted = 0;
+		d->completed = 0;
+		d->flushed = 0;
+
+		pthread_mutex_lock(&eng->lock);
+		if (q->tail) {
+			q->tail->next = d;
+		} else {
+			q->head = d;
+			q->next_active = eng->active;
+			eng->active = qp;
+			split_kick(eng);
+		}
+		q->tail = d;
+		__atomic_add_fetch(&q->pending, 1, __ATOMIC_RELEASE);
+		pthread_mutex_unlock(&eng->lock);
+	}
+	return 0;
+}
+
+// wait until the engine has posted everything qp queued
+void split_engine_drain(struct mlx4_qp *qp)
+{
+	struct split_engine *eng = to_mctx(qp->verbs_qp.qp.context)->split_eng;
+
+	if (!eng)
+		return;
+	pthread_mutex_lock(&eng->lock);
+	while (qp->split_q.pending)
+		pthread_cond_wait(&eng->idle, &eng->lock);
+	pthread_mutex_unlock(&eng->lock);
+}
+
+void split_engine_destroy(struct mlx4_context *ctx)
+{
+	struct split_engine *eng = ctx->split_eng;
+
+	if (!eng)
+		return;
+	pthread_mutex_lock(&eng->lock);
+	eng->stop = 1;
+	eng->sleeping = 1;		// kick even if it is not in poll() yet
+	split_kick(eng);
+	pthread_mutex_unlock(&eng->lock);
+	pthread_join(eng->thread, NULL);
+	close(eng->wake_fd);
+	pthread_mutex_destroy(&eng->lock);
+	pthread_cond_destroy(&eng->idle);
+	free(eng);
+	ctx->split_eng = NULL;
+}
+
+#else
+
+int split_engine_inflight(void)
+{
+	return 0;
+}
+
+void split_engine_drain(struct mlx4_qp *qp)
+{
+}
+
+void split_engine_destroy(struct mlx4_context *ctx)
+{
+}
+
+#endif
@@ -0,0 +1,85 @@
+#ifndef SPLIT_ENGINE_H
+#define SPLIT_ENGINE_H
+//// Asynchronous split engine
+//
+// A one-sided WR larger than the chunk size used to be split inside
+// mlx4_post_send(): every chunk went to split_qp[0] and the caller waited for
+// its completion (and a token) before posting the next one, all under
+// qp->sq.lock. Instead the WR is now copied into a split_desc and handed to a
+// per-context progress thread, and mlx4_post_send() returns right away.
+//
+// The thread keeps up to JUSTITIA_SPLIT_INFLIGHT token grants' worth of
+// chunks of a QP's head descriptor on split_qp[0] (each postlist of
+// split_batch chunks waits for one token in mlx4_post_send_grant), and once
+// they have all completed posts the last piece on the user's QP with the
+// original wr_id and send flags, so the user's completion means the whole
+// message landed. Token waits do not block: a QP whose token has not come
+// yet is passed over until it has. The chunk size and batch are read again before every
+// postlist (split_cut_of()), so when the pacer changes them in the middle
+// of a long message the rest of it is cut the new way. While a QP has queued work every WR posted behind it is
+// queued too, which keeps the order the user QP sees. Chunks are cut over
+// the whole gather list (split_sgl.h); only the last chunk of a postlist is
+// signaled, and those of a single-SGE WR are written from a WQE template
+// (split_wqe.h). WRs the engine cannot copy (inline data, more than
+// SPLIT_ENG_MAX_SGE SGEs, two-sided splits) wait for the queue to drain and
+// go the synchronous way. If a chunk fails, the user QP is moved to error
+// and every queued WR completes with IBV_WC_WR_FLUSH_ERR on its send CQ.
+//
+// Not used with CPU_FRIENDLY, whose token recv and rate spin stay inline.
+#include <pthread.h>
+#include "mlx4.h"
+#include "split_sgl.h"
+
+#define SPLIT_ENG_DEF_INFLIGHT	4	//// token grants in flight per QP; JUSTITIA_SPLIT_INFLIGHT=0 splits inline as before
+#define SPLIT_ENG_MAX_SGE	16	//// SGEs a queued WR may carry
+#define SPLIT_ENG_POLL_BATCH	16
+
+struct split_desc {
+	struct split_desc	*next;
+	struct ibv_send_wr	wr;		// copy of the user's WR; sg_list points at sge, next is NULL
+	struct ibv_sge		sge[SPLIT_ENG_MAX_SGE];
+	uint32_t		chunk_size;	// 0: not split, posted as is on the user QP
+	struct split_sgl	it;		// what is left of wr for split_qp[0]; the last piece goes on the user QP
+	struct split_wqe_tmpl	tmpl;		// chunks of a single-SGE wr (split_wqe.h)
+	int			use_tmpl;
+	uint32_t		posted;
+	uint32_t		completed;
+	int			flushed;	// posted again on the user QP in error (split_fail())
+};
+
+struct split_engine {
+	pthread_t		thread;
+	pthread_mutex_t		lock;		// split_queues and the active list
+	pthread_cond_t		idle;		// broadcast when a QP's queue empties
+	int			wake_fd;	// eventfd; kicks the thread out of poll()
+	int			sleeping;
+	int			kicked;		// new work since the thread last looked
+	int			stop;
+	int			inflight;
+	struct mlx4_qp		*active;	// QPs with queued work
+};
+
+int split_engine_inflight(void);
+int split_engine_can_queue(struct ibv_send_wr *wr);
+int split_engine_should_split(struct mlx4_qp *qp, struct ibv_send_wr *wr);
+uint32_t split_chunk_size_of(struct mlx4_qp *qp, struct ibv_send_wr *wr);
+int split_signal_of(struct mlx4_qp *sqp);
+void split_cut_of(struct mlx4_qp *qp, const struct ibv_send_wr *wr, struct split_sgl_cut *cut);
+int split_engine_post(struct mlx4_qp *qp, struct ibv_send_wr *wr, struct ibv_send_wr **bad_wr);
+void split_engine_drain(struct mlx4_qp *qp);
+void split_engine_destroy(struct mlx4_context *ctx);
+
+static inline int split_engine_busy(struct mlx4_qp *qp)
+{
+	return __atomic_load_n(&qp->split_q.pending, __ATOMIC_ACQUIRE) != 0;
+}
+
+// the engine's error for this QP, if any; cleared once reported
+static inline int split_engine_error(struct mlx4_qp *qp)
+{
+	if (likely(!__atomic_load_n(&qp->split_q.err, __ATOMIC_RELAXED)))
+		return 0;
+	return __atomic_exchange_n(&qp->split_q.err, 0, __ATOMIC_RELAXED);
+}
+
+#endif
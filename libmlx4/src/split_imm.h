@@ -0,0 +1,115 @@
+// Two-sided split without a handshake; identical copies in rdma_pacer/,
+// libmlx4/src/ and libmlx5-41mlnx1/src/
+//
+// A SEND, SEND_WITH_IMM or WRITE_WITH_IMM of SPLIT_IMM_BUF bytes or more is
+// split into a head, its first SPLIT_IMM_BUF bytes, and a tail. The tail
+// goes ahead on the split QP, chunk by chunk; the head follows on the user
+// QP with the original flags and wr_id, so the receiver's completion still
+// is the head's. No INFO message, no ACK, no RR posted on demand.
+//  - The head is always a SEND_WITH_IMM or WRITE_WITH_IMM whose immediate is
+//    SPLIT_IMM_HEAD, the message's sequence number and SPLIT_IMM_HEAD_MAGIC.
+//    That, not its length, is how a receiver knows a head: a peer that does
+//    not split may well send 64 KB. The user's immediate moves to the LAST.
+//  - SEND tail chunks are SEND_WITH_IMM into a pool of SPLIT_IMM_RRS bounce
+//    buffers of SPLIT_IMM_BUF bytes that the receiver keeps posted on its
+//    split QP. The receiver copies each into the head's scatter list, right
+//    behind the bytes before it, and posts the buffer again.
+//  - WRITE_WITH_IMM tail chunks are plain WRITEs behind the head's remote
+//    address.
+//  - Every tail ends with a SPLIT_IMM_LAST_LEN-byte SEND_WITH_IMM into the
+//    pool: the tail's length, the user's immediate and whether it has one.
+// The immediate of every pool message says what it is, SPLIT_IMM_DATA or
+// SPLIT_IMM_LAST, with the message's sequence number and the chunk's index,
+// both checked.
+// Each pool message takes one credit. The sender starts with SPLIT_IMM_RRS;
+// the receiver gives them back as a 0-byte SEND_WITH_IMM SPLIT_IMM_CREDIT
+// on the second split QP (split_qp2), once half the pool is to be returned.
+// The sender waits for credits only when it has none, and it posts the head
+// before that wait if part of the tail is out: the receiver drains the pool
+// (and so returns credits) only behind a head, so the head then comes first
+// and the receiver picks up the rest of the tail as it streams in.
+// split_imm_recv() never waits unless asked to: it takes what has landed and
+// says EAGAIN until the LAST has, so a driver holds the head's completion
+// back, hands out the others meanwhile and tries again on the next poll.
+// rdma_pacer/split2_check runs both directions of this over a simulated QP
+// pair.
+#ifndef SPLIT_IMM_H
+#define SPLIT_IMM_H
+
+#include <stdint.h>
+#include <arpa/inet.h>
+#include <infiniband/verbs.h>
+#include "split_sgl.h"
+
+#define SPLIT_IMM_BUF (64 * 1024)   /* head length, pool buffer size and the largest SEND tail chunk */
+#define SPLIT_IMM_RRS 32            /* pool RRs per QP, i.e. the peer's credits */
+#define SPLIT_IMM_FC_RRS 4          /* credit RRs on split_qp2; at most two credit messages wait for the sender */
+#define SPLIT_IMM_MAX_SGE 32        /* scatter/gather entries of a split WR, mlx4's max_sge */
+
+enum {
+    SPLIT_IMM_DATA,
+    SPLIT_IMM_LAST,
+    SPLIT_IMM_CREDIT,
+    SPLIT_IMM_HEAD,
+};
+
+/* type:2 | seq:8 | val:22, big endian as in ibv_send_wr.imm_data */
+#define SPLIT_IMM_MAKE(type, seq, val) \
+    htonl(((uint32_t)(type) << 30) | (((uint32_t)(seq) & 0xff) << 22) | ((uint32_t)(val) & 0x3fffff))
+#define SPLIT_IMM_TYPE(imm) (ntohl(imm) >> 30)
+#define SPLIT_IMM_SEQ(imm) ((ntohl(imm) >> 22) & 0xff)
+#define SPLIT_IMM_VAL(imm) (ntohl(imm) & 0x3fffff)
+#define SPLIT_IMM_HEAD_MAGIC 0x2a5e17   /* val of a head's immediate */
+#define SPLIT_IMM_IS_HEAD(imm) \
+    (SPLIT_IMM_TYPE(imm) == SPLIT_IMM_HEAD && SPLIT_IMM_VAL(imm) == SPLIT_IMM_HEAD_MAGIC)
+#define SPLIT_IMM_LAST_LEN 16       /* be64 tail length, the user's imm, be32 1 if it has one */
+
+/* where the ops post and poll */
+enum {
+    SPLIT_IMM_CHUNKS,               /* split QP, send side: tail chunks (paced) */
+    SPLIT_IMM_POOL,                 /* split QP, receive side: the bounce pool */
+    SPLIT_IMM_USER,                 /* user QP: the head */
+    SPLIT_IMM_FC,                   /* split_qp2, both sides: credits (not paced) */
+};
+
+struct split_imm_ops {
+    int (*post)(void *ctx, int where, struct ibv_send_wr *wr);
+    int (*post_recv)(void *ctx, int where, struct ibv_recv_wr *wr);
+    /* 1 and *wc if there is a completion, 0 if not and !block, <0 on error */
+    int (*poll)(void *ctx, int where, struct ibv_wc *wc, int block);
+};
+
+/* per QP; credits and fc_inflight are also touched by whichever side polls
+ * split_qp2 first, the rest by the sender or by the receiver alone */
+struct split_imm {
+    char *pool;                     /* SPLIT_IMM_RRS * SPLIT_IMM_BUF; NULL: no split */
+    uint32_t lkey;
+    int credits;                    /* pool buffers of the peer we may fill */
+    int fc_inflight;                /* credit messages not yet completed */
+    uint8_t tx_seq;
+    uint8_t rx_seq;
+    int to_return;                  /* pool buffers posted again, not yet credited */
+    int rx_busy;                    /* a head is waiting for its tail */
+    uint32_t rx_idx;                /* next pool message of its tail */
+    uint64_t rx_got;                /* bytes of the message so far */
+    int rx_err;
+};
+
+/* a split message, once its LAST has landed */
+struct split_imm_msg {
+    uint32_t byte_len;              /* the whole message */
+    uint32_t imm;                   /* the sender's, as in ibv_wc.imm_data */
+    int with_imm;
+};
+
+int split_imm_init(const struct split_imm_ops *ops, void *ctx, struct split_imm *st,
+                   void *pool, uint32_t lkey);
+int split_imm_splits(const struct ibv_send_wr *wr);
+int split_imm_send(const struct split_imm_ops *ops, void *ctx, struct split_imm *st,
+                   struct ibv_send_wr *wr, const struct split_sgl_cut *cut);
+int split_imm_recv(const struct split_imm_ops *ops, void *ctx, struct split_imm *st,
+                   uint32_t head_imm, int wimm, const struct ibv_sge *scat, int nscat,
+                   int block, struct split_imm_msg *msg);
+int split_imm_fc_poll(const struct split_imm_ops *ops, void *ctx, struct split_imm *st, int block);
+
+#endif
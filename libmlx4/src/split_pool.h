@@ -0,0 +1,50 @@
+#ifndef SPLIT_POOL_H
+#define SPLIT_POOL_H
+//// Split resources shared across user QPs
+//
+// Split QPs and split CQs are not pooled yet; each RC QP creates its own.
+// With MANUAL_SPLIT_QPN_DIFF the peer derives their QPNs from the user QPN,
+// so they are created right before it. The exchange at RTR would let a QP
+// pick up pooled ones, but the two-sided split keeps its bounce RRs,
+// credits and message numbers on split_qp[0]/split_qp2, the engine and the
+// inline paths poll the QP's own split CQs, and a split QP only reaches MRs
+// in its remote peer's PD, so both ends would have to agree on a pairing.
+// What is shared:
+//  - one completion channel per context instead of three per QP. Its fd is
+//    non-blocking, and split_wait_event() replaces get/ack/re-arm: a waiter
+//    may now pick up (and re-arm) another QP's event, so it only waits
+//    SPLIT_EVENT_TIMEOUT_MS before polling its CQ anyway;
+//  - the Split_FC_message buffers, carved out of per-PD slabs of
+//    SPLIT_FC_SLAB_QPS QPs that sit behind a single MR;
+//  - the rr_buffer (rr_ring.h), allocated by the first RR that has to be
+//    buffered.
+// The bounce pool of the two-sided split (split_imm.h) stays per QP: the
+// peer's credits are counted against it.
+// Non-RC QPs get no split resources at all, and the pacer is attached once
+// per process (verbs.c). JUSTITIA_SPLIT_POOL_STATS=1 prints what was created
+// and what was saved when the context is closed.
+#include "mlx4.h"
+
+#define SPLIT_FC_SLAB_QPS	256
+#define SPLIT_FC_MSGS		4	//// per QP; the QPN exchange sends and receives at once
+#define SPLIT_EVENT_TIMEOUT_MS	1
+
+struct split_fc_slab {
+	struct split_fc_slab	*next;
+	struct ibv_mr		*mr;
+	int			used;
+	uint8_t			taken[SPLIT_FC_SLAB_QPS];
+	struct Split_FC_message	msg[SPLIT_FC_SLAB_QPS][SPLIT_FC_MSGS];
+};
+
+void split_pool_init(struct mlx4_context *ctx);
+void split_pool_destroy(struct mlx4_context *ctx);
+struct ibv_comp_channel *split_pool_channel(struct mlx4_context *ctx);
+int split_pool_fc_get(struct mlx4_qp *qp, struct ibv_pd *pd);
+void split_pool_fc_put(struct mlx4_qp *qp);
+int split_pool_imm_get(struct mlx4_qp *qp, struct ibv_pd *pd, void **pool);
+void split_pool_imm_put(struct mlx4_qp *qp);
+void split_pool_free_pd(struct ibv_pd *pd);
+int split_wait_event(struct ibv_comp_channel *channel);
+
+#endif
@@ -0,0 +1,102 @@
+// Byte-exact chunking of a one-sided WR over all of its SGEs; identical
+// copies in rdma_pacer/, libmlx4/src/, libmlx5-41mlnx1/src/ and
+// libsimverbs/src/
+//
+// The drivers used to split a WRITE/READ by sg_list[0] alone. An iterator
+// now walks the whole gather list: each chunk is a copy of the WR whose
+// sg_list covers the next `len` bytes, cut at any offset inside an SGE and
+// spanning as many SGEs as it needs (up to the max_sge given), and whose
+// remote_addr is the WR's plus the bytes already handed out. Zero-length
+// SGEs are skipped.
+//
+// split_sgl_post_chain() applies this to a whole WR chain for the inline
+// split: every WR the driver marks SPLIT_SGL_CHUNKS goes to the split QP in
+// postlists of cut.batch chunks, the chunks one token covers, so each costs
+// one token wait and one doorbell. Only every cut.signal-th chunk and the
+// last one are signaled, and a postlist is held back while two signaled
+// chunks are outstanding. The WR's last piece (at most one chunk) goes to
+// the user QP with the original wr_id and flags once they all completed.
+// A driver that sets ops.recut is asked for the cut again after every
+// postlist, so a chunk size the pacer changes in the middle of a long
+// message applies from the next postlist on.
+// A driver that can write a chunk straight into its send queue sets
+// ops.prime and ops.burst: chunks of a single-SGE WR then go out as
+// struct split_sgl_chunk (addresses and length only) and the driver patches
+// them into a WQE template it built once for the WR, instead of getting a
+// full ibv_send_wr per chunk. Runs of WRs that need nothing are posted to
+// the user QP as one postlist, in chain order. rdma_pacer/split_check checks
+// these properties against a mock post function and random gather lists and
+// chains, without a device.
+#ifndef SPLIT_SGL_H
+#define SPLIT_SGL_H
+
+#include <stdint.h>
+#include <infiniband/verbs.h>
+
+#define SPLIT_SGL_MAX_SGE 4         /* SGEs per chunk, i.e. the split QP's max_send_sge; a chunk is cut short at the last one */
+#define SPLIT_SGL_MAX_BATCH 64      /* chunks per postlist; must match SPLIT_MAX_BATCH in rdma_pacer/pacer.h */
+
+enum {
+    SPLIT_SGL_USER,                 /* post as is on the user QP */
+    SPLIT_SGL_CHUNKS,               /* cut into chunks for the split QP */
+    SPLIT_SGL_ALONE,                /* post on its own through the driver's single-WR path */
+};
+
+/* how to cut a SPLIT_SGL_CHUNKS WR */
+struct split_sgl_cut {
+    uint32_t chunk;                 /* bytes per chunk */
+    int batch;                      /* chunks per postlist, 1..SPLIT_SGL_MAX_BATCH */
+    int signal;                     /* signal every signal-th chunk (and the last) */
+};
+
+/* a chunk of a single-SGE WR: all that changes from one chunk to the next */
+struct split_sgl_chunk {
+    uint64_t raddr;
+    uint64_t addr;
+    uint32_t length;
+    int signaled;
+    uint64_t wr_id;
+};
+
+struct split_sgl_ops {
+    /* one of the above; fills *cut for SPLIT_SGL_CHUNKS */
+    int (*classify)(void *ctx, struct ibv_send_wr *wr, struct split_sgl_cut *cut);
+    /* where: SPLIT_SGL_CHUNKS posts one postlist to the split QP after one
+     * token wait for all of it, the others as classified */
+    int (*post)(void *ctx, int where, struct ibv_send_wr *wr, struct ibv_send_wr **bad_wr);
+    /* optional: refresh *cut between two postlists of wr; the signal
+     * interval counts on across the change */
+    void (*recut)(void *ctx, const struct ibv_send_wr *wr, struct split_sgl_cut *cut);
+    /* wait for the next signaled chunk on the split QP */
+    int (*reap)(void *ctx);
+    /* optional: build the split QP's WQE template for a single-SGE wr,
+     * 0 if it can take burst() */
+    int (*prime)(void *ctx, const struct ibv_send_wr *wr);
+    /* post n chunks from the primed template as one postlist, like post() */
+    int (*burst)(void *ctx, const struct split_sgl_chunk *c, int n);
+};
+
+struct split_sgl {
+    const struct ibv_send_wr *wr;
+    int idx;                        /* current SGE */
+    uint32_t off;                   /* bytes of sg_list[idx] already handed out */
+    uint64_t done;                  /* bytes handed out */
+    uint64_t total;
+};
+
+uint64_t split_sgl_bytes(const struct ibv_send_wr *wr);
+void split_sgl_init(struct split_sgl *it, const struct ibv_send_wr *wr);
+uint32_t split_sgl_next(struct split_sgl *it, uint32_t len, int max_sge,
+                        struct ibv_send_wr *swr, struct ibv_sge *sge);
+uint32_t split_sgl_next_1(struct split_sgl *it, uint32_t len, struct split_sgl_chunk *c);
+int split_sgl_more(const struct split_sgl *it, uint32_t chunk);
+int split_sgl_chain_splits(const struct split_sgl_ops *ops, void *ctx, struct ibv_send_wr *wr);
+int split_sgl_post_chain(const struct split_sgl_ops *ops, void *ctx,
+                         struct ibv_send_wr *wr, struct ibv_send_wr **bad_wr);
+
+static inline uint64_t split_sgl_left(const struct split_sgl *it)
+{
+    return it->total - it->done;
+}
+
+#endif
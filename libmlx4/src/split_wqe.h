@@ -0,0 +1,63 @@
+#ifndef SPLIT_WQE_H
+#define SPLIT_WQE_H
+//// WQE template for split chunks
+//
+// The chunks of a split WRITE/READ differ only in remote address, local
+// address and length; opcode, rkey, lkey, flags and WQE size are the same
+// for all of them. Posting each one through __mlx4_post_send() still builds
+// an ibv_send_wr and walks post_send_one -> set_common_segments ->
+// set_data_seg. Instead mlx4_split_tmpl_init() (qp.c) fills a template once
+// per message, and mlx4_post_chunks() writes each chunk into the ring with
+// split_wqe_emit(): ctrl, raddr and one data segment, the way the burst
+// family's send_pending() writes a send. Only single-SGE messages on an RC
+// split QP take this path (split_sgl.h, ops.prime/ops.burst).
+// rdma_pacer/wqe_bench runs both against a fake SQ ring in memory and checks
+// that they write the same WQEs.
+//
+// Needs wmb() and htonll() from the includer (mlx4.h).
+#include <stdint.h>
+#include "wqe.h"
+#include "split_sgl.h"
+
+#define SPLIT_WQE_DS ((sizeof(struct mlx4_wqe_ctrl_seg) + sizeof(struct mlx4_wqe_raddr_seg) + \
+		       sizeof(struct mlx4_wqe_data_seg)) / 16)
+
+struct split_wqe_tmpl {
+	uint32_t	owner_opcode;		// opcode, big endian; the owner bit is added per WQE
+	uint32_t	srcrb_flags[2];		// unsignaled, signaled
+	uint32_t	rkey;			// big endian
+	uint32_t	lkey;			// big endian
+	uint8_t		fence_size;
+	uint8_t		inl;			// what post_send_connected() reports to ring_db (READ)
+};
+
+// write chunk c into the WQE at wqe; byte_owner is the owner bit with
+// MLX4_WQE_FORMAT and 0 without, as SET_BYTE_COUNT() does
+static inline void split_wqe_emit(void *wqe, const struct split_wqe_tmpl *t,
+				  const struct split_sgl_chunk *c,
+				  uint32_t owner_bit, uint32_t byte_owner) __attribute__((always_inline));
+static inline void split_wqe_emit(void *wqe, const struct split_wqe_tmpl *t,
+				  const struct split_sgl_chunk *c,
+				  uint32_t owner_bit, uint32_t byte_owner)
+{
+	struct mlx4_wqe_ctrl_seg *ctrl = wqe;
+	struct mlx4_wqe_raddr_seg *rseg = (struct mlx4_wqe_raddr_seg *)(ctrl + 1);
+	struct mlx4_wqe_data_seg *dseg = (struct mlx4_wqe_data_seg *)(rseg + 1);
+
+	rseg->raddr = htonll(c->raddr);
+	rseg->rkey = t->rkey;
+	rseg->reserved = 0;
+	dseg->lkey = t->lkey;
+	dseg->addr = htonll(c->addr);
+	// data visible before byte_count, see set_ptr_data()
+	wmb();
+	dseg->byte_count = htonl(c->length) | byte_owner;
+	ctrl->srcrb_flags = t->srcrb_flags[c->signaled];
+	ctrl->imm = 0;
+	ctrl->fence_size = t->fence_size;
+	// descriptor written before the owner bit, see set_ctrl_seg()
+	wmb();
+	ctrl->owner_opcode = t->owner_opcode | owner_bit;
+}
+
+#endif
@@ -60,14 +60,11 @@
 /* isolation */
 #include "pacer.h"
 #include "get_clock.h"
-struct flow_info *flow = NULL;
+#include "split_engine.h"
+#include "split_pool.h"
 struct shared_block *sb = NULL;
-int start_flag = 0;
 int registered = 0;
-unsigned int slot = 0;
 //int start_recv = 0;
-int num_active_small_flows = 0;
-int num_active_big_flows = 0;
 #ifdef CPU_FRIENDLY
 double cpu_mhz = 0;
 #endif
@@ -195,6 +192,7 @@ struct ibv_pd *mlx4_alloc_pd(struct ibv_context *context)
 	pd = malloc(sizeof *pd);
 	if (!pd)
 		return NULL;
+	pd->split_fc_slabs = NULL;
 
 	if (ibv_cmd_alloc_pd(context, &pd->ibv_pd, &cmd, sizeof cmd,
 			     &resp.ibv_resp, sizeof resp)) {
@@ -217,9 +215,7 @@ int mlx4_free_pd(struct ibv_pd *pd)
 
 	//printf("calling free pd?\n");
 	//// cleanup split_fc_mr
-	if (mlx4_dereg_mr(to_mpd(pd)->split_fc_mr)) {
-		printf("error dereg split_fc_mr.\n");
-	}
+	split_pool_free_pd(pd);
 
 	ret = ibv_cmd_dealloc_pd(pd);
 	//printf("DEBUG free pd: ret = %d\n", ret);
@@ -939,6 +935,7 @@ int mlx4_destroy_cq(struct ibv_cq *cq)
 		mlx4_free_buf_huge(to_mctx(cq->context), &to_mcq(cq)->buf);
 	else
 		mlx4_free_buf(&to_mcq(cq)->buf);
+	free(to_mcq(cq)->split_held);
 	free(to_mcq(cq));
 
 	return 0;
@@ -1091,17 +1088,6 @@ struct ibv_qp *mlx4_create_qp_ex(struct ibv_context *context,
 	return mlx4_exp_create_qp(context, (struct ibv_exp_qp_init_attr *)attr);
 }
 
-////
-int rr_buffer_init(struct rr_buffer *rr_buf, unsigned int cap) {
-	rr_buf->slot = (struct ibv_recv_wr **)malloc(cap * sizeof(struct ibv_recv_wr *));
-	if (!rr_buf->slot) { return -1; }
-	rr_buf->capacity = cap;
-	rr_buf->size = 0;
-
-	return 0;
-}
-////
-
 //// original mlx4_create_qp is here
 struct ibv_qp *__mlx4_create_qp(struct ibv_pd *pd, struct ibv_qp_init_attr *attr)
 {
@@ -1125,61 +1111,126 @@ struct ibv_qp *__mlx4_create_qp(struct ibv_pd *pd, struct ibv_qp_init_attr *attr
 }
 ////
 
-struct ibv_qp *mlx4_create_qp(struct ibv_pd *pd, struct ibv_qp_init_attr *attr)
+//// attach to the pacer; once per process, however many QPs it creates
+static void pacer_attach(struct split_pool *pool)
 {
-	//// create custom cq used for two-sided rdma message splitting
-	//struct ibv_comp_channel *channel = ibv_create_comp_channel(pd->context);
-	struct ibv_comp_channel *send_channel = ibv_create_comp_channel(pd->context);
-	struct ibv_comp_channel *recv_channel = ibv_create_comp_channel(pd->context);
-	struct ibv_comp_channel *channel2 = ibv_create_comp_channel(pd->context);
-	struct ibv_cq *split_send_cq = mlx4_create_cq(pd->context, SPLIT_MAX_CQE, send_channel, 0);
-	struct ibv_cq *split_recv_cq = mlx4_create_cq(pd->context, SPLIT_MAX_CQE, recv_channel, 0);
-	struct ibv_cq *split_cq2 = mlx4_create_cq(pd->context, SPLIT_MAX_CQE, channel2, 0);
-	//// arm split_cq for completion events
-	//mlx4_arm_cq(split_cq, 0);
-
-	//// create a custom qp for our own use 
-	struct ibv_qp_init_attr split_init_attr, split_init_attr2;
-	memset(&split_init_attr, 0, sizeof(struct ibv_qp_init_attr));
-	split_init_attr.send_cq = split_send_cq;
-	split_init_attr.recv_cq = split_recv_cq;
-	split_init_attr.cap.max_send_wr  = SPLIT_MAX_SEND_WR;
-	split_init_attr.cap.max_recv_wr  = SPLIT_MAX_RECV_WR;
-	split_init_attr.cap.max_send_sge = 1;
-	split_init_attr.cap.max_recv_sge = 1;
-	split_init_attr.cap.max_inline_data = 100;	// probably not going to use inline there
-	split_init_attr.qp_type = IBV_QPT_RC;
-	split_init_attr.qp_context = (void *)1;
-	memcpy(&split_init_attr2, &split_init_attr, sizeof(struct ibv_qp_init_attr));
-	split_init_attr2.send_cq = split_cq2;
-	split_init_attr2.recv_cq = split_cq2;
+	static pthread_mutex_t attach_mtx = PTHREAD_MUTEX_INITIALIZER;
+	int fd_shm;
 
-	struct ibv_qp 		*qp;
-	struct ibv_qp 		*split_qp[MAX_SPLIT_QP_NUM_ONE_SIDED];
-	struct ibv_qp 		*split_qp2;			// temporarily used in 2-sided
-	split_qp2 = __mlx4_create_qp(pd, &split_init_attr2);
-	if (split_qp2 == NULL) {
-		printf("Create split qp2 failed. %s\n", strerror(errno));
+	pthread_mutex_lock(&attach_mtx);
+	if (registered) {
+		pthread_mutex_unlock(&attach_mtx);
+		__atomic_fetch_add(&pool->pacer_attach_skipped, 1, __ATOMIC_RELAXED);
+		return;
 	}
-	printf("DEBUG mlx4_create_qp: split_qp->qpn = %06x\n", split_qp2->qp_num);
+	registered = 1;
 
-	int i;
-	//for (i = 0; i < MAX_SPLIT_QP_NUM_ONE_SIDED; i++) {
-	for (i = MAX_SPLIT_QP_NUM_ONE_SIDED - 1; i >= 0 ; i--) {
-		split_qp[i] = __mlx4_create_qp(pd, &split_init_attr);
-		if (split_qp[i]) {
-			printf("DEBUG mlx4_create_qp: split_qp[%d]->qpn = %06x\n", i, split_qp[i]->qp_num);
+	/* isolation */
+	if ((fd_shm = shm_open(pacer_shm_name(), O_RDWR, 0600)) == -1){
+		printf("@@@Pacer's shared memory is not found. Pacer won't be used.\n");
+	} else {
+		/* set up signal handler */
+	    struct sigaction new_action, old_action;
+	    new_action.sa_handler = termination_handler;
+	    sigemptyset(&new_action.sa_mask);
+	    new_action.sa_flags = 0;
+
+	    sigaction(SIGINT, NULL, &old_action);
+	    if (old_action.sa_handler != SIG_IGN)
+	        sigaction(SIGINT, &new_action, NULL);
+
+	    sigaction(SIGHUP, NULL, &old_action);
+	    if (old_action.sa_handler != SIG_IGN)
+	        sigaction(SIGHUP, &new_action, NULL);
+
+	    sigaction(SIGTERM, NULL, &old_action);
+	    if (old_action.sa_handler != SIG_IGN)
+	        sigaction(SIGTERM, &new_action, NULL);
+	    /* end */
+		atexit(set_inactive_on_exit);
+
+		sb = mmap(NULL, sizeof(struct shared_block), PROT_WRITE | PROT_READ,
+			MAP_SHARED, fd_shm, 0);
+		close(fd_shm);
+		/* a v1 pacer has flows[0] at offset 0, which never reads as a valid version */
+		if (sb == MAP_FAILED || sb->abi_version != JUSTITIA_ABI_VERSION) {
+			printf("@@@Pacer's shared memory ABI does not match (driver ABI %d). Pacer won't be used.\n",
+				JUSTITIA_ABI_VERSION);
+			if (sb != MAP_FAILED)
+				munmap(sb, sizeof(struct shared_block));
+			sb = NULL;
 		} else {
-			fprintf(stderr, "Error creating Split QP #%d\n", i + 1);
-			return NULL;
+			//// each RC QP joins on its first post (pacer_flow_start)
+			pacer_init();
+		}
+	}
+	/* end */
+	pthread_mutex_unlock(&attach_mtx);
+}
+
+struct ibv_qp *mlx4_create_qp(struct ibv_pd *pd, struct ibv_qp_init_attr *attr)
+{
+	struct split_pool *pool = &to_mctx(pd->context)->split_pool;
+	struct ibv_comp_channel *channel = NULL;
+	struct ibv_cq *split_send_cq = NULL, *split_recv_cq = NULL, *split_cq2 = NULL;
+	struct ibv_qp 		*qp;
+	struct ibv_qp 		*split_qp[MAX_SPLIT_QP_NUM_ONE_SIDED] = { NULL };
+	struct ibv_qp 		*split_qp2 = NULL;			// temporarily used in 2-sided
+	//// only RC QPs are ever split (split_pool.h); others get no split resources
+	int is_rc = attr->qp_type == IBV_QPT_RC;
+	int i;
+
+	//// before the split QPs: their sizes come from the pacer
+	pacer_attach(pool);
+	if (is_rc) {
+		//// create custom cq used for two-sided rdma message splitting
+		//// all on the context's shared completion channel
+		channel = split_pool_channel(to_mctx(pd->context));
+		split_send_cq = mlx4_create_cq(pd->context, PACER_TUNABLE(split_cqe, SPLIT_MAX_CQE), channel, 0);
+		split_recv_cq = mlx4_create_cq(pd->context, PACER_TUNABLE(split_cqe, SPLIT_MAX_CQE), channel, 0);
+		split_cq2 = mlx4_create_cq(pd->context, PACER_TUNABLE(split_cqe, SPLIT_MAX_CQE), channel, 0);
+		//// arm split_cq for completion events
+		//mlx4_arm_cq(split_cq, 0);
+
+		//// create a custom qp for our own use 
+		struct ibv_qp_init_attr split_init_attr, split_init_attr2;
+		memset(&split_init_attr, 0, sizeof(struct ibv_qp_init_attr));
+		split_init_attr.send_cq = split_send_cq;
+		split_init_attr.recv_cq = split_recv_cq;
+		split_init_attr.cap.max_send_wr  = PACER_TUNABLE(split_send_wr, SPLIT_MAX_SEND_WR);
+		split_init_attr.cap.max_recv_wr  = PACER_TUNABLE(split_recv_wr, SPLIT_MAX_RECV_WR);
+		split_init_attr.cap.max_send_sge = SPLIT_SGL_MAX_SGE;	// a chunk may straddle SGEs (split_sgl.h)
+		split_init_attr.cap.max_recv_sge = 1;
+		split_init_attr.cap.max_inline_data = 100;	// probably not going to use inline there
+		split_init_attr.qp_type = IBV_QPT_RC;
+		split_init_attr.qp_context = (void *)1;
+		memcpy(&split_init_attr2, &split_init_attr, sizeof(struct ibv_qp_init_attr));
+		split_init_attr2.send_cq = split_cq2;
+		split_init_attr2.recv_cq = split_cq2;
+
+		split_qp2 = __mlx4_create_qp(pd, &split_init_attr2);
+		if (split_qp2 == NULL) {
+			printf("Create split qp2 failed. %s\n", strerror(errno));
+		}
+		printf("DEBUG mlx4_create_qp: split_qp->qpn = %06x\n", split_qp2->qp_num);
+
+		//for (i = 0; i < MAX_SPLIT_QP_NUM_ONE_SIDED; i++) {
+		for (i = MAX_SPLIT_QP_NUM_ONE_SIDED - 1; i >= 0 ; i--) {
+			split_qp[i] = __mlx4_create_qp(pd, &split_init_attr);
+			if (split_qp[i]) {
+				printf("DEBUG mlx4_create_qp: split_qp[%d]->qpn = %06x\n", i, split_qp[i]->qp_num);
+			} else {
+				fprintf(stderr, "Error creating Split QP #%d\n", i + 1);
+				return NULL;
+			}
 		}
 	}
 
 	//// Now create the user's qp
 	qp = __mlx4_create_qp(pd, attr);
-	printf("DEBUG mlx4_create_qp: orig_qp->qpn = %06x\n", qp->qp_num);
 	//// store split_qp & split_cq inside the user's qp
 	if (qp) {
+		printf("DEBUG mlx4_create_qp: orig_qp->qpn = %06x\n", qp->qp_num);
 		struct mlx4_qp *mqp = to_mqp(qp);
 		for (i = 0; i < MAX_SPLIT_QP_NUM_ONE_SIDED; i++) {
 			mqp->split_qp[i] = split_qp[i];
@@ -1188,17 +1239,19 @@ struct ibv_qp *mlx4_create_qp(struct ibv_pd *pd, struct ibv_qp_init_attr *attr)
 		mqp->split_cq2 = split_cq2;
 		mqp->split_send_cq = split_send_cq;
 		mqp->split_recv_cq = split_recv_cq;
-		mqp->split_comp_send_channel = send_channel;
-		mqp->split_comp_recv_channel = recv_channel;
-		mqp->split_comp_channel2 = channel2;
-		//// register mr for two-sided splitting header message
-		//// register size * 2 since in split qpn exchange we need mr for send & recv at the same time
-		mqp->split_fc_mr = mlx4_reg_mr(pd, &mqp->split_fc_msg, 4 * sizeof(struct Split_FC_message), IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE);
-		//// add in pd for later deletion
-		to_mpd(pd)->split_fc_mr = mqp->split_fc_mr;
-		//// initalize recv request buffer
-		rr_buffer_init(&mqp->rr_buf, RR_BUFFER_INIT_CAP);
-		if (MANUAL_SPLIT_QPN_DIFF) {
+		mqp->split_comp_send_channel = channel;
+		mqp->split_comp_recv_channel = channel;
+		mqp->split_comp_channel2 = channel;
+		if (is_rc) {
+			//// two-sided splitting header messages, from the PD's shared MR
+			if (split_pool_fc_get(mqp, pd)) {
+				fprintf(stderr, "Error registering split FC messages\n");
+				mlx4_destroy_qp(qp);
+				return NULL;
+			}
+		}
+		//// the recv request buffer is allocated by the first RR it holds
+		if (MANUAL_SPLIT_QPN_DIFF || !is_rc) {
 			mqp->split_qp_exchange_done = -1;
 		} else {
 			mqp->split_qp_exchange_done = 0;
@@ -1211,8 +1264,10 @@ struct ibv_qp *mlx4_create_qp(struct ibv_pd *pd, struct ibv_qp_init_attr *attr)
 		if (mqp->isSmall == 1) {			// 1 means lat-sensitive; 2 means tput-sensitive
 			mqp->orig_send_cq = to_mcq(attr->send_cq);
 			mqp->orig_send_cq->wr_timestamps = queue_init(TIMESTAMP_QUEUE_CAP);
-#ifdef DRIVER_USE_CMH
-			mqp->orig_send_cq->cmh = CMH_Init(CMH_WIDTH, CMH_DEPTH, CMH_U, CMH_GRAN, CMH_WINDOW_SIZE);
+#ifdef DRIVER_USE_LATQ
+			mqp->orig_send_cq->lat_hist = malloc(sizeof(struct latq));
+			if (mqp->orig_send_cq->lat_hist)
+				latq_init(mqp->orig_send_cq->lat_hist, LATQ_WINDOW);
 #endif
 		} else {
 			mqp->orig_send_cq = NULL;
@@ -1226,41 +1281,18 @@ struct ibv_qp *mlx4_create_qp(struct ibv_pd *pd, struct ibv_qp_init_attr *attr)
 	}
 	////
 
-	/* isolation */
-	int fd_shm;
-	if ((fd_shm = shm_open(SHARED_MEM_NAME, O_RDWR, 0600)) == -1){
-		printf("@@@Pacer's shared memory is not found. Pacer won't be used.\n");
-	} else {
-		if (!registered) {
-			registered = 1;
-			/* set up signal handler */
-		    struct sigaction new_action, old_action;
-		    new_action.sa_handler = termination_handler;
-		    sigemptyset(&new_action.sa_mask);
-		    new_action.sa_flags = 0;
-
-		    sigaction(SIGINT, NULL, &old_action);
-		    if (old_action.sa_handler != SIG_IGN)
-		        sigaction(SIGINT, &new_action, NULL);
-
-		    sigaction(SIGHUP, NULL, &old_action);
-		    if (old_action.sa_handler != SIG_IGN)
-		        sigaction(SIGHUP, &new_action, NULL);
-
-		    sigaction(SIGTERM, NULL, &old_action);
-		    if (old_action.sa_handler != SIG_IGN)
-		        sigaction(SIGTERM, &new_action, NULL);
-		    /* end */
-			atexit(set_inactive_on_exit);
-		}
-		sb = mmap(NULL, sizeof(struct shared_block), PROT_WRITE | PROT_READ,
-			MAP_SHARED, fd_shm, 0);
-		contact_pacer(1);
-		flow = &sb->flows[slot];
-		printf("@@@At slot %d.\n", slot);
-	}
-	/* end */
-
+	pthread_mutex_lock(&pool->lock);
+	if (is_rc)
+		pool->rc_qps++;
+	else
+		pool->other_qps++;
+	pthread_mutex_unlock(&pool->lock);
+	//// a flow of its own for an RC QP, shared with its split QPs; the
+	//// slot comes with the first post
+	to_mqp(qp)->flow = is_rc ? pacer_flow_open(qp, to_mqp(qp)->isSmall) : NULL;
+	for (i = 0; i < MAX_SPLIT_QP_NUM_ONE_SIDED; i++)
+		if (split_qp[i])
+			to_mqp(split_qp[i])->flow = to_mqp(qp)->flow;
 
 	return qp;
 
@@ -1348,19 +1380,16 @@ int __mlx4_modify_qp(struct ibv_qp *qp, struct ibv_qp_attr *attr,
 	return ret;
 }
 
-//// repost recv requests in the rr_buffer and free the memory
-int rr_buffer_post_and_clear(struct rr_buffer *rr_buf, struct ibv_qp *qp) {
-	int i;
+//// repost the recv requests in the rr_buffer, as one chain
+int rr_buffer_post_and_clear(struct rr_ring *rr_buf, struct ibv_qp *qp) {
 	struct ibv_recv_wr *rwr, *bad_rwr;
 	printf("DEBUG: entring rr_buffer_post_and_clear\n");
-	for (i = 0; i < rr_buf->size; i++) {
-		rwr = rr_buf->slot[i];
-		if (mlx4_post_recv(qp, rwr, &bad_rwr)) {
-			fprintf(stderr, "Failed to repost recv requests to user qp.\n");
-			return 1;
-		}
-		free(rwr);
+	rwr = rr_ring_chain(rr_buf);
+	if (rwr && mlx4_post_recv(qp, rwr, &bad_rwr)) {
+		fprintf(stderr, "Failed to repost recv requests to user qp.\n");
+		return 1;
 	}
+	rr_ring_clear(rr_buf);
 	return 0;
 }
 ////
@@ -1377,7 +1406,6 @@ int mlx4_modify_qp(struct ibv_qp *qp, struct ibv_qp_attr *attr,
 		    int attr_mask)
 {
 	int i;
-	start_flag = 0;
 	//start_recv = 0;
 
 	struct ibv_modify_qp cmd;
@@ -1385,17 +1413,22 @@ int mlx4_modify_qp(struct ibv_qp *qp, struct ibv_qp_attr *attr,
 	//// do the same state transition for custom qp.
 	struct mlx4_qp *mqp = to_mqp(qp);
 	////
+	mqp->flow_armed = 0;	//// our own posts below (QPN exchange) don't start the flow
+	if (attr_mask & IBV_QP_STATE && attr->qp_state == IBV_QPS_RESET)
+		mqp->split_q.failed = 0;	//// the split engine flushed it (split_fail()); usable again
 
 	if (attr_mask & IBV_QP_PORT) {
 		////printf("DEBUG MLX4_MODIFY_QP: actually enter here\n");
 		ret = update_port_data(qp, attr->port_num);
 		if (ret)
 			return ret;
-		//// do same for custom_qp
-		for (i = 0; i < MAX_SPLIT_QP_NUM_ONE_SIDED; i++) {
-			update_port_data(mqp->split_qp[i], attr->port_num);
+		//// do same for custom_qp (non-RC QPs have none)
+		if (mqp->split_qp2) {
+			for (i = 0; i < MAX_SPLIT_QP_NUM_ONE_SIDED; i++) {
+				update_port_data(mqp->split_qp[i], attr->port_num);
+			}
+			update_port_data(mqp->split_qp2, attr->port_num);
 		}
-		update_port_data(mqp->split_qp2, attr->port_num);
 		////
 	}
 
@@ -1404,10 +1437,12 @@ int mlx4_modify_qp(struct ibv_qp *qp, struct ibv_qp_attr *attr,
 	    attr->qp_state == IBV_QPS_INIT) {
 		mlx4_qp_init_sq_ownership(to_mqp(qp));
 		//// do same for custom_qp
-		for (i = 0; i < MAX_SPLIT_QP_NUM_ONE_SIDED; i++) {
-			mlx4_qp_init_sq_ownership(to_mqp(mqp->split_qp[i]));
+		if (mqp->split_qp2) {
+			for (i = 0; i < MAX_SPLIT_QP_NUM_ONE_SIDED; i++) {
+				mlx4_qp_init_sq_ownership(to_mqp(mqp->split_qp[i]));
+			}
+			mlx4_qp_init_sq_ownership(to_mqp(mqp->split_qp2));
 		}
-		mlx4_qp_init_sq_ownership(to_mqp(mqp->split_qp2));
 		////
 	}
 
@@ -1475,31 +1510,12 @@ int mlx4_modify_qp(struct ibv_qp *qp, struct ibv_qp_attr *attr,
 			}
 			printf("<<<<MODIFY SPLIT QP to RTR>>>>\n");
 			fflush(stdout);
-			//// pre-post a RR for later use
-			//printf("DEBUG MODIFY QP: post a RR to split_qp\n");
-			struct ibv_sge sge;
-			struct ibv_recv_wr wr;
-			struct ibv_recv_wr *bad_wr;
-			memset(&sge, 0, sizeof(sge));
-			sge.addr = (uintptr_t)&mqp->split_fc_msg[0];
-			sge.length = sizeof(struct Split_FC_message);
-			sge.lkey = mqp->split_fc_mr->lkey;
-
-			memset(&wr, 0, sizeof(wr));
-			wr.wr_id = 0;
-			wr.next = NULL;
-			wr.sg_list = &sge;
-			wr.num_sge = 1;
-
-			if (mlx4_post_recv(mqp->split_qp[0], &wr, &bad_wr)) {
-				fprintf(stderr, "Failed to post the initial RR to split qp.\n");
-				ret = 1;
-				goto err;
-			}
-
-			sge.addr = (uintptr_t)&mqp->split_fc_msg[2];
-			if (mlx4_post_recv(mqp->split_qp2, &wr, &bad_wr)) {
-				fprintf(stderr, "Failed to post the initial RR to split qp.\n");
+			//// the two-sided split's pool and credit RRs (split_imm.h); the peer
+			//// may send as soon as it is at RTS
+			void *pool;
+			if (split_pool_imm_get(mqp, qp->pd, &pool) ||
+			    split_imm_init(&mlx4_split_imm_ops, mqp, &mqp->split_imm, pool, mqp->split_imm_mr->lkey)) {
+				fprintf(stderr, "Failed to post the split pool RRs.\n");
 				ret = 1;
 				goto err;
 			}
@@ -1874,7 +1890,7 @@ check:
 			////
 		}
 	}
-	start_flag = 1;
+	mqp->flow_armed = 1;
 	//start_recv = 1;
 err:
 	return ret;
@@ -1928,8 +1944,12 @@ static void mlx4_unlock_cqs(struct ibv_qp *qp)
 int mlx4_destroy_qp(struct ibv_qp *ibqp)
 {
 	struct mlx4_qp *qp = to_mqp(ibqp);
+	struct ibv_qp *split_qp = qp->split_qp[0];	// NULL for non-RC QPs
 	int ret;
 
+	// the split engine may still be posting to this QP and its split QP
+	split_engine_drain(qp);
+
 	pthread_mutex_lock(&to_mctx(ibqp->context)->qp_table_mutex);
 	ret = ibv_cmd_destroy_qp(ibqp);
 	if (ret) {
@@ -1938,11 +1958,11 @@ int mlx4_destroy_qp(struct ibv_qp *ibqp)
 	}
 
 	mlx4_lock_cqs(ibqp);
-	if (qp->split_qp[0]->recv_cq) {
-		__mlx4_cq_clean(to_mcq(qp->split_qp[0]->recv_cq), qp->split_qp[0]->qp_num, NULL);
+	if (split_qp && split_qp->recv_cq) {
+		__mlx4_cq_clean(to_mcq(split_qp->recv_cq), split_qp->qp_num, NULL);
 	}
-	if (qp->split_qp[0]->send_cq && qp->split_qp[0]->send_cq != qp->split_qp[0]->recv_cq) {
-		__mlx4_cq_clean(to_mcq(qp->split_qp[0]->send_cq), qp->split_qp[0]->qp_num, NULL);
+	if (split_qp && split_qp->send_cq && split_qp->send_cq != split_qp->recv_cq) {
+		__mlx4_cq_clean(to_mcq(split_qp->send_cq), split_qp->qp_num, NULL);
 	}
 	if (ibqp->recv_cq) {
 		__mlx4_cq_clean(to_mcq(ibqp->recv_cq), ibqp->qp_num,
@@ -1953,7 +1973,8 @@ int mlx4_destroy_qp(struct ibv_qp *ibqp)
 	}
 
 	if (qp->sq.wqe_cnt || qp->rq.wqe_cnt) {
-		mlx4_clear_qp(to_mctx(qp->split_qp[0]->context), qp->split_qp[0]->qp_num);
+		if (split_qp)
+			mlx4_clear_qp(to_mctx(split_qp->context), split_qp->qp_num);
 		mlx4_clear_qp(to_mctx(ibqp->context), ibqp->qp_num);
 	}
 
@@ -1978,14 +1999,21 @@ int mlx4_destroy_qp(struct ibv_qp *ibqp)
 	}
 
 	if (qp->rq.wqe_cnt) {
-		mlx4_free_db(to_mctx(qp->split_qp[0]->context), MLX4_DB_TYPE_RQ, to_mqp(qp->split_qp[0])->db);
+		if (split_qp)
+			mlx4_free_db(to_mctx(split_qp->context), MLX4_DB_TYPE_RQ, to_mqp(split_qp)->db);
 		mlx4_free_db(to_mctx(ibqp->context), MLX4_DB_TYPE_RQ, qp->db);
 	}
 
-	mlx4_dealloc_qp_buf(qp->split_qp[0]->context, to_mqp(qp->split_qp[0]));
+	if (split_qp)
+		mlx4_dealloc_qp_buf(split_qp->context, to_mqp(split_qp));
 	mlx4_dealloc_qp_buf(ibqp->context, qp);
 
-	free(to_mqp(qp->split_qp[0]));
+	pacer_flow_close(qp->flow);
+	split_pool_fc_put(qp);
+	split_pool_imm_put(qp);
+	rr_ring_destroy(&qp->rr_buf);
+	if (split_qp)
+		free(to_mqp(split_qp));
 	free(qp);
 
 	return 0;
@@ -48,11 +48,14 @@
 #include "mlx5.h"
 #include "wqe.h"
 #include "doorbell.h"
+#include "split_pool.h"
 
 enum {
 	CQ_OK					=  0,
 	CQ_EMPTY				= -1,
-	CQ_POLL_ERR				= -2
+	CQ_POLL_ERR				= -2,
+	CQ_SPLIT				= 1,	// the head of a split message (split_imm.h)
+	CQ_SPLIT_HOLD				= 2	// a receive behind a held head of its QP
 };
 
 #define MLX5_CQ_DB_REQ_NOT_SOL			(1 << 24)
@@ -910,13 +913,13 @@ static inline int mlx5_poll_one(struct mlx5_cq *cq,
 				struct mlx5_resource **cur_rsc,
 				struct mlx5_srq **cur_srq, struct ibv_exp_wc *wc,
 				uint32_t wc_size,
-				int cqe_ver) __attribute__((always_inline));
+				int cqe_ver, struct ibv_sge *scat, int *nscat) __attribute__((always_inline));
 static inline int mlx5_poll_one(struct mlx5_cq *cq,
 				struct mlx5_resource **cur_rsc,
 				struct mlx5_srq **cur_srq,
 				struct ibv_exp_wc *wc,
 				uint32_t wc_size,
-				int cqe_ver)
+				int cqe_ver, struct ibv_sge *scat, int *nscat)
 {
 	////
 	//if (*cur_rsc == NULL) {
@@ -946,6 +949,7 @@ static inline int mlx5_poll_one(struct mlx5_cq *cq,
 	enum mlx5_rsc_type type = MLX5_RSC_TYPE_INVAL;
 	int cqe_format;
 	uint8_t l3_hdr;
+	int split = CQ_OK;
 	int timestamp_en = cq->creation_flags &
 		MLX5_CQ_CREATION_FLAG_COMPLETION_TIMESTAMP;
 
@@ -1119,6 +1123,27 @@ repoll:
 		wc->status = handle_responder((struct ibv_wc *)wc, cqe64, mqp,
 					      is_srq ? *cur_srq : NULL, type,
 					      &exp_wc_flags);
+		//// the head of a split message, marked by its immediate (split_imm.h).
+		//// Copy its RR's scatter list now, the RQ slot is free from here on
+		if (mqp && !is_srq && mqp->split_imm.pool && wc->status == IBV_WC_SUCCESS &&
+		    (((struct ibv_wc *)wc)->wc_flags & IBV_WC_WITH_IMM) &&
+		    SPLIT_IMM_IS_HEAD(wc->imm_data) && wc->byte_len == SPLIT_IMM_BUF) {
+			struct mlx5_wqe_data_seg *seg;
+			int i;
+
+			idx = (mqp->rq.tail - 1) & (mqp->rq.wqe_cnt - 1);
+			seg = mqp->rq.buff + (idx << mqp->rq.wqe_shift);
+			if (unlikely(mqp->ctrl_seg.wq_sig))
+				++seg;
+			for (i = 0; i < mqp->rq.max_gs && i < SPLIT_IMM_MAX_SGE &&
+				    seg[i].lkey != htonl(MLX5_INVALID_LKEY); i++) {
+				scat[i].addr = ntohll(seg[i].addr);
+				scat[i].length = ntohl(seg[i].byte_count);
+				scat[i].lkey = ntohl(seg[i].lkey);
+			}
+			*nscat = i;
+			split = CQ_SPLIT;
+		}
 		if (mqp &&
 		    (mqp->gen_data.model_flags & MLX5_QP_MODEL_RX_CSUM_IP_OK_IP_NON_TCP_UDP)) {
 			l3_hdr = (cqe64->l4_hdr_type_etc) & MLX5_CQE_L3_HDR_TYPE_MASK;
@@ -1209,7 +1234,11 @@ repoll:
 		wmb();
 	}
 
-	return CQ_OK;
+	//// a receive of a QP with completions held behind a split head waits
+	//// behind them, so the QP's receives stay in order (poll_cq)
+	if (split == CQ_OK && responder && mqp && mqp->split_nheld)
+		split = CQ_SPLIT_HOLD;
+	return split;
 }
 
 int mlx5_exp_peer_peek_cq(struct ibv_cq *ibcq,
@@ -1303,6 +1332,142 @@ int mlx5_exp_peer_abort_peek_cq(struct ibv_cq *ibcq,
 	return 0;
 }
 
+//// Completions held back behind split heads (split_imm.h). A head is held
+//// until its tail has landed; receives of its QP polled after it are held
+//// behind it, so the QP's receives stay in order. Everything else, other
+//// QPs' receives and all sends, goes out as it is polled.
+struct mlx5_split_held {
+	struct mlx5_qp		*qp;
+	int			head;		/* its tail is not all in yet */
+	int			nscat;
+	struct ibv_sge		scat[SPLIT_IMM_MAX_SGE];
+	struct ibv_exp_wc	wc;
+};
+
+/* hold the completion just polled into wc; cq->lock held */
+static int split_hold(struct mlx5_cq *cq, struct mlx5_qp *qp, int head, const struct ibv_exp_wc *wc,
+		      uint32_t wc_size, const struct ibv_sge *scat, int nscat)
+{
+	struct mlx5_split_held *h;
+	int max;
+
+	if (cq->split_nheld == cq->split_held_max) {
+		max = cq->split_held_max ? 2 * cq->split_held_max : 16;
+		h = realloc(cq->split_held, max * sizeof(*h));
+		if (!h)
+			return ENOMEM;
+		cq->split_held = h;
+		cq->split_held_max = max;
+	}
+	h = &cq->split_held[cq->split_nheld++];
+	h->qp = qp;
+	h->head = head;
+	h->nscat = head ? nscat : 0;
+	memcpy(h->scat, scat, h->nscat * sizeof(*scat));
+	memcpy(&h->wc, wc, wc_size < sizeof(h->wc) ? wc_size : sizeof(h->wc));
+	qp->split_nheld++;
+	return 0;
+}
+
+/* the oldest held head of each QP takes what has landed of its tail;
+ * returns how many heads still wait. cq->lock held */
+static int split_held_progress(struct mlx5_cq *cq)
+{
+	struct mlx5_split_held *h, *o;
+	struct split_imm_msg msg;
+	struct ibv_wc *wc;
+	int waiting = 0, ret;
+
+	for (h = cq->split_held; h < cq->split_held + cq->split_nheld; h++) {
+		if (!h->head)
+			continue;
+		for (o = cq->split_held; o < h && !(o->head && o->qp == h->qp); o++)
+			;
+		if (o < h) {
+			waiting++;
+			continue;
+		}
+		wc = (struct ibv_wc *)&h->wc;
+		ret = split_imm_recv(&mlx5_split_imm_ops, h->qp, &h->qp->split_imm, wc->imm_data,
+				     wc->opcode == IBV_WC_RECV_RDMA_WITH_IMM, h->scat, h->nscat, 0, &msg);
+		if (ret == EAGAIN) {
+			waiting++;
+			continue;
+		}
+		h->head = 0;
+		if (ret && ret != ENOSPC) {
+			fprintf(stderr, "split receive failed: %s\n", strerror(ret));
+			wc->status = IBV_WC_GENERAL_ERR;
+			continue;
+		}
+		wc->status = ret ? IBV_WC_LOC_LEN_ERR : IBV_WC_SUCCESS;
+		wc->byte_len = msg.byte_len;
+		wc->imm_data = msg.imm;
+		if (!msg.with_imm) {
+			wc->wc_flags &= ~IBV_WC_WITH_IMM;
+			h->wc.exp_wc_flags &= ~(uint64_t)IBV_EXP_WC_WITH_IMM;
+		}
+	}
+	return waiting;
+}
+
+/* hand out up to ne held completions, oldest first, except those behind a
+ * held head of their own QP. cq->lock held */
+static int split_held_deliver(struct mlx5_cq *cq, struct ibv_exp_wc *wc, int ne, uint32_t wc_size)
+{
+	struct mlx5_split_held *h, *o;
+	int i, kept = 0, n = 0;
+
+	for (i = 0; i < cq->split_nheld; i++) {
+		h = &cq->split_held[i];
+		for (o = cq->split_held; o < cq->split_held + kept && o->qp != h->qp; o++)
+			;
+		if (n < ne && !h->head && o == cq->split_held + kept) {
+			memcpy((void *)wc + n++ * wc_size, &h->wc, wc_size);
+			h->qp->split_nheld--;
+		} else if (kept++ != i) {
+			cq->split_held[kept - 1] = *h;
+		}
+	}
+	cq->split_nheld = kept;
+	return n;
+}
+
+/* drop what is held for rsn_uidx, whose QP is reset or destroyed. cq->lock held */
+static void split_held_clean(struct mlx5_cq *cq, uint32_t rsn_uidx)
+{
+	int i, kept = 0;
+
+	for (i = 0; i < cq->split_nheld; i++) {
+		if (cq->split_held[i].qp->rsc.rsn == rsn_uidx) {
+			cq->split_held[i].qp->split_nheld--;
+			cq->split_held[i].qp->split_imm.rx_busy = 0;
+		} else if (kept++ != i) {
+			cq->split_held[kept - 1] = cq->split_held[i];
+		}
+	}
+	cq->split_nheld = kept;
+}
+
+/* wait until no held head waits for its tail */
+static void split_held_finish(struct mlx5_cq *cq)
+{
+	struct ibv_comp_channel *channel = NULL;
+	int waiting;
+
+	for (;;) {
+		mlx5_lock(&cq->lock);
+		waiting = split_held_progress(cq);
+		if (waiting)
+			channel = cq->split_held[0].qp->split_comp_recv_channel;
+		mlx5_unlock(&cq->lock);
+		if (!waiting)
+			return;
+		if (SPLIT_USE_EVENT && split_wait_event(channel))
+			return;
+	}
+}
+
 static inline int poll_cq(struct ibv_cq *ibcq, int ne, struct ibv_exp_wc *wc,
 			  uint32_t wc_size, int cqe_ver) __attribute__((always_inline));
 static inline int poll_cq(struct ibv_cq *ibcq, int ne, struct ibv_exp_wc *wc,
@@ -1311,7 +1476,10 @@ static inline int poll_cq(struct ibv_cq *ibcq, int ne, struct ibv_exp_wc *wc,
 	struct mlx5_cq *cq = to_mcq(ibcq);
 	struct mlx5_resource *rsc = NULL;
 	struct mlx5_srq *srq = NULL;
-	int npolled;
+	struct ibv_sge scat[SPLIT_IMM_MAX_SGE];
+	int nscat = 0;
+	int npolled = 0;
+	int held = 0;
 	int err = CQ_OK;
 	void *twc;
 
@@ -1327,14 +1495,36 @@ static inline int poll_cq(struct ibv_cq *ibcq, int ne, struct ibv_exp_wc *wc,
 
 	mlx5_lock(&cq->lock);
 
-	for (npolled = 0, twc = wc; npolled < ne; ++npolled, twc += wc_size) {
-		err = mlx5_poll_one(cq, &rsc, &srq, twc, wc_size, cqe_ver);
-		if (err != CQ_OK)
+	/* what was held back goes first, as far as the tails have landed */
+	if (unlikely(cq->split_nheld)) {
+		split_held_progress(cq);
+		npolled = split_held_deliver(cq, wc, ne, wc_size);
+	}
+	for (twc = (void *)wc + npolled * wc_size; npolled < ne; ) {
+		err = mlx5_poll_one(cq, &rsc, &srq, twc, wc_size, cqe_ver, scat, &nscat);
+		if (likely(err == CQ_OK)) {
+			++npolled;
+			twc += wc_size;
+			continue;
+		}
+		if (err != CQ_SPLIT && err != CQ_SPLIT_HOLD)
+			break;
+		if (split_hold(cq, (struct mlx5_qp *)rsc, err == CQ_SPLIT, twc, wc_size, scat, nscat)) {
+			err = CQ_POLL_ERR;
 			break;
+		}
+		held = 1;
+		err = CQ_OK;
 	}
 
 	mlx5_update_cons_index(cq);
 
+	/* the tail usually went ahead of its head, so a new head may be done */
+	if (held && npolled < ne && err != CQ_POLL_ERR) {
+		split_held_progress(cq);
+		npolled += split_held_deliver(cq, twc, ne - npolled, wc_size);
+	}
+
 	mlx5_unlock(&cq->lock);
 
 	if (cq->stall_enable) {
@@ -1393,6 +1583,11 @@ int mlx5_arm_cq(struct ibv_cq *ibvcq, int solicited)
 	uint32_t ci;
 	uint32_t cmd;
 
+	/* no event comes when a held head's tail lands, so those tails are
+	 * waited for here, without cq->lock; the poll after arming gets them */
+	if (unlikely(cq->split_nheld))
+		split_held_finish(cq);
+
 	sn  = cq->arm_sn & 3;
 	ci  = cq->cons_index & 0xffffff;
 	cmd = solicited ? MLX5_CQ_DB_REQ_NOT_SOL : MLX5_CQ_DB_REQ_NOT;
@@ -1464,6 +1659,9 @@ void __mlx5_cq_clean(struct mlx5_cq *cq, uint32_t rsn_uidx, struct mlx5_srq *srq
 	if (!cq || cq->model_flags & MLX5_CQ_MODEL_FLAG_DV_OWNED)
 		return;
 
+	if (cq->split_nheld)
+		split_held_clean(cq, rsn_uidx);
+
 	/*
 	 * First we need to find the current producer index, so we
 	 * know where to start cleaning from.  It doesn't matter if HW
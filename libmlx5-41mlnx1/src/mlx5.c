@@ -52,6 +52,8 @@
 #include "mlx5.h"
 #include "mlx5-abi.h"
 #include "ec.h"
+#include "split_engine.h"
+#include "split_pool.h"
 
 #ifndef PCI_VENDOR_ID_MELLANOX
 #define PCI_VENDOR_ID_MELLANOX			0x15b3
@@ -1150,6 +1152,8 @@ static int mlx5_alloc_context(struct verbs_device *vdev,
 	INIT_LIST_HEAD(&context->hugetlb_list);
 
 	pthread_mutex_init(&context->task_mutex, NULL);
+	pthread_mutex_init(&context->split_eng_mtx, NULL);
+	split_pool_init(context);
 
 	set_extended(verbs_ctx);
 	set_experimental(ctx);
@@ -1190,6 +1194,8 @@ static void mlx5_free_context(struct verbs_device *device,
 	int i;
 	struct mlx5_wc_uar *wc_uar;
 
+	split_engine_destroy(context);
+	split_pool_destroy(context);
 	if (context->clock_info_page)
 		munmap(context->clock_info_page,
 		       to_mdev(&device->device)->page_size);
@@ -67,7 +67,7 @@
 #define MAX_SPLIT_QP_NUM_ONE_SIDED		1	    //// Maximum number of split_QPs used to send split chunks in one-sided verbs
 #define SPLIT_MAX_SEND_WR 		6000
 #define SPLIT_MAX_RECV_WR 		6000
-#define SPLIT_MAX_CQE			10000
+#define SPLIT_MAX_CQE			10000			//// these three unless the pacer publishes others (PACER_TUNABLE)
 #define RR_BUFFER_INIT_CAP		1000
 //#define CPU_FRIENDLY                            //// Don't not use busy-wait checking for "pending" in shared memory. Use UDS with token enforcement.
 #define SPLIT_BIG_CHUNK_SIZE    1000000	        //// The big chunk size used in CPU_FRIENDLY version. Should be consistent with the value used in Pacer.
@@ -382,6 +382,33 @@ int rr_buffer_enqueue(struct rr_buffer *rr_buf, struct ibv_recv_wr* wr);
 
 int rr_buffer_post_and_clear(struct rr_buffer *rr_buf, struct ibv_qp *qp);
 
+#include "split_wqe.h"
+#include "split_imm.h"
+
+//// Send requests of a QP waiting for the split engine (split_engine.c)
+struct split_desc;
+struct mlx5_qp;
+struct split_queue {
+	struct split_desc	*head, *tail;	// FIFO; engine lock
+	int			pending;	// descriptors queued; read without the lock
+	int			inflight;	// chunks on split_qp[0] not yet completed (engine only)
+	int			err;		// first failure, returned by the next post
+	int			failed;		// the user QP was moved to error: what is queued is flushed (engine only)
+	struct mlx5_qp		*next_active;	// engine's list of QPs with queued work
+};
+
+//// Split resources shared by all QPs of a context (split_pool.c)
+struct split_fc_slab;
+struct pacer_flow;	//// pacer.h
+struct split_pool {
+	pthread_mutex_t		lock;
+	struct ibv_comp_channel	*channel;	// every split CQ of the context; created with the first RC QP
+	unsigned long		rc_qps;		// user QPs given split QPs and CQs
+	unsigned long		other_qps;	// non-RC user QPs, given none
+	unsigned long		fc_slabs;	// FC message MRs registered
+	unsigned long		pacer_attach_skipped;
+};
+
 ////
 
 struct mlx5_resource {
@@ -494,6 +521,9 @@ struct mlx5_context {
 	uint32_t			max_send_wqe_inline_klms;
 	pthread_mutex_t			env_mtx;
 	int				env_initialized;
+	struct split_engine		*split_eng;	/* created on the first queued split */
+	pthread_mutex_t			split_eng_mtx;
+	struct split_pool		split_pool;
 	int				compact_av;
 	int				implicit_odp;
 	int				numa_id;
@@ -568,7 +598,7 @@ struct mlx5_pd {
 	struct mlx5_implicit_lkey       w_ilkey;
 	struct mlx5_implicit_lkey      *remote_ilkey;
 	//// added for splitting cleanup
-	struct ibv_mr		*split_fc_mr;
+	struct split_fc_slab	*split_fc_slabs;	// split_pool.c; pool lock
 	////
 };
 
@@ -657,6 +687,9 @@ struct mlx5_cq {
 	struct mlx5_buf				peer_buf;
 	struct mlx5_peek_entry		      **peer_peek_table;
 	struct mlx5_peek_entry		       *peer_peek_free;
+	struct mlx5_split_held		       *split_held;	/* behind split heads (cq.c) */
+	int					split_nheld;
+	int					split_held_max;
 };
 
 struct mlx5_tag_entry {
@@ -916,8 +949,9 @@ struct mlx5_qp {
 	struct ibv_comp_channel *split_comp_recv_channel;
 	struct ibv_comp_channel *split_comp_channel2;
 	uint32_t			split_dest_qpn;
-	struct Split_FC_message split_fc_msg[4];
-	struct ibv_mr		*split_fc_mr;
+	struct Split_FC_message *split_fc_msg;		// 4 messages in split_fc_slab
+	struct ibv_mr		*split_fc_mr;		// split_fc_slab's MR
+	struct split_fc_slab	*split_fc_slab;
 	struct ibv_qp_attr	*user_qp_attr_init;
 	int 				user_qp_mask_init;
 	struct ibv_qp_attr	*user_qp_attr_rtr;
@@ -926,6 +960,13 @@ struct mlx5_qp {
 	int 				split_qp_exchange_done;
 	//uint32_t			prev_chunk_size;		// used in 2-sided chunk size varying
 	int					isSmall;
+	struct split_queue	split_q;
+	struct split_wqe_tmpl	split_tmpl;	// chunks of the WR being split inline
+	struct split_imm	split_imm;	// two-sided split; pool set at RTR (split_pool.c)
+	struct ibv_mr		*split_imm_mr;
+	int			split_nheld;	// receives held in recv_cq (cq.c)
+	struct pacer_flow	*flow;		// slot of the QP (or of its user QP); NULL: not paced (pacer.h)
+	int			flow_armed;	// set when modify_qp returns; the next post starts the flow
 	////
 };
 
@@ -1278,6 +1319,18 @@ void mlx5_init_rwq_indices(struct mlx5_rwq *rwq);
 void mlx5_update_post_send_one(struct mlx5_qp *qp, enum ibv_qp_state qp_state, enum ibv_qp_type	qp_type);
 int split_mlx5_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
 			  struct ibv_send_wr **bad_wr) __MLX5_ALGN_F__;
+int mlx5_post_send_nolock(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
+			  struct ibv_send_wr **bad_wr);
+int mlx5_post_send_grant(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
+			  struct ibv_send_wr **bad_wr);
+int mlx5_split_tmpl_init(struct ibv_qp *ibqp, const struct ibv_send_wr *wr,
+			 struct split_wqe_tmpl *t);
+int mlx5_post_chunks(struct ibv_qp *ibqp, const struct split_wqe_tmpl *t,
+		     const struct split_sgl_chunk *c, int n, int grant) __MLX5_ALGN_F__;
+int mlx5_post_send_ctl(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
+		       struct ibv_send_wr **bad_wr);
+int mlx5_flow_try_charge(struct pacer_flow *f, int opcode, int nreq, uint64_t bytes, int per_wr);
+extern const struct split_imm_ops mlx5_split_imm_ops;
 int mlx5_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
 			  struct ibv_send_wr **bad_wr) __MLX5_ALGN_F__;
 int mlx5_exp_post_send(struct ibv_qp *ibqp, struct ibv_exp_send_wr *wr,
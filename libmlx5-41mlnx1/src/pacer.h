@@ -14,54 +14,268 @@
 #include <string.h>
 #include <semaphore.h>
 #include <inttypes.h>
+#include <endian.h>
 #include <malloc.h>
 #include <pthread.h>
 #include <signal.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include "mlx5.h"
+#include "pacer_msg.h"
+#include "flow_class.h"
 
 #define SHARED_MEM_NAME "/rdma-fairness"
 #define SOCK_PATH "/gpfs/gpfs0/groups/chowdhury/yiwenzhg/rdma_socket"
-#define MSG_LEN 24
+#define MSG_LEN 40
+#define MAX_SERVERS 4               /* virtual links (receivers) per pacer; must match rdma_pacer/pacer.h */
+#define JUSTITIA_ABI_VERSION 13     /* shared_block layout and control messages (pacer_msg.h); must match rdma_pacer/pacer.h */
+#define FLOW_WAIT_SPIN 0            /* busy-wait on "pending" (default) */
+#define FLOW_WAIT_FUTEX 1           /* JUSTITIA_WAIT=futex: spin briefly, then sleep on wake_seq */
+#define FLOW_SPIN_CYCLES 50000      /* futex mode: spin this long when tokens usually come this fast */
 #define MAX_FLOWS 512
 #define HOSTNAME_PATH "/proc/sys/kernel/hostname"
 
+/* one slot per cache line (ABI v2) */
 struct flow_info {
     uint8_t pending;
     uint8_t active;
     uint8_t read;
+    uint8_t wait_mode;              /* FLOW_WAIT_SPIN or FLOW_WAIT_FUTEX */
+    uint32_t wake_seq;              /* futex word; bumped by the pacer on a grant */
+    uint64_t bytes_sent;            /* bytes posted after a token wait */
+    uint64_t tokens_granted;        /* written by the pacer */
+    uint64_t wait_cycles;           /* cycles spent waiting for tokens */
+    uint32_t sleeping;              /* threads that may be in FUTEX_WAIT on wake_seq */
+    uint8_t vlink;                  /* set by the pacer: which receiver's virtual link paces us */
+} __attribute__((aligned(64)));
+
+/* the chunk size, split batch and token bytes change together under cut_seq
+ * (odd while the pacer writes them); read them with vlink_cut() */
+struct vlink_info {
+    uint32_t virtual_link_cap;
+    uint32_t cut_seq;
+    uint32_t active_chunk_size;
+    uint32_t split_batch;           /* split chunks one token covers */
+    uint32_t token_bytes;           /* link bytes one token stands for: a tput flow's credit */
 };
 
 struct shared_block {
-    struct flow_info flows[MAX_FLOWS];
-    uint32_t active_chunk_size;
+    uint32_t abi_version;
     uint32_t active_chunk_size_read;
-    uint32_t active_batch_ops;
-    uint32_t virtual_link_cap;
+    uint32_t wqe_overhead;          /* tput: header bytes charged per WQE */
+    uint32_t split_send_wr;         /* sizes of our split QPs and their CQs; 0 for SPLIT_MAX_* */
+    uint32_t split_recv_wr;
+    uint32_t split_cqe;
+    char sock_path[108];            /* where to join the pacer */
     //uint16_t num_active_split_qps;         /* added to dynamically change number of split qps */
     uint16_t num_active_big_flows;         /* incremented when an elephant first sends a message */
     uint16_t num_active_small_flows;       /* incremented when a mouse first sends a message */
     uint16_t num_active_bw_flows;         /* incremented when an elephant first sends a message */
-    uint16_t split_level;
+    struct vlink_info vlinks[MAX_SERVERS];
+    /* bit i is set while flows[i] is pending; must match rdma_pacer/pacer.h */
+    uint64_t ready_map[MAX_FLOWS / 64] __attribute__((aligned(64)));        /* write/send flows */
+    uint64_t ready_map_read[MAX_FLOWS / 64] __attribute__((aligned(64)));   /* read flows */
+    struct flow_info flows[MAX_FLOWS];
+};
+
+/* the kinds of WR a flow posts, and where the pacer counts the flow for
+ * them: the RDMA READs of a bw flow load its responder's link, so the
+ * responder's pacer paces them (a PMSG_APP_READ); everything else loads ours
+ * (a PMSG_APP of the flow's class) */
+enum {
+    FLOW_WRITES = 1,
+    FLOW_READS = 2,
+};
+
+/* An RC QP to pace (libmlx5 keeps one flow per QP, see pacer_flow_open()):
+ * its slot, once its first post took one, and its token bookkeeping. Split
+ * QPs point at their user QP's flow. The state below is only touched by
+ * whoever posts for the QP: the caller under sq.lock, or the split engine
+ * while the QP has queued work. The classifier (fc, class_want) and
+ * flow_note() always run in the caller, and hand a class change (class_req)
+ * and the kinds of WR posted (posted) over. */
+struct pacer_flow {
+    struct flow_info *info;         /* &sb->flows[slot]; NULL until the flow has a slot */
+    unsigned int slot;
+    int joined;                     /* holds the slot; 0 again once left */
+    int app_type;                   /* PMSG_APP_*: declared (isSmall), forced or classified */
+    int auto_class;                 /* classified online from its posts (flow_class.h) */
+    struct flow_class fc;
+    int class_want;                 /* the class the classifier last asked for */
+    int class_req;                  /* PMSG_APP_* asked for and not applied yet, -1 if none */
+    int started;                    /* first post done: joined, unless the pacer turned us down */
+    int posted;                     /* FLOW_WRITES | FLOW_READS the caller has posted (flow_note()) */
+    int synced;                     /* what of posted pacer_flow_sync() has acted on */
+    int sides;                      /* FLOW_*: where the pacer counts the flow (pacer_flow_sync()) */
+    uint64_t dest_key;              /* identifies our receiver to the pacer; 0 until the first post */
+    int64_t debit;                  /* tput: link bytes the last token still covers */
+    int token_left;                 /* bw: WRs the last token still covers */
+    uint64_t avg_wait_cycles;       /* futex mode: EWMA of token waits */
+    int asked;                      /* split engine: a token asked for and not yet seen (try_token()) */
+    uint64_t ask_start;             /* split engine: when it was asked for */
+    struct pacer_flow *next;        /* joined flows of the process, for set_inactive_on_exit() */
 };
 
-extern struct flow_info *flow;     /* declaration; initialization in verbs.c */
 extern struct shared_block *sb;    /* declaration; initialization in verbs.c */
-extern int start_flag;             /* Initialized in verbs.c */
-extern unsigned int slot;          /* Initialized in verbs.c */
 extern int start_recv;             /* initialized in qp.c */
-extern int isSmall;                /* initialized in qp.c */
-extern int num_active_small_flows; /* initialized in verbs.c */
-extern int num_active_big_flows;   /* initialized in verbs.c */
-//// UDS_IMPL
+extern int wait_mode;              /* initialized in pacer.c */
 #ifdef CPU_FRIENDLY
-unsigned int flow_socket;
 extern double cpu_mhz;              /* declaration; initialization in verbs.c */
 #endif
-////
+
+/* ask the pacer for a token: raise "pending" first, then publish the slot in
+ * the ready map the pacer dispatches from, the READ one for a token of the
+ * responder's (flow_read_token()). The fetch_or is needed even if the bit
+ * looks set: the pacer drops bits lazily and re-reads "pending" after
+ * dropping one (rdma_pacer/pace.c). */
+static inline void flow_set_pending(struct pacer_flow *f, int read)
+{
+    uint64_t *map = read ? sb->ready_map_read : sb->ready_map;
+
+    __atomic_store_n(&f->info->read, read, __ATOMIC_RELAXED);
+    __atomic_store_n(&f->info->pending, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_or(&map[f->slot / 64], 1ULL << (f->slot % 64), __ATOMIC_RELEASE);
+}
+
+static inline void flow_clear_pending(struct pacer_flow *f)
+{
+    __atomic_fetch_and(&sb->ready_map[f->slot / 64], ~(1ULL << (f->slot % 64)), __ATOMIC_RELAXED);
+    __atomic_fetch_and(&sb->ready_map_read[f->slot / 64], ~(1ULL << (f->slot % 64)), __ATOMIC_RELAXED);
+    __atomic_store_n(&f->info->pending, 0, __ATOMIC_RELAXED);
+}
+
+/* the virtual link (receiver) a flow is paced on; link 0 for an unpaced QP */
+static inline struct vlink_info *flow_vlink(struct pacer_flow *f)
+{
+    return &sb->vlinks[f && f->info ? __atomic_load_n(&f->info->vlink, __ATOMIC_RELAXED) : 0];
+}
+
+/* the link's current chunk size and split batch, as one consistent pair:
+ * the pacer may move both between any two postlists of a message */
+static inline void vlink_cut(struct vlink_info *v, uint32_t *chunk, uint32_t *batch)
+{
+    uint32_t s1, s2;
+
+    do {
+        s1 = __atomic_load_n(&v->cut_seq, __ATOMIC_ACQUIRE);
+        *chunk = __atomic_load_n(&v->active_chunk_size, __ATOMIC_RELAXED);
+        *batch = __atomic_load_n(&v->split_batch, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        s2 = __atomic_load_n(&v->cut_seq, __ATOMIC_RELAXED);
+    } while ((s1 & 1) || s1 != s2);
+}
+
+/* tput: the link bytes a post of nreq WQEs carrying `bytes` costs, headers
+ * included; a token is worth the vlink's token_bytes */
+static inline int64_t flow_tput_cost(int nreq, uint64_t bytes)
+{
+    return bytes + (uint64_t)nreq * __atomic_load_n(&sb->wqe_overhead, __ATOMIC_RELAXED);
+}
+
+/* futex wait mode: sleep until the pacer clears "pending"; the pacer bumps
+ * wake_seq only if it sees "sleeping", so announce ourselves before the last
+ * look at "pending" */
+static inline void flow_sleep(struct pacer_flow *f)
+{
+    struct flow_info *fi = f->info;
+    uint32_t seq;
+
+    __atomic_fetch_add(&fi->sleeping, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    while (1) {
+        seq = __atomic_load_n(&fi->wake_seq, __ATOMIC_ACQUIRE);
+        if (!__atomic_load_n(&fi->pending, __ATOMIC_ACQUIRE))
+            break;
+        syscall(SYS_futex, &fi->wake_seq, FUTEX_WAIT, seq, NULL, NULL, 0);
+    }
+    __atomic_fetch_sub(&fi->sleeping, 1, __ATOMIC_RELAXED);
+}
+
+/* charge one token wait to this slot's counters */
+static inline void flow_account(struct pacer_flow *f, uint64_t cycles, uint64_t bytes)
+{
+    __atomic_fetch_add(&f->info->wait_cycles, cycles, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&f->info->bytes_sent, bytes, __ATOMIC_RELAXED);
+}
+
+/* a QP paced as class app_type; the class applies from its first post on */
+static inline int flow_is(struct pacer_flow *f, int app_type)
+{
+    return f && f->info && f->app_type == app_type;
+}
+
+/* whether a WR of this opcode takes its token from the responder's pacer:
+ * the RDMA READs of a bw flow, one chunk (active_chunk_size_read) each.
+ * Any other WR of the flow is paced on our link. */
+static inline int flow_read_token(struct pacer_flow *f, int opcode)
+{
+    return opcode == IBV_WR_RDMA_READ && f->app_type == PMSG_APP_BW;
+}
+
+void pacer_flow_window(struct pacer_flow *f);
+void pacer_flow_sync(struct pacer_flow *f);
+
+/* the bytes a WR carries */
+static inline uint64_t wr_bytes(struct ibv_send_wr *wr)
+{
+    uint64_t bytes = 0;
+    int i;
+
+    for (i = 0; i < wr->num_sge; i++)
+        bytes += wr->sg_list[i].length;
+    return bytes;
+}
+
+/* online classification: count the WRs of a post; the window closes in
+ * pacer_flow_window(), which may ask to move the flow to another class */
+static inline void flow_observe(struct pacer_flow *f, struct ibv_send_wr *wr)
+{
+    for (; wr; wr = wr->next)
+        if (flow_class_add(&f->fc, wr_bytes(wr), wr->send_flags & IBV_SEND_SIGNALED))
+            pacer_flow_window(f);
+}
+
+/* note the kinds of WR a post brings; the first of a kind is where
+ * pacer_flow_sync() adds the flow to the pacer's count for it */
+static inline void flow_note(struct pacer_flow *f, struct ibv_send_wr *wr)
+{
+    int posted = __atomic_load_n(&f->posted, __ATOMIC_RELAXED), kinds = 0;
+
+    if (posted == (FLOW_WRITES | FLOW_READS))
+        return;
+    for (; wr; wr = wr->next)
+        kinds |= wr->opcode == IBV_WR_RDMA_READ ? FLOW_READS : FLOW_WRITES;
+    if (kinds & ~posted)
+        __atomic_fetch_or(&f->posted, kinds, __ATOMIC_RELEASE);
+}
+
+/* apply the class change the classifier asked for, and tell the pacer about
+ * new kinds of WR, if any. Only whoever may charge the flow calls it: the
+ * caller once the split engine is done with the QP, or the engine itself,
+ * before it charges the WRs that brought them */
+static inline void flow_sync(struct pacer_flow *f)
+{
+    if (f && (__atomic_load_n(&f->class_req, __ATOMIC_RELAXED) >= 0 ||
+              __atomic_load_n(&f->posted, __ATOMIC_RELAXED) != f->synced))
+        pacer_flow_sync(f);
+}
 
 char *get_sock_path();
-void contact_pacer(int join);
+const char *pacer_shm_name(void);
+
+/* a size the pacer publishes (rdma_pacer/conf.h), or ours without a pacer */
+#define PACER_TUNABLE(field, def) \
+    (sb && sb->field ? __atomic_load_n(&sb->field, __ATOMIC_RELAXED) : (def))
+void pacer_init(void);
+struct pacer_flow *pacer_flow_open(struct ibv_qp *qp, int declared);
+void pacer_flow_start(struct pacer_flow *f, struct ibv_qp *qp, struct ibv_send_wr *wr);
+void pacer_flow_close(struct pacer_flow *f);
+#ifdef CPU_FRIENDLY
+void pacer_flow_token(struct pacer_flow *f);
+#endif
 void set_inactive_on_exit();
 void termination_handler(int sig);
 
-#endif
+#endif  /* pacer.h */
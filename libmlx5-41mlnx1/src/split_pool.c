@@ -0,0 +1,196 @@
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "split_pool.h"
+
+void split_pool_init(struct mlx5_context *ctx)
+{
+	memset(&ctx->split_pool, 0, sizeof(ctx->split_pool));
+	pthread_mutex_init(&ctx->split_pool.lock, NULL);
+}
+
+// what was created, against what the per-QP scheme would have created;
+// split QPs and CQs are still per RC QP, only non-RC QPs go without them
+void split_pool_destroy(struct mlx5_context *ctx)
+{
+	struct split_pool *pool = &ctx->split_pool;
+	unsigned long qps = pool->rc_qps + pool->other_qps;
+	unsigned long channels = pool->channel ? 1 : 0;
+
+	// the channel stays: split CQs are not destroyed with their QP yet
+	if (!getenv("JUSTITIA_SPLIT_POOL_STATS") || !qps)
+		return;
+	printf("split resources: %lu RC QPs, %lu other QPs\n", pool->rc_qps, pool->other_qps);
+	printf("  split QPs       %lu (per RC QP; none for other QPs)\n",
+	       pool->rc_qps * (MAX_SPLIT_QP_NUM_ONE_SIDED + 1));
+	printf("  split CQs       %lu (per RC QP; none for other QPs)\n", pool->rc_qps * 3);
+	printf("  comp channels   %lu (saved %lu)\n", channels, qps * 3 - channels);
+	printf("  FC MRs          %lu (saved %lu)\n", pool->fc_slabs, qps - pool->fc_slabs);
+	printf("  pacer attaches  %lu (saved %lu)\n", qps - pool->pacer_attach_skipped, pool->pacer_attach_skipped);
+	fflush(stdout);
+}
+
+struct ibv_comp_channel *split_pool_channel(struct mlx5_context *ctx)
+{
+	struct split_pool *pool = &ctx->split_pool;
+	struct ibv_comp_channel *channel;
+	int flags;
+
+	pthread_mutex_lock(&pool->lock);
+	if (!pool->channel) {
+		channel = ibv_create_comp_channel(&ctx->ibv_ctx);
+		if (!channel) {
+			perror("split pool: ibv_create_comp_channel");
+		} else {
+			flags = fcntl(channel->fd, F_GETFL);
+			if (flags < 0 || fcntl(channel->fd, F_SETFL, flags | O_NONBLOCK) < 0)
+				perror("split pool: fcntl");
+			pool->channel = channel;
+		}
+	}
+	channel = pool->channel;
+	pthread_mutex_unlock(&pool->lock);
+	return channel;
+}
+
+// hand qp SPLIT_FC_MSGS messages from a slab of pd, registering a new one if
+// they are all taken
+int split_pool_fc_get(struct mlx5_qp *qp, struct ibv_pd *pd)
+{
+	struct split_pool *pool = &to_mctx(pd->context)->split_pool;
+	struct mlx5_pd *mpd = to_mpd(pd);
+	struct split_fc_slab *slab;
+	int i;
+
+	pthread_mutex_lock(&pool->lock);
+	for (slab = mpd->split_fc_slabs; slab; slab = slab->next)
+		if (slab->used < SPLIT_FC_SLAB_QPS)
+			break;
+	if (!slab) {
+		slab = calloc(1, sizeof(*slab));
+		if (!slab) {
+			pthread_mutex_unlock(&pool->lock);
+			return ENOMEM;
+		}
+		slab->mr = mlx5_reg_mr(pd, slab->msg, sizeof(slab->msg),
+				       IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE);
+		if (!slab->mr) {
+			pthread_mutex_unlock(&pool->lock);
+			free(slab);
+			return errno ? errno : ENOMEM;
+		}
+		slab->next = mpd->split_fc_slabs;
+		mpd->split_fc_slabs = slab;
+		pool->fc_slabs++;
+	}
+	for (i = 0; slab->taken[i]; i++)
+		;
+	slab->taken[i] = 1;
+	slab->used++;
+	pthread_mutex_unlock(&pool->lock);
+
+	memset(slab->msg[i], 0, sizeof(slab->msg[i]));
+	qp->split_fc_slab = slab;
+	qp->split_fc_msg = slab->msg[i];
+	qp->split_fc_mr = slab->mr;
+	return 0;
+}
+
+// give qp's messages back; the last QP of a slab deregisters it
+void split_pool_fc_put(struct mlx5_qp *qp)
+{
+	struct ibv_pd *pd = qp->verbs_qp.qp.pd;
+	struct split_pool *pool = &to_mctx(pd->context)->split_pool;
+	struct split_fc_slab *slab = qp->split_fc_slab, **pp;
+
+	if (!slab)
+		return;
+	pthread_mutex_lock(&pool->lock);
+	slab->taken[(qp->split_fc_msg - slab->msg[0]) / SPLIT_FC_MSGS] = 0;
+	if (--slab->used == 0) {
+		for (pp = &to_mpd(pd)->split_fc_slabs; *pp != slab; pp = &(*pp)->next)
+			;
+		*pp = slab->next;
+		if (mlx5_dereg_mr(slab->mr))
+			printf("error dereg split_fc_mr.\n");
+		free(slab);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	qp->split_fc_slab = NULL;
+	qp->split_fc_msg = NULL;
+	qp->split_fc_mr = NULL;
+}
+
+// qp's bounce pool for the two-sided split (split_imm.h), registered on pd
+int split_pool_imm_get(struct mlx5_qp *qp, struct ibv_pd *pd, void **pool)
+{
+	size_t len = (size_t)SPLIT_IMM_RRS * SPLIT_IMM_BUF;
+	int ret;
+
+	ret = posix_memalign(pool, sysconf(_SC_PAGESIZE), len);
+	if (ret)
+		return ret;
+	qp->split_imm_mr = mlx5_reg_mr(pd, *pool, len, IBV_ACCESS_LOCAL_WRITE);
+	if (!qp->split_imm_mr) {
+		ret = errno ? errno : ENOMEM;
+		free(*pool);
+		return ret;
+	}
+	return 0;
+}
+
+void split_pool_imm_put(struct mlx5_qp *qp)
+{
+	if (!qp->split_imm_mr)
+		return;
+	if (mlx5_dereg_mr(qp->split_imm_mr))
+		printf("error dereg split_imm_mr.\n");
+	free(qp->split_imm.pool);
+	qp->split_imm_mr = NULL;
+	qp->split_imm.pool = NULL;
+}
+
+// slabs still held by QPs that were never destroyed
+void split_pool_free_pd(struct ibv_pd *pd)
+{
+	struct split_pool *pool = &to_mctx(pd->context)->split_pool;
+	struct mlx5_pd *mpd = to_mpd(pd);
+	struct split_fc_slab *slab;
+
+	pthread_mutex_lock(&pool->lock);
+	while ((slab = mpd->split_fc_slabs)) {
+		mpd->split_fc_slabs = slab->next;
+		if (mlx5_dereg_mr(slab->mr))
+			printf("error dereg split_fc_mr.\n");
+		free(slab);
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+// wait briefly for an event on the shared channel, ack it and re-arm its CQ.
+// The event may belong to another QP's CQ (whose waiter then times out), so
+// callers always poll their own CQ afterwards; returns nonzero on error only
+int split_wait_event(struct ibv_comp_channel *channel)
+{
+	struct pollfd pfd;
+	struct ibv_cq *ev_cq;
+	void *ev_ctx;
+
+	pfd.fd = channel->fd;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, SPLIT_EVENT_TIMEOUT_MS) <= 0)
+		return 0;
+	if (ibv_get_cq_event(channel, &ev_cq, &ev_ctx))
+		return errno == EAGAIN ? 0 : -1;
+	ibv_ack_cq_events(ev_cq, 1);
+	return ibv_req_notify_cq(ev_cq, 0);
+}
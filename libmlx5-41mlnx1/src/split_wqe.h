@@ -0,0 +1,61 @@
+#ifndef SPLIT_WQE_H
+#define SPLIT_WQE_H
+//// WQE template for split chunks
+//
+// The chunks of a split WRITE/READ differ only in remote address, local
+// address and length; opcode, rkey, lkey, flags and WQE size are the same
+// for all of them. Posting each one through mlx5_post_send_paced() still
+// builds an ibv_send_wr and walks post_send_one -> set_raddr_seg ->
+// set_data_seg -> set_ctrl_seg. Instead mlx5_split_tmpl_init() (qp.c) fills
+// a template once per message, and mlx5_post_chunks() writes each chunk
+// into the ring with split_wqe_emit(): ctrl, raddr and one data segment, 48
+// bytes, so a chunk always takes one basic block and never wraps. Only
+// single-SGE messages on an RC split QP take this path (split_sgl.h,
+// ops.prime/ops.burst). rdma_pacer/wqe5_bench runs both against a fake SQ
+// ring in memory and checks that they write the same WQEs.
+//
+// Needs htonll() from the includer (mlx5.h).
+#include <stdint.h>
+#include <arpa/inet.h>
+#include "split_sgl.h"
+#include "mlx5dv.h"
+
+#define SPLIT_WQE_DS ((sizeof(struct mlx5_wqe_ctrl_seg) + sizeof(struct mlx5_wqe_raddr_seg) + \
+		       sizeof(struct mlx5_wqe_data_seg)) / 16)
+
+struct split_wqe_tmpl {
+	uint8_t		opcode;			// MLX5_OPCODE_*; the WQE index is added per WQE
+	uint8_t		fm_ce_se[2];		// unsignaled, signaled
+	uint8_t		fence;			// IBV_SEND_FENCE asked for (fm_cache, see mlx5_post_chunks())
+	uint32_t	qpn_ds;			// big endian
+	uint32_t	rkey;			// big endian
+	uint32_t	lkey;			// big endian
+};
+
+// write chunk c into the WQE at wqe, the idx-th posted on the QP;
+// fm is or-ed into the ctrl segment's fence mode, as the fm_cache of a
+// previous WQE is by set_ctrl_seg()'s callers
+static inline void split_wqe_emit(void *wqe, const struct split_wqe_tmpl *t,
+				  const struct split_sgl_chunk *c,
+				  uint16_t idx, uint8_t fm) __attribute__((always_inline));
+static inline void split_wqe_emit(void *wqe, const struct split_wqe_tmpl *t,
+				  const struct split_sgl_chunk *c,
+				  uint16_t idx, uint8_t fm)
+{
+	uint32_t *ctrl = wqe;
+	struct mlx5_wqe_raddr_seg *rseg = (struct mlx5_wqe_raddr_seg *)(ctrl + 4);
+	struct mlx5_wqe_data_seg *dseg = (struct mlx5_wqe_data_seg *)(rseg + 1);
+
+	ctrl[0] = htonl((uint32_t)idx << 8 | t->opcode);
+	ctrl[1] = t->qpn_ds;
+	ctrl[2] = htonl(t->fm_ce_se[c->signaled] | fm);
+	ctrl[3] = 0;
+	rseg->raddr = htonll(c->raddr);
+	rseg->rkey = t->rkey;
+	rseg->reserved = 0;
+	dseg->byte_count = htonl(c->length);
+	dseg->lkey = t->lkey;
+	dseg->addr = htonll(c->addr);
+}
+
+#endif
@@ -55,14 +55,11 @@
 //#include "verbs_pacer.h"
 #include "pacer.h"
 #include "get_clock.h"
-struct flow_info *flow = NULL;
+#include "split_engine.h"
+#include "split_pool.h"
 struct shared_block *sb = NULL;
 int registered = 0;
-int start_flag = 0;
-unsigned int slot = 0;
 //int start_recv = 0;
-int num_active_small_flows = 0;
-int num_active_big_flows = 0;
 #ifdef CPU_FRIENDLY
 double cpu_mhz = 0;
 #endif
@@ -305,6 +302,8 @@ int mlx5_free_pd(struct ibv_pd *pd)
 		mlx5_destroy_implicit_lkey(mpd->remote_ilkey);
 		mpd->remote_ilkey = NULL;
 	}
+	//// cleanup split_fc_mr
+	split_pool_free_pd(pd);
 
 	ret = ibv_cmd_dealloc_pd(pd);
 	if (ret)
@@ -1168,6 +1167,7 @@ int mlx5_destroy_cq(struct ibv_cq *ibcq)
 	mlx5_free_actual_buf(ctx, cq->active_buf);
 	if (cq->peer_enabled)
 		mlx5_free_actual_buf(ctx, &cq->peer_buf);
+	free(cq->split_held);
 	free(cq);
 
 	return 0;
@@ -2373,51 +2373,117 @@ struct ibv_qp *__mlx5_create_qp(struct ibv_pd *pd,
 	return qp;
 }
 
-struct ibv_qp *mlx5_create_qp(struct ibv_pd *pd,
-			      struct ibv_qp_init_attr *attr)
+//// attach to the pacer; once per process, however many QPs it creates
+static void pacer_attach(struct split_pool *pool)
 {
-	//// create custom cq used for two-sided rdma message splitting
-	struct ibv_comp_channel *send_channel = ibv_create_comp_channel(pd->context);
-	struct ibv_comp_channel *recv_channel = ibv_create_comp_channel(pd->context);
-	struct ibv_comp_channel *channel2 = ibv_create_comp_channel(pd->context);
-	struct ibv_cq *split_send_cq = mlx5_create_cq(pd->context, SPLIT_MAX_CQE, send_channel, 0);
-	struct ibv_cq *split_recv_cq = mlx5_create_cq(pd->context, SPLIT_MAX_CQE, recv_channel, 0);
-	struct ibv_cq *split_cq2 = mlx5_create_cq(pd->context, SPLIT_MAX_CQE, channel2, 0);
-
-	/// create a custom qp for our own use 
-	struct ibv_qp_init_attr split_init_attr, split_init_attr2;
-	memset(&split_init_attr, 0, sizeof(struct ibv_qp_init_attr));
-	split_init_attr.send_cq = split_send_cq;
-	split_init_attr.recv_cq = split_recv_cq;
-	split_init_attr.cap.max_send_wr  = SPLIT_MAX_SEND_WR;
-	split_init_attr.cap.max_recv_wr  = SPLIT_MAX_RECV_WR;
-	split_init_attr.cap.max_send_sge = 1;
-	split_init_attr.cap.max_recv_sge = 1;
-	split_init_attr.cap.max_inline_data = 100;	// probably not going to use inline there
-	split_init_attr.qp_type = IBV_QPT_RC;
-	split_init_attr.qp_context = (void *)1;
-	memcpy(&split_init_attr2, &split_init_attr, sizeof(struct ibv_qp_init_attr));
-	split_init_attr2.send_cq = split_cq2;
-	split_init_attr2.recv_cq = split_cq2;
+	static pthread_mutex_t attach_mtx = PTHREAD_MUTEX_INITIALIZER;
+	int fd_shm;
 
-	struct ibv_qp 		*qp;
-	struct ibv_qp 		*split_qp[MAX_SPLIT_QP_NUM_ONE_SIDED];
-	struct ibv_qp 		*split_qp2;			// temporarily used in 2-sided
-	split_qp2 = __mlx5_create_qp(pd, &split_init_attr2);
-	if (split_qp2 == NULL) {
-		printf("Create split qp2 failed. %s\n", strerror(errno));
+	pthread_mutex_lock(&attach_mtx);
+	if (registered) {
+		pthread_mutex_unlock(&attach_mtx);
+		__atomic_fetch_add(&pool->pacer_attach_skipped, 1, __ATOMIC_RELAXED);
+		return;
 	}
-	printf("DEBUG mlx5_create_qp: split_qp->qpn = %06x\n", split_qp2->qp_num);
+	registered = 1;
 
-	int i;
-	//for (i = 0; i < MAX_SPLIT_QP_NUM_ONE_SIDED; i++) {
-	for (i = MAX_SPLIT_QP_NUM_ONE_SIDED - 1; i >= 0 ; i--) {
-		split_qp[i] = __mlx5_create_qp(pd, &split_init_attr);
-		if (split_qp[i]) {
-			printf("DEBUG mlx4_create_qp: split_qp[%d]->qpn = %06x\n", i, split_qp[i]->qp_num);
+	/* isolation */
+	if ((fd_shm = shm_open(pacer_shm_name(), O_RDWR, 0600)) == -1){
+		printf("@@@Pacer's shared memory is not found. Pacer won't be used.\n");
+	} else {
+		/* set up signal handler */
+	    struct sigaction new_action, old_action;
+	    new_action.sa_handler = termination_handler;
+	    sigemptyset(&new_action.sa_mask);
+	    new_action.sa_flags = 0;
+
+	    sigaction(SIGINT, NULL, &old_action);
+	    if (old_action.sa_handler != SIG_IGN)
+	        sigaction(SIGINT, &new_action, NULL);
+
+	    sigaction(SIGHUP, NULL, &old_action);
+	    if (old_action.sa_handler != SIG_IGN)
+	        sigaction(SIGHUP, &new_action, NULL);
+
+	    sigaction(SIGTERM, NULL, &old_action);
+	    if (old_action.sa_handler != SIG_IGN)
+	        sigaction(SIGTERM, &new_action, NULL);
+	    /* end */
+		atexit(set_inactive_on_exit);
+
+		sb = mmap(NULL, sizeof(struct shared_block), PROT_WRITE | PROT_READ,
+			MAP_SHARED, fd_shm, 0);
+		close(fd_shm);
+		/* a v1 pacer has flows[0] at offset 0, which never reads as a valid version */
+		if (sb == MAP_FAILED || sb->abi_version != JUSTITIA_ABI_VERSION) {
+			printf("@@@Pacer's shared memory ABI does not match (driver ABI %d). Pacer won't be used.\n",
+				JUSTITIA_ABI_VERSION);
+			if (sb != MAP_FAILED)
+				munmap(sb, sizeof(struct shared_block));
+			sb = NULL;
 		} else {
-			fprintf(stderr, "Error creating Split QP #%d\n", i + 1);
-			return NULL;
+			//// each RC QP joins on its first post (pacer_flow_start)
+			pacer_init();
+		}
+	}
+	/* end */
+	pthread_mutex_unlock(&attach_mtx);
+}
+
+struct ibv_qp *mlx5_create_qp(struct ibv_pd *pd,
+			      struct ibv_qp_init_attr *attr)
+{
+	struct split_pool *pool = &to_mctx(pd->context)->split_pool;
+	struct ibv_comp_channel *channel = NULL;
+	struct ibv_cq *split_send_cq = NULL, *split_recv_cq = NULL, *split_cq2 = NULL;
+	struct ibv_qp 		*qp;
+	struct ibv_qp 		*split_qp[MAX_SPLIT_QP_NUM_ONE_SIDED] = { NULL };
+	struct ibv_qp 		*split_qp2 = NULL;			// temporarily used in 2-sided
+	//// only RC QPs are ever split (split_pool.h); others get no split resources
+	int is_rc = attr->qp_type == IBV_QPT_RC;
+	int i;
+
+	//// before the split QPs: their sizes come from the pacer
+	pacer_attach(pool);
+	if (is_rc) {
+		//// create custom cq used for two-sided rdma message splitting
+		//// all on the context's shared completion channel
+		channel = split_pool_channel(to_mctx(pd->context));
+		split_send_cq = mlx5_create_cq(pd->context, PACER_TUNABLE(split_cqe, SPLIT_MAX_CQE), channel, 0);
+		split_recv_cq = mlx5_create_cq(pd->context, PACER_TUNABLE(split_cqe, SPLIT_MAX_CQE), channel, 0);
+		split_cq2 = mlx5_create_cq(pd->context, PACER_TUNABLE(split_cqe, SPLIT_MAX_CQE), channel, 0);
+
+		/// create a custom qp for our own use 
+		struct ibv_qp_init_attr split_init_attr, split_init_attr2;
+		memset(&split_init_attr, 0, sizeof(struct ibv_qp_init_attr));
+		split_init_attr.send_cq = split_send_cq;
+		split_init_attr.recv_cq = split_recv_cq;
+		split_init_attr.cap.max_send_wr  = PACER_TUNABLE(split_send_wr, SPLIT_MAX_SEND_WR);
+		split_init_attr.cap.max_recv_wr  = PACER_TUNABLE(split_recv_wr, SPLIT_MAX_RECV_WR);
+		split_init_attr.cap.max_send_sge = SPLIT_SGL_MAX_SGE;	// a chunk may straddle SGEs (split_sgl.h)
+		split_init_attr.cap.max_recv_sge = 1;
+		split_init_attr.cap.max_inline_data = 100;	// probably not going to use inline there
+		split_init_attr.qp_type = IBV_QPT_RC;
+		split_init_attr.qp_context = (void *)1;
+		memcpy(&split_init_attr2, &split_init_attr, sizeof(struct ibv_qp_init_attr));
+		split_init_attr2.send_cq = split_cq2;
+		split_init_attr2.recv_cq = split_cq2;
+
+		split_qp2 = __mlx5_create_qp(pd, &split_init_attr2);
+		if (split_qp2 == NULL) {
+			printf("Create split qp2 failed. %s\n", strerror(errno));
+		}
+		printf("DEBUG mlx5_create_qp: split_qp->qpn = %06x\n", split_qp2->qp_num);
+
+		//for (i = 0; i < MAX_SPLIT_QP_NUM_ONE_SIDED; i++) {
+		for (i = MAX_SPLIT_QP_NUM_ONE_SIDED - 1; i >= 0 ; i--) {
+			split_qp[i] = __mlx5_create_qp(pd, &split_init_attr);
+			if (split_qp[i]) {
+				printf("DEBUG mlx4_create_qp: split_qp[%d]->qpn = %06x\n", i, split_qp[i]->qp_num);
+			} else {
+				fprintf(stderr, "Error creating Split QP #%d\n", i + 1);
+				return NULL;
+			}
 		}
 	}
 
@@ -2426,9 +2492,9 @@ struct ibv_qp *mlx5_create_qp(struct ibv_pd *pd,
 	if (qp == NULL) {
 		printf("Create user qp failed. %s\n", strerror(errno));
 	}
-	printf("DEBUG mlx5_create_qp: orig_qp->qpn = %06x\n", qp->qp_num);
 	//// store split_qp & split_cq inside the user's qp
 	if (qp) {
+		printf("DEBUG mlx5_create_qp: orig_qp->qpn = %06x\n", qp->qp_num);
 		struct mlx5_qp *mqp = to_mqp(qp);
 		for (i = 0; i < MAX_SPLIT_QP_NUM_ONE_SIDED; i++) {
 			mqp->split_qp[i] = split_qp[i];
@@ -2438,15 +2504,18 @@ struct ibv_qp *mlx5_create_qp(struct ibv_pd *pd,
 		mqp->split_cq2 = split_cq2;
 		mqp->split_send_cq = split_send_cq;
 		mqp->split_recv_cq = split_recv_cq;
-		mqp->split_comp_send_channel = send_channel;
-		mqp->split_comp_recv_channel = recv_channel;
-		mqp->split_comp_channel2 = channel2;
-		//// register mr for two-sided splitting header message
-		//// register size * 2 since in split qpn exchange we need mr for send & recv at the same time
-		mqp->split_fc_mr = mlx5_reg_mr(pd, &mqp->split_fc_msg, 4 * sizeof(struct Split_FC_message), IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE);
-		//// add in pd for later deletion
-		to_mpd(pd)->split_fc_mr = mqp->split_fc_mr;
-		if (MANUAL_SPLIT_QPN_DIFF) {
+		mqp->split_comp_send_channel = channel;
+		mqp->split_comp_recv_channel = channel;
+		mqp->split_comp_channel2 = channel;
+		if (is_rc) {
+			//// two-sided splitting header messages, from the PD's shared MR
+			if (split_pool_fc_get(mqp, pd)) {
+				fprintf(stderr, "Error registering split FC messages\n");
+				mlx5_destroy_qp(qp);
+				return NULL;
+			}
+		}
+		if (MANUAL_SPLIT_QPN_DIFF || !is_rc) {
 			mqp->split_qp_exchange_done = -1;
 		} else {
 			mqp->split_qp_exchange_done = 0;
@@ -2460,40 +2529,18 @@ struct ibv_qp *mlx5_create_qp(struct ibv_pd *pd,
 	}
 	////
 
-	/* isolation */
-	int fd_shm;
-	if ((fd_shm = shm_open(SHARED_MEM_NAME, O_RDWR, 0600)) == -1){
-		printf("@@@Pacer's shared memory is not found. Pacer won't be used.\n");
-	} else {
-		if (!registered) {
-			registered = 1;
-			/* set up signal handler */
-		    struct sigaction new_action, old_action;
-		    new_action.sa_handler = termination_handler;
-		    sigemptyset(&new_action.sa_mask);
-		    new_action.sa_flags = 0;
-
-		    sigaction(SIGINT, NULL, &old_action);
-		    if (old_action.sa_handler != SIG_IGN)
-		        sigaction(SIGINT, &new_action, NULL);
-
-		    sigaction(SIGHUP, NULL, &old_action);
-		    if (old_action.sa_handler != SIG_IGN)
-		        sigaction(SIGHUP, &new_action, NULL);
-
-		    sigaction(SIGTERM, NULL, &old_action);
-		    if (old_action.sa_handler != SIG_IGN)
-		        sigaction(SIGTERM, &new_action, NULL);
-		    /* end */
-			atexit(set_inactive_on_exit);
-		}
-		sb = mmap(NULL, sizeof(struct shared_block), PROT_WRITE | PROT_READ,
-			MAP_SHARED, fd_shm, 0);
-		contact_pacer(1);
-		flow = &sb->flows[slot];
-		printf("@@@At slot %d.\n", slot);
-	}
-	/* end */	
+	pthread_mutex_lock(&pool->lock);
+	if (is_rc)
+		pool->rc_qps++;
+	else
+		pool->other_qps++;
+	pthread_mutex_unlock(&pool->lock);
+	//// a flow of its own for an RC QP, shared with its split QPs; the
+	//// slot comes with the first post
+	to_mqp(qp)->flow = is_rc ? pacer_flow_open(qp, to_mqp(qp)->isSmall) : NULL;
+	for (i = 0; i < MAX_SPLIT_QP_NUM_ONE_SIDED; i++)
+		if (split_qp[i])
+			to_mqp(split_qp[i])->flow = to_mqp(qp)->flow;
 
 	return qp;
 }
@@ -2958,6 +3005,9 @@ int mlx5_destroy_qp(struct ibv_qp *ibqp)
 	struct mlx5_context *ctx = to_mctx(ibqp->context);
 	int ret;
 
+	// the split engine may still be posting to this QP and its split QP
+	split_engine_drain(qp);
+
 	if (qp->rx_qp) {
 		ret = ibv_cmd_destroy_qp(ibqp);
 		if (ret)
@@ -3000,6 +3050,9 @@ int mlx5_destroy_qp(struct ibv_qp *ibqp)
 	mlx5_free_qp_buf(qp);
 
 free:
+	pacer_flow_close(qp->flow);
+	split_pool_fc_put(qp);
+	split_pool_imm_put(qp);
 	free(qp);
 
 	return 0;
@@ -3115,7 +3168,6 @@ int mlx5_modify_qp(struct ibv_qp *qp, struct ibv_qp_attr *attr,
 		   int attr_mask)
 {
 	int i;
-	start_flag = 0;
 
 	struct mlx5_qp *mqp = to_mqp(qp);
 	struct mlx5_context *ctx = to_mctx(qp->context);
@@ -3123,6 +3175,10 @@ int mlx5_modify_qp(struct ibv_qp *qp, struct ibv_qp_attr *attr,
 	volatile uint32_t *db;
 	int ret;
 
+	mqp->flow_armed = 0;	//// our own posts below (QPN exchange) don't start the flow
+	if (attr_mask & IBV_QP_STATE && attr->qp_state == IBV_QPS_RESET)
+		mqp->split_q.failed = 0;	//// the split engine flushed it (split_fail()); usable again
+
 	if (mqp->flags & MLX5_QP_FLAGS_USE_UNDERLAY) {
 		if (attr_mask & ~(IBV_QP_STATE | IBV_QP_CUR_STATE))
 			return EINVAL;
@@ -3136,11 +3192,13 @@ int mlx5_modify_qp(struct ibv_qp *qp, struct ibv_qp_attr *attr,
 		ret = update_port_data(qp, attr->port_num);
 		if (ret)
 			return ret;
-		//// do same for custom_qp
-		for (i = 0; i < MAX_SPLIT_QP_NUM_ONE_SIDED; i++) {
-			update_port_data(mqp->split_qp[i], attr->port_num);
+		//// do same for custom_qp (non-RC QPs have none)
+		if (mqp->split_qp2) {
+			for (i = 0; i < MAX_SPLIT_QP_NUM_ONE_SIDED; i++) {
+				update_port_data(mqp->split_qp[i], attr->port_num);
+			}
+			update_port_data(mqp->split_qp2, attr->port_num);
 		}
-		update_port_data(mqp->split_qp2, attr->port_num);
 		////
 	}
 
@@ -3208,31 +3266,12 @@ int mlx5_modify_qp(struct ibv_qp *qp, struct ibv_qp_attr *attr,
 		}
 		printf("<<<<MODIFY SPLIT QP to RTR>>>>\n");
 		fflush(stdout);
-		//// pre-post a RR for later use
-		//printf("DEBUG MODIFY QP: post a RR to split_qp\n");
-		struct ibv_sge sge;
-		struct ibv_recv_wr wr;
-		struct ibv_recv_wr *bad_wr;
-		memset(&sge, 0, sizeof(sge));
-		sge.addr = (uintptr_t)&mqp->split_fc_msg[0];
-		sge.length = sizeof(struct Split_FC_message);
-		sge.lkey = mqp->split_fc_mr->lkey;
-
-		memset(&wr, 0, sizeof(wr));
-		wr.wr_id = 0;
-		wr.next = NULL;
-		wr.sg_list = &sge;
-		wr.num_sge = 1;
-
-		if (mlx5_post_recv(mqp->split_qp[0], &wr, &bad_wr)) {
-			fprintf(stderr, "Failed to post the initial RR to split qp.\n");
-			ret = 1;
-			goto err;
-		}
-
-		sge.addr = (uintptr_t)&mqp->split_fc_msg[2];
-		if (mlx5_post_recv(mqp->split_qp2, &wr, &bad_wr)) {
-			fprintf(stderr, "Failed to post the initial RR to split qp.\n");
+		//// the two-sided split's pool and credit RRs (split_imm.h); the peer
+		//// may send as soon as it is at RTS
+		void *pool;
+		if (split_pool_imm_get(mqp, qp->pd, &pool) ||
+		    split_imm_init(&mlx5_split_imm_ops, mqp, &mqp->split_imm, pool, mqp->split_imm_mr->lkey)) {
+			fprintf(stderr, "Failed to post the split pool RRs.\n");
 			ret = 1;
 			goto err;
 		}
@@ -3297,8 +3336,6 @@ int mlx5_modify_qp(struct ibv_qp *qp, struct ibv_qp_attr *attr,
 		}
 
 	}
-	//// Set start_flag to 1
-	start_flag = 1;
 
 check:
 	if (!ret		       &&
@@ -3363,7 +3400,7 @@ check:
 		mlx5_unlock(&mqp->rq.lock);
 	}
 
-	start_flag = 1;
+	mqp->flow_armed = 1;
 err:
 	return ret;
 }
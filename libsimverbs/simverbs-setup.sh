@@ -0,0 +1,36 @@
+#!/bin/sh
+# Write a fake sysfs tree with simulated devices sim0 .. sim<N-1> for
+# libibverbs-41mlnx1 and print what to export to use them.
+#
+# Usage: simverbs-setup.sh [num_devices] [dir]
+set -e
+
+n=${1:-2}
+dir=${2:-/tmp/simverbs-sysfs}
+lib=$(cd "$(dirname "$0")" && pwd)/libsimverbs
+
+if [ "$n" -lt 1 ] || [ "$n" -gt 16 ]; then
+	echo "num_devices: 1 to 16" >&2
+	exit 1
+fi
+rm -rf "$dir"
+mkdir -p "$dir/class/infiniband_verbs"
+echo 6 > "$dir/class/infiniband_verbs/abi_version"
+i=0
+while [ "$i" -lt "$n" ]; do
+	# no "dev": libibverbs opens the device without a kernel
+	uv="$dir/class/infiniband_verbs/uverbs$i"
+	mkdir -p "$uv"
+	echo "sim$i" > "$uv/ibdev"
+	echo 6 > "$uv/abi_version"
+	ib="$dir/class/infiniband/sim$i"
+	mkdir -p "$ib/ports/1/gids" "$ib/ports/1/pkeys"
+	echo "1: CA" > "$ib/node_type"
+	printf "0002:c903:0000:%04x\n" "$i" > "$ib/node_guid"
+	printf "fe80:0000:0000:0000:0002:c903:0000:%04x\n" "$i" > "$ib/ports/1/gids/0"
+	echo 0xffff > "$ib/ports/1/pkeys/0"
+	i=$((i + 1))
+done
+
+echo "export SYSFS_PATH=$dir"
+echo "export RDMAV_DRIVERS=$lib"
@@ -0,0 +1,623 @@
+//// The shared fabric and this process's NIC thread
+//
+// The NIC thread owns a QP's send queue from sq_tx on. Each pass it:
+//  - sends a segment of the oldest unsent WQE of every QP in turn, until
+//    no QP can send more (the wires' queues are full, or there is nothing
+//    left);
+//  - delivers the WQEs whose last byte has landed: the payload goes to the
+//    peer and the peer's receive completion to its CQ;
+//  - completes the WQEs whose ACK is back;
+//  - raises the events of the armed CQs that got completions.
+// Then it sleeps until the next of these is due, or until a post rings its
+// doorbell. Events less than SIM_SPIN_NS away are waited for spinning, as a
+// sleep would overshoot them.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <infiniband/kern-abi.h>
+#include "sim.h"
+
+struct sim_fabric *fabric;
+int sim_nic = -1;
+int sim_yield;
+
+static pthread_mutex_t attach_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t nic_mtx = PTHREAD_MUTEX_INITIALIZER;	/* the lists below */
+static struct sim_qp *nic_qps;
+static struct sim_cq *nic_cqs;
+static int copy_warned;
+
+uint64_t sim_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint32_t env_u32(const char *name, uint32_t def)
+{
+	const char *v = getenv(name);
+	char *end;
+	unsigned long n;
+
+	if (!v)
+		return def;
+	n = strtoul(v, &end, 10);
+	if (*end || !n || n > UINT32_MAX) {
+		fprintf(stderr, "simverbs: bad %s=%s, using %u\n", name, v, def);
+		return def;
+	}
+	return n;
+}
+
+/* the first process sets the fabric up, from its environment */
+static void fabric_init(struct sim_fabric *fab)
+{
+	pthread_mutexattr_t attr;
+
+	fab->link.rate_mb = env_u32("SIMVERBS_RATE_MB", DEFAULT_SIM_RATE_MB);
+	fab->link.wqe_ns = env_u32("SIMVERBS_WQE_NS", DEFAULT_SIM_WQE_NS);
+	fab->link.latency_ns = env_u32("SIMVERBS_LATENCY_NS", DEFAULT_SIM_LATENCY_NS);
+	fab->link.queue_kb = env_u32("SIMVERBS_QUEUE_KB", DEFAULT_SIM_QUEUE_KB);
+	fab->link.seg = env_u32("SIMVERBS_SEG", DEFAULT_SIM_SEG);
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	pthread_mutex_init(&fab->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+	fab->version = SIM_FABRIC_VERSION;
+	__atomic_store_n(&fab->magic, SIM_FABRIC_MAGIC, __ATOMIC_RELEASE);
+}
+
+static struct sim_fabric *fabric_map(const char *name)
+{
+	struct sim_fabric *fab;
+	struct stat st;
+	int fd, created = 1, i;
+
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0 && errno == EEXIST) {
+		created = 0;
+		fd = shm_open(name, O_RDWR, 0600);
+	}
+	if (fd < 0) {
+		fprintf(stderr, "simverbs: shm_open %s: %s\n", name, strerror(errno));
+		return NULL;
+	}
+	if (created && ftruncate(fd, sizeof(*fab))) {
+		fprintf(stderr, "simverbs: ftruncate %s: %s\n", name, strerror(errno));
+		close(fd);
+		shm_unlink(name);
+		return NULL;
+	}
+	/* whoever created it may not have sized it yet */
+	for (i = 0; !fstat(fd, &st) && st.st_size < (off_t)sizeof(*fab) && i < 1000; i++)
+		usleep(1000);
+	fab = mmap(NULL, sizeof(*fab), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (fab == MAP_FAILED) {
+		fprintf(stderr, "simverbs: mmap %s: %s\n", name, strerror(errno));
+		return NULL;
+	}
+	if (created) {
+		fabric_init(fab);
+		printf("simverbs: fabric %s: %u MBps, %u ns per WQE, %u ns latency, %u KB queues\n",
+		       name, fab->link.rate_mb, fab->link.wqe_ns, fab->link.latency_ns, fab->link.queue_kb);
+	}
+	for (i = 0; __atomic_load_n(&fab->magic, __ATOMIC_ACQUIRE) != SIM_FABRIC_MAGIC && i < 1000; i++)
+		usleep(1000);
+	if (fab->magic != SIM_FABRIC_MAGIC || fab->version != SIM_FABRIC_VERSION) {
+		fprintf(stderr, "simverbs: fabric %s has layout %u, we use %u; remove it (rm /dev/shm%s)\n",
+			name, fab->version, SIM_FABRIC_VERSION, name);
+		munmap(fab, sizeof(*fab));
+		return NULL;
+	}
+	return fab;
+}
+
+/* take the first free slot of a table whose entries start with a pid, or
+ * one whose process is gone; -1 if none is left */
+int sim_slot_take(int32_t *pid, int n, size_t stride)
+{
+	int32_t *p;
+	int i, slot = -1;
+
+	if (pthread_mutex_lock(&fabric->lock) == EOWNERDEAD)
+		pthread_mutex_consistent(&fabric->lock);
+	for (i = 0; i < n; i++) {
+		p = (int32_t *)((char *)pid + i * stride);
+		if (!*p || (kill(*p, 0) && errno == ESRCH)) {
+			*p = getpid();
+			slot = i;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&fabric->lock);
+	return slot;
+}
+
+void sim_nic_ring(int nic)
+{
+	struct sim_nic *n = &fabric->nics[nic];
+
+	__atomic_fetch_add(&n->doorbell, 1, __ATOMIC_RELEASE);
+	if (__atomic_load_n(&n->sleeping, __ATOMIC_SEQ_CST))
+		syscall(SYS_futex, &n->doorbell, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+/* append a completion; with the CQ full it is dropped and counted, as the
+ * CQ of a NIC would overrun */
+int sim_cq_push(struct sim_cq_shm *cq, const struct ibv_wc *wc)
+{
+	int armed;
+
+	sim_spin_lock(&cq->lock);
+	if (cq->head - cq->tail >= cq->size) {
+		cq->overflows++;
+		sim_spin_unlock(&cq->lock);
+		return -1;
+	}
+	cq->ring[cq->head & (cq->size - 1)] = *wc;
+	__atomic_store_n(&cq->head, cq->head + 1, __ATOMIC_RELEASE);
+	armed = __atomic_load_n(&cq->armed, __ATOMIC_RELAXED);
+	sim_spin_unlock(&cq->lock);
+	if (armed)
+		sim_nic_ring(cq->nic);
+	return 0;
+}
+
+//// sending
+
+static struct sim_qp_shm *qp_peer(struct sim_qp *qp)
+{
+	struct sim_qp_shm *peer;
+
+	if (qp->dest_slot < 0)
+		return NULL;
+	peer = &fabric->qps[qp->dest_slot];
+	if (!__atomic_load_n(&peer->pid, __ATOMIC_ACQUIRE) || peer->qpn != qp->dest_qpn)
+		return NULL;
+	return peer;
+}
+
+/* send a segment of qp's oldest unsent WQE; 0 if it has none or has to wait */
+static int qp_transmit(struct sim_qp *qp, uint64_t now, uint64_t *next)
+{
+	struct sim_swqe *w;
+	struct sim_qp_shm *peer;
+	uint64_t at;
+	uint32_t n;
+	int src, dst, ret;
+
+	if (qp->sq_tx == __atomic_load_n(&qp->sq_head, __ATOMIC_ACQUIRE))
+		return 0;
+	w = &qp->sq[qp->sq_tx & (qp->sq_size - 1)];
+	peer = qp_peer(qp);
+	if (qp->err || !peer) {
+		w->status = qp->err ? IBV_WC_WR_FLUSH_ERR : IBV_WC_RETRY_EXC_ERR;
+		w->at = now;
+		qp->sq_tx++;
+		return 1;
+	}
+	/* a READ's data comes from the responder */
+	src = w->opcode == IBV_WR_RDMA_READ ? peer->dev : qp->shm->dev;
+	dst = w->opcode == IBV_WR_RDMA_READ ? qp->shm->dev : peer->dev;
+	n = w->bytes - w->sent < fabric->link.seg ? w->bytes - w->sent : fabric->link.seg;
+	sim_spin_lock(&fabric->wire_lock);
+	ret = link_send(&fabric->link, fabric->ports, src, dst, now, n, w->sent == 0, &at);
+	sim_spin_unlock(&fabric->wire_lock);
+	if (ret) {
+		if (at < *next)
+			*next = at;
+		return 0;
+	}
+	w->sent += n;
+	if (w->sent >= w->bytes) {
+		/* ahead of its data, the READ request crossed the other way */
+		w->at = at + (w->opcode == IBV_WR_RDMA_READ ? fabric->link.latency_ns : 0);
+		w->status = IBV_WC_SUCCESS;
+		qp->sq_tx++;
+	}
+	return 1;
+}
+
+//// delivering
+
+/* the WQE's local buffers */
+static int swqe_iov(struct sim_swqe *w, struct iovec *iov)
+{
+	int i;
+
+	if (w->send_flags & IBV_SEND_INLINE) {
+		iov[0].iov_base = w->inline_data;
+		iov[0].iov_len = w->bytes;
+		return 1;
+	}
+	for (i = 0; i < w->num_sge; i++) {
+		iov[i].iov_base = (void *)(uintptr_t)w->sg_list[i].addr;
+		iov[i].iov_len = w->sg_list[i].length;
+	}
+	return w->num_sge;
+}
+
+/* move n bytes between our buffers and process pid's, both ways through
+ * process_vm_*(); a status for the requester */
+static int sim_copy(pid_t pid, struct iovec *local, int nl, struct iovec *remote, int nr,
+		    size_t n, int write)
+{
+	ssize_t ret;
+
+	if (!n)
+		return IBV_WC_SUCCESS;
+	ret = write ? process_vm_writev(pid, local, nl, remote, nr, 0)
+		    : process_vm_readv(pid, local, nl, remote, nr, 0);
+	if (ret == (ssize_t)n)
+		return IBV_WC_SUCCESS;
+	if (ret < 0 && errno == ESRCH)
+		return IBV_WC_RETRY_EXC_ERR;
+	if (ret < 0 && errno == EPERM) {
+		/* no ptrace access to the peer (yama, seccomp): timing only */
+		if (!__atomic_exchange_n(&copy_warned, 1, __ATOMIC_RELAXED))
+			fprintf(stderr, "simverbs: can't reach the memory of process %d (%s); "
+				"payloads are not moved\n", pid, strerror(errno));
+		return IBV_WC_SUCCESS;
+	}
+	return IBV_WC_REM_ACCESS_ERR;
+}
+
+/* the peer's MR for an rkey, if [addr, addr + len) is in it with access */
+static int mr_check(pid_t pid, uint32_t rkey, uint64_t addr, uint32_t len, int access)
+{
+	struct sim_mr_shm *mr = &fabric->mrs[rkey & ((1 << SIM_MR_BITS) - 1)];
+
+	return mr->pid == pid && mr->key == rkey && (mr->access & access) &&
+	       addr >= mr->addr && addr + len <= mr->addr + mr->length;
+}
+
+/* take the peer's oldest receive WQE */
+static int rq_take(struct sim_qp_shm *peer, struct sim_rwqe *r)
+{
+	uint32_t tail;
+
+	do {
+		tail = __atomic_load_n(&peer->rq_tail, __ATOMIC_ACQUIRE);
+		if (tail == __atomic_load_n(&peer->rq_head, __ATOMIC_ACQUIRE))
+			return 0;
+		*r = peer->rq[tail & (peer->rq_size - 1)];
+	} while (!__atomic_compare_exchange_n(&peer->rq_tail, &tail, tail + 1, 0,
+					      __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+	return 1;
+}
+
+/* hand the landed WQE w to the peer; -1 to retry it later (receiver not
+ * ready), else 0 with w->status set */
+static int qp_deliver(struct sim_qp *qp, struct sim_swqe *w)
+{
+	struct sim_qp_shm *peer = qp_peer(qp);
+	struct iovec local[SIM_MAX_SGE], remote[SIM_MAX_SGE];
+	struct sim_rwqe r = { 0 };
+	struct ibv_wc wc;
+	uint64_t room = 0;
+	int nl, i, two_sided, with_imm;
+
+	if (w->status != IBV_WC_SUCCESS)
+		return 0;
+	if (!peer) {
+		w->status = IBV_WC_RETRY_EXC_ERR;
+		return 0;
+	}
+	if (__atomic_load_n(&peer->state, __ATOMIC_ACQUIRE) < IBV_QPS_RTR)
+		return -1;
+	nl = swqe_iov(w, local);
+
+	switch (w->opcode) {
+	case IBV_WR_RDMA_READ:
+		if (!mr_check(peer->pid, w->rkey, w->raddr, w->bytes, IBV_ACCESS_REMOTE_READ)) {
+			w->status = IBV_WC_REM_ACCESS_ERR;
+			return 0;
+		}
+		remote[0].iov_base = (void *)(uintptr_t)w->raddr;
+		remote[0].iov_len = w->bytes;
+		w->status = sim_copy(peer->pid, local, nl, remote, 1, w->bytes, 0);
+		return 0;
+	case IBV_WR_RDMA_WRITE:
+	case IBV_WR_RDMA_WRITE_WITH_IMM:
+		if (!mr_check(peer->pid, w->rkey, w->raddr, w->bytes, IBV_ACCESS_REMOTE_WRITE)) {
+			w->status = IBV_WC_REM_ACCESS_ERR;
+			return 0;
+		}
+		break;
+	}
+
+	two_sided = w->opcode != IBV_WR_RDMA_WRITE;
+	with_imm = w->opcode == IBV_WR_SEND_WITH_IMM || w->opcode == IBV_WR_RDMA_WRITE_WITH_IMM;
+	if (two_sided && !rq_take(peer, &r))
+		/* RC waits for a receive WQE (RNR), UC drops the message */
+		return peer->type == IBV_QPT_RC ? -1 : 0;
+
+	memset(&wc, 0, sizeof(wc));
+	if (w->opcode == IBV_WR_SEND || w->opcode == IBV_WR_SEND_WITH_IMM) {
+		for (i = 0; i < r.num_sge; i++) {
+			remote[i].iov_base = (void *)(uintptr_t)r.sg_list[i].addr;
+			remote[i].iov_len = r.sg_list[i].length;
+			room += r.sg_list[i].length;
+		}
+		if (w->bytes > room) {
+			w->status = IBV_WC_REM_INV_REQ_ERR;
+			wc.status = IBV_WC_LOC_LEN_ERR;
+			__atomic_store_n(&peer->state, IBV_QPS_ERR, __ATOMIC_RELEASE);
+		} else {
+			w->status = sim_copy(peer->pid, local, nl, remote, r.num_sge, w->bytes, 1);
+		}
+		wc.opcode = IBV_WC_RECV;
+	} else {
+		remote[0].iov_base = (void *)(uintptr_t)w->raddr;
+		remote[0].iov_len = w->bytes;
+		w->status = sim_copy(peer->pid, local, nl, remote, 1, w->bytes, 1);
+		wc.opcode = IBV_WC_RECV_RDMA_WITH_IMM;
+	}
+	if (!two_sided || w->status == IBV_WC_RETRY_EXC_ERR)
+		return 0;
+
+	wc.wr_id = r.wr_id;
+	if (w->status != IBV_WC_SUCCESS && wc.status == IBV_WC_SUCCESS)
+		wc.status = IBV_WC_REM_ACCESS_ERR;
+	wc.byte_len = w->bytes;
+	wc.qp_num = peer->qpn;
+	wc.src_qp = qp->ibv_qp.qp_num;
+	wc.slid = qp->shm->dev + 1;
+	if (with_imm) {
+		wc.wc_flags = IBV_WC_WITH_IMM;
+		wc.imm_data = w->imm;
+	}
+	if (sim_cq_push(&fabric->cqs[peer->recv_cq], &wc))
+		fprintf(stderr, "simverbs: CQ of QP %06x overrun\n", peer->qpn);
+	return 0;
+}
+
+static enum ibv_wc_opcode wc_opcode(int opcode)
+{
+	switch (opcode) {
+	case IBV_WR_RDMA_WRITE:
+	case IBV_WR_RDMA_WRITE_WITH_IMM:
+		return IBV_WC_RDMA_WRITE;
+	case IBV_WR_RDMA_READ:
+		return IBV_WC_RDMA_READ;
+	default:
+		return IBV_WC_SEND;
+	}
+}
+
+/* a WQE is done: its completion, if it wants one, to the send CQ, or to
+ * the split CQ for a hidden one */
+static void qp_complete(struct sim_qp *qp, struct sim_swqe *w)
+{
+	struct ibv_wc wc;
+	int failed = w->status != IBV_WC_SUCCESS;
+
+	if (failed && !qp->err) {
+		qp->err = 1;
+		__atomic_store_n(&qp->shm->state, IBV_QPS_ERR, __ATOMIC_RELEASE);
+	}
+	if (!failed && !(w->send_flags & IBV_SEND_SIGNALED) && !qp->sig_all)
+		return;
+	if (w->hidden) {
+		/* the splitter stops at the first failure: the rest can go */
+		if (qp->split_head - __atomic_load_n(&qp->split_tail, __ATOMIC_ACQUIRE) >= SIM_SPLIT_CQE)
+			return;
+		qp->split_cq[qp->split_head % SIM_SPLIT_CQE] = w->status;
+		__atomic_store_n(&qp->split_head, qp->split_head + 1, __ATOMIC_RELEASE);
+		return;
+	}
+	memset(&wc, 0, sizeof(wc));
+	wc.wr_id = w->wr_id;
+	wc.status = w->status;
+	wc.opcode = wc_opcode(w->opcode);
+	wc.byte_len = w->opcode == IBV_WR_RDMA_READ ? w->bytes : 0;
+	wc.qp_num = qp->ibv_qp.qp_num;
+	if (sim_cq_push(to_scq(qp->ibv_qp.send_cq)->shm, &wc))
+		fprintf(stderr, "simverbs: CQ of QP %06x overrun\n", qp->ibv_qp.qp_num);
+}
+
+/* deliver and complete what is due, oldest first */
+static void qp_progress(struct sim_qp *qp, uint64_t now, uint64_t *next)
+{
+	struct sim_swqe *w;
+
+	while (qp->sq_dlv != qp->sq_tx) {
+		w = &qp->sq[qp->sq_dlv & (qp->sq_size - 1)];
+		if (w->at > now)
+			break;
+		if (qp_deliver(qp, w)) {
+			w->at = now + SIM_RNR_NS;
+			break;
+		}
+		/* the ACK of a WRITE or SEND is one latency behind */
+		if (w->opcode != IBV_WR_RDMA_READ && w->status == IBV_WC_SUCCESS)
+			w->at = now + fabric->link.latency_ns;
+		qp->sq_dlv++;
+	}
+	if (qp->sq_dlv != qp->sq_tx && qp->sq[qp->sq_dlv & (qp->sq_size - 1)].at < *next)
+		*next = qp->sq[qp->sq_dlv & (qp->sq_size - 1)].at;
+
+	while (qp->sq_done != qp->sq_dlv) {
+		w = &qp->sq[qp->sq_done & (qp->sq_size - 1)];
+		if (w->at > now) {
+			if (w->at < *next)
+				*next = w->at;
+			break;
+		}
+		qp_complete(qp, w);
+		__atomic_store_n(&qp->sq_done, qp->sq_done + 1, __ATOMIC_RELEASE);
+	}
+}
+
+/* an armed CQ that got a completion since it was armed raises its event */
+static void cq_events(void)
+{
+	struct ibv_comp_event ev;
+	struct sim_cq *cq;
+	struct sim_cq_shm *s;
+
+	for (cq = nic_cqs; cq; cq = cq->next) {
+		s = cq->shm;
+		if (!cq->ibv_cq.channel || !__atomic_load_n(&s->armed, __ATOMIC_ACQUIRE) ||
+		    __atomic_load_n(&s->head, __ATOMIC_ACQUIRE) == s->arm_head)
+			continue;
+		__atomic_store_n(&s->armed, 0, __ATOMIC_RELAXED);
+		ev.cq_handle = (uintptr_t)&cq->ibv_cq;
+		if (write(ibv_soft_channel_fd(cq->ibv_cq.channel), &ev, sizeof(ev)) != sizeof(ev))
+			perror("simverbs: CQ event");
+	}
+}
+
+static void nic_wait(struct sim_nic *n, uint32_t seq, uint64_t next)
+{
+	struct timespec ts, *timeout = NULL;
+	uint64_t now = sim_now();
+
+	if (next != UINT64_MAX) {
+		if (next < now + SIM_SPIN_NS) {
+			if (sim_yield)
+				sched_yield();
+			else
+				cpu_relax();
+			return;
+		}
+		ts.tv_sec = (next - now - SIM_SPIN_NS / 2) / 1000000000;
+		ts.tv_nsec = (next - now - SIM_SPIN_NS / 2) % 1000000000;
+		timeout = &ts;
+	}
+	__atomic_store_n(&n->sleeping, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&n->doorbell, __ATOMIC_SEQ_CST) == seq)
+		syscall(SYS_futex, &n->doorbell, FUTEX_WAIT, seq, timeout, NULL, 0);
+	__atomic_store_n(&n->sleeping, 0, __ATOMIC_RELAXED);
+}
+
+static void *nic_run(void *arg)
+{
+	struct sim_nic *n = &fabric->nics[sim_nic];
+	struct sim_qp *qp;
+	uint64_t now, next;
+	uint32_t seq;
+	int more;
+
+	prctl(PR_SET_TIMERSLACK, 1);
+	while (1) {
+		seq = __atomic_load_n(&n->doorbell, __ATOMIC_ACQUIRE);
+		next = UINT64_MAX;
+		pthread_mutex_lock(&nic_mtx);
+		now = sim_now();
+		do {
+			more = 0;
+			for (qp = nic_qps; qp; qp = qp->next)
+				more |= qp_transmit(qp, now, &next);
+		} while (more);
+		for (qp = nic_qps; qp; qp = qp->next)
+			qp_progress(qp, now, &next);
+		cq_events();
+		pthread_mutex_unlock(&nic_mtx);
+		nic_wait(n, seq, next);
+	}
+	return NULL;
+}
+
+void sim_nic_add_qp(struct sim_qp *qp)
+{
+	pthread_mutex_lock(&nic_mtx);
+	qp->next = nic_qps;
+	nic_qps = qp;
+	pthread_mutex_unlock(&nic_mtx);
+}
+
+void sim_nic_del_qp(struct sim_qp *qp)
+{
+	struct sim_qp **p;
+
+	pthread_mutex_lock(&nic_mtx);
+	for (p = &nic_qps; *p; p = &(*p)->next) {
+		if (*p == qp) {
+			*p = qp->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&nic_mtx);
+}
+
+void sim_nic_add_cq(struct sim_cq *cq)
+{
+	pthread_mutex_lock(&nic_mtx);
+	cq->next = nic_cqs;
+	nic_cqs = cq;
+	pthread_mutex_unlock(&nic_mtx);
+}
+
+void sim_nic_del_cq(struct sim_cq *cq)
+{
+	struct sim_cq **p;
+
+	pthread_mutex_lock(&nic_mtx);
+	for (p = &nic_cqs; *p; p = &(*p)->next) {
+		if (*p == cq) {
+			*p = cq->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&nic_mtx);
+}
+
+// map the fabric and start this process's NIC thread, once per process
+int sim_fabric_attach(void)
+{
+	const char *name = getenv("SIMVERBS_FABRIC") ? getenv("SIMVERBS_FABRIC") : SIM_FABRIC_NAME;
+	struct sim_fabric *fab;
+	pthread_attr_t attr;
+	pthread_t th;
+	int ret = 0;
+
+	pthread_mutex_lock(&attach_mtx);
+	if (fabric)
+		goto out;
+	if (!(fab = fabric_map(name))) {
+		ret = ENODEV;
+		goto out;
+	}
+	fabric = fab;
+	/* with few cores, a busy poller would starve the NIC thread for a timeslice */
+	sim_yield = env_u32("SIMVERBS_YIELD", sysconf(_SC_NPROCESSORS_ONLN) <= 2);
+	sim_nic = sim_slot_take(&fabric->nics[0].pid, SIM_MAX_NICS, sizeof(struct sim_nic));
+	if (sim_nic < 0) {
+		fprintf(stderr, "simverbs: more than %d processes on fabric %s\n", SIM_MAX_NICS, name);
+		ret = ENOSPC;
+		goto unmap;
+	}
+	/* our peers' NIC threads move payloads in and out of our memory */
+	prctl(PR_SET_PTRACER, PR_SET_PTRACER_ANY);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	ret = pthread_create(&th, &attr, nic_run, NULL);
+	pthread_attr_destroy(&attr);
+	if (!ret)
+		goto out;
+	fprintf(stderr, "simverbs: NIC thread: %s\n", strerror(ret));
+	__atomic_store_n(&fabric->nics[sim_nic].pid, 0, __ATOMIC_RELEASE);
+unmap:
+	munmap(fabric, sizeof(*fabric));
+	fabric = NULL;
+out:
+	pthread_mutex_unlock(&attach_mtx);
+	return ret;
+}
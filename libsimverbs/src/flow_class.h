@@ -0,0 +1,126 @@
+#ifndef FLOW_CLASS_H
+#define FLOW_CLASS_H
+//// Online classification of a QP into bw / lat / tput (PMSG_APP_*)
+//
+// A QP whose application did not declare a class through qp_context is
+// classified from what it posts. The WRs are cut into windows of
+// FC_WINDOW, and each window votes:
+//  - bw: mean message size of at least FC_BW_ENTER bytes (elephants);
+//  - tput: small messages posted at least every FC_TPUT_ENTER_NS on average,
+//    or every 2 * FC_TPUT_ENTER_NS with at most 1 WR in FC_SIGNAL_SPARSE
+//    signaled (batches with selective signaling);
+//  - lat: the rest, small messages posted one at a time (ping-pong).
+// The class a flow has needs less to keep than a new one needs to win
+// (FC_BW_LEAVE, FC_TPUT_LEAVE_NS), and a new class has to win FC_HOLD
+// windows in a row, so a flow near a boundary does not flap between
+// classes. Until its first vote a flow has the class its first post
+// suggests (flow_class_first()): an elephant is bw from its first WR, so it
+// is never let through unpaced, and anything smaller is lat. The first
+// window is only FC_FIRST_WINDOW WRs long and decides without waiting, so a
+// batch of small WRs is paced as tput from its first few posts on. Time is
+// only read once per window, by the caller. rdma_pacer/class_check replays
+// traces through it.
+#include <stdint.h>
+#include "pacer_msg.h"
+
+#define FLOW_CLASS_AUTO		-1		// not declared: classify online
+#define FLOW_CLASS_OFF		-2		// JUSTITIA_CLASS=off: not paced
+
+#define FC_WINDOW		64		// WRs per vote
+#define FC_FIRST_WINDOW		8		// WRs of the first vote
+#define FC_HOLD			3		// votes in a row a new class needs
+#define FC_BW_ENTER		(64 * 1024)	// mean bytes per WR to become bw
+#define FC_BW_LEAVE		(16 * 1024)	// and to stay bw
+#define FC_TPUT_ENTER_NS	500		// mean ns between WRs to become tput
+#define FC_TPUT_LEAVE_NS	1000		// and to stay tput
+#define FC_SIGNAL_SPARSE	4		// 1 in this many signaled or fewer: batching
+
+struct flow_class {
+	uint64_t	start_ns;	// start of the window
+	uint64_t	bytes;		// posted in the window
+	uint32_t	wrs;
+	uint32_t	signaled;
+	int		cls;		// PMSG_APP_*, -1 before the first vote
+	int		guess;		// the class until then (flow_class_first())
+	int		cand;		// class of the last votes against cls
+	int		streak;		// how many votes in a row for cand
+};
+
+static inline void flow_class_init(struct flow_class *fc, uint64_t now_ns)
+{
+	fc->start_ns = now_ns;
+	fc->bytes = 0;
+	fc->wrs = 0;
+	fc->signaled = 0;
+	fc->cls = -1;
+	fc->guess = PMSG_APP_LAT;
+	fc->cand = -1;
+	fc->streak = 0;
+}
+
+// the class of a flow; until its first vote, what its first post suggests
+static inline int flow_class_of(const struct flow_class *fc)
+{
+	return fc->cls < 0 ? fc->guess : fc->cls;
+}
+
+// the first post of the flow, bytes per WR on average: its class until the
+// first vote
+static inline int flow_class_first(struct flow_class *fc, uint64_t bytes)
+{
+	fc->guess = bytes >= FC_BW_ENTER ? PMSG_APP_BW : PMSG_APP_LAT;
+	return flow_class_of(fc);
+}
+
+// count one WR; 1 when the window is full and flow_class_end() is due
+static inline int flow_class_add(struct flow_class *fc, uint64_t bytes, int signaled)
+{
+	fc->bytes += bytes;
+	fc->signaled += !!signaled;
+	return ++fc->wrs >= (fc->cls < 0 ? FC_FIRST_WINDOW : FC_WINDOW);
+}
+
+// what the window just closed votes for, given the class the flow has
+static inline int flow_class_vote(const struct flow_class *fc, uint64_t now_ns)
+{
+	uint64_t mean = fc->bytes / fc->wrs;
+	uint64_t gap = (now_ns - fc->start_ns) / fc->wrs;
+	uint64_t fast = fc->cls == PMSG_APP_TPUT ? FC_TPUT_LEAVE_NS : FC_TPUT_ENTER_NS;
+
+	if (mean >= (fc->cls == PMSG_APP_BW ? FC_BW_LEAVE : FC_BW_ENTER))
+		return PMSG_APP_BW;
+	if (fc->signaled * FC_SIGNAL_SPARSE <= fc->wrs)
+		fast *= 2;
+	return gap <= fast ? PMSG_APP_TPUT : PMSG_APP_LAT;
+}
+
+// close the window at now_ns and start the next; the flow's new class if it
+// changed, or the first vote even if it kept the guess; -1 if not
+static inline int flow_class_end(struct flow_class *fc, uint64_t now_ns)
+{
+	int vote = flow_class_vote(fc, now_ns), first = fc->cls < 0;
+
+	fc->start_ns = now_ns;
+	fc->bytes = 0;
+	fc->wrs = 0;
+	fc->signaled = 0;
+	if (first) {
+		fc->cls = vote;
+		return vote;
+	}
+	if (vote == fc->cls) {
+		fc->streak = 0;
+		return -1;
+	}
+	if (vote != fc->cand) {
+		fc->cand = vote;
+		fc->streak = 0;
+	}
+	if (++fc->streak < FC_HOLD)
+		return -1;
+	fc->streak = 0;
+	fc->cls = vote;
+	return vote;
+}
+
+#endif
@@ -0,0 +1,79 @@
+#ifndef SIM_LINK_H
+#define SIM_LINK_H
+//// Timing model of the simulated fabric
+//
+// Every device has one full-duplex port on a non-blocking switch. A
+// message goes out in segments of at most `seg` bytes. Each segment holds
+// the sender's egress wire for bytes / rate, and the first segment of a WQE
+// also holds it for wqe_ns (the NIC's per-WQE cost, which caps the message
+// rate). Cut-through, the segment then takes the receiver's ingress wire
+// for the same bytes / rate as soon as both the segment and the wire are
+// there. Its last byte lands latency_ns later. Segments of all senders to a
+// receiver queue FIFO in front of its ingress wire, and that queue is what a
+// latency-sensitive message waits in behind elephants.
+//
+// Buffers are finite and lossless, as with PFC: the switch holds up to
+// queue_kb from each sender for a receiver, and a segment only goes out
+// while that buffer and the sender's own egress queue have room. Until then
+// its sender holds it back and serves its other QPs. Senders into one
+// receiver thus take turns on its wire, and a message behind them waits at
+// most one buffer per sender. link_check exercises this without a device.
+#include <stdint.h>
+
+#define LINK_MAX_PORTS 16
+
+/* set when the fabric is created (SIMVERBS_* in the environment, fabric.c) */
+struct sim_link {
+	uint32_t rate_mb;		/* MBps of every wire */
+	uint32_t wqe_ns;		/* NIC time per WQE, on the egress wire */
+	uint32_t latency_ns;		/* one way, after the last byte */
+	uint32_t queue_kb;		/* most a wire may have queued */
+	uint32_t seg;			/* bytes of one QP before the NIC turns to the next */
+};
+
+/* one per device */
+struct sim_port {
+	uint64_t tx_free;		/* ns: the egress wire is busy until then */
+	uint64_t rx_free;		/* ns: the ingress wire is busy until then */
+	uint64_t in_free[LINK_MAX_PORTS];	/* ns: what each sender has queued for us is in by then */
+	uint64_t tx_bytes;
+	uint64_t rx_bytes;
+};
+
+/* ns a wire takes for n bytes */
+static inline uint64_t link_ns(const struct sim_link *l, uint64_t n)
+{
+	return n * 1000 / l->rate_mb;
+}
+
+/* Put n bytes from port src to port dst on the wires at time now, the first
+ * segment of a WQE if first. Returns 0 and when the last byte lands in *at,
+ * or -1 while a buffer on the way is full and in *at when to try again. */
+static inline int link_send(const struct sim_link *l, struct sim_port *ports, int src, int dst,
+			    uint64_t now, uint64_t n, int first, uint64_t *at)
+{
+	struct sim_port *s = &ports[src], *d = &ports[dst];
+	uint64_t limit = link_ns(l, (uint64_t)l->queue_kb * 1024);
+	uint64_t busy = link_ns(l, n);
+	uint64_t tx = s->tx_free > now ? s->tx_free : now;
+	uint64_t rx;
+
+	if (tx - now > limit || d->in_free[src] > now + limit) {
+		tx = tx - now > limit ? tx - limit : now;
+		rx = d->in_free[src] > now + limit ? d->in_free[src] - limit : now;
+		*at = tx > rx ? tx : rx;
+		return -1;
+	}
+	if (first)
+		tx += l->wqe_ns;
+	rx = d->rx_free > tx ? d->rx_free : tx;
+	s->tx_free = tx + busy;
+	d->rx_free = rx + busy;
+	d->in_free[src] = rx + busy;
+	s->tx_bytes += n;
+	d->rx_bytes += n;
+	*at = rx + busy + l->latency_ns;
+	return 0;
+}
+
+#endif
@@ -0,0 +1,136 @@
+// Checks of the simulated fabric's timing model (link.h), without a device.
+// Senders go round-robin a segment at a time, as the NIC thread sends, and
+// time jumps to the next retry when every wire is full:
+//  - an elephant alone finishes at the line rate, plus one WQE and one
+//    latency;
+//  - two elephants into one receiver share its wire evenly, and two into
+//    different receivers do not slow each other down;
+//  - a message behind elephants waits for their queue at the receiver,
+//    which never holds more than queue_kb per sender;
+//  - small messages are bounded by the per-WQE cost.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "link.h"
+
+#define MAX_SENDERS 4
+#define MB (1 << 20)
+
+struct sender {
+	int src, dst;
+	uint64_t start;			/* ns */
+	uint64_t msgs;			/* messages of `bytes` left */
+	uint64_t bytes;
+	uint64_t left;			/* of the current message */
+	uint64_t done;			/* ns: the last byte of the last message landed */
+};
+
+static struct sim_link link = { 5000, 60, 1500, 512, 4096 };
+static struct sim_port ports[LINK_MAX_PORTS];
+
+static void check(int cond, const char *what)
+{
+	if (!cond) {
+		printf("FAIL: %s\n", what);
+		exit(1);
+	}
+}
+
+static int near(double v, double ref, double tol)
+{
+	return v > ref * (1 - tol) && v < ref * (1 + tol);
+}
+
+static void run(struct sender *s, int n)
+{
+	uint64_t now = 0, next, at, seg;
+	int i, sent;
+
+	memset(ports, 0, sizeof(ports));
+	while (1) {
+		next = UINT64_MAX;
+		do {
+			sent = 0;
+			for (i = 0; i < n; i++) {
+				if (!s[i].left && !s[i].msgs)
+					continue;
+				if (s[i].start > now) {
+					next = s[i].start < next ? s[i].start : next;
+					continue;
+				}
+				if (!s[i].left) {
+					s[i].left = s[i].bytes;
+					s[i].msgs--;
+				}
+				seg = s[i].left < link.seg ? s[i].left : link.seg;
+				if (link_send(&link, ports, s[i].src, s[i].dst, now, seg,
+					      s[i].left == s[i].bytes, &at)) {
+					check(at > now, "a full wire is retried later");
+					next = at < next ? at : next;
+					continue;
+				}
+				s[i].left -= seg;
+				if (!s[i].left)
+					s[i].done = at;
+				sent = 1;
+			}
+		} while (sent);
+		if (next == UINT64_MAX)
+			return;
+		now = next;
+	}
+}
+
+int main(void)
+{
+	uint64_t limit = link_ns(&link, (uint64_t)link.queue_kb * 1024);
+	struct sender s[MAX_SENDERS];
+	double alone, mouse;
+
+	/* one elephant */
+	memset(s, 0, sizeof(s));
+	s[0] = (struct sender){ .src = 0, .dst = 1, .msgs = 1, .bytes = 8 * MB };
+	run(s, 1);
+	alone = link_ns(&link, 8 * MB);
+	check(near(s[0].done, alone + link.wqe_ns + link.latency_ns, 0.01), "an elephant alone runs at line rate");
+	check(ports[0].tx_bytes == 8 * MB && ports[1].rx_bytes == 8 * MB, "bytes counted");
+
+	/* two elephants into one receiver */
+	memset(s, 0, sizeof(s));
+	s[0] = (struct sender){ .src = 0, .dst = 2, .msgs = 1, .bytes = 8 * MB };
+	s[1] = (struct sender){ .src = 1, .dst = 2, .msgs = 1, .bytes = 8 * MB };
+	run(s, 2);
+	check(near(s[0].done, 2 * alone, 0.02) && near(s[1].done, 2 * alone, 0.02),
+	      "two elephants share the receiver's wire evenly");
+
+	/* two elephants into two receivers */
+	memset(s, 0, sizeof(s));
+	s[0] = (struct sender){ .src = 0, .dst = 2, .msgs = 1, .bytes = 8 * MB };
+	s[1] = (struct sender){ .src = 1, .dst = 3, .msgs = 1, .bytes = 8 * MB };
+	run(s, 2);
+	check(near(s[0].done, alone, 0.01) && near(s[1].done, alone, 0.01),
+	      "elephants to different receivers don't interfere");
+
+	/* a mouse behind two elephants */
+	memset(s, 0, sizeof(s));
+	s[0] = (struct sender){ .src = 0, .dst = 3, .msgs = 1, .bytes = 8 * MB };
+	s[1] = (struct sender){ .src = 1, .dst = 3, .msgs = 1, .bytes = 8 * MB };
+	s[2] = (struct sender){ .src = 2, .dst = 3, .start = 1000000, .msgs = 1, .bytes = 64 };
+	run(s, 3);
+	mouse = s[2].done - s[2].start;
+	printf("mouse behind elephants: %.1f us (alone %.1f us, queue %.1f us)\n", mouse / 1000,
+	       (link.wqe_ns + link_ns(&link, 64) + link.latency_ns) / 1000.0, limit / 1000.0);
+	check(mouse > limit / 2 + link.latency_ns, "a mouse waits behind the elephants' queue");
+	check(mouse <= 2 * (limit + link_ns(&link, link.seg)) + link.wqe_ns + link_ns(&link, 64) + link.latency_ns,
+	      "the switch holds at most queue_kb per sender");
+
+	/* small messages: the per-WQE cost bounds the rate */
+	memset(s, 0, sizeof(s));
+	s[0] = (struct sender){ .src = 0, .dst = 1, .msgs = 100000, .bytes = 64 };
+	run(s, 1);
+	check(near(s[0].done, 100000.0 * (link.wqe_ns + link_ns(&link, 64)) + link.latency_ns, 0.01),
+	      "message rate is 1 / (wqe_ns + bytes / rate)");
+
+	printf("link_check: ok\n");
+	return 0;
+}
@@ -0,0 +1,501 @@
+#include "pacer.h"
+
+int wait_mode = FLOW_WAIT_SPIN;    /* how this process waits for tokens; JUSTITIA_WAIT=spin|futex */
+
+// the pacer's shared block: JUSTITIA_SHM_NAME, to join a pacer started with
+// another shm_name (a second pacer on the host, as with libsimverbs)
+const char *pacer_shm_name(void) {
+    const char *name = getenv("JUSTITIA_SHM_NAME");
+
+    return name && name[0] == '/' ? name : SHARED_MEM_NAME;
+}
+
+// the pacer's socket: as the pacer published it, else worked out the way
+// it used to from the hostname
+char *get_sock_path() {
+    FILE *fp;
+    if (sb && sb->sock_path[0])
+        return sb->sock_path;
+    fp = fopen(HOSTNAME_PATH, "r");
+    if (fp == NULL) {
+        printf("Error opening %s, use default SOCK_PATH", HOSTNAME_PATH);
+        fclose(fp);
+        return SOCK_PATH;
+    }
+
+    char hostname[100];
+    if(fgets(hostname, 100, fp) != NULL) {
+        //char *sock_path = (char *)malloc(108 * sizeof(char));
+        char *sock_path = (char *)calloc(108, sizeof(char));
+        //printf("DE hostname:%s\n", hostname);
+        int len = strlen(hostname);
+        if (len > 0 && hostname[len-1] == '\n') hostname[len-1] = '\0';
+        strcat(hostname, "_rdma_socket");
+        strcpy(sock_path, getenv("HOME"));
+        len = strlen(sock_path);
+        sock_path[len] = '/';
+        //printf("DE: len(sock_path) = %d\n", len);
+        //printf("DE: sock_path:%s\n", sock_path);
+        strcat(sock_path, hostname);
+        fclose(fp);
+        return sock_path;
+    }
+
+    fclose(fp);
+    return SOCK_PATH;
+}
+
+// One connection to the pacer per process (pacer_msg.h), opened by the
+// first flow that joins; every flow is multiplexed over it. A flow is an RC
+// QP: pacer_flow_open() sets it up when the QP is created, and the QP's
+// first post after it is connected joins the pacer and gets the QP its own
+// slot (pacer_flow_start()). QPs that never send, and UD, UC or raw QPs,
+// take no slot. pacer_flow_close() gives the slot back when the QP is
+// destroyed. A process with a latency QP and a bandwidth QP thus has two
+// slots, each paced (or not) on its own, and threads posting on different
+// QPs never share a "pending" flag. With CPU_FRIENDLY every flow's tokens
+// arrive on the connection, each naming its slot; whoever reads one that is
+// not theirs leaves it in slot_tokens for its flow. If the process dies
+// without leaving, the pacer notices the connection closing and cleans up
+// after each flow.
+//
+// A QP's class is the one JUSTITIA_CLASS forces on every QP of the process,
+// else the one the application declared in qp_context, else found online
+// from its posts (flow_class.h); pacer_flow_window() tells the pacer when
+// it changes. The RDMA READs of a bw QP wait on the READ ready map, for
+// tokens at the rate the responder's pacer gives us; its other WRs, and
+// every WR of another class, on ours (flow_read_token()). The pacer hears
+// of each side when the QP first posts for it (pacer_flow_sync()).
+static unsigned int join_weight, join_burst_kb;
+static int class_forced, class_env;    /* JUSTITIA_CLASS=bw|lat|tput|auto|off */
+static pthread_mutex_t flows_mtx = PTHREAD_MUTEX_INITIALIZER;
+static struct pacer_flow *flows;    /* every joined flow of the process */
+/* what this process adds to sb's active flow counts, for termination_handler() */
+static int own_small_flows, own_big_flows, own_bw_flows;
+
+/* the connection: one join at a time (join_mtx), and one reader at a time
+ * (conn_reader, under conn_mtx), who does not hold conn_mtx in recv() */
+static pthread_mutex_t join_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t conn_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t conn_cond = PTHREAD_COND_INITIALIZER;
+static int conn_sock = -1;
+static int conn_failed;             /* the pacer can't be reached or has another ABI */
+static int conn_reader;
+static int conn_broken;             /* recv() failed: the pacer is gone */
+static struct pmsg conn_reply;      /* the join ack, whoever read it */
+static ssize_t conn_reply_len;
+static unsigned int slot_tokens[MAX_FLOWS];    /* CPU_FRIENDLY: tokens read for each slot */
+
+static int pacer_send(struct pmsg *m) {
+    if (send(conn_sock, m, sizeof(m->hdr) + m->hdr.len, MSG_NOSIGNAL) == -1) {
+        perror("send: pacer message");
+        return -1;
+    }
+    return 0;
+}
+
+// read one datagram off the connection: a token is counted for its slot,
+// a reply kept for the joiner. If someone else is reading, wait for them
+// instead; either way the caller looks again at what it is waiting for.
+// conn_mtx held, dropped while waiting.
+static void conn_read(void) {
+    struct pmsg m;
+    uint32_t slot;
+    ssize_t len;
+
+    if (conn_reader) {
+        pthread_cond_wait(&conn_cond, &conn_mtx);
+        return;
+    }
+    conn_reader = 1;
+    pthread_mutex_unlock(&conn_mtx);
+    len = recv(conn_sock, &m, sizeof(m), 0);
+    pthread_mutex_lock(&conn_mtx);
+    conn_reader = 0;
+    if (len == PMSG_TOKEN_LEN) {
+        memcpy(&slot, &m, sizeof(slot));
+        if (slot < MAX_FLOWS)
+            slot_tokens[slot]++;
+    } else if (len > 0) {
+        conn_reply = m;
+        conn_reply_len = len;
+    } else {
+        if (len < 0) perror("recv");
+        conn_broken = 1;
+    }
+    pthread_cond_broadcast(&conn_cond);
+}
+
+// the process's connection, opened on first use; join_mtx held
+static int conn_open(void) {
+    char *sock_path;
+    struct sockaddr_un remote;
+    int s;
+
+    if (conn_sock >= 0 || conn_failed)
+        return conn_sock;
+    if ((s = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) == -1) {
+        perror("socket");
+        conn_failed = 1;
+        return -1;
+    }
+    printf("Contacting pacer...\n");
+    sock_path = get_sock_path();
+    memset(&remote, 0, sizeof(remote));
+    remote.sun_family = AF_UNIX;
+    strncpy(remote.sun_path, sock_path, sizeof(remote.sun_path) - 1);     // may be SOCK_PATH itself, so not freed
+    if (connect(s, (struct sockaddr *)&remote, sizeof(remote)) == -1) {
+        perror("connect");
+        close(s);
+        conn_failed = 1;
+        return -1;
+    }
+    return conn_sock = s;
+}
+
+// once per process, when the pacer's shared memory is mapped: the settings
+// every flow of the process joins with
+void pacer_init(void) {
+    /* this tenant's DRR weight and burst (KB), given to each of its flows */
+    join_weight = getenv("JUSTITIA_WEIGHT") ? strtoul(getenv("JUSTITIA_WEIGHT"), NULL, 10) : 0;
+    join_burst_kb = getenv("JUSTITIA_BURST_KB") ? strtoul(getenv("JUSTITIA_BURST_KB"), NULL, 10) : 0;
+    if (join_weight > 1000)
+        join_weight = 1000;
+    if (join_burst_kb > 999999)
+        join_burst_kb = 999999;
+
+    if (getenv("JUSTITIA_WAIT") && strcmp(getenv("JUSTITIA_WAIT"), "futex") == 0)
+        wait_mode = FLOW_WAIT_FUTEX;
+
+    if (getenv("JUSTITIA_CLASS")) {
+        static const char *names[] = { "bw", "lat", "tput", "auto", "off" };
+        static const int classes[] = { PMSG_APP_BW, PMSG_APP_LAT, PMSG_APP_TPUT, FLOW_CLASS_AUTO, FLOW_CLASS_OFF };
+        int i;
+
+        for (i = 0; i < 5; i++)
+            if (strcmp(getenv("JUSTITIA_CLASS"), names[i]) == 0)
+                break;
+        if (i < 5) {
+            class_forced = 1;
+            class_env = classes[i];
+            printf("QP class: %s for every QP\n", names[i]);
+        } else {
+            printf("Unknown JUSTITIA_CLASS=%s; classes as declared or online\n", getenv("JUSTITIA_CLASS"));
+        }
+    }
+    printf("Token wait mode: %s\n", wait_mode == FLOW_WAIT_FUTEX ? "futex" : "spin");
+}
+
+// the class qp is paced as, given what its application declared in
+// qp_context (isSmall). Only 1 (lat) and 2 (tput) count as declared: 0 is
+// also what every unmodified application passes (NULL), and any other value
+// is a real context pointer. Those are classified online, which finds bw.
+static int flow_class_pick(int declared) {
+    if (class_forced)
+        return class_env;
+    if (declared == PMSG_APP_LAT || declared == PMSG_APP_TPUT)
+        return declared;
+    return FLOW_CLASS_AUTO;
+}
+
+// the flow of RC QP qp; NULL if JUSTITIA_CLASS=off or there is no pacer,
+// and the QP is then not paced. It joins on the QP's first post.
+struct pacer_flow *pacer_flow_open(struct ibv_qp *qp, int declared) {
+    struct pacer_flow *f;
+    int app_type = flow_class_pick(declared);
+
+    if (!sb || app_type == FLOW_CLASS_OFF)
+        return NULL;
+    f = calloc(1, sizeof(*f));
+    if (!f)
+        return NULL;
+    f->auto_class = app_type == FLOW_CLASS_AUTO;
+    flow_class_init(&f->fc, 0);
+    f->app_type = f->auto_class ? flow_class_of(&f->fc) : app_type;
+    f->class_want = f->app_type;
+    f->class_req = -1;
+    return f;
+}
+
+// take a slot for the flow of qp; -1 if the pacer can't be reached, turned
+// us down or has no free slot, and the QP is then not paced
+static int flow_join(struct pacer_flow *f, struct ibv_qp *qp) {
+    struct pmsg m;
+    ssize_t len;
+    int ret = -1;
+
+    pthread_mutex_lock(&join_mtx);
+    if (conn_open() < 0)
+        goto out;
+    pmsg_init(&m, PMSG_JOIN, sizeof(m.join));
+    m.join.abi_version = JUSTITIA_ABI_VERSION;
+    m.join.pid = getpid();
+    m.join.weight = join_weight;
+    m.join.burst_kb = join_burst_kb;
+    m.join.dest_key = f->dest_key;
+    m.join.qpn = qp->qp_num;
+    if (pacer_send(&m))
+        goto out;
+
+    /* receive the slot number; tokens of other flows may come first */
+    pthread_mutex_lock(&conn_mtx);
+    while (!conn_reply_len && !conn_broken)
+        conn_read();
+    m = conn_reply;
+    len = conn_reply_len;
+    conn_reply_len = 0;
+    pthread_mutex_unlock(&conn_mtx);
+    if (!pmsg_valid(&m, len) || m.hdr.type != PMSG_JOIN_ACK) {
+        printf("Bad or no reply from pacer\n");
+        goto out;
+    }
+    if (m.ack.status == PMSG_EABI) {
+        printf("Pacer uses shared memory ABI %u, driver uses %d. Pacer won't be used.\n",
+                m.ack.abi_version, JUSTITIA_ABI_VERSION);
+        conn_failed = 1;
+        goto out;
+    } else if (m.ack.status != PMSG_OK) {
+        printf("Pacer has no free slot. QP %06x won't be paced.\n", qp->qp_num);
+        goto out;
+    }
+    f->slot = m.ack.slot;
+    slot_tokens[f->slot] = 0;
+    __atomic_store_n(&sb->flows[f->slot].wait_mode, wait_mode, __ATOMIC_RELAXED);
+    printf("QP %06x (%s, app type %d%s) at slot %d\n", qp->qp_num,
+           m.ack.is_sender ? "sender" : "receiver", f->app_type, f->auto_class ? ", online" : "", f->slot);
+    ret = 0;
+out:
+    pthread_mutex_unlock(&join_mtx);
+    return ret;
+}
+
+// the destination key of qp's receiver, in the form the pacer uses to tell
+// its receivers apart (see dest_key() in rdma_pacer/pacer.h); 0 if unknown
+static uint64_t qp_dest_key(struct ibv_qp *qp) {
+    struct ibv_qp_attr attr;
+    struct ibv_qp_init_attr init_attr;
+
+    if (ibv_query_qp(qp, &attr, IBV_QP_AV, &init_attr)) {
+        printf("Couldn't query QP address vector; pacing on the default virtual link\n");
+        return 0;
+    }
+    if (attr.ah_attr.is_global)
+        return be64toh(attr.ah_attr.grh.dgid.global.interface_id);
+    return attr.ah_attr.dlid;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// where the pacer is to count a flow of class app_type that posted these
+// kinds of WR (FLOW_*): only a bw flow's READs are the responder's
+static int flow_sides(int posted, int app_type) {
+    if (app_type != PMSG_APP_BW)
+        return posted ? FLOW_WRITES : 0;
+    return posted;
+}
+
+// tell the pacer about the flow: a control message of this type and class
+static void flow_send(struct pacer_flow *f, uint16_t type, int app_type) {
+    struct pmsg m;
+
+    pmsg_init(&m, type, sizeof(m.app));
+    m.app.dest_key = f->dest_key;
+    m.app.app_type = app_type;
+    m.app.slot = f->slot;
+    pacer_send(&m);
+}
+
+// count the flow among the host's active flows of its class (n = 1), or not
+// any more (n = -1); only while its writes load our link (FLOW_WRITES)
+static void flow_count(struct pacer_flow *f, int n) {
+    if (f->app_type == PMSG_APP_LAT) {
+        __atomic_fetch_add(&own_small_flows, n, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&sb->num_active_small_flows, n, __ATOMIC_RELAXED);
+    } else {
+        __atomic_fetch_add(&own_big_flows, n, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&sb->num_active_big_flows, n, __ATOMIC_RELAXED);
+        if (f->app_type == PMSG_APP_BW) {
+            __atomic_fetch_add(&own_bw_flows, n, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&sb->num_active_bw_flows, n, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// take back whatever the process still adds to one of sb's counts; a
+// signal may land between the two adds of flow_count(), so the tally can
+// be one ahead of sb, never behind
+static void flow_uncount(int *own, uint16_t *count) {
+    int n = __atomic_exchange_n(own, 0, __ATOMIC_RELAXED);
+
+    if (n)
+        __atomic_fetch_sub(count, n, __ATOMIC_RELAXED);
+}
+
+// first post of the flow, qp connected: take a slot. An online-classified
+// flow starts in the class its first post suggests; the pacer hears of it
+// with the kinds of WR the post brings (pacer_flow_sync()).
+void pacer_flow_start(struct pacer_flow *f, struct ibv_qp *qp, struct ibv_send_wr *wr) {
+    struct ibv_send_wr *w;
+    uint64_t bytes = 0;
+    int n = 0;
+
+    f->started = 1;
+    f->dest_key = qp_dest_key(qp);
+    printf("QP %06x destination key: %016" PRIx64 "\n", qp->qp_num, f->dest_key);
+    if (f->auto_class) {
+        for (w = wr; w; w = w->next, n++)
+            bytes += wr_bytes(w);
+        f->app_type = f->class_want = flow_class_first(&f->fc, bytes / n);
+    }
+    if (flow_join(f, qp))
+        return;
+    if (f->auto_class)
+        flow_class_init(&f->fc, now_ns());
+    f->info = &sb->flows[f->slot];
+    f->joined = 1;
+
+    pthread_mutex_lock(&flows_mtx);
+    f->next = flows;
+    flows = f;
+    pthread_mutex_unlock(&flows_mtx);
+}
+
+// a classification window of the flow is full: if the windows vote for
+// another class, ask for it. The caller may not charge the flow (the split
+// engine may be), so whoever does moves it (pacer_flow_sync()).
+void pacer_flow_window(struct pacer_flow *f) {
+    int cls = flow_class_end(&f->fc, now_ns());
+
+    if (cls < 0 || cls == f->class_want || !f->joined)
+        return;
+    f->class_want = cls;
+    __atomic_store_n(&f->class_req, cls, __ATOMIC_RELEASE);
+}
+
+// move the flow to the class pacer_flow_window() asked for, and have the
+// pacer count it where the kinds of WR it posted so far load a link: ours
+// for its class (PMSG_APP, PMSG_CLASS, PMSG_EXIT), the responder's for the
+// READs of a bw flow (a PMSG_APP_READ). Only by whoever may charge it
+// (flow_sync()), before the WRs that brought a new kind, as its token
+// state starts over on a class change.
+void pacer_flow_sync(struct pacer_flow *f) {
+    int cls = __atomic_exchange_n(&f->class_req, -1, __ATOMIC_ACQUIRE);
+    int posted = __atomic_load_n(&f->posted, __ATOMIC_ACQUIRE);
+    int old, sides;
+
+    pthread_mutex_lock(&flows_mtx);     /* against flow_leave() at exit */
+    f->synced = posted;
+    old = f->sides;
+    if (!f->joined)
+        goto out;
+    if (cls < 0 || cls == f->app_type) {
+        cls = f->app_type;
+    } else {
+        printf("Slot %d: app type %d -> %d\n", f->slot, f->app_type, cls);
+        f->token_left = 0;
+        f->debit = 0;
+    }
+    sides = flow_sides(posted, cls);
+    if ((old & sides & FLOW_WRITES) && cls != f->app_type) {
+        flow_count(f, -1);
+        f->app_type = cls;
+        flow_count(f, 1);
+        flow_send(f, PMSG_CLASS, cls);
+    } else {
+        if ((old & ~sides) & FLOW_WRITES) {
+            flow_count(f, -1);
+            flow_send(f, PMSG_EXIT, f->app_type);
+        }
+        f->app_type = cls;
+        if ((sides & ~old) & FLOW_WRITES) {
+            flow_count(f, 1);
+            flow_send(f, PMSG_APP, cls);
+        }
+    }
+    if ((old ^ sides) & FLOW_READS)
+        flow_send(f, sides & FLOW_READS ? PMSG_APP : PMSG_EXIT, PMSG_APP_READ);
+    f->sides = sides;
+out:
+    pthread_mutex_unlock(&flows_mtx);
+}
+
+// undo pacer_flow_start() and give the slot back; flows_mtx held,
+// idempotent. The pacer takes the flow out of its class, and off its
+// responder's READs, with the slot.
+static void flow_leave(struct pacer_flow *f) {
+    if (!f->joined)
+        return;
+    f->joined = 0;
+    if (f->sides & FLOW_WRITES)
+        flow_count(f, -1);
+    flow_clear_pending(f);
+    __atomic_store_n(&f->info->read, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&f->info->active, 0, __ATOMIC_RELAXED);
+    flow_send(f, PMSG_LEAVE, f->app_type);
+}
+
+// the QP is destroyed
+void pacer_flow_close(struct pacer_flow *f) {
+    struct pacer_flow **p;
+
+    if (!f)
+        return;
+    pthread_mutex_lock(&flows_mtx);
+    for (p = &flows; *p; p = &(*p)->next) {
+        if (*p == f) {
+            *p = f->next;
+            break;
+        }
+    }
+    flow_leave(f);
+    pthread_mutex_unlock(&flows_mtx);
+    free(f);
+}
+
+#ifdef CPU_FRIENDLY
+// wait for the pacer's next grant to the flow, which the connection's
+// reader may already have taken off it for us
+void pacer_flow_token(struct pacer_flow *f) {
+    pthread_mutex_lock(&conn_mtx);
+    while (!slot_tokens[f->slot]) {
+        if (conn_broken) {
+            printf("Error in recving tokens. Exit\n");
+            exit(1);
+        }
+        conn_read();
+    }
+    slot_tokens[f->slot]--;
+    pthread_mutex_unlock(&conn_mtx);
+}
+#endif
+
+// the process is leaving: every flow leaves, QPs destroyed later find
+// theirs already gone
+void set_inactive_on_exit() {
+    struct pacer_flow *f;
+
+    pthread_mutex_lock(&flows_mtx);
+    for (f = flows; f; f = f->next)
+        flow_leave(f);
+    pthread_mutex_unlock(&flows_mtx);
+    printf("libsimverbs exit\n");
+}
+
+// SIGINT/SIGHUP/SIGTERM: the signal may have stopped a thread holding
+// flows_mtx or inside stdio, so only lock-free stores to the shared memory
+// here. The kernel closes our connections and the pacer cleans up each
+// slot; then the signal kills us as it would have without the handler.
+void termination_handler(int sig) {
+    if (sb) {
+        flow_uncount(&own_small_flows, &sb->num_active_small_flows);
+        flow_uncount(&own_big_flows, &sb->num_active_big_flows);
+        flow_uncount(&own_bw_flows, &sb->num_active_bw_flows);
+    }
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
@@ -0,0 +1,323 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "sim.h"
+#include "pacer.h"
+#include "split_sgl.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+static inline unsigned long get_cycles(void)
+{
+	unsigned low, high;
+	unsigned long long val;
+
+	asm volatile("rdtsc" : "=a" (low), "=d" (high));
+	val = high;
+	val = (val << 32) | low;
+	return val;
+}
+#else
+static inline unsigned long get_cycles(void)
+{
+	return 0;
+}
+#endif
+
+//// Pacing is libmlx4's (libmlx4/src/qp.c), on the same pacer.c
+
+/* isolation: wait until the pacer grants flow f a token, the responder's if
+ * read (flow_read_token()), then charge the wait and the bytes the token
+ * covers to its slot
+ *
+ * In futex mode we keep spinning for up to FLOW_SPIN_CYCLES while tokens
+ * usually arrive within that time, and sleep after a short spin otherwise. */
+static inline void wait_for_token(struct pacer_flow *f, int read, uint64_t bytes)
+{
+	uint64_t start = get_cycles(), budget, waited;
+	int polls = 0;
+
+	flow_set_pending(f, read);
+	if (wait_mode == FLOW_WAIT_FUTEX) {
+		budget = f->avg_wait_cycles <= FLOW_SPIN_CYCLES ? FLOW_SPIN_CYCLES : FLOW_SPIN_CYCLES / 16;
+		while (__atomic_load_n(&f->info->pending, __ATOMIC_ACQUIRE)) {
+			if (get_cycles() - start > budget || ++polls > FLOW_SPIN_CYCLES) {
+				flow_sleep(f);
+				break;
+			}
+			cpu_relax();
+		}
+	} else {
+		while (__atomic_load_n(&f->info->pending, __ATOMIC_ACQUIRE))
+			cpu_relax();
+	}
+	waited = get_cycles() - start;
+	f->avg_wait_cycles += ((int64_t)waited - (int64_t)f->avg_wait_cycles) / 8;
+	flow_account(f, waited, bytes);
+}
+
+static inline uint64_t sge_bytes(struct ibv_sge *sg_list, int num_sge)
+{
+	uint64_t bytes = 0;
+	int i;
+
+	for (i = 0; i < num_sge; i++)
+		bytes += sg_list[i].length;
+	return bytes;
+}
+
+/* isolation: a token covers split_batch chunks of the link (the pacer paces
+ * it that long), so as many WRs of up to a chunk share one. A READ token is
+ * one chunk (active_chunk_size_read), and a READ never takes what is left
+ * of ours */
+static inline void wait_for_token_wr(struct pacer_flow *f, int opcode, uint64_t bytes)
+{
+	int read = flow_read_token(f, opcode);
+
+	if (!read && f->token_left > 0) {
+		f->token_left--;
+		flow_account(f, 0, bytes);
+		return;
+	}
+	wait_for_token(f, read, bytes);
+	f->token_left = read ? 0 : (int)__atomic_load_n(&flow_vlink(f)->split_batch, __ATOMIC_RELAXED) - 1;
+}
+
+/* isolation: a tput flow spends the bytes of a token on its WRs, payload and
+ * headers, so it gets the same share of the link whatever its op size */
+static inline void tput_debit(struct pacer_flow *f, int nreq, uint64_t bytes)
+{
+	while (f->debit <= 0)
+	{
+		wait_for_token(f, 0, 0);
+		f->debit += __atomic_load_n(&flow_vlink(f)->token_bytes, __ATOMIC_RELAXED);
+	}
+	f->debit -= flow_tput_cost(nreq, bytes);
+	flow_account(f, 0, bytes);
+}
+
+static int wr_supported(struct sim_qp *qp, struct ibv_send_wr *wr)
+{
+	switch (wr->opcode) {
+	case IBV_WR_SEND:
+	case IBV_WR_SEND_WITH_IMM:
+	case IBV_WR_RDMA_WRITE:
+	case IBV_WR_RDMA_WRITE_WITH_IMM:
+		return 1;
+	case IBV_WR_RDMA_READ:
+		return qp->ibv_qp.qp_type == IBV_QPT_RC;
+	default:
+		return 0;
+	}
+}
+
+//// queue a postlist for the NIC thread, called with sq_lock held. With
+//// grant, one token wait covers the whole postlist (the split chunks of one
+//// token, split_sgl.h); hidden WQEs are split chunks
+static int sim_post_send_paced(struct sim_qp *qp, struct ibv_send_wr *wr,
+			       struct ibv_send_wr **bad_wr, int grant, int hidden)
+{
+	struct pacer_flow *f = qp->flow;
+	uint64_t batch_bytes = 0;	/* isolation: bytes covered by a tput batch */
+	struct ibv_send_wr *w;
+	struct sim_swqe *q;
+	uint32_t room = hidden ? qp->sq_size : qp->max_send_wr;
+	int nreq, ret = 0, i;
+
+	if (grant && flow_is(f, PMSG_APP_BW)) {
+		for (w = wr; w; w = w->next)
+			batch_bytes += sge_bytes(w->sg_list, w->num_sge);
+		wait_for_token(f, flow_read_token(f, wr->opcode), batch_bytes);	/* chunks of one WR */
+	}
+
+	for (nreq = 0; wr; ++nreq, wr = wr->next) {
+		/* isolation */
+		if (!grant && flow_is(f, PMSG_APP_BW))
+			wait_for_token_wr(f, wr->opcode, sge_bytes(wr->sg_list, wr->num_sge));
+		else if (flow_is(f, PMSG_APP_TPUT))
+			batch_bytes += sge_bytes(wr->sg_list, wr->num_sge);
+		/* end */
+		if (__atomic_load_n(&qp->shm->state, __ATOMIC_RELAXED) != IBV_QPS_RTS ||
+		    !wr_supported(qp, wr) || wr->num_sge > SIM_MAX_SGE || wr->num_sge < 0) {
+			ret = EINVAL;
+			break;
+		}
+		if (qp->sq_head - __atomic_load_n(&qp->sq_done, __ATOMIC_ACQUIRE) >= room) {
+			ret = ENOMEM;
+			break;
+		}
+		q = &qp->sq[qp->sq_head & (qp->sq_size - 1)];
+		q->wr_id = wr->wr_id;
+		q->opcode = wr->opcode;
+		q->send_flags = wr->send_flags;
+		q->hidden = hidden;
+		q->num_sge = wr->num_sge;
+		memcpy(q->sg_list, wr->sg_list, wr->num_sge * sizeof(*wr->sg_list));
+		q->raddr = wr->wr.rdma.remote_addr;
+		q->rkey = wr->wr.rdma.rkey;
+		q->imm = wr->imm_data;
+		q->bytes = sge_bytes(wr->sg_list, wr->num_sge);
+		q->sent = 0;
+		q->at = 0;
+		q->status = IBV_WC_SUCCESS;
+		if (wr->send_flags & IBV_SEND_INLINE) {
+			if (q->bytes > qp->max_inline || wr->opcode == IBV_WR_RDMA_READ) {
+				ret = EINVAL;
+				break;
+			}
+			for (q->bytes = 0, i = 0; i < wr->num_sge; i++) {
+				memcpy(q->inline_data + q->bytes, (void *)(uintptr_t)wr->sg_list[i].addr,
+				       wr->sg_list[i].length);
+				q->bytes += wr->sg_list[i].length;
+			}
+		}
+		__atomic_store_n(&qp->sq_head, qp->sq_head + 1, __ATOMIC_RELEASE);
+	}
+	if (ret) {
+		errno = ret;
+		*bad_wr = wr;
+	}
+	/* isolation */
+	if (nreq && flow_is(f, PMSG_APP_TPUT))
+		tput_debit(f, nreq, batch_bytes);
+	/* end */
+	if (nreq)
+		sim_nic_ring(sim_nic);
+	return ret;
+}
+
+//// Inline split of a WR chain (split_sgl_post_chain(), split_sgl.h), as
+//// libmlx4 does it: WRITE/READ WRs over the chunk size are cut into
+//// chunks, which go on the same QP as hidden WQEs; the rest as they are.
+//// Two-sided WRs are not split, and are paced whole.
+
+// the pacer's current chunk size and batch for wr
+static void split_cut_of(struct sim_qp *qp, const struct ibv_send_wr *wr, struct split_sgl_cut *cut)
+{
+	uint32_t batch = 1;
+
+	if (wr->opcode == IBV_WR_RDMA_READ)
+		cut->chunk = __atomic_load_n(&sb->active_chunk_size_read, __ATOMIC_RELAXED);
+	else
+		vlink_cut(flow_vlink(qp->flow), &cut->chunk, &batch);
+	if (batch > SPLIT_SGL_MAX_BATCH)
+		batch = SPLIT_SGL_MAX_BATCH;
+	if (batch > qp->split_wr / 2)
+		batch = qp->split_wr / 2;
+	cut->batch = batch < 1 ? 1 : batch;
+	cut->signal = qp->split_wr / 4 > 1 ? qp->split_wr / 4 : 1;
+}
+
+static int split_chain_classify(void *ctx, struct ibv_send_wr *wr, struct split_sgl_cut *cut)
+{
+	struct sim_qp *qp = ctx;
+
+	if (wr->opcode == IBV_WR_RDMA_WRITE || wr->opcode == IBV_WR_RDMA_READ) {
+		split_cut_of(qp, wr, cut);
+		return split_sgl_bytes(wr) > cut->chunk ? SPLIT_SGL_CHUNKS : SPLIT_SGL_USER;
+	}
+	return SPLIT_SGL_USER;
+}
+
+// called with qp->sq_lock held
+static int split_chain_post(void *ctx, int where, struct ibv_send_wr *wr, struct ibv_send_wr **bad_wr)
+{
+	struct sim_qp *qp = ctx;
+
+	if (where == SPLIT_SGL_CHUNKS)
+		return sim_post_send_paced(qp, wr, bad_wr, 1, 1);
+	return sim_post_send_paced(qp, wr, bad_wr, 0, 0);
+}
+
+// wait for the signaled chunk of the oldest postlist
+static int split_chain_reap(void *ctx)
+{
+	struct sim_qp *qp = ctx;
+	int status;
+
+	while (__atomic_load_n(&qp->split_head, __ATOMIC_ACQUIRE) == qp->split_tail)
+		cpu_relax();
+	status = qp->split_cq[qp->split_tail % SIM_SPLIT_CQE];
+	__atomic_store_n(&qp->split_tail, qp->split_tail + 1, __ATOMIC_RELEASE);
+	if (status != IBV_WC_SUCCESS) {
+		fprintf(stderr, "split chunk failed: %s\n", ibv_wc_status_str(status));
+		return EIO;
+	}
+	return 0;
+}
+
+// between two postlists: the pacer's current chunk size and batch
+static void split_chain_recut(void *ctx, const struct ibv_send_wr *wr, struct split_sgl_cut *cut)
+{
+	split_cut_of(ctx, wr, cut);
+}
+
+static const struct split_sgl_ops split_chain_ops = {
+	.classify	= split_chain_classify,
+	.post		= split_chain_post,
+	.reap		= split_chain_reap,
+	.recut		= split_chain_recut,
+};
+
+int sim_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr, struct ibv_send_wr **bad_wr)
+{
+	struct sim_qp *qp = to_sqp(ibqp);
+	int ret;
+
+	pthread_spin_lock(&qp->sq_lock);
+
+	/* isolation: the first post after the QP was connected starts its flow */
+	if (qp->flow_armed && qp->flow && !qp->flow->started)
+		pacer_flow_start(qp->flow, ibqp, wr);
+	/* isolation: a QP with no declared class is classified from what it posts;
+	 * the pacer hears of its class and of each kind of WR before we charge it */
+	if (qp->flow && qp->flow->info) {
+		flow_note(qp->flow, wr);
+		if (qp->flow->auto_class)
+			flow_observe(qp->flow, wr);
+		flow_sync(qp->flow);
+	}
+	/* end */
+
+	//// WRITE/READ elephants over all of their SGEs and anywhere in the chain
+	if (qp->split_wr && split_sgl_chain_splits(&split_chain_ops, qp, wr)) {
+		ret = split_sgl_post_chain(&split_chain_ops, qp, wr, bad_wr);
+		if (ret)
+			errno = ret;
+	} else {
+		ret = sim_post_send_paced(qp, wr, bad_wr, 0, 0);
+	}
+	pthread_spin_unlock(&qp->sq_lock);
+	return ret;
+}
+
+int sim_post_recv(struct ibv_qp *ibqp, struct ibv_recv_wr *wr, struct ibv_recv_wr **bad_wr)
+{
+	struct sim_qp *qp = to_sqp(ibqp);
+	struct sim_qp_shm *s = qp->shm;
+	struct sim_rwqe *r;
+	int ret = 0;
+
+	pthread_spin_lock(&qp->rq_lock);
+	for (; wr; wr = wr->next) {
+		if (wr->num_sge > SIM_MAX_SGE || wr->num_sge < 0) {
+			ret = EINVAL;
+			break;
+		}
+		if (s->rq_head - __atomic_load_n(&s->rq_tail, __ATOMIC_ACQUIRE) >= s->rq_size) {
+			ret = ENOMEM;
+			break;
+		}
+		r = &s->rq[s->rq_head & (s->rq_size - 1)];
+		r->wr_id = wr->wr_id;
+		r->num_sge = wr->num_sge;
+		memcpy(r->sg_list, wr->sg_list, wr->num_sge * sizeof(*wr->sg_list));
+		__atomic_store_n(&s->rq_head, s->rq_head + 1, __ATOMIC_RELEASE);
+	}
+	pthread_spin_unlock(&qp->rq_lock);
+	if (ret) {
+		errno = ret;
+		*bad_wr = wr;
+	}
+	return ret;
+}
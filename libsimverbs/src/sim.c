@@ -0,0 +1,103 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "sim.h"
+
+static struct ibv_context_ops sim_ctx_ops = {
+	.query_device	= sim_query_device,
+	.query_port	= sim_query_port,
+	.alloc_pd	= sim_alloc_pd,
+	.dealloc_pd	= sim_dealloc_pd,
+	.reg_mr		= sim_reg_mr,
+	.dereg_mr	= sim_dereg_mr,
+	.create_cq	= sim_create_cq,
+	.poll_cq	= sim_poll_cq,
+	.req_notify_cq	= sim_req_notify_cq,
+	.destroy_cq	= sim_destroy_cq,
+	.create_qp	= sim_create_qp,
+	.query_qp	= sim_query_qp,
+	.modify_qp	= sim_modify_qp,
+	.destroy_qp	= sim_destroy_qp,
+	.post_send	= sim_post_send,
+	.post_recv	= sim_post_recv,
+	.create_ah	= sim_create_ah,
+	.destroy_ah	= sim_destroy_ah,
+	.attach_mcast	= sim_mcast,
+	.detach_mcast	= sim_mcast,
+};
+
+// there is no kernel: cmd_fd is -1, and async events never come. The
+// library allocates the context, with the verbs_context_exp in front of it
+static int sim_init_context(struct verbs_device *vdev, struct ibv_context *ibctx, int cmd_fd)
+{
+	struct sim_context *ctx = to_sctx(ibctx);
+	struct verbs_context_exp *vctx_exp = verbs_get_exp_ctx(ibctx);
+
+	if (sim_fabric_attach())
+		return ENODEV;
+	ibctx->cmd_fd = cmd_fd;
+	ibctx->device = &vdev->device;
+	ibctx->async_fd = eventfd(0, EFD_CLOEXEC);
+	if (ibctx->async_fd < 0)
+		return errno;
+	ibctx->ops = sim_ctx_ops;
+	ctx->dev = to_sdev(&vdev->device)->index;
+
+	//// the experimental verbs perftest and the MLNX examples call
+	verbs_set_exp_ctx_op(vctx_exp, drv_exp_query_device, sim_exp_query_device);
+	verbs_set_exp_ctx_op(vctx_exp, drv_exp_query_port, sim_exp_query_port);
+	verbs_set_exp_ctx_op(vctx_exp, drv_exp_create_qp, sim_exp_create_qp);
+	verbs_set_exp_ctx_op(vctx_exp, drv_exp_modify_qp, sim_exp_modify_qp);
+	verbs_set_exp_ctx_op(vctx_exp, drv_exp_reg_mr, sim_exp_reg_mr);
+	verbs_set_exp_ctx_op(vctx_exp, exp_create_cq, sim_exp_create_cq);
+	verbs_set_exp_ctx_op(vctx_exp, drv_exp_post_send, sim_exp_post_send);
+	verbs_set_exp_ctx_op(vctx_exp, drv_exp_ibv_poll_cq, sim_exp_poll_cq);
+	return 0;
+}
+
+// libibverbs closes async_fd and frees the context
+static void sim_uninit_context(struct verbs_device *vdev, struct ibv_context *ibctx)
+{
+}
+
+static void sim_driver_uninit(struct verbs_device *vdev)
+{
+	free(to_sdev(&vdev->device));
+}
+
+// a uverbs device of the fake sysfs tree whose ibdev is simN
+static struct verbs_device *sim_driver_init(const char *uverbs_sys_path, int abi_version)
+{
+	struct sim_device *dev;
+	char value[IBV_SYSFS_NAME_MAX];
+	char *end;
+	long index;
+
+	if (ibv_read_sysfs_file(uverbs_sys_path, "ibdev", value, sizeof(value)) < 0)
+		return NULL;
+	if (strncmp(value, SIM_DRIVER_NAME, strlen(SIM_DRIVER_NAME)))
+		return NULL;
+	index = strtol(value + strlen(SIM_DRIVER_NAME), &end, 10);
+	if (end == value + strlen(SIM_DRIVER_NAME) || *end || index < 0 || index >= SIM_MAX_DEVS) {
+		fprintf(stderr, "simverbs: %s: devices are sim0 to sim%d\n", value, SIM_MAX_DEVS - 1);
+		return NULL;
+	}
+	dev = calloc(1, sizeof(*dev));
+	if (!dev)
+		return NULL;
+	dev->index = index;
+	dev->verbs_dev.sz = sizeof(*dev);
+	dev->verbs_dev.size_of_context = sizeof(struct sim_context) - sizeof(struct ibv_context);
+	dev->verbs_dev.init_context = sim_init_context;
+	dev->verbs_dev.uninit_context = sim_uninit_context;
+	dev->verbs_dev.verbs_uninit_func = sim_driver_uninit;
+	return &dev->verbs_dev;
+}
+
+static __attribute__((constructor)) void sim_register_driver(void)
+{
+	verbs_register_driver(SIM_DRIVER_NAME, sim_driver_init);
+}
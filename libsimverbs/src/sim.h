@@ -0,0 +1,289 @@
+#ifndef SIM_H
+#define SIM_H
+//// libsimverbs: a software verbs provider, so the Justitia pacer and driver
+//// logic run on machines without RDMA NICs
+//
+// Devices sim0, sim1, ... are the hosts of one simulated fabric, all on
+// this machine. They come from a fake sysfs tree (simverbs-setup.sh writes
+// one and the SYSFS_PATH to use). Their uverbs directories have no "dev"
+// attribute, so libibverbs opens them without a kernel (cmd_fd -1). Any
+// process may open any device, so a test runs the two ends of a benchmark
+// as two processes on sim0 and sim1.
+//
+// The fabric's state is one POSIX shared memory segment (SIMVERBS_FABRIC,
+// default SIM_FABRIC_NAME) holding:
+//  - the ports and the wire model (link.h);
+//  - the QPs' receive queues;
+//  - the CQs;
+//  - the MRs, which a peer checks an rkey against.
+// Send queues stay in the process that owns them. Each process runs one
+// NIC thread (fabric.c). It sends its QPs' WQEs over the wires round-robin
+// a segment at a time. When the last byte of a WQE lands, the NIC thread
+// moves the payload into the peer process with process_vm_writev() (or
+// reads it for a READ) and writes the peer's receive completion into its
+// CQ. The requester's own completion follows one latency later, with the
+// ACK. Payloads are moved at the time the model says they arrive, so
+// applications that poll memory (ib_write_lat) see real latencies too.
+//
+// Only RC and UC QPs are simulated, with SEND, SEND_WITH_IMM, RDMA_WRITE,
+// RDMA_WRITE_WITH_IMM and RDMA_READ. There are no SRQs, atomics, UD or
+// memory windows. Of the experimental (ibv_exp_*) verbs there are only the
+// ones that have a legacy equivalent (verbs_exp.c). None of the rest is on
+// perftest's default paths.
+//
+// Pacing is the libmlx4 logic on the same code: pacer.c, pacer.h,
+// flow_class.h, pacer_msg.h and split_sgl.c are libmlx4's, and qp.c paces
+// and splits as mlx4_post_send() does. Split chunks go on the user QP
+// itself as hidden WQEs, whose completions only the splitter sees.
+#include <stdint.h>
+#include <pthread.h>
+#include <infiniband/driver.h>
+#include <infiniband/verbs.h>
+#include <infiniband/verbs_exp.h>
+#include "link.h"
+
+#define SIM_DRIVER_NAME "sim"
+#define SIM_FABRIC_NAME "/simverbs"
+#define SIM_FABRIC_MAGIC 0x73696d76
+#define SIM_FABRIC_VERSION 1		/* layout of struct sim_fabric; bump on any change */
+#define SIM_MAX_DEVS LINK_MAX_PORTS
+#define SIM_MAX_NICS 64			/* processes with the fabric open */
+#define SIM_MAX_QPS 256
+#define SIM_MAX_CQS 256
+#define SIM_MAX_MRS 1024
+#define SIM_MR_BITS 10			/* an MR's key: its slot, and above these bits a generation */
+#define SIM_MAX_SEND_WR 8192
+#define SIM_MAX_RECV_WR 1024
+#define SIM_MAX_CQE 2048
+#define SIM_MAX_SGE 4			/* SPLIT_SGL_MAX_SGE: a chunk may need as many */
+#define SIM_MAX_INLINE 256
+#define SIM_QPN_BASE 0x100		/* QP numbers are SIM_QPN_BASE + slot */
+#define SIM_SPLIT_WR 256		/* hidden split WQEs a QP may have queued; or the pacer's split_send_wr */
+#define SIM_SPLIT_CQE 64
+#define SIM_RNR_NS 10000		/* retry of a SEND that found no receive WQE */
+#define SIM_SPIN_NS 20000		/* the NIC thread spins for events closer than this, else sleeps */
+
+#define DEFAULT_SIM_RATE_MB 5000	/* 40 Gbps, 4X QDR */
+#define DEFAULT_SIM_WQE_NS 60
+#define DEFAULT_SIM_LATENCY_NS 1500
+#define DEFAULT_SIM_QUEUE_KB 512
+#define DEFAULT_SIM_SEG 4096
+
+//// shared: in the fabric segment
+
+struct sim_nic {
+	int32_t pid;			/* 0: free */
+	uint32_t doorbell;		/* futex word; bumped to wake the NIC thread */
+	uint32_t sleeping;
+};
+
+struct sim_mr_shm {
+	int32_t pid;			/* 0: free */
+	uint32_t key;			/* lkey and rkey */
+	uint32_t gen;
+	int access;
+	uint64_t addr;
+	uint64_t length;
+};
+
+struct sim_rwqe {
+	uint64_t wr_id;
+	int num_sge;
+	struct ibv_sge sg_list[SIM_MAX_SGE];
+};
+
+struct sim_qp_shm {
+	int32_t pid;			/* 0: free */
+	uint32_t qpn;
+	int dev;
+	int state;			/* enum ibv_qp_state */
+	int type;
+	int recv_cq;			/* CQ slot */
+	uint32_t rq_size;		/* power of 2 */
+	uint32_t rq_head;		/* posted by the owner */
+	uint32_t rq_tail;		/* taken by the peer's NIC thread */
+	struct sim_rwqe rq[SIM_MAX_RECV_WR];
+};
+
+struct sim_cq_shm {
+	int32_t pid;			/* 0: free */
+	int nic;			/* the owner's NIC thread, woken for events */
+	uint32_t size;			/* power of 2 */
+	uint32_t lock;
+	uint32_t head;
+	uint32_t tail;
+	uint32_t armed;			/* req_notify_cq()ed: an event when head moves past arm_head */
+	uint32_t arm_head;
+	uint32_t overflows;
+	struct ibv_wc ring[SIM_MAX_CQE];
+};
+
+struct sim_fabric {
+	uint32_t magic;			/* set last, once the rest is initialized */
+	uint32_t version;
+	struct sim_link link;
+	pthread_mutex_t lock;		/* the tables below, to take or free a slot */
+	uint32_t wire_lock;
+	struct sim_port ports[SIM_MAX_DEVS];
+	struct sim_nic nics[SIM_MAX_NICS];
+	struct sim_mr_shm mrs[SIM_MAX_MRS];
+	struct sim_qp_shm qps[SIM_MAX_QPS];
+	struct sim_cq_shm cqs[SIM_MAX_CQS];
+};
+
+//// local: in the process that owns them
+
+struct sim_device {
+	struct verbs_device verbs_dev;
+	int index;			/* N of simN */
+};
+
+struct sim_context {
+	struct ibv_context ibv_ctx;
+	int dev;
+};
+
+struct sim_pd {
+	struct ibv_pd ibv_pd;
+};
+
+struct sim_mr {
+	struct ibv_mr ibv_mr;
+	int slot;
+};
+
+struct sim_cq {
+	struct ibv_cq ibv_cq;
+	int slot;
+	struct sim_cq_shm *shm;
+	struct sim_cq *next;		/* the NIC's CQs, for events */
+};
+
+/* a send WQE */
+struct sim_swqe {
+	uint64_t wr_id;
+	int opcode;			/* enum ibv_wr_opcode */
+	int send_flags;
+	int hidden;			/* a split chunk: completes on the QP's split CQ */
+	int num_sge;
+	struct ibv_sge sg_list[SIM_MAX_SGE];
+	uint64_t raddr;
+	uint32_t rkey;
+	uint32_t imm;
+	uint32_t bytes;
+	uint32_t sent;			/* bytes on the wire so far */
+	uint64_t at;			/* ns: its last byte lands, or the next RNR retry */
+	int status;			/* enum ibv_wc_status */
+	char inline_data[SIM_MAX_INLINE];
+};
+
+struct sim_qp {
+	struct ibv_qp ibv_qp;
+	int slot;
+	struct sim_qp_shm *shm;
+	pthread_spinlock_t sq_lock;	/* posters */
+	pthread_spinlock_t rq_lock;
+	struct sim_swqe *sq;
+	uint32_t sq_size;		/* power of 2 */
+	uint32_t max_send_wr;		/* what the user may have outstanding */
+	uint32_t max_inline;
+	int sig_all;
+	uint32_t sq_head;		/* posted */
+	uint32_t sq_tx;			/* next to send; the NIC thread's from here on */
+	uint32_t sq_dlv;		/* next to deliver */
+	uint32_t sq_done;		/* next to complete: the slots before it are free */
+	uint32_t dest_qpn;
+	int dest_slot;			/* -1 until RTR */
+	int err;			/* the QP failed: the rest of its WQEs are flushed */
+	struct ibv_qp_attr attr;	/* as modify_qp() last set it, for query_qp() */
+	struct ibv_qp_cap cap;
+	/* isolation */
+	struct pacer_flow *flow;
+	int flow_armed;			/* connected: the next post starts the flow */
+	uint32_t split_wr;		/* hidden WQEs the QP may have queued */
+	uint32_t split_head;		/* split CQ, a ring of statuses: written by the NIC thread */
+	uint32_t split_tail;		/* read by the splitter */
+	int split_cq[SIM_SPLIT_CQE];
+	struct sim_qp *next;		/* the NIC's QPs */
+};
+
+#define to_sctx(ctx)	container_of(ctx, struct sim_context, ibv_ctx)
+#define to_sdev(dev)	container_of(dev, struct sim_device, verbs_dev.device)
+#define to_smr(mr)	container_of(mr, struct sim_mr, ibv_mr)
+#define to_scq(cq)	container_of(cq, struct sim_cq, ibv_cq)
+#define to_sqp(qp)	container_of(qp, struct sim_qp, ibv_qp)
+
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	asm volatile("pause" ::: "memory");
+#else
+	asm volatile("" ::: "memory");
+#endif
+}
+
+static inline void sim_spin_lock(uint32_t *lock)
+{
+	while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE))
+		while (__atomic_load_n(lock, __ATOMIC_RELAXED))
+			cpu_relax();
+}
+
+static inline void sim_spin_unlock(uint32_t *lock)
+{
+	__atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+
+extern struct sim_fabric *fabric;
+extern int sim_nic;			/* this process's slot in fabric->nics */
+extern int sim_yield;			/* empty polls and short waits yield the CPU */
+
+/* fabric.c */
+uint64_t sim_now(void);
+int sim_fabric_attach(void);
+int sim_slot_take(int32_t *pid, int n, size_t stride);
+void sim_nic_add_qp(struct sim_qp *qp);
+void sim_nic_del_qp(struct sim_qp *qp);
+void sim_nic_add_cq(struct sim_cq *cq);
+void sim_nic_del_cq(struct sim_cq *cq);
+void sim_nic_ring(int nic);
+int sim_cq_push(struct sim_cq_shm *cq, const struct ibv_wc *wc);
+
+/* verbs.c */
+int sim_query_device(struct ibv_context *context, struct ibv_device_attr *attr);
+int sim_query_port(struct ibv_context *context, uint8_t port, struct ibv_port_attr *attr);
+struct ibv_pd *sim_alloc_pd(struct ibv_context *context);
+int sim_dealloc_pd(struct ibv_pd *pd);
+struct ibv_mr *sim_reg_mr(struct ibv_pd *pd, void *addr, size_t length, int access);
+int sim_dereg_mr(struct ibv_mr *mr);
+struct ibv_cq *sim_create_cq(struct ibv_context *context, int cqe,
+			     struct ibv_comp_channel *channel, int comp_vector);
+int sim_poll_cq(struct ibv_cq *cq, int ne, struct ibv_wc *wc);
+int sim_req_notify_cq(struct ibv_cq *cq, int solicited_only);
+int sim_destroy_cq(struct ibv_cq *cq);
+struct ibv_qp *sim_create_qp(struct ibv_pd *pd, struct ibv_qp_init_attr *attr);
+int sim_query_qp(struct ibv_qp *qp, struct ibv_qp_attr *attr, int attr_mask,
+		 struct ibv_qp_init_attr *init_attr);
+int sim_modify_qp(struct ibv_qp *qp, struct ibv_qp_attr *attr, int attr_mask);
+int sim_destroy_qp(struct ibv_qp *qp);
+struct ibv_ah *sim_create_ah(struct ibv_pd *pd, struct ibv_ah_attr *attr);
+int sim_destroy_ah(struct ibv_ah *ah);
+int sim_mcast(struct ibv_qp *qp, const union ibv_gid *gid, uint16_t lid);
+
+/* verbs_exp.c */
+int sim_exp_query_device(struct ibv_context *context, struct ibv_exp_device_attr *attr);
+int sim_exp_query_port(struct ibv_context *context, uint8_t port, struct ibv_exp_port_attr *attr);
+struct ibv_qp *sim_exp_create_qp(struct ibv_context *context, struct ibv_exp_qp_init_attr *attr);
+int sim_exp_modify_qp(struct ibv_qp *qp, struct ibv_exp_qp_attr *attr, uint64_t attr_mask);
+struct ibv_mr *sim_exp_reg_mr(struct ibv_exp_reg_mr_in *in);
+struct ibv_cq *sim_exp_create_cq(struct ibv_context *context, int cqe,
+				 struct ibv_comp_channel *channel, int comp_vector,
+				 struct ibv_exp_cq_init_attr *attr);
+int sim_exp_post_send(struct ibv_qp *qp, struct ibv_exp_send_wr *wr, struct ibv_exp_send_wr **bad_wr);
+int sim_exp_poll_cq(struct ibv_cq *cq, int ne, struct ibv_exp_wc *wc, uint32_t wc_size);
+
+/* qp.c */
+int sim_post_send(struct ibv_qp *qp, struct ibv_send_wr *wr, struct ibv_send_wr **bad_wr);
+int sim_post_recv(struct ibv_qp *qp, struct ibv_recv_wr *wr, struct ibv_recv_wr **bad_wr);
+
+#endif
@@ -0,0 +1,428 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sched.h>
+#include "sim.h"
+#include "pacer.h"
+
+struct shared_block *sb = NULL;
+int registered = 0;
+
+static uint32_t roundup_pow2(uint32_t n)
+{
+	uint32_t p = 1;
+
+	while (p < n)
+		p <<= 1;
+	return p;
+}
+
+int sim_query_device(struct ibv_context *context, struct ibv_device_attr *attr)
+{
+	int dev = to_sctx(context)->dev;
+
+	memset(attr, 0, sizeof(*attr));
+	snprintf(attr->fw_ver, sizeof(attr->fw_ver), "simverbs %u", SIM_FABRIC_VERSION);
+	attr->node_guid = htobe64(0x0002c90300000000ull + dev);
+	attr->sys_image_guid = attr->node_guid;
+	attr->max_mr_size = UINT32_MAX;
+	attr->page_size_cap = 0xfffff000;
+	attr->vendor_id = 0x02c9;
+	attr->vendor_part_id = 0x5a44;		/* sim */
+	attr->max_qp = SIM_MAX_QPS;
+	attr->max_qp_wr = SIM_MAX_SEND_WR;
+	attr->device_cap_flags = IBV_DEVICE_RC_RNR_NAK_GEN;
+	attr->max_sge = SIM_MAX_SGE;
+	attr->max_cq = SIM_MAX_CQS;
+	attr->max_cqe = SIM_MAX_CQE;
+	attr->max_mr = SIM_MAX_MRS;
+	attr->max_pd = 1024;
+	attr->max_qp_rd_atom = 16;
+	attr->max_qp_init_rd_atom = 16;
+	attr->max_res_rd_atom = SIM_MAX_QPS * 16;
+	attr->atomic_cap = IBV_ATOMIC_NONE;
+	attr->max_pkeys = 1;
+	attr->local_ca_ack_delay = 16;
+	attr->phys_port_cnt = 1;
+	return 0;
+}
+
+// 4X QDR, whatever the fabric's rate: give the pacer line_rate_mb
+int sim_query_port(struct ibv_context *context, uint8_t port, struct ibv_port_attr *attr)
+{
+	if (port != 1)
+		return EINVAL;
+	memset(attr, 0, sizeof(*attr));
+	attr->state = IBV_PORT_ACTIVE;
+	attr->max_mtu = IBV_MTU_4096;
+	attr->active_mtu = IBV_MTU_4096;
+	attr->gid_tbl_len = 1;
+	attr->port_cap_flags = 0;
+	attr->max_msg_sz = 1u << 31;
+	attr->pkey_tbl_len = 1;
+	attr->lid = to_sctx(context)->dev + 1;
+	attr->sm_lid = 1;
+	attr->max_vl_num = 1;
+	attr->active_width = 2;			/* 4X */
+	attr->active_speed = 4;			/* QDR */
+	attr->phys_state = 5;			/* LinkUp */
+	attr->link_layer = IBV_LINK_LAYER_INFINIBAND;
+	return 0;
+}
+
+struct ibv_pd *sim_alloc_pd(struct ibv_context *context)
+{
+	struct sim_pd *pd = calloc(1, sizeof(*pd));
+
+	return pd ? &pd->ibv_pd : NULL;
+}
+
+int sim_dealloc_pd(struct ibv_pd *pd)
+{
+	free(container_of(pd, struct sim_pd, ibv_pd));
+	return 0;
+}
+
+// a peer's NIC thread checks an rkey against the MR's slot
+struct ibv_mr *sim_reg_mr(struct ibv_pd *pd, void *addr, size_t length, int access)
+{
+	struct sim_mr *mr;
+	struct sim_mr_shm *s;
+
+	mr = calloc(1, sizeof(*mr));
+	if (!mr)
+		return NULL;
+	mr->slot = sim_slot_take(&fabric->mrs[0].pid, SIM_MAX_MRS, sizeof(struct sim_mr_shm));
+	if (mr->slot < 0) {
+		free(mr);
+		errno = ENOMEM;
+		return NULL;
+	}
+	s = &fabric->mrs[mr->slot];
+	s->gen++;
+	s->addr = (uintptr_t)addr;
+	s->length = length;
+	s->access = access;
+	__atomic_store_n(&s->key, mr->slot | (s->gen << SIM_MR_BITS), __ATOMIC_RELEASE);
+	mr->ibv_mr.addr = addr;
+	mr->ibv_mr.length = length;
+	mr->ibv_mr.lkey = mr->ibv_mr.rkey = s->key;
+	return &mr->ibv_mr;
+}
+
+int sim_dereg_mr(struct ibv_mr *ibmr)
+{
+	struct sim_mr *mr = to_smr(ibmr);
+	struct sim_mr_shm *s = &fabric->mrs[mr->slot];
+
+	__atomic_store_n(&s->key, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&s->pid, 0, __ATOMIC_RELEASE);
+	free(mr);
+	return 0;
+}
+
+struct ibv_cq *sim_create_cq(struct ibv_context *context, int cqe,
+			     struct ibv_comp_channel *channel, int comp_vector)
+{
+	struct sim_cq *cq;
+	struct sim_cq_shm *s;
+
+	if (cqe < 1 || cqe > SIM_MAX_CQE) {
+		errno = EINVAL;
+		return NULL;
+	}
+	cq = calloc(1, sizeof(*cq));
+	if (!cq)
+		return NULL;
+	cq->slot = sim_slot_take(&fabric->cqs[0].pid, SIM_MAX_CQS, sizeof(struct sim_cq_shm));
+	if (cq->slot < 0) {
+		free(cq);
+		errno = ENOMEM;
+		return NULL;
+	}
+	s = cq->shm = &fabric->cqs[cq->slot];
+	s->nic = sim_nic;
+	s->size = roundup_pow2(cqe);
+	s->lock = 0;
+	s->head = s->tail = 0;
+	s->armed = 0;
+	s->overflows = 0;
+	cq->ibv_cq.cqe = s->size;
+	sim_nic_add_cq(cq);
+	return &cq->ibv_cq;
+}
+
+int sim_poll_cq(struct ibv_cq *ibcq, int ne, struct ibv_wc *wc)
+{
+	struct sim_cq_shm *s = to_scq(ibcq)->shm;
+	int n;
+
+	if (__atomic_load_n(&s->head, __ATOMIC_ACQUIRE) == s->tail) {
+		if (sim_yield)
+			sched_yield();
+		return 0;
+	}
+	sim_spin_lock(&s->lock);
+	for (n = 0; n < ne && s->tail != s->head; n++, s->tail++)
+		wc[n] = s->ring[s->tail & (s->size - 1)];
+	sim_spin_unlock(&s->lock);
+	return n;
+}
+
+// solicited_only is taken as any completion
+int sim_req_notify_cq(struct ibv_cq *ibcq, int solicited_only)
+{
+	struct sim_cq_shm *s = to_scq(ibcq)->shm;
+
+	sim_spin_lock(&s->lock);
+	s->arm_head = s->head;
+	__atomic_store_n(&s->armed, 1, __ATOMIC_RELEASE);
+	sim_spin_unlock(&s->lock);
+	sim_nic_ring(sim_nic);
+	return 0;
+}
+
+int sim_destroy_cq(struct ibv_cq *ibcq)
+{
+	struct sim_cq *cq = to_scq(ibcq);
+
+	sim_nic_del_cq(cq);
+	__atomic_store_n(&cq->shm->pid, 0, __ATOMIC_RELEASE);
+	free(cq);
+	return 0;
+}
+
+//// isolation: map the pacer's shared block once, before the first QP
+static void pacer_attach(void)
+{
+	static pthread_mutex_t attach_mtx = PTHREAD_MUTEX_INITIALIZER;
+	int fd_shm;
+
+	pthread_mutex_lock(&attach_mtx);
+	if (registered) {
+		pthread_mutex_unlock(&attach_mtx);
+		return;
+	}
+	registered = 1;
+
+	if ((fd_shm = shm_open(pacer_shm_name(), O_RDWR, 0600)) == -1){
+		printf("@@@Pacer's shared memory is not found. Pacer won't be used.\n");
+	} else {
+		/* set up signal handler */
+		struct sigaction new_action, old_action;
+		new_action.sa_handler = termination_handler;
+		sigemptyset(&new_action.sa_mask);
+		new_action.sa_flags = 0;
+
+		sigaction(SIGINT, NULL, &old_action);
+		if (old_action.sa_handler != SIG_IGN)
+			sigaction(SIGINT, &new_action, NULL);
+
+		sigaction(SIGHUP, NULL, &old_action);
+		if (old_action.sa_handler != SIG_IGN)
+			sigaction(SIGHUP, &new_action, NULL);
+
+		sigaction(SIGTERM, NULL, &old_action);
+		if (old_action.sa_handler != SIG_IGN)
+			sigaction(SIGTERM, &new_action, NULL);
+		/* end */
+		atexit(set_inactive_on_exit);
+
+		sb = mmap(NULL, sizeof(struct shared_block), PROT_WRITE | PROT_READ,
+			MAP_SHARED, fd_shm, 0);
+		close(fd_shm);
+		if (sb == MAP_FAILED || sb->abi_version != JUSTITIA_ABI_VERSION) {
+			printf("@@@Pacer's shared memory ABI does not match (driver ABI %d). Pacer won't be used.\n",
+				JUSTITIA_ABI_VERSION);
+			if (sb != MAP_FAILED)
+				munmap(sb, sizeof(struct shared_block));
+			sb = NULL;
+		} else {
+			pacer_init();
+		}
+	}
+	pthread_mutex_unlock(&attach_mtx);
+}
+
+struct ibv_qp *sim_create_qp(struct ibv_pd *pd, struct ibv_qp_init_attr *attr)
+{
+	struct sim_context *ctx = to_sctx(pd->context);
+	struct sim_qp *qp;
+	struct sim_qp_shm *s;
+
+	pacer_attach();
+	if ((attr->qp_type != IBV_QPT_RC && attr->qp_type != IBV_QPT_UC) || attr->srq ||
+	    attr->cap.max_send_wr > SIM_MAX_SEND_WR || attr->cap.max_recv_wr > SIM_MAX_RECV_WR ||
+	    attr->cap.max_send_sge > SIM_MAX_SGE || attr->cap.max_recv_sge > SIM_MAX_SGE ||
+	    attr->cap.max_inline_data > SIM_MAX_INLINE) {
+		errno = EINVAL;
+		return NULL;
+	}
+	qp = calloc(1, sizeof(*qp));
+	if (!qp)
+		return NULL;
+	//// chunks of split WRs queue on the QP itself; only RC QPs are split
+	if (sb && attr->qp_type == IBV_QPT_RC) {
+		qp->split_wr = PACER_TUNABLE(split_send_wr, SIM_SPLIT_WR);
+		if (qp->split_wr > SIM_SPLIT_WR)
+			qp->split_wr = SIM_SPLIT_WR;
+	}
+	qp->max_send_wr = attr->cap.max_send_wr ? attr->cap.max_send_wr : 1;
+	qp->sq_size = roundup_pow2(qp->max_send_wr + qp->split_wr);
+	qp->sq = calloc(qp->sq_size, sizeof(*qp->sq));
+	if (!qp->sq)
+		goto err;
+	qp->slot = sim_slot_take(&fabric->qps[0].pid, SIM_MAX_QPS, sizeof(struct sim_qp_shm));
+	if (qp->slot < 0) {
+		errno = ENOMEM;
+		goto err;
+	}
+	pthread_spin_init(&qp->sq_lock, PTHREAD_PROCESS_PRIVATE);
+	pthread_spin_init(&qp->rq_lock, PTHREAD_PROCESS_PRIVATE);
+	s = qp->shm = &fabric->qps[qp->slot];
+	s->dev = ctx->dev;
+	s->state = IBV_QPS_RESET;
+	s->type = attr->qp_type;
+	s->recv_cq = to_scq(attr->recv_cq)->slot;
+	s->rq_size = roundup_pow2(attr->cap.max_recv_wr ? attr->cap.max_recv_wr : 1);
+	s->rq_head = s->rq_tail = 0;
+	__atomic_store_n(&s->qpn, SIM_QPN_BASE + qp->slot, __ATOMIC_RELEASE);
+
+	qp->max_inline = attr->cap.max_inline_data;
+	qp->sig_all = attr->sq_sig_all;
+	qp->dest_slot = -1;
+	qp->cap = attr->cap;
+	qp->ibv_qp.qp_num = s->qpn;
+	qp->attr.qp_state = IBV_QPS_RESET;
+	//// a flow of its own for an RC QP, with a slot from its first post on;
+	//// 1 (lat) or 2 (tput) in qp_context declare its class
+	qp->flow = attr->qp_type == IBV_QPT_RC ? pacer_flow_open(&qp->ibv_qp, (long)attr->qp_context) : NULL;
+	sim_nic_add_qp(qp);
+	return &qp->ibv_qp;
+
+err:
+	free(qp->sq);
+	free(qp);
+	return NULL;
+}
+
+int sim_query_qp(struct ibv_qp *ibqp, struct ibv_qp_attr *attr, int attr_mask,
+		 struct ibv_qp_init_attr *init_attr)
+{
+	struct sim_qp *qp = to_sqp(ibqp);
+
+	*attr = qp->attr;
+	attr->qp_state = __atomic_load_n(&qp->shm->state, __ATOMIC_ACQUIRE);
+	attr->cap = qp->cap;
+	memset(init_attr, 0, sizeof(*init_attr));
+	init_attr->qp_context = ibqp->qp_context;
+	init_attr->send_cq = ibqp->send_cq;
+	init_attr->recv_cq = ibqp->recv_cq;
+	init_attr->cap = qp->cap;
+	init_attr->qp_type = ibqp->qp_type;
+	init_attr->sq_sig_all = qp->sig_all;
+	return 0;
+}
+
+int sim_modify_qp(struct ibv_qp *ibqp, struct ibv_qp_attr *attr, int attr_mask)
+{
+	struct sim_qp *qp = to_sqp(ibqp);
+	struct ibv_qp_attr *a = &qp->attr;
+
+	if (attr_mask & IBV_QP_STATE)
+		a->qp_state = attr->qp_state;
+	if (attr_mask & IBV_QP_PATH_MTU)
+		a->path_mtu = attr->path_mtu;
+	if (attr_mask & IBV_QP_ACCESS_FLAGS)
+		a->qp_access_flags = attr->qp_access_flags;
+	if (attr_mask & IBV_QP_PKEY_INDEX)
+		a->pkey_index = attr->pkey_index;
+	if (attr_mask & IBV_QP_PORT)
+		a->port_num = attr->port_num;
+	if (attr_mask & IBV_QP_AV)
+		a->ah_attr = attr->ah_attr;
+	if (attr_mask & IBV_QP_DEST_QPN)
+		a->dest_qp_num = attr->dest_qp_num;
+	if (attr_mask & IBV_QP_RQ_PSN)
+		a->rq_psn = attr->rq_psn;
+	if (attr_mask & IBV_QP_SQ_PSN)
+		a->sq_psn = attr->sq_psn;
+	if (attr_mask & IBV_QP_MAX_DEST_RD_ATOMIC)
+		a->max_dest_rd_atomic = attr->max_dest_rd_atomic;
+	if (attr_mask & IBV_QP_MAX_QP_RD_ATOMIC)
+		a->max_rd_atomic = attr->max_rd_atomic;
+	if (attr_mask & IBV_QP_MIN_RNR_TIMER)
+		a->min_rnr_timer = attr->min_rnr_timer;
+	if (attr_mask & IBV_QP_TIMEOUT)
+		a->timeout = attr->timeout;
+	if (attr_mask & IBV_QP_RETRY_CNT)
+		a->retry_cnt = attr->retry_cnt;
+	if (attr_mask & IBV_QP_RNR_RETRY)
+		a->rnr_retry = attr->rnr_retry;
+	if (!(attr_mask & IBV_QP_STATE))
+		return 0;
+
+	switch (attr->qp_state) {
+	case IBV_QPS_RESET:
+		//// out of the NIC's hands while its queues are emptied
+		sim_nic_del_qp(qp);
+		qp->sq_head = qp->sq_tx = qp->sq_dlv = qp->sq_done = 0;
+		qp->split_head = qp->split_tail = 0;
+		qp->shm->rq_head = qp->shm->rq_tail = 0;
+		qp->dest_slot = -1;
+		qp->err = 0;
+		sim_nic_add_qp(qp);
+		break;
+	case IBV_QPS_RTR:
+		//// QP numbers are unique on the fabric: the peer is found by its QPN
+		qp->dest_qpn = a->dest_qp_num;
+		qp->dest_slot = qp->dest_qpn >= SIM_QPN_BASE && qp->dest_qpn < SIM_QPN_BASE + SIM_MAX_QPS ?
+				qp->dest_qpn - SIM_QPN_BASE : -1;
+		break;
+	case IBV_QPS_RTS:
+		qp->flow_armed = 1;
+		break;
+	case IBV_QPS_ERR:
+		qp->err = 1;
+		break;
+	default:
+		break;
+	}
+	__atomic_store_n(&qp->shm->state, attr->qp_state, __ATOMIC_RELEASE);
+	return 0;
+}
+
+int sim_destroy_qp(struct ibv_qp *ibqp)
+{
+	struct sim_qp *qp = to_sqp(ibqp);
+
+	sim_nic_del_qp(qp);
+	pacer_flow_close(qp->flow);
+	__atomic_store_n(&qp->shm->qpn, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&qp->shm->pid, 0, __ATOMIC_RELEASE);
+	pthread_spin_destroy(&qp->sq_lock);
+	pthread_spin_destroy(&qp->rq_lock);
+	free(qp->sq);
+	free(qp);
+	return 0;
+}
+
+// UD is not simulated
+struct ibv_ah *sim_create_ah(struct ibv_pd *pd, struct ibv_ah_attr *attr)
+{
+	errno = ENOSYS;
+	return NULL;
+}
+
+int sim_destroy_ah(struct ibv_ah *ah)
+{
+	return ENOSYS;
+}
+
+int sim_mcast(struct ibv_qp *qp, const union ibv_gid *gid, uint16_t lid)
+{
+	return ENOSYS;
+}
@@ -0,0 +1,154 @@
+// The experimental verbs the simulated devices answer: each is its legacy
+// verb, for callers (perftest, the MLNX examples) that go through the
+// ibv_exp_* entry points. Only the legacy part of an attribute is filled
+// or honored; an extension the caller asks for is refused, not ignored.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "sim.h"
+
+// the legacy fields lead both structs
+int sim_exp_query_device(struct ibv_context *context, struct ibv_exp_device_attr *attr)
+{
+	struct ibv_device_attr legacy;
+
+	sim_query_device(context, &legacy);
+	memcpy(attr, &legacy, sizeof(legacy));
+	attr->comp_mask = 0;
+	return 0;
+}
+
+int sim_exp_query_port(struct ibv_context *context, uint8_t port, struct ibv_exp_port_attr *attr)
+{
+	int ret = sim_query_port(context, port, &attr->port_attr);
+
+	attr->comp_mask = 0;
+	return ret;
+}
+
+// the library calls this directly, so the QP's common fields are set here
+// as ibv_create_qp() sets them
+struct ibv_qp *sim_exp_create_qp(struct ibv_context *context, struct ibv_exp_qp_init_attr *attr)
+{
+	struct ibv_qp_init_attr legacy;
+	struct ibv_qp *qp;
+
+	if (attr->comp_mask & ~IBV_EXP_QP_INIT_ATTR_PD || !attr->pd) {
+		errno = EINVAL;
+		return NULL;
+	}
+	memcpy(&legacy, attr, sizeof(legacy));
+	qp = sim_create_qp(attr->pd, &legacy);
+	if (!qp)
+		return NULL;
+	qp->context = context;
+	qp->qp_context = attr->qp_context;
+	qp->pd = attr->pd;
+	qp->send_cq = attr->send_cq;
+	qp->recv_cq = attr->recv_cq;
+	qp->srq = attr->srq;
+	qp->qp_type = attr->qp_type;
+	qp->state = IBV_QPS_RESET;
+	qp->events_completed = 0;
+	pthread_mutex_init(&qp->mutex, NULL);
+	pthread_cond_init(&qp->cond, NULL);
+	attr->cap = legacy.cap;
+	return qp;
+}
+
+// the library sets qp->state
+int sim_exp_modify_qp(struct ibv_qp *qp, struct ibv_exp_qp_attr *attr, uint64_t attr_mask)
+{
+	if (attr_mask & ~(IBV_EXP_START_FLAG - 1))
+		return EINVAL;
+	return sim_modify_qp(qp, (struct ibv_qp_attr *)attr, attr_mask);
+}
+
+struct ibv_mr *sim_exp_reg_mr(struct ibv_exp_reg_mr_in *in)
+{
+	if (in->comp_mask || in->exp_access & ~(IBV_EXP_START_FLAG - 1)) {
+		errno = EINVAL;
+		return NULL;
+	}
+	return sim_reg_mr(in->pd, in->addr, in->length, in->exp_access);
+}
+
+struct ibv_cq *sim_exp_create_cq(struct ibv_context *context, int cqe,
+				 struct ibv_comp_channel *channel, int comp_vector,
+				 struct ibv_exp_cq_init_attr *attr)
+{
+	if (attr->comp_mask) {
+		errno = EINVAL;
+		return NULL;
+	}
+	return sim_create_cq(context, cqe, channel, comp_vector);
+}
+
+#define SIM_EXP_BATCH 32
+
+// a chain goes to sim_post_send() as legacy WRs, a batch at a time
+int sim_exp_post_send(struct ibv_qp *qp, struct ibv_exp_send_wr *wr, struct ibv_exp_send_wr **bad_wr)
+{
+	struct ibv_send_wr batch[SIM_EXP_BATCH], *bad;
+	struct ibv_exp_send_wr *orig[SIM_EXP_BATCH];
+	int n, ret;
+
+	while (wr) {
+		memset(batch, 0, sizeof(batch));
+		for (n = 0; wr && n < SIM_EXP_BATCH; n++, wr = wr->next) {
+			if ((int)wr->exp_opcode >= IBV_EXP_START_ENUM ||
+			    wr->exp_send_flags & ~(IBV_EXP_START_FLAG - 1) || wr->comp_mask) {
+				*bad_wr = wr;
+				return EINVAL;
+			}
+			orig[n] = wr;
+			batch[n].wr_id = wr->wr_id;
+			batch[n].next = &batch[n + 1];
+			batch[n].sg_list = wr->sg_list;
+			batch[n].num_sge = wr->num_sge;
+			batch[n].opcode = wr->exp_opcode;
+			batch[n].send_flags = wr->exp_send_flags;
+			batch[n].imm_data = wr->ex.imm_data;
+			batch[n].wr.rdma.remote_addr = wr->wr.rdma.remote_addr;
+			batch[n].wr.rdma.rkey = wr->wr.rdma.rkey;
+		}
+		batch[n - 1].next = NULL;
+		ret = sim_post_send(qp, batch, &bad);
+		if (ret) {
+			*bad_wr = orig[bad - batch];
+			return ret;
+		}
+	}
+	return 0;
+}
+
+// wc_size is the caller's struct ibv_exp_wc, which may be an older, shorter one
+int sim_exp_poll_cq(struct ibv_cq *cq, int ne, struct ibv_exp_wc *exp_wc, uint32_t wc_size)
+{
+	struct ibv_wc wc[SIM_EXP_BATCH];
+	struct ibv_exp_wc e;
+	int i, n;
+
+	if (ne > SIM_EXP_BATCH)
+		ne = SIM_EXP_BATCH;
+	n = sim_poll_cq(cq, ne, wc);
+	for (i = 0; i < n; i++) {
+		memset(&e, 0, sizeof(e));
+		e.wr_id = wc[i].wr_id;
+		e.status = wc[i].status;
+		e.exp_opcode = (enum ibv_exp_wc_opcode)wc[i].opcode;
+		e.vendor_err = wc[i].vendor_err;
+		e.byte_len = wc[i].byte_len;
+		e.imm_data = wc[i].imm_data;
+		e.qp_num = wc[i].qp_num;
+		e.src_qp = wc[i].src_qp;
+		e.pkey_index = wc[i].pkey_index;
+		e.slid = wc[i].slid;
+		e.sl = wc[i].sl;
+		e.dlid_path_bits = wc[i].dlid_path_bits;
+		e.exp_wc_flags = wc[i].wc_flags;
+		memcpy((char *)exp_wc + i * wc_size, &e, wc_size < sizeof(e) ? wc_size : sizeof(e));
+	}
+	return n;
+}
@@ -0,0 +1,122 @@
+#include "cc.h"
+#include <string.h>
+#include <math.h>
+
+/* cubic: growth is C * (t - K)^3 MBps with t in ms, so after a halving at
+ * 6000 MBps the cap is back at its old value K = cbrt(3000 / C) = 10 ms later */
+#define CC_CUBIC_BETA 0.5           /* multiplicative decrease, same as AIMD */
+#define CC_CUBIC_C 3.0              /* MBps / ms^3 */
+#define CC_HYSTART_FRAC 0.75        /* rising latency above this fraction of the target ends the cubic ramp */
+
+/* delay gradient: additive steps are a fraction of the line rate per round
+ * (30 MBps at 56 Gbps, i.e. +3000 MBps in ~20 ms at one round per 200 us) */
+#define CC_DELAY_AI 0.005
+#define CC_DELAY_BETA 0.8           /* how hard a normalized gradient / overshoot cuts the cap */
+#define CC_DELAY_MAX_MD 0.5         /* never cut by more than half in one round */
+#define CC_DELAY_T_LOW 0.75         /* below this fraction of the target the gradient is ignored (noise) */
+
+/* the original Justitia law: halve above the target, +1 MBps per round below it */
+static uint32_t aimd_update(struct cc_state *st, const struct cc_sample *s)
+{
+    if (s->tail_us > s->target_us) {
+        st->decreases++;
+        return st->cap >> 1;
+    }
+    return st->cap + 1;
+}
+
+/* halve like AIMD, then grow back along a cubic centred on the cap we had
+ * before the decrease: fast right after the cut, flat near the old cap,
+ * accelerating again past it. HyStart-style, a latency sample that is both
+ * rising and close to the target ends the ramp early and falls back to +1. */
+static uint32_t cubic_update(struct cc_state *st, const struct cc_sample *s)
+{
+    double t, k, w;
+
+    if (st->epoch_us == UINT64_MAX) {
+        st->epoch_us = s->now_us;
+        st->w_max = st->cap;
+    }
+    if (s->tail_us > s->target_us) {
+        st->decreases++;
+        st->w_max = st->cap;
+        st->epoch_us = s->now_us;
+        return st->cap * CC_CUBIC_BETA;
+    }
+    if (s->tail_us > s->target_us * CC_HYSTART_FRAC && s->tail_us > st->prev_tail_us)
+        return st->cap + 1;
+
+    t = (s->now_us - st->epoch_us) / 1000.0;
+    k = cbrt(st->w_max * (1 - CC_CUBIC_BETA) / CC_CUBIC_C);
+    w = st->w_max + CC_CUBIC_C * (t - k) * (t - k) * (t - k);
+    if (w > s->line_rate)
+        w = s->line_rate;
+    return w > st->cap + 1 ? w : st->cap + 1;
+}
+
+/* Swift/TIMELY-style: react to how far latency is above the target and to
+ * how fast it is rising, before it crosses the target */
+static uint32_t delay_update(struct cc_state *st, const struct cc_sample *s)
+{
+    double step = s->line_rate * CC_DELAY_AI, md = 0;
+
+    if (step < 1)
+        step = 1;
+    if (s->tail_us > s->target_us)
+        md = CC_DELAY_BETA * (1 - s->target_us / s->tail_us);
+    else if (s->tail_us > s->target_us * CC_DELAY_T_LOW && s->tail_us > st->prev_tail_us)
+        md = CC_DELAY_BETA * (s->tail_us - st->prev_tail_us) / s->target_us;
+    if (md <= 0)
+        return st->cap + step;
+
+    st->decreases++;
+    if (md > CC_DELAY_MAX_MD)
+        md = CC_DELAY_MAX_MD;
+    return st->cap * (1 - md);
+}
+
+static const struct cc_ops cc_aimd = {
+    "aimd", "halve above target, +1 MBps per round (original)", aimd_update,
+};
+
+static const struct cc_ops cc_cubic = {
+    "cubic", "halve above target, cubic recovery with a HyStart-style delay exit", cubic_update,
+};
+
+static const struct cc_ops cc_delay = {
+    "delay", "delay-gradient: proportional decrease on overshoot or rising latency", delay_update,
+};
+
+const struct cc_ops *cc_registry[] = {&cc_aimd, &cc_cubic, &cc_delay, NULL};
+
+const struct cc_ops *cc_find(const char *name)
+{
+    int i;
+    for (i = 0; cc_registry[i]; i++)
+        if (strcmp(cc_registry[i]->name, name) == 0)
+            return cc_registry[i];
+    return NULL;
+}
+
+void cc_init(struct cc_state *st, const struct cc_ops *ops, uint32_t cap)
+{
+    memset(st, 0, sizeof(*st));
+    st->ops = ops;
+    st->cap = cap;
+    st->epoch_us = UINT64_MAX;
+}
+
+uint32_t cc_update(struct cc_state *st, const struct cc_sample *s)
+{
+    uint32_t cap = st->ops->update(st, s);
+
+    if (cap > s->line_rate)
+        cap = s->line_rate;
+    if (cap < s->min_cap)
+        cap = s->min_cap;
+    if (cap == 0)
+        cap = 1;        // 0 stops the token generator altogether
+    st->cap = cap;
+    st->prev_tail_us = s->tail_us;
+    return cap;
+}
@@ -0,0 +1,49 @@
+#ifndef CC_H
+#define CC_H
+// Virtual link rate control
+//
+// monitor_latency() feeds one smoothed reference-flow latency sample per
+// virtual link every probe round (~200 us) to that link's controller, which
+// answers with a new virtual link cap in MBps. Controllers only see the
+// samples, the latency target and the bounds, so cc_sim can replay recorded
+// traces through them without RDMA hardware.
+//
+// Controllers are registered in cc_registry[] (cc.c) and picked by name,
+// from JUSTITIA_CC in the pacer.
+#include <stdint.h>
+
+#define CC_DEFAULT "aimd"
+
+/* one probe round as seen by a controller */
+struct cc_sample {
+    uint64_t now_us;            /* monotonic time of the sample */
+    double tail_us;             /* smoothed reference-flow latency */
+    double target_us;           /* latency target (tail_us) */
+    uint32_t min_cap;           /* MBps the elephants are guaranteed; >= 1 */
+    uint32_t line_rate;         /* MBps; upper bound of the cap */
+};
+
+/* per-link controller state; each controller uses the fields it needs */
+struct cc_state {
+    const struct cc_ops *ops;
+    uint32_t cap;               /* MBps; the controller's output */
+    double prev_tail_us;        /* previous sample, for gradients */
+    double w_max;               /* cubic: cap before the last decrease */
+    uint64_t epoch_us;          /* cubic: start of the current growth epoch; UINT64_MAX before the first sample */
+    uint32_t decreases;         /* number of decreases so far */
+};
+
+struct cc_ops {
+    const char *name;
+    const char *desc;
+    /* return the new cap; the caller clamps it to [min_cap, line_rate] */
+    uint32_t (*update)(struct cc_state *st, const struct cc_sample *s);
+};
+
+extern const struct cc_ops *cc_registry[];
+
+const struct cc_ops *cc_find(const char *name);
+void cc_init(struct cc_state *st, const struct cc_ops *ops, uint32_t cap);
+uint32_t cc_update(struct cc_state *st, const struct cc_sample *s);
+
+#endif
@@ -0,0 +1,210 @@
+// Replay reference-flow latency samples through the virtual link rate
+// controllers (cc.c) offline, without RDMA hardware.
+// The trace is what the pacer records with JUSTITIA_LAT_TRACE=<file>: one
+// line per controller round, "now_us link tail_us [min_cap [cap]]", '#'
+// starts a comment. Without -f a synthetic trace is used: ~1 us latency with
+// a 2 ms congestion episode (latency climbing past the target) every 200 ms.
+//
+// The replay is open loop: every controller sees the same latency, which
+// does not react to its cap. It compares how deep each controller cuts and
+// how fast it gets back to the line rate, not closed-loop stability.
+//
+// Usage: cc_sim [-f trace] [-l link] [-c controller] [-T target_us]
+//               [-r line_rate_MBps] [-m min_cap_MBps] [-t synthetic_ms]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <getopt.h>
+#include "cc.h"
+
+#define ROUND_US 200                /* monitor_latency() probe period */
+#define RECOVERED 0.95              /* recovered once the cap is back to this fraction of the line rate */
+
+struct trace_sample {
+    uint64_t now_us;
+    double tail_us;
+    uint32_t min_cap;
+    uint32_t cap;                   /* recorded cap, 0 if the trace has none */
+};
+
+struct trace {
+    struct trace_sample *s;
+    size_t n, size;
+};
+
+static void trace_add(struct trace *t, uint64_t now_us, double tail_us, uint32_t min_cap, uint32_t cap)
+{
+    if (t->n == t->size) {
+        t->size = t->size ? 2 * t->size : 4096;
+        if (!(t->s = realloc(t->s, t->size * sizeof(*t->s)))) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    t->s[t->n].now_us = now_us;
+    t->s[t->n].tail_us = tail_us;
+    t->s[t->n].min_cap = min_cap;
+    t->s[t->n].cap = cap;
+    t->n++;
+}
+
+static void load_trace(struct trace *t, const char *path, int link, uint32_t min_cap)
+{
+    char line[256];
+    uint64_t now_us;
+    double tail_us;
+    uint32_t mc, cap;
+    int l, n;
+    FILE *fp = fopen(path, "r");
+
+    if (!fp) {
+        perror("fopen");
+        exit(1);
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        if (line[0] == '#')
+            continue;
+        mc = min_cap;
+        cap = 0;
+        n = sscanf(line, "%" SCNu64 " %d %lf %" SCNu32 " %" SCNu32, &now_us, &l, &tail_us, &mc, &cap);
+        if (n < 3 || l != link)
+            continue;
+        trace_add(t, now_us, tail_us, min_cap ? min_cap : mc, cap);
+    }
+    fclose(fp);
+}
+
+static void synth_trace(struct trace *t, uint64_t ms, double target_us, uint32_t min_cap)
+{
+    unsigned int seed = 1;
+    uint64_t now, phase;
+    double tail;
+
+    for (now = 0; now < ms * 1000; now += ROUND_US) {
+        phase = now % 200000;
+        tail = 0.8 + 0.4 * rand_r(&seed) / RAND_MAX;
+        if (phase >= 100000 && phase < 101000)              // queue builds up
+            tail += (target_us - tail) * (phase - 100000) / 1000.0;
+        else if (phase >= 101000 && phase < 103000)         // congested
+            tail = target_us * 1.75;
+        trace_add(t, now, tail, min_cap, 0);
+    }
+}
+
+/* run one controller (or the recorded caps if ops is NULL) over the trace */
+static void replay(const struct trace *t, const struct cc_ops *ops, const char *name,
+                   double target_us, uint32_t line_rate)
+{
+    struct cc_state st;
+    struct cc_sample s;
+    uint64_t over_us = 0, rec_sum = 0, rec_max = 0, rec_n = 0, unrecovered = 0, r;
+    double cap_sum = 0, cap_over_sum = 0;
+    size_t i, n_over = 0;
+    uint32_t cap, cap_min = line_rate, decreases = 0, prev = line_rate;
+    int recovering = 0;
+
+    if (ops)
+        cc_init(&st, ops, line_rate);
+    for (i = 0; i < t->n; i++) {
+        if (ops) {
+            s.now_us = t->s[i].now_us;
+            s.tail_us = t->s[i].tail_us;
+            s.target_us = target_us;
+            s.min_cap = t->s[i].min_cap;
+            s.line_rate = line_rate;
+            cap = cc_update(&st, &s);
+        } else {
+            cap = t->s[i].cap;
+            if (cap < prev)
+                decreases++;
+        }
+        prev = cap;
+
+        cap_sum += cap;
+        if (cap < cap_min)
+            cap_min = cap;
+        /* recovery time: from the last over-target sample of an episode
+         * until the cap is back near the line rate */
+        if (t->s[i].tail_us > target_us) {
+            cap_over_sum += cap;
+            n_over++;
+            if (recovering && i && t->s[i - 1].tail_us <= target_us)
+                unrecovered++;      // next episode started before we got back up
+            recovering = 1;
+            over_us = t->s[i].now_us;
+        } else if (recovering && cap >= RECOVERED * line_rate) {
+            r = t->s[i].now_us - over_us;
+            rec_sum += r;
+            if (r > rec_max)
+                rec_max = r;
+            rec_n++;
+            recovering = 0;
+        }
+    }
+    if (recovering)
+        unrecovered++;
+    if (ops)
+        decreases = st.decreases;
+
+    printf("%-8s %10.0f %10.0f %8" PRIu32 " %9" PRIu32 " %12.2f %12.2f %8" PRIu64 "\n", name,
+           t->n ? cap_sum / t->n : 0, n_over ? cap_over_sum / n_over : 0, cap_min, decreases,
+           rec_n ? rec_sum / 1000.0 / rec_n : 0, rec_max / 1000.0, unrecovered);
+}
+
+int main(int argc, char **argv)
+{
+    struct trace t = {NULL, 0, 0};
+    const char *path = NULL, *only = NULL;
+    double target_us = 2;
+    uint32_t line_rate = 6000, min_cap = 0;
+    uint64_t ms = 2000;
+    int link = 0, c, i;
+
+    while ((c = getopt(argc, argv, "f:l:c:T:r:m:t:")) != -1) {
+        switch (c) {
+        case 'f': path = optarg; break;
+        case 'l': link = atoi(optarg); break;
+        case 'c': only = optarg; break;
+        case 'T': target_us = strtod(optarg, NULL); break;
+        case 'r': line_rate = strtoul(optarg, NULL, 10); break;
+        case 'm': min_cap = strtoul(optarg, NULL, 10); break;
+        case 't': ms = strtoull(optarg, NULL, 10); break;
+        default:
+            fprintf(stderr, "usage: %s [-f trace] [-l link] [-c controller] [-T target_us] [-r MBps] [-m min_cap] [-t ms]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (only && !cc_find(only)) {
+        fprintf(stderr, "unknown controller %s; available:", only);
+        for (i = 0; cc_registry[i]; i++)
+            fprintf(stderr, " %s", cc_registry[i]->name);
+        fprintf(stderr, "\n");
+        return 1;
+    }
+    if (!line_rate) {
+        fprintf(stderr, "line rate must be non-zero\n");
+        return 1;
+    }
+
+    if (path)
+        load_trace(&t, path, link, min_cap);
+    else
+        synth_trace(&t, ms, target_us, min_cap ? min_cap : line_rate / 2);
+    if (!t.n) {
+        fprintf(stderr, "no samples for link %d\n", link);
+        return 1;
+    }
+
+    printf("%zu samples over %.1f ms, target %.1f us, line rate %" PRIu32 " MBps\n", t.n,
+           (t.s[t.n - 1].now_us - t.s[0].now_us) / 1000.0, target_us, line_rate);
+    printf("%-8s %10s %10s %8s %9s %12s %12s %8s\n", "cc", "mean_cap", "cap_over", "min_cap",
+           "decreases", "recover_ms", "recover_max", "unrecov");
+    if (path && t.s[0].cap && !only)
+        replay(&t, NULL, "trace", target_us, line_rate);
+    for (i = 0; cc_registry[i]; i++)
+        if (!only || strcmp(only, cc_registry[i]->name) == 0)
+            replay(&t, cc_registry[i], cc_registry[i]->name, target_us, line_rate);
+    free(t.s);
+    return 0;
+}
@@ -0,0 +1,55 @@
+#include "chunk.h"
+
+void chunk_init(struct chunk_state *st, const struct chunk_params *p)
+{
+    st->chunk = p->max;
+    st->changes = 0;
+    st->base_us = 0;
+}
+
+/* the smallest chunk whose splitting stays within the CPU budget at cap:
+ * cap / chunk chunks per us at cost_ns each */
+uint32_t chunk_floor(const struct chunk_params *p, uint32_t cap)
+{
+    double f = p->cpu_share > 0 ? p->cost_ns * cap / (1000 * p->cpu_share) : 0;
+
+    if (f < CHUNK_MIN)
+        return CHUNK_MIN;
+    return f > p->max ? p->max : f;
+}
+
+uint32_t chunk_update(struct chunk_state *st, const struct chunk_params *p, const struct chunk_sample *s)
+{
+    double want, lo;
+
+    if (!s->num_small || !s->num_big) {
+        want = p->max;
+        st->base_us = 0;
+    } else {
+        if (!st->base_us || s->tail_us < st->base_us)
+            st->base_us = s->tail_us;
+        else
+            st->base_us += (s->tail_us - st->base_us) * CHUNK_BASE_DECAY;
+        /* a latency-sensitive message may wait behind one chunk of every big flow */
+        want = s->target_us > st->base_us ? (s->target_us - st->base_us) * s->line_rate / s->num_big : 0;
+        if (s->tail_us > s->target_us && want > st->chunk * s->target_us / s->tail_us)
+            want = st->chunk * s->target_us / s->tail_us;
+        if (want > st->chunk * CHUNK_GROW)
+            want = st->chunk * CHUNK_GROW;
+        lo = chunk_floor(p, s->cap);
+        if (want < lo)
+            want = lo;
+        if (want > p->max)
+            want = p->max;
+        if (want < st->chunk * (1 + CHUNK_DEADBAND) && want > st->chunk * (1 - CHUNK_DEADBAND) &&
+            want != lo && want != p->max)
+            return st->chunk;
+        if (want < p->max)
+            want = (uint32_t)want / CHUNK_ALIGN * CHUNK_ALIGN;
+    }
+    if ((uint32_t)want != st->chunk) {
+        st->chunk = want;
+        st->changes++;
+    }
+    return st->chunk;
+}
@@ -0,0 +1,62 @@
+#ifndef CHUNK_H
+#define CHUNK_H
+// Chunk size control
+//
+// Splitting trades CPU for latency. A latency-sensitive message sent while
+// big flows are backlogged waits at the NIC behind the chunk each of them
+// has on the wire or next in line, about num_big * chunk / line_rate. Small
+// chunks bound that wait, but every chunk costs the sender a WQE and driver
+// CPU.
+//
+// monitor_latency() feeds each virtual link's controller one sample per
+// probe round. Without latency-sensitive flows on the link, or without big
+// flows to split, the link uses the largest chunk. Otherwise the floor of
+// the measured tail (its running minimum, slowly forgotten) is latency the
+// chunks cannot fix, and what is left of the target is their budget. The
+// controller picks the largest chunk for which one chunk of every big flow
+// fits the budget, i.e. splits no finer than the target needs, and cuts
+// further in proportion while the tail is over the target anyway. It
+// shrinks at once and grows by at most CHUNK_GROW per round. The per-chunk
+// CPU cost sets a floor: at the link's cap, splitting may take at most
+// cpu_share of a core. If the target needs smaller chunks than that, the
+// floor wins and the rate controller (cc.c) closes the rest of the gap.
+// Changes smaller than CHUNK_DEADBAND are not made, so the drivers' chunk
+// size does not move every round. chunk_sim runs it in closed loop against
+// a simulated NIC.
+#include <stdint.h>
+
+#define CHUNK_MIN 1024              /* never split finer than this */
+#define CHUNK_ALIGN 64              /* chunks are a multiple of this */
+#define CHUNK_GROW 1.25             /* at most this much larger per round */
+#define CHUNK_DEADBAND 0.125        /* smaller relative changes are not made */
+#define CHUNK_BASE_DECAY 0.015625   /* per round, the tail floor moves this much towards a higher tail */
+#define DEFAULT_CHUNK_COST_NS 100   /* driver CPU per chunk, WQE, doorbell and completion; JUSTITIA_CHUNK_COST_NS */
+#define DEFAULT_CHUNK_CPU_PCT 25    /* % of a core splitting may take at the link's cap; JUSTITIA_CHUNK_CPU_PCT */
+
+struct chunk_params {
+    uint32_t max;                   /* bytes; also the chunk while nothing needs smaller ones */
+    double cost_ns;                 /* driver CPU per chunk */
+    double cpu_share;               /* of a core, at the link's cap */
+};
+
+/* one probe round as seen by the controller */
+struct chunk_sample {
+    double tail_us;                 /* smoothed reference-flow latency */
+    double target_us;               /* latency target (tail_us) */
+    uint32_t cap;                   /* MBps the link's big flows get */
+    uint32_t line_rate;             /* MBps */
+    uint16_t num_big;               /* flows split on the link: bw flows and READ responses */
+    uint16_t num_small;             /* latency-sensitive flows on the link, ours or the receiver's */
+};
+
+struct chunk_state {
+    uint32_t chunk;                 /* bytes; the controller's output */
+    uint32_t changes;               /* number of changes so far */
+    double base_us;                 /* floor of the tail while splitting for latency; 0 when not */
+};
+
+void chunk_init(struct chunk_state *st, const struct chunk_params *p);
+uint32_t chunk_floor(const struct chunk_params *p, uint32_t cap);
+uint32_t chunk_update(struct chunk_state *st, const struct chunk_params *p, const struct chunk_sample *s);
+
+#endif
@@ -0,0 +1,308 @@
+// Closed-loop simulation of the chunk size controller (chunk.c) on one
+// virtual link, with the rate controllers of cc.c. No RDMA hardware or
+// pacer daemon is needed.
+//
+// The sender has -n backlogged bw flows and a latency-sensitive flow of
+// 16-byte RPCs. Each bw flow splits its messages on its own QP, so the NIC
+// round-robins WQEs between the big flows' QPs, the RPC QP and the
+// reference flow's QP at the line rate. As in generate_fetch_tokens(),
+// tokens come at the link's cap, cover split_batch chunks each, and go to
+// the bw flows in turn, each of which keeps up to SPLIT_ENG_DEF_INFLIGHT
+// postlists at the NIC. Every ROUND_US the reference flow's latency (queue
+// wait, wire time and a fixed round trip) is smoothed as monitor_latency()
+// does, and drives the rate controller and, in the "ctl" run, the chunk
+// size controller. The chunk size applies from the next postlist on, as
+// the drivers cut. Fixed 5000-byte chunks (the old size with latency
+// flows) and fixed 1 MB chunks run for comparison.
+//
+// Reported per run: the RPCs' median and p99 wait at the NIC, what the bw
+// flows got, and the driver CPU chunking costs (chunks per second times
+// the per-chunk cost). The checks are that the controller stays within the
+// CPU budget, that it meets the latency target whenever the budget allows
+// chunks small enough, and that without RPCs it stays at 1 MB.
+//
+// Usage: chunk_sim [-n bw_flows] [-r line_rate_MBps] [-k chunk_cost_ns]
+//                  [-u cpu_pct] [-g rpc_gap_us] [-c controller] [-t sim_ms]
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+#include "cc.h"
+#include "chunk.h"
+
+#define MAX_BW 16
+#define TAIL_US 2.0                 /* latency target, tail_us (conf.h) */
+#define EWMA 0.5
+#define ROUND_US 200
+#define BASE_RTT_NS 1000            /* the reference WRITE's round trip without queueing */
+#define RPC_BYTES 16
+#define REF_BYTES 10
+#define MAX_CHUNK 1000000           /* max_chunk (conf.h) */
+#define OLD_CHUNK 5000              /* SMALL_CHUNK_SIZE, the fixed size with latency flows */
+#define BATCH_BYTES (64 * 1024)     /* split_batch_kb (conf.h) */
+#define MAX_BATCH 64
+#define INFLIGHT 4                  /* SPLIT_ENG_DEF_INFLIGHT: postlists a flow keeps at the NIC */
+#define MAX_TOKEN 5
+#define WARMUP_MS 10
+#define RING 1024
+#define HIST_NS 10
+#define HIST_BINS 100000
+
+enum { FIXED_OLD, FIXED_MAX, CTL };
+static const char *mode_names[] = { "5000 B", "1 MB", "ctl" };
+
+struct qp {
+    double post_ns[RING];
+    uint32_t bytes[RING];
+    unsigned int head, tail;
+    int postlists;                  /* bw: postlists at the NIC, the last WQE of one ends it */
+    uint8_t last[RING];
+};
+
+struct sim {
+    int n;
+    double rate;                    /* MBps = bytes per us */
+    struct chunk_params cp;
+    double rpc_gap_ns;
+    const struct cc_ops *cc;
+    double end_ns;
+    int rpcs;
+
+    struct qp qps[MAX_BW + 2];      /* bw flows, then the RPC QP, then the reference flow */
+    int rr;                         /* NIC: next QP to look at */
+    double nic_free_ns;
+
+    uint64_t hist[HIST_BINS], samples;
+    double bw_bytes, chunks, ref_post_ns, tail_us;
+    uint32_t chunk, min_chunk, max_chunk;
+};
+
+static void post(struct qp *q, double now, uint32_t bytes, int last)
+{
+    if (q->tail - q->head == RING) {
+        printf("QP ring full\n");
+        exit(1);
+    }
+    q->post_ns[q->tail % RING] = now;
+    q->bytes[q->tail % RING] = bytes;
+    q->last[q->tail % RING] = last;
+    q->tail++;
+}
+
+static uint32_t batch_of(uint32_t chunk)
+{
+    uint32_t n = BATCH_BYTES / chunk;
+
+    return n < 1 ? 1 : n > MAX_BATCH ? MAX_BATCH : n;
+}
+
+static double quantile(const struct sim *s, double q)
+{
+    uint64_t n = 0, want = q * (s->samples - 1);
+    int i;
+
+    for (i = 0; i < HIST_BINS; i++)
+        if ((n += s->hist[i]) > want)
+            return (double)i * HIST_NS / 1000;
+    return (double)HIST_BINS * HIST_NS / 1000;
+}
+
+// the NIC finished a WQE of QP i that was posted at post_ns
+static void sent(struct sim *s, double now, int i, double post_ns, uint32_t bytes, int last)
+{
+    uint64_t bin;
+
+    if (i < s->n) {
+        if (last)
+            s->qps[i].postlists--;
+        if (now >= WARMUP_MS * 1e6)
+            s->bw_bytes += bytes;
+    } else if (i == s->n) {
+        bin = (now - post_ns) / HIST_NS;
+        if (now >= WARMUP_MS * 1e6) {
+            s->hist[bin < HIST_BINS ? bin : HIST_BINS - 1]++;
+            s->samples++;
+        }
+    } else {
+        s->tail_us = EWMA * ((now - post_ns + BASE_RTT_NS) / 1000) + (1 - EWMA) * s->tail_us;
+    }
+}
+
+static void run(struct sim *s, int mode)
+{
+    struct cc_state cc;
+    struct chunk_state cs;
+    struct chunk_sample cs_sample;
+    struct cc_sample sample;
+    struct qp *q;
+    double now = 0, next_rpc = 0, next_probe = 0, last_token = 0, token_bytes, done;
+    uint32_t cap, batch, tokens = 1, c;
+    int i, k, turn = 0;
+
+    memset(s->qps, 0, sizeof(s->qps));
+    memset(s->hist, 0, sizeof(s->hist));
+    s->samples = 0;
+    s->bw_bytes = s->chunks = s->tail_us = 0;
+    s->rr = 0;
+    s->nic_free_ns = 0;
+    cc_init(&cc, s->cc, s->rate);
+    chunk_init(&cs, &s->cp);
+    s->chunk = mode == FIXED_OLD ? OLD_CHUNK : MAX_CHUNK;
+    s->min_chunk = UINT32_MAX;
+    s->max_chunk = 0;
+    cap = s->rate;
+
+    while (now < s->end_ns) {
+        // the pacer: a token once the link could have carried the last one
+        batch = batch_of(s->chunk);
+        token_bytes = (double)s->chunk * batch;
+        if (tokens < MAX_TOKEN && now - last_token >= token_bytes * 1000 / cap) {
+            last_token = now;
+            tokens++;
+        }
+        for (k = 0; tokens && k < s->n; k++, turn = (turn + 1) % s->n) {
+            q = &s->qps[turn];
+            if (q->postlists >= INFLIGHT)
+                continue;
+            tokens--;
+            for (i = 0; i < (int)batch; i++)
+                post(q, now, s->chunk, i == (int)batch - 1);
+            q->postlists++;
+            s->chunks += now >= WARMUP_MS * 1e6 ? batch : 0;
+        }
+        if (s->rpcs && now >= next_rpc) {
+            post(&s->qps[s->n], now, RPC_BYTES, 1);
+            next_rpc += s->rpc_gap_ns * (0.5 + (double)rand() / RAND_MAX);
+        }
+        if (now >= next_probe) {
+            // the previous probe round: rate and chunk size controllers
+            if (next_probe > 0) {
+                sample.now_us = now / 1000;
+                sample.tail_us = s->tail_us;
+                sample.target_us = TAIL_US;
+                sample.min_cap = s->rpcs ? s->n * s->rate / (s->n + 1) : s->rate;
+                sample.line_rate = s->rate;
+                cap = s->rpcs ? cc_update(&cc, &sample) : s->rate;
+                cs_sample.tail_us = s->tail_us;
+                cs_sample.target_us = TAIL_US;
+                cs_sample.cap = cap;
+                cs_sample.line_rate = s->rate;
+                cs_sample.num_big = s->n;
+                cs_sample.num_small = s->rpcs;
+                c = chunk_update(&cs, &s->cp, &cs_sample);
+                if (mode == CTL)
+                    s->chunk = c;
+                if (now >= WARMUP_MS * 1e6) {
+                    s->min_chunk = s->chunk < s->min_chunk ? s->chunk : s->min_chunk;
+                    s->max_chunk = s->chunk > s->max_chunk ? s->chunk : s->max_chunk;
+                }
+            }
+            post(&s->qps[s->n + 1], now, REF_BYTES, 1);
+            next_probe += ROUND_US * 1000;
+        }
+        // the NIC: one WQE at a time, round robin over the QPs with work
+        if (now >= s->nic_free_ns) {
+            for (k = 0; k < s->n + 2; k++) {
+                i = (s->rr + k) % (s->n + 2);
+                q = &s->qps[i];
+                if (q->head == q->tail)
+                    continue;
+                done = now + q->bytes[q->head % RING] * 1000.0 / s->rate;
+                sent(s, done, i, q->post_ns[q->head % RING], q->bytes[q->head % RING], q->last[q->head % RING]);
+                q->head++;
+                s->nic_free_ns = done;
+                s->rr = (i + 1) % (s->n + 2);
+                break;
+            }
+        }
+        // next event
+        done = s->nic_free_ns > now ? s->nic_free_ns : now + 1e9;
+        if (tokens < MAX_TOKEN && last_token + token_bytes * 1000 / cap < done)
+            done = last_token + token_bytes * 1000 / cap;
+        if (s->rpcs && next_rpc < done)
+            done = next_rpc;
+        if (next_probe < done)
+            done = next_probe;
+        now = done > now ? done : now + 1;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    static struct sim s;
+    uint64_t sim_ms = 200;
+    double secs, cpu[3], p99[3], lo;
+    int c, m, fail = 0;
+
+    memset(&s, 0, sizeof(s));
+    s.n = 2;
+    s.rate = 12500;
+    s.cp.max = MAX_CHUNK;
+    s.cp.cost_ns = DEFAULT_CHUNK_COST_NS;
+    s.cp.cpu_share = DEFAULT_CHUNK_CPU_PCT / 100.0;
+    s.rpc_gap_ns = 5000;
+    s.cc = cc_find(CC_DEFAULT);
+    while ((c = getopt(argc, argv, "n:r:k:u:g:c:t:")) != -1) {
+        switch (c) {
+        case 'n': s.n = atoi(optarg); break;
+        case 'r': s.rate = atof(optarg); break;
+        case 'k': s.cp.cost_ns = atof(optarg); break;
+        case 'u': s.cp.cpu_share = atof(optarg) / 100; break;
+        case 'g': s.rpc_gap_ns = atof(optarg) * 1000; break;
+        case 'c':
+            if (!(s.cc = cc_find(optarg))) {
+                printf("unknown controller %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 't': sim_ms = strtoull(optarg, NULL, 10); break;
+        default:
+            printf("usage: %s [-n bw_flows] [-r line_rate_MBps] [-k chunk_cost_ns] [-u cpu_pct]"
+                   " [-g rpc_gap_us] [-c controller] [-t sim_ms]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (s.n < 1 || s.n > MAX_BW || s.rate < 1 || s.cp.cost_ns < 0 || s.cp.cpu_share <= 0 ||
+        s.rpc_gap_ns < 100 || sim_ms <= WARMUP_MS) {
+        printf("bad arguments\n");
+        exit(1);
+    }
+    s.end_ns = sim_ms * 1e6;
+    secs = (sim_ms - WARMUP_MS) / 1000.0;
+    lo = chunk_floor(&s.cp, s.n * s.rate / (s.n + 1));
+
+    printf("%d bw flow(s) at %.0f MBps, 16-byte RPCs every ~%.0f us; %.0f ns per chunk, budget %.0f%% of a core"
+           " (floor %.0f B at the min cap); %s\n", s.n, s.rate, s.rpc_gap_ns / 1000, s.cp.cost_ns,
+           s.cp.cpu_share * 100, lo, s.cc->name);
+    srand(1);
+    s.rpcs = 1;
+    for (m = 0; m < 3; m++) {
+        run(&s, m);
+        cpu[m] = s.chunks / secs * s.cp.cost_ns / 1e9;
+        p99[m] = quantile(&s, 0.99);
+        printf("  %-7s RPC wait p50 %7.2f us  p99 %7.2f us;  bw %7.1f MBps;  %8.0f chunks/s, %5.1f%% of a core;"
+               "  chunk %u..%u B\n", mode_names[m], quantile(&s, 0.5), p99[m], s.bw_bytes / secs / 1e6,
+               s.chunks / secs, cpu[m] * 100, s.min_chunk, s.max_chunk);
+    }
+    if (cpu[CTL] > s.cp.cpu_share * 1.05) {
+        printf("FAIL: chunking took %.1f%% of a core, budget %.0f%%\n", cpu[CTL] * 100, s.cp.cpu_share * 100);
+        fail = 1;
+    }
+    // the wait behind one chunk per bw flow is the chunks' share of the target
+    if (lo * s.n / s.rate <= TAIL_US - BASE_RTT_NS / 1000.0 && p99[CTL] > TAIL_US - BASE_RTT_NS / 1000.0) {
+        printf("FAIL: RPC p99 %.2f us over the %.2f us the chunks may take\n", p99[CTL], TAIL_US - BASE_RTT_NS / 1000.0);
+        fail = 1;
+    }
+    s.rpcs = 0;
+    run(&s, CTL);
+    printf("  no RPCs: chunk %u..%u B\n", s.min_chunk, s.max_chunk);
+    if (s.min_chunk != MAX_CHUNK) {
+        printf("FAIL: chunks split without latency-sensitive flows\n");
+        fail = 1;
+    }
+    if (fail)
+        exit(1);
+    printf("chunk size controller within its latency target and CPU budget\n");
+    return 0;
+}
@@ -0,0 +1,245 @@
+// Trace replay of the online QP classifier (libmlx4/src/flow_class.h). A
+// trace is one line per posted WR: "time_ns bytes signaled". Each WR goes
+// through flow_class_add() as mlx4_post_send() counts it, and a full window
+// is closed at the time of the WR that filled it, as pacer_flow_window()
+// does. Without -f, synthetic traces with jitter are checked:
+//  - ping-pong of small signaled messages stays lat;
+//  - 1 MB WRITEs are bw from their first WR, and batched small WRITEs with
+//    selective signaling become tput with the first, short window;
+//  - a QP that turns from ping-pong into an elephant changes class once,
+//    FC_HOLD windows after it changed;
+//  - mean sizes and post rates wandering between the enter and leave
+//    thresholds, or posting bursts alternating with idle gaps, change class
+//    far less often than a classifier without hysteresis would.
+// With -f, the trace in the file is replayed and every class change printed.
+//
+// Usage: class_check [-f trace] [-s seed]
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+#include "../libmlx4/src/flow_class.h"
+
+#define MAX_WRS (1 << 20)
+
+struct wr_rec {
+    uint64_t t_ns;
+    uint64_t bytes;
+    int signaled;
+};
+
+static struct wr_rec trace[MAX_WRS];
+static int n_wrs;
+static const char *names[] = { "bw", "lat", "tput" };
+
+struct replay {
+    int first_cls;                  /* the class from the first WR, before any vote */
+    long first_vote;                /* WR index of the first vote */
+    int cls;                        /* the flow's class at the end */
+    int changes;                    /* class changes after the first vote */
+    long first_change;              /* WR index of the first change, -1 if none */
+};
+
+static void check(int cond, const char *what)
+{
+    if (!cond) {
+        printf("FAIL: %s\n", what);
+        exit(1);
+    }
+}
+
+static void add(uint64_t t_ns, uint64_t bytes, int signaled)
+{
+    check(n_wrs < MAX_WRS, "trace too long");
+    trace[n_wrs].t_ns = t_ns;
+    trace[n_wrs].bytes = bytes;
+    trace[n_wrs].signaled = signaled;
+    n_wrs++;
+}
+
+// a vote per window on thresholds alone, as a flow without hysteresis would
+// change class
+static int naive_vote(const struct flow_class *fc, uint64_t now_ns)
+{
+    struct flow_class f = *fc;
+
+    f.cls = PMSG_APP_LAT;
+    return flow_class_vote(&f, now_ns);
+}
+
+static struct replay replay(int verbose)
+{
+    struct flow_class fc;
+    struct replay r = { PMSG_APP_LAT, -1, PMSG_APP_LAT, 0, -1 };
+    int i, cls;
+
+    flow_class_init(&fc, n_wrs ? trace[0].t_ns : 0);
+    if (n_wrs)
+        r.first_cls = r.cls = flow_class_first(&fc, trace[0].bytes);
+    for (i = 0; i < n_wrs; i++) {
+        if (!flow_class_add(&fc, trace[i].bytes, trace[i].signaled))
+            continue;
+        cls = flow_class_end(&fc, trace[i].t_ns);
+        if (r.first_vote < 0) {
+            r.first_vote = i;
+        } else if (cls >= 0) {
+            r.changes++;
+            if (r.first_change < 0)
+                r.first_change = i;
+        }
+        if (cls == r.cls)
+            continue;
+        if (cls >= 0 && verbose)
+            printf("WR %d at %.3f ms: %s -> %s\n", i, trace[i].t_ns / 1e6, names[r.cls], names[cls]);
+        if (cls >= 0)
+            r.cls = cls;
+    }
+    check(r.cls == flow_class_of(&fc), "class reported");
+    return r;
+}
+
+static int naive_changes()
+{
+    struct flow_class fc;
+    int i, cls, last = -1, changes = 0;
+
+    flow_class_init(&fc, n_wrs ? trace[0].t_ns : 0);
+    for (i = 0; i < n_wrs; i++) {
+        if (!flow_class_add(&fc, trace[i].bytes, trace[i].signaled))
+            continue;
+        cls = naive_vote(&fc, trace[i].t_ns);
+        changes += last >= 0 && cls != last;
+        last = cls;
+        fc.cls = cls;               /* only for the window length */
+        fc.start_ns = trace[i].t_ns;
+        fc.bytes = fc.wrs = fc.signaled = 0;
+    }
+    return changes;
+}
+
+// n WRs of `bytes` posted every `gap` ns (+-jitter %), 1 in `sig` signaled
+static uint64_t gen(uint64_t t, int n, uint64_t bytes, uint64_t gap, int jitter, int sig)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        t += gap + (jitter ? (int64_t)gap * (rand() % (2 * jitter + 1) - jitter) / 100 : 0);
+        add(t, bytes, i % sig == sig - 1);
+    }
+    return t;
+}
+
+static void expect(const char *name, int cls, int changes)
+{
+    struct replay r = replay(0);
+
+    printf("%-26s %5d WRs: %-4s after %d changes\n", name, n_wrs, names[r.cls], r.changes);
+    check(r.cls == cls, name);
+    check(r.changes == changes, name);
+}
+
+static void run_checks()
+{
+    struct replay r;
+    uint64_t t;
+    int i, naive;
+
+    n_wrs = 0;
+    gen(0, 100 * FC_WINDOW, 64, 3000, 30, 1);
+    expect("ping-pong", PMSG_APP_LAT, 0);
+
+    n_wrs = 0;
+    gen(0, 100 * FC_WINDOW, 1 << 20, 90000, 10, 16);
+    expect("1 MB writes", PMSG_APP_BW, 0);
+    r = replay(0);
+    check(r.first_cls == PMSG_APP_BW, "an elephant is bw from its first WR");
+
+    n_wrs = 0;
+    gen(0, 100 * FC_WINDOW, 64, 200, 50, 16);
+    expect("batched small writes", PMSG_APP_TPUT, 0);
+    r = replay(0);
+    check(r.first_vote == FC_FIRST_WINDOW - 1, "tput from the first, short window");
+
+    n_wrs = 0;
+    t = gen(0, 50 * FC_WINDOW, 64, 3000, 30, 1);
+    gen(t, 50 * FC_WINDOW, 1 << 20, 90000, 10, 16);
+    expect("ping-pong, then 1 MB", PMSG_APP_BW, 1);
+    r = replay(0);
+    check(r.first_change >= (50 + FC_HOLD - 1) * FC_WINDOW && r.first_change < (50 + FC_HOLD) * FC_WINDOW,
+          "change after FC_HOLD windows");
+
+    // windows whose mean size is between FC_BW_LEAVE and FC_BW_ENTER, with
+    // now and then one over FC_BW_ENTER: a flow that got to bw stays there
+    n_wrs = 0;
+    t = gen(0, (FC_HOLD + 1) * FC_WINDOW, 1 << 20, 90000, 10, 16);
+    for (i = 0; i < 400; i++)
+        t = gen(t, FC_WINDOW, (FC_BW_LEAVE + FC_BW_ENTER) / 2 + (rand() % 4 == 0 ? FC_BW_ENTER : 0), 20000, 10, 16);
+    expect("sizes between thresholds", PMSG_APP_BW, 0);
+
+    // post rates drifting around the tput threshold, window by window
+    n_wrs = 0;
+    t = 0;
+    for (i = 0; i < 2000; i++)
+        t = gen(t, FC_WINDOW, 256, FC_TPUT_ENTER_NS / 2 + rand() % (2 * FC_TPUT_LEAVE_NS), 20, 4);
+    r = replay(0);
+    naive = naive_changes();
+    printf("%-26s %5d WRs: %d changes, %d without hysteresis\n", "rates near tput", n_wrs, r.changes, naive);
+    check(r.changes * 10 < naive, "hysteresis on rate");
+
+    // bursts of tput posting between idle gaps of about the same length
+    n_wrs = 0;
+    t = 0;
+    for (i = 0; i < 2000; i++) {
+        t = gen(t, 48, 128, 150, 30, 8);
+        t += rand() % (48 * 2 * FC_TPUT_ENTER_NS);
+    }
+    r = replay(0);
+    naive = naive_changes();
+    printf("%-26s %5d WRs: %d changes, %d without hysteresis\n", "bursts and idle gaps", n_wrs, r.changes, naive);
+    check(r.changes * 10 < naive, "hysteresis on bursts");
+
+    printf("classifier checked\n");
+}
+
+static void run_file(const char *path)
+{
+    FILE *fp = fopen(path, "r");
+    unsigned long long t, bytes;
+    int sig;
+    struct replay r;
+
+    if (!fp) {
+        perror(path);
+        exit(1);
+    }
+    n_wrs = 0;
+    while (fscanf(fp, "%llu %llu %d", &t, &bytes, &sig) == 3)
+        add(t, bytes, sig);
+    fclose(fp);
+    r = replay(1);
+    printf("%d WRs: %s, %d changes after the first vote (%d without hysteresis)\n", n_wrs, names[r.cls],
+           r.changes, naive_changes());
+}
+
+int main(int argc, char **argv)
+{
+    const char *file = NULL;
+    int op;
+
+    srand(1);
+    while ((op = getopt(argc, argv, "f:s:")) != -1) {
+        switch (op) {
+        case 'f': file = optarg; break;
+        case 's': srand(atoi(optarg)); break;
+        default:
+            printf("usage: %s [-f trace] [-s seed]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (file)
+        run_file(file);
+    else
+        run_checks();
+    return 0;
+}
@@ -0,0 +1,385 @@
+#include "conf.h"
+#include "cc.h"
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stddef.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+struct pacer_conf conf;
+
+enum { CONF_STR, CONF_U32, CONF_DBL };
+
+struct conf_key {
+    const char *name;
+    int type;
+    size_t off, len;
+    int live;
+    double min, max;                /* numbers only */
+};
+
+#define KEY(name, type, field, live, min, max) \
+    { name, type, offsetof(struct pacer_conf, field), sizeof(((struct pacer_conf *)0)->field), live, min, max }
+
+static const struct conf_key keys[] = {
+    KEY("sock_path",      CONF_STR, sock_path,      0, 0, 0),
+    KEY("shm_name",       CONF_STR, shm_name,       0, 0, 0),
+    KEY("cc",             CONF_STR, cc,             0, 0, 0),
+    KEY("ib_dev",         CONF_U32, ib_dev,         0, 0, 255),
+    KEY("ib_port",        CONF_U32, ib_port,        0, 1, 255),
+    KEY("line_rate_mb",   CONF_U32, line_rate,      1, 0, 1000000),
+    KEY("max_chunk",      CONF_U32, max_chunk,      1, CHUNK_MIN, 1 << 30),
+    KEY("max_token",      CONF_U32, max_token,      1, 1, 1000),
+    KEY("treat_l_as_one", CONF_U32, treat_l_as_one, 1, 0, 1),
+    KEY("split_batch_kb", CONF_U32, split_batch_kb, 1, 0, 65536),
+    KEY("wqe_overhead",   CONF_U32, wqe_overhead,   1, 0, 4096),
+    KEY("split_send_wr",  CONF_U32, split_send_wr,  1, 0, 65536),
+    KEY("split_recv_wr",  CONF_U32, split_recv_wr,  1, 0, 65536),
+    KEY("split_cqe",      CONF_U32, split_cqe,      1, 0, 4194304),
+    KEY("tail_us",        CONF_DBL, tail_us,        1, 0.1, 1000000),
+    KEY("ewma",           CONF_DBL, ewma,           1, 0.01, 1),
+    KEY("chunk_cost_ns",  CONF_DBL, chunk_cost_ns,  1, 0, 1000000),
+    KEY("chunk_cpu_pct",  CONF_DBL, chunk_cpu_pct,  1, 0, 100),
+};
+#define NUM_KEYS (sizeof(keys) / sizeof(keys[0]))
+
+/* $HOME/<hostname>_rdma_socket, as the drivers used to work it out */
+static void default_sock_path(char *path, size_t len)
+{
+    char hostname[64] = "";
+    FILE *fp;
+
+    if ((fp = fopen(HOSTNAME_PATH, "r"))) {
+        if (!fgets(hostname, sizeof(hostname), fp))
+            hostname[0] = '\0';
+        fclose(fp);
+    }
+    hostname[strcspn(hostname, "\n")] = '\0';
+    if (!hostname[0] || !getenv("HOME") ||
+        snprintf(path, len, "%s/%s_rdma_socket", getenv("HOME"), hostname) >= (int)len)
+        snprintf(path, len, "%s", FALLBACK_SOCK_PATH);
+}
+
+void conf_defaults(struct pacer_conf *c)
+{
+    memset(c, 0, sizeof(*c));
+    default_sock_path(c->sock_path, sizeof(c->sock_path));
+    strcpy(c->shm_name, DEFAULT_SHM_NAME);
+    strcpy(c->cc, CC_DEFAULT);
+    c->ib_dev = 0;
+    c->ib_port = 1;
+    c->line_rate = DEFAULT_LINE_RATE;
+    c->max_chunk = DEFAULT_CHUNK_SIZE;
+    c->max_token = DEFAULT_MAX_TOKEN;
+    c->treat_l_as_one = 1;
+    c->split_batch_kb = DEFAULT_SPLIT_BATCH_KB;
+    c->wqe_overhead = DEFAULT_WQE_OVERHEAD;
+    c->split_send_wr = DEFAULT_SPLIT_SEND_WR;
+    c->split_recv_wr = DEFAULT_SPLIT_RECV_WR;
+    c->split_cqe = DEFAULT_SPLIT_CQE;
+    c->tail_us = DEFAULT_TAIL_US;
+    c->ewma = DEFAULT_EWMA;
+    c->chunk_cost_ns = DEFAULT_CHUNK_COST_NS;
+    c->chunk_cpu_pct = DEFAULT_CHUNK_CPU_PCT;
+}
+
+static const struct conf_key *conf_find(const char *name)
+{
+    unsigned i;
+
+    for (i = 0; i < NUM_KEYS; i++)
+        if (!strcmp(keys[i].name, name))
+            return &keys[i];
+    return NULL;
+}
+
+/* parse value into key k of c; live_only refuses keys that need a restart.
+ * Numbers are stored atomically, the threads reading them may be running */
+int conf_set(struct pacer_conf *c, const char *key, const char *value, int live_only, char *err, int errlen)
+{
+    const struct conf_key *k = conf_find(key);
+    char *p = (char *)c + (k ? k->off : 0), *end;
+    double d;
+    uint32_t u;
+
+    if (!k) {
+        snprintf(err, errlen, "unknown key %s", key);
+        return -1;
+    }
+    if (live_only && !k->live) {
+        snprintf(err, errlen, "%s takes a restart", key);
+        return -1;
+    }
+    if (k->type == CONF_STR) {
+        if (strlen(value) >= k->len) {
+            snprintf(err, errlen, "%s: longer than %zu characters", key, k->len - 1);
+            return -1;
+        }
+        strcpy(p, value);
+        return 0;
+    }
+    errno = 0;
+    d = strtod(value, &end);
+    if (errno || end == value || *end) {
+        snprintf(err, errlen, "%s: not a number: %s", key, value);
+        return -1;
+    }
+    if (d < k->min || d > k->max || (k->type == CONF_U32 && d != (uint32_t)d)) {
+        snprintf(err, errlen, "%s: %s is not %s in [%.15g, %.15g]", key, value,
+                 k->type == CONF_U32 ? "an integer" : "a number", k->min, k->max);
+        return -1;
+    }
+    if (k->type == CONF_U32) {
+        u = d;
+        __atomic_store_n((uint32_t *)p, u, __ATOMIC_RELAXED);
+    } else {
+        __atomic_store((double *)p, &d, __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+int conf_get(const struct pacer_conf *c, const char *key, char *out, int outlen)
+{
+    const struct conf_key *k = conf_find(key);
+    const char *p = (const char *)c + (k ? k->off : 0);
+
+    if (!k)
+        return -1;
+    if (k->type == CONF_STR)
+        snprintf(out, outlen, "%s", p);
+    else if (k->type == CONF_U32)
+        snprintf(out, outlen, "%u", __atomic_load_n((const uint32_t *)p, __ATOMIC_RELAXED));
+    else
+        snprintf(out, outlen, "%g", conf_dbl((const double *)p));
+    return 0;
+}
+
+/* JUSTITIA_CONFIG, else the default file if there is one */
+const char *conf_path(void)
+{
+    if (getenv("JUSTITIA_CONFIG"))
+        return getenv("JUSTITIA_CONFIG");
+    return access(DEFAULT_CONF_PATH, R_OK) ? NULL : DEFAULT_CONF_PATH;
+}
+
+static char *trim(char *s)
+{
+    char *e;
+
+    while (isspace((unsigned char)*s))
+        s++;
+    for (e = s + strlen(s); e > s && isspace((unsigned char)e[-1]); e--)
+        ;
+    *e = '\0';
+    return s;
+}
+
+/* the file at path (none if NULL), then the JUSTITIA_* environment, over
+ * whatever c holds; prints the first bad line and returns -1 on error */
+int conf_load(struct pacer_conf *c, const char *path)
+{
+    char line[CONF_LINE_MAX], name[64], err[128], *key, *value, *eq;
+    unsigned i, j;
+    int n = 0;
+    FILE *f;
+
+    if (path) {
+        if (!(f = fopen(path, "r"))) {
+            perror(path);
+            return -1;
+        }
+        while (fgets(line, sizeof(line), f)) {
+            n++;
+            if ((eq = strchr(line, '#')))
+                *eq = '\0';
+            key = trim(line);
+            if (!*key)
+                continue;
+            if (!(eq = strchr(key, '='))) {
+                printf("%s:%d: expected key = value\n", path, n);
+                fclose(f);
+                return -1;
+            }
+            *eq = '\0';
+            key = trim(key);
+            value = trim(eq + 1);
+            if (conf_set(c, key, value, 0, err, sizeof(err))) {
+                printf("%s:%d: %s\n", path, n, err);
+                fclose(f);
+                return -1;
+            }
+        }
+        fclose(f);
+    }
+    for (i = 0; i < NUM_KEYS; i++) {
+        j = snprintf(name, sizeof(name), "JUSTITIA_");
+        for (key = (char *)keys[i].name; *key && j < sizeof(name) - 1; key++)
+            name[j++] = toupper((unsigned char)*key);
+        name[j] = '\0';
+        if (getenv(name) && conf_set(c, keys[i].name, getenv(name), 0, err, sizeof(err))) {
+            printf("%s: %s\n", name, err);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* the chunk size controller's parameters (chunk.h), as they are now */
+void conf_chunk_params(struct chunk_params *p)
+{
+    p->max = CONF_U32(max_chunk);
+    p->cost_ns = conf_dbl(&conf.chunk_cost_ns);
+    p->cpu_share = conf_dbl(&conf.chunk_cpu_pct) / 100;
+}
+
+/* read the file and environment again; live keys that changed take the new
+ * value, the others are reported */
+static int conf_reload(FILE *out)
+{
+    struct pacer_conf fresh;
+    char now[CONF_PATH_MAX], want[CONF_PATH_MAX];
+    const char *src;
+    char *dst;
+    unsigned i;
+
+    conf_defaults(&fresh);
+    if (conf_load(&fresh, conf_path())) {
+        fprintf(out, "error: bad config, nothing changed (see the pacer's output)\n");
+        return -1;
+    }
+    for (i = 0; i < NUM_KEYS; i++) {
+        dst = (char *)&conf + keys[i].off;
+        src = (const char *)&fresh + keys[i].off;
+        if (!memcmp(dst, src, keys[i].len))
+            continue;
+        conf_get(&conf, keys[i].name, now, sizeof(now));
+        conf_get(&fresh, keys[i].name, want, sizeof(want));
+        if (!keys[i].live) {
+            fprintf(out, "%s = %s takes a restart; still %s\n", keys[i].name, want, now);
+            continue;
+        }
+        if (keys[i].type == CONF_U32)
+            __atomic_store_n((uint32_t *)dst, *(const uint32_t *)src, __ATOMIC_RELAXED);
+        else
+            __atomic_store((double *)dst, (double *)src, __ATOMIC_RELAXED);
+        fprintf(out, "%s = %s (was %s)\n", keys[i].name, want, now);
+    }
+    return 0;
+}
+
+/* one line of the config socket's protocol (conf.h) on the global conf;
+ * applied() runs after anything changed */
+void conf_command(char *line, FILE *out, void (*applied)(void))
+{
+    char val[CONF_PATH_MAX], err[128], *save = NULL, *cmd, *key, *value;
+    unsigned i;
+
+    cmd = strtok_r(line, " \t\r\n", &save);
+    key = cmd ? strtok_r(NULL, " \t\r\n", &save) : NULL;
+    value = key ? trim(save) : NULL;
+    if (!cmd) {
+        fprintf(out, "error: empty command\n");
+    } else if (!strcmp(cmd, "get") && !key) {
+        for (i = 0; i < NUM_KEYS; i++) {
+            conf_get(&conf, keys[i].name, val, sizeof(val));
+            fprintf(out, "%s = %s%s\n", keys[i].name, val, keys[i].live ? "" : "  (restart)");
+        }
+        fprintf(out, "ok\n");
+    } else if (!strcmp(cmd, "get")) {
+        if (conf_get(&conf, key, val, sizeof(val)))
+            fprintf(out, "error: unknown key %s\n", key);
+        else
+            fprintf(out, "%s\nok\n", val);
+    } else if (!strcmp(cmd, "set")) {
+        if (!key || !*value) {
+            fprintf(out, "error: set key value\n");
+        } else if (conf_set(&conf, key, value, 1, err, sizeof(err))) {
+            fprintf(out, "error: %s\n", err);
+        } else {
+            printf("config: %s = %s\n", key, value);
+            if (applied)
+                applied();
+            fprintf(out, "ok\n");
+        }
+    } else if (!strcmp(cmd, "reload")) {
+        if (!conf_reload(out)) {
+            printf("config: reloaded %s\n", conf_path() ? conf_path() : "the environment");
+            if (applied)
+                applied();
+            fprintf(out, "ok\n");
+        }
+    } else {
+        fprintf(out, "error: unknown command %s; get [key], set key value, reload\n", cmd);
+    }
+    fflush(out);
+}
+
+static void error(char *msg)
+{
+    perror(msg);
+    exit(1);
+}
+
+/* the config socket next to the drivers' one; a stream socket, so any
+ * line-based client will do */
+int conf_listen(const char *sock_path)
+{
+    struct sockaddr_un local;
+    int s;
+
+    if ((s = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
+        error("socket: config");
+    memset(&local, 0, sizeof(local));
+    local.sun_family = AF_UNIX;
+    if (strlen(sock_path) + strlen(CONF_SUFFIX) >= sizeof(local.sun_path)) {
+        printf("Config socket path %s%s is too long\n", sock_path, CONF_SUFFIX);
+        exit(1);
+    }
+    snprintf(local.sun_path, sizeof(local.sun_path), "%s%s", sock_path, CONF_SUFFIX);
+    unlink(local.sun_path);
+    if (bind(s, (struct sockaddr *)&local, sizeof(local)))
+        error("bind: config");
+    if (listen(s, 4))
+        error("listen: config");
+    printf("config socket at %s\n", local.sun_path);
+    return s;
+}
+
+/* serve operators one at a time; each may send any number of commands.
+ * Replies go out with MSG_NOSIGNAL: a client that hangs up early must not
+ * take the pacer with it */
+void conf_serve(int lfd, void (*applied)(void))
+{
+    char line[CONF_LINE_MAX], *reply;
+    size_t len;
+    FILE *in, *out;
+    int fd;
+
+    while (1) {
+        if ((fd = accept(lfd, NULL, NULL)) < 0) {
+            if (errno != EINTR)
+                perror("accept: config");
+            continue;
+        }
+        if (!(in = fdopen(fd, "r"))) {
+            perror("fdopen: config");
+            close(fd);
+            continue;
+        }
+        while (fgets(line, sizeof(line), in)) {
+            if (!(out = open_memstream(&reply, &len)))
+                break;
+            conf_command(line, out, applied);
+            fclose(out);
+            if (send(fd, reply, len, MSG_NOSIGNAL) < 0) {
+                free(reply);
+                break;
+            }
+            free(reply);
+        }
+        fclose(in);
+    }
+}
@@ -0,0 +1,94 @@
+#ifndef CONF_H
+#define CONF_H
+// Runtime configuration
+//
+// The pacer's operating parameters used to be macros patched per cluster.
+// At start they are now set from built-in defaults, then from a config file
+// (JUSTITIA_CONFIG, else DEFAULT_CONF_PATH if it exists; one `key = value`
+// per line, # starts a comment), then from environment variables named
+// JUSTITIA_ plus the key in upper case, which win over the file.
+//
+// A running pacer takes commands on its config socket, the driver socket's
+// path plus ".conf", one per line (`socat - UNIX-CONNECT:<path>.conf`):
+//   get [key]          print one key, or all of them
+//   set key value      change a live key
+//   reload             read the file and environment again; live keys change,
+//                      the others are listed as needing a restart
+// and ends every reply with a line "ok" or "error: <why>".
+//
+// The bounds of the pacer's tables (MAX_FLOWS, MAX_SERVERS, MAX_CLIENTS)
+// stay compile-time: they size the shared block. What the drivers need,
+// the socket path and the sizes of their split QPs, is published in the
+// shared block, so a new value reaches them without a rebuild. conf_check
+// runs the parser and the commands without a device.
+#include <stdio.h>
+#include <stdint.h>
+#include "chunk.h"
+
+#define DEFAULT_CONF_PATH "/etc/justitia.conf"
+#define CONF_SUFFIX ".conf"             /* config socket: driver socket path + this */
+#define CONF_LINE_MAX 256
+#define CONF_PATH_MAX 108               /* sun_path */
+#define HOSTNAME_PATH "/proc/sys/kernel/hostname"
+#define FALLBACK_SOCK_PATH "/users/yiwenzhg/rdma_socket"     /* without a hostname or $HOME */
+#define DEFAULT_SHM_NAME "/rdma-fairness"  /* SHARED_MEM_NAME: where the drivers look without JUSTITIA_SHM_NAME */
+
+#define DEFAULT_LINE_RATE 0             /* MBps; 0: from the port's active speed and width */
+#define DEFAULT_CHUNK_SIZE 1000000      /* chunk while nothing needs smaller ones */
+#define DEFAULT_MAX_TOKEN 5             /* tokens a link may bank */
+#define DEFAULT_TAIL_US 2.0             /* reference-flow latency target */
+#define DEFAULT_EWMA 0.5                /* weight of the newest reference-flow sample */
+#define DEFAULT_SPLIT_BATCH_KB 64       /* bytes of small chunks one token covers */
+#define DEFAULT_WQE_OVERHEAD 100        /* header bytes a tput flow is charged per message: RoCEv2 with preamble and IFG */
+#define DEFAULT_SPLIT_SEND_WR 0         /* drivers' split QPs; 0: the driver's own SPLIT_MAX_* */
+#define DEFAULT_SPLIT_RECV_WR 0
+#define DEFAULT_SPLIT_CQE 0
+
+struct pacer_conf {
+    /* start only */
+    char sock_path[CONF_PATH_MAX];      /* where drivers join; $HOME/<hostname>_rdma_socket */
+    char shm_name[64];                  /* the shared block; its telemetry is this plus "-stats" */
+    char cc[16];                        /* rate controller (cc.h) */
+    uint32_t ib_dev;                    /* index in ibv_get_device_list() */
+    uint32_t ib_port;
+    /* live */
+    uint32_t line_rate;                 /* MBps; 0 for the port's rate */
+    uint32_t max_chunk;
+    uint32_t max_token;
+    uint32_t treat_l_as_one;            /* the receiver's latency-sensitive flows count as one in the min cap */
+    uint32_t split_batch_kb;
+    uint32_t wqe_overhead;
+    uint32_t split_send_wr;             /* for QPs created from then on */
+    uint32_t split_recv_wr;
+    uint32_t split_cqe;
+    double tail_us;
+    double ewma;
+    double chunk_cost_ns;
+    double chunk_cpu_pct;
+};
+
+extern struct pacer_conf conf;
+
+void conf_defaults(struct pacer_conf *c);
+const char *conf_path(void);
+int conf_load(struct pacer_conf *c, const char *path);
+int conf_set(struct pacer_conf *c, const char *key, const char *value, int live_only, char *err, int errlen);
+int conf_get(const struct pacer_conf *c, const char *key, char *out, int outlen);
+void conf_command(char *line, FILE *out, void (*applied)(void));
+void conf_chunk_params(struct chunk_params *p);
+int conf_listen(const char *sock_path);
+void conf_serve(int lfd, void (*applied)(void));
+
+/* a live double, read while the config thread may write it */
+static inline double conf_dbl(const double *p)
+{
+    double v;
+
+    __atomic_load(p, &v, __ATOMIC_RELAXED);
+    return v;
+}
+
+/* a live integer */
+#define CONF_U32(field) __atomic_load_n(&conf.field, __ATOMIC_RELAXED)
+
+#endif
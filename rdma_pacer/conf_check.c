@@ -0,0 +1,157 @@
+// Checks of the pacer's runtime configuration (conf.h) without a device:
+//  - a config file with comments, blank lines and spaces around "=" sets
+//    its keys and leaves the others at their defaults;
+//  - JUSTITIA_<KEY> wins over the file;
+//  - unknown keys, lines without "=", numbers out of range and fractions
+//    for integer keys are refused with the file and line;
+//  - on the config socket's protocol, get lists every key and marks those
+//    that take a restart, set changes live keys only, and reload takes the
+//    live keys that changed in the file and reports the others.
+//
+// Usage: conf_check
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "conf.h"
+
+static char path[] = "/tmp/conf_checkXXXXXX";
+static int applied;
+
+static void check(int cond, const char *what)
+{
+    if (!cond) {
+        printf("FAIL: %s\n", what);
+        unlink(path);
+        exit(1);
+    }
+}
+
+static void write_file(const char *text)
+{
+    FILE *f = fopen(path, "w");
+
+    check(f != NULL, "create the config file");
+    fputs(text, f);
+    fclose(f);
+}
+
+static void on_applied(void)
+{
+    applied++;
+}
+
+/* one command; the reply, to be freed */
+static char *command(const char *cmd)
+{
+    char line[CONF_LINE_MAX], *reply;
+    size_t len;
+    FILE *out;
+
+    snprintf(line, sizeof(line), "%s\n", cmd);
+    out = open_memstream(&reply, &len);
+    check(out != NULL, "open_memstream");
+    conf_command(line, out, on_applied);
+    fclose(out);
+    return reply;
+}
+
+static void expect(const char *cmd, const char *want, const char *what)
+{
+    char *reply = command(cmd);
+
+    if (!strstr(reply, want))
+        printf("%s: got\n%s", cmd, reply);
+    check(strstr(reply, want) != NULL, what);
+    free(reply);
+}
+
+static void check_file(void)
+{
+    struct pacer_conf c;
+
+    conf_defaults(&c);
+    check(c.max_token == DEFAULT_MAX_TOKEN && c.ib_port == 1 && c.sock_path[0], "defaults");
+    write_file("# a comment\n"
+               "\n"
+               "  line_rate_mb = 4400   # 40 Gbps\n"
+               "tail_us=3.5\n"
+               "cc = aimd\n"
+               "max_token = 3\n");
+    check(!conf_load(&c, path), "load a good file");
+    check(c.line_rate == 4400 && c.tail_us == 3.5 && !strcmp(c.cc, "aimd") && c.max_token == 3,
+          "the file's keys are set");
+    check(c.max_chunk == DEFAULT_CHUNK_SIZE && c.ewma == DEFAULT_EWMA, "the others keep their defaults");
+
+    setenv("JUSTITIA_MAX_TOKEN", "7", 1);
+    conf_defaults(&c);
+    check(!conf_load(&c, path) && c.max_token == 7, "the environment wins over the file");
+    setenv("JUSTITIA_MAX_TOKEN", "0", 1);
+    conf_defaults(&c);
+    check(conf_load(&c, path), "a bad environment variable is refused");
+    unsetenv("JUSTITIA_MAX_TOKEN");
+
+    write_file("no_such_key = 1\n");
+    check(conf_load(&c, path), "unknown key");
+    write_file("line_rate_mb 4400\n");
+    check(conf_load(&c, path), "line without =");
+    write_file("ewma = 2\n");
+    check(conf_load(&c, path), "out of range");
+    write_file("max_chunk = 4096.5\n");
+    check(conf_load(&c, path), "fraction for an integer key");
+    write_file("max_chunk = 64k\n");
+    check(conf_load(&c, path), "not a number");
+    printf("file and environment: ok\n");
+}
+
+static void check_commands(void)
+{
+    conf_defaults(&conf);
+    write_file("line_rate_mb = 6000\n");
+    setenv("JUSTITIA_CONFIG", path, 1);
+    check(!strcmp(conf_path(), path), "JUSTITIA_CONFIG names the file");
+    check(!conf_load(&conf, conf_path()), "load");
+
+    expect("get", "sock_path = ", "get lists every key");
+    expect("get", "(restart)", "get marks keys that take a restart");
+    expect("get line_rate_mb", "6000\nok\n", "get one key");
+    expect("get nothing", "error: unknown key", "get an unknown key");
+
+    applied = 0;
+    expect("set tail_us 5", "ok\n", "set a live key");
+    check(conf.tail_us == 5 && applied == 1, "set changes the key and applies it");
+    expect("set ib_port 2", "error: ib_port takes a restart", "set a key that takes a restart");
+    expect("set ewma 0", "error: ewma", "set out of range");
+    expect("set max_token", "error: set key value", "set without a value");
+    check(conf.ib_port == 1 && conf.ewma == DEFAULT_EWMA && applied == 1, "refused sets change nothing");
+    expect("frob", "error: unknown command", "unknown command");
+    expect("", "error: empty command", "empty command");
+
+    write_file("line_rate_mb = 4400\n"
+               "ib_port = 2\n");
+    expect("reload", "line_rate_mb = 4400 (was 6000)", "reload reports a live change");
+    check(conf.line_rate == 4400 && conf.tail_us == DEFAULT_TAIL_US && applied == 2,
+          "reload takes the file's live keys, and the defaults of the others");
+    expect("reload", "ok\n", "reload without changes");
+    write_file("ib_port = 3\n");
+    expect("reload", "ib_port = 3 takes a restart; still 1", "reload reports a key that takes a restart");
+    check(conf.ib_port == 1, "reload leaves keys that take a restart");
+    write_file("tail_us = 9\n"
+               "ewma = 7\n");
+    expect("reload", "error: bad config", "reload of a bad file");
+    check(conf.tail_us == DEFAULT_TAIL_US, "a bad file changes nothing");
+    unsetenv("JUSTITIA_CONFIG");
+    printf("commands: ok\n");
+}
+
+int main(void)
+{
+    int fd = mkstemp(path);
+
+    check(fd >= 0, "mkstemp");
+    close(fd);
+    check_file();
+    check_commands();
+    unlink(path);
+    return 0;
+}
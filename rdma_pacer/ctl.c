@@ -0,0 +1,247 @@
+#define _GNU_SOURCE                 /* accept4 */
+#include "ctl.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+
+static void error(char *msg)
+{
+    perror(msg);
+    exit(1);
+}
+
+/* listening SOCK_SEQPACKET socket at path; non-blocking so ctl_run can drain
+ * the accept queue */
+int ctl_listen(const char *path)
+{
+    struct sockaddr_un local;
+    int s;
+
+    if ((s = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1)
+        error("socket");
+    memset(&local, 0, sizeof(local));
+    local.sun_family = AF_UNIX;
+    strncpy(local.sun_path, path, sizeof(local.sun_path) - 1);
+    unlink(local.sun_path);
+    if (bind(s, (struct sockaddr *)&local, sizeof(local)))
+        error("bind");
+    if (listen(s, CTL_BACKLOG))
+        error("listen");
+    return s;
+}
+
+struct ctl_flow *ctl_conn_flow(struct ctl_conn *c, int slot)
+{
+    int i;
+
+    for (i = 0; i < c->nflows; i++)
+        if (c->flows[i].slot == slot)
+            return &c->flows[i];
+    return NULL;
+}
+
+/* a flow at slot joined on c; 0 if out of memory */
+static int flow_add(struct ctl_conn *c, int slot)
+{
+    struct ctl_flow *f;
+    int max;
+
+    if (ctl_conn_flow(c, slot))
+        return 1;
+    if (c->nflows == c->max_flows) {
+        max = c->max_flows ? 2 * c->max_flows : 4;
+        if (!(f = realloc(c->flows, max * sizeof(*f))))
+            return 0;
+        c->flows = f;
+        c->max_flows = max;
+    }
+    f = &c->flows[c->nflows++];
+    f->slot = slot;
+    f->app_type = -1;
+    f->dest_key = 0;
+    f->reads = 0;
+    f->read_key = 0;
+    return 1;
+}
+
+/* an exit of app_type the driver did not send */
+static void flow_exit(struct ctl_conn *c, struct ctl_flow *f, int app_type, uint64_t dest_key,
+                      const struct ctl_ops *ops)
+{
+    struct pmsg_app m;
+
+    memset(&m, 0, sizeof(m));
+    m.dest_key = dest_key;
+    m.app_type = app_type;
+    m.slot = f->slot;
+    ops->exit(c, f, &m);
+}
+
+/* the flow leaves: exit its class and its READs if it still has them, close
+ * it, forget it */
+static void flow_drop(struct ctl_conn *c, struct ctl_flow *f, const struct ctl_ops *ops)
+{
+    /* the process died (or forgot) without saying goodbye */
+    if (f->app_type >= 0)
+        flow_exit(c, f, f->app_type, f->dest_key, ops);
+    if (f->reads)
+        flow_exit(c, f, PMSG_APP_READ, f->read_key, ops);
+    ops->close(c, f);
+    *f = c->flows[--c->nflows];
+}
+
+static void ctl_close(int ep, struct ctl_conn *c, const struct ctl_ops *ops)
+{
+    while (c->nflows)
+        flow_drop(c, &c->flows[c->nflows - 1], ops);
+    epoll_ctl(ep, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    free(c->flows);
+    free(c);
+}
+
+/* handle one datagram; returns 0 if the connection should be dropped */
+static int ctl_recv(struct ctl_conn *c, uint32_t abi_version, const struct ctl_ops *ops)
+{
+    struct pmsg m, ack;
+    struct ctl_flow *f;
+    ssize_t n;
+
+    n = recv(c->fd, &m, sizeof(m), 0);
+    if (n <= 0) {
+        if (n < 0 && errno != ECONNRESET)
+            perror("recv");
+        return 0;
+    }
+    if (!pmsg_valid(&m, n)) {
+        printf("Dropping connection after a malformed message (type %u, %zd bytes)\n", m.hdr.type, n);
+        return 0;
+    }
+
+    if (m.hdr.type == PMSG_JOIN) {
+        pmsg_init(&ack, PMSG_JOIN_ACK, sizeof(ack.ack));
+        ack.ack.abi_version = abi_version;
+        if (m.join.abi_version != abi_version) {
+            printf("Driver ABI version %u does not match pacer ABI version %u. Rejected.\n",
+                   m.join.abi_version, abi_version);
+            ack.ack.status = PMSG_EABI;
+        } else {
+            ops->join(c, &m.join, &ack.ack);
+        }
+        if (ack.ack.status == PMSG_OK && !flow_add(c, ack.ack.slot)) {
+            perror("malloc: flow");
+            return 0;
+        }
+        if (send(c->fd, &ack, sizeof(ack.hdr) + ack.hdr.len, MSG_NOSIGNAL) == -1) {
+            perror("send: join ack");
+            return 0;
+        }
+        /* no slot free: the connection's other flows stay */
+        return ack.ack.status != PMSG_EABI;
+    }
+
+    if (!(f = ctl_conn_flow(c, m.app.slot))) {
+        printf("Dropping connection: message type %u for slot %u it did not join\n", m.hdr.type, m.app.slot);
+        return 0;
+    }
+    if (m.app.app_type == PMSG_APP_READ) {
+        switch (m.hdr.type) {
+        case PMSG_APP:
+            if (!f->reads) {
+                f->reads = 1;
+                f->read_key = m.app.dest_key;
+                ops->app(c, f, &m.app);
+            }
+            return 1;
+        case PMSG_EXIT:
+            if (f->reads)
+                ops->exit(c, f, &m.app);
+            f->reads = 0;
+            return 1;
+        case PMSG_CLASS:
+            printf("Dropping connection: slot %u asked for class READ\n", m.app.slot);
+            return 0;
+        }
+    }
+    switch (m.hdr.type) {
+    case PMSG_APP:
+        f->app_type = m.app.app_type;
+        f->dest_key = m.app.dest_key;
+        ops->app(c, f, &m.app);
+        break;
+    case PMSG_CLASS:
+        if (f->app_type >= 0) {         // leave the old class, join the new one
+            printf("slot %d: class %d -> %u\n", f->slot, f->app_type, m.app.app_type);
+            flow_exit(c, f, f->app_type, f->dest_key, ops);
+        }
+        f->app_type = m.app.app_type;
+        f->dest_key = m.app.dest_key;
+        ops->app(c, f, &m.app);
+        break;
+    case PMSG_EXIT:
+        if (f->app_type >= 0)           // nothing to undo if the flow never posted
+            ops->exit(c, f, &m.app);
+        f->app_type = -1;
+        break;
+    case PMSG_LEAVE:
+        flow_drop(c, f, ops);
+        break;
+    default:
+        printf("Dropping connection: unexpected message type %u\n", m.hdr.type);
+        return 0;
+    }
+    return 1;
+}
+
+/* serve lfd forever */
+void ctl_run(int lfd, uint32_t abi_version, const struct ctl_ops *ops)
+{
+    struct epoll_event ev, events[CTL_MAX_EVENTS];
+    struct ctl_conn *c;
+    int ep, n, i, fd;
+
+    if ((ep = epoll_create1(EPOLL_CLOEXEC)) == -1)
+        error("epoll_create1");
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;                 /* NULL marks the listening socket */
+    if (epoll_ctl(ep, EPOLL_CTL_ADD, lfd, &ev))
+        error("epoll_ctl");
+
+    while (1) {
+        n = epoll_wait(ep, events, CTL_MAX_EVENTS, -1);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            error("epoll_wait");
+        }
+        for (i = 0; i < n; i++) {
+            c = events[i].data.ptr;
+            if (c) {
+                if (!ctl_recv(c, abi_version, ops))
+                    ctl_close(ep, c, ops);
+                continue;
+            }
+            /* connection sockets stay blocking: replies and CPU_FRIENDLY
+             * tokens are tiny and the driver always reads them */
+            while ((fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC)) >= 0) {
+                if (!(c = malloc(sizeof(*c))))
+                    error("malloc");
+                c->fd = fd;
+                c->nflows = 0;
+                c->max_flows = 0;
+                c->flows = NULL;
+                ev.events = EPOLLIN;
+                ev.data.ptr = c;
+                if (epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev))
+                    error("epoll_ctl");
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED)
+                perror("accept");
+        }
+    }
+}
@@ -0,0 +1,54 @@
+#ifndef CTL_H
+#define CTL_H
+// Pacer side of the driver control protocol (pacer_msg.h)
+//
+// One thread multiplexes the listening socket and every driver connection
+// with epoll, so a process that is slow to finish its handshake (or never
+// does) no longer holds up everyone queued behind it in accept(). A join is
+// a single request/response, app, class, exit and leave messages need no
+// reply. A class change is passed on as an exit of the old class and an app
+// of the new one. A flow's READs (PMSG_APP_READ) come and go on their own,
+// next to its class. A connection holds the flows joined on it; a leave, or
+// the connection going away, exits and closes them one by one.
+//
+// The protocol bookkeeping lives here; what a join, app or exit means is up
+// to the callbacks, so the pacer and reg_bench share the same loop.
+#include <stdint.h>
+#include "pacer_msg.h"
+
+#define CTL_BACKLOG 512             /* pending connects; a registration storm fits */
+#define CTL_MAX_EVENTS 64
+
+struct ctl_flow {
+    int slot;
+    int app_type;                   /* PMSG_APP_* reported and not yet exited, -1 if none */
+    uint64_t dest_key;              /* of that app message */
+    int reads;                      /* a PMSG_APP_READ reported and not yet exited */
+    uint64_t read_key;              /* of that one */
+};
+
+struct ctl_conn {
+    int fd;
+    int nflows;                     /* flows joined on the connection and not left */
+    int max_flows;
+    struct ctl_flow *flows;
+};
+
+struct ctl_ops {
+    /* fill in ack->status, slot, vlink and is_sender; status PMSG_OK adds a
+     * flow at ack->slot to the connection, unless it holds one there
+     * already. The ABI is already checked. */
+    void (*join)(struct ctl_conn *c, const struct pmsg_join *m, struct pmsg_join_ack *ack);
+    void (*app)(struct ctl_conn *c, struct ctl_flow *f, const struct pmsg_app *m);
+    void (*exit)(struct ctl_conn *c, struct ctl_flow *f, const struct pmsg_app *m);
+    /* a flow left or its connection went away; runs after the implicit
+     * exit, if any */
+    void (*close)(struct ctl_conn *c, struct ctl_flow *f);
+};
+
+/* the connection's flow at slot, NULL if it holds none there */
+struct ctl_flow *ctl_conn_flow(struct ctl_conn *c, int slot);
+int ctl_listen(const char *path);
+void ctl_run(int lfd, uint32_t abi_version, const struct ctl_ops *ops);
+
+#endif
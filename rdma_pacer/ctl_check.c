@@ -0,0 +1,222 @@
+// Checks of the pacer's control loop (ctl.c) with several flows on one
+// connection, as libmlx4 and libsimverbs multiplex a process's QPs:
+//  - two joins on one connection get two slots, and app, class and exit
+//    messages reach the flow their slot names;
+//  - a join the pacer turns down (no free slot) keeps the connection and
+//    the flows already on it;
+//  - a flow's READs (PMSG_APP_READ) come and go next to its class, and are
+//    never a class of their own;
+//  - a leave exits the flow's class and its READs and closes only that flow;
+//  - a message for a slot the connection did not join drops it;
+//  - closing the connection exits and closes every flow still on it.
+//
+// Usage: ctl_check
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "ctl.h"
+
+#define CHECK_ABI 7
+#define CHECK_SLOTS 4
+
+static char sock_path[108];
+static int slot_used[CHECK_SLOTS];
+/* what the callbacks saw, per slot */
+static int apps[CHECK_SLOTS], exits[CHECK_SLOTS], closes[CHECK_SLOTS], last_type[CHECK_SLOTS];
+static int read_apps[CHECK_SLOTS], read_exits[CHECK_SLOTS];
+
+static void check(int cond, const char *what)
+{
+    if (!cond) {
+        printf("FAIL: %s\n", what);
+        unlink(sock_path);
+        exit(1);
+    }
+}
+
+static void on_join(struct ctl_conn *c, const struct pmsg_join *m, struct pmsg_join_ack *ack)
+{
+    int slot = m->qpn < CHECK_SLOTS ? m->qpn : -1;
+
+    if (slot < 0 || slot_used[slot]) {
+        ack->status = PMSG_EFULL;
+        return;
+    }
+    slot_used[slot] = 1;
+    ack->status = PMSG_OK;
+    ack->slot = slot;
+}
+
+static void on_app(struct ctl_conn *c, struct ctl_flow *f, const struct pmsg_app *m)
+{
+    if (m->app_type == PMSG_APP_READ) {
+        __atomic_fetch_add(&read_apps[f->slot], 1, __ATOMIC_RELEASE);
+        return;
+    }
+    __atomic_store_n(&last_type[f->slot], m->app_type, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&apps[f->slot], 1, __ATOMIC_RELEASE);
+}
+
+static void on_exit_app(struct ctl_conn *c, struct ctl_flow *f, const struct pmsg_app *m)
+{
+    check(m->slot == (uint32_t)f->slot, "exit names its flow's slot");
+    if (m->app_type == PMSG_APP_READ) {
+        __atomic_fetch_add(&read_exits[f->slot], 1, __ATOMIC_RELEASE);
+        return;
+    }
+    __atomic_fetch_add(&exits[f->slot], 1, __ATOMIC_RELEASE);
+}
+
+static void on_close(struct ctl_conn *c, struct ctl_flow *f)
+{
+    slot_used[f->slot] = 0;
+    __atomic_fetch_add(&closes[f->slot], 1, __ATOMIC_RELEASE);
+}
+
+static void *server(void *arg)
+{
+    static const struct ctl_ops ops = {
+        .join = on_join,
+        .app = on_app,
+        .exit = on_exit_app,
+        .close = on_close,
+    };
+    ctl_run(*(int *)arg, CHECK_ABI, &ops);
+    return NULL;
+}
+
+/* wait up to a second for *count to reach n */
+static int wait_for(int *count, int n)
+{
+    int i;
+
+    for (i = 0; i < 1000 && __atomic_load_n(count, __ATOMIC_ACQUIRE) < n; i++)
+        usleep(1000);
+    return __atomic_load_n(count, __ATOMIC_ACQUIRE) == n;
+}
+
+static int conn(void)
+{
+    struct sockaddr_un remote;
+    int s = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+
+    memset(&remote, 0, sizeof(remote));
+    remote.sun_family = AF_UNIX;
+    memcpy(remote.sun_path, sock_path, sizeof(remote.sun_path));
+    check(s >= 0 && connect(s, (struct sockaddr *)&remote, sizeof(remote)) == 0, "connect");
+    return s;
+}
+
+static void send_msg(int s, uint16_t type, uint32_t slot, uint8_t app_type)
+{
+    struct pmsg m;
+
+    pmsg_init(&m, type, sizeof(m.app));
+    m.app.dest_key = 0x1234;
+    m.app.app_type = app_type;
+    m.app.slot = slot;
+    check(send(s, &m, sizeof(m.hdr) + m.hdr.len, 0) > 0, "send");
+}
+
+/* join flow qpn on s; the ack's status, and its slot in *slot */
+static int join(int s, uint32_t qpn, uint32_t *slot)
+{
+    struct pmsg m;
+    long n;
+
+    pmsg_init(&m, PMSG_JOIN, sizeof(m.join));
+    m.join.abi_version = CHECK_ABI;
+    m.join.pid = getpid();
+    m.join.qpn = qpn;
+    check(send(s, &m, sizeof(m.hdr) + m.hdr.len, 0) > 0, "send join");
+    n = recv(s, &m, sizeof(m), 0);
+    check(pmsg_valid(&m, n) && m.hdr.type == PMSG_JOIN_ACK, "join ack");
+    *slot = m.ack.slot;
+    return m.ack.status;
+}
+
+/* whether the pacer dropped s */
+static int dropped(int s)
+{
+    char c;
+
+    return recv(s, &c, 1, 0) == 0;
+}
+
+int main(void)
+{
+    pthread_t t;
+    uint32_t a, b, x;
+    int lfd, s, s2;
+
+    snprintf(sock_path, sizeof(sock_path), "/tmp/ctl_check.%d", getpid());
+    lfd = ctl_listen(sock_path);
+    check(pthread_create(&t, NULL, server, &lfd) == 0, "server thread");
+
+    /* two flows on one connection, each with its own class */
+    s = conn();
+    check(join(s, 1, &a) == PMSG_OK && a == 1, "first join gets its slot");
+    check(join(s, 2, &b) == PMSG_OK && b == 2, "second join on the same connection gets another slot");
+    send_msg(s, PMSG_APP, a, PMSG_APP_LAT);
+    send_msg(s, PMSG_APP, b, PMSG_APP_BW);
+    check(wait_for(&apps[a], 1) && wait_for(&apps[b], 1), "app reaches each flow");
+    check(last_type[a] == PMSG_APP_LAT && last_type[b] == PMSG_APP_BW, "each flow keeps its class");
+
+    /* a class change is an exit and an app of that flow only */
+    send_msg(s, PMSG_CLASS, b, PMSG_APP_TPUT);
+    check(wait_for(&apps[b], 2) && exits[b] == 1 && exits[a] == 0, "class change moves only its flow");
+    check(last_type[b] == PMSG_APP_TPUT, "class change sets the new class");
+
+    /* READs start and stop next to the class, once each */
+    send_msg(s, PMSG_APP, b, PMSG_APP_READ);
+    send_msg(s, PMSG_APP, b, PMSG_APP_READ);
+    send_msg(s, PMSG_EXIT, b, PMSG_APP_READ);
+    send_msg(s, PMSG_EXIT, b, PMSG_APP_READ);
+    send_msg(s, PMSG_APP, b, PMSG_APP_READ);
+    check(wait_for(&read_apps[b], 2) && read_exits[b] == 1, "READs start and stop once each");
+    check(apps[b] == 2 && exits[b] == 1 && last_type[b] == PMSG_APP_TPUT, "READs leave the class alone");
+
+    /* no free slot: turned down, and the connection carries on */
+    check(join(s, CHECK_SLOTS, &x) == PMSG_EFULL, "join without a free slot is turned down");
+    send_msg(s, PMSG_EXIT, a, PMSG_APP_LAT);
+    check(wait_for(&exits[a], 1), "connection survives a turned-down join");
+
+    /* a leave closes its flow and no other; the slot is free again */
+    send_msg(s, PMSG_APP, a, PMSG_APP_LAT);
+    send_msg(s, PMSG_APP, a, PMSG_APP_READ);
+    check(wait_for(&apps[a], 2) && wait_for(&read_apps[a], 1), "app after exit");
+    send_msg(s, PMSG_LEAVE, a, PMSG_APP_LAT);
+    check(wait_for(&closes[a], 1) && exits[a] == 2 && read_exits[a] == 1, "leave exits and closes its flow");
+    check(closes[b] == 0, "leave keeps the other flow");
+    check(join(s, 1, &x) == PMSG_OK && x == 1, "a left slot can be joined again");
+    send_msg(s, PMSG_LEAVE, x, PMSG_APP_LAT);
+    check(wait_for(&closes[a], 2) && exits[a] == 2, "leave of a flow without a class only closes it");
+
+    /* another connection can't talk for our flows */
+    s2 = conn();
+    send_msg(s2, PMSG_APP, b, PMSG_APP_BW);
+    check(dropped(s2), "message for a slot not joined on the connection drops it");
+    check(apps[b] == 2 && closes[b] == 0, "foreign message leaves the flow alone");
+    close(s2);
+
+    /* the process goes away: every flow left on the connection exits and closes */
+    close(s);
+    check(wait_for(&closes[b], 1) && exits[b] == 2, "closing the connection exits and closes its flows");
+    check(read_exits[b] == 2, "closing the connection exits a flow's READs");
+
+    /* a READ is not a class */
+    s = conn();
+    check(join(s, 3, &x) == PMSG_OK, "join for a READ class");
+    send_msg(s, PMSG_CLASS, x, PMSG_APP_READ);
+    check(dropped(s), "class change to READ drops the connection");
+    close(s);
+    check(wait_for(&closes[x], 1) && read_apps[x] == 0, "no READs for a class change to READ");
+
+    unlink(sock_path);
+    printf("ctl_check: ok\n");
+    return 0;
+}
@@ -0,0 +1,122 @@
+// Dispatch latency of the token thread vs. number of active slots.
+// Compares the original linear scan over shared_block.flows[] (3-byte
+// flow_info, relaxed loads of read/pending) with the ready bitmap + DRR
+// scheduler now used by pace_tokens(). Active slots are placed at random
+// and re-raise "pending" immediately after each grant, i.e. every active
+// slot is a backlogged elephant, so no ready bit is ever cleared.
+//
+// Usage: dispatch_bench [iterations]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "sched.h"
+
+struct legacy_flow_info {
+    uint8_t pending;
+    uint8_t active;
+    uint8_t read;
+};
+
+static struct legacy_flow_info flows[SCHED_MAX_SLOTS];
+static uint64_t ready[SCHED_MAP_WORDS] __attribute__((aligned(64)));
+static struct token_sched s;
+
+static double now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void place_slots(int *slots, int n)
+{
+    int perm[SCHED_MAX_SLOTS], i, j, t;
+    for (i = 0; i < SCHED_MAX_SLOTS; i++)
+        perm[i] = i;
+    for (i = SCHED_MAX_SLOTS - 1; i > 0; i--) {
+        j = rand() % (i + 1);
+        t = perm[i]; perm[i] = perm[j]; perm[j] = t;
+    }
+    memcpy(slots, perm, n * sizeof(int));
+}
+
+/* the pre-bitmap dispatch loop from generate_fetch_tokens() */
+static double run_legacy(int *slots, int n, long iters)
+{
+    int i = 0, next_idx = 0, k;
+    long it;
+    double t0;
+
+    memset(flows, 0, sizeof(flows));
+    for (k = 0; k < n; k++)
+        flows[slots[k]].pending = 1;
+
+    t0 = now_ns();
+    for (it = 0; it < iters; it++) {
+        i = next_idx;
+        while (1) {
+            if (!__atomic_load_n(&flows[i].read, __ATOMIC_RELAXED) && __atomic_load_n(&flows[i].pending, __ATOMIC_RELAXED)) {
+                __atomic_store_n(&flows[i].pending, 0, __ATOMIC_RELAXED);
+                next_idx = (i + 1) % SCHED_MAX_SLOTS;
+                break;
+            }
+            i = (i + 1) % SCHED_MAX_SLOTS;
+        }
+        __atomic_store_n(&flows[i].pending, 1, __ATOMIC_RELAXED);      // driver asks again
+    }
+    return (now_ns() - t0) / iters;
+}
+
+/* the token thread's side of pace_tokens(): ready bits are cleared lazily
+ * (pace_pending()), so a backlogged slot keeps its bit across grants. The
+ * driver's fetch_or of its bit runs on the driver's core; here it is only
+ * done when the bit is clear, which is when a real driver's fetch_or would
+ * change the map. */
+static double run_ready_map(int *slots, int n, long iters, uint32_t cost)
+{
+    int i, k;
+    long it;
+    double t0;
+
+    sched_init(&s, SCHED_DEFAULT_QUANTUM);
+    memset(ready, 0, sizeof(ready));
+    memset(flows, 0, sizeof(flows));
+    for (k = 0; k < n; k++) {
+        flows[slots[k]].pending = 1;
+        sched_map_set(ready, slots[k]);
+    }
+
+    t0 = now_ns();
+    for (it = 0; it < iters; it++) {
+        while ((i = sched_next(&s, cost, ready)) >= 0 &&
+               !__atomic_load_n(&flows[i].pending, __ATOMIC_ACQUIRE)) {
+            sched_refund(&s, i, cost);
+            sched_map_clear(ready, i);
+        }
+        __atomic_store_n(&flows[i].pending, 0, __ATOMIC_RELEASE);
+        __atomic_store_n(&flows[i].pending, 1, __ATOMIC_RELAXED);      // driver asks again
+        if (!(__atomic_load_n(&ready[i / 64], __ATOMIC_RELAXED) & (1ULL << (i % 64))))
+            sched_map_set(ready, i);
+    }
+    return (now_ns() - t0) / iters;
+}
+
+int main(int argc, char **argv)
+{
+    int actives[] = {1, 16, 128, 512};
+    int slots[SCHED_MAX_SLOTS];
+    long iters = argc > 1 ? strtol(argv[1], NULL, 10) : 2000000;
+    unsigned k;
+
+    srand(1);
+    printf("active\tlegacy_scan(ns)\tready_map_5KB(ns)\tready_map_1MB(ns)\n");
+    for (k = 0; k < sizeof(actives) / sizeof(actives[0]); k++) {
+        place_slots(slots, actives[k]);
+        printf("%d\t%.1f\t\t%.1f\t\t\t%.1f\n", actives[k],
+               run_legacy(slots, actives[k], iters),
+               run_ready_map(slots, actives[k], iters, 5000),
+               run_ready_map(slots, actives[k], iters, 1000000));
+    }
+    return 0;
+}
@@ -0,0 +1,78 @@
+#include "latq.h"
+#include <string.h>
+
+/* bucket of a value: v itself below 2^(SUB+1), then 2^SUB buckets per
+ * power of two, indexed by the top SUB+1 bits */
+static inline int latq_bucket(uint32_t v)
+{
+    int shift;
+
+    if (v < (2u << LATQ_SUB_BITS))
+        return v;
+    shift = 31 - __builtin_clz(v) - LATQ_SUB_BITS;
+    if (shift > LATQ_MAX_BITS - LATQ_SUB_BITS - 1)
+        return LATQ_BUCKETS - 1;
+    return (shift << LATQ_SUB_BITS) + (v >> shift);
+}
+
+/* middle of the range of values that fall into bucket b */
+static inline uint32_t latq_value(int b)
+{
+    int shift;
+
+    if (b < (2 << LATQ_SUB_BITS))
+        return b;
+    shift = (b >> LATQ_SUB_BITS) - 1;
+    return ((uint32_t)(b - (shift << LATQ_SUB_BITS)) << shift) + (1u << shift) / 2;
+}
+
+void latq_init(struct latq *q, uint32_t window)
+{
+    memset(q, 0, sizeof(*q));
+    q->epoch_size = window / LATQ_EPOCHS;
+    if (q->epoch_size == 0)
+        q->epoch_size = 1;
+}
+
+void latq_update(struct latq *q, uint32_t value)
+{
+    int b = latq_bucket(value), i;
+    uint32_t *old;
+
+    if (q->epoch_n[q->cur] == q->epoch_size) {
+        /* retire the oldest epoch and reuse it as the current one */
+        q->cur = (q->cur + 1) % LATQ_EPOCHS;
+        old = q->epochs[q->cur];
+        for (i = 0; i < LATQ_BUCKETS; i++) {
+            if (old[i]) {
+                __atomic_store_n(&q->total[i], q->total[i] - old[i], __ATOMIC_RELAXED);
+                old[i] = 0;
+            }
+        }
+        __atomic_store_n(&q->count, q->count - q->epoch_n[q->cur], __ATOMIC_RELAXED);
+        q->epoch_n[q->cur] = 0;
+    }
+    q->epochs[q->cur][b]++;
+    q->epoch_n[q->cur]++;
+    __atomic_store_n(&q->total[b], q->total[b] + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&q->count, q->count + 1, __ATOMIC_RELAXED);
+}
+
+/* value at quantile frac (0..1) of the window, to within half a bucket;
+ * 0 if the window is empty */
+uint32_t latq_quantile(const struct latq *q, double frac)
+{
+    uint32_t n = __atomic_load_n(&q->count, __ATOMIC_RELAXED), above, seen = 0;
+    int b;
+
+    if (n == 0)
+        return 0;
+    /* number of samples allowed above the answer; tails are short, so walk down from the top */
+    above = (uint32_t)((1 - frac) * n);
+    for (b = LATQ_BUCKETS - 1; b > 0; b--) {
+        seen += __atomic_load_n(&q->total[b], __ATOMIC_RELAXED);
+        if (seen > above)
+            break;
+    }
+    return latq_value(b);
+}
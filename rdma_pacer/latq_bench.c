@@ -0,0 +1,145 @@
+// Sliding-window tail latency: log-linear histogram (latq.c) vs. the
+// windowed hierarchical count-min sketch (countmin.c) that USE_CMH used.
+// Feeds both the same synthetic reference-flow latencies (ns; ~1.5 us body,
+// exponential tail, occasional congestion bursts), measures update and
+// quantile cost, and compares their p99/p99.9 with the exact quantiles of
+// the last `window` samples.
+//
+// Usage: latq_bench [-n samples] [-w window] [-q query_every]
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <getopt.h>
+#include <time.h>
+#include "latq.h"
+#include "countmin.h"
+
+/* same parameters as monitor.c's USE_CMH path */
+#define CMH_WIDTH 32768
+#define CMH_DEPTH 16
+#define CMH_U 24
+#define CMH_GRAN 4
+
+static double now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int cmp_int(const void *a, const void *b)
+{
+    return *(const int *)a - *(const int *)b;
+}
+
+/* counters allocated by CMH_Init(): sketches below freelim, exact arrays above */
+static double cmh_bytes(const CMH_type *cmh, int window)
+{
+    double bytes = window * sizeof(int);        // the window queue
+    int i, j = 1;
+    for (i = cmh->levels - 1; i >= 0; i--) {
+        if (i >= cmh->freelim)
+            bytes += (double)(1 << (cmh->gran * j++)) * sizeof(int);
+        else
+            bytes += (double)cmh->depth * cmh->width * sizeof(int);
+    }
+    return bytes;
+}
+
+static int exact_quantile(const int *win, int n, int *scratch, double frac)
+{
+    int k = (int)ceil(frac * n) - 1;
+    memcpy(scratch, win, n * sizeof(int));
+    qsort(scratch, n, sizeof(int), cmp_int);
+    return scratch[k < 0 ? 0 : k];
+}
+
+int main(int argc, char **argv)
+{
+    static struct latq q;
+    CMH_type *cmh;
+    int n = 200000, window = 10000, every = 1000, c, i, k, checks = 0;
+    int *samples, *scratch;
+    unsigned int seed = 1;
+    double t0, upd_latq = 0, upd_cmh = 0, qry_latq = 0, qry_cmh = 0;
+    double err_latq[2] = {0, 0}, err_cmh[2] = {0, 0};
+    double fracs[2] = {0.99, 0.999};
+
+    while ((c = getopt(argc, argv, "n:w:q:")) != -1) {
+        switch (c) {
+        case 'n': n = atoi(optarg); break;
+        case 'w': window = atoi(optarg); break;
+        case 'q': every = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-n samples] [-w window] [-q query_every]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (n < window || window < 1 || every < 1) {
+        fprintf(stderr, "need samples >= window >= 1 and query_every >= 1\n");
+        return 1;
+    }
+
+    samples = malloc(n * sizeof(int));
+    scratch = malloc(window * sizeof(int));
+    if (!samples || !scratch) {
+        perror("malloc");
+        return 1;
+    }
+    for (i = 0; i < n; i++) {
+        double u = (rand_r(&seed) + 1.0) / ((double)RAND_MAX + 2);
+        samples[i] = 1200 + (int)(-300 * log(u));               // body
+        if (rand_r(&seed) % 100 == 0)
+            samples[i] += (int)(-4000 * log(u));                // tail
+        if ((i / 5000) % 10 == 9)
+            samples[i] += 3000;                                 // congestion burst
+    }
+
+    latq_init(&q, window);
+    if (!(cmh = CMH_Init(CMH_WIDTH, CMH_DEPTH, CMH_U, CMH_GRAN, window))) {
+        fprintf(stderr, "CMH_Init failed\n");
+        return 1;
+    }
+
+    for (i = 0; i < n; i++) {
+        t0 = now_ns();
+        latq_update(&q, samples[i]);
+        upd_latq += now_ns() - t0;
+        t0 = now_ns();
+        CMH_Update(cmh, samples[i]);
+        upd_cmh += now_ns() - t0;
+
+        /* only compare once both hold a full window (latq holds 3/4 to all of it) */
+        if (i + 1 < window || (i + 1) % every)
+            continue;
+        for (k = 0; k < 2; k++) {
+            int exact = exact_quantile(samples + i + 1 - window, window, scratch, fracs[k]);
+            int a, b;
+            t0 = now_ns();
+            a = latq_quantile(&q, fracs[k]);
+            qry_latq += now_ns() - t0;
+            t0 = now_ns();
+            b = CMH_Quantile(cmh, fracs[k]);
+            qry_cmh += now_ns() - t0;
+            err_latq[k] += fabs(a - exact) / exact;
+            err_cmh[k] += fabs(b - exact) / exact;
+        }
+        checks++;
+    }
+
+    printf("%d samples, window %d, %d quantile checks\n", n, window, checks);
+    printf("estimator\tmemory(KB)\tupdate(ns)\tquantile(ns)\tp99_err%%\tp99.9_err%%\n");
+    printf("latq\t\t%.1f\t\t%.1f\t\t%.1f\t\t%.2f\t\t%.2f\n", sizeof(q) / 1024.0, upd_latq / n,
+           checks ? qry_latq / (2 * checks) : 0, checks ? 100 * err_latq[0] / checks : 0,
+           checks ? 100 * err_latq[1] / checks : 0);
+    printf("cmh\t\t%.1f\t%.1f\t\t%.1f\t\t%.2f\t\t%.2f\n",
+           cmh_bytes(cmh, window) / 1024.0,
+           upd_cmh / n, checks ? qry_cmh / (2 * checks) : 0, checks ? 100 * err_cmh[0] / checks : 0,
+           checks ? 100 * err_cmh[1] / checks : 0);
+    CMH_Destroy(cmh);
+    free(samples);
+    free(scratch);
+    return 0;
+}
@@ -0,0 +1,162 @@
+// Token hand-off throughput across processes for the two shared_block layouts.
+// v1 packs flow_info into 3 bytes (21 slots per cache line); v2 gives each
+// slot its own line. Every driver process spins on its own "pending" like
+// __mlx4_post_send does, and one pacer process grants to whichever slot is
+// pending, so in v1 each grant invalidates the line the neighbours spin on.
+// It needs at least drivers + 1 cores, otherwise the spinners just time-slice
+// and the two rates say nothing about the layouts; it refuses to run on fewer
+// unless forced.
+//
+// Usage: layout_bench [-n drivers] [-t ms] [-s slot_stride] [-f]
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "pacer.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
+
+struct v1_flow_info {
+    uint8_t pending;
+    uint8_t active;
+    uint8_t read;
+};
+
+struct bench_block {
+    volatile int go;
+    volatile int stop;
+    uint64_t grants[MAX_FLOWS];
+    union {
+        struct v1_flow_info v1[MAX_FLOWS];
+        struct flow_info v2[MAX_FLOWS];
+    } flows __attribute__((aligned(64)));
+};
+
+static double now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static uint8_t *pending_of(struct bench_block *b, int v2, int slot)
+{
+    return v2 ? &b->flows.v2[slot].pending : &b->flows.v1[slot].pending;
+}
+
+static void driver(struct bench_block *b, int v2, int slot)
+{
+    uint8_t *pending = pending_of(b, v2, slot);
+    uint64_t n = 0;
+
+    while (!b->go)
+        cpu_relax();
+    while (!b->stop) {
+        __atomic_store_n(pending, 1, __ATOMIC_RELAXED);
+        while (__atomic_load_n(pending, __ATOMIC_ACQUIRE) && !b->stop)
+            cpu_relax();
+        n++;
+    }
+    b->grants[slot] = n;
+    _exit(0);
+}
+
+static void pacer(struct bench_block *b, int v2, int *slots, int n)
+{
+    int i = 0;
+
+    while (!b->go)
+        cpu_relax();
+    while (!b->stop) {
+        uint8_t *pending = pending_of(b, v2, slots[i]);
+        if (__atomic_load_n(pending, __ATOMIC_RELAXED))
+            __atomic_store_n(pending, 0, __ATOMIC_RELEASE);
+        i = (i + 1) % n;
+    }
+    _exit(0);
+}
+
+static double run(int v2, int *slots, int n, int ms)
+{
+    struct bench_block *b;
+    uint64_t total = 0;
+    double t0, t1;
+    int i;
+
+    b = mmap(NULL, sizeof(*b), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (b == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    memset(b, 0, sizeof(*b));
+
+    for (i = 0; i < n; i++)
+        if (fork() == 0)
+            driver(b, v2, slots[i]);
+    if (fork() == 0)
+        pacer(b, v2, slots, n);
+
+    t0 = now_ns();
+    b->go = 1;
+    usleep(ms * 1000);
+    b->stop = 1;
+    while (wait(NULL) > 0)
+        ;
+    t1 = now_ns();
+
+    for (i = 0; i < n; i++)
+        total += b->grants[slots[i]];
+    munmap(b, sizeof(*b));
+    return total / ((t1 - t0) / 1e9);
+}
+
+int main(int argc, char **argv)
+{
+    int n = 8, ms = 1000, stride = 1, force = 0, c, i;
+    int slots[MAX_FLOWS];
+    double r1, r2;
+
+    while ((c = getopt(argc, argv, "n:t:s:f")) != -1) {
+        switch (c) {
+        case 'n': n = atoi(optarg); break;
+        case 't': ms = atoi(optarg); break;
+        case 's': stride = atoi(optarg); break;
+        case 'f': force = 1; break;
+        default:
+            fprintf(stderr, "usage: %s [-n drivers] [-t ms] [-s slot_stride] [-f]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (n < 1 || n > MAX_FLOWS || stride < 1) {
+        fprintf(stderr, "need 1 <= drivers <= %d and stride >= 1\n", MAX_FLOWS);
+        return 1;
+    }
+    if (sysconf(_SC_NPROCESSORS_ONLN) < n + 1 && !force) {
+        fprintf(stderr, "%d drivers need %d online cpus, have %ld; -f runs anyway\n",
+                n, n + 1, sysconf(_SC_NPROCESSORS_ONLN));
+        return 1;
+    }
+    /* slot i = i * stride; stride 1 models consecutive pids sharing lines */
+    for (i = 0; i < n; i++)
+        slots[i] = (i * stride) % MAX_FLOWS;
+
+    printf("%d drivers, %ld online cpus, %d ms per layout, slot stride %d\n",
+           n, sysconf(_SC_NPROCESSORS_ONLN), ms, stride);
+    printf("sizeof(flow_info): v1 %zu B, v2 %zu B\n", sizeof(struct v1_flow_info), sizeof(struct flow_info));
+    r1 = run(0, slots, n, ms);
+    r2 = run(1, slots, n, ms);
+    printf("layout\tgrants/s\n");
+    printf("v1\t%.0f\n", r1);
+    printf("v2\t%.0f\t(%.2fx)\n", r2, r1 ? r2 / r1 : 0);
+    return 0;
+}
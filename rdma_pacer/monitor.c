@@ -2,42 +2,69 @@
 #include "pingpong.h"
 #include "get_clock.h"
 #include "pacer.h"
-#include "countmin.h"
+#include "latq.h"
+#include "pace.h"
 #include <inttypes.h>
 #include <math.h>
 #include <assert.h>
 
-#define TAIL 2
-
 #define EVENT_POLL 0    // use event-triggered polling (or busy polling) for reference flow
 #define CS_OFFSET 4     // context switch offset
-#define EWMA 0.5
 
-#define WIDTH 32768
-#define DEPTH 16
-#define U 24
-#define GRAN 4
-#define WINDOW_SIZE 10000
-//#define USE_CMH
-#define CMH_PERCENTILE  0.99    // pencentile ask from CMH
+//#define USE_LATQ              // control on a windowed quantile of the ref flow latency instead of its EWMA
+#define LATQ_WINDOW 10000       // samples per virtual link
+#define LATQ_PERCENTILE 0.99
+
+#define INFO_WINDOW_US 200      // least time between INFO broadcasts; senders read at most one per probe round anyway
+#define INFO_SIGNAL_EVERY 8     // INFO SENDs per signaled one on each sender's QP (<= MONITOR_SQ_DEPTH)
+#define INFO_BENCH_REPORT 100   // JUSTITIA_INFO_BENCH: broadcasts per report line
 
-CMH_type *cmh = NULL;
+#ifdef USE_LATQ
+static struct latq lat_hist[MAX_SERVERS];
+#endif
 
 static inline void cpu_relax() __attribute__((always_inline));
 static inline void cpu_relax() {
     asm("nop");
 }
 
+/* tell receiver i what its READs from us may use; inline and unsignaled,
+ * the next signaled reference-flow WRITE retires it */
+static void send_read_rate(int i, uint32_t rate, uint32_t chunk_size)
+{
+    struct pingpong_context *ctx = cb.ctx_per_server[i];
+    struct read_rate_msg m;
+    struct ibv_send_wr wr, *bad_wr;
+    struct ibv_sge sge;
+
+    m.magic = READ_MAGIC;
+    m.rate = rate;
+    m.chunk_size = chunk_size;
+    m.seq = ++cb.vlinks[i].read_seq;
+    memset(&wr, 0, sizeof(wr));
+    wr.opcode = IBV_WR_SEND;
+    wr.sg_list = &sge;
+    wr.num_sge = 1;
+    wr.send_flags = IBV_SEND_INLINE;
+    sge.addr = (uintptr_t)&m;
+    sge.length = sizeof(m);
+    sge.lkey = ctx->send_mr->lkey;
+    if (ibv_post_send(ctx->qp, &wr, &bad_wr))
+        perror("ibv_post_send: read rate");
+    else
+        printf("receiver %d: READs from us at %" PRIu32 " MBps in %" PRIu32 "-byte chunks\n", i, rate, chunk_size);
+}
+
 // called by sender to monitor ref flow latency and so on
 void monitor_latency(void *arg) {
     printf(">>>starting monitor_latency...\n");
     struct monitor_param *params = (struct monitor_param *)arg;
     assert(params->is_client);
 
-    double latency_target = TAIL;
-    if (EVENT_POLL) {
-        latency_target += CS_OFFSET;
-    }
+    /* conf.h: read once per round, a set on the config socket applies from the next */
+    double latency_target = conf_dbl(&conf.tail_us) + (EVENT_POLL ? CS_OFFSET : 0);
+    double ewma;
+    uint32_t line_rate = __atomic_load_n(&cb.line_rate, __ATOMIC_RELAXED);
     double measured_tail[MAX_SERVERS];
     double prev_measured_tail[MAX_SERVERS];
     int i;
@@ -49,7 +76,6 @@ void monitor_latency(void *arg) {
     int lat; // in nanoseconds
     cycles_t start_cycle[MAX_SERVERS], end_cycle[MAX_SERVERS];
     //cycles_t prev_start_cycle = 0;
-    // cycles_t cmh_start, cmh_end;
     int no_cpu_freq_warn = 1;
     double cpu_mhz = get_cpu_mhz(no_cpu_freq_warn);
 
@@ -59,17 +85,36 @@ void monitor_latency(void *arg) {
     struct ibv_recv_wr recv_wr[MAX_SERVERS], *bad_recv_wr[MAX_SERVERS];
     struct ibv_sge sge[MAX_SERVERS], recv_sge[MAX_SERVERS];
     struct ibv_wc wc[MAX_SERVERS], recv_wc[MAX_SERVERS];
+    const struct info_msg *info;
     //struct ibv_send_wr wr, send_wr, *bad_wr = NULL;
     //struct ibv_sge sge, send_sge, recv_sge;
     int num_comp;
-    int num_remote_big_reads = 0;
-    uint32_t temp;
-    //uint32_t received_read_rate;
-    //uint32_t new_remote_read_rate;
+    char addrs[1024], *addr, *saveptr;
+    cycles_t cc_start = get_cycles();
+    FILE *lat_trace = NULL;
+
+    /* JUSTITIA_LAT_TRACE=<file> records every sample fed to the rate
+     * controllers, in the format cc_sim replays */
+    if (getenv("JUSTITIA_LAT_TRACE")) {
+        if (!(lat_trace = fopen(getenv("JUSTITIA_LAT_TRACE"), "w"))) {
+            perror("fopen: JUSTITIA_LAT_TRACE");
+            exit(1);
+        }
+        setvbuf(lat_trace, NULL, _IOLBF, 0);     // the pacer leaves through _exit()
+        fprintf(lat_trace, "# now_us\tlink\ttail_us\tmin_cap\tcap\t(%s, target %.1f us, line rate %d MBps)\n",
+                cb.vlinks[0].cc.ops->name, latency_target, line_rate);
+    }
 
     //ctx = init_monitor_chan(servername, isclient, gid_idx);
+    strncpy(addrs, params->server_addr, sizeof(addrs) - 1);
+    addrs[sizeof(addrs) - 1] = '\0';
+    addr = strtok_r(addrs, ",", &saveptr);
     for (i = 0; i < params->num_servers; i++) {
-        ctx = init_monitor_chan(params);
+        if (!addr) {
+            fprintf(stderr, "%d receivers requested but only %d addresses given. exiting monitor_latency\n", params->num_servers, i);
+            exit(1);
+        }
+        ctx = init_monitor_chan(params, addr);
         if (!ctx) {
             fprintf(stderr, "failed to allocate pingpong context. exiting monitor_latency\n");
             exit(1);
@@ -77,6 +122,10 @@ void monitor_latency(void *arg) {
 
         //cb.ctx = ctx;
         cb.ctx_per_server[i] = ctx;
+        /* lets flow_handler map an app's destination to this virtual link */
+        __atomic_store_n(&cb.app_vaddrs[i], dest_key(ctx->rem_dest->lid, &ctx->rem_dest->gid, params->gid_idx >= 0), __ATOMIC_RELEASE);
+        printf("virtual link %d: receiver %s, destination key %016" PRIx64 "\n", i, addr, cb.app_vaddrs[i]);
+        addr = strtok_r(NULL, ",", &saveptr);
         cpu_mhz = get_cpu_mhz(no_cpu_freq_warn);
 
         /* REF FLOW WRITE WR */
@@ -125,31 +174,24 @@ void monitor_latency(void *arg) {
     }
 
 
-#ifdef USE_CMH
-    cmh = CMH_Init(WIDTH, DEPTH, U, GRAN, WINDOW_SIZE);
-    if (!cmh)
-    {
-        fprintf(stderr, "CMH_Init failed\n");
-        exit(1);
-    }
+#ifdef USE_LATQ
+    for (i = 0; i < params->num_servers; i++)
+        latq_init(&lat_hist[i], LATQ_WINDOW);
 #endif
 
     /* monitor loop */
-    uint32_t min_virtual_link_cap = 0;
-    uint16_t num_local_big_flows = 0;
-    uint16_t num_local_bw_flows = 0;
-    uint16_t num_local_small_flows = 0;
     //cb.num_receiver_big_flows = 0;        // big: bw + tput; received from receiver; Note: this value also includes this sender's local big flow
     //cb.num_receiver_small_flows = 0;      // small: lat
     for (i = 0; i < params->num_servers; i++) {
         cb.num_receiver_big_flows[i] = 0;        // big: bw + tput; received from receiver; Note: this value also includes this sender's local big flow
         cb.num_receiver_small_flows[i] = 0;      // small: lat
     }
-    //TODO: consider a more general case (multi-sender + multi-receiver) when calculating local rate
-    // For now, assume 'multi-sender' or 'multi-receiver' case won't appear simultaneously
     void *ev_ctx[MAX_SERVERS];
     while (1) {
         usleep(200);
+        latency_target = conf_dbl(&conf.tail_us) + (EVENT_POLL ? CS_OFFSET : 0);
+        ewma = conf_dbl(&conf.ewma);
+        line_rate = __atomic_load_n(&cb.line_rate, __ATOMIC_RELAXED);
 
         for (i = 0; i < params->num_servers; i++) {
             //// check for receiver-side updates
@@ -161,14 +203,18 @@ void monitor_latency(void *arg) {
                     fprintf(stderr, "error bad recv_wc status: %u.%s\n", recv_wc[i].status, ibv_wc_status_str(recv_wc[i].status));
                     break;
                 }
-                if (strncmp(ctx->recv_buf, "INFO:xxxx:xxxx", 5) == 0) {
-                    sscanf(ctx->recv_buf, "INFO:%hu:%hu", &cb.num_receiver_big_flows[i], &cb.num_receiver_small_flows[i]);
+                info = (const struct info_msg *)ctx->recv_buf;
+                if (info->magic == INFO_MAGIC) {
+                    cb.num_receiver_big_flows[i] = info->num_big;
+                    cb.num_receiver_small_flows[i] = info->num_small;
+                    __atomic_store_n(&cb.vlinks[i].num_remote_reads, info->num_reads, __ATOMIC_RELAXED);
                 } else {
                     printf("Unrecognized reciever info format. Exit");
                     exit(1);
                 }
                 printf("current receiver[%d] num big apps: %" PRIu32 "\n", i, cb.num_receiver_big_flows[i]);
                 printf("current receiver[%d] num small apps: %" PRIu32 "\n", i, cb.num_receiver_small_flows[i]);
+                printf("current receiver[%d] num READ apps from us: %" PRIu16 "\n", i, info->num_reads);
 
                 if (ibv_post_recv(ctx->qp, &recv_wr[i], &bad_recv_wr[i])) {
                     perror("ibv_post_recv: recv_wr");
@@ -213,21 +259,12 @@ void monitor_latency(void *arg) {
             end_cycle[i] = get_cycles();
 
 
-#ifdef USE_CMH
-            lat = round((end_cycle - start_cycle) / cpu_mhz * 1000);
-            if (CMH_Update(cmh, lat)) {
-                fprintf(stderr, "CMH_Update failed\n");
-                break;
-            }
-
-            //cmh_start = get_cycles();
-            measured_tail[i] = round(CMH_Quantile(cmh, CMH_PERCENTILE)/100.0)/10;
-
-            ////tail_99 = (double)lat / 1000;
+#ifdef USE_LATQ
+            lat = round((end_cycle[i] - start_cycle[i]) / cpu_mhz * 1000);
+            latq_update(&lat_hist[i], lat);
+            measured_tail[i] = latq_quantile(&lat_hist[i], LATQ_PERCENTILE) / 1000.0;
 
             //printf("measured_tail = %.1f \n", measured_tail[i]);
-            //cmh_end = get_cycles();
-            //printf("CMH_Quantile 99th takes %.2f us\n", (cmh_end - cmh_start)/cpu_mhz);
             // if (prev_start_cycle)
             //     printf("time between two sends %.2f us", (start_cycle - prev_start_cycle)/cpu_mhz);
             // prev_start_cycle = start_cycle;
@@ -235,7 +272,7 @@ void monitor_latency(void *arg) {
 #else
             lat = (end_cycle[i] - start_cycle[i]) / cpu_mhz * 1000;
             measured_tail[i] = (double)lat / 1000;
-            measured_tail[i] = EWMA * measured_tail[i] + (1 - EWMA) * prev_measured_tail[i];
+            measured_tail[i] = ewma * measured_tail[i] + (1 - ewma) * prev_measured_tail[i];
             prev_measured_tail[i] = measured_tail[i];
             //printf("measured_tail[i] = %.1f \n", measured_tail[i]);
 #endif
@@ -244,248 +281,156 @@ void monitor_latency(void *arg) {
 
         }
 
-        //TODO: fix READ impl later
-        /* check if any remote read is registered or if read rate is received */
-        /*
-        num_comp = ibv_poll_cq(ctx->cq_recv, 1, &recv_wc);
-        if (num_comp == 1) {
-            if (recv_wc.status != IBV_WC_SUCCESS) {
-                fprintf(stderr, "error bad recv_wc status: %u.%s\n", recv_wc.status, ibv_wc_status_str(recv_wc.status));
-                break;
-            }
-            if (strcmp(ctx->remote_read_buf, "read") == 0) {
-                printf("receive new big read flow registration\n");
-                num_remote_big_reads++;
-            } else if (strcmp(ctx->remote_read_buf, "exit") == 0) {
-                printf("receive big read flow deregistration\n");
-                num_remote_big_reads--;
-            } else {
-                received_read_rate = (uint32_t)strtol((const char *)ctx->remote_read_buf, NULL, 10);
-                printf("receive new big read rate %" PRIu32 "\n", received_read_rate);
-                __atomic_store_n(&cb.local_read_rate, received_read_rate, __ATOMIC_RELAXED);
-            }
-            if (ibv_post_recv(ctx->qp_read, &recv_wr, &bad_recv_wr))
-                perror("ibv_post_recv: recv_wr");
-        } else if (num_comp < 0) {
-            perror("ibv_poll_cq: recv_wc");
-            break;
-        }
-        */
-
-
-
         //num_active_big_flows = __atomic_load_n(&cb.sb->num_active_big_flows, __ATOMIC_RELAXED);
         //num_active_small_flows = __atomic_load_n(&cb.sb->num_active_small_flows, __ATOMIC_RELAXED);
         //num_active_bw_flows = __atomic_load_n(&cb.sb->num_active_bw_flows, __ATOMIC_RELAXED);
 
-        num_local_big_flows = __atomic_load_n(&cb.sb->num_active_big_flows, __ATOMIC_RELAXED);
-        num_local_small_flows = __atomic_load_n(&cb.sb->num_active_small_flows, __ATOMIC_RELAXED);
-        num_local_bw_flows = __atomic_load_n(&cb.sb->num_active_bw_flows, __ATOMIC_RELAXED);
+        /* one rate controller per receiver, driven by that receiver's reference flow (pace.c) */
+        pace_round(&cb, params->num_servers, measured_tail, latency_target, line_rate,
+                   (get_cycles() - cc_start) / cpu_mhz, send_read_rate, lat_trace);
+    }
+    printf("Out of while loop. exiting...\n");
 
-#ifdef HACK_APP_NUMS
-        num_local_big_flows = HACK_NUM_BW_APP;
-        num_local_small_flows = HACK_NUM_LAT_APP;
-        num_local_bw_flows = HACK_NUM_BW_APP;
-        cb.num_receiver_big_flows[0] = HACK_NUM_BW_APP;
-        cb.num_receiver_small_flows[0] = HACK_NUM_LAT_APP;
-#endif
+    exit(1);
+}
 
-        // TODO: remove this hardcode for bw write vs lat read
-        //// READ HACK
-        /*
-        __atomic_store_n(&cb.sb->virtual_link_cap, 3000, __ATOMIC_RELAXED);
-        __atomic_store_n(&cb.sb->split_level, 2, __ATOMIC_RELAXED);
-        continue;
-        */
-        ////
-        if (num_local_big_flows + num_remote_big_reads)        // TODO: simplfiy the logic here later (can just check num_active_bw_flows + num_remote_big_reads)
-        {
-            ////if (num_active_small_flows && (num_active_bw_flows || num_remote_big_reads))    // READ HACK
-            ////if (num_active_small_flows && num_active_bw_flows) {            // before receiver-side update
-            if ((num_local_small_flows || cb.num_receiver_small_flows[0]) && num_local_bw_flows) {                // after receiver-side update
-/*
-#ifndef TREAT_L_AS_ONE
-                min_virtual_link_cap = round((double)(num_active_big_flows + num_remote_big_reads) 
-                    / (num_active_big_flows + num_active_small_flows + num_remote_big_reads) * LINE_RATE_MB);
-#else
-                min_virtual_link_cap = round((double)(num_active_big_flows + num_remote_big_reads) 
-                    / (num_active_big_flows + 1 + num_remote_big_reads) * LINE_RATE_MB);
-#endif
-*/
-#ifndef TREAT_L_AS_ONE
-                min_virtual_link_cap = round((double)(num_local_big_flows + num_remote_big_reads) 
-                    / (cb.num_receiver_big_flows[0] + cb.num_receiver_small_flows[0] + num_remote_big_reads) * LINE_RATE_MB);   // assume a single receiver
-#else
-                min_virtual_link_cap = round((double)(num_local_big_flows + num_remote_big_reads) 
-                    / (cb.num_receiver_big_flows[0] + 1 + num_remote_big_reads) * LINE_RATE_MB);      // assume a single receiver
-#endif
-                if (min_virtual_link_cap > LINE_RATE_MB) {      // could happen if haven't received info from the receiver
-                    min_virtual_link_cap = LINE_RATE_MB;
-                }
-                temp = __atomic_load_n(&cb.sb->virtual_link_cap, __ATOMIC_RELAXED);
-
-                if (measured_tail[0] > latency_target)      //HACK
-                {
-                    /* Multiplicative Decrease */
-                    temp >>= 1;
-                    if (ELEPHANT_HAS_LOWER_BOUND && temp < min_virtual_link_cap) {
-                        temp = min_virtual_link_cap;
-                    }
-                }
-                else    // target met
-                {
-                    /* Additive Increase */
-                    if (__atomic_load_n(&cb.sb->virtual_link_cap, __ATOMIC_RELAXED) < LINE_RATE_MB) {
-                        temp++;
-                    }
-                }
-                if (num_remote_big_reads) {
-                    //TODO: fix READ impl later
-                    /*
-                    new_remote_read_rate = round((double)num_remote_big_reads
-                        / (num_remote_big_reads + num_active_big_flows) * temp);
-                    //// READ HACK
-                    //new_remote_read_rate = 3000;    // TODO: fix HARDCODE later
-                    ////
-                    if (new_remote_read_rate != cb.remote_read_rate) {
-                        cb.remote_read_rate = new_remote_read_rate;
-                        memset((char *)ctx->local_read_buf + BUF_READ_SIZE, 0, BUF_READ_SIZE);
-                        sprintf((char*)ctx->local_read_buf + BUF_READ_SIZE, "%" PRIu32, cb.remote_read_rate);
-                        printf("new remote read rate %s\n", (char*)ctx->local_read_buf + BUF_READ_SIZE);
-                        if (ibv_post_send(ctx->qp_read, &send_wr, &bad_wr))
-                        {
-                            perror("ibv_post_send: remote read rate");
-                        }
-                        do {
-                            num_comp = ibv_poll_cq(ctx->cq_send, 1, &send_wc);      //TODO: event-triggered polling
-                        } while(num_comp == 0);
-                        if (num_comp < 0) {
-                            perror("ibv_poll_cq: send_wr");
-                            break;
-                        }
-                        if (wc.status != IBV_WC_SUCCESS) {
-                            fprintf(stderr, "bad wc status: %s\n", ibv_wc_status_str(wc.status));
-                        }
-                    }
-                    temp -= new_remote_read_rate;
-                    */
-                }
-                __atomic_store_n(&cb.sb->virtual_link_cap, temp, __ATOMIC_RELAXED);
-            }
-            else {  // if no small flows
-                if (__atomic_load_n(&cb.sb->virtual_link_cap, __ATOMIC_RELAXED) != LINE_RATE_MB) {   
-                    temp = LINE_RATE_MB;
-                }
 
-                //TODO: figure out what's going on with the big read logic here. Why handle big reads only if there is no small flows?
-                if (num_remote_big_reads) {
-                    //TODO: fix READ impl later
-                    /*
-                    new_remote_read_rate = round((double)num_remote_big_reads
-                        / (num_remote_big_reads + num_active_big_flows) * temp);
-                    if (new_remote_read_rate != cb.remote_read_rate) {
-                        cb.remote_read_rate = new_remote_read_rate;
-                        memset((char *)ctx->local_read_buf + BUF_READ_SIZE, 0, BUF_READ_SIZE);
-                        sprintf((char*)ctx->local_read_buf + BUF_READ_SIZE, "%" PRIu32, cb.remote_read_rate);
-                        printf("new remote read rate %s\n", (char*)ctx->local_read_buf + BUF_READ_SIZE);
-                        if (ibv_post_send(ctx->qp_read, &send_wr, &bad_wr))
-                        {
-                            perror("ibv_post_send: remote read rate");
-                        }
-                        do {
-                            num_comp = ibv_poll_cq(ctx->cq_send, 1, &send_wc);      //TODO: event-triggered polling
-                        } while(num_comp == 0);
-                        if (num_comp < 0) {
-                            perror("ibv_poll_cq: send_wr");
-                            break;
-                        }
-                        if (wc.status != IBV_WC_SUCCESS) {
-                            fprintf(stderr, "bad wc status: %s\n", ibv_wc_status_str(wc.status));
-                        }
-                    }
-                    temp -= new_remote_read_rate;
-                    */
-                }
-                __atomic_store_n(&cb.sb->virtual_link_cap, temp, __ATOMIC_RELAXED);
-
-            }
-            //printf(">>>> virtual link cap: %" PRIu32 "\n", __atomic_load_n(&cb.sb->virtual_link_cap, __ATOMIC_RELAXED));
+/* receiver side: per-sender channel state for the INFO broadcast */
+struct info_chan {
+    struct ibv_send_wr send_wr;
+    struct ibv_sge send_sge;
+    struct ibv_recv_wr recv_wr;
+    struct ibv_sge recv_sge;
+    uint32_t outstanding;       /* SENDs posted and not known to be complete */
+    uint32_t unsignaled;        /* SENDs posted since the last signaled one */
+};
+
+/* reap signaled INFO completions; each retires INFO_SIGNAL_EVERY sends.
+ * With wait set, spin until at least one is there. */
+static void info_reap(struct pingpong_context *ctx, struct info_chan *ch, int wait)
+{
+    struct ibv_wc wc[MONITOR_SQ_DEPTH];
+    int n, i;
+
+    do {
+        n = ibv_poll_cq(ctx->send_cq, MONITOR_SQ_DEPTH, wc);
+        if (n < 0) {
+            perror("ibv_poll_cq: info send");
+            exit(1);
+        }
+        for (i = 0; i < n; i++) {
+            if (wc[i].status != IBV_WC_SUCCESS)
+                fprintf(stderr, "error bad info send_wc status: %u.%s\n", wc[i].status, ibv_wc_status_str(wc[i].status));
+            ch->outstanding -= wc[i].wr_id;
         }
+    } while (wait && n == 0);
+}
 
+/* post one INFO to a sender without waiting for it; only every
+ * INFO_SIGNAL_EVERY-th send (or every one, if `signal`) asks for a completion */
+static void info_post(struct pingpong_context *ctx, struct info_chan *ch, const struct info_msg *m, int signal)
+{
+    struct ibv_send_wr *bad_wr;
+
+    info_reap(ctx, ch, 0);
+    while (ch->outstanding >= MONITOR_SQ_DEPTH)
+        info_reap(ctx, ch, 1);
+
+    memcpy(ctx->send_buf, m, sizeof(*m));       // inline: the HCA copies it at post time
+    ch->unsignaled++;
+    if (signal || ch->unsignaled == INFO_SIGNAL_EVERY) {
+        ch->send_wr.send_flags = IBV_SEND_SIGNALED | IBV_SEND_INLINE;
+        ch->send_wr.wr_id = ch->unsignaled;     // sends this completion retires
+        ch->unsignaled = 0;
+    } else {
+        ch->send_wr.send_flags = IBV_SEND_INLINE;
     }
-    printf("Out of while loop. exiting...\n");
-
-#ifdef USE_CMH
-    CMH_Destroy(cmh);
-#endif
-
-    exit(1);
+    if (ibv_post_send(ctx->qp, &ch->send_wr, &bad_wr)) {
+        perror("ibv_post_send: broadcast info to all senders");
+        return;
+    }
+    ch->outstanding++;
 }
 
-
 // handle receiver-side updates and coordinate with all senders
+//
+// Updates from senders are folded into one INFO broadcast per window
+// (JUSTITIA_INFO_WINDOW_US, default INFO_WINDOW_US): the first update after a
+// quiet window goes out at once, the rest of a storm waits for the window to
+// end. A broadcast posts one SEND to each sender back to back and does not
+// wait for any of them.
+//
+// JUSTITIA_INFO_BENCH=batched|serial also waits for every SEND of a broadcast
+// to complete (serial: one sender at a time, as before) and reports how long
+// updates take to reach all senders.
 void server_loop(void *arg) {
     printf(">>>starting server loop...\n");
     struct monitor_param *params = (struct monitor_param *)arg;
     assert(!params->is_client);
 
     struct pingpong_context *ctx = NULL;
-    struct ibv_send_wr send_wr[MAX_CLIENTS], *bad_send_wr[MAX_CLIENTS];
-    struct ibv_recv_wr recv_wr[MAX_CLIENTS], *bad_recv_wr[MAX_CLIENTS];
-    struct ibv_sge send_sge[MAX_CLIENTS], recv_sge[MAX_CLIENTS];
-    struct ibv_wc send_wc[MAX_CLIENTS], recv_wc[MAX_CLIENTS];
+    static struct info_chan chans[MAX_CLIENTS];
+    struct ibv_recv_wr *bad_recv_wr;
+    struct ibv_wc recv_wc;
+    struct info_msg msg;
     int num_comp;
     //uint32_t current_receiver_fan_in = 0;
     uint16_t current_num_big_apps = 0;       // bw or tput
     uint16_t current_num_small_apps = 0;     // lat
+    uint32_t pending_updates = 0, seq = 0;
+    uint16_t reads_sent[MAX_CLIENTS] = { 0 }, reads;
+    const struct read_rate_msg *rm;
+    struct read_link *r;
+    double cpu_mhz = get_cpu_mhz(1);
+    cycles_t now, first_update = 0, last_bcast = 0, window;
+    const char *bench = getenv("JUSTITIA_INFO_BENCH");
+    int serial = bench && strcmp(bench, "serial") == 0;
+    static struct latq bench_lat;
+    uint64_t bench_updates = 0;
+
+    window = (getenv("JUSTITIA_INFO_WINDOW_US") ? atoi(getenv("JUSTITIA_INFO_WINDOW_US")) : INFO_WINDOW_US) * cpu_mhz;
+    if (bench) {
+        printf("INFO broadcast benchmark (%s), fan-in %d\n", serial ? "serial" : "batched", params->num_clients);
+        latq_init(&bench_lat, INFO_BENCH_REPORT);
+    }
 
     int i = 0;
     for (i = 0; i < params->num_clients; i++) {
-        ctx = init_monitor_chan(params);        // server will get stuck in socket listen()
+        struct info_chan *ch = &chans[i];
+
+        ctx = init_monitor_chan(params, NULL);        // server will get stuck in socket listen()
         if (!ctx) {
             fprintf(stderr, "failed to allocate pingpong context. exiting monitor_latency\n");
             exit(1);
         }
         cb.ctx_per_client[i] = ctx;
+        /* this sender is the responder of our READs from it: lets flow_handler find it */
+        __atomic_store_n(&cb.read_links[i].key, dest_key(ctx->rem_dest->lid, &ctx->rem_dest->gid, params->gid_idx >= 0), __ATOMIC_RELEASE);
+        __atomic_store_n(&cb.num_read_links, i + 1, __ATOMIC_RELEASE);
+        printf("sender %d: destination key %016" PRIx64 "\n", i, cb.read_links[i].key);
 
         /* UPDATE SEND WR */
-        memset(&send_wr[i], 0, sizeof send_wr[i]);
-        send_wr[i].opcode = IBV_WR_SEND;
-        send_wr[i].sg_list = &send_sge[i];
-        send_wr[i].num_sge = 1;
-        send_wr[i].send_flags = (IBV_SEND_SIGNALED | IBV_SEND_INLINE);
+        memset(ch, 0, sizeof(*ch));
+        ch->send_wr.opcode = IBV_WR_SEND;
+        ch->send_wr.sg_list = &ch->send_sge;
+        ch->send_wr.num_sge = 1;
 
-        memset(&send_sge[i], 0, sizeof send_sge[i]);
         memset((char *)ctx->send_buf, 0, BUF_SIZE);
-        send_sge[i].addr = (uintptr_t)ctx->send_buf;
-        ////send_sge.addr = (uintptr_t)((char *)ctx->send_buf + BUF_SIZE);
-        send_sge[i].length = BUF_SIZE;
-        send_sge[i].lkey = ctx->send_mr->lkey;
+        ch->send_sge.addr = (uintptr_t)ctx->send_buf;
+        ch->send_sge.length = sizeof(struct info_msg);
+        ch->send_sge.lkey = ctx->send_mr->lkey;
 
         /* UPDATE RECV WR */
-        memset(&recv_wr[i], 0, sizeof recv_wr[i]);
-        recv_wr[i].num_sge = 1;
-        recv_wr[i].sg_list = &recv_sge[i];
+        ch->recv_wr.num_sge = 1;
+        ch->recv_wr.sg_list = &ch->recv_sge;
 
-        memset(&recv_sge[i], 0, sizeof recv_sge[i]);
         memset(ctx->recv_buf, 0, BUF_SIZE);
-        recv_sge[i].addr = (uintptr_t)ctx->recv_buf;
-        recv_sge[i].length = BUF_SIZE;
-        recv_sge[i].lkey = ctx->recv_mr->lkey;
-        ibv_post_recv(ctx->qp, &recv_wr[i], &bad_recv_wr[i]);
+        ch->recv_sge.addr = (uintptr_t)ctx->recv_buf;
+        ch->recv_sge.length = BUF_SIZE;
+        ch->recv_sge.lkey = ctx->recv_mr->lkey;
+        ibv_post_recv(ctx->qp, &ch->recv_wr, &bad_recv_wr);
     }
 
-
-
-#ifdef USE_CMH
-    cmh = CMH_Init(WIDTH, DEPTH, U, GRAN, WINDOW_SIZE);
-    if (!cmh)
-    {
-        fprintf(stderr, "CMH_Init failed\n");
-        exit(1);
-    }
-#endif
-
     while (1) {
         //TODO: poll via channel
         /* check for receiver-side updates */
@@ -493,15 +438,29 @@ void server_loop(void *arg) {
         for (i = 0; i < params->num_clients; i++) {
             ctx = cb.ctx_per_client[i];
 
-            num_comp = ibv_poll_cq(ctx->recv_cq, 1, &recv_wc[i]);
+            num_comp = ibv_poll_cq(ctx->recv_cq, 1, &recv_wc);
             if (num_comp > 0) {     // found an update; actually num_comp should be either 0 or 1 given we set 'num_entires'=1 in ibv_poll_cq
-                if (recv_wc[i].status != IBV_WC_SUCCESS) {
-                    fprintf(stderr, "error bad recv_wc status: %u.%s\n", recv_wc[i].status, ibv_wc_status_str(recv_wc[i].status));
+                if (recv_wc.status != IBV_WC_SUCCESS) {
+                    fprintf(stderr, "error bad recv_wc status: %u.%s\n", recv_wc.status, ibv_wc_status_str(recv_wc.status));
                     break;
                 }
 
                 //remote_receiver_fan_in = (uint32_t)strtol((const char *)ctx->update_recv_buf, NULL, 10);
-                if (strcmp(ctx->recv_buf, "big_inc") == 0) {
+                rm = (const struct read_rate_msg *)ctx->recv_buf;
+                if (rm->magic == READ_MAGIC) {
+                    /* what our READs from this sender may use; not an update to broadcast */
+                    r = &cb.read_links[i];
+                    if (rm->rate)
+                        __atomic_store_n(&r->rate, rm->rate, __ATOMIC_RELAXED);
+                    if (rm->chunk_size)
+                        __atomic_store_n(&r->chunk_size, rm->chunk_size, __ATOMIC_RELAXED);
+                    printf("sender %d: our READs at %" PRIu32 " MBps in %" PRIu32 "-byte chunks (#%u)\n",
+                           i, r->rate, r->chunk_size, rm->seq);
+                    if (ibv_post_recv(ctx->qp, &chans[i].recv_wr, &bad_recv_wr)) {
+                        perror("ibv_post_recv: recv_wr");
+                    }
+                    continue;
+                } else if (strcmp(ctx->recv_buf, "big_inc") == 0) {
                     current_num_big_apps++;
                 } else if (strcmp(ctx->recv_buf, "small_inc") == 0) {
                     current_num_small_apps++;
@@ -514,36 +473,53 @@ void server_loop(void *arg) {
                     exit(1);
                 }
 
-                printf("current receiver num big apps: %" PRIu32 "\n", current_num_big_apps);
-                printf("current receiver num small apps: %" PRIu32 "\n", current_num_small_apps);
-
-                if (ibv_post_recv(ctx->qp, &recv_wr[i], &bad_recv_wr[i])) {
+                if (ibv_post_recv(ctx->qp, &chans[i].recv_wr, &bad_recv_wr)) {
                     perror("ibv_post_recv: recv_wr");
                 }
-
-                /* broadcast to all clients when there is an update from a client */
-
-                printf("Broadcasting receiver-side info...\n");
-                for (j = 0; j < params->num_clients; j++) {
-                    ctx = cb.ctx_per_client[j];
-
-                    sprintf(ctx->send_buf, "INFO:%04hu:%04hu", current_num_big_apps, current_num_small_apps);
-                    if (ibv_post_send(ctx->qp, &send_wr[j], &bad_send_wr[j])) {
-                        perror("ibv_post_send: broadcast info to all senders");
-                    }
-                    do {    // clean up the cq for SEND message
-                        num_comp = ibv_poll_cq(ctx->send_cq, 1, &send_wc[j]);
-                    } while (num_comp == 0);
-                }
-
+                if (pending_updates++ == 0)
+                    first_update = get_cycles();
             } else if (num_comp < 0) {
                 perror("ibv_poll_cq: update_recv_wc");
                 exit(1);
             }
 
+            /* our READ apps from this sender came or went: it has to know,
+             * the responses to them leave through its link */
+            if ((reads = __atomic_load_n(&cb.read_links[i].num_reads, __ATOMIC_ACQUIRE)) != reads_sent[i]) {
+                reads_sent[i] = reads;
+                if (pending_updates++ == 0)
+                    first_update = get_cycles();
+            }
         }
 
-
-
+        /* broadcast to all clients once per window when there were updates */
+        if (!pending_updates || (now = get_cycles()) - last_bcast < window)
+            continue;
+        last_bcast = now;
+        msg.magic = INFO_MAGIC;
+        msg.num_big = current_num_big_apps;
+        msg.num_small = current_num_small_apps;
+        msg.seq = ++seq;
+        msg.updates = pending_updates > UINT16_MAX ? UINT16_MAX : pending_updates;
+        printf("Broadcasting receiver-side info #%u (%u updates): %hu big, %hu small apps\n",
+               seq, pending_updates, current_num_big_apps, current_num_small_apps);
+        for (j = 0; j < params->num_clients; j++) {
+            msg.num_reads = reads_sent[j];
+            info_post(cb.ctx_per_client[j], &chans[j], &msg, bench != NULL);
+            if (serial)
+                info_reap(cb.ctx_per_client[j], &chans[j], 1);
+        }
+        if (bench) {
+            for (j = 0; j < params->num_clients; j++)
+                while (chans[j].outstanding)
+                    info_reap(cb.ctx_per_client[j], &chans[j], 1);
+            latq_update(&bench_lat, (get_cycles() - first_update) / cpu_mhz * 1000);
+            bench_updates += pending_updates;
+            if (seq % INFO_BENCH_REPORT == 0)
+                printf("info bench %s fan-in %d: %u broadcasts, %" PRIu64 " updates, propagation p50 %.1f us, p99 %.1f us\n",
+                       serial ? "serial" : "batched", params->num_clients, seq, bench_updates,
+                       latq_quantile(&bench_lat, 0.5) / 1000.0, latq_quantile(&bench_lat, 0.99) / 1000.0);
+        }
+        pending_updates = 0;
     }
 }
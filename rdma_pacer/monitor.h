@@ -1,9 +1,46 @@
 #ifndef MONITOR_H
 #define MONITOR_H
 
+#include <stdint.h>
+
+#define INFO_MAGIC 0x4f464e49       /* "INFO" */
+#define READ_MAGIC 0x44414552       /* "READ" */
+
+/* receiver -> sender flow counts, broadcast by server_loop; BUF_SIZE bytes */
+struct info_msg {
+    uint32_t magic;
+    uint16_t num_big;               /* bw + tput apps sending to the receiver */
+    uint16_t num_small;             /* lat apps */
+    uint32_t seq;                   /* broadcasts so far */
+    uint16_t updates;               /* big/small inc/dec messages folded into this one; saturates */
+    uint16_t num_reads;             /* READ apps of the receiver with this sender as responder */
+};
+
+/* sender -> receiver, when it changes: what the receiver's READs from this
+ * sender may use of the sender's link to it; BUF_SIZE bytes */
+struct read_rate_msg {
+    uint32_t magic;                 /* READ_MAGIC */
+    uint32_t rate;                  /* MBps, for all of those READs together */
+    uint32_t chunk_size;            /* bytes per READ; what the sender's own WRITEs to the receiver use */
+    uint32_t seq;
+};
+
+/* responder side: the part of a virtual link's cap that goes to the remote
+ * READs of its receiver, when num_big local flows send to it as well; every
+ * READ counts as one more big flow */
+static inline uint32_t read_share(uint32_t cap, uint16_t num_reads, uint16_t num_big)
+{
+    uint32_t share;
+
+    if (!num_reads)
+        return 0;
+    share = (uint64_t)cap * num_reads / (num_reads + num_big);
+    return share ? share : 1;
+}
+
 struct monitor_param {
     int is_client;
-    const char *server_addr;
+    const char *server_addr;    /* client: comma-separated receivers, one virtual link each */
     int num_clients;
     int num_servers;
     int gid_idx;
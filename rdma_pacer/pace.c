@@ -0,0 +1,357 @@
+#include "pacer.h"
+#include "monitor.h"
+#include "pace.h"
+#include <math.h>
+
+#define BIG_CHUNK_SIZE 1000000
+//#define BIG_CHUNK_SIZE 1048576
+//#define TIMEFRAME 2         // In microseconds
+
+/* whether a virtual link carries elephants: local ones, or the responses to
+ * its receiver's READs from us */
+static inline int link_busy(struct vlink *v)
+{
+    return __atomic_load_n(&v->num_big_flows, __ATOMIC_RELAXED) ||
+           __atomic_load_n(&v->num_remote_reads, __ATOMIC_RELAXED);
+}
+
+/* hierarchical sharing of the host link: every virtual link (receiver) runs
+ * its own rate controller, then the links that carry elephants split the
+ * line rate in proportion to their caps whenever those add up to more than it */
+static void share_line_rate(struct control_block *cb, int num_links, uint32_t line_rate)
+{
+    uint64_t sum = 0;
+    uint32_t cap;
+    int i;
+
+    for (i = 0; i < num_links; i++)
+        if (link_busy(&cb->vlinks[i]))
+            sum += cb->vlinks[i].cc.cap;
+    for (i = 0; i < num_links; i++) {
+        cap = cb->vlinks[i].cc.cap;
+        if (sum > line_rate && link_busy(&cb->vlinks[i]))
+            cap = (uint64_t)cap * line_rate / sum;
+        if (cap == 0)
+            cap = 1;        // 0 stops the token generator altogether
+        __atomic_store_n(&cb->sb->vlinks[i].virtual_link_cap, cap, __ATOMIC_RELAXED);
+    }
+}
+
+/* one round of every link's chunk size controller (chunk.c): the chunks
+ * our bw flows and the receiver's READs from us are cut into. The token
+ * thread publishes the result to drivers. */
+static void size_chunks(struct control_block *cb, int num_links, const double *tail_us, double target_us,
+                        uint32_t line_rate)
+{
+    struct chunk_params params;
+    struct chunk_sample sample;
+    struct vlink *v;
+    int i;
+
+    conf_chunk_params(&params);
+    for (i = 0; i < num_links; i++) {
+        v = &cb->vlinks[i];
+        sample.tail_us = tail_us[i];
+        sample.target_us = target_us;
+        sample.cap = __atomic_load_n(&cb->sb->vlinks[i].virtual_link_cap, __ATOMIC_RELAXED);
+        sample.line_rate = line_rate;
+        sample.num_big = __atomic_load_n(&v->num_bw_flows, __ATOMIC_RELAXED) +
+                         __atomic_load_n(&v->num_remote_reads, __ATOMIC_RELAXED);
+        sample.num_small = __atomic_load_n(&v->num_small_flows, __ATOMIC_RELAXED) + cb->num_receiver_small_flows[i];
+        __atomic_store_n(&v->chunk_size, chunk_update(&v->chunk, &params, &sample), __ATOMIC_RELAXED);
+    }
+}
+
+/* responder side: the READs of each receiver get their share of what the
+ * link was given (read_share()), our own flows to it the rest. The receiver
+ * paces its READs to that rate, so the responses leave us at it. */
+static void share_reads(struct control_block *cb, int num_links, pace_read_rate_fn read_rate)
+{
+    struct vlink *v;
+    uint32_t cap, rate, chunk_size;
+    uint16_t reads;
+    int i;
+
+    for (i = 0; i < num_links; i++) {
+        v = &cb->vlinks[i];
+        reads = __atomic_load_n(&v->num_remote_reads, __ATOMIC_RELAXED);
+        cap = __atomic_load_n(&cb->sb->vlinks[i].virtual_link_cap, __ATOMIC_RELAXED);
+        rate = read_share(cap, reads, __atomic_load_n(&v->num_big_flows, __ATOMIC_RELAXED));
+        if (reads) {
+            cap = cap > rate ? cap - rate : 1;
+            __atomic_store_n(&cb->sb->vlinks[i].virtual_link_cap, cap, __ATOMIC_RELAXED);
+        }
+        chunk_size = __atomic_load_n(&v->chunk_size, __ATOMIC_RELAXED);
+        if (rate && (rate != v->read_rate || chunk_size != v->read_chunk) && read_rate)
+            read_rate(i, rate, chunk_size);
+        v->read_rate = rate;
+        v->read_chunk = chunk_size;
+    }
+}
+
+/* one controller round into the telemetry segment: the per-link record,
+ * and a history entry whenever the link's share of the line rate moved */
+static void publish_stats(struct control_block *cb, int num_links, const double *tail_us, uint64_t now_us)
+{
+    struct stats_cc *c;
+    struct stats_hist_entry *e;
+    uint32_t cap;
+    int i;
+
+    for (i = 0; i < num_links; i++) {
+        c = &cb->stats->cc[i];
+        cap = __atomic_load_n(&cb->sb->vlinks[i].virtual_link_cap, __ATOMIC_RELAXED);
+        stats_write_begin(&c->seq);
+        if (cap > c->shared_cap)
+            __atomic_store_n(&c->increases, c->increases + 1, __ATOMIC_RELAXED);
+        else if (cap < c->shared_cap)
+            __atomic_store_n(&c->decreases, c->decreases + 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&c->cap, cb->vlinks[i].cc.cap, __ATOMIC_RELAXED);
+        __atomic_store_n(&c->tail_ns, (uint32_t)(tail_us[i] * 1000), __ATOMIC_RELAXED);
+        __atomic_store_n(&c->rounds, c->rounds + 1, __ATOMIC_RELAXED);
+        if (cap == c->shared_cap) {
+            stats_write_end(&c->seq);
+            continue;
+        }
+        __atomic_store_n(&c->shared_cap, cap, __ATOMIC_RELAXED);
+        stats_write_end(&c->seq);
+
+        e = &cb->stats->hist[cb->stats->hist_head % STATS_HIST_LEN];
+        stats_write_begin(&e->seq);
+        __atomic_store_n(&e->link, i, __ATOMIC_RELAXED);
+        __atomic_store_n(&e->shared_cap, cap, __ATOMIC_RELAXED);
+        __atomic_store_n(&e->tail_ns, (uint32_t)(tail_us[i] * 1000), __ATOMIC_RELAXED);
+        __atomic_store_n(&e->now_us, now_us, __ATOMIC_RELAXED);
+        stats_write_end(&e->seq);
+        __atomic_store_n(&cb->stats->hist_head, cb->stats->hist_head + 1, __ATOMIC_RELEASE);
+    }
+}
+
+void pace_round(struct control_block *cb, int num_links, const double *tail_us, double target_us,
+                uint32_t line_rate, uint64_t now_us, pace_read_rate_fn read_rate, FILE *lat_trace)
+{
+    uint32_t min_virtual_link_cap = 0;
+    uint16_t num_local_big_flows = 0;
+    uint16_t num_local_bw_flows = 0;
+    uint16_t num_local_small_flows = 0;
+    uint16_t num_remote_big_reads = 0;
+    uint32_t temp;
+    int l_as_one = CONF_U32(treat_l_as_one);
+    struct cc_sample sample;
+    struct vlink *v;
+    int i;
+
+    //TODO: consider a more general case (multi-sender + multi-receiver) when calculating local rate
+    // For now, assume 'multi-sender' or 'multi-receiver' case won't appear simultaneously
+    /* one rate controller per receiver, driven by that receiver's reference flow */
+    for (i = 0; i < num_links; i++) {
+        v = &cb->vlinks[i];
+        num_local_big_flows = __atomic_load_n(&v->num_big_flows, __ATOMIC_RELAXED);
+        num_local_small_flows = __atomic_load_n(&v->num_small_flows, __ATOMIC_RELAXED);
+        num_local_bw_flows = __atomic_load_n(&v->num_bw_flows, __ATOMIC_RELAXED);
+        num_remote_big_reads = __atomic_load_n(&v->num_remote_reads, __ATOMIC_RELAXED);
+        temp = v->cc.cap;
+
+#ifdef HACK_APP_NUMS
+        num_local_big_flows = HACK_NUM_BW_APP;
+        num_local_small_flows = HACK_NUM_LAT_APP;
+        num_local_bw_flows = HACK_NUM_BW_APP;
+        cb->num_receiver_big_flows[i] = HACK_NUM_BW_APP;
+        cb->num_receiver_small_flows[i] = HACK_NUM_LAT_APP;
+#endif
+
+        if (num_local_big_flows + num_remote_big_reads)        // TODO: simplfiy the logic here later (can just check num_active_bw_flows + num_remote_big_reads)
+        {
+            if ((num_local_small_flows || cb->num_receiver_small_flows[i]) && (num_local_bw_flows || num_remote_big_reads)) {                // after receiver-side update
+                min_virtual_link_cap = round((double)(num_local_big_flows + num_remote_big_reads)
+                    / (cb->num_receiver_big_flows[i] + (l_as_one ? 1 : cb->num_receiver_small_flows[i]) + num_remote_big_reads) * line_rate);
+                if (min_virtual_link_cap > line_rate) {      // could happen if haven't received info from the receiver
+                    min_virtual_link_cap = line_rate;
+                }
+                sample.now_us = now_us;
+                sample.tail_us = tail_us[i];
+                sample.target_us = target_us;
+                sample.min_cap = ELEPHANT_HAS_LOWER_BOUND ? min_virtual_link_cap : 1;
+                sample.line_rate = line_rate;
+                temp = cc_update(&v->cc, &sample);
+                if (lat_trace) {
+                    fprintf(lat_trace, "%" PRIu64 "\t%d\t%.3f\t%" PRIu32 "\t%" PRIu32 "\n",
+                            sample.now_us, i, sample.tail_us, sample.min_cap, temp);
+                }
+                v->cc.cap = temp;
+            }
+            else {  // if no small flows
+                temp = line_rate;
+
+                /* contention is over; restart the controller from here */
+                if (v->cc.cap != temp)
+                    cc_init(&v->cc, v->cc.ops, temp);
+
+            }
+            //printf(">>>> virtual link %d cap: %" PRIu32 "\n", i, v->cc.cap);
+        }
+    }
+    share_line_rate(cb, num_links, line_rate);
+    size_chunks(cb, num_links, tail_us, target_us, line_rate);
+    share_reads(cb, num_links, read_rate);
+    publish_stats(cb, num_links, tail_us, now_us);
+}
+
+/* try fetch one token of a virtual link; return 1 on success and 0 on failure
+ */
+static inline int try_fetch_a_token(struct vlink *v) __attribute__((always_inline));
+static inline int try_fetch_a_token(struct vlink *v)
+{
+    int got_token = 0;
+    if (__atomic_load_n(&v->tokens, __ATOMIC_RELAXED)) {
+        __atomic_fetch_sub(&v->tokens, 1, __ATOMIC_RELAXED);
+        got_token = 1;
+    }
+    return got_token;
+}
+
+/* Ready bits are cleared lazily: a grant only lowers "pending", and a
+ * backlogged driver raises it again under a bit that is still set, so at
+ * full occupancy the token thread makes no atomic read-modify-write on the
+ * maps. A bit is dropped when its slot is picked and found not pending (or
+ * pending on the other map, after a class change). The driver raises
+ * "pending" before its fetch_or of the bit, so re-reading "pending" after
+ * the clear catches a driver that asked in between. */
+int pace_pending(struct control_block *cb, uint64_t *ready_map, int slot, int read)
+{
+    struct flow_info *f = &cb->sb->flows[slot];
+
+    if (__atomic_load_n(&f->pending, __ATOMIC_ACQUIRE) && __atomic_load_n(&f->read, __ATOMIC_RELAXED) == read)
+        return 1;
+    sched_map_clear(ready_map, slot);
+    if (!__atomic_load_n(&f->pending, __ATOMIC_SEQ_CST) || __atomic_load_n(&f->read, __ATOMIC_RELAXED) != read)
+        return 0;
+    sched_map_set(ready_map, slot);
+    return 1;
+}
+
+void pace_grant(struct control_block *cb, int slot)
+{
+    __atomic_fetch_add(&cb->sb->flows[slot].tokens_granted, 1, __ATOMIC_RELAXED);
+    STATS_INC(cb->stats->token[cb->sb->flows[slot].vlink].tokens_granted);
+    __atomic_store_n(&cb->sb->flows[slot].pending, 0, __ATOMIC_RELEASE);
+    flow_wake(&cb->sb->flows[slot]);
+}
+
+/* split chunks one token covers: as many as fit in split_batch_kb (conf.h),
+ * so the driver posts them with one token wait and one doorbell */
+static uint32_t split_batch_of(uint32_t chunk_size)
+{
+#ifdef CPU_FRIENDLY
+    return 1;       // the socket token path splits one chunk per token
+#else
+    uint32_t n = CONF_U32(split_batch_kb) * 1024 / chunk_size;
+
+    return n < 1 ? 1 : n > SPLIT_MAX_BATCH ? SPLIT_MAX_BATCH : n;
+#endif
+}
+
+/* hand link d's drivers a new chunk size, with the split batch and token
+ * bytes that go with it, under cut_seq: a driver cutting a message in the
+ * middle of the update retries and gets either the old triple or the new
+ * one. Returns the token bytes. */
+static uint32_t publish_cut(struct control_block *cb, int d, uint32_t chunk_size)
+{
+    struct vlink_info *vi = &cb->sb->vlinks[d];
+    uint32_t batch = split_batch_of(chunk_size), token_bytes;
+
+    /* the link time of a token, in bytes: tput flows spend it byte by byte */
+#ifdef CPU_FRIENDLY
+    token_bytes = BIG_CHUNK_SIZE;
+#else
+    token_bytes = chunk_size * batch;
+#endif
+    stats_write_begin(&vi->cut_seq);
+    __atomic_store_n(&vi->active_chunk_size, chunk_size, __ATOMIC_RELAXED);
+    __atomic_store_n(&vi->split_batch, batch, __ATOMIC_RELAXED);
+    __atomic_store_n(&vi->token_bytes, token_bytes, __ATOMIC_RELAXED);
+    stats_write_end(&vi->cut_seq);
+    if (chunk_size != cb->stats->token[d].chunk_size) {
+        __atomic_store_n(&cb->stats->token[d].chunk_size, chunk_size, __ATOMIC_RELAXED);
+        STATS_INC(cb->stats->token[d].chunk_changes);
+    }
+    __atomic_store_n(&cb->stats->token[d].split_batch, batch, __ATOMIC_RELAXED);
+    return token_bytes;
+}
+
+void pace_tokens_init(struct control_block *cb, int num_links, uint64_t now)
+{
+    struct vlink *v;
+    int d;
+
+    for (d = 0; d < num_links; d++) {
+        v = &cb->vlinks[d];
+        v->cut_chunk = v->chunk_size;
+        v->token_bytes = publish_cut(cb, d, v->cut_chunk);
+        __atomic_store_n(&v->tokens, 1, __ATOMIC_RELAXED);      // in fact, in current logic, # of tokens should always be 1 or 0
+        v->last_token = now;
+    }
+}
+
+/* ticks the link takes for the bytes of a token at its current cap */
+static inline uint64_t token_interval(const struct vlink *v, uint32_t cap, uint32_t ticks_per_us)
+{
+#ifndef USE_TIMEFRAME
+    return (uint64_t)ticks_per_us * v->token_bytes / cap;
+#else
+    return (uint64_t)ticks_per_us * TIMEFRAME;      // number of cycles needed to send 1 split chunk at current virtual link rate
+#endif
+}
+
+int pace_tokens(struct control_block *cb, int d, uint64_t now, uint32_t ticks_per_us)
+{
+    struct vlink *v = &cb->vlinks[d];
+    uint64_t ready[MAX_FLOWS / 64];
+    uint32_t cap, c;
+    int i = -1, w;
+
+    if (!(cap = __atomic_load_n(&cb->sb->vlinks[d].virtual_link_cap, __ATOMIC_RELAXED)))   // yiwen: is it necessary to check virtual cap = 0?
+        return -1;
+    /* the chunk size controller (chunk.c) runs with the monitor; a change
+     * reaches drivers between two of their postlists */
+    if ((c = __atomic_load_n(&v->chunk_size, __ATOMIC_RELAXED)) != v->cut_chunk) {
+        v->cut_chunk = c;
+        v->token_bytes = publish_cut(cb, d, c);
+    }
+
+    // hand a token to a pending flow of this link in weighted (DRR) order;
+    // the token is taken first so that sched_next() only debits a slot's
+    // deficit for a token it really gets, and put back if no slot is ready
+    if (try_fetch_a_token(v)) {
+        for (w = 0; w < MAX_FLOWS / 64; w++)
+            ready[w] = __atomic_load_n(&cb->sb->ready_map[w], __ATOMIC_ACQUIRE) & __atomic_load_n(&v->slots[w], __ATOMIC_RELAXED);
+        while ((i = sched_next(&v->sched, v->token_bytes, ready)) >= 0 &&
+               !pace_pending(cb, cb->sb->ready_map, i, 0)) {
+            sched_refund(&v->sched, i, v->token_bytes);
+            sched_map_clear(ready, i);
+        }
+        if (i >= 0)
+            pace_grant(cb, i);
+        else
+            __atomic_fetch_add(&v->tokens, 1, __ATOMIC_RELAXED);
+    }
+
+    /* generate one token once the link could have carried the previous one */
+    if (__atomic_load_n(&v->tokens, __ATOMIC_RELAXED) < CONF_U32(max_token) &&
+        now - v->last_token >= token_interval(v, cap, ticks_per_us)) {
+        v->last_token = now;
+        __atomic_fetch_add(&v->tokens, 1, __ATOMIC_RELAXED);
+        STATS_INC(cb->stats->token[d].tokens_generated);
+    }
+    return i;
+}
+
+uint64_t pace_token_due(const struct control_block *cb, int d, uint32_t ticks_per_us)
+{
+    const struct vlink *v = &cb->vlinks[d];
+    uint32_t cap = __atomic_load_n(&cb->sb->vlinks[d].virtual_link_cap, __ATOMIC_RELAXED);
+
+    if (!cap || __atomic_load_n(&v->tokens, __ATOMIC_RELAXED) >= CONF_U32(max_token))
+        return UINT64_MAX;
+    return v->last_token + token_interval(v, cap, ticks_per_us);
+}
@@ -0,0 +1,48 @@
+#ifndef PACE_H
+#define PACE_H
+//// The pacer's control logic, clocked by its caller
+//
+// What monitor_latency() does with a round of reference-flow samples, and
+// what generate_fetch_tokens() does on one pass over a virtual link, on an
+// explicit control block and at a time the caller gives. The pacer's
+// threads run them against get_cycles(), busy looping; pacer_sim runs them
+// against a virtual clock, one control block per simulated sender.
+//
+// Times are in ticks of the caller's clock, ticks_per_us of them to a
+// microsecond: CPU cycles in the pacer, nanoseconds in pacer_sim.
+#include <stdio.h>
+#include <stdint.h>
+
+struct control_block;
+
+/* tells link i's receiver what its READs from us may use (monitor.c) */
+typedef void (*pace_read_rate_fn)(int link, uint32_t rate, uint32_t chunk_size);
+
+/* one controller round over num_links virtual links, after their reference
+ * flows measured tail_us[]: the rate controllers, the split of line_rate
+ * between the links, the chunk sizes, the READ shares and the telemetry.
+ * read_rate may be NULL when no receiver READs from us; lat_trace, if not
+ * NULL, gets every sample fed to a rate controller (cc_sim's format). */
+void pace_round(struct control_block *cb, int num_links, const double *tail_us, double target_us,
+                uint32_t line_rate, uint64_t now_us, pace_read_rate_fn read_rate, FILE *lat_trace);
+
+/* the token buckets start with a token each, at `now` */
+void pace_tokens_init(struct control_block *cb, int num_links, uint64_t now);
+
+/* one pass of the token thread over link d at `now`: publish a new chunk
+ * size, hand a token to a pending slot (DRR order) and make a token if the
+ * link could have carried the last one. Returns the slot granted, or -1. */
+int pace_tokens(struct control_block *cb, int d, uint64_t now, uint32_t ticks_per_us);
+
+/* when pace_tokens() makes link d's next token; UINT64_MAX while its bucket
+ * is full or its cap is 0 */
+uint64_t pace_token_due(const struct control_block *cb, int d, uint32_t ticks_per_us);
+
+/* whether a slot picked from ready_map (write/send, or READ if `read`)
+ * still waits for a token; drops the bit if not */
+int pace_pending(struct control_block *cb, uint64_t *ready_map, int slot, int read);
+
+/* hand a token to a slot pace_pending() vouched for */
+void pace_grant(struct control_block *cb, int slot);
+
+#endif
@@ -1,43 +1,18 @@
 #include "pacer.h"
 #include "monitor.h"
 #include "get_clock.h"
+#include "ctl.h"
+#include "pace.h"
 //#include <immintrin.h> /* For _mm_pause */
-#include "countmin.h"
 #include "assert.h"
 
-// DEFAULT_CHUNK_SIZE is the initial chunk size when num_split_qps = 1
-// NOTE: from Crail exp: use 1048576 & 5120 since 1048576 is Crail's default slice size
-//#define DEFAULT_CHUNK_SIZE 10000000
-#define DEFAULT_CHUNK_SIZE 1000000
-//#define DEFAULT_CHUNK_SIZE 1048576
-#define SMALL_CHUNK_SIZE 5000
-//#define SMALL_CHUNK_SIZE 5120
-//#define EVEN_SMALLER_CHUNK_SIZE 1000
-//#define EVEN_SMALLER_CHUNK_SIZE 1024
-//#define EVEN_SMALLER_CHUNK_SIZE 5120
-#define EVEN_SMALLER_CHUNK_SIZE 5000
-#define BIG_CHUNK_SIZE 1000000
-//#define BIG_CHUNK_SIZE 1048576
-//#define DEFAULT_BATCH_OPS 5000    // xl170 (when using 10Gbps link)
-//#define DEFAULT_BATCH_OPS 1000     // Conflux
-//#define DEFAULT_BATCH_OPS 1500    // c6220
-//#define DEFAULT_BATCH_OPS 1667    // r320
-#define DEFAULT_BATCH_OPS 1800    // r320
-//#define DEFAULT_BATCH_OPS 2500    // Shin's RoCEv2
-//#define MAX_TOKEN 5
-#define MAX_TOKEN 5
-#define HOSTNAME_PATH "/proc/sys/kernel/hostname"
 //#define SPLIT_QP_NUM_ONE_SIDED 2
-//#define TIMEFRAME 2         // In microseconds
 
-extern CMH_type *cmh;
+#if SCHED_MAX_SLOTS != MAX_FLOWS
+#error "SCHED_MAX_SLOTS must match MAX_FLOWS"
+#endif
+
 struct control_block cb;
-//uint32_t chunk_size_table[] = {4096, 8192, 16384, 32768, 65536, 1048576, 1048576};
-//uint32_t chunk_size_table[] = {8192, 8192, 100000, 100000, 500000, 1000000, 1000000};
-////uint32_t chunk_size_table[] = {1000000, 1000000, 1000000, 1000000, 1000000, 1000000, 1000000};	// Use 1048576 in Conflux
-//uint32_t chunk_size_table[] = {1000000, 5000, 2000, 1000};	// adjusted based on number of split qps
-//uint32_t chunk_size_table[] = {5000, 5000, 5000, 5000};	// adjusted based on number of split qps
-uint32_t chunk_size_table[] = {1000000, 5000};	// adjusted based on split_level ; don't delete for now for RDMA READ's sake; not currently in use
 //// UDS_IMPL
 #ifdef CPU_FRIENDLY
 unsigned int flow_sockets[MAX_FLOWS];
@@ -53,7 +28,7 @@ static void error(char *msg)
 static void usage()
 {
     //printf("Usage: program is_client server_addr num_clients [gid_idx]\n");
-    printf("Usage: program is_client server_addr num_clients_or_receiver [gid_idx]\n");
+    printf("Usage: program is_client server_addr[,server_addr...] num_clients_or_receivers [gid_idx]\n");
 }
 
 static inline void cpu_relax() __attribute__((always_inline));
@@ -69,46 +44,22 @@ static inline void cpu_relax()
     asm("nop");
 }
 
+static char stats_shm_name[sizeof(conf.shm_name) + sizeof(STATS_MEM_SUFFIX)];
+
 static void termination_handler(int sig)
 {
     printf("signal handler called\n");
-    remove("/dev/shm/rdma-fairness");
-    CMH_Destroy(cmh);
+    shm_unlink(conf.shm_name);
+    shm_unlink(stats_shm_name);
     _exit(0);
 }
 
 static void rm_shmem_on_exit()
 {
-    remove("/dev/shm/rdma-fairness");
+    shm_unlink(conf.shm_name);
+    shm_unlink(stats_shm_name);
 }
 
-char *get_sock_path() {
-    FILE *fp;
-    fp = fopen(HOSTNAME_PATH, "r");
-    if (fp == NULL) {
-        printf("Error opening %s, use default SOCK_PATH", HOSTNAME_PATH);
-        fclose(fp);
-        return SOCK_PATH;
-    }
-
-    char hostname[100];
-    if (fgets(hostname, 100, fp) != NULL) {
-        char *sock_path = (char *)malloc(108 * sizeof(char));
-        printf("DE hostname:%s\n", hostname);
-        int len = strlen(hostname);
-        if (len > 0 && hostname[len-1] == '\n') hostname[len-1] = '\0';
-        strcat(hostname, "_rdma_socket");
-        strcpy(sock_path, getenv("HOME"));
-        len = strlen(sock_path);
-        sock_path[len] = '/';
-        strcat(sock_path, hostname);
-        fclose(fp);
-        return sock_path;
-    }
-
-    fclose(fp);
-    return SOCK_PATH;
-}
 /* end */
 
 /* circular buffer for future logging */
@@ -178,84 +129,115 @@ void logging_tokens()
     double cpu_mhz = get_cpu_mhz(1);
     while (1) {
         // NOTE: shouldn't be DEAFULT_CHUNK_SIZE; it can change
-        while (get_cycles() - curr_cycle < cpu_mhz * DEFAULT_CHUNK_SIZE / LINE_RATE_MB)
+        while (get_cycles() - curr_cycle < cpu_mhz * DEFAULT_CHUNK_SIZE / cb.line_rate)
             cpu_relax();
         curr_cycle = get_cycles();
-        fprintf(f, "%.2f\t\t%lld\n", ((double) (curr_cycle - start_cycle) / cpu_mhz), cb.tokens);
-        //fprintf(f, "%.2f\t\t%" PRIu64 "\n", (double) ((curr_cycle - start_cycle) / cpu_mhz), __atomic_load_n(&cb.tokens, __ATOMIC_RELAXED));
+        fprintf(f, "%.2f\t\t%lld\n", ((double) (curr_cycle - start_cycle) / cpu_mhz), cb.vlinks[0].tokens);
+        //fprintf(f, "%.2f\t\t%" PRIu64 "\n", (double) ((curr_cycle - start_cycle) / cpu_mhz), __atomic_load_n(&cb.vlinks[0].tokens, __ATOMIC_RELAXED));
     }
 
 }
 /* end */
 
-int find_next_slot(pid_t pid)
+/* slot of flow (pid, qpn): the one it already holds, else the first free one */
+int find_next_slot(pid_t pid, uint32_t qpn)
 {
-    int i, ret_slot = -1, match = 0;
+    int i, ret_slot = -1;
     if (pid == -1) {
-        printf("Invalid pid. Exiting.\n");
-        exit(1);
+        printf("Invalid pid.\n");
+        return -1;
+    }
+
+    for (i = 0; i < MAX_FLOWS; i++) {
+        if (cb.pid_list[i] == pid && cb.qpn_list[i] == qpn) {
+            printf("PID(%d) QPN(%#x) match at slot %d\n", pid, qpn, i);
+            return i;
+        }
     }
 
+    /* if the flow appears for the first time */
     for (i = 0; i < MAX_FLOWS; i++) {
-        if (cb.pid_list[i] == pid) {
-            printf("PID(%d) match at slot %d\n", pid, i);
-            cb.pid_list[i] = pid;
+        if (cb.pid_list[i] == -1) {
             ret_slot = i;
-            match = 1;
             break;
         }
-    } 
-
-    /* if the pid appears for the first time */
-    if (match == 0) {
-        for (i = 0; i < MAX_FLOWS; i++) {
-            if (cb.pid_list[i] == -1) {
-                //printf("No pid match. Next empty slot is %d\n", i);
-                ret_slot = i;
-                break;
-            }
-        } 
     }
 
     if (ret_slot == -1) {
-        printf("Error finding next slot. Exiting.\n");
-        exit(1);
+        printf("No free slot for pid %d QPN %#x\n", pid, qpn);
     } else {
         cb.pid_list[ret_slot] = pid;
+        cb.qpn_list[ret_slot] = qpn;
+        __atomic_store_n(&cb.stats->pids[ret_slot], pid, __ATOMIC_RELAXED);
+        __atomic_store_n(&cb.stats->qpns[ret_slot], qpn, __ATOMIC_RELAXED);
     }
 
     return ret_slot;
 }
 
 // Assume only clients keep track of per src/dsr info
-// TODO: fix this impl; where did the app_vaddrs get added?
+// app_vaddrs[] holds each receiver's destination key (set by monitor_latency)
 int find_vaddr_idx(int num_servers, uint64_t vaddr)
 {
     int i;
     for (i = 0; i < num_servers; i++) {
-        if (vaddr == cb.app_vaddrs[i]) {
+        if (vaddr == __atomic_load_n(&cb.app_vaddrs[i], __ATOMIC_ACQUIRE)) {
             return i;
         }
     }
     return -1;
 }
 
-/* handle incoming flows one by one; assign a slot to an incoming flow */
-static void flow_handler(void *arg)
+/* virtual link for a destination key; apps whose destination is unknown
+ * (key 0, or not one of our receivers) share link 0 */
+static int find_vlink(int num_servers, uint64_t vaddr)
 {
-    /* prepare unix domain socket communication */
-    printf("starting flow_handler...\n");
-    unsigned int s, s2, len;
-    struct sockaddr_un local, remote;
-    char buf[MSG_LEN];
-    char buf_pid[MSG_LEN];
-    char *sock_path = get_sock_path();
-    pid_t pid;
-    int num_comp;
+    int idx = find_vaddr_idx(num_servers, vaddr);
+    if (idx < 0) {
+        printf("Unknown destination key %016" PRIx64 "; using virtual link 0\n", vaddr);
+        idx = 0;
+    }
+    return idx;
+}
+
+/* read link of a READ app's responder: the sender with that destination
+ * key, or the last link for a responder that is not one of our senders */
+static int find_read_link(uint64_t key)
+{
+    int i, n = __atomic_load_n(&cb.num_read_links, __ATOMIC_ACQUIRE);
 
+    for (i = 0; i < n; i++)
+        if (key && key == __atomic_load_n(&cb.read_links[i].key, __ATOMIC_ACQUIRE))
+            return i;
+    printf("READ responder %016" PRIx64 " is not one of our senders; pacing at line rate\n", key);
+    return MAX_READ_LINKS - 1;
+}
+
+/* move a slot onto the token scheduler of virtual link `idx` */
+static void bind_slot(int slot, int idx)
+{
+    int old = __atomic_load_n(&cb.sb->flows[slot].vlink, __ATOMIC_RELAXED);
+    if (old == idx)
+        return;
+    sched_map_clear(cb.vlinks[old].slots, slot);
+    sched_map_set(cb.vlinks[idx].slots, slot);
+    __atomic_store_n(&cb.sb->flows[slot].vlink, idx, __ATOMIC_RELAXED);
+    printf("slot %d now on virtual link %d\n", slot, idx);
+}
+
+/* driver connections (ctl.c); the callbacks below run on the flow_handler thread */
+static int ctl_is_client, ctl_num_servers;
+static uint16_t slot_conns[MAX_FLOWS];     /* connections holding each slot */
+
+/* as a sender, tell receiver d's pacer (since WRITE operates passively) that
+ * one of its fan-in senders started or stopped an app of this kind */
+static void notify_receiver(int d, const char *msg)
+{
+    struct pingpong_context *ctx = cb.ctx_per_server[d];
     struct ibv_send_wr send_wr, *bad_wr = NULL;
     struct ibv_sge send_sge;
     struct ibv_wc send_wc;
+    int num_comp;
 
     memset(&send_wr, 0, sizeof send_wr);
     send_wr.opcode = IBV_WR_SEND;
@@ -263,248 +245,205 @@ static void flow_handler(void *arg)
     send_wr.num_sge = 1;
     send_wr.send_flags = (IBV_SEND_SIGNALED | IBV_SEND_INLINE);
 
-    memset(&send_sge, 0, sizeof send_sge);
-
-    /* get a socket descriptor */
-    if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
-        error("socket");
-
-    /* bind to an address */
-    local.sun_family = AF_UNIX;
-    strcpy(local.sun_path, sock_path);
-    unlink(local.sun_path);
-    len = strlen(local.sun_path) + sizeof(local.sun_family);
-    if (bind(s, (struct sockaddr *)&local, len))
-        error("bind");
-
-    /* listen for clients */
-    if (listen(s, 10))
-        error("listen");
-
-
-    int is_client = ((struct monitor_param *)arg)->is_client;
-    int num_servers = ((struct monitor_param *)arg)->num_servers;
-    uint64_t vaddr;
-    int vaddr_idx;
-
-    /* handling loop */
-    while (1) {
-        len = sizeof(struct sockaddr_un);
-        if ((s2 = accept(s, (struct sockaddr *)&remote, &len)) == -1)
-            error("accept");
-
-        /* check join */
-        len = recv(s2, (void *)buf, (size_t)MSG_LEN, 0);
-        printf("receive message of length %d.\n", len);
-        buf[len] = '\0';
-        printf("message is %s.\n", buf);
-        //if (strcmp(buf, "join") == 0) {
-        if (strncmp(buf, "join:xxxx", 4) == 0) {      // join message now also send dst
-            // assume pacers have established connection between each other before
-            // RDMA applications start to send data (which is reasonable) 
-            // assume only clients need to keep track of per src/pair info
-            sscanf(buf, "join:%Lx", &vaddr);
-            vaddr_idx = find_vaddr_idx(num_servers, vaddr);
-            if (vaddr_idx < 0) {
-                printf("Error finding vaddr idx. Exit\n");
-                exit(1);
-            }
-            printf("Found vaddr idx: %d\n", vaddr_idx);
-
-            /* send if the node is a sender or receiver (instead of sending "pid" to prompt for pid) */
-            // for sender, also send the vaddr_idx
-            if (is_client) {
-                sprintf(buf, "sender:%04x", vaddr_idx);
-                if (send(s2, buf, sizeof(buf), 0) == -1) {
-                    perror("error sending sender info: ");
-                    exit(1);
-                }
-            } else {
-                if (send(s2, "recver", 6, 0) == -1) {
-                    perror("error sending receiver info: ");
-                    exit(1);
-                }
-            }
-
-            /* receive pid from process */
-            len = recv(s2, (void *)buf_pid, (size_t)MSG_LEN, 0);
-            //printf("receive pid message of length %d.\n", len);
-            //printf("message is %s.\n", buf_pid);
-            buf_pid[len] = '\0';
-            pid = strtol(buf_pid, NULL, 10);
-            printf("received pid: %d\n", pid);
+    strcpy(ctx->send_buf, msg);
+    send_sge.addr = (uintptr_t)ctx->send_buf;
+    send_sge.length = BUF_SIZE;
+    send_sge.lkey = ctx->send_mr->lkey;
 
-            /* find the slot number based on the pid received */
-            cb.next_slot = find_next_slot(pid);
+    if (ibv_post_send(ctx->qp, &send_wr, &bad_wr)) {
+        perror("ibv_post_send: update num_sender for remote receiver");
+    }
+    do {    // clean up the cq for SEND message
+        num_comp = ibv_poll_cq(ctx->send_cq, 1, &send_wc);
+    } while (num_comp == 0);
+    printf("sent %s to remote receiver %d\n", msg, d);
+}
 
-            //// UDS_IMPL
+static void on_join(struct ctl_conn *c, const struct pmsg_join *m, struct pmsg_join_ack *ack)
+{
+    // assume pacers have established connection between each other before
+    // RDMA applications start to send data (which is reasonable)
+    // dest_key is the app's destination key if its QP was already connected, 0 otherwise
+    int idx = m->dest_key ? find_vlink(ctl_num_servers, m->dest_key) : 0;
+    uint32_t weight = m->weight ? m->weight : SCHED_DEFAULT_WEIGHT;
+    int slot, d;
+
+    printf("join from pid %d QPN %#x (weight %u, burst %u KB), vlink %d\n", m->pid, m->qpn, weight,
+           m->burst_kb, idx);
+    ack->is_sender = ctl_is_client;
+    if ((slot = find_next_slot(m->pid, m->qpn)) < 0) {
+        ack->status = PMSG_EFULL;
+        return;
+    }
+    /* a flow that joins again (libmlx5: a process with several contexts)
+     * holds its slot on more than one connection */
+    if (!ctl_conn_flow(c, slot))
+        slot_conns[slot]++;
+    /* the weight is the slot's, not the process's: each QP of a process
+     * gets a DRR share of its own */
+    for (d = 0; d < ctl_num_servers; d++)
+        sched_set_slot(&cb.vlinks[d].sched, slot, weight, m->burst_kb * 1024);
+    for (d = 0; d < MAX_READ_LINKS; d++)
+        sched_set_slot(&cb.read_links[d].sched, slot, weight, m->burst_kb * 1024);
+    if (m->dest_key)
+        bind_slot(slot, idx);
+
+    //// UDS_IMPL
 #ifdef CPU_FRIENDLY
-            /* store the uds for later use (to inform token is ready) */
-            flow_sockets[cb.next_slot] = s2;
+    /* store the uds for later use (to inform token is ready) */
+    flow_sockets[slot] = c->fd;
 #endif
-            ////
-            
-            /* send back slot number */
-            printf("sending back slot number %d ...\n", cb.next_slot);
-            len = snprintf(buf, MSG_LEN, "%d", cb.next_slot);
-            cb.sb->flows[cb.next_slot].active = 1;
-            send(s2, &buf, len, 0);     // yiwen:why &buf not buf?
-
-            /* find next empty slot */
-            // No longer needed since we switch to the pid based slot
-            /* 
-            cb.next_slot = (cb.next_slot + 1) % MAX_FLOWS;
-            while (__atomic_load_n(&cb.sb->flows[cb.next_slot].active, __ATOMIC_RELAXED))
-            {
-                cb.next_slot = (cb.next_slot + 1) % MAX_FLOWS;
-            }
-            */
-
+    ////
 
-        }
-        else if (strcmp(buf, "read") == 0)
-        {
-            // TODO: fix READ impl later
-            /*
-            send_sge.addr = (uintptr_t)cb.ctx->local_read_buf;
-            send_sge.length = BUF_READ_SIZE;
-            send_sge.lkey = cb.ctx->local_read_mr->lkey;
-
-            strcpy(cb.ctx->local_read_buf, buf);
-            ibv_post_send(cb.ctx->qp_read, &send_wr, &bad_wr);
-            __atomic_fetch_add(&cb.num_big_read_flows, 1, __ATOMIC_RELAXED);
-            */
-        }
-        else if (strncmp(buf, "exit_app_xxx", 8) == 0) {
-            /* As a sender, tell the receriver that # of the sending apps has decreased by 1 */
-            int i;
-            for (i = 0; i < num_servers; i++) {
-                //TODO: 
-            }
-            if (is_client) {
-                struct pingpong_context *ctx = cb.ctx_per_server[0]; // Hack for now
-                if (strcmp(buf, "exit_app_bw") == 0) {
-                    strcpy(ctx->send_buf, "big_dec");
-                } else if (strcmp(buf, "exit_app_lat") == 0) {
-                    strcpy(ctx->send_buf, "small_dec");
-                } else if (strcmp(buf, "exit_app_tput") == 0) {
-                    strcpy(ctx->send_buf, "big_dec");
-                } else {
-                    printf("Error unrecognized app type. Exit\n");
-                    exit(1);
-                }
+    printf("sending back slot number %d ...\n", slot);
+    cb.sb->flows[slot].active = 1;
+    ack->status = PMSG_OK;
+    ack->slot = slot;
+    ack->vlink = __atomic_load_n(&cb.sb->flows[slot].vlink, __ATOMIC_RELAXED);
+}
 
-                send_sge.addr = (uintptr_t)ctx->send_buf;
-                send_sge.length = BUF_SIZE;
-                send_sge.lkey = ctx->send_mr->lkey;
+/* a READ app starts (n = 1) or stops (n = -1) reading from the responder
+ * with destination key `key`; server_loop passes the count on to it */
+static void read_app(int slot, uint64_t key, int n)
+{
+    struct read_link *r = &cb.read_links[find_read_link(key)];
 
+    if (n > 0)
+        sched_map_set(r->slots, slot);
+    else
+        sched_map_clear(r->slots, slot);
+    __atomic_fetch_add(&r->num_reads, n, __ATOMIC_RELEASE);
+}
 
-                if (ibv_post_send(ctx->qp, &send_wr, &bad_wr)) {
-                    perror("ibv_post_send: decrement num_sender for remote receiver");
-                }
-                
-                do {    // clean up the cq for SEND message
-                    num_comp = ibv_poll_cq(ctx->send_cq, 1, &send_wc);
-                } while (num_comp == 0);
-                printf("sent a msg to remote receiver on WRITE EXIT\n");
+static void on_app(struct ctl_conn *c, struct ctl_flow *f, const struct pmsg_app *m)
+{
+    int d;
 
-            }
+    if (m->app_type == PMSG_APP_READ) {
+        read_app(f->slot, m->dest_key, 1);
+        return;
+    }
+    d = find_vlink(ctl_num_servers, m->dest_key);
+    bind_slot(f->slot, d);
+    if (m->app_type == PMSG_APP_LAT) {
+        __atomic_fetch_add(&cb.vlinks[d].num_small_flows, 1, __ATOMIC_RELAXED);
+    } else {
+        __atomic_fetch_add(&cb.vlinks[d].num_big_flows, 1, __ATOMIC_RELAXED);
+        if (m->app_type == PMSG_APP_BW)
+            __atomic_fetch_add(&cb.vlinks[d].num_bw_flows, 1, __ATOMIC_RELAXED);
+    }
+    if (ctl_is_client)
+        notify_receiver(d, m->app_type == PMSG_APP_LAT ? "small_inc" : "big_inc");
+}
 
-            // TODO: hanlde read exit later
-            /*
-            send_sge.addr = (uintptr_t)cb.ctx->local_read_buf;
-            send_sge.length = BUF_READ_SIZE;
-            send_sge.lkey = cb.ctx->local_read_mr->lkey;
-
-            strcpy(cb.ctx->local_read_buf, buf);
-            ibv_post_send(cb.ctx->qp_read, &send_wr, &bad_wr);
-            __atomic_fetch_sub(&cb.num_big_read_flows, 1, __ATOMIC_RELAXED);
-            */
-
-        } else if (strncmp(buf, "app_xxx", 4) == 0) {
-            /* As a sender, tell the receiver (since WRITE operates passively) that I contribute to one of the fan-in (# of sending apps increase by 1) */
-            if (is_client) {
-                struct pingpong_context *ctx = cb.ctx_per_server[0]; // Hack for now
-                if (strcmp(buf, "app_bw") == 0) {
-                    strcpy(ctx->send_buf, "big_inc");
-                } else if (strcmp(buf, "app_lat") == 0) {
-                    strcpy(ctx->send_buf, "small_inc");
-                } else if (strcmp(buf, "app_tput") == 0) {
-                    strcpy(ctx->send_buf, "big_inc");
-                } else {
-                    printf("Error unrecognized app type. Exit\n");
-                    exit(1);
-                }
-                send_sge.addr = (uintptr_t)ctx->send_buf;
-                send_sge.length = BUF_SIZE;
-                send_sge.lkey = ctx->send_mr->lkey;
+static void on_exit_app(struct ctl_conn *c, struct ctl_flow *f, const struct pmsg_app *m)
+{
+    int d;
 
-                if (ibv_post_send(ctx->qp, &send_wr, &bad_wr)) {
-                    perror("ibv_post_send: increment num_sender for remote receiver");
-                }
-                do {    // clean up the cq for SEND message
-                    num_comp = ibv_poll_cq(ctx->send_cq, 1, &send_wc);
-                } while (num_comp == 0);
-                printf("sent a msg to remote receiver on WRITE ARRIVAL; %s\n", buf);
-            }
-        }
+    if (m->app_type == PMSG_APP_READ) {
+        read_app(f->slot, m->dest_key, -1);
+        return;
     }
+    d = find_vlink(ctl_num_servers, m->dest_key);
+    if (m->app_type == PMSG_APP_LAT) {
+        __atomic_fetch_sub(&cb.vlinks[d].num_small_flows, 1, __ATOMIC_RELAXED);
+    } else {
+        __atomic_fetch_sub(&cb.vlinks[d].num_big_flows, 1, __ATOMIC_RELAXED);
+        if (m->app_type == PMSG_APP_BW)
+            __atomic_fetch_sub(&cb.vlinks[d].num_bw_flows, 1, __ATOMIC_RELAXED);
+    }
+    if (ctl_is_client)
+        notify_receiver(d, m->app_type == PMSG_APP_LAT ? "small_dec" : "big_dec");
 }
 
-/* fetch one token; block if no token is available 
- */
-static inline void fetch_token() __attribute__((always_inline));
-static inline void fetch_token()
+/* the flow left, or the last connection holding its slot closed: free the slot */
+static void on_close(struct ctl_conn *c, struct ctl_flow *f)
 {
-    while (!__atomic_load_n(&cb.tokens, __ATOMIC_RELAXED))
-        cpu_relax();
-    __atomic_fetch_sub(&cb.tokens, 1, __ATOMIC_RELAXED);
+    int slot = f->slot, d;
+
+    if (--slot_conns[slot])
+        return;
+    printf("pid %d QPN %#x left slot %d\n", cb.pid_list[slot], cb.qpn_list[slot], slot);
+#ifdef CPU_FRIENDLY
+    flow_sockets[slot] = -1;
+#endif
+    __atomic_store_n(&cb.sb->flows[slot].active, 0, __ATOMIC_RELAXED);
+    __atomic_fetch_and(&cb.sb->ready_map[slot / 64], ~(1ULL << (slot % 64)), __ATOMIC_RELAXED);
+    __atomic_fetch_and(&cb.sb->ready_map_read[slot / 64], ~(1ULL << (slot % 64)), __ATOMIC_RELAXED);
+    /* the next flow in this slot starts without our credit, on link 0 */
+    for (d = 0; d < ctl_num_servers; d++)
+        sched_reset_slot(&cb.vlinks[d].sched, slot);
+    for (d = 0; d < MAX_READ_LINKS; d++)
+        sched_reset_slot(&cb.read_links[d].sched, slot);
+    bind_slot(slot, 0);
+    cb.pid_list[slot] = -1;
+    cb.qpn_list[slot] = 0;
 }
 
-/* try fetch one token; return 1 on success and 0 on failure 
- */
-static inline int try_fetch_a_token() __attribute__((always_inline));
-static inline int try_fetch_a_token()
+/* serve driver registrations and app/exit messages (see ctl.h) */
+static void flow_handler(void *arg)
 {
-    int got_token = 0;
-    if (__atomic_load_n(&cb.tokens, __ATOMIC_RELAXED)) {
-        __atomic_fetch_sub(&cb.tokens, 1, __ATOMIC_RELAXED);
-        got_token = 1;
-    }
-    return got_token;
+    static const struct ctl_ops ops = {
+        .join = on_join,
+        .app = on_app,
+        .exit = on_exit_app,
+        .close = on_close,
+    };
+    printf("starting flow_handler...\n");
+    ctl_is_client = ((struct monitor_param *)arg)->is_client;
+    ctl_num_servers = ((struct monitor_param *)arg)->num_servers;
+    ctl_run(ctl_listen(conf.sock_path), JUSTITIA_ABI_VERSION, &ops);
+}
+
+#ifdef CPU_FRIENDLY
+/* a grant for slot, on the connection of its process, which may carry other
+ * flows too (pacer_msg.h) */
+static void send_token(uint32_t slot)
+{
+    if (send(flow_sockets[slot], &slot, PMSG_TOKEN_LEN, MSG_NOSIGNAL) == -1)
+        perror("error sending token: ");     // the process is gone; flow_handler frees the slot
 }
+#endif
 
-static inline void fetch_token_read() __attribute__((always_inline));
-static inline void fetch_token_read()
+/* fetch one token of a virtual link; block if no token is available 
+ */
+static inline void fetch_token(struct vlink *v) __attribute__((always_inline));
+static inline void fetch_token(struct vlink *v)
 {
-    while (!__atomic_load_n(&cb.tokens_read, __ATOMIC_RELAXED))
+    while (!__atomic_load_n(&v->tokens, __ATOMIC_RELAXED))
         cpu_relax();
-    __atomic_fetch_sub(&cb.tokens_read, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&v->tokens, 1, __ATOMIC_RELAXED);
 }
 
 /* generate tokens at some rate; now also fetch tokens
+ *
+ * Each virtual link (receiver) has its own token bucket, refilled at the
+ * link's share of the line rate, and its own DRR scheduler over the slots
+ * bound to it.
  */
-static void generate_fetch_tokens()
+static void generate_fetch_tokens(void *arg)
 {
-    cycles_t start_cycle = 0;
+    int num_links = ((struct monitor_param *)arg)->num_servers;
     int cpu_mhz = get_cpu_mhz(1);
-    int start_flag = 1;
+    int d;
+#ifdef CPU_FRIENDLY
     int i;
-    int next_idx = 0;
-    // struct timespec wait_time;
+#endif
 
     /* infinite loop: generate tokens at a rate calculated 
-     * from virtual_link_cap and active chunk size 
+     * from virtual_link_cap and active chunk size (pace_tokens())
      */
-    uint32_t temp, chunk_size = DEFAULT_CHUNK_SIZE;
-    //uint16_t num_big;
-    uint16_t num_small;
-    __atomic_store_n(&cb.sb->active_chunk_size, chunk_size, __ATOMIC_RELAXED);
-    //__atomic_store_n(&cb.sb->active_batch_ops, chunk_size/DEFAULT_CHUNK_SIZE*DEFAULT_BATCH_OPS, __ATOMIC_RELAXED);
-    __atomic_store_n(&cb.sb->active_batch_ops, DEFAULT_BATCH_OPS, __ATOMIC_RELAXED);
-    __atomic_store_n(&cb.tokens, 1, __ATOMIC_RELAXED);      // in fact, in current logic, # of tokens should always be 1 or 0
+    uint32_t c, batch_kb;
+    batch_kb = CONF_U32(split_batch_kb);
+    pace_tokens_init(&cb, num_links, get_cycles());
     while (1)
     {
+        /* a new split_batch_kb changes the batch of every chunk size */
+        if ((c = CONF_U32(split_batch_kb)) != batch_kb) {
+            batch_kb = c;
+            for (d = 0; d < num_links; d++)
+                cb.vlinks[d].cut_chunk = 0;
+        }
 //// FETCH TOKEN loop
 /*
         for (i = 0; i < MAX_FLOWS; i++)
@@ -519,178 +458,116 @@ static void generate_fetch_tokens()
 */
 //// end of FETCH TOKEN loop
 
-        if ((temp = __atomic_load_n(&cb.sb->virtual_link_cap, __ATOMIC_RELAXED)))   // yiwen: is it necessary to check virtual cap = 0?
+        for (d = 0; d < num_links; d++)
         {
-#ifdef HACK_APP_NUMS
-            cb.num_receiver_small_flows[0] = HACK_NUM_LAT_APP;
-#endif
-            ////if ((num_small = __atomic_load_n(&cb.sb->num_active_small_flows, __ATOMIC_RELAXED))) {
-            if (cb.num_receiver_small_flows[0]) {   // hack
-                //chunk_size = chunk_size_table[temp / num_big / (LINE_RATE_MB/6)];
-                //chunk_size = DEFAULT_CHUNK_SIZE;
-
-                ////chunk_size = chunk_size_table[__atomic_load_n(&cb.sb->num_active_split_qps, __ATOMIC_RELAXED) - 1];
-                /* adjust chunk size based on split_level */
-                /*
-                chunk_size = chunk_size_table[__atomic_load_n(&cb.sb->split_level, __ATOMIC_RELAXED) - 1];
-                if (__atomic_load_n(&cb.sb->split_level, __ATOMIC_RELAXED) > 1) {
-                    chunk_size = chunk_size_table[1];
-                } else {
-                    chunk_size = chunk_size_table[0];
-                }
-                */
-                chunk_size = SMALL_CHUNK_SIZE;
-                if (temp > (double) LINE_RATE_MB / 3) {
-                    chunk_size = SMALL_CHUNK_SIZE;
-                } else {
-                    chunk_size = EVEN_SMALLER_CHUNK_SIZE;
-                }
-            }
-            else
-            {
-                chunk_size = DEFAULT_CHUNK_SIZE;
-                //chunk_size = SMALL_CHUNK_SIZE;      // READ hack
-            }
-            //printf("num big flows = %d; split_level = %d; chunk_size = %d\n", num_big, __atomic_load_n(&cb.sb->split_level, __ATOMIC_RELAXED), chunk_size);
-            __atomic_store_n(&cb.sb->active_chunk_size, chunk_size, __ATOMIC_RELAXED);
-            //__atomic_store_n(&cb.sb->active_batch_ops, DEFAULT_BATCH_OPS * chunk_size/DEFAULT_CHUNK_SIZE, __ATOMIC_RELAXED);  // not used
-            __atomic_store_n(&cb.sb->active_batch_ops, DEFAULT_BATCH_OPS, __ATOMIC_RELAXED);
-            //__atomic_fetch_add(&cb.tokens, 10, __ATOMIC_RELAXED);
-            //wait_time.tv_nsec = 10 * chunk_size / temp * 1000;
-
-            // try to fetch tokens for flows until we are out of tokens
-            i = next_idx;
-
-#ifdef CPU_FRIENDLY
-            //struct timeval tt1, tt2;
-#endif
-            while (1) {
-                if (!__atomic_load_n(&cb.sb->flows[i].read, __ATOMIC_RELAXED) && __atomic_load_n(&cb.sb->flows[i].pending, __ATOMIC_RELAXED)) {
-                    if (try_fetch_a_token()) {
-                        __atomic_store_n(&cb.sb->flows[i].pending, 0, __ATOMIC_RELAXED);
-                        //// UDS_IMPL
-#ifdef CPU_FRIENDLY
-                        //gettimeofday(&tt1,NULL);
-                        if (send(flow_sockets[i], "0", 1, 0) == -1) {
-                            perror("error sending token: ");
-                            exit(1);
-                        }
-#endif
-                        //gettimeofday(&tt2,NULL);
-                        //printf("elaspsed time = %d us\n", tt2.tv_usec - tt1.tv_usec);
-                        ////
-                        //printf("fetched for flow %d\n", i);
-                        next_idx = (i + 1) % MAX_FLOWS;
-                        break;
-                    } else {    // out of tokens
-                        //printf("out of tokens %d\n");
-                        next_idx = i;
-                        break;
-                    }
-                }
-                i = (i + 1) % MAX_FLOWS;
-            }
- 
-            /* generate one token */
-            if (__atomic_load_n(&cb.tokens, __ATOMIC_RELAXED) < MAX_TOKEN)
-            {
-                if (start_flag)
-                {
-                    start_flag = 0;
-                    start_cycle = get_cycles();
-                    __atomic_fetch_add(&cb.tokens, 1, __ATOMIC_RELAXED);
-                }
-                else
-                {
-                    //while (get_cycles() - start_cycle < (cpu_mhz * chunk_size / temp) / SPLIT_QP_NUM_ONE_SIDED)
-#ifndef USE_TIMEFRAME
+            // hand a token to a pending flow of this link in weighted (DRR) order; make one when due
+            //// UDS_IMPL
 #ifdef CPU_FRIENDLY
-                    while (get_cycles() - start_cycle < cpu_mhz * BIG_CHUNK_SIZE / temp)      // number of cycles needed to send 1 1MB-chunk at current virtual link rate
+            if ((i = pace_tokens(&cb, d, get_cycles(), cpu_mhz)) >= 0)
+                send_token(i);
 #else
-                    while (get_cycles() - start_cycle < cpu_mhz * chunk_size / temp)      // number of cycles needed to send 1 split chunk at current virtual link rate
+            pace_tokens(&cb, d, get_cycles(), cpu_mhz);
 #endif
-#else
-                    while (get_cycles() - start_cycle < cpu_mhz * TIMEFRAME)      // number of cycles needed to send 1 split chunk at current virtual link rate
-#endif
-                        cpu_relax();
-                    start_cycle = get_cycles();
-                    __atomic_fetch_add(&cb.tokens, 1, __ATOMIC_RELAXED);
-                }
-            }
+            ////
         }
         //nanosleep(&wait_time, NULL);
     }
 }
 
-static void generate_tokens_read()
+/* requester side: the READs of local apps, paced per responder
+ *
+ * Each responder (read link) hands us a rate and a chunk size for all of our
+ * READs from it (read_rate_msg, received by server_loop); its token bucket
+ * is refilled at that rate with tokens of one chunk, and its DRR scheduler
+ * hands them to the pending READ slots that read from it. Drivers cut their
+ * READs into chunks of active_chunk_size_read, the smallest chunk any
+ * responder with READs asks for.
+ */
+static void generate_fetch_tokens_read(void *arg)
 {
-    cycles_t start_cycle = 0;
     int cpu_mhz = get_cpu_mhz(1);
-    int start_flag = 1;
-    // struct timespec wait_time;
+    int d, i, w, n, busy;
+    uint32_t rate, chunk_size, read_chunk, max_token;
+    uint64_t ready[MAX_FLOWS / 64];
+    struct read_link *r;
 
-    /* infinite loop: generate tokens at a rate calculated 
-     * from virtual_link_cap and active chunk size 
-     */
-    uint32_t temp, chunk_size;
-    uint16_t num_read;
     while (1)
     {
-        if ((num_read = __atomic_load_n(&cb.num_big_read_flows, __ATOMIC_RELAXED)))
+        n = __atomic_load_n(&cb.num_read_links, __ATOMIC_ACQUIRE);
+        busy = 0;
+        read_chunk = CONF_U32(max_chunk);
+        max_token = CONF_U32(max_token);
+        for (d = 0; d < MAX_READ_LINKS; d++)
         {
-            // temp = 4999; // for testing
-            if ((temp = __atomic_load_n(&cb.local_read_rate, __ATOMIC_RELAXED)))
-            {
-                //TODO: note the table is no longer used
-                //chunk_size = chunk_size_table[temp / num_read / 1000];
-                ////chunk_size = chunk_size_table[__atomic_load_n(&cb.sb->num_active_split_qps, __ATOMIC_RELAXED) - 1];
-                /* adjust chunk size based on split_level */
-                chunk_size = chunk_size_table[__atomic_load_n(&cb.sb->split_level, __ATOMIC_RELAXED) - 1];
-                if (__atomic_load_n(&cb.sb->split_level, __ATOMIC_RELAXED) > 1) {
-                    chunk_size = chunk_size_table[0];
-                } else {
-                    chunk_size = chunk_size_table[1];
+            if (d == n)
+                d = MAX_READ_LINKS - 1;     // skip the senders we don't have
+            r = &cb.read_links[d];
+            if (!__atomic_load_n(&r->num_reads, __ATOMIC_ACQUIRE))
+                continue;
+            busy = 1;
+            rate = __atomic_load_n(&r->rate, __ATOMIC_RELAXED);
+            chunk_size = __atomic_load_n(&r->chunk_size, __ATOMIC_RELAXED);
+            if (chunk_size < read_chunk)
+                read_chunk = chunk_size;
+
+            // hand a token to a pending READ of this responder in weighted (DRR) order
+            if (__atomic_load_n(&r->tokens, __ATOMIC_RELAXED)) {
+                for (w = 0; w < MAX_FLOWS / 64; w++)
+                    ready[w] = __atomic_load_n(&cb.sb->ready_map_read[w], __ATOMIC_ACQUIRE) & __atomic_load_n(&r->slots[w], __ATOMIC_RELAXED);
+                while ((i = sched_next(&r->sched, chunk_size, ready)) >= 0 &&
+                       !pace_pending(&cb, cb.sb->ready_map_read, i, 1)) {
+                    sched_refund(&r->sched, i, chunk_size);
+                    sched_map_clear(ready, i);
                 }
-
-                __atomic_store_n(&cb.sb->active_chunk_size_read, chunk_size, __ATOMIC_RELAXED);
-                // __atomic_fetch_add(&cb.tokens, 10, __ATOMIC_RELAXED);
-                // wait_time.tv_nsec = 10 * chunk_size / temp * 1000;
-                if (__atomic_load_n(&cb.tokens_read, __ATOMIC_RELAXED) < MAX_TOKEN)
-                {
-                    if (start_flag)
-                    {
-                        start_flag = 0;
-                        start_cycle = get_cycles();
-                        __atomic_fetch_add(&cb.tokens_read, 1, __ATOMIC_RELAXED);
-                    }
-                    else
-                    {
-                        while (get_cycles() - start_cycle < cpu_mhz * chunk_size / temp)
-                            cpu_relax();
-                        start_cycle = get_cycles();
-                        __atomic_fetch_add(&cb.tokens_read, 1, __ATOMIC_RELAXED);
-                    }
+                if (i >= 0) {
+                    __atomic_fetch_sub(&r->tokens, 1, __ATOMIC_RELAXED);
+                    pace_grant(&cb, i);
+#ifdef CPU_FRIENDLY
+                    send_token(i);
+#endif
                 }
             }
+
+            /* one token once the responder could have sent the previous chunk */
+            if (__atomic_load_n(&r->tokens, __ATOMIC_RELAXED) < max_token &&
+                get_cycles() - r->last_token >= (uint64_t)cpu_mhz * chunk_size / rate) {
+                r->last_token = get_cycles();
+                __atomic_fetch_add(&r->tokens, 1, __ATOMIC_RELAXED);
+            }
         }
-        // nanosleep(&wait_time, NULL);
+        if (read_chunk != __atomic_load_n(&cb.sb->active_chunk_size_read, __ATOMIC_RELAXED))
+            __atomic_store_n(&cb.sb->active_chunk_size_read, read_chunk, __ATOMIC_RELAXED);
+        if (!busy)
+            usleep(READ_IDLE_US);
     }
 }
 
-void rate_limit_read()
+/* what drivers read from the shared block, as conf has it now */
+static void publish_conf(void)
 {
-    int i;
-    while (1)
-    {
-        for (i = 0; i < MAX_FLOWS; i++)
-        {
-            if (__atomic_load_n(&cb.sb->flows[i].read, __ATOMIC_RELAXED) && __atomic_load_n(&cb.sb->flows[i].pending, __ATOMIC_RELAXED))
-            {
-                fetch_token_read();
-                __atomic_store_n(&cb.sb->flows[i].pending, 0, __ATOMIC_RELAXED);
-            }
-        }
-    }
+    __atomic_store_n(&cb.sb->wqe_overhead, CONF_U32(wqe_overhead), __ATOMIC_RELAXED);
+    __atomic_store_n(&cb.sb->split_send_wr, CONF_U32(split_send_wr), __ATOMIC_RELAXED);
+    __atomic_store_n(&cb.sb->split_recv_wr, CONF_U32(split_recv_wr), __ATOMIC_RELAXED);
+    __atomic_store_n(&cb.sb->split_cqe, CONF_U32(split_cqe), __ATOMIC_RELAXED);
+}
+
+/* after a set or reload on the config socket; the threads pick up the rest
+ * of conf on their own */
+static void conf_applied(void)
+{
+    uint32_t line_rate = CONF_U32(line_rate) ? CONF_U32(line_rate) : cb.port_rate;
+
+    if (line_rate)
+        __atomic_store_n(&cb.line_rate, line_rate, __ATOMIC_RELAXED);
+    else
+        printf("config: the port's rate is unknown; line rate stays %" PRIu32 " MBps\n", cb.line_rate);
+    publish_conf();
+}
+
+static void config_handler(void *arg)
+{
+    printf("starting config_handler...\n");
+    conf_serve(*(int *)arg, conf_applied);
 }
 
 int main(int argc, char **argv)
@@ -715,10 +592,11 @@ int main(int argc, char **argv)
     /* end */
     atexit(rm_shmem_on_exit);
 
-    int fd_shm, i;
-    pthread_t th1, th2, th3;
-    //pthread_t th1, th2, th3, th4, th5;
+    int fd_shm, fd_conf, i;
+    pthread_t th1, th2, th3, th4, th5;
     struct monitor_param params;
+    struct chunk_params chunk_params;
+    const struct cc_ops *cc;
     params.num_clients = 0;
     char *endPtr;
 
@@ -747,7 +625,6 @@ int main(int argc, char **argv)
         params.server_addr = argv[2];   // for server, it is DC; type something random
         if (params.is_client) {
             params.num_servers = strtol(argv[3], &endPtr, 10);
-            assert(params.num_servers == 1);
         } else {
             params.num_clients = strtol(argv[3], &endPtr, 10);
             params.num_servers = 1;
@@ -759,7 +636,6 @@ int main(int argc, char **argv)
         params.server_addr = argv[2];   // for server, it is DC; type something random
         if (params.is_client) {
             params.num_servers = strtol(argv[3], &endPtr, 10);
-            assert(params.num_servers == 1);
         } else {
             params.num_clients = strtol(argv[3], &endPtr, 10);
             params.num_servers = 1;
@@ -768,9 +644,42 @@ int main(int argc, char **argv)
         usage();
         exit(1);
     }
-
-    /* allocate shared memory */
-    if ((fd_shm = shm_open(SHARED_MEM_NAME, O_RDWR | O_CREAT, 0666)) < 0)
+    if (params.num_servers < 1 || params.num_servers > MAX_SERVERS) {
+        printf("Number of receivers must be between 1 and %d\n", MAX_SERVERS);
+        exit(1);
+    }
+    /* operating parameters: defaults, the config file, JUSTITIA_* (conf.h) */
+    conf_defaults(&conf);
+    if (conf_load(&conf, conf_path()))
+        exit(1);
+    printf("config: %s\n", conf_path() ? conf_path() : "defaults and environment");
+    /* virtual link rate controller: cc = aimd|cubic|delay */
+    if (!(cc = cc_find(conf.cc))) {
+        printf("Unknown rate controller %s; available:\n", conf.cc);
+        for (i = 0; cc_registry[i]; i++)
+            printf("  %-8s %s\n", cc_registry[i]->name, cc_registry[i]->desc);
+        exit(1);
+    }
+    printf("virtual link rate controller: %s\n", cc->name);
+    /* line rate: line_rate_mb, or the port's active speed and width */
+    cb.port_rate = pp_port_rate_mb();
+    cb.line_rate = conf.line_rate ? conf.line_rate : cb.port_rate;
+    if (!cb.line_rate) {
+        printf("Can't tell the rate of device %" PRIu32 " port %" PRIu32 "; set line_rate_mb\n", conf.ib_dev, conf.ib_port);
+        exit(1);
+    }
+    printf("line rate: %" PRIu32 " MBps%s\n", cb.line_rate, conf.line_rate ? "" : " (from the port)");
+    conf_chunk_params(&chunk_params);
+    fd_conf = conf_listen(conf.sock_path);
+
+    /* allocate shared memory; a second pacer on the host (libsimverbs)
+     * takes its own shm_name, and its drivers JUSTITIA_SHM_NAME */
+    if (conf.shm_name[0] != '/' || strchr(conf.shm_name + 1, '/')) {
+        printf("shm_name %s: must be / and a name\n", conf.shm_name);
+        exit(1);
+    }
+    snprintf(stats_shm_name, sizeof(stats_shm_name), "%s%s", conf.shm_name, STATS_MEM_SUFFIX);
+    if ((fd_shm = shm_open(conf.shm_name, O_RDWR | O_CREAT, 0666)) < 0)
         error("shm_open");
 
     if (ftruncate(fd_shm, sizeof(struct shared_block)) < 0)
@@ -780,36 +689,69 @@ int main(int argc, char **argv)
                       PROT_WRITE | PROT_READ, MAP_SHARED, fd_shm, 0)) == MAP_FAILED)
         error("mmap");
 
+    /* telemetry segment; pacer-stat maps it read-only */
+    if ((fd_shm = shm_open(stats_shm_name, O_RDWR | O_CREAT, 0644)) < 0)
+        error("shm_open: stats");
+
+    if (ftruncate(fd_shm, sizeof(struct stats_block)) < 0)
+        error("ftruncate: stats");
+
+    if ((cb.stats = mmap(NULL, sizeof(struct stats_block),
+                         PROT_WRITE | PROT_READ, MAP_SHARED, fd_shm, 0)) == MAP_FAILED)
+        error("mmap: stats");
+
+    memset(cb.stats, 0, sizeof(struct stats_block));
+    cb.stats->num_links = params.is_client ? params.num_servers : 0;
+    cb.stats->cpu_mhz = get_cpu_mhz(1);
+    strncpy(cb.stats->cc_name, cc->name, sizeof(cb.stats->cc_name) - 1);
+    for (i = 0; i < MAX_FLOWS; i++)
+        cb.stats->pids[i] = -1;
+    for (i = 0; i < MAX_SERVERS; i++) {
+        cb.stats->token[i].chunk_size = conf.max_chunk;
+        cb.stats->token[i].split_batch = 1;
+        cb.stats->cc[i].cap = cb.stats->cc[i].shared_cap = cb.line_rate;
+    }
+    __atomic_store_n(&cb.stats->abi_version, STATS_ABI_VERSION, __ATOMIC_RELEASE);
+
     /* initialize control block */
-    cb.tokens = 0;
-    cb.tokens_read = 0;
-    cb.num_big_read_flows = 0;
     //cb.virtual_link_cap = LINE_RATE_MB;
-    cb.local_read_rate = LINE_RATE_MB;
     cb.next_slot = 0;
-    cb.sb->active_chunk_size = DEFAULT_CHUNK_SIZE;
-    cb.sb->active_chunk_size_read = DEFAULT_CHUNK_SIZE;
-    cb.sb->active_batch_ops = DEFAULT_BATCH_OPS;
-    cb.sb->virtual_link_cap = LINE_RATE_MB;
+    cb.sb->abi_version = JUSTITIA_ABI_VERSION;
+    cb.sb->active_chunk_size_read = conf.max_chunk;
+    publish_conf();
+    strcpy(cb.sb->sock_path, conf.sock_path);
     //cb.sb->num_active_split_qps = DEFAULT_NUM_SPLIT_QPS;    /* should always be 1 for now */
-#ifdef DYNAMIC_CPU_OPT
-    cb.sb->split_level = 1;        /* starts with 0 waiting interval */
-#else
-    ////cb.sb->num_active_split_qps = DEFAULT_NUM_SPLIT_QPS;
-    cb.sb->split_level = DEFAULT_SPLIT_LEVEL;        /* starts with 0 waiting interval */
-#endif
     cb.sb->num_active_big_flows = 0;
     cb.sb->num_active_small_flows = 0; /* cancel out pacer's monitor flow */
+    memset(cb.sb->flows, 0, sizeof(cb.sb->flows));
     for (i = 0; i < MAX_FLOWS; i++) {
-        cb.sb->flows[i].pending = 0;
-        cb.sb->flows[i].active = 0;
         cb.pid_list[i] = -1;
+        cb.qpn_list[i] = 0;
     }
+    memset(cb.sb->ready_map, 0, sizeof(cb.sb->ready_map));
+    memset(cb.sb->ready_map_read, 0, sizeof(cb.sb->ready_map_read));
     for (i = 0; i < MAX_SERVERS; i++) {
+        memset(&cb.vlinks[i], 0, sizeof(cb.vlinks[i]));
+        sched_init(&cb.vlinks[i].sched, SCHED_DEFAULT_QUANTUM);
+        cc_init(&cb.vlinks[i].cc, cc, cb.line_rate);
+        chunk_init(&cb.vlinks[i].chunk, &chunk_params);
+        cb.vlinks[i].chunk_size = conf.max_chunk;
+        cb.sb->vlinks[i].virtual_link_cap = cb.line_rate;
+        cb.sb->vlinks[i].active_chunk_size = conf.max_chunk;
+        cb.sb->vlinks[i].split_batch = 1;
+        cb.sb->vlinks[i].token_bytes = conf.max_chunk;
         cb.app_vaddrs[i] = 0;
         cb.num_receiver_big_flows[i] = 0;
         cb.num_receiver_small_flows[i] = 0;
     }
+    memset(cb.vlinks[0].slots, 0xff, sizeof(cb.vlinks[0].slots));     // every slot starts on link 0 (flows[].vlink == 0)
+    for (i = 0; i < MAX_READ_LINKS; i++) {
+        memset(&cb.read_links[i], 0, sizeof(cb.read_links[i]));
+        sched_init(&cb.read_links[i].sched, SCHED_DEFAULT_QUANTUM);
+        cb.read_links[i].rate = cb.line_rate;
+        cb.read_links[i].chunk_size = conf.max_chunk;
+    }
+    cb.num_read_links = 0;      // server_loop adds one per sender
 
     /* start thread handling incoming flows */
     printf("starting thread for flow handling...\n");
@@ -837,24 +779,23 @@ int main(int argc, char **argv)
 
     /* start token generating thread */
     printf("starting thread for token generating...\n");
-    if (pthread_create(&th3, NULL, (void *(*)(void *)) & generate_fetch_tokens, NULL))
+    if (pthread_create(&th3, NULL, (void *(*)(void *)) & generate_fetch_tokens, (void *)&params))
     {
         error("pthread_create: generate_fetch_tokens");
     }
 
-    /*
     printf("starting thread for token generating for read...\n");
-    if (pthread_create(&th4, NULL, (void *(*)(void *)) & generate_tokens_read, NULL))
+    if (pthread_create(&th4, NULL, (void *(*)(void *)) & generate_fetch_tokens_read, (void *)&params))
     {
-        error("pthread_create: generate_tokens_read");
+        error("pthread_create: generate_fetch_tokens_read");
     }
 
-    printf("starting thread for rate limiting big read flows...\n");
-    if (pthread_create(&th5, NULL, (void *(*)(void *)) & rate_limit_read, NULL))
+    /* config socket: get, set and reload (conf.h) */
+    printf("starting thread for the config socket...\n");
+    if (pthread_create(&th5, NULL, (void *(*)(void *)) & config_handler, (void *)&fd_conf))
     {
-        error("pthread_create: rate_limit_read");
+        error("pthread_create: config_handler");
     }
-    */
 
     /* logging thread */
     /*
@@ -16,21 +16,26 @@
 #include <time.h>
 #include <pthread.h>
 #include <signal.h>
+#include <limits.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <endian.h>
 #include "pingpong.h"
+#include "sched.h"
+#include "cc.h"
+#include "chunk.h"
+#include "stats.h"
+#include "conf.h"
 
 #define SHARED_MEM_NAME "/rdma-fairness"
 #define MAX_FLOWS 512
 #define MAX_CLIENTS 36      // clients per server
 #define MAX_SERVERS 4       // servers (receivers) per clients
-// IMPORTANT: use the correct line rate
-//#define LINE_RATE_MB 12000 /* MBps */     // 100Gbps
-//#define LINE_RATE_MB 1100 /* MBps */      // 10Gbps
-//#define LINE_RATE_MB 4400 /* MBps */      // 40Gbps
-#define LINE_RATE_MB 6000 /* MBps */        // 56Gbps
-#define MSG_LEN 24
-#define SOCK_PATH "/users/yiwenzhg/rdma_socket"
-#define ELEPHANT_HAS_LOWER_BOUND 1  /* whether elephant has a minimum virtual link cap set by AIMD */
-#define TABLE_SIZE 7
+#define JUSTITIA_ABI_VERSION 13     /* shared_block layout and control messages (pacer_msg.h); bump on any change, drivers must match */
+#define FLOW_WAIT_SPIN 0            /* driver busy-waits on "pending" */
+#define FLOW_WAIT_FUTEX 1           /* driver spins briefly, then sleeps on wake_seq */
+#define ELEPHANT_HAS_LOWER_BOUND 1  /* whether elephant has a minimum virtual link cap set by the rate controller */
+#define SPLIT_MAX_BATCH 64          /* chunks one token may cover; must match SPLIT_SGL_MAX_BATCH in the drivers' split_sgl.h */
 //#define FAVOR_BIG_FLOW
 //#define SMART_RMF
 //#define USE_TIMEFRAME
@@ -39,56 +44,138 @@
 #define DEFAULT_NUM_SPLIT_QPS 1     // Now never use more than 1 SQPs
 #define MAX_NUM_SPLIT_QPS 4         // qp = 3, 4 or above is not very helpful
 //#define CPU_FRIENDLY                //// Don't not use busy-wait checking for "pending" in shared memory. Use UDS with token enforcement.
-//#define DYNAMIC_CPU_OPT           // dymanically change shaper local busy waiting interval; similar to dynamical num split qps adjustment
-#define MAX_SPLIT_LEVEL 5           // maximum possible split level
-#define DEFAULT_SPLIT_LEVEL 2       // default split level used when DYNAMIC_CPU_OPT is OFF; Note: this is DC now; all SPLIT_LEVEL = 1
-#define MIN_SPLIT_LEVEL 2           // minimun split level when small flows are present (so always use smaller chunks in such cases)
-//#define INCAST_HACK
-#define INCAST_ACTIVE_CHUNK_SIZE 1000
-#define INCAST_SAFEUTIL 550
-#define INCAST_SPLIT_LEVEL 2
-#define TREAT_L_AS_ONE
 //#define HACK_APP_NUMS               // for easy debugging purposes
 #define HACK_NUM_BW_APP 8
 #define HACK_NUM_LAT_APP 1
 
+/* one slot per cache line, so a driver spinning on its own "pending" does not
+ * share a line with the slots the pacer is granting to */
 struct flow_info {
     uint8_t pending;
     uint8_t active;
     uint8_t read;
+    uint8_t wait_mode;              /* driver: FLOW_WAIT_SPIN or FLOW_WAIT_FUTEX */
+    uint32_t wake_seq;              /* futex word; bumped by the pacer to wake a sleeping driver */
+    uint64_t bytes_sent;            /* driver: bytes posted after a token wait */
+    uint64_t tokens_granted;        /* pacer: tokens granted to this slot */
+    uint64_t wait_cycles;           /* driver: cycles spent waiting for tokens */
+    uint32_t sleeping;              /* driver: threads that may be in FUTEX_WAIT on wake_seq */
+    uint8_t vlink;                  /* pacer: index of the receiver (virtual link) this slot sends to */
+} __attribute__((aligned(64)));
+
+/* one virtual link per receiver; what drivers sending to it should use.
+ * The chunk size, split batch and token bytes change together under
+ * cut_seq (odd while the token thread writes them), so a driver cutting a
+ * message never mixes the old and the new ones */
+struct vlink_info {
+    uint32_t virtual_link_cap;      /* MBps, after sharing the host line rate with the other links */
+    uint32_t cut_seq;
+    uint32_t active_chunk_size;
+    uint32_t split_batch;           /* split chunks one token covers; the driver posts them as one postlist, one doorbell */
+    uint32_t token_bytes;           /* link bytes one token stands for; a tput flow's credit per token */
 };
 
 struct shared_block {
-    struct flow_info flows[MAX_FLOWS];
-    uint32_t active_chunk_size;
+    uint32_t abi_version;           /* JUSTITIA_ABI_VERSION; written once by the pacer */
     uint32_t active_chunk_size_read;
-    uint32_t active_batch_ops;
-    uint32_t virtual_link_cap;
+    uint32_t wqe_overhead;          /* bytes a tput flow is charged per WQE on top of its payload */
+    uint32_t split_send_wr;         /* sizes of the drivers' split QPs and their CQs (conf.h); 0 for their own */
+    uint32_t split_recv_wr;
+    uint32_t split_cqe;
+    char sock_path[CONF_PATH_MAX];  /* the pacer's socket; drivers that find the block join here */
     //uint16_t num_active_split_qps;         /* added to dynamically change number of split qps */
     uint16_t num_active_big_flows;         /* incremented when an elephant or tput flow first sends a message */
     uint16_t num_active_small_flows;       /* incremented when a mouse first sends a message */
     uint16_t num_active_bw_flows;         /* incremented when an elephant first sends a message */
-    uint16_t split_level;
+    struct vlink_info vlinks[MAX_SERVERS];
+    /* bit i is set while flows[i] is pending; drivers set the bit after raising
+     * "pending", the pacer clears it before clearing "pending" */
+    uint64_t ready_map[MAX_FLOWS / 64] __attribute__((aligned(64)));        /* write/send flows */
+    uint64_t ready_map_read[MAX_FLOWS / 64] __attribute__((aligned(64)));   /* read flows */
+    struct flow_info flows[MAX_FLOWS];
 };
 
+/* called right after clearing "pending"; only futex-mode slots pay for the
+ * fence, which orders the clear before the check of "sleeping" (the driver
+ * does the mirror image before it goes to sleep) */
+static inline void flow_wake(struct flow_info *f)
+{
+    if (__atomic_load_n(&f->wait_mode, __ATOMIC_RELAXED) != FLOW_WAIT_FUTEX)
+        return;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&f->sleeping, __ATOMIC_RELAXED)) {
+        __atomic_fetch_add(&f->wake_seq, 1, __ATOMIC_RELEASE);
+        syscall(SYS_futex, &f->wake_seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    }
+}
+
+/* pacer-side state of one virtual link */
+struct vlink {
+    struct token_sched sched;              /* weighted (DRR) dispatch of this link's tokens across slots */
+    uint64_t slots[MAX_FLOWS / 64];        /* slots bound to this receiver; unbound slots stay on link 0 */
+    uint64_t tokens;                       /* number of available tokens */
+    uint64_t last_token;                   /* when the last token was generated, in ticks of the token clock (pace.h) */
+    struct cc_state cc;                    /* rate controller; cc.cap is in MBps, before sharing the host line rate */
+    struct chunk_state chunk;              /* chunk size controller, run by the monitor thread */
+    uint32_t chunk_size;                   /* its output, published to drivers by the token thread */
+    uint32_t cut_chunk;                    /* token thread: the chunk size last published; 0 to publish again */
+    uint32_t token_bytes;                  /* and the token bytes that went with it */
+    uint16_t num_big_flows;                /* local apps sending to this receiver: bw + tput */
+    uint16_t num_bw_flows;
+    uint16_t num_small_flows;
+    uint16_t num_remote_reads;             /* the receiver's READ apps with us as responder (info_msg) */
+    uint32_t read_rate;                    /* MBps of this link they get, and the chunk they use, */
+    uint32_t read_chunk;                   /* as last sent in a read_rate_msg */
+    uint32_t read_seq;
+};
+
+#define MAX_READ_LINKS (MAX_CLIENTS + 1)   /* one per sender, and the last for READs from anyone else */
+#define READ_IDLE_US 100                    /* read token thread: sleep while there are no READ apps */
+
+/* requester-side state of one responder: the local READ apps reading from
+ * it share the rate it gives us (read_rate_msg), tokens of one chunk each */
+struct read_link {
+    struct token_sched sched;              /* DRR across the READ slots of this responder */
+    uint64_t slots[MAX_FLOWS / 64];
+    uint64_t key;                          /* the responder's destination key; set by server_loop */
+    uint64_t tokens;
+    uint64_t last_token;
+    uint32_t rate;                         /* MBps; the line rate until the responder says otherwise */
+    uint32_t chunk_size;                   /* bytes per READ it asks for */
+    uint16_t num_reads;                    /* local READ apps reading from it */
+};
+
+#if STATS_MAX_LINKS != MAX_SERVERS || STATS_MAX_SLOTS != MAX_FLOWS
+#error "stats.h limits must match MAX_SERVERS and MAX_FLOWS"
+#endif
+
 struct control_block {
     struct shared_block *sb;
+    struct stats_block *stats;             /* telemetry segment, read by pacer-stat */
 
     //struct pingpong_context *ctx;           // used by each client
     struct pingpong_context *ctx_per_server[MAX_SERVERS];           // used by each client
     struct pingpong_context *ctx_per_client[MAX_CLIENTS];           // used by the server
-    pid_t pid_list[MAX_FLOWS];             /* used to map pid to slot; index is the slot number; treat flows from the same process as one */
-    uint64_t tokens;                       /* number of available tokens */
-    uint64_t tokens_read;
-    uint64_t app_vaddrs[MAX_SERVERS];           // used to compare and find which flow/app sends to which direction
+    pid_t pid_list[MAX_FLOWS];             /* with qpn_list, maps a flow to its slot; index is the slot number; -1 if free */
+    uint32_t qpn_list[MAX_FLOWS];          /* the flow's QP (pmsg_join.qpn), 0 for a whole process */
+    struct vlink vlinks[MAX_SERVERS];      /* one per receiver (params.num_servers of them) */
+    struct read_link read_links[MAX_READ_LINKS];    /* one per sender (params.num_clients of them), plus the last */
+    int num_read_links;
+    uint64_t app_vaddrs[MAX_SERVERS];      /* destination key of each receiver, see dest_key(); set by monitor_latency */
     //uint32_t virtual_link_cap;           /* capacity of the virtual link that elephants go through */ /* moved to sb */
-    uint32_t remote_read_rate;             /* remote read rate */
-    uint32_t local_read_rate;
+    uint32_t line_rate;                    /* MBps: conf.line_rate, or the port's when that is 0 */
+    uint32_t port_rate;                    /* MBps, from the port's active speed and width; 0 if unknown */
     uint16_t next_slot;
-    uint16_t num_big_read_flows;
     uint16_t num_receiver_big_flows[MAX_SERVERS];        // big: bw + tput; received from receiver; Note: this value also includes this sender's local big flow
     uint16_t num_receiver_small_flows[MAX_SERVERS];      // small: lat
 };
 
-extern struct control_block cb;            /* declaration */
-extern uint32_t chunk_size_table[TABLE_SIZE];
\ No newline at end of file
+/* identify a receiver by its port: the GID interface id when the link uses
+ * GRH (RoCE), the LID otherwise. Drivers compute the same key from the
+ * address vector of their QP and send it in their "app_*" message. */
+static inline uint64_t dest_key(uint16_t lid, const union ibv_gid *gid, int use_gid)
+{
+    return use_gid ? be64toh(gid->global.interface_id) : lid;
+}
+
+extern struct control_block cb;            /* declaration */
\ No newline at end of file
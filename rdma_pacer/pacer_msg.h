@@ -0,0 +1,121 @@
+// Driver <-> pacer control messages; identical copies in rdma_pacer/,
+// libmlx4/src/, libmlx5-41mlnx1/src/ and libsimverbs/src/
+//
+// Each process holds one SOCK_SEQPACKET connection to the pacer for its
+// whole life, so every message is one datagram: a pmsg_hdr followed by the
+// body of its type, all fields in host byte order (both ends are on the same
+// host). The connection carries any number of flows. A flow is an RC QP
+// (pmsg_join.qpn); the pacer gives each (pid, qpn) a slot of its own. The
+// driver adds a flow with PMSG_JOIN and gets a PMSG_JOIN_ACK carrying the
+// slot; a join the pacer turns down leaves the connection and its other
+// flows alone. Later PMSG_APP / PMSG_CLASS / PMSG_EXIT / PMSG_LEAVE name the
+// flow by that slot.
+// PMSG_CLASS moves a flow the driver classified online to another class, as
+// if it exited and came back as the new one. PMSG_LEAVE gives the slot back,
+// with an implicit exit if the flow still has a class. The RDMA READs of a
+// bw flow bring its data towards us, so the responder's pacer sets their
+// rate: the flow sends a PMSG_APP of PMSG_APP_READ once it posts its first
+// READ as bw, and a PMSG_EXIT of it once it stops being bw. Its class is
+// apart from that: the flow has one once it posts anything the responder
+// does not pace. A leave exits both. If the connection drops, the pacer
+// does the exit accounting for each of its flows itself.
+// With CPU_FRIENDLY the pacer also sends the flows' tokens on it, each a
+// PMSG_TOKEN_LEN datagram outside this framing that holds the slot (uint32_t).
+#ifndef PACER_MSG_H
+#define PACER_MSG_H
+
+#include <stdint.h>
+
+enum {
+    PMSG_JOIN = 1,                  /* driver -> pacer: struct pmsg_join */
+    PMSG_JOIN_ACK,                  /* pacer -> driver: struct pmsg_join_ack */
+    PMSG_APP,                       /* driver -> pacer: struct pmsg_app; first post of the flow */
+    PMSG_EXIT,                      /* driver -> pacer: struct pmsg_app; flow is leaving */
+    PMSG_CLASS,                     /* driver -> pacer: struct pmsg_app; flow changed class */
+    PMSG_LEAVE,                     /* driver -> pacer: struct pmsg_app; the flow's slot is free */
+};
+
+#define PMSG_TOKEN_LEN 4            /* CPU_FRIENDLY token: the slot it is for */
+
+enum {
+    PMSG_APP_BW = 0,                /* same values as the QP's isSmall (qp_context) */
+    PMSG_APP_LAT,
+    PMSG_APP_TPUT,
+    PMSG_APP_READ,                  /* the RDMA READs of a bw flow: paced at its responder's rate; never a class */
+};
+
+enum {
+    PMSG_OK = 0,
+    PMSG_EABI,                      /* abi_version differs; ack.abi_version is the pacer's */
+    PMSG_EFULL,                     /* no free slot */
+};
+
+struct pmsg_hdr {
+    uint16_t type;
+    uint16_t len;                   /* bytes of body after the header */
+    uint32_t reserved;              /* keeps the body 8-byte aligned */
+};
+
+struct pmsg_join {
+    uint32_t abi_version;           /* JUSTITIA_ABI_VERSION of the driver */
+    int32_t pid;
+    uint32_t weight;                /* DRR weight, 0 for the default */
+    uint32_t burst_kb;
+    uint64_t dest_key;              /* receiver, 0 if no QP is connected yet */
+    uint32_t qpn;                   /* the flow's QP, 0 for one flow per process */
+    uint32_t reserved;
+};
+
+struct pmsg_join_ack {
+    uint32_t abi_version;           /* JUSTITIA_ABI_VERSION of the pacer */
+    uint16_t status;                /* PMSG_OK or PMSG_E* */
+    uint8_t is_sender;
+    uint8_t vlink;
+    uint32_t slot;
+};
+
+struct pmsg_app {
+    uint64_t dest_key;
+    uint8_t app_type;               /* PMSG_APP_* */
+    uint8_t pad[3];
+    uint32_t slot;                  /* the flow, as the join ack gave it */
+};
+
+struct pmsg {
+    struct pmsg_hdr hdr;
+    union {
+        struct pmsg_join join;
+        struct pmsg_join_ack ack;
+        struct pmsg_app app;
+    };
+} __attribute__((aligned(8)));
+
+static inline void pmsg_init(struct pmsg *m, uint16_t type, uint16_t len)
+{
+    __builtin_memset(m, 0, sizeof(*m));
+    m->hdr.type = type;
+    m->hdr.len = len;
+}
+
+/* body length the receiver expects for a message type, -1 if unknown */
+static inline int pmsg_body_len(uint16_t type)
+{
+    switch (type) {
+    case PMSG_JOIN: return sizeof(struct pmsg_join);
+    case PMSG_JOIN_ACK: return sizeof(struct pmsg_join_ack);
+    case PMSG_APP:
+    case PMSG_CLASS:
+    case PMSG_EXIT:
+    case PMSG_LEAVE: return sizeof(struct pmsg_app);
+    }
+    return -1;
+}
+
+/* whether a received datagram of n bytes is a well-formed message */
+static inline int pmsg_valid(const struct pmsg *m, long n)
+{
+    return n >= (long)sizeof(struct pmsg_hdr) && pmsg_body_len(m->hdr.type) == m->hdr.len &&
+           n == (long)sizeof(struct pmsg_hdr) + m->hdr.len;
+}
+
+#endif
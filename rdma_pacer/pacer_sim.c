@@ -0,0 +1,999 @@
+// Discrete-event simulation of Justitia on a cluster of senders and
+// receivers, driven by the pacer's own control logic (pace.c), to try an
+// isolation policy without the CloudLab runs of scripts/*_exp_*.sh. No
+// RDMA hardware or pacer daemon is needed.
+//
+// Every host has one full-duplex port on a non-blocking switch, as in
+// libsimverbs (link.h): a sender's NIC goes round-robin over its QPs a
+// segment at a time, paying wqe_ns for the first segment of a WQE, and the
+// segments of all senders to a receiver queue FIFO in front of its wire.
+// Buffers are lossless, as with PFC: a sender holds a segment back while
+// what it already has queued for that receiver would take longer than
+// queue_kb on the wire to get in, and serves its other QPs meanwhile. A
+// WQE completes when the ACK of its last byte is back, one latency each way.
+//
+// Each sender with paced apps runs a pacer, with its own control block:
+//  - every ROUND_US, as monitor_latency() does, it probes each receiver it
+//    sends to with a reference WRITE, smooths the completion time with the
+//    ewma, and runs pace_round() on it;
+//  - its token thread is pace_tokens(), run whenever a driver raises
+//    "pending" and when the link's next token is due (pace_token_due());
+//  - the receivers count the apps of all their senders and broadcast them
+//    in INFO messages, at most one per INFO_WINDOW_US, as server_loop() does.
+// The drivers are modeled on libmlx4's: a bw app cuts its messages into
+// active_chunk_size chunks and posts split_batch of them per token; a tput
+// app gets token_bytes of credit per token and spends its payload plus
+// wqe_overhead per message; a lat app is not paced and sends one message
+// at a time, gap_us apart. Unpaced apps (paced=0, or pacing = 0) post
+// straight to the NIC, up to depth messages outstanding. READ apps are not
+// modeled here; read_sim covers them.
+//
+// A scenario is a file of `key = value` lines (# starts a comment), each a
+// key of the pacer's config (conf.h: tail_us, cc, max_chunk, ...) or one of
+// the simulation's:
+//   senders, receivers     hosts of each kind (sender i, receiver j)
+//   sim_ms, warmup_ms      length of the run, and of its start left out
+//   pacing                 0: no pacers at all, the baseline
+//   link_mb, wqe_ns, latency_ns, queue_kb, seg
+//                          the fabric; the pacers' line rate is link_mb
+//                          unless line_rate_mb says otherwise
+//   app = <bw|lat|tput> <senders> <receivers> [option=value ...]
+//                          senders and receivers are an index or a range
+//                          a-b; ranges of the same length pair up, and one
+//                          index goes with every one of the other side.
+//                          Options: size (bytes per message), weight,
+//                          depth (messages outstanding), n (copies),
+//                          start_ms, stop_ms, gap_us (lat) and paced.
+// scenarios/ has the incast, large_net and weight experiments, and per_qp
+// for weights given per QP. key=value arguments after the file override it.
+//
+// For each app it reports what it got in MBps and, for lat apps, the
+// p50/p99/p99.9 completion time of its WRITEs; then Jain's index over the
+// weight-normalized rates of the bw and tput apps into each receiver, and
+// what every pacer's links ended up with.
+//
+// Usage: pacer_sim <scenario> [key=value ...]
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <ctype.h>
+#include "pacer.h"
+#include "monitor.h"
+#include "pace.h"
+
+#define MAX_SENDERS MAX_CLIENTS
+#define MAX_RECEIVERS MAX_CLIENTS
+#define MAX_HOSTS (MAX_SENDERS + MAX_RECEIVERS)
+#define MAX_APPS 1024
+#define TICKS_PER_US 1000           /* the clock is in ns */
+#define ROUND_US 200                /* monitor_latency() sleeps this long between probe rounds */
+#define INFO_WINDOW_US 200          /* server_loop(): least time between INFO broadcasts */
+#define HIST_NS 10                  /* latency histogram bin */
+#define HIST_BINS 1000000
+
+#define DEFAULT_LINK_MB 6000
+#define DEFAULT_WQE_NS 60
+#define DEFAULT_LATENCY_NS 500
+#define DEFAULT_QUEUE_KB 64
+#define DEFAULT_SEG 4096
+#define DEFAULT_SIM_MS 100
+#define DEFAULT_WARMUP_MS 10
+#define DEFAULT_BW_SIZE 1000000     /* as the experiments run ib_write_bw */
+#define DEFAULT_LAT_SIZE 16
+#define DEFAULT_TPUT_SIZE 64
+#define DEFAULT_DEPTH 128           /* perftest's tx depth */
+
+enum { APP_BW, APP_LAT, APP_TPUT };
+static const char *app_kinds[] = { "bw", "lat", "tput" };
+
+enum { EV_NIC, EV_DONE, EV_START, EV_STOP, EV_POST, EV_TOKEN, EV_ROUND, EV_NOTIFY, EV_BCAST, EV_INFO };
+
+struct ev {
+    uint64_t t;                     /* ns */
+    uint64_t seq;                   /* ties go in the order the events were made */
+    int type;
+    int a, b;
+    uint32_t c;
+    uint64_t u;
+};
+
+struct wqe {
+    uint32_t bytes;
+    uint32_t left;                  /* not on the wire yet */
+    uint64_t posted;                /* ns */
+    int msg_end;                    /* the last WQE of a message */
+};
+
+struct qp {
+    int host, dst;
+    int app;                        /* -1 for a pacer's reference flow */
+    int link;                       /* reference flow: its virtual link */
+    struct wqe *ring;
+    uint32_t head, tail, size;      /* size is a power of 2 */
+};
+
+struct app {
+    int kind, sender, receiver;
+    uint32_t size, weight, depth;
+    uint64_t start_ns, stop_ns, gap_ns;
+    int paced;
+    int qp, slot, link;             /* link: the sender's virtual link to the receiver */
+    int running;
+    /* the driver */
+    uint64_t msg_left;              /* bw: bytes of the current message not cut yet */
+    uint32_t outstanding;           /* messages posted and not completed */
+    int64_t credit;                 /* tput: bytes of link time left */
+    int waiting;                    /* "pending" is raised */
+    /* after the warmup */
+    uint64_t bytes, msgs;           /* bytes that landed; messages completed */
+    uint32_t *hist;
+    uint64_t samples;
+};
+
+struct host {
+    /* NIC */
+    int *qps, nqps, rr;
+    uint64_t tx_free;               /* ns: the egress wire is busy until then */
+    uint64_t nic_at;                /* ns: the NIC looks for work then; UINT64_MAX if idle */
+    /* ingress */
+    uint64_t rx_free;
+    uint64_t in_free[MAX_HOSTS];    /* ns: what each sender has queued for us is in by then */
+    /* sender: the pacer */
+    struct control_block cb;
+    int num_links;
+    int link_host[MAX_SERVERS];     /* receiver of each virtual link */
+    int probe_qp[MAX_SERVERS];
+    uint64_t probe_start, probe_done[MAX_SERVERS];
+    int probes_left;
+    double tail_us[MAX_SERVERS], prev_tail_us[MAX_SERVERS];
+    uint16_t info_big[MAX_SERVERS], info_small[MAX_SERVERS];
+    int info_new[MAX_SERVERS];
+    uint64_t token_at[MAX_SERVERS];
+    int next_slot;
+    int slot_app[MAX_FLOWS];
+    /* receiver: server_loop's counts */
+    uint16_t num_big, num_small;
+    uint32_t pending_updates;
+    uint64_t next_bcast;            /* ns: the next INFO broadcast may go then */
+    int bcast_armed;
+};
+
+struct scenario {
+    int senders, receivers;
+    uint64_t sim_ms, warmup_ms;
+    int pacing;
+    uint32_t link_mb, wqe_ns, latency_ns, queue_kb, seg;
+};
+
+static struct scenario sc = {
+    1, 1, DEFAULT_SIM_MS, DEFAULT_WARMUP_MS, 1,
+    DEFAULT_LINK_MB, DEFAULT_WQE_NS, DEFAULT_LATENCY_NS, DEFAULT_QUEUE_KB, DEFAULT_SEG,
+};
+static struct app apps[MAX_APPS];
+static int num_apps;
+static struct host *hosts[MAX_HOSTS];
+static int num_hosts;
+static struct qp *qps;
+static int num_qps;
+static uint32_t line_rate;
+static uint64_t now, warmup_ns, end_ns, queue_ns;
+
+static struct ev *heap;
+static size_t heap_len, heap_cap;
+static uint64_t ev_seq;
+
+static void *xcalloc(size_t n, size_t size)
+{
+    void *p = calloc(n, size);
+
+    if (!p) {
+        perror("calloc");
+        exit(1);
+    }
+    return p;
+}
+
+static int ev_before(const struct ev *x, const struct ev *y)
+{
+    return x->t < y->t || (x->t == y->t && x->seq < y->seq);
+}
+
+static void push(uint64_t t, int type, int a, int b, uint32_t c, uint64_t u)
+{
+    struct ev e = { t, ev_seq++, type, a, b, c, u }, tmp;
+    size_t i;
+
+    if (heap_len == heap_cap) {
+        heap_cap = heap_cap ? heap_cap * 2 : 1024;
+        if (!(heap = realloc(heap, heap_cap * sizeof(*heap)))) {
+            perror("realloc: events");
+            exit(1);
+        }
+    }
+    heap[i = heap_len++] = e;
+    for (; i && ev_before(&heap[i], &heap[(i - 1) / 2]); i = (i - 1) / 2) {
+        tmp = heap[i];
+        heap[i] = heap[(i - 1) / 2];
+        heap[(i - 1) / 2] = tmp;
+    }
+}
+
+static struct ev pop(void)
+{
+    struct ev top = heap[0], tmp;
+    size_t i = 0, c;
+
+    heap[0] = heap[--heap_len];
+    while ((c = 2 * i + 1) < heap_len) {
+        if (c + 1 < heap_len && ev_before(&heap[c + 1], &heap[c]))
+            c++;
+        if (!ev_before(&heap[c], &heap[i]))
+            break;
+        tmp = heap[i];
+        heap[i] = heap[c];
+        heap[c] = tmp;
+        i = c;
+    }
+    return top;
+}
+
+static inline uint64_t wire_ns(uint64_t bytes)
+{
+    return bytes * 1000 / sc.link_mb;
+}
+
+/* the NIC of host h has work now, unless it is on the wire anyway */
+static void nic_kick(struct host *h, int hi)
+{
+    if (h->tx_free <= now && h->nic_at > now) {
+        h->nic_at = now;
+        push(now, EV_NIC, hi, 0, 0, 0);
+    }
+}
+
+static int add_qp(int host, int dst, int app, int link)
+{
+    struct host *h = hosts[host];
+    struct qp *q;
+
+    if (!(qps = realloc(qps, (num_qps + 1) * sizeof(*qps))) ||
+        !(h->qps = realloc(h->qps, (h->nqps + 1) * sizeof(*h->qps)))) {
+        perror("realloc: QPs");
+        exit(1);
+    }
+    q = &qps[num_qps];
+    memset(q, 0, sizeof(*q));
+    q->host = host;
+    q->dst = dst;
+    q->app = app;
+    q->link = link;
+    q->size = 64;
+    q->ring = xcalloc(q->size, sizeof(*q->ring));
+    h->qps[h->nqps++] = num_qps;
+    return num_qps++;
+}
+
+static void post(int qi, uint32_t bytes, int msg_end)
+{
+    struct qp *q = &qps[qi];
+    struct wqe *ring;
+    uint32_t i;
+
+    if (q->tail - q->head == q->size) {
+        ring = xcalloc(q->size * 2, sizeof(*ring));
+        for (i = 0; i < q->size; i++)
+            ring[i] = q->ring[(q->head + i) & (q->size - 1)];
+        free(q->ring);
+        q->ring = ring;
+        q->tail -= q->head;
+        q->head = 0;
+        q->size *= 2;
+    }
+    q->ring[q->tail++ & (q->size - 1)] = (struct wqe){ bytes, bytes, now, msg_end };
+    nic_kick(hosts[q->host], q->host);
+}
+
+/* one segment of the next QP that has one and room for it at its receiver;
+ * the NIC looks again when it is on the wire, or when room frees up */
+static void nic(int hi)
+{
+    struct host *h = hosts[hi], *r;
+    uint64_t wake = UINT64_MAX, busy, seg_ns, rx_end;
+    struct qp *q;
+    struct wqe *w;
+    uint32_t seg;
+    int k, i;
+
+    for (k = 1; k <= h->nqps; k++) {
+        i = (h->rr + k) % h->nqps;
+        q = &qps[h->qps[i]];
+        if (q->head == q->tail)
+            continue;
+        r = hosts[q->dst];
+        if (r->in_free[hi] > now + queue_ns) {
+            if (r->in_free[hi] - queue_ns < wake)
+                wake = r->in_free[hi] - queue_ns;
+            continue;
+        }
+        w = &q->ring[q->head & (q->size - 1)];
+        seg = w->left < sc.seg ? w->left : sc.seg;
+        seg_ns = wire_ns(seg);
+        busy = (w->left == w->bytes ? sc.wqe_ns : 0) + seg_ns;
+        rx_end = r->rx_free + seg_ns > now + busy ? r->rx_free + seg_ns : now + busy;
+        r->rx_free = r->in_free[hi] = rx_end;
+        if (q->app >= 0 && rx_end >= warmup_ns && rx_end < end_ns)
+            apps[q->app].bytes += seg;
+        w->left -= seg;
+        if (!w->left) {
+            push(rx_end + 2 * sc.latency_ns, EV_DONE, h->qps[i], w->msg_end, 0, w->posted);
+            q->head++;
+        }
+        h->rr = i;
+        h->tx_free = h->nic_at = now + busy;
+        push(h->nic_at, EV_NIC, hi, 0, 0, 0);
+        return;
+    }
+    h->nic_at = wake;
+    if (wake != UINT64_MAX)
+        push(wake, EV_NIC, hi, 0, 0, 0);
+}
+
+/* link d's token thread passes over it then, unless it does sooner anyway */
+static void arm_tokens(struct host *h, int hi, int d, uint64_t t)
+{
+    if (t < h->token_at[d]) {
+        h->token_at[d] = t;
+        push(t, EV_TOKEN, hi, d, 0, 0);
+    }
+}
+
+/* the driver of a paced app waits for a token */
+static void raise_pending(struct app *a)
+{
+    struct host *h = hosts[a->sender];
+
+    a->waiting = 1;
+    __atomic_store_n(&h->cb.sb->flows[a->slot].pending, 1, __ATOMIC_RELAXED);
+    sched_map_set(h->cb.sb->ready_map, a->slot);
+    arm_tokens(h, a->sender, a->link, now);
+}
+
+/* post what the app may post now */
+static void drive(struct app *a)
+{
+    if (!a->running || a->waiting)
+        return;
+    switch (a->kind) {
+    case APP_LAT:
+        if (!a->outstanding) {
+            post(a->qp, a->size, 1);
+            a->outstanding = 1;
+        }
+        break;
+    case APP_BW:
+        if (!a->paced) {
+            for (; a->outstanding < a->depth; a->outstanding++)
+                post(a->qp, a->size, 1);
+            break;
+        }
+        if (!a->msg_left) {
+            if (a->outstanding == a->depth)
+                break;
+            a->msg_left = a->size;
+            a->outstanding++;
+        }
+        raise_pending(a);
+        break;
+    case APP_TPUT:
+        for (; a->outstanding < a->depth; a->outstanding++) {
+            if (a->paced && a->credit <= 0) {
+                raise_pending(a);
+                break;
+            }
+            post(a->qp, a->size, 1);
+            a->credit -= a->size + CONF_U32(wqe_overhead);
+        }
+        break;
+    }
+}
+
+/* the pacer granted a token: cut and post what it covers */
+static void granted(struct app *a)
+{
+    struct vlink_info *vi = &hosts[a->sender]->cb.sb->vlinks[a->link];
+    uint32_t n, chunk;
+
+    a->waiting = 0;
+    if (a->kind == APP_TPUT) {
+        a->credit += vi->token_bytes;
+    } else {
+        for (n = 0; n < vi->split_batch && a->msg_left; n++) {
+            chunk = a->msg_left < vi->active_chunk_size ? a->msg_left : vi->active_chunk_size;
+            a->msg_left -= chunk;
+            post(a->qp, chunk, !a->msg_left);
+        }
+    }
+    drive(a);
+}
+
+static void tokens(int hi, int d)
+{
+    struct host *h = hosts[hi];
+    uint64_t before, due;
+    int slot;
+
+    h->token_at[d] = UINT64_MAX;
+    do {
+        before = h->cb.vlinks[d].tokens;
+        if ((slot = pace_tokens(&h->cb, d, now, TICKS_PER_US)) >= 0)
+            granted(&apps[h->slot_app[slot]]);
+    } while (slot >= 0 || h->cb.vlinks[d].tokens != before);
+    if ((due = pace_token_due(&h->cb, d, TICKS_PER_US)) != UINT64_MAX)
+        arm_tokens(h, hi, d, due > now ? due : now + 1);
+}
+
+/* server_loop(): one INFO to every sender with a link to us, at most one
+ * per window */
+static void broadcast(int ri)
+{
+    struct host *r = hosts[ri], *s;
+    int i, d;
+
+    if (!r->pending_updates)
+        return;
+    if (now < r->next_bcast) {
+        if (!r->bcast_armed) {
+            r->bcast_armed = 1;
+            push(r->next_bcast, EV_BCAST, ri, 0, 0, 0);
+        }
+        return;
+    }
+    r->next_bcast = now + INFO_WINDOW_US * 1000;
+    r->pending_updates = 0;
+    for (i = 0; i < sc.senders; i++)
+        for (s = hosts[i], d = 0; d < s->num_links; d++)
+            if (s->link_host[d] == ri)
+                push(now + sc.latency_ns, EV_INFO, i, d, (uint32_t)r->num_big << 16 | r->num_small, 0);
+}
+
+/* flow_handler's on_join and on_app, or on_exit_app (n = -1) */
+static void app_joins(struct app *a, int n)
+{
+    struct host *h = hosts[a->sender];
+    struct vlink *v = &h->cb.vlinks[a->link];
+    int d;
+
+    if (n > 0) {
+        a->slot = h->next_slot++;
+        h->slot_app[a->slot] = a - apps;
+        for (d = 0; d < h->num_links; d++)
+            sched_set_slot(&h->cb.vlinks[d].sched, a->slot, a->weight, 0);
+        sched_map_clear(h->cb.vlinks[0].slots, a->slot);
+        sched_map_set(v->slots, a->slot);
+        h->cb.sb->flows[a->slot].vlink = a->link;
+        h->cb.sb->flows[a->slot].active = 1;
+    } else {
+        h->cb.sb->flows[a->slot].active = 0;
+        h->cb.sb->flows[a->slot].pending = 0;
+        sched_map_clear(h->cb.sb->ready_map, a->slot);
+        a->waiting = 0;
+    }
+    if (a->kind == APP_LAT) {
+        v->num_small_flows += n;
+    } else {
+        v->num_big_flows += n;
+        if (a->kind == APP_BW)
+            v->num_bw_flows += n;
+    }
+    /* notify_receiver() */
+    push(now + sc.latency_ns, EV_NOTIFY, a->receiver, a->kind == APP_LAT, n > 0, 0);
+}
+
+/* monitor_latency(): post a reference WRITE on every link */
+static void probe_round(int hi)
+{
+    struct host *h = hosts[hi];
+    int d;
+
+    for (d = 0; d < h->num_links; d++) {
+        if (h->info_new[d]) {
+            h->cb.num_receiver_big_flows[d] = h->info_big[d];
+            h->cb.num_receiver_small_flows[d] = h->info_small[d];
+            h->info_new[d] = 0;
+        }
+        post(h->probe_qp[d], REF_FLOW_SIZE, 1);
+    }
+    h->probe_start = now;
+    h->probes_left = h->num_links;
+}
+
+/* the reference WRITEs are polled link by link; then the controllers run */
+static void probes_done(int hi)
+{
+    struct host *h = hosts[hi];
+    double ewma = conf_dbl(&conf.ewma);
+    uint64_t end = 0;
+    int d;
+
+    for (d = 0; d < h->num_links; d++) {
+        if (h->probe_done[d] > end)
+            end = h->probe_done[d];
+        h->tail_us[d] = ewma * (end - h->probe_start) / 1000.0 + (1 - ewma) * h->prev_tail_us[d];
+        h->prev_tail_us[d] = h->tail_us[d];
+    }
+    pace_round(&h->cb, h->num_links, h->tail_us, conf_dbl(&conf.tail_us), line_rate, now / 1000, NULL, NULL);
+    for (d = 0; d < h->num_links; d++)
+        arm_tokens(h, hi, d, now);
+    push(now + ROUND_US * 1000, EV_ROUND, hi, 0, 0, 0);
+}
+
+static void completed(const struct ev *e)
+{
+    struct qp *q = &qps[e->a];
+    struct app *a;
+    uint64_t bin;
+
+    if (q->app < 0) {
+        hosts[q->host]->probe_done[q->link] = now;
+        if (!--hosts[q->host]->probes_left)
+            probes_done(q->host);
+        return;
+    }
+    a = &apps[q->app];
+    if (!e->b)
+        return;
+    a->outstanding--;
+    if (now >= warmup_ns)
+        a->msgs++;
+    if (a->kind == APP_LAT && e->u >= warmup_ns) {
+        bin = (now - e->u) / HIST_NS;
+        a->hist[bin < HIST_BINS ? bin : HIST_BINS - 1]++;
+        a->samples++;
+    }
+    if (a->kind == APP_LAT && a->gap_ns)
+        push(now + a->gap_ns, EV_POST, q->app, 0, 0, 0);
+    else
+        drive(a);
+}
+
+static void run(void)
+{
+    struct ev e;
+    struct host *r;
+
+    while (heap_len && heap[0].t < end_ns) {
+        e = pop();
+        now = e.t;
+        switch (e.type) {
+        case EV_NIC:
+            if (hosts[e.a]->nic_at == now) {
+                hosts[e.a]->nic_at = UINT64_MAX;
+                nic(e.a);
+            }
+            break;
+        case EV_DONE:
+            completed(&e);
+            break;
+        case EV_START:
+            apps[e.a].running = 1;
+            if (apps[e.a].paced)
+                app_joins(&apps[e.a], 1);
+            drive(&apps[e.a]);
+            break;
+        case EV_STOP:
+            apps[e.a].running = 0;
+            if (apps[e.a].paced)
+                app_joins(&apps[e.a], -1);
+            break;
+        case EV_POST:
+            drive(&apps[e.a]);
+            break;
+        case EV_TOKEN:
+            if (hosts[e.a]->token_at[e.b] == now)
+                tokens(e.a, e.b);
+            break;
+        case EV_ROUND:
+            probe_round(e.a);
+            break;
+        case EV_NOTIFY:
+            r = hosts[e.a];
+            if (e.b)
+                r->num_small += e.c ? 1 : -1;
+            else
+                r->num_big += e.c ? 1 : -1;
+            r->pending_updates++;
+            broadcast(e.a);
+            break;
+        case EV_BCAST:
+            hosts[e.a]->bcast_armed = 0;
+            broadcast(e.a);
+            break;
+        case EV_INFO:
+            hosts[e.a]->info_big[e.b] = e.c >> 16;
+            hosts[e.a]->info_small[e.b] = e.c & 0xffff;
+            hosts[e.a]->info_new[e.b] = 1;
+            break;
+        }
+    }
+}
+
+/* pacer.c's main(): a control block as the pacer starts with */
+static void pacer_init(struct host *h, const struct cc_ops *cc)
+{
+    struct control_block *cb = &h->cb;
+    struct chunk_params chunk_params;
+    int i;
+
+    conf_chunk_params(&chunk_params);
+    cb->sb = xcalloc(1, sizeof(*cb->sb));
+    cb->stats = xcalloc(1, sizeof(*cb->stats));
+    cb->line_rate = cb->port_rate = line_rate;
+    cb->sb->active_chunk_size_read = conf.max_chunk;
+    cb->stats->num_links = h->num_links;
+    for (i = 0; i < MAX_SERVERS; i++) {
+        cb->stats->token[i].chunk_size = conf.max_chunk;
+        cb->stats->token[i].split_batch = 1;
+        cb->stats->cc[i].cap = cb->stats->cc[i].shared_cap = line_rate;
+        sched_init(&cb->vlinks[i].sched, SCHED_DEFAULT_QUANTUM);
+        cc_init(&cb->vlinks[i].cc, cc, line_rate);
+        chunk_init(&cb->vlinks[i].chunk, &chunk_params);
+        cb->vlinks[i].chunk_size = conf.max_chunk;
+        cb->sb->vlinks[i].virtual_link_cap = line_rate;
+        cb->sb->vlinks[i].active_chunk_size = conf.max_chunk;
+        cb->sb->vlinks[i].split_batch = 1;
+        cb->sb->vlinks[i].token_bytes = conf.max_chunk;
+        h->token_at[i] = UINT64_MAX;
+    }
+    memset(cb->vlinks[0].slots, 0xff, sizeof(cb->vlinks[0].slots));     // every slot starts on link 0
+    pace_tokens_init(cb, h->num_links, 0);
+}
+
+static char *trim(char *s)
+{
+    char *e;
+
+    while (isspace((unsigned char)*s))
+        s++;
+    e = s + strlen(s);
+    while (e > s && isspace((unsigned char)e[-1]))
+        *--e = '\0';
+    return s;
+}
+
+/* "i" or "a-b"; hosts [*lo, *hi] */
+static int parse_range(const char *s, int *lo, int *hi)
+{
+    char *end;
+
+    *lo = *hi = strtol(s, &end, 10);
+    if (*end == '-')
+        *hi = strtol(end + 1, &end, 10);
+    return end == s || *end || *lo < 0 || *hi < *lo ? -1 : 0;
+}
+
+static int parse_app(char *line, char *err, int errlen)
+{
+    char *kind, *snd, *rcv, *opt, *val, *save;
+    int s_lo, s_hi, r_lo, r_hi, ns, nr, copies = 1, i, j;
+    struct app a;
+
+    memset(&a, 0, sizeof(a));
+    kind = strtok_r(line, " \t", &save);
+    snd = strtok_r(NULL, " \t", &save);
+    rcv = strtok_r(NULL, " \t", &save);
+    if (!rcv || parse_range(snd, &s_lo, &s_hi) || parse_range(rcv, &r_lo, &r_hi)) {
+        snprintf(err, errlen, "expected app = <bw|lat|tput> <senders> <receivers> [option=value ...]");
+        return -1;
+    }
+    for (a.kind = 0; a.kind < 3 && strcmp(kind, app_kinds[a.kind]); a.kind++)
+        ;
+    if (a.kind == 3) {
+        snprintf(err, errlen, "unknown app kind %s", kind);
+        return -1;
+    }
+    a.size = a.kind == APP_BW ? DEFAULT_BW_SIZE : a.kind == APP_LAT ? DEFAULT_LAT_SIZE : DEFAULT_TPUT_SIZE;
+    a.weight = SCHED_DEFAULT_WEIGHT;
+    a.depth = DEFAULT_DEPTH;
+    a.stop_ns = UINT64_MAX;
+    a.paced = 1;
+    while ((opt = strtok_r(NULL, " \t", &save))) {
+        if (!(val = strchr(opt, '='))) {
+            snprintf(err, errlen, "app option %s: expected option=value", opt);
+            return -1;
+        }
+        *val++ = '\0';
+        if (!strcmp(opt, "size"))
+            a.size = atoi(val);
+        else if (!strcmp(opt, "weight"))
+            a.weight = atoi(val);
+        else if (!strcmp(opt, "depth"))
+            a.depth = atoi(val);
+        else if (!strcmp(opt, "n"))
+            copies = atoi(val);
+        else if (!strcmp(opt, "start_ms"))
+            a.start_ns = atof(val) * 1000000;
+        else if (!strcmp(opt, "stop_ms"))
+            a.stop_ns = atof(val) * 1000000;
+        else if (!strcmp(opt, "gap_us"))
+            a.gap_ns = atof(val) * 1000;
+        else if (!strcmp(opt, "paced"))
+            a.paced = atoi(val);
+        else {
+            snprintf(err, errlen, "unknown app option %s", opt);
+            return -1;
+        }
+    }
+    if (!a.size || !a.depth || a.weight < 1 || a.weight > SCHED_MAX_WEIGHT) {
+        snprintf(err, errlen, "app: size and depth must be > 0, weight 1 to %d", SCHED_MAX_WEIGHT);
+        return -1;
+    }
+    ns = s_hi - s_lo + 1;
+    nr = r_hi - r_lo + 1;
+    if (ns != nr && ns != 1 && nr != 1) {
+        snprintf(err, errlen, "app: %d senders and %d receivers don't pair up", ns, nr);
+        return -1;
+    }
+    for (i = 0; i < (ns > nr ? ns : nr); i++) {
+        for (j = 0; j < copies; j++) {
+            if (num_apps == MAX_APPS) {
+                snprintf(err, errlen, "more than %d apps", MAX_APPS);
+                return -1;
+            }
+            a.sender = s_lo + (ns > 1 ? i : 0);
+            a.receiver = r_lo + (nr > 1 ? i : 0);
+            apps[num_apps++] = a;
+        }
+    }
+    return 0;
+}
+
+/* a key of the scenario's, or of the pacer's config */
+static int scenario_set(char *key, char *value, char *err, int errlen)
+{
+    if (!strcmp(key, "app"))
+        return parse_app(value, err, errlen);
+    if (!strcmp(key, "senders"))
+        sc.senders = atoi(value);
+    else if (!strcmp(key, "receivers"))
+        sc.receivers = atoi(value);
+    else if (!strcmp(key, "sim_ms"))
+        sc.sim_ms = atoi(value);
+    else if (!strcmp(key, "warmup_ms"))
+        sc.warmup_ms = atoi(value);
+    else if (!strcmp(key, "pacing"))
+        sc.pacing = atoi(value);
+    else if (!strcmp(key, "link_mb"))
+        sc.link_mb = atoi(value);
+    else if (!strcmp(key, "wqe_ns"))
+        sc.wqe_ns = atoi(value);
+    else if (!strcmp(key, "latency_ns"))
+        sc.latency_ns = atoi(value);
+    else if (!strcmp(key, "queue_kb"))
+        sc.queue_kb = atoi(value);
+    else if (!strcmp(key, "seg"))
+        sc.seg = atoi(value);
+    else
+        return conf_set(&conf, key, value, 0, err, errlen);
+    return 0;
+}
+
+static int load(const char *path)
+{
+    char line[CONF_LINE_MAX], err[128], *key, *value, *eq;
+    FILE *f;
+    int n = 0;
+
+    if (!(f = fopen(path, "r"))) {
+        perror(path);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        n++;
+        if ((eq = strchr(line, '#')))
+            *eq = '\0';
+        key = trim(line);
+        if (!*key)
+            continue;
+        if (!(eq = strchr(key, '='))) {
+            printf("%s:%d: expected key = value\n", path, n);
+            fclose(f);
+            return -1;
+        }
+        *eq = '\0';
+        key = trim(key);
+        value = trim(eq + 1);
+        if (scenario_set(key, value, err, sizeof(err))) {
+            printf("%s:%d: %s\n", path, n, err);
+            fclose(f);
+            return -1;
+        }
+    }
+    fclose(f);
+    return 0;
+}
+
+/* hosts, QPs and pacers for the apps */
+static void setup(void)
+{
+    const struct cc_ops *cc = cc_find(conf.cc);
+    struct app *a;
+    struct host *h;
+    int i, d;
+
+    if (!cc) {
+        printf("Unknown rate controller %s\n", conf.cc);
+        exit(1);
+    }
+    if (sc.senders < 1 || sc.senders > MAX_SENDERS || sc.receivers < 1 || sc.receivers > MAX_RECEIVERS) {
+        printf("1 to %d senders and 1 to %d receivers\n", MAX_SENDERS, MAX_RECEIVERS);
+        exit(1);
+    }
+    if (!sc.link_mb || !sc.seg || sc.warmup_ms >= sc.sim_ms) {
+        printf("link_mb and seg must be > 0, warmup_ms less than sim_ms\n");
+        exit(1);
+    }
+    line_rate = conf.line_rate ? conf.line_rate : sc.link_mb;
+    num_hosts = sc.senders + sc.receivers;
+    for (i = 0; i < num_hosts; i++) {
+        hosts[i] = xcalloc(1, sizeof(struct host));
+        hosts[i]->nic_at = UINT64_MAX;
+    }
+    for (i = 0; i < num_apps; i++) {
+        a = &apps[i];
+        if (a->sender >= sc.senders || a->receiver >= sc.receivers) {
+            printf("app %d: sender %d or receiver %d is not in the scenario\n", i, a->sender, a->receiver);
+            exit(1);
+        }
+        a->receiver += sc.senders;
+        a->paced = a->paced && sc.pacing;
+        a->qp = add_qp(a->sender, a->receiver, i, 0);
+        if (a->kind == APP_LAT)
+            a->hist = xcalloc(HIST_BINS, sizeof(*a->hist));
+        if (!a->paced)
+            continue;
+        /* the receivers on the pacer's command line */
+        h = hosts[a->sender];
+        for (d = 0; d < h->num_links && h->link_host[d] != a->receiver; d++)
+            ;
+        if (d == h->num_links) {
+            if (d == MAX_SERVERS) {
+                printf("sender %d: paced apps to more than %d receivers\n", a->sender, MAX_SERVERS);
+                exit(1);
+            }
+            h->link_host[h->num_links++] = a->receiver;
+        }
+        a->link = d;
+        if (h->next_slot++ == MAX_FLOWS) {
+            printf("sender %d: more than %d paced apps\n", a->sender, MAX_FLOWS);
+            exit(1);
+        }
+    }
+    for (i = 0; i < sc.senders; i++) {
+        h = hosts[i];
+        if (!h->num_links)
+            continue;
+        h->next_slot = 0;
+        pacer_init(h, cc);
+        for (d = 0; d < h->num_links; d++)
+            h->probe_qp[d] = add_qp(i, h->link_host[d], -1, d);
+        push(ROUND_US * 1000, EV_ROUND, i, 0, 0, 0);
+    }
+    for (i = 0; i < num_apps; i++) {
+        push(apps[i].start_ns, EV_START, i, 0, 0, 0);
+        if (apps[i].stop_ns != UINT64_MAX)
+            push(apps[i].stop_ns, EV_STOP, i, 0, 0, 0);
+    }
+}
+
+static double quantile(const struct app *a, double q)
+{
+    uint64_t n = 0, want = q * (a->samples - 1);
+    int i;
+
+    for (i = 0; i < HIST_BINS; i++)
+        if ((n += a->hist[i]) > want)
+            return (double)i * HIST_NS / 1000;
+    return (double)HIST_BINS * HIST_NS / 1000;
+}
+
+static double mbps(const struct app *a)
+{
+    return (double)a->bytes * 1000 / (end_ns - warmup_ns);
+}
+
+/* Jain's index over the weight-normalized rates of the bw and tput apps
+ * into receiver ri (all receivers if ri < 0); 0 if there are none */
+static double jain(int ri, int *n)
+{
+    double x, sum = 0, sq = 0;
+    int i;
+
+    *n = 0;
+    for (i = 0; i < num_apps; i++) {
+        if (apps[i].kind == APP_LAT || (ri >= 0 && apps[i].receiver != ri))
+            continue;
+        x = mbps(&apps[i]) / apps[i].weight;
+        sum += x;
+        sq += x * x;
+        (*n)++;
+    }
+    return sq ? sum * sum / (*n * sq) : 0;
+}
+
+static void report(const char *path)
+{
+    struct control_block *cb;
+    struct app *a;
+    double total;
+    int i, d, n;
+
+    printf("%s: %d senders, %d receivers, %" PRIu64 " ms (first %" PRIu64 " left out), pacing %s",
+           path, sc.senders, sc.receivers, sc.sim_ms, sc.warmup_ms, sc.pacing ? "on" : "off");
+    if (sc.pacing)
+        printf(" (%s, target %.1f us, line rate %" PRIu32 " MBps)", conf.cc, conf_dbl(&conf.tail_us), line_rate);
+    printf("\n%-4s %-5s %6s %8s %6s %6s %9s %9s %9s %9s %9s\n",
+           "app", "kind", "sender", "receiver", "weight", "paced", "MBps", "msgs", "p50_us", "p99_us", "p99.9_us");
+    for (i = 0; i < num_apps; i++) {
+        a = &apps[i];
+        printf("%-4d %-5s %6d %8d %6" PRIu32 " %6s %9.1f %9" PRIu64, i, app_kinds[a->kind], a->sender,
+               a->receiver - sc.senders, a->weight, a->paced ? "yes" : "no", mbps(a), a->msgs);
+        if (a->kind == APP_LAT && a->samples)
+            printf(" %9.2f %9.2f %9.2f", quantile(a, 0.5), quantile(a, 0.99), quantile(a, 0.999));
+        printf("\n");
+    }
+    for (d = sc.senders; d < num_hosts; d++) {
+        for (total = 0, i = 0; i < num_apps; i++)
+            if (apps[i].receiver == d)
+                total += mbps(&apps[i]);
+        if (!total)
+            continue;
+        printf("receiver %d: %.1f MBps", d - sc.senders, total);
+        if (jain(d, &n) && n > 1)
+            printf(", Jain's index %.4f over %d bw/tput apps", jain(d, &n), n);
+        printf("\n");
+    }
+    if (jain(-1, &n) && n > 1)
+        printf("all receivers: Jain's index %.4f over %d bw/tput apps\n", jain(-1, &n), n);
+    for (i = 0; i < sc.senders; i++) {
+        cb = &hosts[i]->cb;
+        for (d = 0; d < hosts[i]->num_links; d++)
+            printf("sender %d link %d (receiver %d): cap %" PRIu32 " MBps, chunk %" PRIu32 " B x %" PRIu32
+                   ", tail %.2f us, %" PRIu64 " tokens\n", i, d, hosts[i]->link_host[d] - sc.senders,
+                   cb->sb->vlinks[d].virtual_link_cap, cb->sb->vlinks[d].active_chunk_size,
+                   cb->sb->vlinks[d].split_batch, hosts[i]->tail_us[d], cb->stats->token[d].tokens_generated);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    char err[128], *eq;
+    int i;
+
+    if (argc < 2) {
+        printf("Usage: %s <scenario> [key=value ...]\n", argv[0]);
+        return 1;
+    }
+    conf_defaults(&conf);
+    if (load(argv[1]))
+        return 1;
+    for (i = 2; i < argc; i++) {
+        if (!(eq = strchr(argv[i], '='))) {
+            printf("%s: expected key=value\n", argv[i]);
+            return 1;
+        }
+        *eq = '\0';
+        if (scenario_set(argv[i], eq + 1, err, sizeof(err))) {
+            printf("%s: %s\n", argv[i], err);
+            return 1;
+        }
+    }
+    warmup_ns = sc.warmup_ms * 1000000;
+    end_ns = sc.sim_ms * 1000000;
+    queue_ns = wire_ns((uint64_t)sc.queue_kb * 1024);
+    setup();
+    run();
+    report(argv[1]);
+    return 0;
+}
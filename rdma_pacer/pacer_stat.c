@@ -0,0 +1,239 @@
+// pacer-stat: dump the pacer's telemetry as JSON or Prometheus text.
+// Maps the stats segment and the flow table read-only and never writes to
+// them, so sampling does not disturb the token thread beyond the cache
+// misses of the reads themselves.
+//
+// Usage: pacer-stat [-f json|prom] [-i interval_ms] [-n samples] [-H] [-s shm_name]
+//   -n 0 samples forever; -H adds the virtual link cap history (JSON only);
+//   -s reads the pacer started with that shm_name (conf.h)
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "pacer.h"
+
+#define SEQ_RETRIES 100
+
+enum { FMT_JSON, FMT_PROM };
+
+static void *map_ro(const char *name, size_t len)
+{
+    void *p;
+    int fd = shm_open(name, O_RDONLY, 0);
+
+    if (fd < 0) {
+        fprintf(stderr, "shm_open %s: is the pacer running? ", name);
+        perror("");
+        exit(1);
+    }
+    p = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    return p;
+}
+
+static int read_cc(const struct stats_block *st, int link, struct stats_cc *out)
+{
+    int n;
+    for (n = 0; n < SEQ_RETRIES; n++)
+        if (stats_read(&st->cc[link].seq, out, &st->cc[link], sizeof(*out)))
+            return 1;
+    return 0;
+}
+
+static int read_hist(const struct stats_block *st, uint64_t idx, struct stats_hist_entry *out)
+{
+    const struct stats_hist_entry *e = &st->hist[idx % STATS_HIST_LEN];
+    int n;
+    for (n = 0; n < SEQ_RETRIES; n++)
+        if (stats_read(&e->seq, out, e, sizeof(*out)))
+            return 1;
+    return 0;
+}
+
+static uint64_t wall_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static void dump_json(const struct stats_block *st, const struct shared_block *sb, int hist, uint64_t *hist_next)
+{
+    struct stats_cc c;
+    struct stats_hist_entry e;
+    const struct flow_info *f;
+    uint64_t head, i;
+    int l, s, first = 1;
+
+    printf("{\"ts_ms\":%" PRIu64 ",\"cc\":\"%s\",\"links\":[", wall_ms(), st->cc_name);
+    for (l = 0; l < (int)st->num_links; l++) {
+        const struct stats_token *t = &st->token[l];
+        if (!read_cc(st, l, &c))
+            memset(&c, 0, sizeof(c));
+        printf("%s{\"link\":%d,\"cap_mbps\":%u,\"shared_cap_mbps\":%u,\"tail_us\":%.3f,"
+               "\"rounds\":%" PRIu64 ",\"increases\":%" PRIu64 ",\"decreases\":%" PRIu64 ","
+               "\"tokens_generated\":%" PRIu64 ",\"tokens_granted\":%" PRIu64 ","
+               "\"chunk_size\":%u,\"chunk_changes\":%u,\"split_batch\":%u}", l ? "," : "", l,
+               c.cap, c.shared_cap, c.tail_ns / 1000.0, c.rounds, c.increases, c.decreases,
+               __atomic_load_n(&t->tokens_generated, __ATOMIC_RELAXED),
+               __atomic_load_n(&t->tokens_granted, __ATOMIC_RELAXED),
+               __atomic_load_n(&t->chunk_size, __ATOMIC_RELAXED),
+               __atomic_load_n(&t->chunk_changes, __ATOMIC_RELAXED),
+               __atomic_load_n(&t->split_batch, __ATOMIC_RELAXED));
+    }
+    printf("],\"slots\":[");
+    for (s = 0; s < MAX_FLOWS; s++) {
+        int32_t pid = __atomic_load_n(&st->pids[s], __ATOMIC_RELAXED);
+        if (pid == -1)
+            continue;
+        f = &sb->flows[s];
+        printf("%s{\"slot\":%d,\"pid\":%d,\"qpn\":%u,\"link\":%u,\"active\":%u,\"tokens_granted\":%" PRIu64 ","
+               "\"bytes_sent\":%" PRIu64 ",\"wait_s\":%.6f}", first ? "" : ",", s, pid,
+               __atomic_load_n(&st->qpns[s], __ATOMIC_RELAXED),
+               __atomic_load_n(&f->vlink, __ATOMIC_RELAXED),
+               __atomic_load_n(&f->active, __ATOMIC_RELAXED),
+               __atomic_load_n(&f->tokens_granted, __ATOMIC_RELAXED),
+               __atomic_load_n(&f->bytes_sent, __ATOMIC_RELAXED),
+               __atomic_load_n(&f->wait_cycles, __ATOMIC_RELAXED) / (st->cpu_mhz * 1e6));
+        first = 0;
+    }
+    printf("]");
+    if (hist) {
+        head = __atomic_load_n(&st->hist_head, __ATOMIC_ACQUIRE);
+        i = *hist_next;
+        if (head - i > STATS_HIST_LEN)
+            i = head - STATS_HIST_LEN;          // overwritten before we got to them
+        printf(",\"cap_history\":[");
+        for (first = 1; i < head; i++) {
+            if (!read_hist(st, i, &e))
+                continue;
+            printf("%s[%" PRIu64 ",%u,%u,%.3f]", first ? "" : ",", e.now_us, e.link, e.shared_cap, e.tail_ns / 1000.0);
+            first = 0;
+        }
+        printf("]");
+        *hist_next = head;
+    }
+    printf("}\n");
+}
+
+static void prom_head(const char *name, const char *type, const char *help)
+{
+    printf("# HELP justitia_%s %s\n# TYPE justitia_%s %s\n", name, help, name, type);
+}
+
+static void dump_prom(const struct stats_block *st, const struct shared_block *sb)
+{
+    struct stats_cc c[STATS_MAX_LINKS];
+    int l, s, n = st->num_links;
+
+    for (l = 0; l < n; l++)
+        if (!read_cc(st, l, &c[l]))
+            memset(&c[l], 0, sizeof(c[l]));
+
+#define PROM_LINKS(name, type, help, fmt, expr) do {                            \
+        prom_head(name, type, help);                                            \
+        for (l = 0; l < n; l++)                                                 \
+            printf("justitia_%s{link=\"%d\",cc=\"%s\"} " fmt "\n", name, l, st->cc_name, expr); \
+    } while (0)
+    PROM_LINKS("link_cap_mbps", "gauge", "Rate controller output.", "%u", c[l].cap);
+    PROM_LINKS("link_shared_cap_mbps", "gauge", "Virtual link cap after sharing the line rate.", "%u", c[l].shared_cap);
+    PROM_LINKS("link_tail_latency_us", "gauge", "Reference flow latency seen by the controller.", "%.3f", c[l].tail_ns / 1000.0);
+    PROM_LINKS("link_cc_rounds_total", "counter", "Controller rounds.", "%" PRIu64, c[l].rounds);
+    PROM_LINKS("link_cap_increases_total", "counter", "Rounds that raised the cap.", "%" PRIu64, c[l].increases);
+    PROM_LINKS("link_cap_decreases_total", "counter", "Rounds that lowered the cap.", "%" PRIu64, c[l].decreases);
+    PROM_LINKS("link_tokens_generated_total", "counter", "Tokens generated.", "%" PRIu64,
+               __atomic_load_n(&st->token[l].tokens_generated, __ATOMIC_RELAXED));
+    PROM_LINKS("link_tokens_granted_total", "counter", "Tokens granted to slots.", "%" PRIu64,
+               __atomic_load_n(&st->token[l].tokens_granted, __ATOMIC_RELAXED));
+    PROM_LINKS("link_chunk_size_bytes", "gauge", "Active chunk size.", "%u",
+               __atomic_load_n(&st->token[l].chunk_size, __ATOMIC_RELAXED));
+    PROM_LINKS("link_chunk_size_changes_total", "counter", "Chunk size changes.", "%u",
+               __atomic_load_n(&st->token[l].chunk_changes, __ATOMIC_RELAXED));
+    PROM_LINKS("link_split_batch", "gauge", "Split chunks one token covers.", "%u",
+               __atomic_load_n(&st->token[l].split_batch, __ATOMIC_RELAXED));
+#undef PROM_LINKS
+
+#define PROM_SLOTS(name, type, help, fmt, expr) do {                            \
+        prom_head(name, type, help);                                            \
+        for (s = 0; s < MAX_FLOWS; s++) {                                       \
+            const struct flow_info *f = &sb->flows[s];                          \
+            int32_t pid = __atomic_load_n(&st->pids[s], __ATOMIC_RELAXED);      \
+            if (pid != -1)                                                      \
+                printf("justitia_%s{slot=\"%d\",pid=\"%d\",qpn=\"%u\",link=\"%u\"} " fmt "\n", \
+                       name, s, pid, __atomic_load_n(&st->qpns[s], __ATOMIC_RELAXED), \
+                       __atomic_load_n(&f->vlink, __ATOMIC_RELAXED), expr);     \
+        }                                                                       \
+    } while (0)
+    PROM_SLOTS("slot_active", "gauge", "Whether the slot's flow is registered.", "%u",
+               __atomic_load_n(&f->active, __ATOMIC_RELAXED));
+    PROM_SLOTS("slot_tokens_granted_total", "counter", "Tokens granted to the slot.", "%" PRIu64,
+               __atomic_load_n(&f->tokens_granted, __ATOMIC_RELAXED));
+    PROM_SLOTS("slot_bytes_sent_total", "counter", "Bytes the slot's driver posted.", "%" PRIu64,
+               __atomic_load_n(&f->bytes_sent, __ATOMIC_RELAXED));
+    PROM_SLOTS("slot_token_wait_seconds_total", "counter", "Time the slot's driver waited for tokens.", "%.6f",
+               __atomic_load_n(&f->wait_cycles, __ATOMIC_RELAXED) / (st->cpu_mhz * 1e6));
+#undef PROM_SLOTS
+}
+
+int main(int argc, char **argv)
+{
+    const struct stats_block *st;
+    const struct shared_block *sb;
+    int fmt = FMT_JSON, hist = 0, interval_ms = 1000, c;
+    long n = 1, k;
+    uint64_t hist_next = 0;
+    const char *shm_name = SHARED_MEM_NAME;
+    char stats_name[256];
+
+    while ((c = getopt(argc, argv, "f:i:n:Hs:")) != -1) {
+        switch (c) {
+        case 'f':
+            if (strcmp(optarg, "json") == 0) {
+                fmt = FMT_JSON;
+            } else if (strcmp(optarg, "prom") == 0) {
+                fmt = FMT_PROM;
+            } else {
+                fprintf(stderr, "unknown format %s (json or prom)\n", optarg);
+                return 1;
+            }
+            break;
+        case 'i': interval_ms = atoi(optarg); break;
+        case 'n': n = atol(optarg); break;
+        case 'H': hist = 1; break;
+        case 's': shm_name = optarg; break;
+        default:
+            fprintf(stderr, "usage: %s [-f json|prom] [-i interval_ms] [-n samples] [-H] [-s shm_name]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    snprintf(stats_name, sizeof(stats_name), "%s%s", shm_name, STATS_MEM_SUFFIX);
+    st = map_ro(stats_name, sizeof(struct stats_block));
+    sb = map_ro(shm_name, sizeof(struct shared_block));
+    if (__atomic_load_n(&st->abi_version, __ATOMIC_ACQUIRE) != STATS_ABI_VERSION ||
+        sb->abi_version != JUSTITIA_ABI_VERSION) {
+        fprintf(stderr, "pacer telemetry version %u / layout %u, expected %u / %u; rebuild pacer-stat with the pacer\n",
+                st->abi_version, sb->abi_version, STATS_ABI_VERSION, JUSTITIA_ABI_VERSION);
+        return 1;
+    }
+
+    for (k = 0; n == 0 || k < n; k++) {
+        if (k)
+            usleep(interval_ms * 1000);
+        if (fmt == FMT_JSON)
+            dump_json(st, sb, hist, &hist_next);
+        else
+            dump_prom(st, sb);
+        fflush(stdout);
+    }
+    return 0;
+}
@@ -1,18 +1,17 @@
 #include "pingpong.h"
+#include "conf.h"
 
 static const int port = 18515;
-static const int ib_port = 1;
 static const int mtu = IBV_MTU_2048;
-static const int ib_dev_idx = 0;
-//static const int ib_dev_idx = 1;
-//static const int ib_dev_idx = 2;  // used in xl170
+static const int port_rate_pct = 88;    /* of the signaling rate the pacer may hand out: 4400 MBps at 40 Gbps */
 
 static struct pingpong_context * alloc_monitor_qp();
 static void pp_client_exch_dest(struct pingpong_context *, const char *, struct pingpong_dest *);
 static void pp_server_exch_dest(struct pingpong_context *, const struct pingpong_dest *, int);
 static int pp_connect_ctx(struct pingpong_context *, int, struct pingpong_dest *, int);
 
-struct pingpong_context *init_monitor_chan(struct monitor_param *params){
+// server_addr: the receiver to connect to (client only; ignored by the server)
+struct pingpong_context *init_monitor_chan(struct monitor_param *params, const char *server_addr){
     struct pingpong_context *ctx;
     struct pingpong_dest my_dest;
 
@@ -20,7 +19,7 @@ struct pingpong_context *init_monitor_chan(struct monitor_param *params){
     if (!ctx)
         return NULL;
     
-    if (pp_get_port_info(ctx->context, ib_port, &ctx->portinfo)) {
+    if (pp_get_port_info(ctx->context, conf.ib_port, &ctx->portinfo)) {
         fprintf(stderr, "Coundln't get port info\n");
         return NULL;
     }
@@ -28,7 +27,7 @@ struct pingpong_context *init_monitor_chan(struct monitor_param *params){
     //printf("%d", isclient);
     my_dest.lid = ctx->portinfo.lid;
     if (params->gid_idx >= 0) {
-		if (ibv_query_gid(ctx->context, ib_port, params->gid_idx, &my_dest.gid)) {
+		if (ibv_query_gid(ctx->context, conf.ib_port, params->gid_idx, &my_dest.gid)) {
 			fprintf(stderr, "Could not get local gid for gid index %d\n", params->gid_idx);
 			return NULL;
 		}
@@ -43,7 +42,7 @@ struct pingpong_context *init_monitor_chan(struct monitor_param *params){
     my_dest.vaddr = (uintptr_t)ctx->write_buf;
 
     if (params->is_client)
-        pp_client_exch_dest(ctx, params->server_addr, &my_dest);
+        pp_client_exch_dest(ctx, server_addr, &my_dest);
     else {
         pp_server_exch_dest(ctx, &my_dest, params->gid_idx);
     }
@@ -60,6 +59,61 @@ struct pingpong_context *init_monitor_chan(struct monitor_param *params){
     return ctx;
 }
 
+/* the ib_dev'th device; NULL if there are not that many */
+static struct ibv_device *pp_find_device(struct ibv_device **dev_list)
+{
+    uint32_t i;
+
+    for (i = 0; dev_list[i] && i < conf.ib_dev; i++)
+        ;
+    return dev_list[i];
+}
+
+/* MBps the pacer may hand out on the configured port, from its active speed
+ * and width: port_rate_pct of the lanes' signaling rate. 0 if the port
+ * cannot be queried or reports a speed we don't know */
+uint32_t pp_port_rate_mb(void)
+{
+    struct ibv_device **dev_list;
+    struct ibv_device *ib_dev;
+    struct ibv_context *context;
+    struct ibv_port_attr attr;
+    double lane_gbps;
+    int lanes, ret;
+
+    if (!(dev_list = ibv_get_device_list(NULL)))
+        return 0;
+    ib_dev = pp_find_device(dev_list);
+    context = ib_dev ? ibv_open_device(ib_dev) : NULL;
+    ibv_free_device_list(dev_list);
+    if (!context)
+        return 0;
+    ret = ibv_query_port(context, conf.ib_port, &attr);
+    ibv_close_device(context);
+    if (ret)
+        return 0;
+    switch (attr.active_speed) {
+    case 1:   lane_gbps = 2.5; break;   /* SDR */
+    case 2:   lane_gbps = 5;   break;   /* DDR */
+    case 4:                             /* QDR */
+    case 8:   lane_gbps = 10;  break;   /* FDR10 */
+    case 16:  lane_gbps = 14;  break;   /* FDR */
+    case 32:  lane_gbps = 25;  break;   /* EDR */
+    case 64:  lane_gbps = 50;  break;   /* HDR */
+    case 128: lane_gbps = 100; break;   /* NDR */
+    default:  return 0;
+    }
+    switch (attr.active_width) {
+    case 1:  lanes = 1;  break;
+    case 2:  lanes = 4;  break;
+    case 4:  lanes = 8;  break;
+    case 8:  lanes = 12; break;
+    case 16: lanes = 2;  break;
+    default: return 0;
+    }
+    return lane_gbps * lanes * 125 * port_rate_pct / 100;
+}
+
 static struct pingpong_context *alloc_monitor_qp() {
     struct ibv_device **dev_list;
     struct ibv_device *ib_dev;
@@ -72,8 +126,9 @@ static struct pingpong_context *alloc_monitor_qp() {
     }
 
     //ib_dev = *dev_list; // pick the first device
-    ib_dev = dev_list[ib_dev_idx];
-    printf("IB DEV NAME: %s\n", ib_dev->name);
+    ib_dev = pp_find_device(dev_list);
+    if (ib_dev)
+        printf("IB DEV NAME: %s\n", ib_dev->name);
     //printf("start printing all dev name from idx 0:\n");
     //printf("dev_list[0]: %s\n", dev_list[0]->name);
     //printf("dev_list[1]: %s\n", dev_list[1]->name);
@@ -156,7 +211,7 @@ static struct pingpong_context *alloc_monitor_qp() {
 
     /* monitor qp's cq */
     //ctx->cq = ibv_create_cq(ctx->context, 2, NULL, NULL, 0);
-    ctx->send_cq = ibv_create_cq(ctx->context, 2, NULL, ctx->send_channel, 0);
+    ctx->send_cq = ibv_create_cq(ctx->context, MONITOR_SQ_DEPTH, NULL, ctx->send_channel, 0);
     if (!ctx->send_cq) {
         fprintf(stderr, "Couldn't create CQ\n");
         goto clean_send_cq;
@@ -184,7 +239,7 @@ static struct pingpong_context *alloc_monitor_qp() {
 	    memset(&init_attr, 0, sizeof(struct ibv_qp_init_attr));
 	    init_attr.send_cq = ctx->send_cq;
 	    init_attr.recv_cq = ctx->recv_cq;
-	    init_attr.cap.max_send_wr  = 2;
+	    init_attr.cap.max_send_wr  = MONITOR_SQ_DEPTH;
 	    init_attr.cap.max_recv_wr  = 2;
 	    init_attr.cap.max_send_sge = 1;
 	    init_attr.cap.max_recv_sge = 1;
@@ -203,7 +258,7 @@ static struct pingpong_context *alloc_monitor_qp() {
         struct ibv_qp_attr attr = {
             .qp_state = IBV_QPS_INIT,
             .pkey_index = 0,
-            .port_num = ib_port,
+            .port_num = conf.ib_port,
             .qp_access_flags = IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_LOCAL_WRITE
         };
         if (ibv_modify_qp(ctx->qp, &attr,
@@ -455,7 +510,7 @@ static int pp_connect_ctx(struct pingpong_context *ctx,
             .dlid       = dest->lid,
             .sl         = 0,
             .src_path_bits  = 0,
-            .port_num   = ib_port
+            .port_num   = conf.ib_port
         }
     };
 
@@ -24,6 +24,7 @@
 
 static const int BUF_SIZE = 16;		// for SEND/RECV mesg
 static const int REF_FLOW_SIZE = 10;
+static const int MONITOR_SQ_DEPTH = 16;	// SENDs in flight per monitor QP (server_loop's unsignaled INFO)
 
 struct pingpong_context {
 	struct ibv_context		*context;
@@ -52,6 +53,7 @@ struct pingpong_dest {
 	union ibv_gid gid;
 };
 
-struct pingpong_context * init_monitor_chan(struct monitor_param *);
+struct pingpong_context * init_monitor_chan(struct monitor_param *, const char *);
+uint32_t pp_port_rate_mb(void);
 
 #endif
\ No newline at end of file
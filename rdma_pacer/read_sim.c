@@ -0,0 +1,342 @@
+// Two-node simulation of READ isolation: a requester Q doing large RDMA
+// READs from a responder R, whose link to Q also carries a latency-sensitive
+// flow of R's. READ responses and R's messages share R's egress, a FIFO at
+// the line rate. No RDMA hardware or pacer daemon is needed.
+//
+// Unpaced, Q keeps -d READs of -s bytes outstanding per flow, and R's small
+// messages wait behind whole READ responses. Paced, the pacers do what
+// monitor_latency() and generate_fetch_tokens_read() do:
+//  - every ROUND_US R probes its link to Q with a reference WRITE, feeds the
+//    EWMA of its latency to the rate controller (cc.c) with the min cap
+//    monitor_latency() would give, and hands Q's READs their share of the
+//    cap (read_share()) in a read_rate_msg, with the chunk size R's chunk
+//    size controller (chunk.c) picks for its link to Q;
+//  - Q refills a bucket of up to MAX_TOKEN one-chunk tokens at that rate and
+//    gives them to its pending READ flows in DRR order (sched.c); a flow with
+//    a token posts one READ of a chunk, up to -w chunks outstanding.
+// R learns of Q's READs one INFO window after they start, and Q reads at the
+// line rate in 1 MB chunks until R's first read_rate_msg arrives, as with
+// the real pacers. The checks are that pacing cuts the latency flow's p99 at
+// least tenfold, under P99_BOUND_US, while the READs still get at least 90%
+// of the min cap that keeps them from starving.
+//
+// Usage: read_sim [-n reads] [-s read_bytes] [-d reads_outstanding]
+//                 [-w chunks_outstanding] [-g lat_gap_us] [-c controller] [-t sim_ms]
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <getopt.h>
+#include "sched.h"
+#include "cc.h"
+#include "chunk.h"
+#include "monitor.h"
+
+#define LINE_RATE 6000              /* MBps, line_rate_mb (conf.h) */
+#define TAIL_US 2.0                 /* latency target, tail_us (conf.h) */
+#define EWMA 0.5                    /* as monitor_latency() smooths the reference flow */
+#define ROUND_US 200                /* monitor_latency() probe period */
+#define INFO_US 200                 /* INFO_WINDOW_US: R hears of Q's READs this much later */
+#define MAX_TOKEN 5
+#define DEFAULT_CHUNK 1000000       /* max_chunk (conf.h) */
+#define REF_BYTES 10                /* REF_FLOW_SIZE */
+#define LAT_BYTES 64
+#define PROP_NS 500                 /* one way, wire and NICs */
+#define STEP_NS 50
+#define WARMUP_MS 5
+#define MAX_READS 16
+#define RING 4096
+#define HIST_NS 10                  /* latency histogram bin */
+#define HIST_BINS 1000000
+#define P99_BOUND_US 10.0
+
+struct ev {
+    uint64_t t_ns;
+    int flow;
+    uint32_t bytes;
+};
+
+struct ring {
+    struct ev e[RING];
+    unsigned int head, tail;
+};
+
+struct read_flow {
+    int outstanding;                /* READs (unpaced) or chunks (paced) in flight */
+    uint64_t done_bytes;            /* after the warmup */
+};
+
+struct sim {
+    int paced;
+    int n;
+    uint32_t op_bytes;
+    int depth;
+    int window;
+    uint64_t lat_gap_ns;
+    const struct cc_ops *cc;
+    uint64_t end_ns;
+
+    struct read_flow flows[MAX_READS];
+    struct ring req;                /* READ requests on their way to R */
+    struct ring resp;               /* READ responses on their way to Q */
+    uint64_t link_free_ns;          /* R's egress is busy until then */
+
+    /* Q's read link */
+    uint32_t rate, chunk;
+    uint64_t tokens, last_token_ns;
+    struct token_sched sched;
+    uint64_t ready[SCHED_MAP_WORDS];
+    uint64_t msg_ns;                /* a read_rate_msg arrives then, 0 if none is on the way */
+    uint32_t msg_rate, msg_chunk;
+
+    /* R's monitor */
+    struct cc_state cc_state;
+    struct chunk_params chunk_params;
+    struct chunk_state chunk_state;
+    double tail_us;
+    uint32_t sent_rate, sent_chunk;
+
+    uint32_t hist[HIST_BINS];
+    uint64_t samples;
+};
+
+static void push(struct ring *r, uint64_t t_ns, int flow, uint32_t bytes)
+{
+    if (r->tail - r->head == RING) {
+        printf("event ring full\n");
+        exit(1);
+    }
+    r->e[r->tail % RING].t_ns = t_ns;
+    r->e[r->tail % RING].flow = flow;
+    r->e[r->tail % RING].bytes = bytes;
+    r->tail++;
+}
+
+static struct ev *due(struct ring *r, uint64_t now)
+{
+    return r->head != r->tail && r->e[r->head % RING].t_ns <= now ? &r->e[r->head % RING] : NULL;
+}
+
+/* R's egress: when the last byte of a message posted at `now` is on the wire */
+static uint64_t egress(struct sim *s, uint64_t now, uint32_t bytes)
+{
+    uint64_t start = now > s->link_free_ns ? now : s->link_free_ns;
+
+    s->link_free_ns = start + (uint64_t)bytes * 1000 / LINE_RATE;
+    return s->link_free_ns;
+}
+
+static void post_read(struct sim *s, uint64_t now, int i, uint32_t bytes)
+{
+    s->flows[i].outstanding++;
+    push(&s->req, now + PROP_NS, i, bytes);
+}
+
+/* Q: issue what the READ flows may issue now */
+static void requester(struct sim *s, uint64_t now)
+{
+    uint64_t interval;
+    int i;
+
+    if (!s->paced) {
+        for (i = 0; i < s->n; i++)
+            while (s->flows[i].outstanding < s->depth)
+                post_read(s, now, i, s->op_bytes);
+        return;
+    }
+    if (s->msg_ns && s->msg_ns <= now) {
+        s->rate = s->msg_rate;
+        s->chunk = s->msg_chunk;
+        s->msg_ns = 0;
+    }
+    for (i = 0; i < s->n; i++) {
+        if (s->flows[i].outstanding < s->window)
+            sched_map_set(s->ready, i);
+        else
+            sched_map_clear(s->ready, i);
+    }
+    if (s->tokens && (i = sched_next(&s->sched, s->chunk, s->ready)) >= 0) {
+        s->tokens--;
+        post_read(s, now, i, s->chunk);
+    }
+    interval = (uint64_t)s->chunk * 1000 / s->rate;
+    if (s->tokens < MAX_TOKEN && now - s->last_token_ns >= interval) {
+        s->last_token_ns = now;
+        s->tokens++;
+    }
+}
+
+/* R: a probe round of monitor_latency() on its link to Q */
+static void monitor(struct sim *s, uint64_t now)
+{
+    struct cc_sample sample;
+    struct chunk_sample cs;
+    uint64_t done = egress(s, now, REF_BYTES);
+    double lat_us = (done - now + 2 * PROP_NS) / 1000.0;
+    uint16_t reads = now >= INFO_US * 1000 ? s->n : 0;
+    uint32_t rate, chunk;
+
+    s->tail_us = EWMA * lat_us + (1 - EWMA) * s->tail_us;
+    if (!s->paced || !reads)
+        return;
+    /* a small flow (ours) and READs: treat_l_as_one, no big flows of others */
+    sample.now_us = now / 1000;
+    sample.tail_us = s->tail_us;
+    sample.target_us = TAIL_US;
+    sample.min_cap = (uint64_t)reads * LINE_RATE / (1 + reads);
+    sample.line_rate = LINE_RATE;
+    rate = read_share(cc_update(&s->cc_state, &sample), reads, 0);
+    cs.tail_us = s->tail_us;
+    cs.target_us = TAIL_US;
+    cs.cap = rate;
+    cs.line_rate = LINE_RATE;
+    cs.num_big = reads;
+    cs.num_small = 1;
+    chunk = chunk_update(&s->chunk_state, &s->chunk_params, &cs);
+    if (rate != s->sent_rate || chunk != s->sent_chunk) {
+        s->msg_ns = now + PROP_NS;
+        s->msg_rate = rate;
+        s->msg_chunk = chunk;
+        s->sent_rate = rate;
+        s->sent_chunk = chunk;
+    }
+}
+
+static double quantile(const struct sim *s, double q)
+{
+    uint64_t n = 0, want = q * (s->samples - 1);
+    int i;
+
+    for (i = 0; i < HIST_BINS; i++)
+        if ((n += s->hist[i]) > want)
+            return (double)i * HIST_NS / 1000;
+    return (double)HIST_BINS * HIST_NS / 1000;
+}
+
+static void run(struct sim *s)
+{
+    uint64_t now, next_probe = 0, next_lat = 0, warmup = WARMUP_MS * 1000000ull, bin;
+    struct ev *e;
+    int i;
+
+    memset(s->flows, 0, sizeof(s->flows));
+    memset(&s->req, 0, sizeof(s->req));
+    memset(&s->resp, 0, sizeof(s->resp));
+    memset(s->ready, 0, sizeof(s->ready));
+    memset(s->hist, 0, sizeof(s->hist));
+    s->samples = 0;
+    s->link_free_ns = 0;
+    s->rate = LINE_RATE;
+    s->chunk = DEFAULT_CHUNK;
+    s->tokens = 1;
+    s->last_token_ns = 0;
+    s->msg_ns = 0;
+    s->sent_rate = s->sent_chunk = 0;
+    s->tail_us = 0;
+    sched_init(&s->sched, SCHED_DEFAULT_QUANTUM);
+    for (i = 0; i < s->n; i++)
+        sched_set_slot(&s->sched, i, SCHED_DEFAULT_WEIGHT, 0);
+    cc_init(&s->cc_state, s->cc, LINE_RATE);
+    chunk_init(&s->chunk_state, &s->chunk_params);
+
+    for (now = 0; now < s->end_ns; now += STEP_NS) {
+        requester(s, now);
+        while ((e = due(&s->req, now))) {          // R's NIC answers in arrival order
+            push(&s->resp, egress(s, now, e->bytes) + PROP_NS, e->flow, e->bytes);
+            s->req.head++;
+        }
+        while ((e = due(&s->resp, now))) {
+            s->flows[e->flow].outstanding--;
+            if (now >= warmup)
+                s->flows[e->flow].done_bytes += e->bytes;
+            s->resp.head++;
+        }
+        if (now >= next_lat) {
+            bin = (egress(s, now, LAT_BYTES) + PROP_NS - now) / HIST_NS;
+            if (now >= warmup) {
+                s->hist[bin < HIST_BINS ? bin : HIST_BINS - 1]++;
+                s->samples++;
+            }
+            next_lat += s->lat_gap_ns;
+        }
+        if (now >= next_probe) {
+            monitor(s, now);
+            next_probe += ROUND_US * 1000;
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    static struct sim s;
+    uint64_t sim_ms = 200, bytes;
+    double p99[2], gbps[2], min_cap;
+    int c, i, fail = 0;
+
+    memset(&s, 0, sizeof(s));
+    s.n = 1;
+    s.op_bytes = 1 << 20;
+    s.depth = 2;
+    s.window = 16;
+    s.lat_gap_ns = 20000;
+    s.cc = cc_find(CC_DEFAULT);
+    s.chunk_params.max = DEFAULT_CHUNK;
+    s.chunk_params.cost_ns = DEFAULT_CHUNK_COST_NS;
+    s.chunk_params.cpu_share = DEFAULT_CHUNK_CPU_PCT / 100.0;
+    while ((c = getopt(argc, argv, "n:s:d:w:g:c:t:")) != -1) {
+        switch (c) {
+        case 'n': s.n = atoi(optarg); break;
+        case 's': s.op_bytes = strtoul(optarg, NULL, 10); break;
+        case 'd': s.depth = atoi(optarg); break;
+        case 'w': s.window = atoi(optarg); break;
+        case 'g': s.lat_gap_ns = strtoull(optarg, NULL, 10) * 1000; break;
+        case 'c':
+            if (!(s.cc = cc_find(optarg))) {
+                printf("unknown controller %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 't': sim_ms = strtoull(optarg, NULL, 10); break;
+        default:
+            printf("usage: %s [-n reads] [-s read_bytes] [-d reads_outstanding] [-w chunks_outstanding]"
+                   " [-g lat_gap_us] [-c controller] [-t sim_ms]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (s.n < 1 || s.n > MAX_READS || s.op_bytes < 1 || s.depth < 1 || s.window < 1 ||
+        s.lat_gap_ns < 1000 || sim_ms <= WARMUP_MS) {
+        printf("bad arguments\n");
+        exit(1);
+    }
+    s.end_ns = sim_ms * 1000000;
+
+    printf("%d READ flow(s) of %u B from R, %d outstanding; R's %d B messages every %" PRIu64 " us; %s\n",
+           s.n, s.op_bytes, s.depth, LAT_BYTES, s.lat_gap_ns / 1000, s.cc->name);
+    for (s.paced = 0; s.paced < 2; s.paced++) {
+        run(&s);
+        for (bytes = 0, i = 0; i < s.n; i++)
+            bytes += s.flows[i].done_bytes;
+        gbps[s.paced] = (double)bytes / ((sim_ms - WARMUP_MS) * 1000.0);
+        p99[s.paced] = quantile(&s, 0.99);
+        printf("  %-7s latency p50 %8.2f us  p99 %8.2f us  max %8.2f us;  READs %7.1f MBps",
+               s.paced ? "paced" : "unpaced", quantile(&s, 0.5), p99[s.paced], quantile(&s, 1.0), gbps[s.paced]);
+        if (s.paced)
+            printf(" (%u MBps in %u B chunks at the end)", s.rate, s.chunk);
+        printf("\n");
+    }
+
+    min_cap = (double)s.n * LINE_RATE / (1 + s.n);
+    if (p99[1] > P99_BOUND_US || p99[1] * 10 > p99[0]) {
+        printf("FAIL: paced p99 %.2f us (unpaced %.2f us)\n", p99[1], p99[0]);
+        fail = 1;
+    }
+    if (gbps[1] < 0.9 * min_cap) {
+        printf("FAIL: paced READs got %.1f MBps, min cap %.1f MBps\n", gbps[1], min_cap);
+        fail = 1;
+    }
+    if (fail)
+        exit(1);
+    printf("READs paced by the responder: latency isolated\n");
+    return 0;
+}
@@ -0,0 +1,330 @@
+// Registration storm: the old string protocol (a fresh SOCK_STREAM
+// connection per message, one accept loop that finishes each handshake
+// before looking at the next connection) vs. pacer_msg.h over one persistent
+// SOCK_SEQPACKET connection per process, served by ctl_run() (ctl.c, the
+// pacer's own loop).
+//
+// Each of `clients` forked processes registers `rounds` times: join, app,
+// exit, as a driver does over its life. The first `stalled` clients are
+// descheduled for `stall_ms` in the middle of their first registration (the
+// old protocol's second round trip, or before the join datagram), which the
+// old loop waits out with everyone else queued behind. `work_us` of busy time
+// per app/exit message stands in for flow_handler's SEND to the receiver.
+// Join latency is measured by the client, from socket() to knowing its slot.
+//
+// Usage: reg_bench [-c clients] [-n rounds] [-s stalled] [-d stall_ms] [-w work_us]
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <math.h>
+#include <getopt.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "ctl.h"
+
+#define MAX_FLOWS 512
+#define MSG_LEN 40
+#define BENCH_ABI 4
+
+static char sock_path[108];
+static int work_us;
+static pid_t pid_list[MAX_FLOWS];
+static uint16_t slot_conns[MAX_FLOWS];
+
+static double now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void busy(int us)
+{
+    double end = now_us() + us;
+    while (now_us() < end)
+        ;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* find_next_slot() of the pacer */
+static int find_slot(pid_t pid)
+{
+    int i, free_slot = -1;
+    for (i = 0; i < MAX_FLOWS; i++) {
+        if (pid_list[i] == pid)
+            return i;
+        if (free_slot < 0 && pid_list[i] == -1)
+            free_slot = i;
+    }
+    if (free_slot >= 0)
+        pid_list[free_slot] = pid;
+    return free_slot;
+}
+
+static int unix_socket(int type, struct sockaddr_un *addr)
+{
+    int s = socket(AF_UNIX, type, 0);
+    if (s == -1) {
+        perror("socket");
+        exit(1);
+    }
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, sock_path);
+    return s;
+}
+
+/* ---- old protocol: the pre-ctl.c flow_handler and contact_pacer() ---- */
+
+static void legacy_server()
+{
+    struct sockaddr_un local;
+    int s = unix_socket(SOCK_STREAM, &local), s2, len;
+    char buf[MSG_LEN];
+    pid_t pid;
+    uint64_t dest;
+    unsigned int abi, weight, burst_kb;
+
+    unlink(local.sun_path);
+    if (bind(s, (struct sockaddr *)&local, sizeof(local)) || listen(s, 10)) {
+        perror("bind/listen");
+        exit(1);
+    }
+    while ((s2 = accept(s, NULL, NULL)) >= 0) {
+        if ((len = recv(s2, buf, MSG_LEN - 1, 0)) <= 0) {
+            close(s2);
+            continue;
+        }
+        buf[len] = '\0';
+        if (strncmp(buf, "join", 4) == 0) {
+            abi = 0;
+            sscanf(buf, "join:%" SCNx64 ":%u", &dest, &abi);
+            send(s2, "sender:0000", 11, 0);
+            if ((len = recv(s2, buf, MSG_LEN - 1, 0)) > 0) {
+                buf[len] = '\0';
+                sscanf(buf, "%d:%u:%u", &pid, &weight, &burst_kb);
+                len = snprintf(buf, MSG_LEN, "%d", find_slot(pid));
+                send(s2, buf, len, 0);
+            }
+        } else {
+            busy(work_us);      // "app_*" / "exit_app_*": tell the receiver
+        }
+        close(s2);              // the old handler leaked these; be generous
+    }
+    perror("accept");
+    exit(1);
+}
+
+static int legacy_connect()
+{
+    struct sockaddr_un remote;
+    int s = unix_socket(SOCK_STREAM, &remote);
+    if (connect(s, (struct sockaddr *)&remote, sizeof(remote)) == -1) {
+        perror("connect");
+        exit(1);
+    }
+    return s;
+}
+
+static void legacy_send(const char *msg)
+{
+    int s = legacy_connect();
+    send(s, msg, strlen(msg), 0);
+    close(s);
+}
+
+static void legacy_register(int stall_ms, double *join_us)
+{
+    char str[MSG_LEN];
+    double t0 = now_us();
+    int s = legacy_connect(), len;
+
+    snprintf(str, MSG_LEN, "join:%016" PRIx64 ":%u", (uint64_t)0, BENCH_ABI);
+    send(s, str, strlen(str), 0);
+    recv(s, str, MSG_LEN, 0);
+    if (stall_ms)
+        usleep(stall_ms * 1000);
+    len = snprintf(str, MSG_LEN, "%d", getpid());
+    send(s, str, len, 0);
+    if (recv(s, str, MSG_LEN, 0) <= 0) {
+        printf("legacy: no slot\n");
+        exit(1);
+    }
+    *join_us = now_us() - t0;
+    close(s);
+
+    legacy_send("app_bw:0000000000000000:0");
+    legacy_send("exit_app_bw:0000000000000000:0");
+}
+
+/* ---- pacer_msg.h over one SOCK_SEQPACKET connection, ctl_run() ---- */
+
+static void bench_join(struct ctl_conn *c, const struct pmsg_join *m, struct pmsg_join_ack *ack)
+{
+    int slot = find_slot(m->pid);
+
+    if (slot < 0) {
+        ack->status = PMSG_EFULL;
+        return;
+    }
+    if (!ctl_conn_flow(c, slot))
+        slot_conns[slot]++;
+    ack->status = PMSG_OK;
+    ack->is_sender = 1;
+    ack->slot = slot;
+}
+
+static void bench_msg(struct ctl_conn *c, struct ctl_flow *f, const struct pmsg_app *m)
+{
+    busy(work_us);
+}
+
+static void bench_close(struct ctl_conn *c, struct ctl_flow *f)
+{
+    if (--slot_conns[f->slot] == 0)
+        pid_list[f->slot] = -1;
+}
+
+static void tlv_server()
+{
+    static const struct ctl_ops ops = {
+        .join = bench_join,
+        .app = bench_msg,
+        .exit = bench_msg,
+        .close = bench_close,
+    };
+    ctl_run(ctl_listen(sock_path), BENCH_ABI, &ops);
+}
+
+static void tlv_send(int s, struct pmsg *m)
+{
+    if (send(s, m, sizeof(m->hdr) + m->hdr.len, 0) == -1) {
+        perror("send");
+        exit(1);
+    }
+}
+
+static void tlv_register(int stall_ms, double *join_us)
+{
+    struct sockaddr_un remote;
+    struct pmsg m;
+    double t0 = now_us();
+    int s = unix_socket(SOCK_SEQPACKET, &remote);
+    uint32_t slot;
+
+    if (connect(s, (struct sockaddr *)&remote, sizeof(remote)) == -1) {
+        perror("connect");
+        exit(1);
+    }
+    if (stall_ms)
+        usleep(stall_ms * 1000);
+    pmsg_init(&m, PMSG_JOIN, sizeof(m.join));
+    m.join.abi_version = BENCH_ABI;
+    m.join.pid = getpid();
+    tlv_send(s, &m);
+    if (!pmsg_valid(&m, recv(s, &m, sizeof(m), 0)) || m.hdr.type != PMSG_JOIN_ACK || m.ack.status != PMSG_OK) {
+        printf("tlv: no slot\n");
+        exit(1);
+    }
+    *join_us = now_us() - t0;
+
+    slot = m.ack.slot;
+    pmsg_init(&m, PMSG_APP, sizeof(m.app));
+    m.app.app_type = PMSG_APP_BW;
+    m.app.slot = slot;
+    tlv_send(s, &m);
+    m.hdr.type = PMSG_EXIT;
+    tlv_send(s, &m);
+    close(s);
+}
+
+/* ---- driver ---- */
+
+static void run(const char *name, void (*server)(), void (*reg)(int, double *),
+                int clients, int rounds, int stalled, int stall_ms, double *lat)
+{
+    pid_t srv, pid;
+    double t0, total;
+    int c, r, n = clients * rounds;
+
+    memset(pid_list, 0xff, sizeof(pid_list));
+    fflush(stdout);
+    if ((srv = fork()) == 0) {
+        server();
+        _exit(0);
+    }
+    usleep(100000);     // let it bind
+
+    t0 = now_us();
+    for (c = 0; c < clients; c++) {
+        if ((pid = fork()) == 0) {
+            for (r = 0; r < rounds; r++)
+                reg(c < stalled && r == 0 ? stall_ms : 0, &lat[c * rounds + r]);
+            _exit(0);
+        }
+        if (pid < 0) {
+            perror("fork");
+            exit(1);
+        }
+    }
+    while (wait(NULL) > 0 && --c)
+        ;
+    total = now_us() - t0;
+    kill(srv, SIGKILL);
+    waitpid(srv, NULL, 0);
+    unlink(sock_path);
+
+    qsort(lat, n, sizeof(double), cmp_double);
+    printf("%s\t%.1f\t\t%.0f\t\t%.1f\t\t%.1f\t\t%.1f\n", name, total / 1000, n / (total / 1e6),
+           lat[n / 2], lat[(int)ceil(0.99 * n) - 1], lat[n - 1]);
+}
+
+int main(int argc, char **argv)
+{
+    int clients = 64, rounds = 50, stalled = 0, stall_ms = 20, c;
+    double *lat;
+
+    while ((c = getopt(argc, argv, "c:n:s:d:w:")) != -1) {
+        switch (c) {
+        case 'c': clients = atoi(optarg); break;
+        case 'n': rounds = atoi(optarg); break;
+        case 's': stalled = atoi(optarg); break;
+        case 'd': stall_ms = atoi(optarg); break;
+        case 'w': work_us = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-c clients] [-n rounds] [-s stalled] [-d stall_ms] [-w work_us]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (clients < 1 || clients > MAX_FLOWS || rounds < 1) {
+        fprintf(stderr, "need 1 <= clients <= %d and rounds >= 1\n", MAX_FLOWS);
+        return 1;
+    }
+
+    lat = mmap(NULL, clients * rounds * sizeof(double), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (lat == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    snprintf(sock_path, sizeof(sock_path), "/tmp/reg_bench.%d", getpid());
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("%d clients x %d registrations, %d stalled for %d ms, %d us per app/exit\n",
+           clients, rounds, stalled, stall_ms, work_us);
+    printf("protocol\ttotal(ms)\treg/s\t\tjoin_p50(us)\tjoin_p99(us)\tjoin_max(us)\n");
+    run("string", legacy_server, legacy_register, clients, rounds, stalled, stall_ms, lat);
+    run("tlv", tlv_server, tlv_register, clients, rounds, stalled, stall_ms, lat);
+    return 0;
+}
@@ -0,0 +1,297 @@
+// Cost of buffering the RRs a user QP gets at INIT, before and after the
+// RR ring (libmlx4/src/rr_ring.h). Each of `qps` QPs gets `rrs` RRs of `sges`
+// SGEs, one per post_recv as most applications post them, holds them until
+// the split QPN exchange, posts them again to a mock post_recv and is
+// destroyed:
+//  - old:  rr_buffer_enqueue() as it was in libmlx4/src/qp.c (a malloc'd
+//          ibv_recv_wr per RR in a slot array grown by realloc from
+//          RR_BUFFER_INIT_CAP), reposted one post_recv per RR and freed;
+//  - ring: rr_ring_push(), rr_ring_chain() into a single post_recv, with a
+//          ring of the RQ's size (rrs rounded up to a power of two).
+// malloc, realloc and free are wrapped at link time to count the calls of
+// both. Before timing, the ring is checked on its own: wr_ids and SGEs come
+// back in order across wrap-arounds, though the caller reuses one SGE array
+// (the old copy kept a pointer to it), and a chain that does not fit or has
+// too many SGEs is refused whole.
+//
+// Usage: rr_bench [-q qps] [-r rrs_per_qp] [-s sges] [-n rounds]
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include "../libmlx4/src/rr_ring.h"
+
+#define RR_BUFFER_INIT_CAP 1000     /* libmlx4/src/mlx4.h, before the ring */
+#define MAX_SGES 16
+
+static unsigned long n_malloc, n_realloc, n_free;
+
+void *__real_malloc(size_t n);
+void *__real_realloc(void *p, size_t n);
+void __real_free(void *p);
+
+void *__wrap_malloc(size_t n)
+{
+    n_malloc++;
+    return __real_malloc(n);
+}
+
+void *__wrap_realloc(void *p, size_t n)
+{
+    n_realloc++;
+    return __real_realloc(p, n);
+}
+
+void __wrap_free(void *p)
+{
+    if (p)
+        n_free++;
+    __real_free(p);
+}
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+//// the old rr_buffer, as it was
+struct rr_buffer {
+    struct ibv_recv_wr **slot;
+    unsigned int size;
+    unsigned int capacity;
+};
+
+static int rr_buffer_init(struct rr_buffer *rr_buf, unsigned int cap)
+{
+    rr_buf->slot = (struct ibv_recv_wr **)malloc(cap * sizeof(struct ibv_recv_wr *));
+    if (!rr_buf->slot)
+        return -1;
+    rr_buf->capacity = cap;
+    rr_buf->size = 0;
+    return 0;
+}
+
+static int rr_buffer_enqueue(struct rr_buffer *rr_buf, struct ibv_recv_wr *wr)
+{
+    unsigned int i = rr_buf->size;
+    struct ibv_recv_wr **new_slot;
+
+    if (!rr_buf->capacity && rr_buffer_init(rr_buf, RR_BUFFER_INIT_CAP))
+        return -1;
+    if (i >= rr_buf->capacity) {
+        rr_buf->capacity *= 2;
+        new_slot = realloc(rr_buf->slot, rr_buf->capacity * sizeof(struct ibv_recv_wr *));
+        if (!new_slot)
+            return -1;
+        rr_buf->slot = new_slot;
+    }
+    struct ibv_recv_wr *rwr = (struct ibv_recv_wr *)malloc(sizeof(struct ibv_recv_wr));
+    memcpy(rwr, wr, sizeof(struct ibv_recv_wr));
+    rr_buf->slot[i] = rwr;
+    rr_buf->size += 1;
+    return 0;
+}
+////
+
+// what the RQ gets; volatile so that neither side's copies are optimized away
+static volatile uint64_t sink;
+static unsigned long n_posts;
+
+static void mock_post_recv(struct ibv_recv_wr *wr)
+{
+    int i;
+
+    n_posts++;
+    for (; wr; wr = wr->next)
+        for (i = 0; i < wr->num_sge; i++)
+            sink += wr->wr_id ^ wr->sg_list[i].addr ^ wr->sg_list[i].length;
+}
+
+static void make_rr(struct ibv_recv_wr *wr, struct ibv_sge *sge, uint64_t id, int sges)
+{
+    int i;
+
+    for (i = 0; i < sges; i++) {
+        sge[i].addr = 0x7f0000000000ull + (id << 12) + i * 64;
+        sge[i].length = 64 + i;
+        sge[i].lkey = (uint32_t)id;
+    }
+    memset(wr, 0, sizeof(*wr));
+    wr->wr_id = id;
+    wr->sg_list = sge;
+    wr->num_sge = sges;
+}
+
+static void check(int cond, const char *what)
+{
+    if (!cond) {
+        printf("FAIL: %s\n", what);
+        exit(1);
+    }
+}
+
+static void check_ring(int sges)
+{
+    struct rr_ring r;
+    struct ibv_recv_wr wr[8], *bad, *w;
+    struct ibv_sge sge[8][MAX_SGES];
+    uint64_t next = 0, first = 0;
+    int round, n, i, j;
+
+    check(!rr_ring_init(&r, 64, sges), "ring init");
+    srand(1);
+    for (round = 0; round < 1000; round++) {
+        // push random chains until about full, posting each from the same arrays
+        while (r.size < 56) {
+            n = 1 + rand() % 8;
+            for (i = 0; i < n; i++) {
+                make_rr(&wr[i], sge[i], next + i, sges);
+                wr[i].next = i + 1 < n ? &wr[i + 1] : NULL;
+            }
+            if (r.size + n > r.capacity) {
+                check(rr_ring_push(&r, wr, &bad) == ENOMEM && bad == wr, "chain past capacity refused");
+                break;
+            }
+            check(!rr_ring_push(&r, wr, &bad), "push");
+            next += n;
+        }
+        wr[0].num_sge = sges + 1;
+        wr[0].next = NULL;
+        n = r.size;
+        check(rr_ring_push(&r, wr, &bad) == EINVAL && bad == wr && r.size == n, "too many SGEs refused");
+        // drain a random part of the ring the way rr_buffer_post_and_clear drains all of it
+        n = rand() % (r.size + 1);
+        for (i = 0, w = rr_ring_chain(&r); w; w = w->next, i++) {
+            check(w->wr_id == first + i, "wr_id order");
+            check(w->num_sge == sges, "num_sge");
+            make_rr(&wr[0], sge[0], first + i, sges);
+            for (j = 0; j < sges; j++)
+                check(!memcmp(&w->sg_list[j], &sge[0][j], sizeof(sge[0][j])), "SGE copied");
+        }
+        check(i == (int)r.size, "chain length");
+        r.head = (r.head + n) & (r.capacity - 1);
+        r.size -= n;
+        first += n;
+    }
+    rr_ring_clear(&r);
+    check(!r.size && !rr_ring_chain(&r), "clear");
+    rr_ring_destroy(&r);
+}
+
+// noipa: gcc takes malloc and free for builtins that leave the counters
+// alone and would read them around the calls
+static void __attribute__((noipa)) run_old(int qps, int rrs, int sges)
+{
+    struct rr_buffer rb;
+    struct ibv_recv_wr wr;
+    struct ibv_sge sge[MAX_SGES];
+    int q, i;
+
+    for (q = 0; q < qps; q++) {
+        memset(&rb, 0, sizeof(rb));
+        for (i = 0; i < rrs; i++) {
+            make_rr(&wr, sge, i, sges);
+            if (rr_buffer_enqueue(&rb, &wr)) {
+                printf("old enqueue failed\n");
+                exit(1);
+            }
+        }
+        for (i = 0; i < (int)rb.size; i++) {
+            mock_post_recv(rb.slot[i]);
+            free(rb.slot[i]);
+        }
+        free(rb.slot);
+    }
+}
+
+static void __attribute__((noipa)) run_ring(int qps, int rrs, int sges, unsigned int cap)
+{
+    struct rr_ring r;
+    struct ibv_recv_wr wr, *bad;
+    struct ibv_sge sge[MAX_SGES];
+    int q, i;
+
+    for (q = 0; q < qps; q++) {
+        memset(&r, 0, sizeof(r));
+        for (i = 0; i < rrs; i++) {
+            make_rr(&wr, sge, i, sges);
+            if (!r.capacity && rr_ring_init(&r, cap, sges)) {
+                printf("ring init failed\n");
+                exit(1);
+            }
+            if (rr_ring_push(&r, &wr, &bad)) {
+                printf("ring push failed\n");
+                exit(1);
+            }
+        }
+        mock_post_recv(rr_ring_chain(&r));
+        rr_ring_clear(&r);
+        rr_ring_destroy(&r);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int qps = 1000, rrs = 512, sges = 1, rounds = 5, op, i;
+    unsigned int cap = 1;
+    unsigned long m0, r0, f0, p0, total;
+    uint64_t t0, ns_old = 0, ns_ring = 0;
+    unsigned long a_old, a_ring, f_old, f_ring, p_old, p_ring;
+
+    while ((op = getopt(argc, argv, "q:r:s:n:")) != -1) {
+        switch (op) {
+        case 'q': qps = atoi(optarg); break;
+        case 'r': rrs = atoi(optarg); break;
+        case 's': sges = atoi(optarg); break;
+        case 'n': rounds = atoi(optarg); break;
+        default:
+            printf("usage: %s [-q qps] [-r rrs_per_qp] [-s sges] [-n rounds]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (qps < 1 || rrs < 1 || sges < 1 || sges > MAX_SGES || rounds < 1) {
+        printf("bad arguments\n");
+        exit(1);
+    }
+    while (cap < (unsigned int)rrs)
+        cap <<= 1;
+
+    check_ring(sges);
+
+    // warm up, then count one round of each
+    run_old(qps, rrs, sges);
+    run_ring(qps, rrs, sges, cap);
+    m0 = n_malloc; r0 = n_realloc; f0 = n_free; p0 = n_posts;
+    run_old(qps, rrs, sges);
+    a_old = n_malloc - m0 + n_realloc - r0;
+    f_old = n_free - f0;
+    p_old = n_posts - p0;
+    m0 = n_malloc; r0 = n_realloc; f0 = n_free; p0 = n_posts;
+    run_ring(qps, rrs, sges, cap);
+    a_ring = n_malloc - m0 + n_realloc - r0;
+    f_ring = n_free - f0;
+    p_ring = n_posts - p0;
+
+    for (i = 0; i < rounds; i++) {
+        t0 = now_ns();
+        run_old(qps, rrs, sges);
+        ns_old += now_ns() - t0;
+        t0 = now_ns();
+        run_ring(qps, rrs, sges, cap);
+        ns_ring += now_ns() - t0;
+    }
+
+    total = (unsigned long)qps * rrs;
+    printf("%d QPs x %d RRs of %d SGEs (ring of %u): ring checked\n", qps, rrs, sges, cap);
+    printf("  old  %.4f allocs/RR  %.4f frees/RR  %.4f post_recv/RR  %7.1f ns/RR\n",
+           (double)a_old / total, (double)f_old / total, (double)p_old / total,
+           (double)ns_old / rounds / total);
+    printf("  ring %.4f allocs/RR  %.4f frees/RR  %.4f post_recv/RR  %7.1f ns/RR (%.2fx)\n",
+           (double)a_ring / total, (double)f_ring / total, (double)p_ring / total,
+           (double)ns_ring / rounds / total, (double)ns_old / ns_ring);
+    return 0;
+}
@@ -0,0 +1,103 @@
+#include "sched.h"
+#include <string.h>
+
+/* Deficit Round Robin, one token per call.
+ *
+ * Reference paper: Shreedhar & Varghese, "Efficient Fair Queuing using
+ * Deficit Round Robin", SIGCOMM '95. The only twist is that the "packet" at
+ * the head of every queue is one chunk, whose size (cost) is set by the pacer
+ * and may change between calls.
+ */
+
+void sched_init(struct token_sched *s, uint32_t quantum)
+{
+    int i;
+    memset(s, 0, sizeof(*s));
+    s->quantum = quantum ? quantum : SCHED_DEFAULT_QUANTUM;
+    for (i = 0; i < SCHED_MAX_SLOTS; i++)
+        s->slots[i].weight = SCHED_DEFAULT_WEIGHT;
+}
+
+void sched_set_slot(struct token_sched *s, int slot, uint32_t weight, uint32_t burst)
+{
+    if (slot < 0 || slot >= SCHED_MAX_SLOTS)
+        return;
+    if (weight == 0)
+        weight = SCHED_DEFAULT_WEIGHT;
+    if (weight > SCHED_MAX_WEIGHT)
+        weight = SCHED_MAX_WEIGHT;
+    /* slot params are written by flow_handler and read by the token thread */
+    __atomic_store_n(&s->slots[slot].weight, weight, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->slots[slot].burst, burst, __ATOMIC_RELAXED);
+}
+
+void sched_reset_slot(struct token_sched *s, int slot)
+{
+    if (slot < 0 || slot >= SCHED_MAX_SLOTS)
+        return;
+    sched_set_slot(s, slot, SCHED_DEFAULT_WEIGHT, 0);
+    s->slots[slot].deficit = 0;
+    s->slots[slot].granted = 0;
+}
+
+/* pick the slot that gets the next token of `cost` bytes among the slots
+ * set in `ready`; return -1 if no slot is ready
+ *
+ * Slots are only visited while their ready bit is set. A turn holder that
+ * goes idle mid-turn forfeits its credit, which can be up to burst - cost
+ * when burst > quantum. A slot that goes idle between turns keeps what its
+ * last turn left, less than the chunk it could not pay for.
+ */
+int sched_next(struct token_sched *s, uint32_t cost, const uint64_t *ready)
+{
+    struct sched_slot *slot;
+    int64_t quantum, cap;
+    int i;
+
+    /* a slot whose quantum is smaller than the cost needs several rounds
+     * to build up enough deficit, hence the loop */
+    while (1) {
+        if ((i = sched_map_next(ready, s->cur)) < 0) {
+            if (s->in_turn)
+                s->slots[s->cur].deficit = 0;
+            s->in_turn = 0;
+            return -1;
+        }
+        if (i != s->cur) {          // the turn holder went idle; move on
+            if (s->in_turn)
+                s->slots[s->cur].deficit = 0;
+            s->cur = i;
+            s->in_turn = 0;
+        }
+        slot = &s->slots[i];
+        if (!s->in_turn) {
+            s->in_turn = 1;
+            quantum = (int64_t)__atomic_load_n(&slot->weight, __ATOMIC_RELAXED) * s->quantum;
+            cap = __atomic_load_n(&slot->burst, __ATOMIC_RELAXED);
+            if (cap == 0)
+                cap = quantum;
+            if (cap < cost)
+                cap = cost;         // otherwise the slot could never be served
+            slot->deficit += quantum;
+            if (slot->deficit > cap)
+                slot->deficit = cap;
+        }
+        if (slot->deficit >= cost) {
+            slot->deficit -= cost;
+            slot->granted++;
+            return i;               // keep the turn; cur stays on this slot
+        }
+        s->in_turn = 0;
+        s->cur = (i + 1) % SCHED_MAX_SLOTS;
+    }
+}
+
+/* undo the last sched_next() that picked `slot`, whose ready bit turned out
+ * to be stale: the caller clears the bit and picks again */
+void sched_refund(struct token_sched *s, int slot, uint32_t cost)
+{
+    if (slot < 0 || slot >= SCHED_MAX_SLOTS)
+        return;
+    s->slots[slot].deficit += cost;
+    s->slots[slot].granted--;
+}
@@ -0,0 +1,71 @@
+#ifndef SCHED_H
+#define SCHED_H
+// Weighted token dispatch across flow slots (Deficit Round Robin)
+//
+// Each slot is one registered flow: a QP with libmlx4 and libsimverbs, a whole
+// process with libmlx5. Weights are per slot, so a process with N backlogged
+// QPs gets N shares of its weight (scenarios/per_qp.conf). A token is worth
+// one chunk of the active chunk size; slots earn `weight * quantum` bytes of
+// credit per DRR round, so a backlogged slot's share of the virtual link is
+// proportional to its weight.
+//
+// Candidates come from a ready bitmap (one bit per slot, 512 bits = one cache
+// line) that drivers set next to their "pending" flag, so a dispatch decision
+// costs O(active slots) rather than a scan of every flow_info.
+//
+// The scheduler has no notion of time; callers decide when a token exists
+// (the pacer from get_cycles(), sched_bench from a simulated clock).
+#include <stdint.h>
+
+#define SCHED_MAX_SLOTS 512             /* must match MAX_FLOWS */
+#define SCHED_MAP_WORDS (SCHED_MAX_SLOTS / 64)
+#define SCHED_DEFAULT_QUANTUM 65536     /* bytes of credit per weight unit per round */
+#define SCHED_DEFAULT_WEIGHT 1
+#define SCHED_MAX_WEIGHT 1000
+
+struct sched_slot {
+    uint32_t weight;            /* quantum multiplier */
+    uint32_t burst;             /* cap on banked credit (bytes); 0 -> weight * quantum */
+    int64_t deficit;            /* DRR deficit counter (bytes) */
+    uint64_t granted;           /* tokens granted to this slot */
+};
+
+struct token_sched {
+    struct sched_slot slots[SCHED_MAX_SLOTS];
+    uint32_t quantum;
+    uint16_t cur;               /* slot currently holding the DRR turn */
+    uint8_t in_turn;            /* whether cur already received its quantum this round */
+};
+
+/* first set bit at or after `start`, wrapping around; -1 if the map is empty */
+static inline int sched_map_next(const uint64_t *map, int start)
+{
+    int w = start / 64, n;
+    uint64_t bits = __atomic_load_n(&map[w], __ATOMIC_ACQUIRE) & (~0ULL << (start % 64));
+
+    for (n = 0; n <= SCHED_MAP_WORDS; n++) {
+        if (bits)
+            return w * 64 + __builtin_ctzll(bits);
+        w = (w + 1) % SCHED_MAP_WORDS;
+        bits = __atomic_load_n(&map[w], __ATOMIC_ACQUIRE);
+    }
+    return -1;
+}
+
+static inline void sched_map_set(uint64_t *map, int slot)
+{
+    __atomic_fetch_or(&map[slot / 64], 1ULL << (slot % 64), __ATOMIC_RELEASE);
+}
+
+static inline void sched_map_clear(uint64_t *map, int slot)
+{
+    __atomic_fetch_and(&map[slot / 64], ~(1ULL << (slot % 64)), __ATOMIC_RELEASE);
+}
+
+void sched_init(struct token_sched *s, uint32_t quantum);
+void sched_set_slot(struct token_sched *s, int slot, uint32_t weight, uint32_t burst);
+void sched_reset_slot(struct token_sched *s, int slot);
+int sched_next(struct token_sched *s, uint32_t cost, const uint64_t *ready);
+void sched_refund(struct token_sched *s, int slot, uint32_t cost);
+
+#endif
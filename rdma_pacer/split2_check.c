@@ -0,0 +1,560 @@
+// Loopback check of the two-sided split (split_imm.c) over a simulated QP
+// pair. Each side has a user QP, a split QP and split_qp2, each with its own
+// CQs as in the driver (split_qp2 sends and receives on one CQ). A posted
+// message is gathered at post time and delivered in order per QP; a SEND
+// waits in its QP's queue until the peer posts a RR (receiver not ready),
+// except on the split QP, where a SEND with no pool RR posted means the
+// credits were overrun, and fails. WRITEs land in memory on delivery. Every
+// CQ hides a ready completion from a poll now and then, so completions of
+// different QPs show up in varying order.
+// Both directions run at once, a sender and a receiver thread per side,
+// with random SEND / SEND_WITH_IMM / WRITE_WITH_IMM messages of up to 3 MB
+// (over the pool, so the sender runs out of credits), lengths around
+// SPLIT_IMM_BUF, 1-8 SGEs, random chunk, batch and signal settings, and
+// receive scatter lists of 1-SPLIT_IMM_MAX_SGE pieces with gaps between them.
+// Now and then a message of SPLIT_IMM_BUF bytes or more goes out unsplit, as
+// from a peer that does not split, and must not be taken for a head.
+// The receiver never waits for a tail: like the driver's poll, it holds a
+// head back, keeps polling its user CQ and tries the head's tail again.
+// Checked per message: opcode, imm, wr_id, byte_len and every byte, in
+// order; at the end, that the credits add up again on both sides.
+//
+// Usage: split2_check [-n messages] [-s seed]
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <errno.h>
+#include "split_imm.h"
+
+#define MAX_LEN (3 << 20)
+#define CQ_DEPTH 4096
+#define USER_RRS 8
+#define WIMM_SLOTS 4                /* receive regions a WRITE_WITH_IMM sender cycles through */
+
+#define CHECK(c, ...) do { \
+    if (!(c)) { \
+        fprintf(stderr, "FAIL %s:%d: %s: ", __FILE__, __LINE__, #c); \
+        fprintf(stderr, __VA_ARGS__); \
+        fputc('\n', stderr); \
+        exit(1); \
+    } \
+} while (0)
+
+struct mcq {
+    pthread_mutex_t lock;
+    struct ibv_wc q[CQ_DEPTH];
+    unsigned head, tail;
+};
+
+struct mmsg {
+    struct mmsg *next;
+    enum ibv_wr_opcode opcode;
+    uint64_t wr_id;
+    int signaled;
+    uint32_t imm;
+    uint64_t raddr;
+    uint32_t len;
+    char *data;
+};
+
+struct mrr {
+    uint64_t wr_id;
+    int nsge;
+    struct ibv_sge sge[SPLIT_IMM_MAX_SGE];
+};
+
+struct mqp {
+    pthread_mutex_t lock;           /* taken on the receiving QP */
+    struct mqp *peer;
+    struct mcq *scq, *rcq;
+    int strict;                     /* a SEND needs a RR already posted */
+    struct mrr rq[CQ_DEPTH];
+    unsigned rq_head, rq_tail;
+    struct mmsg *in, **in_tail;     /* arrived, waiting for a RR */
+};
+
+struct plan {
+    enum ibv_wr_opcode opcode;
+    uint32_t len;
+    int nsge;
+    int unsplit;                    /* posted as is, whatever its length */
+    struct split_sgl_cut cut;
+};
+
+/* a completion held back behind a split head */
+struct held {
+    struct ibv_wc wc;
+    int head;                       /* its tail is not all in yet */
+};
+
+struct side {
+    int id;
+    struct mqp user, split, fc;
+    struct mcq user_scq, user_rcq, split_scq, split_rcq, cq2;
+    struct split_imm st;
+    char *pool;
+    char *send_buf;                 /* MAX_LEN, with room for gaps */
+    char *rr_buf[USER_RRS];         /* 2 * MAX_LEN each: pieces with gaps */
+    struct mrr rr[USER_RRS];
+    char *wimm;                     /* WIMM_SLOTS * MAX_LEN, written by the peer */
+    struct plan *tx_plan;           /* what this side sends */
+    int received;                   /* messages of the peer checked */
+    unsigned seed;
+    struct side *peer;
+};
+
+static int nmsg = 2000;
+static struct side sides[2];
+static __thread unsigned tseed;
+
+static unsigned rnd(unsigned n)
+{
+    return rand_r(&tseed) % n;
+}
+
+static uint8_t pattern(int dir, int msg, uint64_t off)
+{
+    return (dir * 131 + msg * 7 + off * 13 + (off >> 9)) & 0xff;
+}
+
+static void cq_init(struct mcq *cq)
+{
+    pthread_mutex_init(&cq->lock, NULL);
+    cq->head = cq->tail = 0;
+}
+
+static void cq_push(struct mcq *cq, const struct ibv_wc *wc)
+{
+    pthread_mutex_lock(&cq->lock);
+    CHECK(cq->tail - cq->head < CQ_DEPTH, "CQ overrun");
+    cq->q[cq->tail++ % CQ_DEPTH] = *wc;
+    pthread_mutex_unlock(&cq->lock);
+}
+
+static int cq_poll(struct mcq *cq, struct ibv_wc *wc, int block)
+{
+    int got;
+
+    for (;;) {
+        pthread_mutex_lock(&cq->lock);
+        got = cq->head != cq->tail && rnd(4);
+        if (got)
+            *wc = cq->q[cq->head++ % CQ_DEPTH];
+        pthread_mutex_unlock(&cq->lock);
+        if (got || !block)
+            return got;
+        sched_yield();
+    }
+}
+
+static void qp_init(struct mqp *qp, struct mcq *scq, struct mcq *rcq, int strict)
+{
+    pthread_mutex_init(&qp->lock, NULL);
+    qp->scq = scq;
+    qp->rcq = rcq;
+    qp->strict = strict;
+    qp->rq_head = qp->rq_tail = 0;
+    qp->in = NULL;
+    qp->in_tail = &qp->in;
+}
+
+/* hand over what has arrived at qp, in order, as far as RRs allow; qp->lock held */
+static void deliver(struct mqp *qp)
+{
+    struct mmsg *m;
+    struct mrr *rr;
+    struct ibv_wc wc;
+    uint32_t off, n;
+    int i;
+
+    while ((m = qp->in)) {
+        if (m->opcode != IBV_WR_RDMA_WRITE && qp->rq_head == qp->rq_tail)
+            return;
+        if (m->opcode == IBV_WR_RDMA_WRITE || m->opcode == IBV_WR_RDMA_WRITE_WITH_IMM)
+            memcpy((char *)(uintptr_t)m->raddr, m->data, m->len);
+        if (m->opcode != IBV_WR_RDMA_WRITE) {
+            rr = &qp->rq[qp->rq_head++ % CQ_DEPTH];
+            memset(&wc, 0, sizeof(wc));
+            wc.wr_id = rr->wr_id;
+            wc.status = IBV_WC_SUCCESS;
+            wc.byte_len = m->len;
+            if (m->opcode == IBV_WR_RDMA_WRITE_WITH_IMM) {
+                wc.opcode = IBV_WC_RECV_RDMA_WITH_IMM;
+            } else {
+                wc.opcode = IBV_WC_RECV;
+                for (i = 0, off = 0; i < rr->nsge && off < m->len; i++, off += n) {
+                    n = m->len - off < rr->sge[i].length ? m->len - off : rr->sge[i].length;
+                    memcpy((char *)(uintptr_t)rr->sge[i].addr, m->data + off, n);
+                }
+                CHECK(off == m->len, "message of %u bytes overruns a RR of %u", m->len, off);
+            }
+            if (m->opcode != IBV_WR_SEND) {
+                wc.wc_flags = IBV_WC_WITH_IMM;
+                wc.imm_data = m->imm;
+            }
+            cq_push(qp->rcq, &wc);
+        }
+        if (m->signaled) {
+            memset(&wc, 0, sizeof(wc));
+            wc.wr_id = m->wr_id;
+            wc.status = IBV_WC_SUCCESS;
+            wc.opcode = m->opcode == IBV_WR_RDMA_WRITE ? IBV_WC_RDMA_WRITE : IBV_WC_SEND;
+            cq_push(qp->peer->scq, &wc);
+        }
+        qp->in = m->next;
+        if (!qp->in)
+            qp->in_tail = &qp->in;
+        free(m->data);
+        free(m);
+    }
+}
+
+static int qp_post(struct mqp *qp, struct ibv_send_wr *wr)
+{
+    struct mqp *to = qp->peer;
+    struct mmsg *m;
+    uint32_t off;
+    int i;
+
+    for (; wr; wr = wr->next) {
+        m = calloc(1, sizeof(*m));
+        m->opcode = wr->opcode;
+        m->wr_id = wr->wr_id;
+        m->signaled = !!(wr->send_flags & IBV_SEND_SIGNALED);
+        m->imm = wr->imm_data;
+        m->raddr = wr->wr.rdma.remote_addr;
+        for (i = 0; i < wr->num_sge; i++)
+            m->len += wr->sg_list[i].length;
+        m->data = malloc(m->len + 1);
+        for (i = 0, off = 0; i < wr->num_sge; off += wr->sg_list[i++].length)
+            memcpy(m->data + off, (char *)(uintptr_t)wr->sg_list[i].addr, wr->sg_list[i].length);
+        pthread_mutex_lock(&to->lock);
+        CHECK(!to->strict || m->opcode == IBV_WR_RDMA_WRITE || to->in || to->rq_head != to->rq_tail,
+              "SEND with no pool RR posted: credits overrun");
+        *to->in_tail = m;
+        to->in_tail = &m->next;
+        deliver(to);
+        pthread_mutex_unlock(&to->lock);
+    }
+    return 0;
+}
+
+static int qp_post_recv(struct mqp *qp, struct ibv_recv_wr *wr)
+{
+    struct mrr *rr;
+
+    pthread_mutex_lock(&qp->lock);
+    for (; wr; wr = wr->next) {
+        CHECK(qp->rq_tail - qp->rq_head < CQ_DEPTH && wr->num_sge <= SPLIT_IMM_MAX_SGE, "RQ overrun");
+        rr = &qp->rq[qp->rq_tail++ % CQ_DEPTH];
+        rr->wr_id = wr->wr_id;
+        rr->nsge = wr->num_sge;
+        memcpy(rr->sge, wr->sg_list, wr->num_sge * sizeof(*wr->sg_list));
+    }
+    deliver(qp);
+    pthread_mutex_unlock(&qp->lock);
+    return 0;
+}
+
+static int mock_post(void *ctx, int where, struct ibv_send_wr *wr)
+{
+    struct side *s = ctx;
+
+    return qp_post(where == SPLIT_IMM_CHUNKS ? &s->split : where == SPLIT_IMM_FC ? &s->fc : &s->user, wr);
+}
+
+static int mock_post_recv(void *ctx, int where, struct ibv_recv_wr *wr)
+{
+    struct side *s = ctx;
+
+    CHECK(where == SPLIT_IMM_POOL || where == SPLIT_IMM_FC, "post_recv to %d", where);
+    return qp_post_recv(where == SPLIT_IMM_POOL ? &s->split : &s->fc, wr);
+}
+
+static int mock_poll(void *ctx, int where, struct ibv_wc *wc, int block)
+{
+    struct side *s = ctx;
+
+    CHECK(where != SPLIT_IMM_USER, "poll on the user QP");
+    return cq_poll(where == SPLIT_IMM_CHUNKS ? &s->split_scq : where == SPLIT_IMM_POOL ? &s->split_rcq : &s->cq2,
+                   wc, block);
+}
+
+static const struct split_imm_ops mock_ops = {
+    .post       = mock_post,
+    .post_recv  = mock_post_recv,
+    .poll       = mock_poll,
+};
+
+static uint32_t pick_len(void)
+{
+    switch (rnd(8)) {
+    case 0:
+        return 1 + rnd(SPLIT_IMM_BUF - 1);              /* not split */
+    case 1:
+        return SPLIT_IMM_BUF - 1 + rnd(3);               /* around the head */
+    case 2:
+        return SPLIT_IMM_BUF + 1 + rnd(2 * SPLIT_IMM_BUF);
+    case 3:
+        return SPLIT_IMM_RRS * SPLIT_IMM_BUF + rnd(MAX_LEN - SPLIT_IMM_RRS * SPLIT_IMM_BUF);
+    default:
+        return SPLIT_IMM_BUF + rnd(1 << 20);
+    }
+}
+
+static void make_plan(struct side *s)
+{
+    static const uint32_t chunks[] = { 4096, 5000, 65536, 100000, 1 << 20 };
+    static const enum ibv_wr_opcode ops[] = { IBV_WR_SEND, IBV_WR_SEND_WITH_IMM, IBV_WR_RDMA_WRITE_WITH_IMM };
+    struct plan *p;
+    int i;
+
+    tseed = s->seed;
+    s->tx_plan = calloc(nmsg, sizeof(*s->tx_plan));
+    for (i = 0; i < nmsg; i++) {
+        p = &s->tx_plan[i];
+        p->opcode = ops[rnd(3)];
+        p->len = pick_len();
+        p->nsge = 1 + rnd(8);
+        p->unsplit = !rnd(8);
+        if ((uint32_t)p->nsge > p->len)
+            p->nsge = p->len;
+        p->cut.chunk = chunks[rnd(5)];
+        p->cut.batch = 1 + rnd(16);
+        p->cut.signal = 1 + rnd(8);
+    }
+}
+
+/* cut [base, base + len) into n pieces with gaps behind them */
+static int scatter_list(char *base, uint32_t len, int n, struct ibv_sge *sge)
+{
+    uint32_t off = 0, gap = 0, piece, avg;
+    int i;
+
+    for (i = 0; i < n && off < len; i++) {
+        avg = (len - off) / (n - i);
+        piece = i == n - 1 ? len - off : 1 + (avg ? rnd(2 * avg) : 0);
+        if (piece > len - off)
+            piece = len - off;
+        sge[i].addr = (uintptr_t)(base + off + gap);
+        sge[i].length = piece;
+        sge[i].lkey = 0;
+        off += piece;
+        gap += rnd(64);
+    }
+    return i;
+}
+
+static void post_user_rr(struct side *s, int k)
+{
+    struct ibv_recv_wr rwr;
+
+    memset(&rwr, 0, sizeof(rwr));
+    s->rr[k].wr_id = k;
+    s->rr[k].nsge = scatter_list(s->rr_buf[k], MAX_LEN, 1 + rnd(SPLIT_IMM_MAX_SGE), s->rr[k].sge);
+    rwr.wr_id = k;
+    rwr.sg_list = s->rr[k].sge;
+    rwr.num_sge = s->rr[k].nsge;
+    qp_post_recv(&s->user, &rwr);
+}
+
+static void *sender(void *arg)
+{
+    struct side *s = arg;
+    struct ibv_send_wr wr;
+    struct ibv_sge sge[8];
+    struct ibv_wc wc;
+    struct plan *p;
+    char *dst;
+    uint32_t off;
+    int i, j;
+
+    tseed = s->seed * 3 + 1;
+    for (i = 0; i < nmsg; i++) {
+        p = &s->tx_plan[i];
+        memset(&wr, 0, sizeof(wr));
+        wr.num_sge = scatter_list(s->send_buf, p->len, p->nsge, sge);
+        for (j = 0, off = 0; j < wr.num_sge; off += sge[j++].length)
+            for (dst = (char *)(uintptr_t)sge[j].addr; dst < (char *)(uintptr_t)sge[j].addr + sge[j].length; dst++)
+                *dst = pattern(s->id, i, off + (dst - (char *)(uintptr_t)sge[j].addr));
+        wr.wr_id = 1000000 + i;
+        wr.sg_list = sge;
+        wr.opcode = p->opcode;
+        wr.send_flags = IBV_SEND_SIGNALED;
+        wr.imm_data = htonl(i);
+        if (p->opcode == IBV_WR_RDMA_WRITE_WITH_IMM) {
+            while (i - __atomic_load_n(&s->peer->received, __ATOMIC_ACQUIRE) >= WIMM_SLOTS)
+                sched_yield();
+            wr.wr.rdma.remote_addr = (uintptr_t)(s->peer->wimm + (size_t)(i % WIMM_SLOTS) * MAX_LEN);
+        }
+        if (!p->unsplit && split_imm_splits(&wr))
+            CHECK(!split_imm_send(&mock_ops, s, &s->st, &wr, &p->cut), "split send %d", i);
+        else
+            qp_post(&s->user, &wr);
+        cq_poll(&s->user_scq, &wc, 1);
+        CHECK(wc.wr_id == wr.wr_id, "head completion %lu for message %d", (unsigned long)wc.wr_id, i);
+    }
+    return NULL;
+}
+
+/* check message i, whose (head's) completion is wc, and give its RR back */
+static void check_msg(struct side *s, int i, const struct ibv_wc *wc)
+{
+    struct plan *p = &s->peer->tx_plan[i];
+    struct mrr *rr;
+    uint32_t len = wc->byte_len, off, n;
+    const char *src;
+    int j, k, wimm;
+
+    CHECK(wc->status == IBV_WC_SUCCESS, "message %d", i);
+    wimm = wc->opcode == IBV_WC_RECV_RDMA_WITH_IMM;
+    CHECK(wimm == (p->opcode == IBV_WR_RDMA_WRITE_WITH_IMM), "message %d opcode %d", i, wc->opcode);
+    CHECK(!!(wc->wc_flags & IBV_WC_WITH_IMM) == (p->opcode != IBV_WR_SEND), "message %d flags", i);
+    if (p->opcode != IBV_WR_SEND)
+        CHECK(ntohl(wc->imm_data) == (uint32_t)i, "message %d imm %u", i, ntohl(wc->imm_data));
+    k = wc->wr_id;
+    rr = &s->rr[k];
+    CHECK(len == p->len, "message %d: %u bytes, sent %u", i, len, p->len);
+    if (wimm) {
+        src = s->wimm + (size_t)(i % WIMM_SLOTS) * MAX_LEN;
+        for (off = 0; off < len; off++)
+            CHECK((uint8_t)src[off] == pattern(!s->id, i, off), "message %d byte %u", i, off);
+    } else {
+        for (j = 0, off = 0; j < rr->nsge && off < len; j++)
+            for (n = 0, src = (char *)(uintptr_t)rr->sge[j].addr; n < rr->sge[j].length && off < len; n++, off++)
+                CHECK((uint8_t)src[n] == pattern(!s->id, i, off), "message %d byte %u", i, off);
+    }
+    __atomic_store_n(&s->received, i + 1, __ATOMIC_RELEASE);
+    post_user_rr(s, k);
+}
+
+static void *receiver(void *arg)
+{
+    struct side *s = arg;
+    struct held held[USER_RRS];
+    struct split_imm_msg msg;
+    struct ibv_wc *wc;
+    struct mrr *rr;
+    int i = 0, j, nheld = 0, busy, ret;
+
+    tseed = s->seed * 5 + 2;
+    while (i < nmsg) {
+        busy = 0;
+        if (nheld < USER_RRS && cq_poll(&s->user_rcq, &held[nheld].wc, 0)) {
+            busy = 1;
+            wc = &held[nheld].wc;
+            held[nheld++].head = wc->status == IBV_WC_SUCCESS && (wc->wc_flags & IBV_WC_WITH_IMM) &&
+                                 SPLIT_IMM_IS_HEAD(wc->imm_data);
+        }
+        // the oldest head takes what has landed of its tail
+        for (j = 0; j < nheld && !held[j].head; j++)
+            ;
+        if (j < nheld) {
+            wc = &held[j].wc;
+            rr = &s->rr[wc->wr_id];
+            ret = split_imm_recv(&mock_ops, s, &s->st, wc->imm_data, wc->opcode == IBV_WC_RECV_RDMA_WITH_IMM,
+                                 rr->sge, rr->nsge, 0, &msg);
+            if (ret != EAGAIN) {
+                CHECK(!ret, "split recv %d: %d", i + j, ret);
+                CHECK(wc->byte_len == SPLIT_IMM_BUF, "head of %u bytes", wc->byte_len);
+                wc->byte_len = msg.byte_len;
+                wc->imm_data = msg.imm;
+                wc->wc_flags = msg.with_imm ? wc->wc_flags : (wc->wc_flags & ~IBV_WC_WITH_IMM);
+                held[j].head = 0;
+            }
+        }
+        for (; nheld && !held[0].head; nheld--, busy = 1) {
+            check_msg(s, i++, &held[0].wc);
+            memmove(&held[0], &held[1], (nheld - 1) * sizeof(held[0]));
+        }
+        if (!busy)
+            sched_yield();
+    }
+    return NULL;
+}
+
+static void side_init(struct side *s, int id, unsigned seed)
+{
+    int k;
+
+    s->id = id;
+    s->seed = seed * 2 + id;
+    cq_init(&s->user_scq);
+    cq_init(&s->user_rcq);
+    cq_init(&s->split_scq);
+    cq_init(&s->split_rcq);
+    cq_init(&s->cq2);
+    qp_init(&s->user, &s->user_scq, &s->user_rcq, 0);
+    qp_init(&s->split, &s->split_scq, &s->split_rcq, 1);
+    qp_init(&s->fc, &s->cq2, &s->cq2, 0);
+    s->pool = malloc((size_t)SPLIT_IMM_RRS * SPLIT_IMM_BUF);
+    s->send_buf = malloc(2 * MAX_LEN);
+    s->wimm = malloc((size_t)WIMM_SLOTS * MAX_LEN);
+    for (k = 0; k < USER_RRS; k++)
+        s->rr_buf[k] = malloc(2 * MAX_LEN);
+    make_plan(s);
+}
+
+int main(int argc, char **argv)
+{
+    pthread_t th[4];
+    unsigned seed = 1;
+    long bytes = 0, split = 0;
+    int i, k, c;
+
+    while ((c = getopt(argc, argv, "n:s:")) != -1) {
+        switch (c) {
+        case 'n': nmsg = atoi(optarg); break;
+        case 's': seed = strtoul(optarg, NULL, 0); break;
+        default:
+            fprintf(stderr, "usage: %s [-n messages] [-s seed]\n", argv[0]);
+            return 1;
+        }
+    }
+    for (i = 0; i < 2; i++)
+        side_init(&sides[i], i, seed);
+    for (i = 0; i < 2; i++) {
+        struct side *s = &sides[i];
+
+        s->peer = &sides[!i];
+        s->user.peer = &s->peer->user;
+        s->split.peer = &s->peer->split;
+        s->fc.peer = &s->peer->fc;
+    }
+    for (i = 0; i < 2; i++) {
+        tseed = sides[i].seed;
+        CHECK(!split_imm_init(&mock_ops, &sides[i], &sides[i].st, sides[i].pool, 0), "init");
+        for (k = 0; k < USER_RRS; k++)
+            post_user_rr(&sides[i], k);
+    }
+    for (i = 0; i < 2; i++) {
+        pthread_create(&th[2 * i], NULL, sender, &sides[i]);
+        pthread_create(&th[2 * i + 1], NULL, receiver, &sides[i]);
+    }
+    for (i = 0; i < 4; i++)
+        pthread_join(th[i], NULL);
+
+    // every credit is with the sender, with the receiver to return, or in a
+    // credit message not yet polled
+    tseed = 7;
+    do {
+        for (i = 0, c = 0; i < 2; i++)
+            while (split_imm_fc_poll(&mock_ops, &sides[i], &sides[i].st, 0) > 0)
+                c = 1;
+    } while (c || sides[0].cq2.head != sides[0].cq2.tail || sides[1].cq2.head != sides[1].cq2.tail);
+    for (i = 0; i < 2; i++) {
+        CHECK(sides[i].st.credits + sides[!i].st.to_return == SPLIT_IMM_RRS,
+              "side %d: %d credits, peer holds %d", i, sides[i].st.credits, sides[!i].st.to_return);
+        CHECK(sides[i].st.fc_inflight == 0, "side %d: %d credit messages in flight", i, sides[i].st.fc_inflight);
+        for (k = 0; k < nmsg; k++) {
+            bytes += sides[i].tx_plan[k].len;
+            split += sides[i].tx_plan[k].len >= SPLIT_IMM_BUF;
+        }
+    }
+    printf("%d messages each way, %ld split, %.1f MB: ok\n", nmsg, split, bytes / 1e6);
+    return 0;
+}
@@ -0,0 +1,333 @@
+// Property check of the drivers' SGE- and chain-aware split (split_sgl.c).
+// Builds random WR chains (1-8 WRs of WRITE/READ/SEND, 1-16 SGEs each, some
+// zero-length, some far over the chunk size) over synthetic addresses, runs
+// split_sgl_post_chain() against a mock post/reap, and checks that:
+//  - every byte of every WR is moved exactly once, to remote_addr + its
+//    offset in the gather list, and every posted SGE lies inside one of the
+//    WR's own SGEs at the matching offset;
+//  - a chunk carries 1..SPLIT_SGL_MAX_SGE SGEs and at most the chunk size,
+//    and a postlist holds at most the batch size of chunks;
+//  - no more than signal-1 chunks in a row are unsignaled, the last chunk of
+//    a WR is signaled, and a postlist is only posted once at most two
+//    signaled chunks (or the ones it brings itself) are outstanding;
+//  - a WR's last piece reaches the user QP only after all of its chunks
+//    completed, with the original wr_id, flags, opcode and rkey and at most
+//    one chunk of data;
+//  - the user QP sees every WR once, in chain order, and the chain is left
+//    as it was passed, also when a post fails part way.
+// Half of the chains run with a template path (ops.prime/ops.burst) whose
+// chunks are turned back into WRs from the primed WR and checked the same.
+// In half of them the chunk size and batch change between postlists
+// (ops.recut), as when the pacer moves them in the middle of a message;
+// chunks and postlists are then checked against the cut they were made for.
+//
+// Usage: split_check [-n chains] [-s seed]
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+#include "split_sgl.h"
+
+#define MAX_WRS 8
+#define MAX_SGES 16
+#define ALONE_LEN 60000             /* a SEND this long takes the two-sided path */
+
+struct mock {
+    struct ibv_send_wr *wrs;
+    int nwr;
+    uint8_t *cover[MAX_WRS];        /* times each byte of a WR was moved */
+    int user_seen;                  /* WRs that reached the user QP (or ALONE) so far */
+    int outstanding;                /* signaled postlists not reaped */
+    int chunks_of_cur;              /* chunks posted for the WR being cut */
+    int unsignaled;                 /* chunks since the last signaled one */
+    struct split_sgl_cut cut;
+    int recut;                      /* vary cut.chunk and cut.batch in recut() */
+    const struct ibv_send_wr *tmpl; /* WR primed for burst() */
+    int fail_at, posts;             /* fail the fail_at'th post call */
+    long nchunks, nposts;
+};
+
+#define CHECK(c, ...) do { \
+    if (!(c)) { \
+        fprintf(stderr, "FAIL %s:%d: %s: ", __FILE__, __LINE__, #c); \
+        fprintf(stderr, __VA_ARGS__); \
+        fputc('\n', stderr); \
+        exit(1); \
+    } \
+} while (0)
+
+static int mock_classify(void *ctx, struct ibv_send_wr *wr, struct split_sgl_cut *cut)
+{
+    struct mock *m = ctx;
+
+    if (wr->opcode == IBV_WR_RDMA_WRITE || wr->opcode == IBV_WR_RDMA_READ) {
+        *cut = m->cut;
+        return split_sgl_bytes(wr) > m->cut.chunk ? SPLIT_SGL_CHUNKS : SPLIT_SGL_USER;
+    }
+    return wr->num_sge && wr->sg_list->length >= ALONE_LEN ? SPLIT_SGL_ALONE : SPLIT_SGL_USER;
+}
+
+/* the user's WR a posted one belongs to: remote_addr ranges are disjoint */
+static int owner(struct mock *m, const struct ibv_send_wr *w)
+{
+    int i;
+
+    for (i = 0; i < m->nwr; i++)
+        if (w->wr.rdma.remote_addr >= m->wrs[i].wr.rdma.remote_addr &&
+            w->wr.rdma.remote_addr <= m->wrs[i].wr.rdma.remote_addr + split_sgl_bytes(&m->wrs[i]))
+            return i;
+    CHECK(0, "remote_addr %#lx belongs to no WR", (unsigned long)w->wr.rdma.remote_addr);
+    return -1;
+}
+
+/* every SGE of w maps onto its owner's gather list at the right offset;
+ * only a WR posted as is may carry zero-length SGEs */
+static uint64_t account(struct mock *m, const struct ibv_send_wr *w, int k)
+{
+    const struct ibv_send_wr *u = &m->wrs[k];
+    uint64_t off = w->wr.rdma.remote_addr - u->wr.rdma.remote_addr, start, bytes = 0;
+    int i, j;
+
+    CHECK(w->opcode == u->opcode && w->wr.rdma.rkey == u->wr.rdma.rkey, "WR %d: opcode/rkey changed", k);
+    for (i = 0; i < w->num_sge; i++) {
+        const struct ibv_sge *s = &w->sg_list[i];
+
+        if (w == u && !s->length)
+            continue;
+        for (j = 0, start = 0; j < u->num_sge; start += u->sg_list[j].length, j++)
+            if (off < start + u->sg_list[j].length)
+                break;
+        CHECK(j < u->num_sge, "WR %d: offset %lu past the end", k, (unsigned long)off);
+        CHECK(s->length > 0 && off + s->length <= start + u->sg_list[j].length,
+              "WR %d: SGE of %u bytes at offset %lu leaves user SGE %d", k, s->length, (unsigned long)off, j);
+        CHECK(s->addr == u->sg_list[j].addr + (off - start) && s->lkey == u->sg_list[j].lkey,
+              "WR %d: SGE at offset %lu has the wrong address or lkey", k, (unsigned long)off);
+        for (uint64_t b = off; b < off + s->length; b++)
+            CHECK(++m->cover[k][b] == 1, "WR %d: byte %lu moved twice", k, (unsigned long)b);
+        off += s->length;
+        bytes += s->length;
+    }
+    return bytes;
+}
+
+static int mock_post(void *ctx, int where, struct ibv_send_wr *wr, struct ibv_send_wr **bad_wr)
+{
+    struct mock *m = ctx;
+    struct ibv_send_wr *w;
+    struct split_sgl_cut cut;
+    int n = 0, signaled = 0, k;
+
+    if (++m->posts == m->fail_at) {
+        *bad_wr = wr;
+        return 12;
+    }
+    m->nposts++;
+    if (where == SPLIT_SGL_CHUNKS) {
+        for (w = wr; w; w = w->next, n++) {
+            k = owner(m, w);
+            CHECK(k == m->user_seen, "chunk of WR %d while WR %d is due", k, m->user_seen);
+            CHECK(w->num_sge >= 1 && w->num_sge <= SPLIT_SGL_MAX_SGE, "chunk with %d SGEs", w->num_sge);
+            CHECK(account(m, w, k) <= m->cut.chunk, "chunk over %u bytes", m->cut.chunk);
+            if (w->send_flags & IBV_SEND_SIGNALED) {
+                m->unsignaled = 0;
+                signaled++;
+            } else {
+                CHECK(++m->unsignaled < m->cut.signal, "%d chunks in a row unsignaled", m->unsignaled);
+            }
+            m->chunks_of_cur++;
+            m->nchunks++;
+        }
+        CHECK(n <= m->cut.batch, "postlist of %d chunks, batch %d", n, m->cut.batch);
+        CHECK(m->outstanding + signaled <= 2 || m->outstanding == 0, "posted with %d signaled chunks outstanding", m->outstanding);
+        m->outstanding += signaled;
+        return 0;
+    }
+    for (w = wr; w; w = w->next) {
+        k = m->user_seen++;
+        CHECK(k < m->nwr, "more user WRs than the chain has");
+        if (w == &m->wrs[k]) {
+            /* posted as is */
+            CHECK(where == mock_classify(m, w, &cut) && m->chunks_of_cur == 0, "WR %d posted as is", k);
+            if (where == SPLIT_SGL_ALONE)
+                CHECK(!w->next, "ALONE posted with the chain behind it");
+            account(m, w, k);
+        } else {
+            CHECK(where == SPLIT_SGL_USER && !w->next, "last piece of WR %d", k);
+            CHECK(m->outstanding == 0, "last piece of WR %d before its chunks completed", k);
+            CHECK(m->unsignaled == 0, "last chunk of WR %d unsignaled", k);
+            CHECK(w->wr_id == m->wrs[k].wr_id && w->send_flags == m->wrs[k].send_flags,
+                  "last piece of WR %d lost wr_id/flags", k);
+            CHECK(w->num_sge <= SPLIT_SGL_MAX_SGE && account(m, w, k) <= m->cut.chunk, "last piece of WR %d too big", k);
+            CHECK(m->chunks_of_cur > 0, "WR %d cut without chunks", k);
+        }
+        m->chunks_of_cur = 0;
+    }
+    return 0;
+}
+
+static int mock_reap(void *ctx)
+{
+    struct mock *m = ctx;
+
+    CHECK(m->outstanding > 0, "reap with nothing signaled outstanding");
+    m->outstanding--;
+    return 0;
+}
+
+static uint32_t rnd(uint32_t n);
+
+/* refuse now and then, as a driver would for a WR its template cannot take */
+static int mock_prime(void *ctx, const struct ibv_send_wr *wr)
+{
+    struct mock *m = ctx;
+
+    CHECK(wr->num_sge == 1, "primed a WR with %d SGEs", wr->num_sge);
+    m->tmpl = rnd(8) ? wr : NULL;
+    return !m->tmpl;
+}
+
+static int mock_burst(void *ctx, const struct split_sgl_chunk *c, int n)
+{
+    struct mock *m = ctx;
+    struct ibv_send_wr swr[SPLIT_SGL_MAX_BATCH], *bad;
+    struct ibv_sge sge[SPLIT_SGL_MAX_BATCH];
+    int i;
+
+    CHECK(m->tmpl && n >= 1 && n <= SPLIT_SGL_MAX_BATCH, "burst of %d chunks", n);
+    for (i = 0; i < n; i++) {
+        CHECK(c[i].wr_id == (uint64_t)i + 1, "chunk %d has wr_id %lu", i, (unsigned long)c[i].wr_id);
+        swr[i] = *m->tmpl;
+        swr[i].sg_list = &sge[i];
+        swr[i].num_sge = 1;
+        swr[i].wr.rdma.remote_addr = c[i].raddr;
+        swr[i].send_flags = c[i].signaled ? IBV_SEND_SIGNALED : 0;
+        swr[i].next = i + 1 < n ? &swr[i + 1] : NULL;
+        sge[i].addr = c[i].addr;
+        sge[i].length = c[i].length;
+        sge[i].lkey = m->tmpl->sg_list->lkey;
+    }
+    return mock_post(ctx, SPLIT_SGL_CHUNKS, swr, &bad);
+}
+
+/* the pacer's chunk size and batch move now and then; the signal interval
+ * is the driver's own */
+static void mock_recut(void *ctx, const struct ibv_send_wr *wr, struct split_sgl_cut *cut)
+{
+    struct mock *m = ctx;
+
+    CHECK(owner(m, wr) == m->user_seen, "recut of a WR not being cut");
+    if (m->recut && !rnd(3)) {
+        m->cut.chunk = 1 + rnd(rnd(2) ? 64 : 2048);
+        m->cut.batch = 1 + rnd(rnd(2) ? 4 : SPLIT_SGL_MAX_BATCH);
+    }
+    *cut = m->cut;
+}
+
+static const struct split_sgl_ops mock_ops = {
+    .classify = mock_classify,
+    .post = mock_post,
+    .reap = mock_reap,
+    .recut = mock_recut,
+};
+
+static const struct split_sgl_ops mock_tmpl_ops = {
+    .classify = mock_classify,
+    .post = mock_post,
+    .reap = mock_reap,
+    .recut = mock_recut,
+    .prime = mock_prime,
+    .burst = mock_burst,
+};
+
+static uint32_t rnd(uint32_t n)
+{
+    return n ? (uint32_t)(random() % n) : 0;
+}
+
+int main(int argc, char **argv)
+{
+    static struct ibv_send_wr wrs[MAX_WRS], copy[MAX_WRS];
+    static struct ibv_sge sges[MAX_WRS][MAX_SGES], sges_copy[MAX_WRS][MAX_SGES];
+    static const enum ibv_wr_opcode ops[] = { IBV_WR_RDMA_WRITE, IBV_WR_RDMA_WRITE, IBV_WR_RDMA_READ, IBV_WR_SEND };
+    struct ibv_send_wr *bad;
+    struct mock m;
+    long n = 20000, failed = 0, chunks = 0, posts = 0, i;
+    int tmpl;
+    unsigned seed = 1;
+    uint64_t raddr;
+    int c, w, s, ret, big;
+
+    while ((c = getopt(argc, argv, "n:s:")) != -1) {
+        switch (c) {
+        case 'n': n = atol(optarg); break;
+        case 's': seed = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-n chains] [-s seed]\n", argv[0]);
+            return 1;
+        }
+    }
+    srandom(seed);
+
+    for (i = 0; i < n; i++) {
+        memset(&m, 0, sizeof(m));
+        m.wrs = wrs;
+        m.nwr = 1 + rnd(MAX_WRS);
+        m.cut.chunk = 1 + rnd(rnd(2) ? 64 : 2048);
+        m.cut.batch = 1 + rnd(rnd(2) ? 4 : SPLIT_SGL_MAX_BATCH);
+        m.cut.signal = 1 + rnd(rnd(2) ? 4 : 256);
+        m.fail_at = rnd(8) ? 0 : 1 + rnd(12);
+        m.recut = rnd(2);
+        tmpl = rnd(2);
+        raddr = 0x100000;
+        for (w = 0; w < m.nwr; w++) {
+            struct ibv_send_wr *u = &wrs[w];
+
+            memset(u, 0, sizeof(*u));
+            u->wr_id = 1000 + w;
+            u->opcode = ops[rnd(4)];
+            u->send_flags = rnd(2) ? IBV_SEND_SIGNALED : 0;
+            u->num_sge = tmpl && rnd(2) ? 1 : 1 + rnd(MAX_SGES);
+            u->sg_list = sges[w];
+            u->wr.rdma.remote_addr = raddr;
+            u->wr.rdma.rkey = 77 + w;
+            u->next = w + 1 < m.nwr ? &wrs[w + 1] : NULL;
+            big = rnd(3) == 0;
+            for (s = 0; s < u->num_sge; s++) {
+                sges[w][s].addr = ((uint64_t)(w + 1) << 32) + ((uint64_t)s << 24) + rnd(4096);
+                sges[w][s].length = rnd(5) == 0 ? 0 : 1 + rnd(big ? 4 * m.cut.chunk : 2 * m.cut.chunk / u->num_sge + 1);
+                sges[w][s].lkey = 1000 * w + s;
+            }
+            if (u->opcode == IBV_WR_SEND && rnd(4) == 0)
+                sges[w][0].length = ALONE_LEN;
+            m.cover[w] = calloc(split_sgl_bytes(u) + 1, 1);
+            raddr += split_sgl_bytes(u) + 1 + rnd(4096);    // keep remote ranges disjoint
+        }
+        memcpy(copy, wrs, sizeof(copy));
+        memcpy(sges_copy, sges, sizeof(sges_copy));
+
+        bad = NULL;
+        ret = split_sgl_post_chain(tmpl ? &mock_tmpl_ops : &mock_ops, &m, wrs, &bad);
+
+        CHECK(!memcmp(copy, wrs, sizeof(copy)) && !memcmp(sges_copy, sges, sizeof(sges_copy)),
+              "chain %ld: the user's WRs were changed", i);
+        if (ret) {
+            /* the user QP took every WR before the failing one, and nothing after it */
+            CHECK(m.fail_at && bad >= wrs && bad < wrs + m.nwr, "chain %ld: failed without a bad_wr", i);
+            CHECK(m.user_seen <= bad - wrs, "chain %ld: WRs behind bad_wr were posted", i);
+            failed++;
+        } else {
+            CHECK(m.user_seen == m.nwr && m.outstanding == 0, "chain %ld: %d of %d WRs posted", i, m.user_seen, m.nwr);
+            for (w = 0; w < m.nwr; w++)
+                for (uint64_t b = 0; b < split_sgl_bytes(&wrs[w]); b++)
+                    CHECK(m.cover[w][b] == 1, "chain %ld: WR %d byte %lu moved %d times",
+                          i, w, (unsigned long)b, m.cover[w][b]);
+        }
+        for (w = 0; w < m.nwr; w++)
+            free(m.cover[w]);
+        chunks += m.nchunks;
+        posts += m.nposts;
+    }
+    printf("%ld chains ok (%ld with an injected post failure): %ld chunks in %ld post calls\n", n, failed, chunks, posts);
+    return 0;
+}
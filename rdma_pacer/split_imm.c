@@ -0,0 +1,400 @@
+#include <string.h>
+#include <errno.h>
+#include "split_imm.h"
+
+/* a split send in progress */
+struct split_tx {
+    const struct split_imm_ops *ops;
+    void *ctx;
+    struct split_imm *st;
+    struct ibv_send_wr *head;
+    int head_out;
+    int outstanding;                /* signaled chunks not reaped yet */
+};
+
+static void put_be64(unsigned char *p, uint64_t v)
+{
+    int i;
+
+    for (i = 7; i >= 0; i--, v >>= 8)
+        p[i] = v & 0xff;
+}
+
+static uint64_t get_be64(const unsigned char *p)
+{
+    uint64_t v = 0;
+    int i;
+
+    for (i = 0; i < 8; i++)
+        v = v << 8 | p[i];
+    return v;
+}
+
+static void put_be32(unsigned char *p, uint32_t v)
+{
+    int i;
+
+    for (i = 3; i >= 0; i--, v >>= 8)
+        p[i] = v & 0xff;
+}
+
+static uint32_t get_be32(const unsigned char *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static int post_pool(const struct split_imm_ops *ops, void *ctx, struct split_imm *st, uint64_t i)
+{
+    struct ibv_sge sge;
+    struct ibv_recv_wr rwr;
+
+    sge.addr = (uintptr_t)(st->pool + i * SPLIT_IMM_BUF);
+    sge.length = SPLIT_IMM_BUF;
+    sge.lkey = st->lkey;
+    memset(&rwr, 0, sizeof(rwr));
+    rwr.wr_id = i;
+    rwr.sg_list = &sge;
+    rwr.num_sge = 1;
+    return ops->post_recv(ctx, SPLIT_IMM_POOL, &rwr);
+}
+
+static int post_fc(const struct split_imm_ops *ops, void *ctx)
+{
+    struct ibv_recv_wr rwr;
+
+    memset(&rwr, 0, sizeof(rwr));
+    return ops->post_recv(ctx, SPLIT_IMM_FC, &rwr);
+}
+
+/* post the pool and the credit RRs, before the peer may send */
+int split_imm_init(const struct split_imm_ops *ops, void *ctx, struct split_imm *st,
+                   void *pool, uint32_t lkey)
+{
+    int i, ret;
+
+    memset(st, 0, sizeof(*st));
+    st->pool = pool;
+    st->lkey = lkey;
+    st->credits = SPLIT_IMM_RRS;
+    for (i = 0; i < SPLIT_IMM_RRS; i++) {
+        ret = post_pool(ops, ctx, st, i);
+        if (ret)
+            return ret;
+    }
+    for (i = 0; i < SPLIT_IMM_FC_RRS; i++) {
+        ret = post_fc(ops, ctx);
+        if (ret)
+            return ret;
+    }
+    return 0;
+}
+
+int split_imm_splits(const struct ibv_send_wr *wr)
+{
+    return (wr->opcode == IBV_WR_SEND || wr->opcode == IBV_WR_SEND_WITH_IMM ||
+            wr->opcode == IBV_WR_RDMA_WRITE_WITH_IMM) && split_sgl_bytes(wr) >= SPLIT_IMM_BUF;
+}
+
+/* take one completion off split_qp2: credits from the peer, or one of our
+ * credit messages done; 1 if there was one, -errno on error */
+int split_imm_fc_poll(const struct split_imm_ops *ops, void *ctx, struct split_imm *st, int block)
+{
+    struct ibv_wc wc;
+    int ret;
+
+    ret = ops->poll(ctx, SPLIT_IMM_FC, &wc, block);
+    if (ret <= 0)
+        return ret;
+    if (wc.status != IBV_WC_SUCCESS)
+        return -EIO;
+    if (!(wc.opcode & IBV_WC_RECV)) {
+        __atomic_sub_fetch(&st->fc_inflight, 1, __ATOMIC_RELAXED);
+        return 1;
+    }
+    if (!(wc.wc_flags & IBV_WC_WITH_IMM) || SPLIT_IMM_TYPE(wc.imm_data) != SPLIT_IMM_CREDIT)
+        return -EPROTO;
+    __atomic_add_fetch(&st->credits, SPLIT_IMM_VAL(wc.imm_data), __ATOMIC_RELEASE);
+    ret = post_fc(ops, ctx);
+    return ret ? -ret : 1;
+}
+
+/* wait for the oldest signaled chunk */
+static int reap(struct split_tx *tx)
+{
+    struct ibv_wc wc;
+    int ret;
+
+    ret = tx->ops->poll(tx->ctx, SPLIT_IMM_CHUNKS, &wc, 1);
+    if (ret < 0)
+        return -ret;
+    if (wc.status != IBV_WC_SUCCESS)
+        return EIO;
+    tx->outstanding--;
+    return 0;
+}
+
+static int post_head(struct split_tx *tx)
+{
+    tx->head_out = 1;
+    return tx->ops->post(tx->ctx, SPLIT_IMM_USER, tx->head);
+}
+
+/* take up to want credits, at least one. With none left, the head goes
+ * first if any of the tail is out: the peer returns credits behind it */
+static int take_credits(struct split_tx *tx, int tail_out, int want, int *got)
+{
+    struct split_imm *st = tx->st;
+    int c, ret;
+
+    while (!(c = __atomic_load_n(&st->credits, __ATOMIC_ACQUIRE))) {
+        if (tail_out && !tx->head_out) {
+            ret = post_head(tx);
+            if (ret)
+                return ret;
+        }
+        ret = split_imm_fc_poll(tx->ops, tx->ctx, st, 1);
+        if (ret < 0)
+            return -ret;
+    }
+    if (want > c)
+        want = c;
+    __atomic_sub_fetch(&st->credits, want, __ATOMIC_RELAXED);
+    *got = want;
+    return 0;
+}
+
+/* post the tail of wr (everything behind the head) to the split QP in
+ * postlists of cut->batch chunks, signaled as split_sgl_post_chain() does;
+ * *npool is how many went into the peer's pool */
+static int send_tail(struct split_tx *tx, struct ibv_send_wr *wr, struct split_sgl *it,
+                     const struct split_sgl_cut *cut, uint8_t seq, uint32_t *npool)
+{
+    struct ibv_send_wr swr[SPLIT_SGL_MAX_BATCH];
+    struct ibv_sge sge[SPLIT_SGL_MAX_BATCH][SPLIT_SGL_MAX_SGE];
+    int wimm = wr->opcode == IBV_WR_RDMA_WRITE_WITH_IMM;
+    uint32_t chunk = cut->chunk, idx = 0;
+    int n, room, sig, signaled, unsignaled = 0, ret;
+
+    if (!wimm && chunk > SPLIT_IMM_BUF)
+        chunk = SPLIT_IMM_BUF;
+    while (split_sgl_left(it)) {
+        room = cut->batch;
+        if (!wimm) {
+            ret = take_credits(tx, idx > 0, room, &room);
+            if (ret)
+                return ret;
+        }
+        for (n = 0, signaled = 0; n < room && split_sgl_left(it); n++) {
+            split_sgl_next(it, chunk, SPLIT_SGL_MAX_SGE, &swr[n], sge[n]);
+            swr[n].wr_id = idx;
+            if (wimm) {
+                swr[n].opcode = IBV_WR_RDMA_WRITE;
+            } else {
+                swr[n].opcode = IBV_WR_SEND_WITH_IMM;
+                swr[n].imm_data = SPLIT_IMM_MAKE(SPLIT_IMM_DATA, seq, idx);
+            }
+            idx++;
+            sig = ++unsignaled >= cut->signal || !split_sgl_left(it);
+            swr[n].send_flags = sig ? IBV_SEND_SIGNALED : 0;
+            if (sig) {
+                unsignaled = 0;
+                signaled++;
+            }
+            if (n)
+                swr[n - 1].next = &swr[n];
+        }
+        if (!wimm && room > n)
+            __atomic_add_fetch(&tx->st->credits, room - n, __ATOMIC_RELAXED);
+        for (; tx->outstanding && tx->outstanding + signaled > 2; ) {
+            ret = reap(tx);
+            if (ret)
+                return ret;
+        }
+        ret = tx->ops->post(tx->ctx, SPLIT_IMM_CHUNKS, swr);
+        if (ret)
+            return ret;
+        tx->outstanding += signaled;
+    }
+    *npool = wimm ? 0 : idx;
+    return 0;
+}
+
+/* the LAST of every tail: its length and the user's immediate */
+static int send_last(struct split_tx *tx, const struct ibv_send_wr *wr, uint64_t tail,
+                     uint32_t idx, uint8_t seq)
+{
+    struct ibv_send_wr swr;
+    struct ibv_sge sge;
+    unsigned char last[SPLIT_IMM_LAST_LEN];
+    int got, ret;
+
+    ret = take_credits(tx, tail > 0, 1, &got);
+    if (ret)
+        return ret;
+    put_be64(last, tail);
+    memcpy(last + 8, &wr->imm_data, 4);
+    put_be32(last + 12, wr->opcode != IBV_WR_SEND);
+    sge.addr = (uintptr_t)last;
+    sge.length = sizeof(last);
+    sge.lkey = 0;
+    memset(&swr, 0, sizeof(swr));
+    swr.opcode = IBV_WR_SEND_WITH_IMM;
+    swr.imm_data = SPLIT_IMM_MAKE(SPLIT_IMM_LAST, seq, idx);
+    swr.send_flags = IBV_SEND_SIGNALED | IBV_SEND_INLINE;
+    swr.sg_list = &sge;
+    swr.num_sge = 1;
+    ret = tx->ops->post(tx->ctx, SPLIT_IMM_CHUNKS, &swr);
+    if (ret)
+        return ret;
+    tx->outstanding++;
+    return 0;
+}
+
+/* post a two-sided WR that split_imm_splits(): tail, then head, unless the
+ * credits ran out first. The head goes out with the head immediate, a SEND
+ * as a SEND_WITH_IMM. Returns once every chunk completed, so the caller may
+ * reuse its buffers the way it would after a plain post */
+int split_imm_send(const struct split_imm_ops *ops, void *ctx, struct split_imm *st,
+                   struct ibv_send_wr *wr, const struct split_sgl_cut *cut)
+{
+    struct ibv_send_wr head;
+    struct ibv_sge head_sge[SPLIT_IMM_MAX_SGE];
+    struct split_tx tx = { ops, ctx, st, &head, 0, 0 };
+    struct split_sgl it;
+    int wimm = wr->opcode == IBV_WR_RDMA_WRITE_WITH_IMM;
+    uint8_t seq = st->tx_seq++;
+    uint32_t npool = 0;
+    uint64_t tail;
+    int ret;
+
+    if (wr->num_sge > SPLIT_IMM_MAX_SGE)
+        return EINVAL;
+    split_sgl_init(&it, wr);
+    split_sgl_next(&it, SPLIT_IMM_BUF, SPLIT_IMM_MAX_SGE, &head, head_sge);
+    head.opcode = wimm ? IBV_WR_RDMA_WRITE_WITH_IMM : IBV_WR_SEND_WITH_IMM;
+    head.imm_data = SPLIT_IMM_MAKE(SPLIT_IMM_HEAD, seq, SPLIT_IMM_HEAD_MAGIC);
+    tail = split_sgl_left(&it);
+    ret = send_tail(&tx, wr, &it, cut, seq, &npool);
+    if (!ret)
+        ret = send_last(&tx, wr, tail, npool, seq);
+    while (!ret && tx.outstanding)
+        ret = reap(&tx);
+    if (!ret && !tx.head_out)
+        ret = post_head(&tx);
+    return ret;
+}
+
+static int return_credits(const struct split_imm_ops *ops, void *ctx, struct split_imm *st)
+{
+    struct ibv_send_wr swr;
+    int ret;
+
+    while (__atomic_load_n(&st->fc_inflight, __ATOMIC_ACQUIRE) >= SPLIT_IMM_FC_RRS) {
+        ret = split_imm_fc_poll(ops, ctx, st, 1);
+        if (ret < 0)
+            return -ret;
+    }
+    memset(&swr, 0, sizeof(swr));
+    swr.opcode = IBV_WR_SEND_WITH_IMM;
+    swr.imm_data = SPLIT_IMM_MAKE(SPLIT_IMM_CREDIT, 0, st->to_return);
+    swr.send_flags = IBV_SEND_SIGNALED;
+    __atomic_add_fetch(&st->fc_inflight, 1, __ATOMIC_RELAXED);
+    ret = ops->post(ctx, SPLIT_IMM_FC, &swr);
+    if (ret) {
+        __atomic_sub_fetch(&st->fc_inflight, 1, __ATOMIC_RELAXED);
+        return ret;
+    }
+    st->to_return = 0;
+    return 0;
+}
+
+/* copy len bytes to offset off of the scatter list; nonzero if they do not
+ * fit */
+static int scatter(const struct ibv_sge *scat, int nscat, uint64_t off, const char *src, uint32_t len)
+{
+    uint32_t n;
+    int i;
+
+    for (i = 0; i < nscat && len; i++) {
+        if (off >= scat[i].length) {
+            off -= scat[i].length;
+            continue;
+        }
+        n = scat[i].length - off;
+        if (n > len)
+            n = len;
+        memcpy((char *)(uintptr_t)scat[i].addr + off, src, n);
+        src += n;
+        len -= n;
+        off = 0;
+    }
+    return len != 0;
+}
+
+/* the tail behind a head, a completion whose immediate is head_imm, that
+ * arrived in a RR with scatter list scat. Takes what has landed in the pool
+ * (waits for the rest if block) and returns EAGAIN until the LAST has; then
+ * 0 and *msg, or ENOSPC if the tail did not fit, in which case it is still
+ * consumed. Call again with the same head until it is done */
+int split_imm_recv(const struct split_imm_ops *ops, void *ctx, struct split_imm *st,
+                   uint32_t head_imm, int wimm, const struct ibv_sge *scat, int nscat,
+                   int block, struct split_imm_msg *msg)
+{
+    struct ibv_wc wc;
+    const unsigned char *buf;
+    uint64_t tail;
+    int type, ret;
+
+    if (SPLIT_IMM_SEQ(head_imm) != st->rx_seq)
+        return EPROTO;
+    if (!st->rx_busy) {
+        st->rx_busy = 1;
+        st->rx_idx = 0;
+        st->rx_got = SPLIT_IMM_BUF;
+        st->rx_err = 0;
+    }
+    do {
+        ret = ops->poll(ctx, SPLIT_IMM_POOL, &wc, block);
+        if (ret < 0)
+            return -ret;
+        if (!ret)
+            return EAGAIN;
+        if (wc.status != IBV_WC_SUCCESS || wc.wr_id >= SPLIT_IMM_RRS)
+            return EIO;
+        type = SPLIT_IMM_TYPE(wc.imm_data);
+        if (!(wc.wc_flags & IBV_WC_WITH_IMM) || (type != SPLIT_IMM_DATA && type != SPLIT_IMM_LAST) ||
+            SPLIT_IMM_SEQ(wc.imm_data) != st->rx_seq || SPLIT_IMM_VAL(wc.imm_data) != st->rx_idx)
+            return EPROTO;
+        buf = (const unsigned char *)st->pool + wc.wr_id * SPLIT_IMM_BUF;
+        if (type == SPLIT_IMM_DATA) {
+            if (wimm)
+                return EPROTO;
+            if (scatter(scat, nscat, st->rx_got, (const char *)buf, wc.byte_len))
+                st->rx_err = ENOSPC;
+            st->rx_got += wc.byte_len;
+        } else {
+            if (wc.byte_len != SPLIT_IMM_LAST_LEN)
+                return EPROTO;
+            tail = get_be64(buf);
+            if (wimm)
+                st->rx_got += tail;
+            else if (tail != st->rx_got - SPLIT_IMM_BUF)
+                return EPROTO;
+            memcpy(&msg->imm, buf + 8, 4);
+            msg->with_imm = get_be32(buf + 12);
+        }
+        st->rx_idx++;
+        ret = post_pool(ops, ctx, st, wc.wr_id);
+        if (ret)
+            return ret;
+        if (++st->to_return >= SPLIT_IMM_RRS / 2) {
+            ret = return_credits(ops, ctx, st);
+            if (ret)
+                return ret;
+        }
+    } while (type != SPLIT_IMM_LAST);
+    msg->byte_len = st->rx_got;
+    st->rx_busy = 0;
+    st->rx_seq++;
+    return st->rx_err;
+}
@@ -0,0 +1,215 @@
+#include "split_sgl.h"
+
+uint64_t split_sgl_bytes(const struct ibv_send_wr *wr)
+{
+    uint64_t n = 0;
+    int i;
+
+    for (i = 0; i < wr->num_sge; i++)
+        n += wr->sg_list[i].length;
+    return n;
+}
+
+void split_sgl_init(struct split_sgl *it, const struct ibv_send_wr *wr)
+{
+    it->wr = wr;
+    it->idx = 0;
+    it->off = 0;
+    it->done = 0;
+    it->total = split_sgl_bytes(wr);
+}
+
+/* fill swr (a copy of the WR, next cleared) and sge[] with the next chunk of
+ * at most len bytes and max_sge SGEs; returns its length, 0 once the WR is
+ * used up */
+uint32_t split_sgl_next(struct split_sgl *it, uint32_t len, int max_sge,
+                        struct ibv_send_wr *swr, struct ibv_sge *sge)
+{
+    const struct ibv_send_wr *wr = it->wr;
+    const struct ibv_sge *s;
+    uint32_t got = 0, piece;
+    int n = 0;
+
+    *swr = *wr;
+    swr->next = NULL;
+    swr->sg_list = sge;
+    swr->wr.rdma.remote_addr = wr->wr.rdma.remote_addr + it->done;
+    while (got < len && n < max_sge && it->idx < wr->num_sge) {
+        s = &wr->sg_list[it->idx];
+        piece = s->length - it->off;
+        if (piece > len - got)
+            piece = len - got;
+        if (piece) {
+            sge[n].addr = s->addr + it->off;
+            sge[n].length = piece;
+            sge[n].lkey = s->lkey;
+            n++;
+            got += piece;
+            it->off += piece;
+        }
+        if (it->off == s->length) {
+            it->idx++;
+            it->off = 0;
+        }
+    }
+    swr->num_sge = n;
+    it->done += got;
+    return got;
+}
+
+/* like split_sgl_next() for a single-SGE WR, without building a WR; wr_id
+ * and signaled are left to the caller */
+uint32_t split_sgl_next_1(struct split_sgl *it, uint32_t len, struct split_sgl_chunk *c)
+{
+    const struct ibv_sge *s = it->wr->sg_list;
+    uint32_t got = s->length - it->off;
+
+    if (got > len)
+        got = len;
+    c->raddr = it->wr->wr.rdma.remote_addr + it->done;
+    c->addr = s->addr + it->off;
+    c->length = got;
+    it->off += got;
+    it->done += got;
+    return got;
+}
+
+/* whether the split QP takes another chunk: the rest is over the chunk size,
+ * or spans more SGEs than one WR of ours can carry */
+int split_sgl_more(const struct split_sgl *it, uint32_t chunk)
+{
+    int i, n;
+
+    if (split_sgl_left(it) > chunk)
+        return 1;
+    for (i = it->idx, n = 0; i < it->wr->num_sge; i++)
+        if (it->wr->sg_list[i].length > (i == it->idx ? it->off : 0))
+            n++;
+    return n > SPLIT_SGL_MAX_SGE;
+}
+
+/* whether any WR of the chain needs more than posting as is */
+int split_sgl_chain_splits(const struct split_sgl_ops *ops, void *ctx, struct ibv_send_wr *wr)
+{
+    struct split_sgl_cut cut;
+
+    for (; wr; wr = wr->next)
+        if (ops->classify(ctx, wr, &cut) != SPLIT_SGL_USER)
+            return 1;
+    return 0;
+}
+
+/* post wr..last as one postlist, the chain cut behind last for the call */
+static int post_run(const struct split_sgl_ops *ops, void *ctx, int where,
+                    struct ibv_send_wr *wr, struct ibv_send_wr *last, struct ibv_send_wr **bad_wr)
+{
+    struct ibv_send_wr *next = last->next;
+    int ret;
+
+    last->next = NULL;
+    ret = ops->post(ctx, where, wr, bad_wr);
+    last->next = next;
+    return ret;
+}
+
+/* cut one WR; the chunks reuse swr/sge (or ch), which the post has copied
+ * into WQEs */
+static int post_chunks(const struct split_sgl_ops *ops, void *ctx,
+                       struct ibv_send_wr *wr, const struct split_sgl_cut *cut)
+{
+    struct split_sgl_cut c = *cut;
+    struct ibv_send_wr swr[SPLIT_SGL_MAX_BATCH], *bad;
+    struct ibv_sge sge[SPLIT_SGL_MAX_BATCH][SPLIT_SGL_MAX_SGE];
+    struct split_sgl_chunk ch[SPLIT_SGL_MAX_BATCH];
+    struct split_sgl it;
+    int n, sig, signaled, unsignaled = 0, outstanding = 0, ret;
+    int tmpl = ops->prime && wr->num_sge == 1 && !ops->prime(ctx, wr);
+
+    split_sgl_init(&it, wr);
+    while (split_sgl_more(&it, c.chunk)) {
+        for (n = 0, signaled = 0; n < c.batch && split_sgl_more(&it, c.chunk); n++) {
+            if (tmpl)
+                split_sgl_next_1(&it, c.chunk, &ch[n]);
+            else
+                split_sgl_next(&it, c.chunk, SPLIT_SGL_MAX_SGE, &swr[n], sge[n]);
+            sig = ++unsignaled >= c.signal || !split_sgl_more(&it, c.chunk);
+            if (sig) {
+                unsignaled = 0;
+                signaled++;
+            }
+            if (tmpl) {
+                ch[n].wr_id = n + 1;
+                ch[n].signaled = sig;
+                continue;
+            }
+            swr[n].wr_id = n + 1;
+            if (sig)
+                swr[n].send_flags |= IBV_SEND_SIGNALED;
+            else
+                swr[n].send_flags &= ~IBV_SEND_SIGNALED;
+            if (n)
+                swr[n - 1].next = &swr[n];
+        }
+        for (; outstanding && outstanding + signaled > 2; outstanding--) {
+            ret = ops->reap(ctx);
+            if (ret)
+                return ret;
+        }
+        ret = tmpl ? ops->burst(ctx, ch, n) : ops->post(ctx, SPLIT_SGL_CHUNKS, swr, &bad);
+        if (ret)
+            return ret;
+        outstanding += signaled;
+        if (ops->recut && split_sgl_more(&it, c.chunk)) {
+            uint32_t chunk = c.chunk;
+
+            /* the chunk before the last piece stays the signaled one */
+            ops->recut(ctx, wr, &c);
+            if (!split_sgl_more(&it, c.chunk))
+                c.chunk = chunk;
+        }
+    }
+    for (; outstanding; outstanding--) {
+        ret = ops->reap(ctx);
+        if (ret)
+            return ret;
+    }
+    split_sgl_next(&it, c.chunk, SPLIT_SGL_MAX_SGE, &swr[0], sge[0]);
+    return ops->post(ctx, SPLIT_SGL_USER, &swr[0], &bad);
+}
+
+/* post the chain in order; on error *bad_wr is the WR that failed and the
+ * chain is left as the caller passed it */
+int split_sgl_post_chain(const struct split_sgl_ops *ops, void *ctx,
+                         struct ibv_send_wr *wr, struct ibv_send_wr **bad_wr)
+{
+    struct ibv_send_wr *last;
+    struct split_sgl_cut cut;
+    int kind, ret;
+
+    while (wr) {
+        kind = ops->classify(ctx, wr, &cut);
+        if (kind == SPLIT_SGL_CHUNKS) {
+            ret = post_chunks(ops, ctx, wr, &cut);
+            if (ret) {
+                *bad_wr = wr;
+                return ret;
+            }
+            wr = wr->next;
+            continue;
+        }
+        if (kind == SPLIT_SGL_ALONE) {
+            ret = post_run(ops, ctx, SPLIT_SGL_ALONE, wr, wr, bad_wr);
+            if (ret)
+                return ret;
+            wr = wr->next;
+            continue;
+        }
+        for (last = wr; last->next && ops->classify(ctx, last->next, &cut) == SPLIT_SGL_USER; last = last->next)
+            ;
+        ret = post_run(ops, ctx, SPLIT_SGL_USER, wr, last, bad_wr);
+        if (ret)
+            return ret;
+        wr = last->next;
+    }
+    return 0;
+}
@@ -0,0 +1,93 @@
+#ifndef STATS_H
+#define STATS_H
+// Pacer telemetry in its own shared memory segment (the shared block's
+// name plus STATS_MEM_SUFFIX)
+//
+// Every record has a single writer: the token thread owns stats_token, the
+// monitor thread owns stats_cc and the cap history, flow_handler owns pids[]
+// and qpns[].
+// Writers never wait for readers. Monotonic counters are plain relaxed
+// stores; multi-field records (stats_cc, history entries) are seqlocked, so
+// a reader (pacer-stat) retries instead of seeing a torn record. Per-slot
+// byte, token and wait counters already live in shared_block.flows[] and are
+// read from there.
+#include <stdint.h>
+
+#define STATS_MEM_SUFFIX "-stats"   /* /rdma-fairness-stats by default */
+#define STATS_ABI_VERSION 3
+#define STATS_MAX_LINKS 4           /* must match MAX_SERVERS */
+#define STATS_MAX_SLOTS 512         /* must match MAX_FLOWS */
+#define STATS_HIST_LEN 4096         /* cap changes kept; ~0.8 s of AIMD rounds */
+
+/* written by the token thread (generate_fetch_tokens) */
+struct stats_token {
+    uint64_t tokens_generated;
+    uint64_t tokens_granted;
+    uint32_t chunk_size;            /* active chunk size of the link */
+    uint32_t chunk_changes;
+    uint32_t split_batch;           /* chunks one token covers */
+} __attribute__((aligned(64)));
+
+/* written by the monitor thread once per controller round */
+struct stats_cc {
+    uint32_t seq;                   /* odd while the record is being written */
+    uint32_t cap;                   /* controller output, MBps */
+    uint32_t shared_cap;            /* after sharing the line rate: virtual_link_cap */
+    uint32_t tail_ns;               /* latency the controller saw */
+    uint64_t rounds;
+    uint64_t increases;             /* rounds that raised shared_cap */
+    uint64_t decreases;             /* rounds that lowered it */
+} __attribute__((aligned(64)));
+
+struct stats_hist_entry {
+    uint32_t seq;                   /* odd while the entry is being written */
+    uint16_t link;
+    uint16_t pad;
+    uint32_t shared_cap;
+    uint32_t tail_ns;
+    uint64_t now_us;                /* since the pacer started */
+};
+
+struct stats_block {
+    uint32_t abi_version;
+    uint32_t num_links;
+    double cpu_mhz;                 /* converts flows[].wait_cycles */
+    char cc_name[16];
+    int32_t pids[STATS_MAX_SLOTS];  /* pid of each slot, -1 if never used */
+    uint32_t qpns[STATS_MAX_SLOTS]; /* QP of each slot, 0 for a whole process */
+    struct stats_token token[STATS_MAX_LINKS];
+    struct stats_cc cc[STATS_MAX_LINKS];
+    uint64_t hist_head;             /* entries ever written; next one goes to hist_head % STATS_HIST_LEN */
+    struct stats_hist_entry hist[STATS_HIST_LEN];
+};
+
+static inline void stats_write_begin(uint32_t *seq)
+{
+    __atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void stats_write_end(uint32_t *seq)
+{
+    __atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+}
+
+/* copy a seqlocked record; returns 0 if the writer got in the way */
+static inline int stats_read(const uint32_t *seq, void *dst, const void *src, unsigned len)
+{
+    uint32_t s1 = __atomic_load_n(seq, __ATOMIC_ACQUIRE), s2;
+    unsigned i;
+
+    if (s1 & 1)
+        return 0;
+    for (i = 0; i < len; i++)
+        ((char *)dst)[i] = __atomic_load_n((const char *)src + i, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    s2 = __atomic_load_n(seq, __ATOMIC_RELAXED);
+    return s1 == s2;
+}
+
+/* relaxed increment of a counter that only the caller writes */
+#define STATS_INC(x) __atomic_store_n(&(x), (x) + 1, __ATOMIC_RELAXED)
+
+#endif
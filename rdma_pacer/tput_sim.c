@@ -0,0 +1,193 @@
+// Fairness of throughput-class (tput) flows with different op sizes under
+// the two debit schemes, on a simulated clock with the pacer's token
+// scheduler (sched.c). No RDMA hardware or pacer daemon is needed.
+//
+// The pacer makes one token per token_bytes of link time and hands it to a
+// pending slot in DRR order, charging token_bytes. Each flow is a
+// backlogged tput QP posting postlists of k ops of its size. As
+// tput_debit() in libmlx4/src/qp.c does, it waits for a token whenever its
+// debit is used up, adds the token's credit, and charges its posts:
+//  - ops:   credit of DEFAULT_BATCH_OPS (1800, the old per-cluster constant),
+//           one per op, whatever its size;
+//  - bytes: credit of token_bytes (vlink_info.token_bytes), payload plus
+//           wqe_overhead per op (JUSTITIA_WQE_OVERHEAD).
+// For each scheme it reports what every flow put on the link (payload and
+// headers), the total against the link rate, and Jain's index over the
+// weight-normalized shares, for the whole run and for the worst 1 ms window.
+// The bytes scheme is checked to put on the link, within 1%, what the
+// tokens the scheduler granted each flow stand for, whatever its op size;
+// the split between weights is the scheduler's (sched_bench). Each set of
+// flows runs with 1 MB tokens (no latency flows) and with 65000-byte tokens
+// (5000-byte chunks, 13 to a token).
+//
+// Usage: tput_sim [-s 64,1024,4096,32768] [-w 1,1,1,1] [-k ops_per_post]
+//                 [-o wqe_overhead] [-r rate_MBps] [-t sim_ms]
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+#include "sched.h"
+
+#define MAX_SIM_FLOWS 16
+#define OLD_BATCH_OPS 1800          /* DEFAULT_BATCH_OPS, as the pacer had it */
+#define WINDOW_NS 1000000
+
+enum { SCHEME_OPS, SCHEME_BYTES };
+
+struct sim_flow {
+    uint32_t op_bytes;
+    uint32_t weight;
+    int64_t debit;
+    uint64_t wire;                  /* bytes put on the link, headers included */
+    uint64_t win_wire;              /* in the current window */
+    uint64_t tokens;                /* granted by the scheduler */
+};
+
+struct sim {
+    struct sim_flow flows[MAX_SIM_FLOWS];
+    int n;
+    int k;
+    uint32_t overhead;
+    uint32_t rate;                  /* MBps, i.e. bytes per us */
+};
+
+static void parse_list(const char *arg, uint32_t *v, int *n)
+{
+    char buf[256], *tok;
+
+    strncpy(buf, arg, sizeof(buf) - 1);
+    buf[sizeof(buf) - 1] = 0;
+    *n = 0;
+    for (tok = strtok(buf, ","); tok && *n < MAX_SIM_FLOWS; tok = strtok(NULL, ","))
+        v[(*n)++] = strtoul(tok, NULL, 10);
+}
+
+static double jain(const struct sim *s, int win)
+{
+    double x, sum = 0, sumsq = 0;
+    int i;
+
+    for (i = 0; i < s->n; i++) {
+        x = (double)(win ? s->flows[i].win_wire : s->flows[i].wire) / s->flows[i].weight;
+        sum += x;
+        sumsq += x * x;
+    }
+    return sumsq ? sum * sum / (s->n * sumsq) : 1;
+}
+
+// the flow got a token: post until its debit is used up again
+static void spend(struct sim *s, struct sim_flow *f, int scheme, uint32_t token_bytes)
+{
+    uint64_t cost = (uint64_t)s->k * (f->op_bytes + s->overhead);
+
+    f->debit += scheme == SCHEME_OPS ? OLD_BATCH_OPS : token_bytes;
+    while (f->debit > 0) {
+        f->debit -= scheme == SCHEME_OPS ? s->k : (int64_t)cost;
+        f->wire += cost;
+        f->win_wire += cost;
+    }
+}
+
+static void run(struct sim *s, int scheme, uint32_t token_bytes, uint64_t sim_ns, int verbose)
+{
+    static struct token_sched ts;
+    uint64_t ready[SCHED_MAP_WORDS] = { 0 };
+    uint64_t interval = (uint64_t)token_bytes * 1000 / s->rate, now, win_end = WINDOW_NS, total = 0;
+    double worst = 1, j;
+    int i;
+
+    sched_init(&ts, SCHED_DEFAULT_QUANTUM);
+    for (i = 0; i < s->n; i++) {
+        sched_set_slot(&ts, i, s->flows[i].weight, 0);
+        s->flows[i].debit = 0;
+        s->flows[i].wire = 0;
+        s->flows[i].win_wire = 0;
+        s->flows[i].tokens = 0;
+        sched_map_set(ready, i);    // backlogged: always pending when out of debit
+    }
+    for (now = interval; now <= sim_ns; now += interval) {
+        if ((i = sched_next(&ts, token_bytes, ready)) >= 0) {
+            s->flows[i].tokens++;
+            spend(s, &s->flows[i], scheme, token_bytes);
+        }
+        if (now >= win_end) {
+            if ((j = jain(s, 1)) < worst)
+                worst = j;
+            for (i = 0; i < s->n; i++)
+                s->flows[i].win_wire = 0;
+            win_end += WINDOW_NS;
+        }
+    }
+    for (i = 0; i < s->n; i++)
+        total += s->flows[i].wire;
+    if (verbose) {
+        printf("  %-5s", scheme == SCHEME_OPS ? "ops" : "bytes");
+        for (i = 0; i < s->n; i++)
+            printf(" %9.1f", s->flows[i].wire / (sim_ns / 1000.0));
+        printf("  total %8.1f MBps (%5.2fx link)  Jain %.4f, worst 1 ms %.4f\n",
+               total / (sim_ns / 1000.0), (double)total / (sim_ns / 1000.0) / s->rate, jain(s, 0), worst);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    static const uint32_t tokens[] = { 1000000, 65000 };
+    struct sim s;
+    uint32_t sizes[MAX_SIM_FLOWS] = { 64, 1024, 4096, 32768 }, weights[MAX_SIM_FLOWS];
+    int n_sizes = 4, n_weights = 0, c, i, t, fail = 0;
+    uint64_t sim_ms = 200;
+    double ratio;
+
+    memset(&s, 0, sizeof(s));
+    s.k = 16;
+    s.overhead = 100;
+    s.rate = 6000;
+    while ((c = getopt(argc, argv, "s:w:k:o:r:t:")) != -1) {
+        switch (c) {
+        case 's': parse_list(optarg, sizes, &n_sizes); break;
+        case 'w': parse_list(optarg, weights, &n_weights); break;
+        case 'k': s.k = atoi(optarg); break;
+        case 'o': s.overhead = atoi(optarg); break;
+        case 'r': s.rate = atoi(optarg); break;
+        case 't': sim_ms = strtoull(optarg, NULL, 10); break;
+        default:
+            printf("usage: %s [-s sizes] [-w weights] [-k ops_per_post] [-o wqe_overhead] [-r rate_MBps] [-t sim_ms]\n",
+                   argv[0]);
+            exit(1);
+        }
+    }
+    if (n_sizes < 1 || s.k < 1 || s.rate < 1 || sim_ms < 1 || (n_weights && n_weights != n_sizes)) {
+        printf("bad arguments\n");
+        exit(1);
+    }
+    s.n = n_sizes;
+    for (i = 0; i < s.n; i++) {
+        s.flows[i].op_bytes = sizes[i];
+        s.flows[i].weight = n_weights && weights[i] ? weights[i] : 1;
+    }
+
+    for (t = 0; t < 2; t++) {
+        printf("%u-byte tokens, %d ops per post, %u header bytes per op; MBps on the link per flow of\n",
+               tokens[t], s.k, s.overhead);
+        printf("       ");
+        for (i = 0; i < s.n; i++)
+            printf(" %6u B/%u", s.flows[i].op_bytes, s.flows[i].weight);
+        printf("\n");
+        run(&s, SCHEME_OPS, tokens[t], sim_ms * 1000000, 1);
+        run(&s, SCHEME_BYTES, tokens[t], sim_ms * 1000000, 1);
+
+        // every flow puts on the link what its tokens are worth
+        for (i = 0; i < s.n; i++) {
+            ratio = (double)s.flows[i].wire / ((double)s.flows[i].tokens * tokens[t]);
+            if (ratio < 0.99 || ratio > 1.01) {
+                printf("FAIL: flow of %u B ops sent %.3f of its tokens' bytes\n", s.flows[i].op_bytes, ratio);
+                fail = 1;
+            }
+        }
+    }
+    if (fail)
+        exit(1);
+    printf("byte debit fair across op sizes\n");
+    return 0;
+}
@@ -0,0 +1,214 @@
+// Driver-side token wait modes: CPU cost and grant-to-wakeup latency.
+// A fake pacer process hands out one token per interval through a flow_info
+// in shared memory (same grant path as grant_token(): clear "pending", then
+// flow_wake()); a fake driver process asks for tokens back to back and waits
+// in one of three ways:
+//   spin  - busy-wait on "pending" (default driver build)
+//   uds   - block in recv() on a 1-byte message per token (CPU_FRIENDLY build)
+//   futex - spin for a while, then FUTEX_WAIT on wake_seq (JUSTITIA_WAIT=futex)
+// The futex wait below mirrors wait_for_token()/flow_sleep() in the drivers,
+// with clock_gettime() standing in for get_cycles().
+//
+// Usage: wait_bench [-i token_interval_us] [-t ms] [-s spin_us]
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include "pacer.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
+
+#define MAX_SAMPLES (1 << 20)
+
+enum { MODE_SPIN, MODE_UDS, MODE_FUTEX, NUM_MODES };
+static const char *mode_names[] = {"spin", "uds", "futex"};
+
+struct bench_block {
+    struct flow_info flow;
+    volatile int stop;
+    uint64_t grant_ns;              /* when the pacer cleared "pending" */
+    uint64_t tokens;
+    double driver_cpu_s, pacer_cpu_s;
+    double lat_mean, lat_p50, lat_p99;
+};
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static double cpu_seconds()
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void futex_wait_token(struct flow_info *f, uint64_t spin_ns, uint64_t *avg_wait)
+{
+    uint64_t start = now_ns(), budget, seq;
+
+    budget = *avg_wait <= spin_ns ? spin_ns : spin_ns / 16;
+    while (__atomic_load_n(&f->pending, __ATOMIC_ACQUIRE)) {
+        if (now_ns() - start > budget) {
+            __atomic_fetch_add(&f->sleeping, 1, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            while (1) {
+                seq = __atomic_load_n(&f->wake_seq, __ATOMIC_ACQUIRE);
+                if (!__atomic_load_n(&f->pending, __ATOMIC_ACQUIRE))
+                    break;
+                syscall(SYS_futex, &f->wake_seq, FUTEX_WAIT, (uint32_t)seq, NULL, NULL, 0);
+            }
+            __atomic_fetch_sub(&f->sleeping, 1, __ATOMIC_RELAXED);
+            break;
+        }
+        cpu_relax();
+    }
+    *avg_wait += ((int64_t)(now_ns() - start) - (int64_t)*avg_wait) / 8;
+}
+
+static void driver(struct bench_block *b, int mode, int sock, uint64_t spin_ns)
+{
+    uint64_t *lat = malloc(MAX_SAMPLES * sizeof(uint64_t));
+    uint64_t n = 0, avg_wait = 0, sum = 0, t;
+    char c;
+
+    if (!lat) {
+        perror("malloc");
+        exit(1);
+    }
+    __atomic_store_n(&b->flow.wait_mode, mode == MODE_FUTEX ? FLOW_WAIT_FUTEX : FLOW_WAIT_SPIN, __ATOMIC_RELAXED);
+    while (!b->stop) {
+        __atomic_store_n(&b->flow.pending, 1, __ATOMIC_RELEASE);
+        if (mode == MODE_SPIN) {
+            while (__atomic_load_n(&b->flow.pending, __ATOMIC_ACQUIRE))
+                cpu_relax();
+        } else if (mode == MODE_UDS) {
+            if (recv(sock, &c, 1, 0) != 1)
+                break;
+        } else {
+            futex_wait_token(&b->flow, spin_ns, &avg_wait);
+        }
+        if (b->stop)
+            break;
+        t = now_ns() - __atomic_load_n(&b->grant_ns, __ATOMIC_RELAXED);
+        if (n < MAX_SAMPLES)
+            lat[n++] = t;
+        sum += t;
+    }
+
+    b->driver_cpu_s = cpu_seconds();
+    b->tokens = n;
+    if (n) {
+        qsort(lat, n, sizeof(uint64_t), cmp_u64);
+        b->lat_mean = (double)sum / n;
+        b->lat_p50 = lat[n / 2];
+        b->lat_p99 = lat[n * 99 / 100];
+    }
+    _exit(0);
+}
+
+static void pacer(struct bench_block *b, int mode, int sock, uint64_t interval_ns, uint64_t end_ns)
+{
+    struct timespec next;
+
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    while (now_ns() < end_ns) {
+        next.tv_nsec += interval_ns;
+        while (next.tv_nsec >= 1000000000) {
+            next.tv_nsec -= 1000000000;
+            next.tv_sec++;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+        if (!__atomic_load_n(&b->flow.pending, __ATOMIC_ACQUIRE))
+            continue;       // driver has not asked again yet; token is dropped
+        __atomic_store_n(&b->grant_ns, now_ns(), __ATOMIC_RELAXED);
+        __atomic_store_n(&b->flow.pending, 0, __ATOMIC_RELEASE);
+        if (mode == MODE_UDS)
+            send(sock, "0", 1, 0);
+        else
+            flow_wake(&b->flow);
+    }
+
+    /* release the driver wherever it is waiting */
+    b->stop = 1;
+    __atomic_store_n(&b->flow.pending, 0, __ATOMIC_RELEASE);
+    flow_wake(&b->flow);
+    shutdown(sock, SHUT_RDWR);
+    b->pacer_cpu_s = cpu_seconds();
+    _exit(0);
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t interval_us = 167, spin_us = 20, ms = 1000, t0, wall;
+    struct bench_block *b;
+    int mode, c, sv[2];
+
+    while ((c = getopt(argc, argv, "i:t:s:")) != -1) {
+        switch (c) {
+        case 'i': interval_us = strtoull(optarg, NULL, 10); break;
+        case 't': ms = strtoull(optarg, NULL, 10); break;
+        case 's': spin_us = strtoull(optarg, NULL, 10); break;
+        default:
+            fprintf(stderr, "usage: %s [-i token_interval_us] [-t ms] [-s spin_us]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (!interval_us) {
+        fprintf(stderr, "token interval must be non-zero\n");
+        return 1;
+    }
+
+    b = mmap(NULL, sizeof(*b), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (b == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+
+    printf("token every %" PRIu64 " us (%.0f MBps with 1 MB chunks), %" PRIu64 " ms per mode, %ld online cpus\n",
+           interval_us, 1000000.0 / interval_us, ms, sysconf(_SC_NPROCESSORS_ONLN));
+    printf("mode\ttokens\tdriver_cpu%%\tpacer_cpu%%\tlat_mean(us)\tlat_p50(us)\tlat_p99(us)\n");
+    for (mode = 0; mode < NUM_MODES; mode++) {
+        memset(b, 0, sizeof(*b));
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+            perror("socketpair");
+            return 1;
+        }
+        t0 = now_ns();
+        if (fork() == 0)
+            driver(b, mode, sv[1], spin_us * 1000);
+        if (fork() == 0)
+            pacer(b, mode, sv[0], interval_us * 1000, t0 + ms * 1000000);
+        close(sv[0]);
+        close(sv[1]);
+        while (wait(NULL) > 0)
+            ;
+        wall = now_ns() - t0;
+
+        printf("%s\t%" PRIu64 "\t%.1f\t\t%.1f\t\t%.2f\t\t%.2f\t\t%.2f\n", mode_names[mode], b->tokens,
+               100 * b->driver_cpu_s / (wall / 1e9), 100 * b->pacer_cpu_s / (wall / 1e9),
+               b->lat_mean / 1000, b->lat_p50 / 1000, b->lat_p99 / 1000);
+    }
+    return 0;
+}
@@ -0,0 +1,313 @@
+// Per-chunk cost of writing split chunks into an mlx5 send queue, before and
+// after the WQE template (libmlx5-41mlnx1/src/split_wqe.h); wqe_bench does
+// the same for mlx4. Both sides cut the same single-SGE WRITE into chunks, a
+// postlist of `batch` chunks at a time, and write them into a fake SQ ring
+// in memory:
+//  - wr:   split_sgl_next() builds an ibv_send_wr per chunk, then the WQE is
+//          written the way mlx5_post_send_paced() does it for an RC QP
+//          (checks, post_send_one through a pointer, set_raddr_seg,
+//          set_data_non_inl_seg, set_ctrl_seg) -- copied from
+//          libmlx5-41mlnx1/src/qp.c;
+//  - tmpl: split_sgl_next_1() and split_wqe_emit(), as mlx5_post_chunks().
+// Doorbells are left out of both. The two rings (and wr_id and wqe_head
+// arrays) must come out byte-identical, which the bench checks before
+// timing.
+//
+// Usage: wqe5_bench [-s msg_bytes] [-c chunk_bytes] [-b batch] [-n iterations]
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#define htonll(x) __builtin_bswap64(x)
+#include "../libmlx5-41mlnx1/src/split_wqe.h"
+
+#define MLX5_FENCE_MODE_SMALL_AND_FENCE (4 << 5) /* wqe.h */
+#define SQ_CNT 8192                 /* basic blocks */
+#define QPN 0x1a2b3c
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cycles() __builtin_ia32_rdtsc()
+#else
+static uint64_t cycles()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+#endif
+
+struct fake_sq {
+    uint8_t *buf;
+    uint8_t *end;
+    uint64_t *wrid;
+    unsigned int *wqe_head;
+    unsigned int head;
+    unsigned int scur_post;
+    uint8_t fm_ce_se_tbl[8];
+    uint8_t fm_cache;
+    int max_gs;
+    int (*post_send_one)(struct ibv_send_wr *wr, struct fake_sq *q, uint64_t send_flags,
+                         void *seg, int *total_size);
+};
+
+static void *get_send_wqe(struct fake_sq *q, unsigned int n)
+{
+    return q->buf + (n * MLX5_SEND_WQE_BB);
+}
+
+//// qp.c, RC WRITE only (__mlx5_post_send_one_fast_rc_rwrite)
+static inline void set_raddr_seg(struct mlx5_wqe_raddr_seg *rseg, uint64_t remote_addr, uint32_t rkey)
+{
+    rseg->raddr = htonll(remote_addr);
+    rseg->rkey = htonl(rkey);
+    rseg->reserved = 0;
+}
+
+static inline void set_data_ptr_seg(struct mlx5_wqe_data_seg *dseg, struct ibv_sge *sg)
+{
+    dseg->byte_count = htonl(sg->length);
+    dseg->lkey = htonl(sg->lkey);
+    dseg->addr = htonll(sg->addr);
+}
+
+static inline int set_data_non_inl_seg(struct fake_sq *q, int num_sge, struct ibv_sge *sg_list,
+                                       void *wqe, int *sz)
+{
+    struct mlx5_wqe_data_seg *dpseg = wqe;
+    int i;
+
+    for (i = 0; i < num_sge; ++i) {
+        if (dpseg == (void *)q->end)
+            dpseg = get_send_wqe(q, 0);
+        if (sg_list[i].length) {
+            set_data_ptr_seg(dpseg, sg_list + i);
+            ++dpseg;
+            *sz += sizeof(struct mlx5_wqe_data_seg) / 16;
+        }
+    }
+    return 0;
+}
+
+static inline void set_ctrl_seg(uint32_t *start, uint8_t opcode, uint16_t idx, uint8_t size,
+                                uint8_t fm_ce_se)
+{
+    *start++ = htonl(idx << 8 | opcode);
+    *start++ = htonl(QPN << 8 | (size & 0x3F));
+    *start++ = htonl(fm_ce_se);
+    *start = 0;
+}
+
+static int post_send_rc(struct ibv_send_wr *wr, struct fake_sq *q, uint64_t send_flags,
+                        void *seg, int *total_size)
+{
+    void *ctrl = seg;
+    int size = sizeof(struct mlx5_wqe_ctrl_seg) / 16;
+    uint8_t fm_ce_se;
+
+    seg = (uint8_t *)seg + sizeof(struct mlx5_wqe_ctrl_seg);
+    set_raddr_seg(seg, wr->wr.rdma.remote_addr, wr->wr.rdma.rkey);
+    seg = (uint8_t *)seg + sizeof(struct mlx5_wqe_raddr_seg);
+    size += sizeof(struct mlx5_wqe_raddr_seg) / 16;
+    set_data_non_inl_seg(q, wr->num_sge, wr->sg_list, seg, &size);
+    fm_ce_se = q->fm_ce_se_tbl[send_flags & (IBV_SEND_SOLICITED | IBV_SEND_SIGNALED | IBV_SEND_FENCE)];
+    if (q->fm_cache)
+        fm_ce_se |= send_flags & IBV_SEND_FENCE ? MLX5_FENCE_MODE_SMALL_AND_FENCE : q->fm_cache;
+    set_ctrl_seg(ctrl, MLX5_OPCODE_RDMA_WRITE, q->scur_post, size, fm_ce_se);
+    q->fm_cache = 0;
+    *total_size = size;
+    return 0;
+}
+
+static int post_wr(struct fake_sq *q, struct ibv_send_wr *wr)
+{
+    unsigned int idx;
+    int nreq, size, ret;
+
+    for (nreq = 0; wr; ++nreq, wr = wr->next) {
+        if (wr->num_sge > q->max_gs)
+            return ENOMEM;
+        if (wr->opcode > IBV_WR_RDMA_READ)
+            return EINVAL;
+        idx = q->scur_post & (SQ_CNT - 1);
+        ret = q->post_send_one(wr, q, wr->send_flags, get_send_wqe(q, idx), &size);
+        if (ret)
+            return ret;
+        q->wrid[idx] = wr->wr_id;
+        q->wqe_head[idx] = q->head + nreq;
+        q->scur_post += (size * 16 + MLX5_SEND_WQE_BB - 1) / MLX5_SEND_WQE_BB;
+    }
+    q->head += nreq;
+    return 0;
+}
+////
+
+static void post_tmpl(struct fake_sq *q, const struct split_wqe_tmpl *t,
+                      const struct split_sgl_chunk *c, int n)
+{
+    unsigned int idx;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        idx = q->scur_post & (SQ_CNT - 1);
+        split_wqe_emit(get_send_wqe(q, idx), t, &c[i], q->scur_post, 0);
+        q->wrid[idx] = c[i].wr_id;
+        q->wqe_head[idx] = q->head + i;
+        q->scur_post++;
+    }
+    q->head += n;
+}
+
+// cut wr as post_chunks() does (the last piece stays in the ring too);
+// returns the chunks written
+static int split_wr(struct fake_sq *q, struct ibv_send_wr *wr, uint32_t chunk, int batch)
+{
+    struct ibv_send_wr swr[SPLIT_SGL_MAX_BATCH];
+    struct ibv_sge sge[SPLIT_SGL_MAX_BATCH][SPLIT_SGL_MAX_SGE];
+    struct split_sgl it;
+    int n, total = 0;
+
+    split_sgl_init(&it, wr);
+    while (split_sgl_left(&it)) {
+        for (n = 0; n < batch && split_sgl_left(&it); n++) {
+            split_sgl_next(&it, chunk, SPLIT_SGL_MAX_SGE, &swr[n], sge[n]);
+            swr[n].wr_id = n + 1;
+            if (n + 1 == batch || !split_sgl_left(&it))
+                swr[n].send_flags |= IBV_SEND_SIGNALED;
+            else
+                swr[n].send_flags &= ~IBV_SEND_SIGNALED;
+            if (n)
+                swr[n - 1].next = &swr[n];
+        }
+        if (post_wr(q, swr)) {
+            printf("post_wr failed\n");
+            exit(1);
+        }
+        total += n;
+    }
+    return total;
+}
+
+static int split_tmpl(struct fake_sq *q, struct ibv_send_wr *wr, uint32_t chunk, int batch)
+{
+    struct split_sgl_chunk ch[SPLIT_SGL_MAX_BATCH];
+    struct split_wqe_tmpl t;
+    struct split_sgl it;
+    int n, total = 0;
+
+    // mlx5_split_tmpl_init()
+    t.opcode = MLX5_OPCODE_RDMA_WRITE;
+    t.fm_ce_se[0] = q->fm_ce_se_tbl[0];
+    t.fm_ce_se[1] = q->fm_ce_se_tbl[IBV_SEND_SIGNALED];
+    t.fence = 0;
+    t.qpn_ds = htonl(QPN << 8 | SPLIT_WQE_DS);
+    t.rkey = htonl(wr->wr.rdma.rkey);
+    t.lkey = htonl(wr->sg_list->lkey);
+    split_sgl_init(&it, wr);
+    while (split_sgl_left(&it)) {
+        for (n = 0; n < batch && split_sgl_left(&it); n++) {
+            split_sgl_next_1(&it, chunk, &ch[n]);
+            ch[n].wr_id = n + 1;
+            ch[n].signaled = n + 1 == batch || !split_sgl_left(&it);
+        }
+        post_tmpl(q, &t, ch, n);
+        total += n;
+    }
+    return total;
+}
+
+static void sq_init(struct fake_sq *q)
+{
+    int i;
+
+    q->buf = aligned_alloc(4096, SQ_CNT * MLX5_SEND_WQE_BB);
+    q->wrid = calloc(SQ_CNT, sizeof(*q->wrid));
+    q->wqe_head = calloc(SQ_CNT, sizeof(*q->wqe_head));
+    if (!q->buf || !q->wrid || !q->wqe_head) {
+        perror("alloc");
+        exit(1);
+    }
+    memset(q->buf, 0, SQ_CNT * MLX5_SEND_WQE_BB);
+    q->end = q->buf + SQ_CNT * MLX5_SEND_WQE_BB;
+    q->head = 0;
+    q->scur_post = 0;
+    // mlx5_build_ctrl_seg_data(): fence, CQ update and solicited bits per send flag
+    for (i = 0; i < 8; i++)
+        q->fm_ce_se_tbl[i] = (i & IBV_SEND_FENCE ? MLX5_WQE_CTRL_FENCE : 0) |
+                             (i & IBV_SEND_SIGNALED ? MLX5_WQE_CTRL_CQ_UPDATE : 0) |
+                             (i & IBV_SEND_SOLICITED ? MLX5_WQE_CTRL_SOLICITED : 0);
+    q->fm_cache = 0;
+    q->max_gs = 2;
+    q->post_send_one = post_send_rc;
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t msg = 1 << 20, t0, c_wr, c_tmpl;
+    uint32_t chunk = 5000;
+    int batch = 13, iters = 2000, op, i, n = 0;
+    struct fake_sq a, b;
+    struct ibv_send_wr wr;
+    struct ibv_sge sge;
+
+    while ((op = getopt(argc, argv, "s:c:b:n:")) != -1) {
+        switch (op) {
+        case 's': msg = strtoull(optarg, NULL, 0); break;
+        case 'c': chunk = atoi(optarg); break;
+        case 'b': batch = atoi(optarg); break;
+        case 'n': iters = atoi(optarg); break;
+        default:
+            printf("usage: %s [-s msg_bytes] [-c chunk_bytes] [-b batch] [-n iterations]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (!chunk || batch < 1 || batch > SPLIT_SGL_MAX_BATCH || iters < 1) {
+        printf("bad arguments\n");
+        exit(1);
+    }
+
+    memset(&wr, 0, sizeof(wr));
+    sge.addr = 0x7f0000001000ull;
+    sge.length = msg;
+    sge.lkey = 0x1234;
+    wr.opcode = IBV_WR_RDMA_WRITE;
+    wr.sg_list = &sge;
+    wr.num_sge = 1;
+    wr.wr.rdma.remote_addr = 0x5a0000000000ull;
+    wr.wr.rdma.rkey = 0x4321;
+
+    sq_init(&a);
+    sq_init(&b);
+    // a few messages to wrap the ring at least once, then compare
+    for (i = 0; i < 3 || a.scur_post < 2 * SQ_CNT; i++) {
+        n = split_wr(&a, &wr, chunk, batch);
+        split_tmpl(&b, &wr, chunk, batch);
+    }
+    if (a.head != b.head || a.scur_post != b.scur_post ||
+        memcmp(a.buf, b.buf, SQ_CNT * MLX5_SEND_WQE_BB) ||
+        memcmp(a.wrid, b.wrid, SQ_CNT * sizeof(*a.wrid)) ||
+        memcmp(a.wqe_head, b.wqe_head, SQ_CNT * sizeof(*a.wqe_head))) {
+        printf("FAIL: template and WR paths wrote different WQEs\n");
+        exit(1);
+    }
+
+    t0 = cycles();
+    for (i = 0; i < iters; i++)
+        split_wr(&a, &wr, chunk, batch);
+    c_wr = cycles() - t0;
+    t0 = cycles();
+    for (i = 0; i < iters; i++)
+        split_tmpl(&b, &wr, chunk, batch);
+    c_tmpl = cycles() - t0;
+
+    printf("%lu-byte WRITE, %u-byte chunks, %d per postlist: %d chunks per message, rings identical\n",
+           msg, chunk, batch, n);
+    printf("  wr   %8.1f cycles/chunk\n", (double)c_wr / iters / n);
+    printf("  tmpl %8.1f cycles/chunk (%.2fx)\n", (double)c_tmpl / iters / n,
+           (double)c_wr / c_tmpl);
+    return 0;
+}
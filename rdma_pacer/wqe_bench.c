@@ -0,0 +1,312 @@
+// Per-chunk cost of writing split chunks into an mlx4 send queue, before and
+// after the WQE template (libmlx4/src/split_wqe.h). Both sides cut the same
+// single-SGE WRITE into chunks, a postlist of `batch` chunks at a time, and
+// write them into a fake SQ ring in memory:
+//  - wr:   split_sgl_next() builds an ibv_send_wr per chunk, then the WQE is
+//          written the way __mlx4_post_send() does it for an RC QP (checks,
+//          post_send_one through a pointer, set_raddr_seg, set_ptr_data,
+//          set_ctrl_seg, stamping) -- copied from libmlx4/src/qp.c;
+//  - tmpl: split_sgl_next_1() and split_wqe_emit(), as mlx4_post_chunks().
+// Doorbells are left out of both. The two rings (and wr_id arrays) must come
+// out byte-identical, which the bench checks before timing. The layout is the
+// default one, without MLX4_WQE_FORMAT.
+//
+// Usage: wqe_bench [-s msg_bytes] [-c chunk_bytes] [-b batch] [-n iterations]
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#define wmb() __asm__ __volatile__("" ::: "memory")
+#define htonll(x) __builtin_bswap64(x)
+#include "../libmlx4/src/split_wqe.h"
+
+#define MLX4_OPCODE_RDMA_WRITE 0x08 /* mlx4.h */
+#define WQE_CTRL_OWN (1 << 31)
+#define SQ_SHIFT 6                  /* 64-byte WQEs, a QP with max_send_sge 2 */
+#define SQ_CNT 8192
+#define SPARE 16
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cycles() __builtin_ia32_rdtsc()
+#else
+static uint64_t cycles()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+#endif
+
+struct fake_sq {
+    uint8_t *buf;
+    uint64_t *wrid;
+    unsigned int head;
+    uint8_t srcrb_flags_tbl[4];
+    int max_gs;
+    int (*post_send_one)(struct ibv_send_wr *wr, struct fake_sq *q, void *wqe, int *size,
+                         int *inl, unsigned int ind);
+};
+
+static void *get_send_wqe(struct fake_sq *q, unsigned int n)
+{
+    return q->buf + (n << SQ_SHIFT);
+}
+
+static void stamp_send_wqe(struct fake_sq *q, unsigned int n)
+{
+    uint32_t *wqe = get_send_wqe(q, n);
+    int i;
+    int ds = (((struct mlx4_wqe_ctrl_seg *)wqe)->fence_size & 0x3f) << 2;
+
+    for (i = 16; i < ds; i += 16)
+        wqe[i] = 0xffffffff;
+}
+
+//// qp.c, RC WRITE only
+static inline void set_raddr_seg(struct mlx4_wqe_raddr_seg *rseg, uint64_t remote_addr, uint32_t rkey)
+{
+    rseg->raddr = htonll(remote_addr);
+    rseg->rkey = htonl(rkey);
+    rseg->reserved = 0;
+}
+
+static inline void set_ptr_data(struct mlx4_wqe_data_seg *dseg, struct ibv_sge *sg)
+{
+    dseg->lkey = htonl(sg->lkey);
+    dseg->addr = htonll(sg->addr);
+    wmb();
+    if (sg->length)
+        dseg->byte_count = htonl(sg->length);
+    else
+        dseg->byte_count = htonl(0x80000000);
+}
+
+static void set_ctrl_seg(struct mlx4_wqe_ctrl_seg *ctrl, struct ibv_send_wr *wr, uint32_t imm,
+                         uint32_t srcrb_flags, unsigned int owner_bit, int size, uint32_t wr_op)
+{
+    ctrl->srcrb_flags = srcrb_flags;
+    ctrl->imm = imm;
+    ctrl->fence_size = (wr->send_flags & IBV_SEND_FENCE ? MLX4_WQE_CTRL_FENCE : 0) | size;
+    wmb();
+    ctrl->owner_opcode = htonl(wr_op) | owner_bit;
+}
+
+static int post_send_rc(struct ibv_send_wr *wr, struct fake_sq *q, void *wqe_add, int *total_size,
+                        int *inl, unsigned int ind)
+{
+    void *ctrl = wqe_add;
+    void *wqe = (uint8_t *)wqe_add + sizeof(struct mlx4_wqe_ctrl_seg);
+    unsigned int owner_bit = (ind & SQ_CNT) ? htonl(WQE_CTRL_OWN) : 0;
+    int size = sizeof(struct mlx4_wqe_ctrl_seg) / 16;
+    int idx = (wr->send_flags & IBV_SEND_SIGNALED) / IBV_SEND_SIGNALED |
+              (wr->send_flags & IBV_SEND_SOLICITED) / (IBV_SEND_SOLICITED >> 1);
+    uint32_t srcrb_flags = htonl((uint32_t)q->srcrb_flags_tbl[idx]);
+    struct mlx4_wqe_data_seg *seg;
+    int i;
+
+    if (wr->opcode == IBV_WR_RDMA_READ)
+        *inl = 1;
+    set_raddr_seg(wqe, wr->wr.rdma.remote_addr, wr->wr.rdma.rkey);
+    wqe = (uint8_t *)wqe + sizeof(struct mlx4_wqe_raddr_seg);
+    size += sizeof(struct mlx4_wqe_raddr_seg) / 16;
+    seg = wqe;
+    if (wr->num_sge == 1) {
+        set_ptr_data(seg, wr->sg_list);
+        size += sizeof(*seg) / 16;
+    } else {
+        for (i = wr->num_sge - 1; i >= 0; --i)
+            set_ptr_data(seg + i, wr->sg_list + i);
+        size += wr->num_sge * (sizeof(*seg) / 16);
+    }
+    *total_size = size;
+    set_ctrl_seg(ctrl, wr, 0, srcrb_flags, owner_bit, size, MLX4_OPCODE_RDMA_WRITE);
+    return 0;
+}
+
+static int post_wr(struct fake_sq *q, struct ibv_send_wr *wr)
+{
+    void *ctrl;
+    unsigned int ind = q->head;
+    int size, inl = 0, ret;
+
+    for (; wr; wr = wr->next, ++ind) {
+        if (wr->num_sge > q->max_gs)
+            return ENOMEM;
+        if (wr->opcode > IBV_WR_RDMA_READ)
+            return EINVAL;
+        ctrl = get_send_wqe(q, ind & (SQ_CNT - 1));
+        q->wrid[ind & (SQ_CNT - 1)] = wr->wr_id;
+        ret = q->post_send_one(wr, q, ctrl, &size, &inl, ind);
+        if (ret)
+            return ret;
+        if (wr->next)
+            stamp_send_wqe(q, (ind + SPARE) & (SQ_CNT - 1));
+    }
+    stamp_send_wqe(q, (ind + SPARE - 1) & (SQ_CNT - 1));
+    q->head = ind;
+    return 0;
+}
+////
+
+static void post_tmpl(struct fake_sq *q, const struct split_wqe_tmpl *t,
+                      const struct split_sgl_chunk *c, int n)
+{
+    unsigned int ind = q->head;
+    int i;
+
+    for (i = 0; i < n; i++, ind++) {
+        q->wrid[ind & (SQ_CNT - 1)] = c[i].wr_id;
+        split_wqe_emit(get_send_wqe(q, ind & (SQ_CNT - 1)), t, &c[i],
+                       (ind & SQ_CNT) ? htonl(WQE_CTRL_OWN) : 0, 0);
+        if (i + 1 < n)
+            stamp_send_wqe(q, (ind + SPARE) & (SQ_CNT - 1));
+    }
+    stamp_send_wqe(q, (ind + SPARE - 1) & (SQ_CNT - 1));
+    q->head = ind;
+}
+
+// cut wr as post_chunks() does (the last piece stays in the ring too);
+// returns the chunks written
+static int split_wr(struct fake_sq *q, struct ibv_send_wr *wr, uint32_t chunk, int batch)
+{
+    struct ibv_send_wr swr[SPLIT_SGL_MAX_BATCH];
+    struct ibv_sge sge[SPLIT_SGL_MAX_BATCH][SPLIT_SGL_MAX_SGE];
+    struct split_sgl it;
+    int n, total = 0;
+
+    split_sgl_init(&it, wr);
+    while (split_sgl_left(&it)) {
+        for (n = 0; n < batch && split_sgl_left(&it); n++) {
+            split_sgl_next(&it, chunk, SPLIT_SGL_MAX_SGE, &swr[n], sge[n]);
+            swr[n].wr_id = n + 1;
+            if (n + 1 == batch || !split_sgl_left(&it))
+                swr[n].send_flags |= IBV_SEND_SIGNALED;
+            else
+                swr[n].send_flags &= ~IBV_SEND_SIGNALED;
+            if (n)
+                swr[n - 1].next = &swr[n];
+        }
+        if (post_wr(q, swr)) {
+            printf("post_wr failed\n");
+            exit(1);
+        }
+        total += n;
+    }
+    return total;
+}
+
+static int split_tmpl(struct fake_sq *q, struct ibv_send_wr *wr, uint32_t chunk, int batch)
+{
+    struct split_sgl_chunk ch[SPLIT_SGL_MAX_BATCH];
+    struct split_wqe_tmpl t;
+    struct split_sgl it;
+    int n, total = 0;
+
+    // mlx4_split_tmpl_init()
+    t.owner_opcode = htonl(MLX4_OPCODE_RDMA_WRITE);
+    t.srcrb_flags[0] = htonl((uint32_t)q->srcrb_flags_tbl[0]);
+    t.srcrb_flags[1] = htonl((uint32_t)q->srcrb_flags_tbl[1]);
+    t.rkey = htonl(wr->wr.rdma.rkey);
+    t.lkey = htonl(wr->sg_list->lkey);
+    t.fence_size = SPLIT_WQE_DS;
+    t.inl = 0;
+    split_sgl_init(&it, wr);
+    while (split_sgl_left(&it)) {
+        for (n = 0; n < batch && split_sgl_left(&it); n++) {
+            split_sgl_next_1(&it, chunk, &ch[n]);
+            ch[n].wr_id = n + 1;
+            ch[n].signaled = n + 1 == batch || !split_sgl_left(&it);
+        }
+        post_tmpl(q, &t, ch, n);
+        total += n;
+    }
+    return total;
+}
+
+static void sq_init(struct fake_sq *q)
+{
+    q->buf = aligned_alloc(4096, SQ_CNT << SQ_SHIFT);
+    q->wrid = calloc(SQ_CNT, sizeof(*q->wrid));
+    if (!q->buf || !q->wrid) {
+        perror("alloc");
+        exit(1);
+    }
+    memset(q->buf, 0, SQ_CNT << SQ_SHIFT);
+    q->head = 0;
+    q->srcrb_flags_tbl[0] = 0;
+    q->srcrb_flags_tbl[1] = MLX4_WQE_CTRL_CQ_UPDATE;
+    q->srcrb_flags_tbl[2] = MLX4_WQE_CTRL_SOLICIT;
+    q->srcrb_flags_tbl[3] = MLX4_WQE_CTRL_CQ_UPDATE | MLX4_WQE_CTRL_SOLICIT;
+    q->max_gs = 2;
+    q->post_send_one = post_send_rc;
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t msg = 1 << 20, t0, c_wr, c_tmpl;
+    uint32_t chunk = 5000;
+    int batch = 13, iters = 2000, op, i, n = 0;
+    struct fake_sq a, b;
+    struct ibv_send_wr wr;
+    struct ibv_sge sge;
+
+    while ((op = getopt(argc, argv, "s:c:b:n:")) != -1) {
+        switch (op) {
+        case 's': msg = strtoull(optarg, NULL, 0); break;
+        case 'c': chunk = atoi(optarg); break;
+        case 'b': batch = atoi(optarg); break;
+        case 'n': iters = atoi(optarg); break;
+        default:
+            printf("usage: %s [-s msg_bytes] [-c chunk_bytes] [-b batch] [-n iterations]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (!chunk || batch < 1 || batch > SPLIT_SGL_MAX_BATCH || iters < 1) {
+        printf("bad arguments\n");
+        exit(1);
+    }
+
+    memset(&wr, 0, sizeof(wr));
+    sge.addr = 0x7f0000001000ull;
+    sge.length = msg;
+    sge.lkey = 0x1234;
+    wr.opcode = IBV_WR_RDMA_WRITE;
+    wr.sg_list = &sge;
+    wr.num_sge = 1;
+    wr.wr.rdma.remote_addr = 0x5a0000000000ull;
+    wr.wr.rdma.rkey = 0x4321;
+
+    sq_init(&a);
+    sq_init(&b);
+    // a few messages to wrap the ring at least once, then compare
+    for (i = 0; i < 3 || a.head < 2 * SQ_CNT; i++) {
+        n = split_wr(&a, &wr, chunk, batch);
+        split_tmpl(&b, &wr, chunk, batch);
+    }
+    if (a.head != b.head || memcmp(a.buf, b.buf, SQ_CNT << SQ_SHIFT) ||
+        memcmp(a.wrid, b.wrid, SQ_CNT * sizeof(*a.wrid))) {
+        printf("FAIL: template and WR paths wrote different WQEs\n");
+        exit(1);
+    }
+
+    t0 = cycles();
+    for (i = 0; i < iters; i++)
+        split_wr(&a, &wr, chunk, batch);
+    c_wr = cycles() - t0;
+    t0 = cycles();
+    for (i = 0; i < iters; i++)
+        split_tmpl(&b, &wr, chunk, batch);
+    c_tmpl = cycles() - t0;
+
+    printf("%lu-byte WRITE, %u-byte chunks, %d per postlist: %d chunks per message, rings identical\n",
+           msg, chunk, batch, n);
+    printf("  wr   %8.1f cycles/chunk\n", (double)c_wr / iters / n);
+    printf("  tmpl %8.1f cycles/chunk (%.2fx)\n", (double)c_tmpl / iters / n,
+           (double)c_wr / c_tmpl);
+    return 0;
+}